@@ -29,11 +29,11 @@
 #include "modesetting.h"
 #include "notifier_listener.h"
 #include "pixel_format.h"
+#include "platform_view_table.h"
 #include "render_surface.h"
 #include "surface.h"
 #include "tracer.h"
 #include "util/collection.h"
-#include "util/dynarray.h"
 #include "util/logging.h"
 #include "util/refcounting.h"
 #include "window.h"
@@ -70,17 +70,128 @@
  *  - refcounted
  */
 
-struct fl_layer_composition *fl_layer_composition_new(size_t n_layers) {
+/// How many destroyed compositions a pool keeps around for reuse.
+#define FL_LAYER_COMPOSITION_POOL_SIZE 4
+
+/// Pooled compositions have room for at least this many layers, so they can still be
+/// reused if the number of layers changes a bit.
+#define FL_LAYER_COMPOSITION_MIN_CAPACITY 8
+
+struct fl_layer_composition_pool {
+    refcount_t n_refs;
+    pthread_mutex_t lock;
+
+    size_t n_free;
+    struct fl_layer_composition *free[FL_LAYER_COMPOSITION_POOL_SIZE];
+};
+
+static struct fl_layer_composition *alloc_composition(size_t layers_capacity) {
     struct fl_layer_composition *composition;
     struct fl_layer *layers;
 
-    composition = malloc((sizeof *composition) + (n_layers * sizeof *layers));
+    composition = malloc((sizeof *composition) + (layers_capacity * sizeof *layers));
+    if (composition == NULL) {
+        return NULL;
+    }
+
+    composition->layers_capacity = layers_capacity;
+    composition->clip_rect_storage = NULL;
+    composition->clip_rect_capacity = 0;
+    return composition;
+}
+
+static void free_composition(struct fl_layer_composition *composition) {
+    free(composition->clip_rect_storage);
+    free(composition);
+}
+
+struct fl_layer_composition *fl_layer_composition_new(size_t n_layers) {
+    struct fl_layer_composition *composition;
+
+    composition = alloc_composition(n_layers);
     if (composition == NULL) {
         return NULL;
     }
 
     composition->n_refs = REFCOUNT_INIT_1;
     composition->n_layers = n_layers;
+    composition->pool = NULL;
+    return composition;
+}
+
+struct clip_rect *fl_layer_composition_reserve_clip_rects(struct fl_layer_composition *composition, size_t n_clip_rects) {
+    struct clip_rect *storage;
+
+    ASSERT_NOT_NULL(composition);
+
+    if (n_clip_rects <= composition->clip_rect_capacity) {
+        return composition->clip_rect_storage;
+    }
+
+    storage = realloc(composition->clip_rect_storage, n_clip_rects * sizeof *storage);
+    if (storage == NULL) {
+        return NULL;
+    }
+
+    composition->clip_rect_storage = storage;
+    composition->clip_rect_capacity = n_clip_rects;
+    return storage;
+}
+
+struct fl_layer_composition_pool *fl_layer_composition_pool_new(void) {
+    struct fl_layer_composition_pool *pool;
+
+    pool = malloc(sizeof *pool);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->n_refs = REFCOUNT_INIT_1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->n_free = 0;
+    return pool;
+}
+
+void fl_layer_composition_pool_destroy(struct fl_layer_composition_pool *pool) {
+    ASSERT_NOT_NULL(pool);
+
+    for (size_t i = 0; i < pool->n_free; i++) {
+        free_composition(pool->free[i]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+DEFINE_REF_OPS(fl_layer_composition_pool, n_refs)
+
+struct fl_layer_composition *fl_layer_composition_pool_get(struct fl_layer_composition_pool *pool, size_t n_layers) {
+    struct fl_layer_composition *composition;
+
+    ASSERT_NOT_NULL(pool);
+
+    composition = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->n_free; i++) {
+        if (pool->free[i]->layers_capacity >= n_layers) {
+            composition = pool->free[i];
+            pool->free[i] = pool->free[--pool->n_free];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (composition == NULL) {
+        composition = alloc_composition(MAX2(n_layers, FL_LAYER_COMPOSITION_MIN_CAPACITY));
+        if (composition == NULL) {
+            return NULL;
+        }
+    }
+
+    composition->n_refs = REFCOUNT_INIT_1;
+    composition->n_layers = n_layers;
+    composition->pool = fl_layer_composition_pool_ref(pool);
     return composition;
 }
 
@@ -96,17 +207,203 @@ struct fl_layer *fl_layer_composition_peek_layer(struct fl_layer_composition *co
     return composition->layers + layer;
 }
 
+static bool quad_equals(const struct quad *a, const struct quad *b) {
+    return vec2f_equals(a->top_left, b->top_left) && vec2f_equals(a->top_right, b->top_right) &&
+           vec2f_equals(a->bottom_left, b->bottom_left) && vec2f_equals(a->bottom_right, b->bottom_right);
+}
+
+static bool aa_rect_equals(const struct aa_rect *a, const struct aa_rect *b) {
+    return vec2f_equals(a->offset, b->offset) && vec2f_equals(a->size, b->size);
+}
+
+static bool clip_rect_equals(const struct clip_rect *a, const struct clip_rect *b) {
+    if (!quad_equals(&a->rect, &b->rect) || a->is_aa != b->is_aa || a->is_rounded != b->is_rounded) {
+        return false;
+    }
+
+    if (a->is_aa && !aa_rect_equals(&a->aa_rect, &b->aa_rect)) {
+        return false;
+    }
+
+    if (a->is_rounded) {
+        return aa_rect_equals(&a->local_rect, &b->local_rect) &&
+               vec2f_equals(a->upper_left_corner_radius, b->upper_left_corner_radius) &&
+               vec2f_equals(a->upper_right_corner_radius, b->upper_right_corner_radius) &&
+               vec2f_equals(a->lower_right_corner_radius, b->lower_right_corner_radius) &&
+               vec2f_equals(a->lower_left_corner_radius, b->lower_left_corner_radius);
+    }
+
+    return true;
+}
+
+bool fl_layer_props_equals(const struct fl_layer_props *a, const struct fl_layer_props *b) {
+    if (a->is_aa_rect != b->is_aa_rect || !quad_equals(&a->quad, &b->quad) || a->opacity != b->opacity ||
+        a->rotation != b->rotation || a->n_clip_rects != b->n_clip_rects) {
+        return false;
+    }
+
+    if (a->is_aa_rect && !aa_rect_equals(&a->aa_rect, &b->aa_rect)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->n_clip_rects; i++) {
+        if (!clip_rect_equals(a->clip_rects + i, b->clip_rects + i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool fl_layer_props_needs_gpu_composition(const struct fl_layer_props *props) {
+    ASSERT_NOT_NULL(props);
+
+    if (!props->is_aa_rect || props->opacity < 1.0) {
+        return true;
+    }
+
+    for (size_t i = 0; i < props->n_clip_rects; i++) {
+        if (!props->clip_rects[i].is_aa || props->clip_rects[i].is_rounded) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool fl_layer_props_get_scanout_rects(
+    const struct fl_layer_props *props,
+    struct vec2f buffer_size,
+    struct aa_rect *src_out,
+    struct aa_rect *dst_out
+) {
+    struct aa_rect dst, visible;
+
+    ASSERT_NOT_NULL(props);
+    ASSERT_NOT_NULL(src_out);
+    ASSERT_NOT_NULL(dst_out);
+
+    dst = props->is_aa_rect ? props->aa_rect : quad_get_aa_bounding_rect(props->quad);
+    if (aa_rect_is_empty(dst)) {
+        return false;
+    }
+
+    // Rounded or rotated clips can't be done on a plane, but their bounding box is
+    // still a good approximation.
+    visible = dst;
+    for (size_t i = 0; i < props->n_clip_rects; i++) {
+        visible = aa_rect_intersection(visible, props->clip_rects[i].aa_rect);
+    }
+
+    if (aa_rect_is_empty(visible)) {
+        return false;
+    }
+
+    // Crop the source by the same fraction as the destination.
+    *src_out = AA_RECT_FROM_COORDS(
+        (visible.offset.x - dst.offset.x) / dst.size.x * buffer_size.x,
+        (visible.offset.y - dst.offset.y) / dst.size.y * buffer_size.y,
+        visible.size.x / dst.size.x * buffer_size.x,
+        visible.size.y / dst.size.y * buffer_size.y
+    );
+    *dst_out = visible;
+    return true;
+}
+
+static struct drm_mode_rect aa_rect_to_damage_clip(struct aa_rect rect) {
+    // Round outwards, damage can only get bigger.
+    return (struct drm_mode_rect){
+        .x1 = (int32_t) floor(rect.offset.x),
+        .y1 = (int32_t) floor(rect.offset.y),
+        .x2 = (int32_t) ceil(rect.offset.x + rect.size.x),
+        .y2 = (int32_t) ceil(rect.offset.y + rect.size.y),
+    };
+}
+
+bool fl_layer_props_get_damage_clips(const struct fl_layer_props *props, struct drm_mode_rect *clips_out, size_t *n_clips_out) {
+    ASSERT_NOT_NULL(props);
+    ASSERT_NOT_NULL(clips_out);
+    ASSERT_NOT_NULL(n_clips_out);
+
+    if (!props->has_damage) {
+        *n_clips_out = 0;
+        return false;
+    }
+
+    if (props->n_damage_rects > KMS_MAX_DAMAGE_CLIPS) {
+        struct aa_rect bounds = props->damage_rects[0];
+
+        for (size_t i = 1; i < props->n_damage_rects; i++) {
+            bounds = aa_rect_union(bounds, props->damage_rects[i]);
+        }
+
+        clips_out[0] = aa_rect_to_damage_clip(bounds);
+        *n_clips_out = 1;
+        return true;
+    }
+
+    for (size_t i = 0; i < props->n_damage_rects; i++) {
+        clips_out[i] = aa_rect_to_damage_clip(props->damage_rects[i]);
+    }
+    *n_clips_out = props->n_damage_rects;
+    return true;
+}
+
+bool fl_layer_composition_equals(struct fl_layer_composition *a, struct fl_layer_composition *b) {
+    ASSERT_NOT_NULL(a);
+    ASSERT_NOT_NULL(b);
+
+    if (a == b) {
+        return true;
+    }
+
+    if (a->n_layers != b->n_layers) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->n_layers; i++) {
+        const struct fl_layer *layer_a = a->layers + i, *layer_b = b->layers + i;
+
+        if (layer_a->surface != layer_b->surface || layer_a->surface_revision != layer_b->surface_revision) {
+            return false;
+        }
+
+        if (!fl_layer_props_equals(&layer_a->props, &layer_b->props)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void fl_layer_composition_destroy(struct fl_layer_composition *composition) {
+    struct fl_layer_composition_pool *pool;
+
     ASSERT_NOT_NULL(composition);
 
+    // The clip rects of the layers point into the clip rect storage of the composition.
     for (int i = 0; i < composition->n_layers; i++) {
         surface_unref(composition->layers[i].surface);
-        if (composition->layers[i].props.clip_rects != NULL) {
-            free(composition->layers[i].props.clip_rects);
-        }
     }
 
-    free(composition);
+    pool = composition->pool;
+    if (pool == NULL) {
+        free_composition(composition);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free < FL_LAYER_COMPOSITION_POOL_SIZE) {
+        pool->free[pool->n_free++] = composition;
+        composition = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (composition != NULL) {
+        free_composition(composition);
+    }
+
+    fl_layer_composition_pool_unref(pool);
 }
 
 DEFINE_REF_OPS(fl_layer_composition, n_refs)
@@ -124,18 +421,14 @@ struct compositor {
 
     struct tracer *tracer;
     struct window *main_window;
-    struct util_dynarray views;
+    struct platform_view_table *views;
+    struct fl_layer_composition_pool *composition_pool;
 
     FlutterCompositor flutter_compositor;
 
     struct vec2f cursor_pos;
 };
 
-struct platform_view_with_id {
-    int64_t id;
-    struct surface *surface;
-};
-
 static bool on_flutter_present_layers(const FlutterLayer **layers, size_t layers_count, void *userdata);
 
 static bool
@@ -157,7 +450,15 @@ MUST_CHECK struct compositor *compositor_new(struct tracer *tracer, struct windo
         goto fail_free_compositor;
     }
 
-    util_dynarray_init(&compositor->views);
+    compositor->views = platform_view_table_new();
+    if (compositor->views == NULL) {
+        goto fail_destroy_mutex;
+    }
+
+    compositor->composition_pool = fl_layer_composition_pool_new();
+    if (compositor->composition_pool == NULL) {
+        goto fail_destroy_views;
+    }
 
     compositor->n_refs = REFCOUNT_INIT_1;
     compositor->main_window = window_ref(main_window);
@@ -177,6 +478,12 @@ MUST_CHECK struct compositor *compositor_new(struct tracer *tracer, struct windo
     compositor->cursor_pos = VEC2F(0, 0);
     return compositor;
 
+fail_destroy_views:
+    platform_view_table_destroy(compositor->views);
+
+fail_destroy_mutex:
+    pthread_mutex_destroy(&compositor->mutex);
+
 fail_free_compositor:
     free(compositor);
 
@@ -185,10 +492,8 @@ fail_return_null:
 }
 
 void compositor_destroy(struct compositor *compositor) {
-    util_dynarray_foreach(&compositor->views, struct platform_view_with_id, view) {
-        surface_unref(view->surface);
-    }
-    util_dynarray_fini(&compositor->views);
+    platform_view_table_destroy(compositor->views);
+    fl_layer_composition_pool_unref(compositor->composition_pool);
     tracer_unref(compositor->tracer);
     window_unref(compositor->main_window);
     pthread_mutex_destroy(&compositor->mutex);
@@ -223,12 +528,46 @@ static int compositor_push_composition(struct compositor *compositor, struct fl_
     return ok;
 }
 
+static void fill_clip_rect(struct clip_rect *clip_out, struct mat3f transform, const FlutterRect *rect, const FlutterRoundedRect *rounded) {
+    struct aa_rect local = AA_RECT_FROM_COORDS(rect->left, rect->top, rect->right - rect->left, rect->bottom - rect->top);
+
+    clip_out->rect = transform_aa_rect(transform, local);
+    clip_out->is_aa = quad_is_axis_aligned(clip_out->rect);
+    clip_out->aa_rect = quad_get_aa_bounding_rect(clip_out->rect);
+    clip_out->local_rect = local;
+    if (!invert_mat3f(transform, &clip_out->layer_to_local)) {
+        // The clip (and the platform view along with it) was scaled to nothing.
+        clip_out->layer_to_local = MAT3F_IDENTITY;
+        clip_out->local_rect = AA_RECT_FROM_COORDS(0, 0, 0, 0);
+    }
+
+    clip_out->is_rounded = rounded != NULL;
+    if (rounded != NULL) {
+        clip_out->upper_left_corner_radius = VEC2F(rounded->upper_left_corner_radius.width, rounded->upper_left_corner_radius.height);
+        clip_out->upper_right_corner_radius = VEC2F(rounded->upper_right_corner_radius.width, rounded->upper_right_corner_radius.height);
+        clip_out->lower_right_corner_radius = VEC2F(rounded->lower_right_corner_radius.width, rounded->lower_right_corner_radius.height);
+        clip_out->lower_left_corner_radius = VEC2F(rounded->lower_left_corner_radius.width, rounded->lower_left_corner_radius.height);
+    } else {
+        clip_out->upper_left_corner_radius = VEC2F(0, 0);
+        clip_out->upper_right_corner_radius = VEC2F(0, 0);
+        clip_out->lower_right_corner_radius = VEC2F(0, 0);
+        clip_out->lower_left_corner_radius = VEC2F(0, 0);
+    }
+}
+
+/**
+ * @brief Fills @a props_out for a platform view layer.
+ *
+ * @a clip_rect_storage needs to have room for @a n_mutations clip rects. If it's NULL,
+ * the platform view is not clipped.
+ */
 static void fill_platform_view_layer_props(
     struct fl_layer_props *props_out,
     const FlutterPoint *offset,
     const FlutterSize *size,
     const FlutterPlatformViewMutation **mutations,
     size_t n_mutations,
+    struct clip_rect *clip_rect_storage,
     const struct mat3f *display_to_view_transform,
     const struct mat3f *view_to_display_transform,
     double device_pixel_ratio
@@ -278,10 +617,15 @@ static void fill_platform_view_layer_props(
     rect.offset.y = 0;
     quad = get_quad(rect);
 
+    // The mutations are ordered from the root of the layer tree to the platform view, so every
+    // clip is specified in the coordinate space of the transforms that come before it.
+    struct mat3f transform = MAT3F_IDENTITY;
+    struct clip_rect *clip_rects = clip_rect_storage;
+    size_t n_clip_rects = 0;
     double rotation = 0, opacity = 1;
-    for (int i = n_mutations - 1; i >= 0; i--) {
+    for (size_t i = 0; i < n_mutations; i++) {
         if (mutations[i]->type == kFlutterPlatformViewMutationTypeTransformation) {
-            quad = transform_quad(FLUTTER_TRANSFORM_AS_MAT3F(mutations[i]->transformation), quad);
+            transform = multiply_mat3f(transform, FLUTTER_TRANSFORM_AS_MAT3F(mutations[i]->transformation));
 
             double rotz = atan2(mutations[i]->transformation.skewX, mutations[i]->transformation.scaleX) * 180.0 / M_PI;
             if (rotz < 0) {
@@ -291,32 +635,65 @@ static void fill_platform_view_layer_props(
             rotation += rotz;
         } else if (mutations[i]->type == kFlutterPlatformViewMutationTypeOpacity) {
             opacity *= mutations[i]->opacity;
+        } else if (mutations[i]->type == kFlutterPlatformViewMutationTypeClipRect ||
+                   mutations[i]->type == kFlutterPlatformViewMutationTypeClipRoundedRect) {
+            if (clip_rects == NULL) {
+                continue;
+            }
+
+            if (mutations[i]->type == kFlutterPlatformViewMutationTypeClipRect) {
+                fill_clip_rect(clip_rects + n_clip_rects, transform, &mutations[i]->clip_rect, NULL);
+            } else {
+                fill_clip_rect(clip_rects + n_clip_rects, transform, &mutations[i]->clip_rounded_rect.rect, &mutations[i]->clip_rounded_rect);
+            }
+            n_clip_rects++;
         }
     }
 
+    quad = transform_quad(transform, quad);
     rotation = fmod(rotation, 360.0);
 
-    /// TODO: Implement axis aligned rectangle detection
-    props_out->is_aa_rect = false;
-    props_out->aa_rect = AA_RECT_FROM_COORDS(0, 0, 0, 0);
+    props_out->is_aa_rect = quad_is_axis_aligned(quad);
+    props_out->aa_rect = quad_get_aa_bounding_rect(quad);
     props_out->quad = quad;
     props_out->opacity = opacity;
     props_out->rotation = rotation;
+    props_out->n_clip_rects = n_clip_rects;
+    props_out->clip_rects = n_clip_rects > 0 ? clip_rects : NULL;
 
-    /// TODO: Implement clip rects
-    props_out->n_clip_rects = 0;
-    props_out->clip_rects = NULL;
+    // We don't know what changed inside platform views.
+    props_out->has_damage = false;
+    props_out->n_damage_rects = 0;
+    props_out->damage_rects = NULL;
 }
 
 static int compositor_push_fl_layers(struct compositor *compositor, size_t n_fl_layers, const FlutterLayer **fl_layers) {
     struct fl_layer_composition *composition;
+    struct clip_rect *clip_rects;
+    size_t n_clip_rects;
     int ok;
 
-    composition = fl_layer_composition_new(n_fl_layers);
+    composition = fl_layer_composition_pool_get(compositor->composition_pool, n_fl_layers);
     if (composition == NULL) {
         return ENOMEM;
     }
 
+    // Every mutation of a platform view could be a clip.
+    n_clip_rects = 0;
+    for (int i = 0; i < n_fl_layers; i++) {
+        if (fl_layers[i]->type == kFlutterLayerContentTypePlatformView) {
+            n_clip_rects += fl_layers[i]->platform_view->mutations_count;
+        }
+    }
+
+    clip_rects = NULL;
+    if (n_clip_rects > 0) {
+        clip_rects = fl_layer_composition_reserve_clip_rects(composition, n_clip_rects);
+        if (clip_rects == NULL) {
+            LOG_ERROR("Couldn't allocate platform view clip rects. Platform views will not be clipped.\n");
+        }
+    }
+
     compositor_lock(compositor);
 
     for (int i = 0; i < n_fl_layers; i++) {
@@ -338,26 +715,22 @@ static int compositor_push_fl_layers(struct compositor *compositor, size_t n_fl_
             layer->props.rotation = 0.0;
             layer->props.n_clip_rects = 0;
             layer->props.clip_rects = NULL;
+
+            // The engine doesn't tell us which parts of a backing store it repainted,
+            // only whether it repainted it at all.
+            layer->props.has_damage = !fl_layer->backing_store->did_update;
+            layer->props.n_damage_rects = 0;
+            layer->props.damage_rects = NULL;
         } else {
             ASSERT_EQUALS(fl_layer->type, kFlutterLayerContentTypePlatformView);
 
-            /// TODO: Maybe always check if the ID is valid?
-#if DEBUG
-            // if we're in debug mode, we actually check if the ID is a valid,
-            // registered ID.
-            /// TODO: Implement
-            layer->surface = compositor_get_view_by_id_locked(compositor, fl_layer->platform_view->identifier);
+            // Ids of platform views that were already removed (or garbage ids) just show up as
+            // an empty surface.
+            layer->surface = compositor_get_view_by_id(compositor, fl_layer->platform_view->identifier);
             if (layer->surface == NULL) {
                 layer->surface =
                     CAST_SURFACE(dummy_render_surface_new(compositor->tracer, VEC2I(fl_layer->size.width, fl_layer->size.height)));
             }
-#else
-            // in release mode, we just assume the id is valid.
-            // Since the surface constructs the ID by just casting the surface pointer to an int64_t,
-            // we can easily cast it back without too much trouble.
-            // Only problem is if the id is garbage, we won't notice and the returned surface is garbage too.
-            layer->surface = surface_ref(surface_from_id(fl_layer->platform_view->identifier));
-#endif
 
             struct view_geometry geometry = window_get_view_geometry(compositor->main_window);
 
@@ -369,11 +742,18 @@ static int compositor_push_fl_layers(struct compositor *compositor, size_t n_fl_
                 &fl_layer->size,
                 fl_layer->platform_view->mutations,
                 fl_layer->platform_view->mutations_count,
+                clip_rects,
                 &geometry.display_to_view_transform,
                 &geometry.view_to_display_transform,
                 geometry.device_pixel_ratio
             );
+
+            if (clip_rects != NULL) {
+                clip_rects += fl_layer->platform_view->mutations_count;
+            }
         }
+
+        layer->surface_revision = surface_get_revision(layer->surface);
     }
 
     compositor_unlock(compositor);
@@ -411,59 +791,27 @@ static bool on_flutter_present_layers(const FlutterLayer **layers, size_t layers
     return true;
 }
 
-ATTR_PURE static bool platform_view_with_id_equal(const struct platform_view_with_id lhs, const struct platform_view_with_id rhs) {
-    return lhs.id == rhs.id;
-}
-
-int compositor_set_platform_view(struct compositor *compositor, int64_t id, struct surface *surface) {
-    struct platform_view_with_id *view;
-
+int compositor_add_platform_view(struct compositor *compositor, struct surface *surface, int64_t *id_out) {
     ASSERT_NOT_NULL(compositor);
-    assert(id != 0);
     ASSERT_NOT_NULL(surface);
+    ASSERT_NOT_NULL(id_out);
 
-    compositor_lock(compositor);
-
-    view = NULL;
-    util_dynarray_foreach(&compositor->views, struct platform_view_with_id, view_iter) {
-        if (view_iter->id == id) {
-            view = view_iter;
-            break;
-        }
-    }
+    return platform_view_table_add(compositor->views, surface, id_out);
+}
 
-    if (view == NULL) {
-        if (surface != NULL) {
-            struct platform_view_with_id v = {
-                .id = id,
-                .surface = surface_ref(surface),
-            };
+int compositor_set_platform_view(struct compositor *compositor, int64_t id, struct surface *surface) {
+    ASSERT_NOT_NULL(compositor);
 
-            util_dynarray_append(&compositor->views, struct platform_view_with_id, v);
-        }
+    if (surface == NULL) {
+        return platform_view_table_remove(compositor->views, id);
     } else {
-        ASSERT_NOT_NULL(view->surface);
-        if (surface == NULL) {
-            util_dynarray_delete_unordered_ext(&compositor->views, struct platform_view_with_id, *view, platform_view_with_id_equal);
-            surface_unref(view->surface);
-            free(view);
-        } else {
-            surface_swap_ptrs(&view->surface, surface);
-        }
+        return platform_view_table_set(compositor->views, id, surface);
     }
-
-    compositor_unlock(compositor);
-    return 0;
 }
 
-struct surface *compositor_get_view_by_id_locked(struct compositor *compositor, int64_t view_id) {
-    util_dynarray_foreach(&compositor->views, struct platform_view_with_id, view) {
-        if (view->id == view_id) {
-            return view->surface;
-        }
-    }
-
-    return NULL;
+struct surface *compositor_get_view_by_id(struct compositor *compositor, int64_t view_id) {
+    ASSERT_NOT_NULL(compositor);
+    return platform_view_table_lookup(compositor->views, view_id);
 }
 
 #ifdef HAVE_EGL_GLES2
@@ -80,19 +80,6 @@ struct compositor_config {
     struct device_config *device_configs;
 };
 
-struct clip_rect {
-    struct quad rect;
-    bool is_aa;
-
-    struct aa_rect aa_rect;
-
-    bool is_rounded;
-    struct vec2f upper_left_corner_radius;
-    struct vec2f upper_right_corner_radius;
-    struct vec2f lower_right_corner_radius;
-    struct vec2f lower_left_corner_radius;
-};
-
 struct fl_layer_props {
     /**
      * @brief True if the presentation quadrangle (the quadrangle on the target window into which the
@@ -132,16 +119,55 @@ struct fl_layer_props {
      * @brief The (possibly rounded) rectangles that the surface should be clipped to.
      */
     struct clip_rect *clip_rects;
+
+    /**
+     * @brief Whether only the regions in @ref damage_rects changed since the layer was last presented.
+     *
+     * If false, the whole layer is considered damaged.
+     */
+    bool has_damage;
+
+    /**
+     * @brief The number of damage rectangles in the @ref damage_rects array.
+     *
+     * Zero (with @ref has_damage true) means the surface contents didn't change at all.
+     */
+    size_t n_damage_rects;
+
+    /**
+     * @brief The regions of the surface that changed, in surface pixel coordinates.
+     */
+    const struct aa_rect *damage_rects;
 };
 
 struct fl_layer {
     struct fl_layer_props props;
     struct surface *surface;
+
+    /**
+     * @brief The revision of @ref surface at the time this layer was composed.
+     */
+    int64_t surface_revision;
 };
 
+struct fl_layer_composition_pool;
+
 struct fl_layer_composition {
     refcount_t n_refs;
     size_t n_layers;
+
+    /**
+     * @brief The pool this composition goes back to when it's destroyed, or NULL if it's not pooled.
+     */
+    struct fl_layer_composition_pool *pool;
+    size_t layers_capacity;
+
+    /**
+     * @brief Storage for the clip rects of all layers, see @ref fl_layer_composition_reserve_clip_rects.
+     */
+    struct clip_rect *clip_rect_storage;
+    size_t clip_rect_capacity;
+
     struct fl_layer layers[];
 };
 
@@ -166,9 +192,26 @@ ATTR_PURE double compositor_get_refresh_rate(struct compositor *compositor);
 
 int compositor_get_next_vblank(struct compositor *compositor, uint64_t *next_vblank_ns_out);
 
+/**
+ * @brief Registers @a surface as a platform view and returns the id flutter should use for it in @a id_out.
+ *
+ * @returns 0 on success, or an error code.
+ */
+int compositor_add_platform_view(struct compositor *compositor, struct surface *surface, int64_t *id_out);
+
+/**
+ * @brief Replaces the surface of the platform view with id @a id, or removes the platform view
+ * if @a surface is NULL.
+ *
+ * @returns 0 on success, EINVAL if @a id is not a registered platform view.
+ */
 int compositor_set_platform_view(struct compositor *compositor, int64_t id, struct surface *surface);
 
-struct surface *compositor_get_view_by_id_locked(struct compositor *compositor, int64_t view_id);
+/**
+ * @brief Returns a new reference to the surface of the platform view with id @a view_id,
+ * or NULL if there's no such platform view.
+ */
+struct surface *compositor_get_view_by_id(struct compositor *compositor, int64_t view_id);
 
 const FlutterCompositor *compositor_get_flutter_compositor(struct compositor *compositor);
 
@@ -203,4 +246,75 @@ DECLARE_REF_OPS(fl_layer_composition)
 size_t fl_layer_composition_get_n_layers(struct fl_layer_composition *composition);
 struct fl_layer *fl_layer_composition_peek_layer(struct fl_layer_composition *composition, int layer);
 
+/**
+ * @brief Returns storage for at least @a n_clip_rects clip rects that lives as long as @a composition.
+ *
+ * The storage is kept when the composition is recycled by its pool, so it's only (re-)allocated
+ * if a composition needs more clip rects than ever before. Storage returned by earlier calls
+ * is invalid afterwards.
+ *
+ * @returns The storage, or NULL if it couldn't be allocated.
+ */
+struct clip_rect *fl_layer_composition_reserve_clip_rects(struct fl_layer_composition *composition, size_t n_clip_rects);
+
+/**
+ * @brief Recycles compositions, so composing a frame doesn't need to allocate anything in the steady state.
+ *
+ * Compositions taken from the pool keep a reference on it, so it can be unrefed while they're still in use.
+ */
+struct fl_layer_composition_pool *fl_layer_composition_pool_new(void);
+void fl_layer_composition_pool_destroy(struct fl_layer_composition_pool *pool);
+DECLARE_REF_OPS(fl_layer_composition_pool)
+
+/**
+ * @brief Returns a composition with @a n_layers (uninitialized) layers, reusing a destroyed one if possible.
+ */
+struct fl_layer_composition *fl_layer_composition_pool_get(struct fl_layer_composition_pool *pool, size_t n_layers);
+
+/**
+ * @brief Whether @a a and @a b describe the same geometry, opacity and clipping.
+ *
+ * Damage is not compared.
+ */
+bool fl_layer_props_equals(const struct fl_layer_props *a, const struct fl_layer_props *b);
+
+/**
+ * @brief Returns true if @a a and @a b look exactly the same on screen, i.e. they have the same
+ * surfaces at the same revisions, with the same geometry.
+ */
+bool fl_layer_composition_equals(struct fl_layer_composition *a, struct fl_layer_composition *b);
+
+/**
+ * @brief Whether a layer with @a props can only be drawn correctly by compositing it on the GPU,
+ * i.e. it's not an axis-aligned rectangle, it's translucent or it's clipped to something
+ * that a hardware plane can't represent (rounded or rotated clip rects).
+ */
+bool fl_layer_props_needs_gpu_composition(const struct fl_layer_props *props);
+
+/**
+ * @brief Gets the source and destination rectangles for scanning out a buffer of @a buffer_size
+ * with @a props on a hardware plane.
+ *
+ * Axis-aligned clip rects are applied by cropping both rectangles.
+ * If @a props is not representable on a hardware plane (see @ref fl_layer_props_needs_gpu_composition),
+ * this is only an approximation using the bounding rectangle of the layer.
+ *
+ * @returns false if the layer is clipped completely, i.e. there's nothing to scan out.
+ */
+bool fl_layer_props_get_scanout_rects(
+    const struct fl_layer_props *props,
+    struct vec2f buffer_size,
+    struct aa_rect *src_out,
+    struct aa_rect *dst_out
+);
+
+/**
+ * @brief Converts the damage of @a props to KMS damage clips.
+ *
+ * @param clips_out Room for KMS_MAX_DAMAGE_CLIPS damage clips.
+ * @param n_clips_out The number of damage clips written to @a clips_out.
+ * @returns The value for @ref kms_fb_layer.has_damage.
+ */
+bool fl_layer_props_get_damage_clips(const struct fl_layer_props *props, struct drm_mode_rect *clips_out, size_t *n_clips_out);
+
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_COMPOSITOR_NG_H
@@ -50,6 +50,10 @@
 
 #include "config.h"
 
+#ifdef HAVE_EGL_GLES2
+    #include "gl_renderer.h"
+#endif
+
 struct refcounted_dmabuf {
     refcount_t n_refs;
     struct dmabuf buf;
@@ -107,6 +111,9 @@ ATTR_PURE struct dmabuf_surface *__checked_cast_dmabuf_surface(void *ptr) {
 static void dmabuf_surface_deinit(struct surface *s);
 static int dmabuf_surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
 static int dmabuf_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder);
+#ifdef HAVE_EGL_GLES2
+static int dmabuf_surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener);
+#endif
 
 int dmabuf_surface_init(struct dmabuf_surface *s, struct tracer *tracer, struct texture_registry *texture_registry) {
     struct texture *texture;
@@ -125,6 +132,9 @@ int dmabuf_surface_init(struct dmabuf_surface *s, struct tracer *tracer, struct
     s->surface.deinit = dmabuf_surface_deinit;
     s->surface.present_kms = dmabuf_surface_present_kms;
     s->surface.present_fbdev = dmabuf_surface_present_fbdev;
+#ifdef HAVE_EGL_GLES2
+    s->surface.present_gl = dmabuf_surface_present_gl;
+#endif
 
 #ifdef DEBUG
     uuid_copy(&s->uuid, uuid);
@@ -235,6 +245,7 @@ int dmabuf_surface_push_dmabuf(struct dmabuf_surface *s, const struct dmabuf *bu
     }
 
     refcounted_dmabuf_swap_ptrs(&s->next_buf, b);
+    s->surface.revision++;
 
     surface_unlock(CAST_SURFACE_UNCHECKED(s));
 
@@ -248,10 +259,13 @@ ATTR_PURE int64_t dmabuf_surface_get_texture_id(struct dmabuf_surface *s) {
 
 static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_props *props, struct kms_req_builder *builder) {
     struct dmabuf_surface *s;
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+    struct aa_rect src, dst;
+    size_t n_damage_clips;
+    bool has_damage;
     uint32_t fb_id;
     int ok;
 
-    ASSERT_MSG(props->is_aa_rect, "Only axis-aligned rectangles supported right now.");
     s = CAST_THIS(_s);
     (void) s;
     (void) props;
@@ -284,6 +298,14 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
         s->next_buf->drmdev = drmdev_ref(kms_req_builder_get_drmdev(builder));
     }
 
+    // The platform view is completely clipped away.
+    if (!fl_layer_props_get_scanout_rects(props, VEC2F(s->next_buf->buf.width, s->next_buf->buf.height), &src, &dst)) {
+        surface_unlock(_s);
+        return 0;
+    }
+
+    has_damage = fl_layer_props_get_damage_clips(props, damage_clips, &n_damage_clips);
+
     ok = kms_req_builder_push_fb_layer(
         builder,
         &(struct kms_fb_layer){
@@ -293,20 +315,24 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
             .has_modifier = s->next_buf->buf.has_modifiers,
             .modifier = s->next_buf->buf.modifiers[0],
 
-            .src_x = 0,
-            .src_y = 0,
-            .src_w = DOUBLE_TO_FP1616_ROUNDED(s->next_buf->buf.width),
-            .src_h = DOUBLE_TO_FP1616_ROUNDED(s->next_buf->buf.height),
+            .src_x = DOUBLE_TO_FP1616_ROUNDED(src.offset.x),
+            .src_y = DOUBLE_TO_FP1616_ROUNDED(src.offset.y),
+            .src_w = DOUBLE_TO_FP1616_ROUNDED(src.size.x),
+            .src_h = DOUBLE_TO_FP1616_ROUNDED(src.size.y),
 
-            .dst_x = props->aa_rect.offset.x,
-            .dst_y = props->aa_rect.offset.y,
-            .dst_w = props->aa_rect.size.x,
-            .dst_h = props->aa_rect.size.y,
+            .dst_x = dst.offset.x,
+            .dst_y = dst.offset.y,
+            .dst_w = dst.size.x,
+            .dst_h = dst.size.y,
 
             .has_rotation = false,
             .rotation = PLANE_TRANSFORM_ROTATE_0,
             .has_in_fence_fd = false,
             .in_fence_fd = 0,
+
+            .has_damage = has_damage,
+            .n_damage_clips = n_damage_clips,
+            .damage_clips = damage_clips,
         },
         refcounted_dmabuf_unref_void,
         NULL,
@@ -325,6 +351,49 @@ static int dmabuf_surface_present_kms(struct surface *_s, const struct fl_layer_
     return 0;
 }
 
+#ifdef HAVE_EGL_GLES2
+static int dmabuf_surface_present_gl(struct surface *_s, const struct fl_layer_props *props, struct gl_flattener *flattener) {
+    struct dmabuf_surface *s;
+    int ok;
+
+    s = CAST_THIS(_s);
+
+    surface_lock(_s);
+
+    ASSERT_NOT_NULL_MSG(s->next_buf, "dmabuf_surface_present_gl was called, but no dmabuf is queued to be presented.");
+
+    ok = gl_flattener_draw(
+        flattener,
+        &(const struct gl_flattener_source){
+            .format = s->next_buf->buf.format,
+            .width = s->next_buf->buf.width,
+            .height = s->next_buf->buf.height,
+            .fd = s->next_buf->buf.fds[0],
+            .offset = s->next_buf->buf.offsets[0],
+            .pitch = s->next_buf->buf.strides[0],
+            .has_modifier = s->next_buf->buf.has_modifiers,
+            .modifier = s->next_buf->buf.modifiers[0],
+        },
+        &props->quad,
+        props->opacity,
+        props->clip_rects,
+        props->n_clip_rects,
+        refcounted_dmabuf_unref_void,
+        refcounted_dmabuf_ref(s->next_buf)
+    );
+    if (ok != 0) {
+        LOG_ERROR("Couldn't flatten dmabuf. gl_flattener_draw: %s\n", strerror(ok));
+        refcounted_dmabuf_unref(s->next_buf);
+        surface_unlock(_s);
+        return ok;
+    }
+
+    surface_unlock(_s);
+
+    return 0;
+}
+#endif
+
 static int dmabuf_surface_present_fbdev(struct surface *_s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder) {
     struct dmabuf_surface *s;
 
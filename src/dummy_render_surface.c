@@ -58,6 +58,7 @@ ATTR_PURE struct dummy_render_surface *__checked_cast_dummy_render_surface(void
 void dummy_render_surface_deinit(struct surface *s);
 static int dummy_render_surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
 static int dummy_render_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder);
+static int dummy_render_surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener);
 static int dummy_render_surface_fill(struct render_surface *surface, FlutterBackingStore *fl_store);
 static int dummy_render_surface_queue_present(struct render_surface *surface, const FlutterBackingStore *fl_store);
 
@@ -71,6 +72,7 @@ int dummy_render_surface_init(struct dummy_render_surface *surface, struct trace
 
     surface->surface.present_kms = dummy_render_surface_present_kms;
     surface->surface.present_fbdev = dummy_render_surface_present_fbdev;
+    surface->surface.present_gl = dummy_render_surface_present_gl;
     surface->surface.deinit = dummy_render_surface_deinit;
     surface->render_surface.fill = dummy_render_surface_fill;
     surface->render_surface.queue_present = dummy_render_surface_queue_present;
@@ -128,6 +130,15 @@ static int dummy_render_surface_present_fbdev(struct surface *s, const struct fl
     return 0;
 }
 
+static int dummy_render_surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener) {
+    (void) props;
+    (void) flattener;
+
+    TRACER_INSTANT(s->tracer, "dummy_render_surface_present_gl");
+
+    return 0;
+}
+
 static int dummy_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store) {
     (void) fl_store;
 
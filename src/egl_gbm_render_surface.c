@@ -14,6 +14,8 @@
 #include <inttypes.h>
 #include <stdlib.h>
 
+#include <unistd.h>
+
 #include "egl.h"
 #include "gl_renderer.h"
 #include "gles.h"
@@ -104,6 +106,7 @@ void egl_gbm_render_surface_deinit(struct surface *s);
 static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
 static int
 egl_gbm_render_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder);
+static int egl_gbm_render_surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener);
 static int egl_gbm_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store);
 static int egl_gbm_render_surface_queue_present(struct render_surface *s, const FlutterBackingStore *fl_store);
 
@@ -228,6 +231,7 @@ static int egl_gbm_render_surface_init(
 
     s->surface.present_kms = egl_gbm_render_surface_present_kms;
     s->surface.present_fbdev = egl_gbm_render_surface_present_fbdev;
+    s->surface.present_gl = egl_gbm_render_surface_present_gl;
     s->surface.deinit = egl_gbm_render_surface_deinit;
     s->render_surface.fill = egl_gbm_render_surface_fill;
     s->render_surface.queue_present = egl_gbm_render_surface_queue_present;
@@ -388,12 +392,19 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
     struct gbm_bo *bo;
     enum pixfmt pixel_format;
     uint32_t fb_id, opaque_fb_id;
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+    struct aa_rect src, dst;
+    size_t n_damage_clips;
+    bool has_damage;
     int ok;
 
     egl_surface = CAST_THIS(s);
 
-    /// TODO: Implement non axis-aligned fl_layer_props
-    ASSERT_MSG(props->is_aa_rect, "only axis aligned view geometry is supported right now");
+    // Layers that can't be represented on a plane are composited on the GPU by the window.
+    // If it can't do that, we just present the bounding rect.
+    if (!fl_layer_props_get_scanout_rects(props, VEC2F(egl_surface->render_surface.size.x, egl_surface->render_surface.size.y), &src, &dst)) {
+        return 0;
+    }
 
     surface_lock(s);
 
@@ -524,12 +535,14 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
         }
     }
 
+    has_damage = fl_layer_props_get_damage_clips(props, damage_clips, &n_damage_clips);
+
     TRACER_BEGIN(egl_surface->surface.tracer, "kms_req_builder_push_fb_layer");
     LOG_KMS_DEBUG("egl_gbm_present_kms: pushing fb layer: fb_id=%u, format=%d, modifier=0x%" PRIx64 ", dst=(%d,%d %ux%u)\n",
         fb_id, pixel_format,
         (uint64_t)gbm_bo_get_modifier(bo),
-        (int32_t) props->aa_rect.offset.x, (int32_t) props->aa_rect.offset.y,
-        (uint32_t) props->aa_rect.size.x, (uint32_t) props->aa_rect.size.y);
+        (int32_t) dst.offset.x, (int32_t) dst.offset.y,
+        (uint32_t) dst.size.x, (uint32_t) dst.size.y);
     ok = kms_req_builder_push_fb_layer(
         builder,
         &(const struct kms_fb_layer){
@@ -539,15 +552,15 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
                             && gbm_bo_get_modifier(bo) != DRM_FORMAT_MOD_LINEAR,
             .modifier = gbm_bo_get_modifier(bo),
 
-            .dst_x = (int32_t) props->aa_rect.offset.x,
-            .dst_y = (int32_t) props->aa_rect.offset.y,
-            .dst_w = (uint32_t) props->aa_rect.size.x,
-            .dst_h = (uint32_t) props->aa_rect.size.y,
+            .dst_x = (int32_t) dst.offset.x,
+            .dst_y = (int32_t) dst.offset.y,
+            .dst_w = (uint32_t) dst.size.x,
+            .dst_h = (uint32_t) dst.size.y,
 
-            .src_x = 0,
-            .src_y = 0,
-            .src_w = DOUBLE_TO_FP1616_ROUNDED(egl_surface->render_surface.size.x),
-            .src_h = DOUBLE_TO_FP1616_ROUNDED(egl_surface->render_surface.size.y),
+            .src_x = DOUBLE_TO_FP1616_ROUNDED(src.offset.x),
+            .src_y = DOUBLE_TO_FP1616_ROUNDED(src.offset.y),
+            .src_w = DOUBLE_TO_FP1616_ROUNDED(src.size.x),
+            .src_h = DOUBLE_TO_FP1616_ROUNDED(src.size.y),
 
             // If a rotated framebuffer console is shown, the rotation of the primary plane might be non-zero.
             //
@@ -558,6 +571,10 @@ static int egl_gbm_render_surface_present_kms(struct surface *s, const struct fl
 
             .has_in_fence_fd = false,
             .in_fence_fd = 0,
+
+            .has_damage = has_damage,
+            .n_damage_clips = n_damage_clips,
+            .damage_clips = damage_clips,
         },
         on_release_layer,
         NULL,
@@ -589,6 +606,70 @@ fail_unlock:
     return ok;
 }
 
+static int egl_gbm_render_surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener) {
+    struct egl_gbm_render_surface *egl_surface;
+    struct gbm_bo *bo;
+    uint64_t modifier;
+    int fd, ok;
+
+    egl_surface = CAST_THIS(s);
+
+    surface_lock(s);
+
+    ASSERT_NOT_NULL_MSG(
+        egl_surface->locked_front_fb,
+        "There's no framebuffer available for flattening right now. Make sure you called render_surface_queue_present() before presenting."
+    );
+
+    bo = egl_surface->locked_front_fb->bo;
+
+    fd = gbm_bo_get_fd(bo);
+    if (fd < 0) {
+        LOG_ERROR("Couldn't get dmabuf fd of GBM buffer for flattening.\n");
+        ok = EIO;
+        goto fail_unlock;
+    }
+
+    modifier = gbm_bo_get_modifier(bo);
+
+    ok = gl_flattener_draw(
+        flattener,
+        &(const struct gl_flattener_source){
+            .format = egl_surface->pixel_format,
+            .width = (int) gbm_bo_get_width(bo),
+            .height = (int) gbm_bo_get_height(bo),
+            .fd = fd,
+            .offset = gbm_bo_get_offset(bo, 0),
+            .pitch = gbm_bo_get_stride(bo),
+            .has_modifier = modifier != DRM_FORMAT_MOD_INVALID && modifier != DRM_FORMAT_MOD_LINEAR,
+            .modifier = modifier,
+        },
+        &props->quad,
+        props->opacity,
+        props->clip_rects,
+        props->n_clip_rects,
+        on_release_layer,
+        locked_fb_ref(egl_surface->locked_front_fb)
+    );
+
+    // EGL dups the fd if it needs it.
+    close(fd);
+
+    if (ok != 0) {
+        goto fail_unref_locked_fb;
+    }
+
+    surface_unlock(s);
+    return 0;
+
+fail_unref_locked_fb:
+    locked_fb_unref(egl_surface->locked_front_fb);
+
+fail_unlock:
+    surface_unlock(s);
+    return ok;
+}
+
 static int
 egl_gbm_render_surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder) {
     struct egl_gbm_render_surface *egl_surface;
@@ -633,11 +714,16 @@ static int egl_gbm_render_surface_queue_present(struct render_surface *s, const
     int i, ok;
 
     egl_surface = CAST_THIS(s);
-    (void) fl_store;
 
     surface_lock(CAST_SURFACE(s));
 
-    /// TODO: Handle fl_store->did_update == false here
+    // If flutter didn't render anything into this surface, there's no new buffer to swap to.
+    // Keep presenting the current front fb and leave the revision alone, so the
+    // window can tell nothing changed.
+    if (!fl_store->did_update && egl_surface->locked_front_fb != NULL) {
+        surface_unlock(CAST_SURFACE(s));
+        return 0;
+    }
 
     // Unref the old front fb so potentially one of the locked_fbs entries gets freed
     if (egl_surface->locked_front_fb != NULL) {
@@ -765,6 +851,7 @@ locked:
     egl_surface->locked_fbs[i].surface = CAST_THIS(surface_ref(CAST_SURFACE(s)));
     egl_surface->locked_fbs[i].n_refs = REFCOUNT_INIT_1;
     egl_surface->locked_front_fb = egl_surface->locked_fbs + i;
+    s->surface.revision++;
     surface_unlock(CAST_SURFACE(s));
     return 0;
 
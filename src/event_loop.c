@@ -1,23 +1,708 @@
 #include "event_loop.h"
 
+#include <errno.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <sys/eventfd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <systemd/sd-event.h>
 
 #include "util/collection.h"
+#include "util/lock_ops.h"
+#include "util/logging.h"
 #include "util/refcounting.h"
 
+struct task_queue_node {
+    struct task_queue_node *next;
+
+    task_queue_callback_t callback;
+    void *userdata;
+
+    /// Storage for task_queue_post_with_data. userdata points here in that case.
+    _Alignas(max_align_t) uint8_t data[TASK_QUEUE_MAX_DATA_SIZE];
+};
+
+/*
+ * Task nodes are recycled through a process-wide pool so posting a task
+ * doesn't need a malloc.
+ *
+ * The pool is a lock-free stack that's only ever pushed to (by the queue
+ * consumers, one CAS per batch of executed tasks) or emptied as a whole (by
+ * producers refilling their thread-local cache). Since nothing ever pops a
+ * single node, there's no ABA problem. When a thread exits, its cached nodes
+ * are pushed back onto the pool.
+ */
+static struct task_queue_node *_Atomic node_pool = NULL;
+static _Thread_local struct task_queue_node *node_cache = NULL;
+
+static pthread_once_t node_cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t node_cache_key;
+
+static void push_nodes_to_pool(struct task_queue_node *first, struct task_queue_node *last) {
+    struct task_queue_node *head;
+
+    head = atomic_load_explicit(&node_pool, memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&node_pool, &head, first, memory_order_release, memory_order_relaxed));
+}
+
+static void on_thread_exit(void *userdata) {
+    struct task_queue_node *last;
+
+    (void) userdata;
+
+    if (node_cache == NULL) {
+        return;
+    }
+
+    for (last = node_cache; last->next != NULL; last = last->next)
+        ;
+
+    push_nodes_to_pool(node_cache, last);
+    node_cache = NULL;
+}
+
+static void create_node_cache_key(void) {
+    ASSERTED int ok;
+
+    ok = pthread_key_create(&node_cache_key, on_thread_exit);
+    ASSERT_ZERO(ok);
+}
+
+static struct task_queue_node *alloc_node(void) {
+    struct task_queue_node *node;
+
+    if (node_cache == NULL) {
+        node_cache = atomic_exchange_explicit(&node_pool, NULL, memory_order_acquire);
+        if (node_cache == NULL) {
+            return malloc(sizeof(struct task_queue_node));
+        }
+
+        // make sure the cached nodes are given back to the pool when this thread exits.
+        pthread_once(&node_cache_key_once, create_node_cache_key);
+        if (pthread_getspecific(node_cache_key) == NULL) {
+            pthread_setspecific(node_cache_key, (void *) 1);
+        }
+    }
+
+    node = node_cache;
+    node_cache = node->next;
+    return node;
+}
+
+struct task_queue {
+    /// Posted but not yet executed tasks, most recently posted first.
+    struct task_queue_node *_Atomic head;
+
+    /// Whether the wakeup eventfd was already written since the last time
+    /// the queue was drained. Used to coalesce wakeups.
+    atomic_bool wakeup_pending;
+
+    int wakeup_fd;
+    sd_event_source *source;
+};
+
+static int on_task_queue_wakeup(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    struct task_queue_node *node, *next, *fifo, *last;
+    struct task_queue *queue;
+    uint64_t value;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    queue = userdata;
+    (void) s;
+    (void) revents;
+
+    ok = read(fd, &value, sizeof value);
+    if (ok < 0 && errno != EAGAIN) {
+        ok = errno;
+        LOG_ERROR("Could not read task queue wakeup eventfd. read: %s\n", strerror(ok));
+        return -ok;
+    }
+
+    // Clear the flag before taking the tasks. Any task posted after we took the
+    // tasks will then see the flag cleared and wake us up again.
+    atomic_store(&queue->wakeup_pending, false);
+    node = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+    if (node == NULL) {
+        return 0;
+    }
+
+    // reverse the list so we execute the tasks in the order they were posted.
+    last = node;
+    fifo = NULL;
+    for (; node != NULL; node = next) {
+        next = node->next;
+        node->next = fifo;
+        fifo = node;
+    }
+
+    for (node = fifo; node != NULL; node = node->next) {
+        ok = node->callback(node->userdata);
+        if (ok != 0) {
+            LOG_ERROR("Error executing task: %s\n", strerror(ok));
+        }
+    }
+
+    push_nodes_to_pool(fifo, last);
+    return 0;
+}
+
+struct task_queue *task_queue_new(sd_event *loop) {
+    struct task_queue *queue;
+    int ok;
+
+    ASSERT_NOT_NULL(loop);
+
+    queue = malloc(sizeof *queue);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (queue->wakeup_fd < 0) {
+        LOG_ERROR("Could not create task queue wakeup fd. eventfd: %s\n", strerror(errno));
+        goto fail_free_queue;
+    }
+
+    ok = sd_event_add_io(loop, &queue->source, queue->wakeup_fd, EPOLLIN, on_task_queue_wakeup, queue);
+    if (ok < 0) {
+        LOG_ERROR("Could not add task queue to event loop. sd_event_add_io: %s\n", strerror(-ok));
+        goto fail_close_wakeup_fd;
+    }
+
+    atomic_init(&queue->head, NULL);
+    atomic_init(&queue->wakeup_pending, false);
+    return queue;
+
+fail_close_wakeup_fd:
+    close(queue->wakeup_fd);
+
+fail_free_queue:
+    free(queue);
+    return NULL;
+}
+
+void task_queue_destroy(struct task_queue *queue) {
+    struct task_queue_node *node, *last;
+
+    ASSERT_NOT_NULL(queue);
+
+    sd_event_source_disable_unref(queue->source);
+    close(queue->wakeup_fd);
+
+    // Tasks that didn't get to run are dropped, same as pending sd-event sources
+    // are dropped when the event loop is destroyed.
+    node = atomic_exchange(&queue->head, NULL);
+    if (node != NULL) {
+        for (last = node; last->next != NULL; last = last->next)
+            ;
+
+        push_nodes_to_pool(node, last);
+    }
+
+    free(queue);
+}
+
+static int post_node(struct task_queue *queue, struct task_queue_node *node) {
+    struct task_queue_node *head;
+    int ok;
+
+    head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, node, memory_order_release, memory_order_relaxed));
+
+    // Only the first task posted after the queue was drained needs to wake up the loop.
+    if (!atomic_exchange(&queue->wakeup_pending, true)) {
+        ok = write(queue->wakeup_fd, &(uint64_t){ 1 }, sizeof(uint64_t));
+        if (ok < 0) {
+            ok = errno;
+            LOG_ERROR("Could not wake up task queue. write: %s\n", strerror(ok));
+            return ok;
+        }
+    }
+
+    return 0;
+}
+
+int task_queue_post(struct task_queue *queue, task_queue_callback_t callback, void *userdata) {
+    struct task_queue_node *node;
+
+    ASSERT_NOT_NULL(queue);
+    ASSERT_NOT_NULL(callback);
+
+    node = alloc_node();
+    if (node == NULL) {
+        return ENOMEM;
+    }
+
+    node->callback = callback;
+    node->userdata = userdata;
+
+    return post_node(queue, node);
+}
+
+int task_queue_post_with_data(struct task_queue *queue, task_queue_callback_t callback, const void *data, size_t size) {
+    struct task_queue_node *node;
+
+    ASSERT_NOT_NULL(queue);
+    ASSERT_NOT_NULL(callback);
+    ASSERT(size <= TASK_QUEUE_MAX_DATA_SIZE);
+
+    node = alloc_node();
+    if (node == NULL) {
+        return ENOMEM;
+    }
+
+    memcpy(node->data, data, size);
+    node->callback = callback;
+    node->userdata = node->data;
+
+    return post_node(queue, node);
+}
+
+#define TIMER_SLOT_NONE UINT32_MAX
+
+struct timer {
+    uint64_t target_time_ns;
+
+    /// Used to execute tasks with the same target time in the order they were posted.
+    uint64_t sequence;
+
+    /// Index of this timer in the heap if it's pending, or the next free slot if it's unused.
+    uint32_t index;
+
+    /// Incremented every time the slot is freed, so stale handles don't match anymore.
+    uint32_t generation;
+
+    task_queue_callback_t callback;
+    void *userdata;
+    bool has_data;
+    _Alignas(max_align_t) uint8_t data[TASK_QUEUE_MAX_DATA_SIZE];
+};
+
+struct timer_queue {
+    pthread_mutex_t mutex;
+
+    /// All timer slots, pending or not. Handles refer to these by index, so they
+    /// stay valid when the array is reallocated.
+    struct timer *timers;
+    size_t n_timers;
+    uint32_t first_free;
+
+    /// Binary min-heap of slot indices, ordered by target time.
+    uint32_t *heap;
+    size_t heap_size;
+
+    uint64_t next_sequence;
+
+    int timer_fd;
+    sd_event_source *source;
+
+    /// The time the timerfd is armed for, or zero if it's disarmed.
+    uint64_t armed_time_ns;
+
+    struct timer_queue_stats stats;
+};
+
+DEFINE_STATIC_LOCK_OPS(timer_queue, mutex)
+
+static inline bool timer_before(const struct timer *a, const struct timer *b) {
+    if (a->target_time_ns != b->target_time_ns) {
+        return a->target_time_ns < b->target_time_ns;
+    }
+    return a->sequence < b->sequence;
+}
+
+static void heap_set(struct timer_queue *queue, size_t index, uint32_t slot) {
+    queue->heap[index] = slot;
+    queue->timers[slot].index = index;
+}
+
+static void heap_sift_up(struct timer_queue *queue, size_t index) {
+    uint32_t slot = queue->heap[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if (!timer_before(queue->timers + slot, queue->timers + queue->heap[parent])) {
+            break;
+        }
+
+        heap_set(queue, index, queue->heap[parent]);
+        index = parent;
+    }
+
+    heap_set(queue, index, slot);
+}
+
+static void heap_sift_down(struct timer_queue *queue, size_t index) {
+    uint32_t slot = queue->heap[index];
+
+    for (;;) {
+        size_t child = 2 * index + 1;
+
+        if (child >= queue->heap_size) {
+            break;
+        }
+
+        if (child + 1 < queue->heap_size && timer_before(queue->timers + queue->heap[child + 1], queue->timers + queue->heap[child])) {
+            child++;
+        }
+
+        if (!timer_before(queue->timers + queue->heap[child], queue->timers + slot)) {
+            break;
+        }
+
+        heap_set(queue, index, queue->heap[child]);
+        index = child;
+    }
+
+    heap_set(queue, index, slot);
+}
+
+static void heap_remove(struct timer_queue *queue, size_t index) {
+    ASSERT(index < queue->heap_size);
+
+    queue->heap_size--;
+    if (index == queue->heap_size) {
+        return;
+    }
+
+    // move the last timer into the gap and restore the heap property from there.
+    heap_set(queue, index, queue->heap[queue->heap_size]);
+    if (index > 0 && timer_before(queue->timers + queue->heap[index], queue->timers + queue->heap[(index - 1) / 2])) {
+        heap_sift_up(queue, index);
+    } else {
+        heap_sift_down(queue, index);
+    }
+}
+
+static void free_timer_slot(struct timer_queue *queue, uint32_t slot) {
+    struct timer *timer = queue->timers + slot;
+
+    timer->generation++;
+    if (timer->generation == 0) {
+        timer->generation = 1;
+    }
+
+    timer->index = queue->first_free;
+    queue->first_free = slot;
+}
+
+static int grow_timer_slots(struct timer_queue *queue) {
+    struct timer *timers;
+    uint32_t *heap;
+    size_t n_timers;
+
+    n_timers = queue->n_timers ? queue->n_timers * 2 : 16;
+    if (n_timers >= TIMER_SLOT_NONE) {
+        return ENOMEM;
+    }
+
+    timers = realloc(queue->timers, n_timers * sizeof *timers);
+    if (timers == NULL) {
+        return ENOMEM;
+    }
+    queue->timers = timers;
+
+    heap = realloc(queue->heap, n_timers * sizeof *heap);
+    if (heap == NULL) {
+        return ENOMEM;
+    }
+    queue->heap = heap;
+
+    for (size_t i = n_timers; i > queue->n_timers; i--) {
+        timers[i - 1].generation = 1;
+        timers[i - 1].index = queue->first_free;
+        queue->first_free = i - 1;
+    }
+
+    queue->n_timers = n_timers;
+    return 0;
+}
+
+/**
+ * @brief Makes sure the timerfd fires no later than the earliest pending deadline.
+ */
+static void arm_timer_locked(struct timer_queue *queue) {
+    struct itimerspec spec;
+    uint64_t target_time_ns;
+    int ok;
+
+    ASSERT_MUTEX_LOCKED(queue->mutex);
+
+    if (queue->heap_size == 0) {
+        // If it's still armed, the timer will just fire without anything to do.
+        return;
+    }
+
+    // zero would disarm the timer.
+    target_time_ns = MAX2(queue->timers[queue->heap[0]].target_time_ns, 1);
+    if (queue->armed_time_ns != 0 && queue->armed_time_ns <= target_time_ns) {
+        return;
+    }
+
+    spec.it_interval = (struct timespec){ 0 };
+    spec.it_value.tv_sec = target_time_ns / 1000000000ull;
+    spec.it_value.tv_nsec = target_time_ns % 1000000000ull;
+
+    ok = timerfd_settime(queue->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    if (ok < 0) {
+        LOG_ERROR("Could not arm timer queue timerfd. timerfd_settime: %s\n", strerror(errno));
+        return;
+    }
+
+    queue->armed_time_ns = target_time_ns;
+    queue->stats.n_timer_updates++;
+}
+
+static int on_timer_queue_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    struct timer_queue *queue;
+    struct timer timer;
+    uint64_t value, start, now;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    queue = userdata;
+    (void) s;
+    (void) revents;
+
+    ok = read(fd, &value, sizeof value);
+    if (ok < 0 && errno != EAGAIN) {
+        ok = errno;
+        LOG_ERROR("Could not read timer queue timerfd. read: %s\n", strerror(ok));
+        return -ok;
+    }
+
+    // Only execute the tasks that are due right now, so a task that reposts itself
+    // with a target time in the past can't starve the event loop.
+    start = get_monotonic_time();
+
+    timer_queue_lock(queue);
+    queue->armed_time_ns = 0;
+
+    while (queue->heap_size > 0 && queue->timers[queue->heap[0]].target_time_ns <= start) {
+        uint32_t slot = queue->heap[0];
+
+        timer = queue->timers[slot];
+        heap_remove(queue, 0);
+        free_timer_slot(queue, slot);
+
+        now = get_monotonic_time();
+        if (now > timer.target_time_ns) {
+            queue->stats.total_slack_ns += now - timer.target_time_ns;
+            queue->stats.max_slack_ns = MAX2(queue->stats.max_slack_ns, now - timer.target_time_ns);
+        }
+        queue->stats.n_executed++;
+
+        // Execute the task without holding the lock, so it can post or cancel other tasks.
+        timer_queue_unlock(queue);
+
+        ok = timer.callback(timer.has_data ? timer.data : timer.userdata);
+        if (ok != 0) {
+            LOG_ERROR("Error executing timed task: %s\n", strerror(ok));
+        }
+
+        timer_queue_lock(queue);
+    }
+
+    arm_timer_locked(queue);
+    timer_queue_unlock(queue);
+
+    return 0;
+}
+
+struct timer_queue *timer_queue_new(sd_event *loop) {
+    struct timer_queue *queue;
+    int ok;
+
+    ASSERT_NOT_NULL(loop);
+
+    queue = malloc(sizeof *queue);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (queue->timer_fd < 0) {
+        LOG_ERROR("Could not create timer queue timerfd. timerfd_create: %s\n", strerror(errno));
+        goto fail_free_queue;
+    }
+
+    ok = sd_event_add_io(loop, &queue->source, queue->timer_fd, EPOLLIN, on_timer_queue_ready, queue);
+    if (ok < 0) {
+        LOG_ERROR("Could not add timer queue to event loop. sd_event_add_io: %s\n", strerror(-ok));
+        goto fail_close_timer_fd;
+    }
+
+    pthread_mutex_init(&queue->mutex, get_default_mutex_attrs());
+    queue->timers = NULL;
+    queue->n_timers = 0;
+    queue->first_free = TIMER_SLOT_NONE;
+    queue->heap = NULL;
+    queue->heap_size = 0;
+    queue->next_sequence = 0;
+    queue->armed_time_ns = 0;
+    memset(&queue->stats, 0, sizeof queue->stats);
+    return queue;
+
+fail_close_timer_fd:
+    close(queue->timer_fd);
+
+fail_free_queue:
+    free(queue);
+    return NULL;
+}
+
+void timer_queue_destroy(struct timer_queue *queue) {
+    ASSERT_NOT_NULL(queue);
+
+    sd_event_source_disable_unref(queue->source);
+    close(queue->timer_fd);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->heap);
+    free(queue->timers);
+    free(queue);
+}
+
+static int post_timer(
+    struct timer_queue *queue,
+    task_queue_callback_t callback,
+    void *userdata,
+    const void *data,
+    size_t size,
+    uint64_t target_time_ns,
+    timer_queue_handle_t *handle_out
+) {
+    struct timer *timer;
+    uint32_t slot;
+    int ok;
+
+    ASSERT_NOT_NULL(queue);
+    ASSERT_NOT_NULL(callback);
+    ASSERT(size <= TASK_QUEUE_MAX_DATA_SIZE);
+
+    timer_queue_lock(queue);
+
+    if (queue->first_free == TIMER_SLOT_NONE) {
+        ok = grow_timer_slots(queue);
+        if (ok != 0) {
+            timer_queue_unlock(queue);
+            return ok;
+        }
+    }
+
+    slot = queue->first_free;
+    timer = queue->timers + slot;
+    queue->first_free = timer->index;
+
+    timer->target_time_ns = target_time_ns;
+    timer->sequence = queue->next_sequence++;
+    timer->callback = callback;
+    timer->userdata = userdata;
+    timer->has_data = data != NULL;
+    if (data != NULL) {
+        memcpy(timer->data, data, size);
+    }
+
+    queue->heap[queue->heap_size] = slot;
+    queue->heap_size++;
+    heap_sift_up(queue, queue->heap_size - 1);
+
+    queue->stats.n_posted++;
+    queue->stats.max_pending = MAX2(queue->stats.max_pending, queue->heap_size);
+
+    arm_timer_locked(queue);
+
+    if (handle_out != NULL) {
+        *handle_out = ((uint64_t) timer->generation << 32) | slot;
+    }
+
+    timer_queue_unlock(queue);
+    return 0;
+}
+
+int timer_queue_post(
+    struct timer_queue *queue,
+    task_queue_callback_t callback,
+    void *userdata,
+    uint64_t target_time_ns,
+    timer_queue_handle_t *handle_out
+) {
+    return post_timer(queue, callback, userdata, NULL, 0, target_time_ns, handle_out);
+}
+
+int timer_queue_post_with_data(
+    struct timer_queue *queue,
+    task_queue_callback_t callback,
+    const void *data,
+    size_t size,
+    uint64_t target_time_ns,
+    timer_queue_handle_t *handle_out
+) {
+    ASSERT_NOT_NULL(data);
+    return post_timer(queue, callback, NULL, data, size, target_time_ns, handle_out);
+}
+
+int timer_queue_cancel(struct timer_queue *queue, timer_queue_handle_t handle) {
+    struct timer *timer;
+    uint32_t slot, generation;
+
+    ASSERT_NOT_NULL(queue);
+
+    slot = handle & 0xFFFFFFFF;
+    generation = handle >> 32;
+
+    timer_queue_lock(queue);
+
+    if (slot >= queue->n_timers || queue->timers[slot].generation != generation) {
+        timer_queue_unlock(queue);
+        return ENOENT;
+    }
+
+    timer = queue->timers + slot;
+
+    // A free slot with a matching generation can only come from a made-up handle.
+    if (timer->index >= queue->heap_size || queue->heap[timer->index] != slot) {
+        timer_queue_unlock(queue);
+        return ENOENT;
+    }
+
+    heap_remove(queue, timer->index);
+    free_timer_slot(queue, slot);
+    queue->stats.n_cancelled++;
+
+    // We don't disarm or reprogram the timerfd here. If it fires too early,
+    // it'll just be armed again for the next deadline.
+    timer_queue_unlock(queue);
+    return 0;
+}
+
+void timer_queue_get_stats(struct timer_queue *queue, struct timer_queue_stats *stats_out) {
+    ASSERT_NOT_NULL(queue);
+    ASSERT_NOT_NULL(stats_out);
+
+    timer_queue_lock(queue);
+    *stats_out = queue->stats;
+    timer_queue_unlock(queue);
+}
+
 struct evloop {
     refcount_t n_refs;
     pthread_mutex_t mutex;
     sd_event *sdloop;
     int wakeup_fd;
     pthread_t owning_thread;
+    struct task_queue *tasks;
+    struct timer_queue *timers;
 };
 
 DEFINE_STATIC_LOCK_OPS(evloop, mutex)
@@ -65,7 +750,17 @@ struct evloop *evloop_new() {
     ok = sd_event_add_io(sdloop, NULL, wakeup_fd, EPOLLIN, on_wakeup_event_loop, NULL);
     if (ok < 0) {
         LOG_ERROR("Error adding wakeup callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
-        goto fail_unref_sdloop;
+        goto fail_close_wakeup_fd;
+    }
+
+    loop->tasks = task_queue_new(sdloop);
+    if (loop->tasks == NULL) {
+        goto fail_close_wakeup_fd;
+    }
+
+    loop->timers = timer_queue_new(sdloop);
+    if (loop->timers == NULL) {
+        goto fail_destroy_tasks;
     }
 
     loop->n_refs = REFCOUNT_INIT_1;
@@ -75,6 +770,12 @@ struct evloop *evloop_new() {
     loop->owning_thread = pthread_self();
     return loop;
 
+fail_destroy_tasks:
+    task_queue_destroy(loop->tasks);
+
+fail_close_wakeup_fd:
+    close(wakeup_fd);
+
 fail_unref_sdloop:
     sd_event_unref(sdloop);
 
@@ -84,6 +785,8 @@ fail_free_loop:
 }
 
 void evloop_destroy(struct evloop *loop) {
+    timer_queue_destroy(loop->timers);
+    task_queue_destroy(loop->tasks);
     sd_event_unref(loop->sdloop);
     close(loop->wakeup_fd);
     pthread_mutex_destroy(&loop->mutex);
@@ -242,131 +945,53 @@ struct task {
     void *userdata;
 };
 
-static int on_execute_task(sd_event_source *s, void *userdata) {
+static int on_execute_task(void *userdata) {
     struct task *task;
-    int ok;
 
     ASSERT_NOT_NULL(userdata);
     task = userdata;
 
     task->callback(task->userdata);
-    free(task);
-
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unref(s);
     return 0;
 }
 
 int evloop_post_task_locked(struct evloop *loop, void_callback_t callback, void *userdata) {
-    sd_event_source *src;
-    struct task *task;
-    int ok;
-
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
     ASSERT_MUTEX_LOCKED(loop->mutex);
 
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
-
-    task->callback = callback;
-    task->userdata = userdata;
-
-    ok = sd_event_add_defer(loop->sdloop, &src, on_execute_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error adding task to event loop. sd_event_add_defer: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_free_task;
-    }
-
-    return 0;
-
-fail_remove_src:
-    sd_event_source_disable_unref(src);
-
-fail_free_task:
-    free(task);
-    return ok;
+    return evloop_post_task(loop, callback, userdata);
 }
 
 int evloop_post_task(struct evloop *loop, void_callback_t callback, void *userdata) {
-    int ok;
-
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
 
-    evloop_lock(loop);
-    ok = evloop_post_task_locked(loop, callback, userdata);
-    evloop_unlock(loop);
-
-    wakeup_sdloop(loop);
-
-    return ok;
-}
-
-static int on_execute_delayed_task(sd_event_source *s, uint64_t usec, void *userdata) {
-    struct task *task;
-
-    ASSERT_NOT_NULL(userdata);
-    task = userdata;
-    (void) usec;
-
-    task->callback(task->userdata);
-    free(task);
-
-    sd_event_source_disable_unref(s);
-    return 0;
+    // The task queue is lock-free and wakes up the loop itself.
+    return task_queue_post_with_data(loop->tasks, on_execute_task, &(struct task){ .callback = callback, .userdata = userdata }, sizeof(struct task));
 }
 
 int evloop_post_delayed_task_locked(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec) {
-    sd_event_source *src;
-    struct task *task;
-    int ok;
-
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
     ASSERT_MUTEX_LOCKED(loop->mutex);
 
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
-
-    task->callback = callback;
-    task->userdata = userdata;
-
-    ok = sd_event_add_time(loop->sdloop, &src, CLOCK_MONOTONIC, target_time_usec, 1, on_execute_delayed_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_free_task;
-    }
-
-    return 0;
-
-fail_remove_src:
-    sd_event_source_disable_unref(src);
-
-fail_free_task:
-    free(task);
-    return ok;
+    return evloop_post_delayed_task(loop, callback, userdata, target_time_usec);
 }
 
 int evloop_post_delayed_task(struct evloop *loop, void_callback_t callback, void *userdata, uint64_t target_time_usec) {
-    int ok;
-
     ASSERT_NOT_NULL(loop);
     ASSERT_NOT_NULL(callback);
 
-    evloop_lock(loop);
-    ok = evloop_post_delayed_task_locked(loop, callback, userdata, target_time_usec);
-    evloop_unlock(loop);
-
-    wakeup_sdloop(loop);
-
-    return ok;
+    // The timer queue has its own lock and rearms its timerfd itself, so no need to wake up the loop.
+    return timer_queue_post_with_data(
+        loop->timers,
+        on_execute_task,
+        &(struct task){ .callback = callback, .userdata = userdata },
+        sizeof(struct task),
+        target_time_usec * 1000,
+        NULL
+    );
 }
 
 struct evsrc {
@@ -467,7 +1092,6 @@ struct evthread_startup_args {
 static void *evthread_entry(void *userdata) {
     struct evthread *evthread;
     struct evloop *evloop;
-    int ok;
 
     // initialization.
     {
@@ -488,6 +1112,7 @@ static void *evthread_entry(void *userdata) {
         evthread->loop = evloop;
         evthread->thread = pthread_self();
 
+        args->evthread = evthread;
         args->initialization_success = true;
         sem_post(&args->initialization_done);
         goto init_done;
@@ -504,7 +1129,7 @@ fail_post_semaphore:
 
 init_done:
     evloop_run(evloop);
-    sd_event_unrefp(&evthread->loop);
+    evloop_unref(evloop);
     return NULL;
 }
 
@@ -574,7 +1199,7 @@ struct evloop *evthread_get_evloop(struct evthread *thread) {
     return thread->loop;
 }
 
-void evthread_stop(struct evthread *thread) {
+void evthread_join(struct evthread *thread) {
     evloop_schedule_exit(thread->loop);
     pthread_join(thread->thread, NULL);
     free(thread);
@@ -10,8 +10,126 @@
 #ifndef _FLUTTER_DRM_EMBEDDER_SRC_EVENT_LOOP_H
 #define _FLUTTER_DRM_EMBEDDER_SRC_EVENT_LOOP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <systemd/sd-event.h>
+
+#include "util/collection.h"
 #include "util/refcounting.h"
 
+/**
+ * @brief A multi-producer, single-consumer queue of tasks executed on an sd-event loop.
+ *
+ * Tasks can be posted from any thread without locking. They're executed on the
+ * thread running the sd-event loop, in the order they were posted, in batches
+ * from a single persistent event source.
+ */
+struct task_queue;
+
+typedef int (*task_queue_callback_t)(void *userdata);
+
+/// Maximum size of the data that can be passed to task_queue_post_with_data.
+#define TASK_QUEUE_MAX_DATA_SIZE 16
+
+struct task_queue *task_queue_new(sd_event *loop);
+
+/**
+ * @brief Destroys the task queue. Tasks that were posted but not yet executed are dropped.
+ *
+ * Must be called on the thread running the event loop, and no other thread may
+ * post tasks anymore.
+ */
+void task_queue_destroy(struct task_queue *queue);
+
+int task_queue_post(struct task_queue *queue, task_queue_callback_t callback, void *userdata);
+
+/**
+ * @brief Posts a task and copies @a size bytes of @a data into the task itself.
+ *
+ * @a callback is called with a pointer to that copy as the userdata, which is only
+ * valid until @a callback returns. Saves an allocation for small task arguments.
+ */
+int task_queue_post_with_data(struct task_queue *queue, task_queue_callback_t callback, const void *data, size_t size);
+
+/**
+ * @brief A queue of tasks that should be executed at some point in the future,
+ * on an sd-event loop.
+ *
+ * All pending tasks are kept in a single min-heap and share a single timerfd,
+ * which is only reprogrammed when the earliest deadline changes. Tasks can be posted
+ * and cancelled from any thread.
+ */
+struct timer_queue;
+
+/**
+ * @brief Identifies a task posted to a timer queue, for cancelling it. Never zero.
+ */
+typedef uint64_t timer_queue_handle_t;
+
+struct timer_queue_stats {
+    /// Number of tasks posted, executed and cancelled so far.
+    uint64_t n_posted;
+    uint64_t n_executed;
+    uint64_t n_cancelled;
+
+    /// Number of times the timerfd had to be reprogrammed.
+    uint64_t n_timer_updates;
+
+    /// How late tasks were executed, compared to their target time.
+    uint64_t total_slack_ns;
+    uint64_t max_slack_ns;
+
+    /// Maximum number of tasks that were pending at the same time.
+    size_t max_pending;
+};
+
+struct timer_queue *timer_queue_new(sd_event *loop);
+
+/**
+ * @brief Destroys the timer queue. Pending tasks are dropped.
+ *
+ * Must be called on the thread running the event loop.
+ */
+void timer_queue_destroy(struct timer_queue *queue);
+
+/**
+ * @brief Posts a task that's executed as soon as possible after @a target_time_ns,
+ * which is a CLOCK_MONOTONIC timestamp in nanoseconds. (see get_monotonic_time)
+ *
+ * If @a handle_out is not NULL, it's set to a handle that can be used to cancel the task.
+ */
+int timer_queue_post(
+    struct timer_queue *queue,
+    task_queue_callback_t callback,
+    void *userdata,
+    uint64_t target_time_ns,
+    timer_queue_handle_t *handle_out
+);
+
+/**
+ * @brief Same as timer_queue_post, but copies @a size bytes of @a data into the task,
+ * like task_queue_post_with_data.
+ */
+int timer_queue_post_with_data(
+    struct timer_queue *queue,
+    task_queue_callback_t callback,
+    const void *data,
+    size_t size,
+    uint64_t target_time_ns,
+    timer_queue_handle_t *handle_out
+);
+
+/**
+ * @brief Cancels a pending task.
+ *
+ * @returns 0 if the task was cancelled and won't be executed, ENOENT if it was already
+ * executed (or is executing right now) or cancelled before.
+ */
+int timer_queue_cancel(struct timer_queue *queue, timer_queue_handle_t handle);
+
+void timer_queue_get_stats(struct timer_queue *queue, struct timer_queue_stats *stats_out);
+
 struct evloop;
 
 struct evloop *evloop_new();
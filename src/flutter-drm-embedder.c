@@ -6,10 +6,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <locale.h>
 #include <math.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -36,13 +38,17 @@
 #include <libudev.h>
 #include <linux/input.h>
 #include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <systemd/sd-event.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include "compositor_ng.h"
+#include "event_loop.h"
 #include "filesystem_layout.h"
+#include "frame_capture.h"
 #include "frame_scheduler.h"
+#include "frame_timings.h"
 #include "keyboard.h"
 #include "locales.h"
 #include "modesetting.h"
@@ -57,6 +63,7 @@
 #include "user_input.h"
 #include "util/list.h"
 #include "util/logging.h"
+#include "util/spsc_ring.h"
 #include "window.h"
 
 #include "config.h"
@@ -108,6 +115,15 @@ OPTIONS:\n\
     "\
                              NOTE: This flutter-drm-embedder executable was built without\n\
                              vulkan support.\n"
+#endif
+    "\n\
+  --software                 Render on the CPU, without any GPU driver. Frames\n\
+                             are scanned out using DRM dumb buffers, or kept in\n\
+                             memory when using --dummy-display.\n"
+#ifndef HAVE_SOFTWARE
+    "\
+                             NOTE: This flutter-drm-embedder executable was built without\n\
+                             software rendering support.\n"
 #endif
     "\n\
   -o, --orientation <orientation>  Start the app in this orientation. Valid\n\
@@ -146,8 +162,75 @@ OPTIONS:\n\
                              without a display attached.\n\
   --dummy-display-size \"width,height\" The width & height of the dummy display\n\
                              in pixels.\n\
+  --dummy-display-capture <target>  Composite every frame offscreen and write\n\
+                             it to <target>. Implies --dummy-display and needs\n\
+                             OpenGL (software rendering using llvmpipe works).\n\
+                             Valid targets are:\n\
+                               null            (don't write the frames anywhere,\n\
+                                                for benchmarking)\n\
+                               png:<directory> (one PNG image per frame)\n\
+                               raw:<path>      (all frames as raw RGBA pixels,\n\
+                                                \"-\" for stdout)\n\
+                               shm:<name>      (a shared memory ring buffer of\n\
+                                                the most recent frames)\n\
+  --dummy-display-timings <path>  Write the compositing, readback & write time\n\
+                             of every captured frame to <path> as CSV.\n\
+                             Needs --dummy-display-capture.\n\
 \n\
     --drm-fd                   An opened and valid DRM file descriptor\n\
+\n\
+  --frame-stats <seconds>    Print frame timing statistics (latency percentiles\n\
+                             for every stage of a frame, late & dropped frames)\n\
+                             to stderr every <seconds> seconds.\n\
+\n\
+  --trace <path>             Record trace events from startup and write them to\n\
+                             <path> on exit. Paths ending in .pftrace are written\n\
+                             as perfetto traces, everything else as Chrome JSON.\n\
+                             Independent of this option, sending SIGUSR2 starts\n\
+                             recording, and sending it again writes the trace to\n\
+                             <path> (or /tmp/flutter-drm-embedder-<pid>.json) and\n\
+                             stops recording.\n\
+\n\
+  --plugin-loading <modes>   Comma-separated list of how GTK plugins are loaded.\n\
+                             Valid values are:\n\
+                               parallel  (load plugin libraries on worker threads)\n\
+                               lazy      (bind plugin symbols on first use)\n\
+                               manifest  (cache scanned plugins & their channels\n\
+                                          in <asset bundle path>/gtk_plugins.manifest)\n\
+                               deferred  (load plugins known from the manifest on\n\
+                                          the first message to one of their channels,\n\
+                                          implies manifest)\n\
+                               fast      (same as parallel,lazy,manifest)\n\
+                             By default, all plugins are loaded serially on startup.\n\
+\n\
+  --input-thread             Read & process touch, mouse and keyboard input on a\n\
+                             dedicated thread, so input isn't delayed when the\n\
+                             platform thread is busy.\n\
+  --input-thread-priority <priority>  Run the input thread with the SCHED_FIFO\n\
+                             real-time scheduling policy and this priority\n\
+                             (1 - 99). Implies --input-thread. Needs CAP_SYS_NICE\n\
+                             or a sufficient RLIMIT_RTPRIO.\n\
+  --touch-resampling <mode>  How touch moves are sent to flutter. One of:\n\
+                               off       (every touch move is sent as-is)\n\
+                               coalesce  (only the latest touch move of each\n\
+                                          touch point is sent, with\n\
+                                          --input-thread once per frame,\n\
+                                          shortly before the next vblank)\n\
+                               resample  (like coalesce, but the position is\n\
+                                          interpolated to a fixed time before\n\
+                                          the vblank, for smoother scrolling.\n\
+                                          Implies --input-thread)\n\
+                             The default is off.\n\
+  --input-record <path>      Record all touch, mouse and keyboard input events\n\
+                             to a binary trace at <path>, for --input-replay.\n\
+  --input-replay <path>      Replay the input events recorded in the trace at\n\
+                             <path> instead of using the real input devices.\n\
+                             Once the trace is finished, the frame stats are\n\
+                             printed and flutter-drm-embedder exits. Implies\n\
+                             --input-thread. Useful together with\n\
+                             --dummy-display for repeatable benchmarks.\n\
+  --input-replay-speed <factor>  Replay the input trace <factor> times faster\n\
+                             than it was recorded. The default is 1.\n\
 \n\
     -V, --version                Show version and exit.\n\
 \n\
@@ -194,6 +277,12 @@ struct flutter_drm_embedder {
 	 */
     struct compositor *compositor;
 
+    /**
+	 * @brief Answers flutter vsync requests, aligned to the display's vblanks.
+	 *
+	 */
+    struct frame_scheduler *scheduler;
+
     /**
 	 * @brief Event source which represents the compositor event fd as registered to the
 	 * event loop.
@@ -240,7 +329,7 @@ struct flutter_drm_embedder {
         FlutterEngine engine;
         FlutterEngineAOTData aot_data;
 
-        bool next_frame_request_is_secondary;
+        atomic_bool next_frame_request_is_secondary;
     } flutter;
 
     /// main event loop
@@ -249,6 +338,10 @@ struct flutter_drm_embedder {
     sd_event *event_loop;
     int wakeup_event_loop_fd;
 
+    /// platform tasks, executed on the main event loop.
+    struct task_queue *platform_tasks;
+    struct timer_queue *platform_timers;
+
     struct evloop *evloop;
 
     /**
@@ -270,6 +363,7 @@ struct flutter_drm_embedder {
      */
     struct texture_registry *texture_registry;
 
+    enum renderer_type renderer_type;
     struct gl_renderer *gl_renderer;
     struct vk_renderer *vk_renderer;
 
@@ -277,7 +371,40 @@ struct flutter_drm_embedder {
     struct list_head fd_for_device_id;
     bool session_active;
 
+    /**
+     * @brief Whether user input is processed on a dedicated thread.
+     *
+     * In that case, evdev devices are opened & closed on the input thread, so all
+     * libseat calls (and @ref fd_for_device_id) are protected by @ref libseat_mutex.
+     */
+    bool use_input_thread;
+    int input_thread_priority;
+    pthread_mutex_t libseat_mutex;
+
+    /**
+     * @brief User input events the input thread handed to the platform thread, see @ref maybe_defer_input_event.
+     *
+     * The input thread is the only producer, the platform thread the only consumer.
+     * @ref deferred_input_events_posted is set while a platform task to drain the ring is pending,
+     * so the input thread doesn't post one for every event.
+     *
+     * When the ring is full, events are posted as separate platform tasks instead.
+     * @ref n_overflowed_input_events counts those that haven't been handled yet. While it's
+     * non-zero, new events take the same route so they're not handled before older ones.
+     */
+    struct spsc_ring deferred_input_events;
+    atomic_bool deferred_input_events_posted;
+    atomic_uint n_overflowed_input_events;
+
     char *desired_videomode;
+
+    /// If non-zero, frame timing stats are printed to stderr with this period.
+    uint64_t frame_stats_interval_ns;
+
+    /// Where recorded trace events are written to. NULL if --trace wasn't given.
+    char *trace_path;
+
+    struct gtk_plugin_loader_options gtk_plugin_loader_options;
 };
 
 struct device_id_and_fd {
@@ -461,6 +588,20 @@ UNUSED static bool on_present_vulkan_image(void *userdata, const FlutterVulkanIm
     UNREACHABLE();
 }
 
+UNUSED static bool on_present_software_surface(void *userdata, const void *allocation, size_t row_bytes, size_t height) {
+    ASSERT_NOT_NULL(userdata);
+    ASSERT_NOT_NULL(allocation);
+    (void) userdata;
+    (void) allocation;
+    (void) row_bytes;
+    (void) height;
+
+    // We always specify a compositor, so flutter presents the software backing stores
+    // filled by sw_render_surface using that instead.
+    LOG_ERROR("Flutter tried to present a software surface without using the compositor.\n");
+    return false;
+}
+
 static void on_platform_message(const FlutterPlatformMessage *message, void *userdata) {
     int ok;
 
@@ -505,54 +646,25 @@ static int on_deferred_begin_frame(void *userdata) {
     return 0;
 }
 
-UNUSED static void on_begin_frame(void *userdata, uint64_t vblank_ns, uint64_t next_vblank_ns) {
+/// Called by the frame scheduler (on any thread) when a vsync request should be answered.
+static void on_begin_frame(void *userdata, intptr_t baton, uint64_t vblank_ns, uint64_t next_vblank_ns) {
     FlutterEngineResult engine_result;
     struct frame_req *req;
     int ok;
 
-    ASSERT_NOT_NULL(userdata);
-    req = userdata;
+    (void) userdata;
 
-    if (flutter_drm_embedder_runs_platform_tasks_on_current_thread(req->flutter_drm_embedder)) {
-        TRACER_INSTANT(req->flutter_drm_embedder->tracer, "FlutterEngineOnVsync");
+    if (flutter_drm_embedder_runs_platform_tasks_on_current_thread(flutter_drm_embedder)) {
+        TRACER_INSTANT(flutter_drm_embedder->tracer, "FlutterEngineOnVsync");
 
-        engine_result = req->flutter_drm_embedder->flutter.procs.OnVsync(req->flutter_drm_embedder->flutter.engine, req->baton, vblank_ns, next_vblank_ns);
+        engine_result = flutter_drm_embedder->flutter.procs.OnVsync(flutter_drm_embedder->flutter.engine, baton, vblank_ns, next_vblank_ns);
         if (engine_result != kSuccess) {
             LOG_ERROR("Couldn't signal frame begin to flutter engine. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-            goto fail_free_req;
         }
 
-        free(req);
-    } else {
-        req->vblank_ns = vblank_ns;
-        req->next_vblank_ns = next_vblank_ns;
-        ok = flutter_drm_embedder_post_platform_task(on_deferred_begin_frame, req);
-        if (ok != 0) {
-            LOG_ERROR("Couldn't defer signalling frame begin.\n");
-            goto fail_free_req;
-        }
+        return;
     }
 
-    return;
-
-fail_free_req:
-    free(req);
-    return;
-}
-
-/// Called on some flutter internal thread to request a frame,
-/// and also get the vblank timestamp of the pageflip preceding that frame.
-UNUSED static void on_frame_request(void *userdata, intptr_t baton) {
-    FlutterEngineResult engine_result;
-    struct flutter_drm_embedder *flutter_drm_embedder;
-    struct frame_req *req;
-    int ok;
-
-    ASSERT_NOT_NULL(userdata);
-    flutter_drm_embedder = userdata;
-
-    TRACER_INSTANT(flutter_drm_embedder->tracer, "on_frame_request");
-
     req = malloc(sizeof *req);
     if (req == NULL) {
         LOG_ERROR("Out of memory\n");
@@ -561,32 +673,27 @@ UNUSED static void on_frame_request(void *userdata, intptr_t baton) {
 
     req->flutter_drm_embedder = flutter_drm_embedder;
     req->baton = baton;
-    req->vblank_ns = get_monotonic_time();
-    req->next_vblank_ns = req->vblank_ns + (1000000000.0 / compositor_get_refresh_rate(flutter_drm_embedder->compositor));
-
-    if (flutter_drm_embedder_runs_platform_tasks_on_current_thread(req->flutter_drm_embedder)) {
-        TRACER_INSTANT(req->flutter_drm_embedder->tracer, "FlutterEngineOnVsync");
-
-        engine_result =
-            req->flutter_drm_embedder->flutter.procs.OnVsync(req->flutter_drm_embedder->flutter.engine, req->baton, req->vblank_ns, req->next_vblank_ns);
-        if (engine_result != kSuccess) {
-            LOG_ERROR("Couldn't signal frame begin to flutter engine. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
-            goto fail_free_req;
-        }
+    req->vblank_ns = vblank_ns;
+    req->next_vblank_ns = next_vblank_ns;
 
+    ok = flutter_drm_embedder_post_platform_task(on_deferred_begin_frame, req);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't defer signalling frame begin.\n");
         free(req);
-    } else {
-        ok = flutter_drm_embedder_post_platform_task(on_deferred_begin_frame, req);
-        if (ok != 0) {
-            LOG_ERROR("Couldn't defer signalling frame begin.\n");
-            goto fail_free_req;
-        }
     }
+}
 
-    return;
+/// Called on some flutter internal thread to request a frame,
+/// and also get the vblank timestamp of the pageflip preceding that frame.
+static void on_frame_request(void *userdata, intptr_t baton) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
 
-fail_free_req:
-    free(req);
+    ASSERT_NOT_NULL(userdata);
+    flutter_drm_embedder = userdata;
+
+    TRACER_INSTANT(flutter_drm_embedder->tracer, "on_frame_request");
+
+    frame_scheduler_on_fl_vsync_request(flutter_drm_embedder->scheduler, baton);
 }
 
 UNUSED static FlutterTransformation on_get_transformation(void *userdata) {
@@ -601,143 +708,14 @@ UNUSED static FlutterTransformation on_get_transformation(void *userdata) {
     return MAT3F_AS_FLUTTER_TRANSFORM(geometry.view_to_display_transform);
 }
 
-atomic_int_least64_t platform_task_counter = 0;
-
 /// platform tasks
-static int on_execute_platform_task(sd_event_source *s, void *userdata) {
-    struct platform_task *task;
-    int ok;
-
-    task = userdata;
-    ok = task->callback(task->userdata);
-    if (ok != 0) {
-        LOG_ERROR("Error executing platform task: %s\n", strerror(ok));
-    }
-
-    free(task);
-
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unrefp(&s);
-
-    return 0;
-}
-
 int flutter_drm_embedder_post_platform_task(int (*callback)(void *userdata), void *userdata) {
-    struct platform_task *task;
-    sd_event_source *src;
-    int ok;
-
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
-
-    task->callback = callback;
-    task->userdata = userdata;
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_lock(&flutter_drm_embedder->event_loop_mutex);
-    }
-
-    ok = sd_event_add_defer(flutter_drm_embedder->event_loop, &src, on_execute_platform_task, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_defer: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
-    }
-
-    // Higher values mean lower priority. So later platform tasks are handled later too.
-    sd_event_source_set_priority(src, atomic_fetch_add(&platform_task_counter, 1));
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        ok = write(flutter_drm_embedder->wakeup_event_loop_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-        if (ok < 0) {
-            ok = errno;
-            LOG_ERROR("Error arming main loop for platform task. write: %s\n", strerror(ok));
-            goto fail_unlock_event_loop;
-        }
-    }
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_unlock(&flutter_drm_embedder->event_loop_mutex);
-    }
-
-    return 0;
-
-fail_unlock_event_loop:
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_unlock(&flutter_drm_embedder->event_loop_mutex);
-    }
-
-    return ok;
+    return task_queue_post(flutter_drm_embedder->platform_tasks, callback, userdata);
 }
 
 /// timed platform tasks
-static int on_execute_platform_task_with_time(sd_event_source *s, uint64_t usec, void *userdata) {
-    struct platform_task *task;
-    int ok;
-
-    (void) usec;
-
-    task = userdata;
-    ok = task->callback(task->userdata);
-    if (ok != 0) {
-        LOG_ERROR("Error executing timed platform task: %s\n", strerror(ok));
-    }
-
-    free(task);
-
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unrefp(&s);
-
-    return 0;
-}
-
 int flutter_drm_embedder_post_platform_task_with_time(int (*callback)(void *userdata), void *userdata, uint64_t target_time_usec) {
-    struct platform_task *task;
-    //sd_event_source *source;
-    int ok;
-
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
-
-    task->callback = callback;
-    task->userdata = userdata;
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_lock(&flutter_drm_embedder->event_loop_mutex);
-    }
-
-    ok = sd_event_add_time(flutter_drm_embedder->event_loop, NULL, CLOCK_MONOTONIC, target_time_usec, 1, on_execute_platform_task_with_time, task);
-    if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
-    }
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        ok = write(flutter_drm_embedder->wakeup_event_loop_fd, (uint8_t[8]){ 0, 0, 0, 0, 0, 0, 0, 1 }, 8);
-        if (ok < 0) {
-            perror("[flutter-drm-embedder] Error arming main loop for platform task. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
-    }
-
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_unlock(&flutter_drm_embedder->event_loop_mutex);
-    }
-
-    return 0;
-
-fail_unlock_event_loop:
-    if (pthread_self() != flutter_drm_embedder->event_loop_thread) {
-        pthread_mutex_unlock(&flutter_drm_embedder->event_loop_mutex);
-    }
-    free(task);
-    return ok;
+    return timer_queue_post(flutter_drm_embedder->platform_timers, callback, userdata, target_time_usec * 1000, NULL);
 }
 
 int flutter_drm_embedder_sd_event_add_io(sd_event_source **source_out, int fd, uint32_t events, sd_event_io_handler_t callback, void *userdata) {
@@ -785,31 +763,29 @@ static int on_execute_flutter_task(void *userdata) {
     result = flutter_drm_embedder->flutter.procs.RunTask(flutter_drm_embedder->flutter.engine, task);
     if (result != kSuccess) {
         LOG_ERROR("Error running platform task. FlutterEngineRunTask: %d\n", result);
-        free(task);
         return EINVAL;
     }
 
-    free(task);
-
     return 0;
 }
 
 static void on_post_flutter_task(FlutterTask task, uint64_t target_time, void *userdata) {
-    FlutterTask *dup_task;
     int ok;
 
     (void) userdata;
 
-    dup_task = malloc(sizeof *dup_task);
-    if (dup_task == NULL) {
-        return;
-    }
+    static_assert(sizeof task <= TASK_QUEUE_MAX_DATA_SIZE, "FlutterTask must fit into a task queue node.");
 
-    *dup_task = task;
+    // Most engine tasks are due immediately, those skip the timer queue.
+    // Either way, the task is copied into the queue, so it doesn't need an allocation.
+    if (target_time <= get_monotonic_time()) {
+        ok = task_queue_post_with_data(flutter_drm_embedder->platform_tasks, on_execute_flutter_task, &task, sizeof task);
+    } else {
+        ok = timer_queue_post_with_data(flutter_drm_embedder->platform_timers, on_execute_flutter_task, &task, sizeof task, target_time, NULL);
+    }
 
-    ok = flutter_drm_embedder_post_platform_task_with_time(on_execute_flutter_task, dup_task, target_time / 1000);
     if (ok != 0) {
-        free(dup_task);
+        LOG_ERROR("Couldn't post flutter task: %s\n", strerror(ok));
     }
 }
 
@@ -983,6 +959,12 @@ struct plugin_registry *flutter_drm_embedder_get_plugin_registry(struct flutter_
     return flutter_drm_embedder->plugin_registry;
 }
 
+struct frame_timings *flutter_drm_embedder_get_frame_timings(struct flutter_drm_embedder *flutter_drm_embedder) {
+    ASSERT_NOT_NULL(flutter_drm_embedder);
+    ASSERT_NOT_NULL(flutter_drm_embedder->scheduler);
+    return frame_scheduler_get_frame_timings(flutter_drm_embedder->scheduler);
+}
+
 FlutterPlatformMessageResponseHandle *
 flutter_drm_embedder_create_platform_message_response_handle(struct flutter_drm_embedder *flutter_drm_embedder, FlutterDataCallback data_callback, void *userdata) {
     FlutterPlatformMessageResponseHandle *handle;
@@ -1064,16 +1046,71 @@ void flutter_drm_embedder_set_pointer_kind(struct flutter_drm_embedder *flutter_
     return compositor_set_cursor(flutter_drm_embedder->compositor, false, false, true, kind, false, VEC2F(0, 0));
 }
 
+/// Plugins can pass names that don't outlive the call, but recorded events
+/// only keep a pointer to their name until the trace is exported.
+static const char *intern_trace_event_name(struct flutter_drm_embedder *flutter_drm_embedder, const char *name) {
+    if (!tracer_is_recording(flutter_drm_embedder->tracer)) {
+        return name;
+    }
+
+    return tracer_intern_name(flutter_drm_embedder->tracer, name);
+}
+
 void flutter_drm_embedder_trace_event_instant(struct flutter_drm_embedder *flutter_drm_embedder, const char *name) {
-    flutter_drm_embedder->flutter.procs.TraceEventInstant(name);
+    name = intern_trace_event_name(flutter_drm_embedder, name);
+    if (name != NULL) {
+        __tracer_instant(flutter_drm_embedder->tracer, name);
+    }
 }
 
 void flutter_drm_embedder_trace_event_begin(struct flutter_drm_embedder *flutter_drm_embedder, const char *name) {
-    flutter_drm_embedder->flutter.procs.TraceEventDurationBegin(name);
+    name = intern_trace_event_name(flutter_drm_embedder, name);
+    if (name != NULL) {
+        __tracer_begin(flutter_drm_embedder->tracer, name);
+    }
 }
 
 void flutter_drm_embedder_trace_event_end(struct flutter_drm_embedder *flutter_drm_embedder, const char *name) {
-    flutter_drm_embedder->flutter.procs.TraceEventDurationEnd(name);
+    name = intern_trace_event_name(flutter_drm_embedder, name);
+    if (name != NULL) {
+        __tracer_end(flutter_drm_embedder->tracer, name);
+    }
+}
+
+static void write_trace(struct flutter_drm_embedder *flutter_drm_embedder) {
+    char default_path[64];
+    const char *path;
+    int ok;
+
+    if (flutter_drm_embedder->trace_path != NULL) {
+        path = flutter_drm_embedder->trace_path;
+    } else {
+        snprintf(default_path, sizeof default_path, "/tmp/flutter-drm-embedder-%d.json", (int) getpid());
+        path = default_path;
+    }
+
+    ok = tracer_export_to_path(flutter_drm_embedder->tracer, path);
+    if (ok == 0) {
+        fprintf(stderr, "Wrote trace to \"%s\".\n", path);
+    }
+}
+
+static int on_trace_signal(sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+
+    (void) s;
+    (void) si;
+
+    flutter_drm_embedder = userdata;
+
+    if (tracer_is_recording(flutter_drm_embedder->tracer)) {
+        tracer_stop_recording(flutter_drm_embedder->tracer);
+        write_trace(flutter_drm_embedder);
+    } else {
+        tracer_start_recording(flutter_drm_embedder->tracer);
+    }
+
+    return 0;
 }
 
 static bool runs_platform_tasks_on_current_thread(void *userdata) {
@@ -1279,6 +1316,7 @@ static int on_mark_texture_frame_available(void *userdata, int64_t texture_ident
 }
 
 static FlutterEngine create_flutter_engine(
+    enum renderer_type renderer_type,
     struct vk_renderer *vk_renderer,
     struct flutter_paths *paths,
     int engine_argc,
@@ -1294,7 +1332,7 @@ static FlutterEngine create_flutter_engine(
     memset(&renderer_config, 0, sizeof(renderer_config));
 
     // configure flutter rendering
-    if (vk_renderer) {
+    if (renderer_type == kVulkan_RendererType) {
 #ifdef HAVE_VULKAN
         renderer_config.type = kVulkan;
         renderer_config.vulkan.struct_size = sizeof(FlutterVulkanRendererConfig);
@@ -1311,10 +1349,20 @@ static FlutterEngine create_flutter_engine(
         renderer_config.vulkan.get_instance_proc_address_callback = on_get_vulkan_proc_address;
         renderer_config.vulkan.get_next_image_callback = on_get_next_vulkan_image;
         renderer_config.vulkan.present_image_callback = on_present_vulkan_image;
+#else
+        (void) vk_renderer;
+        UNREACHABLE();
+#endif
+    } else if (renderer_type == kSoftware_RendererType) {
+#ifdef HAVE_SOFTWARE
+        renderer_config.type = kSoftware;
+        renderer_config.software.struct_size = sizeof(FlutterSoftwareRendererConfig);
+        renderer_config.software.surface_present_callback = on_present_software_surface;
 #else
         UNREACHABLE();
 #endif
     } else {
+        ASSUME(renderer_type == kOpenGL_RendererType);
 #ifdef HAVE_EGL_GLES2
         renderer_config.type = kOpenGL;
         renderer_config.open_gl.struct_size = sizeof(FlutterOpenGLRendererConfig);
@@ -1373,7 +1421,7 @@ static FlutterEngine create_flutter_engine(
     project_args.update_semantics_custom_action_callback = NULL;
     project_args.persistent_cache_path = paths->asset_bundle_path;
     project_args.is_persistent_cache_read_only = false;
-    project_args.vsync_callback = NULL;  // on_frame_request, /* broken since 2.2, kinda *
+    project_args.vsync_callback = on_frame_request;
     project_args.custom_dart_entrypoint = NULL;
     project_args.custom_task_runners = &custom_task_runners;
     project_args.shutdown_dart_vm_when_done = true;
@@ -1399,6 +1447,32 @@ static FlutterEngine create_flutter_engine(
     return engine;
 }
 
+static int on_print_frame_stats(void *userdata) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+
+    flutter_drm_embedder = userdata;
+
+    frame_timings_print_stats(flutter_drm_embedder_get_frame_timings(flutter_drm_embedder), stderr);
+
+    if (flutter_drm_embedder->user_input != NULL) {
+        struct user_input_stats stats;
+
+        user_input_get_stats(flutter_drm_embedder->user_input, &stats);
+        fprintf(stderr, "touch moves: %" PRIu64 " in, %" PRIu64 " out\n", stats.n_touch_moves_in, stats.n_touch_moves_out);
+        if (stats.n_replayed_events != 0) {
+            fprintf(stderr, "replayed input events: %" PRIu64 "\n", stats.n_replayed_events);
+        }
+    }
+
+    return timer_queue_post(
+        flutter_drm_embedder->platform_timers,
+        on_print_frame_stats,
+        flutter_drm_embedder,
+        get_monotonic_time() + flutter_drm_embedder->frame_stats_interval_ns,
+        NULL
+    );
+}
+
 static int flutter_drm_embedder_run(struct flutter_drm_embedder *flutter_drm_embedder) {
     FlutterEngineProcTable *procs;
     struct view_geometry geometry;
@@ -1426,6 +1500,7 @@ static int flutter_drm_embedder_run(struct flutter_drm_embedder *flutter_drm_emb
     }
 
     engine = create_flutter_engine(
+        flutter_drm_embedder->renderer_type,
         flutter_drm_embedder->vk_renderer,
         flutter_drm_embedder->flutter.paths,
         flutter_drm_embedder->flutter.engine_argc,
@@ -1500,6 +1575,26 @@ static int flutter_drm_embedder_run(struct flutter_drm_embedder *flutter_drm_emb
         goto fail_shutdown_engine;
     }
 
+    if (flutter_drm_embedder->use_input_thread && flutter_drm_embedder->user_input != NULL) {
+        ok = user_input_start_thread(flutter_drm_embedder->user_input, flutter_drm_embedder->input_thread_priority);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't start input thread. flutter-drm-embedder will run without user input.\n");
+        }
+    }
+
+    if (flutter_drm_embedder->frame_stats_interval_ns != 0) {
+        ok = timer_queue_post(
+            flutter_drm_embedder->platform_timers,
+            on_print_frame_stats,
+            flutter_drm_embedder,
+            get_monotonic_time() + flutter_drm_embedder->frame_stats_interval_ns,
+            NULL
+        );
+        if (ok != 0) {
+            LOG_ERROR("Could not schedule printing frame stats. timer_queue_post: %s\n", strerror(ok));
+        }
+    }
+
     pthread_mutex_lock(&flutter_drm_embedder->event_loop_mutex);
 
     ok = sd_event_get_fd(flutter_drm_embedder->event_loop);
@@ -1582,6 +1677,12 @@ static int flutter_drm_embedder_run(struct flutter_drm_embedder *flutter_drm_emb
         pthread_mutex_unlock(&flutter_drm_embedder->event_loop_mutex);
     }
 
+    // Make sure the input thread doesn't send any more pointer events
+    // to the engine after it was shut down.
+    if (flutter_drm_embedder->user_input != NULL) {
+        user_input_stop_thread(flutter_drm_embedder->user_input);
+    }
+
     // We deinitialize the plugins here so plugins don't attempt to use the
     // flutter engine anymore.
     // For example, otherwise the gstreamer video player might call
@@ -1593,6 +1694,9 @@ static int flutter_drm_embedder_run(struct flutter_drm_embedder *flutter_drm_emb
     return 0;
 
 fail_shutdown_engine:
+    if (flutter_drm_embedder->user_input != NULL) {
+        user_input_stop_thread(flutter_drm_embedder->user_input);
+    }
     flutter_drm_embedder->flutter.procs.Shutdown(engine);
     return ok;
 
@@ -1650,8 +1754,7 @@ static void on_flutter_pointer_event(void *userdata, const FlutterPointerEvent *
     ASSERT_NOT_NULL(userdata);
     flutter_drm_embedder = userdata;
 
-    /// TODO: make this atomic
-    flutter_drm_embedder->flutter.next_frame_request_is_secondary = true;
+    atomic_store_explicit(&flutter_drm_embedder->flutter.next_frame_request_is_secondary, true, memory_order_relaxed);
 
     engine_result = flutter_drm_embedder->flutter.procs.SendPointerEvent(flutter_drm_embedder->flutter.engine, events, n_events);
     if (engine_result != kSuccess) {
@@ -1663,33 +1766,221 @@ static void on_flutter_pointer_event(void *userdata, const FlutterPointerEvent *
     }
 }
 
-static void on_utf8_character(void *userdata, uint8_t *character) {
-    struct flutter_drm_embedder *flutter_drm_embedder;
-    int ok;
+/*
+ * With --input-thread, the user input callbacks are called on the input thread.
+ * Pointer events can be sent to the engine from any thread, but everything else
+ * (keyboard events for the plugins, cursor updates, VT switches) is handled on the
+ * platform thread, so it's deferred to there.
+ */
+#define N_DEFERRED_INPUT_EVENTS 256
 
-    flutter_drm_embedder = userdata;
+enum deferred_input_event_type {
+    kUtf8Character_DeferredInputEventType,
+    kXkbKeysym_DeferredInputEventType,
+    kGtkKeyevent_DeferredInputEventType,
+    kSwitchVt_DeferredInputEventType,
+    kSetCursorEnabled_DeferredInputEventType,
+    kMoveCursor_DeferredInputEventType,
+};
 
-    (void) flutter_drm_embedder;
+struct deferred_input_event {
+    enum deferred_input_event_type type;
+    union {
+        uint8_t utf8_character[5];
+        xkb_keysym_t keysym;
+        struct {
+            uint32_t unicode_scalar_values;
+            uint32_t key_code;
+            uint32_t scan_code;
+            uint32_t modifiers;
+            bool is_down;
+        } gtk_keyevent;
+        int vt;
+        bool cursor_enabled;
+        struct vec2f cursor_delta;
+    };
+};
 
-#ifdef BUILD_TEXT_INPUT_PLUGIN
-    ok = textin_on_utf8_char(character);
-    if (ok != 0) {
-        LOG_ERROR("Error handling keyboard event. textin_on_utf8_char: %s\n", strerror(ok));
-        //flutter_drm_embedder_schedule_exit(flutter_drm_embedder);
+static void on_utf8_character(void *userdata, uint8_t *character);
+static void on_xkb_keysym(void *userdata, xkb_keysym_t keysym);
+static void
+on_gtk_keyevent(void *userdata, uint32_t unicode_scalar_values, uint32_t key_code, uint32_t scan_code, uint32_t modifiers, bool is_down);
+static void on_switch_vt(void *userdata, int vt);
+static void on_set_cursor_enabled(void *userdata, bool enabled);
+static void on_move_cursor(void *userdata, struct vec2f delta);
+
+static void handle_deferred_input_event(struct flutter_drm_embedder *fpi, struct deferred_input_event *event) {
+    switch (event->type) {
+        case kUtf8Character_DeferredInputEventType: on_utf8_character(fpi, event->utf8_character); break;
+        case kXkbKeysym_DeferredInputEventType: on_xkb_keysym(fpi, event->keysym); break;
+        case kGtkKeyevent_DeferredInputEventType:
+            on_gtk_keyevent(
+                fpi,
+                event->gtk_keyevent.unicode_scalar_values,
+                event->gtk_keyevent.key_code,
+                event->gtk_keyevent.scan_code,
+                event->gtk_keyevent.modifiers,
+                event->gtk_keyevent.is_down
+            );
+            break;
+        case kSwitchVt_DeferredInputEventType: on_switch_vt(fpi, event->vt); break;
+        case kSetCursorEnabled_DeferredInputEventType: on_set_cursor_enabled(fpi, event->cursor_enabled); break;
+        case kMoveCursor_DeferredInputEventType: on_move_cursor(fpi, event->cursor_delta); break;
+        default: UNREACHABLE();
     }
-#endif
 }
 
-static void on_xkb_keysym(void *userdata, xkb_keysym_t keysym) {
+static int on_deferred_input_events(void *userdata) {
     struct flutter_drm_embedder *flutter_drm_embedder;
-    int ok;
+    struct deferred_input_event event;
 
+    ASSERT_NOT_NULL(userdata);
     flutter_drm_embedder = userdata;
-    (void) flutter_drm_embedder;
 
-#ifdef BUILD_TEXT_INPUT_PLUGIN
-    ok = textin_on_xkb_keysym(keysym);
-    if (ok != 0) {
+    // Clear this before draining, so events pushed while we're draining
+    // either get drained now or post a new task.
+    atomic_store(&flutter_drm_embedder->deferred_input_events_posted, false);
+
+    while (spsc_ring_pop(&flutter_drm_embedder->deferred_input_events, &event)) {
+        handle_deferred_input_event(flutter_drm_embedder, &event);
+    }
+
+    return 0;
+}
+
+struct overflowed_input_event {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    struct deferred_input_event event;
+};
+
+static int on_overflowed_input_event(void *userdata) {
+    struct overflowed_input_event *overflowed;
+
+    ASSERT_NOT_NULL(userdata);
+    overflowed = userdata;
+
+    handle_deferred_input_event(overflowed->flutter_drm_embedder, &overflowed->event);
+    atomic_fetch_sub(&overflowed->flutter_drm_embedder->n_overflowed_input_events, 1);
+
+    free(overflowed);
+    return 0;
+}
+
+static void post_deferred_input_events(struct flutter_drm_embedder *flutter_drm_embedder) {
+    int ok;
+
+    if (!atomic_exchange(&flutter_drm_embedder->deferred_input_events_posted, true)) {
+        ok = flutter_drm_embedder_post_platform_task(on_deferred_input_events, flutter_drm_embedder);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't defer user input events to the platform thread.\n");
+            atomic_store(&flutter_drm_embedder->deferred_input_events_posted, false);
+        }
+    }
+}
+
+/**
+ * @brief Posts @a event as a platform task of its own, for when the ring is full.
+ */
+static void post_overflowed_input_event(struct flutter_drm_embedder *flutter_drm_embedder, const struct deferred_input_event *event) {
+    struct overflowed_input_event *overflowed;
+    int ok;
+
+    overflowed = malloc(sizeof *overflowed);
+    if (overflowed == NULL) {
+        goto fail_log;
+    }
+
+    overflowed->flutter_drm_embedder = flutter_drm_embedder;
+    overflowed->event = *event;
+
+    // Make sure the events still in the ring are drained before this one is handled.
+    post_deferred_input_events(flutter_drm_embedder);
+
+    atomic_fetch_add(&flutter_drm_embedder->n_overflowed_input_events, 1);
+
+    ok = flutter_drm_embedder_post_platform_task(on_overflowed_input_event, overflowed);
+    if (ok != 0) {
+        atomic_fetch_sub(&flutter_drm_embedder->n_overflowed_input_events, 1);
+        goto fail_free_overflowed;
+    }
+
+    return;
+
+fail_free_overflowed:
+    free(overflowed);
+
+fail_log:
+    LOG_ERROR("Couldn't defer a user input event to the platform thread. Dropping it.\n");
+}
+
+/**
+ * @brief If we're not on the platform thread, queues a copy of @a event for the platform thread
+ * and returns true. The caller should return in that case, the callback will be called again
+ * on the platform thread.
+ */
+static bool maybe_defer_input_event(struct flutter_drm_embedder *flutter_drm_embedder, const struct deferred_input_event *event) {
+    if (!flutter_drm_embedder->use_input_thread || flutter_drm_embedder_runs_platform_tasks_on_current_thread(flutter_drm_embedder)) {
+        return false;
+    }
+
+    if (atomic_load(&flutter_drm_embedder->n_overflowed_input_events) > 0 ||
+        !spsc_ring_push(&flutter_drm_embedder->deferred_input_events, event)) {
+        post_overflowed_input_event(flutter_drm_embedder, event);
+        return true;
+    }
+
+    post_deferred_input_events(flutter_drm_embedder);
+    return true;
+}
+
+UNUSED static void lock_libseat(struct flutter_drm_embedder *flutter_drm_embedder) {
+    if (flutter_drm_embedder->use_input_thread) {
+        pthread_mutex_lock(&flutter_drm_embedder->libseat_mutex);
+    }
+}
+
+UNUSED static void unlock_libseat(struct flutter_drm_embedder *flutter_drm_embedder) {
+    if (flutter_drm_embedder->use_input_thread) {
+        pthread_mutex_unlock(&flutter_drm_embedder->libseat_mutex);
+    }
+}
+
+static void on_utf8_character(void *userdata, uint8_t *character) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    int ok;
+
+    flutter_drm_embedder = userdata;
+
+    {
+        struct deferred_input_event event = { .type = kUtf8Character_DeferredInputEventType };
+        memcpy(event.utf8_character, character, sizeof event.utf8_character);
+        if (maybe_defer_input_event(flutter_drm_embedder, &event)) {
+            return;
+        }
+    }
+
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+    ok = textin_on_utf8_char(character);
+    if (ok != 0) {
+        LOG_ERROR("Error handling keyboard event. textin_on_utf8_char: %s\n", strerror(ok));
+        //flutter_drm_embedder_schedule_exit(flutter_drm_embedder);
+    }
+#endif
+}
+
+static void on_xkb_keysym(void *userdata, xkb_keysym_t keysym) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    int ok;
+
+    flutter_drm_embedder = userdata;
+
+    if (maybe_defer_input_event(flutter_drm_embedder, &(struct deferred_input_event){ .type = kXkbKeysym_DeferredInputEventType, .keysym = keysym })) {
+        return;
+    }
+
+#ifdef BUILD_TEXT_INPUT_PLUGIN
+    ok = textin_on_xkb_keysym(keysym);
+    if (ok != 0) {
         LOG_ERROR("Error handling keyboard event. textin_on_xkb_keysym: %s\n", strerror(ok));
         //flutter_drm_embedder_schedule_exit(flutter_drm_embedder);
     }
@@ -1702,7 +1993,22 @@ on_gtk_keyevent(void *userdata, uint32_t unicode_scalar_values, uint32_t key_cod
     int ok;
 
     flutter_drm_embedder = userdata;
-    (void) flutter_drm_embedder;
+
+    if (maybe_defer_input_event(
+            flutter_drm_embedder,
+            &(struct deferred_input_event){
+                .type = kGtkKeyevent_DeferredInputEventType,
+                .gtk_keyevent = {
+                    .unicode_scalar_values = unicode_scalar_values,
+                    .key_code = key_code,
+                    .scan_code = scan_code,
+                    .modifiers = modifiers,
+                    .is_down = is_down,
+                },
+            }
+        )) {
+        return;
+    }
 
 #ifdef BUILD_RAW_KEYBOARD_PLUGIN
     ok = rawkb_send_gtk_keyevent(unicode_scalar_values, key_code, scan_code, modifiers, is_down);
@@ -1721,16 +2027,22 @@ static void on_switch_vt(void *userdata, int vt) {
     (void) flutter_drm_embedder;
     (void) vt;
 
+    if (maybe_defer_input_event(flutter_drm_embedder, &(struct deferred_input_event){ .type = kSwitchVt_DeferredInputEventType, .vt = vt })) {
+        return;
+    }
+
     LOG_DEBUG("on_switch_vt(%d)\n", vt);
 
     if (flutter_drm_embedder->libseat != NULL) {
 #ifdef HAVE_LIBSEAT
         int ok;
 
+        lock_libseat(flutter_drm_embedder);
         ok = libseat_switch_session(flutter_drm_embedder->libseat, vt);
         if (ok < 0) {
             LOG_ERROR("Could not switch session. libseat_switch_session: %s\n", strerror(errno));
         }
+        unlock_libseat(flutter_drm_embedder);
 #else
         UNREACHABLE();
 #endif
@@ -1741,7 +2053,13 @@ static void on_set_cursor_enabled(void *userdata, bool enabled) {
     struct flutter_drm_embedder *flutter_drm_embedder;
 
     flutter_drm_embedder = userdata;
-    (void) flutter_drm_embedder;
+
+    if (maybe_defer_input_event(
+            flutter_drm_embedder,
+            &(struct deferred_input_event){ .type = kSetCursorEnabled_DeferredInputEventType, .cursor_enabled = enabled }
+        )) {
+        return;
+    }
 
     compositor_set_cursor(flutter_drm_embedder->compositor, true, enabled, false, POINTER_KIND_NONE, false, VEC2F(0, 0));
 }
@@ -1751,9 +2069,109 @@ static void on_move_cursor(void *userdata, struct vec2f delta) {
 
     flutter_drm_embedder = userdata;
 
+    if (maybe_defer_input_event(
+            flutter_drm_embedder,
+            &(struct deferred_input_event){ .type = kMoveCursor_DeferredInputEventType, .cursor_delta = delta }
+        )) {
+        return;
+    }
+
     compositor_set_cursor(flutter_drm_embedder->compositor, true, true, false, POINTER_KIND_NONE, true, delta);
 }
 
+static int on_input_replay_finished_on_platform_thread(void *userdata) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    struct user_input_stats stats;
+
+    ASSERT_NOT_NULL(userdata);
+    flutter_drm_embedder = userdata;
+
+    user_input_get_stats(flutter_drm_embedder->user_input, &stats);
+
+    frame_timings_print_stats(flutter_drm_embedder_get_frame_timings(flutter_drm_embedder), stderr);
+    fprintf(stderr, "touch moves: %" PRIu64 " in, %" PRIu64 " out\n", stats.n_touch_moves_in, stats.n_touch_moves_out);
+    fprintf(stderr, "replayed input events: %" PRIu64 "\n", stats.n_replayed_events);
+
+    flutter_drm_embedder_schedule_exit(flutter_drm_embedder);
+    return 0;
+}
+
+static void on_input_replay_finished(void *userdata) {
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+
+    ok = flutter_drm_embedder_post_platform_task(on_input_replay_finished_on_platform_thread, userdata);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't post input replay finished task to platform thread. flutter_drm_embedder_post_platform_task: %s\n", strerror(ok));
+    }
+}
+
+/**
+ * @brief Acknowledges that the session was disabled, once user input stopped using the input devices.
+ */
+static void finish_session_disable(struct flutter_drm_embedder *flutter_drm_embedder) {
+#ifdef HAVE_LIBSEAT
+    if (flutter_drm_embedder->libseat != NULL) {
+        lock_libseat(flutter_drm_embedder);
+        libseat_disable_seat(flutter_drm_embedder->libseat);
+        unlock_libseat(flutter_drm_embedder);
+    }
+
+    flutter_drm_embedder->session_active = false;
+#else
+    (void) flutter_drm_embedder;
+    UNREACHABLE();
+#endif
+}
+
+static int on_user_input_suspended_on_platform_thread(void *userdata) {
+    ASSERT_NOT_NULL(userdata);
+    finish_session_disable(userdata);
+    return 0;
+}
+
+static void on_user_input_suspended(void *userdata) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    flutter_drm_embedder = userdata;
+
+    if (flutter_drm_embedder_runs_platform_tasks_on_current_thread(flutter_drm_embedder)) {
+        finish_session_disable(flutter_drm_embedder);
+        return;
+    }
+
+    // Not deferred through the deferred input event ring, since that can drop events when it's full.
+    ok = flutter_drm_embedder_post_platform_task(on_user_input_suspended_on_platform_thread, flutter_drm_embedder);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't post user input suspended task to platform thread. flutter_drm_embedder_post_platform_task: %s\n", strerror(ok));
+    }
+}
+
+static int on_get_next_vblank(void *userdata, uint64_t after_ns, uint64_t *next_vblank_ns_out) {
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    uint64_t next_vblank_ns, period_ns;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    flutter_drm_embedder = userdata;
+
+    ok = compositor_get_next_vblank(flutter_drm_embedder->compositor, &next_vblank_ns);
+    if (ok != 0) {
+        return ok;
+    }
+
+    if (next_vblank_ns <= after_ns) {
+        period_ns = 1000000000.0 / compositor_get_refresh_rate(flutter_drm_embedder->compositor);
+        next_vblank_ns += ((after_ns - next_vblank_ns) / period_ns + 1) * period_ns;
+    }
+
+    *next_vblank_ns_out = next_vblank_ns;
+    return 0;
+}
+
 static int on_user_input_open(const char *path, int flags, void *userdata) {
     struct flutter_drm_embedder *flutter_drm_embedder;
     int ok, fd;
@@ -1768,10 +2186,13 @@ static int on_user_input_open(const char *path, int flags, void *userdata) {
         struct device_id_and_fd *entry;
         int device_id;
 
+        lock_libseat(flutter_drm_embedder);
+
         ok = libseat_open_device(flutter_drm_embedder->libseat, path, &fd);
         if (ok < 0) {
             ok = errno;
             LOG_ERROR("Couldn't open evdev device. libseat_open_device: %s\n", strerror(ok));
+            unlock_libseat(flutter_drm_embedder);
             return -ok;
         }
 
@@ -1780,6 +2201,7 @@ static int on_user_input_open(const char *path, int flags, void *userdata) {
         entry = malloc(sizeof *entry);
         if (entry == NULL) {
             libseat_close_device(flutter_drm_embedder->libseat, device_id);
+            unlock_libseat(flutter_drm_embedder);
             return -ENOMEM;
         }
 
@@ -1788,6 +2210,8 @@ static int on_user_input_open(const char *path, int flags, void *userdata) {
         entry->device_id = device_id;
 
         list_add(&entry->entry, &flutter_drm_embedder->fd_for_device_id);
+
+        unlock_libseat(flutter_drm_embedder);
         return fd;
 #else
         UNREACHABLE();
@@ -1817,6 +2241,8 @@ static void on_user_input_close(int fd, void *userdata) {
 #ifdef HAVE_LIBSEAT
         struct device_id_and_fd *entry = NULL;
 
+        lock_libseat(flutter_drm_embedder);
+
         list_for_each_entry_safe(struct device_id_and_fd, entry_iter, &flutter_drm_embedder->fd_for_device_id, entry) {
             if (entry_iter->fd == fd) {
                 entry = entry_iter;
@@ -1826,6 +2252,7 @@ static void on_user_input_close(int fd, void *userdata) {
 
         if (entry == NULL) {
             LOG_ERROR("Could not find the device id for the evdev device that should be closed.\n");
+            unlock_libseat(flutter_drm_embedder);
             return;
         }
 
@@ -1836,6 +2263,8 @@ static void on_user_input_close(int fd, void *userdata) {
 
         list_del(&entry->entry);
         free(entry);
+
+        unlock_libseat(flutter_drm_embedder);
         return;
 #else
         UNREACHABLE();
@@ -1882,10 +2311,49 @@ static bool parse_vec2i(const char *str, struct vec2i *out) {
     return true;
 }
 
+static bool parse_plugin_loading_modes(const char *str, struct gtk_plugin_loader_options *out) {
+    char *modes, *mode, *saveptr;
+    bool valid;
+
+    modes = strdup(str);
+    if (modes == NULL) {
+        return false;
+    }
+
+    valid = true;
+    for (mode = strtok_r(modes, ",", &saveptr); mode != NULL; mode = strtok_r(NULL, ",", &saveptr)) {
+        if (streq(mode, "parallel")) {
+            out->parallel = true;
+        } else if (streq(mode, "lazy")) {
+            out->lazy_binding = true;
+        } else if (streq(mode, "manifest")) {
+            out->use_manifest = true;
+        } else if (streq(mode, "deferred")) {
+            out->use_manifest = true;
+            out->defer_registration = true;
+        } else if (streq(mode, "fast")) {
+            out->parallel = true;
+            out->lazy_binding = true;
+            out->use_manifest = true;
+        } else {
+            LOG_ERROR(
+                "ERROR: Invalid argument for --plugin-loading passed: \"%s\". Valid values are parallel, lazy, manifest, deferred, fast.\n",
+                mode
+            );
+            valid = false;
+            break;
+        }
+    }
+
+    free(modes);
+    return valid;
+}
+
 bool flutter_drm_embedder_parse_cmdline_args(int argc, char **argv, struct flutter_drm_embedder_cmdline_args *result_out) {
     bool finished_parsing_options;
     int runtime_mode_int = FLUTTER_RUNTIME_MODE_DEBUG;
     int vulkan_int = false;
+    int software_int = false;
     int dummy_display_int = 0;
     int longopt_index = 0;
     int opt, ok;
@@ -1902,11 +2370,23 @@ bool flutter_drm_embedder_parse_cmdline_args(int argc, char **argv, struct flutt
         { "help", no_argument, 0, 'h' },
         { "pixelformat", required_argument, NULL, 'p' },
         { "vulkan", no_argument, &vulkan_int, true },
+        { "software", no_argument, &software_int, true },
         { "videomode", required_argument, NULL, 'v' },
         { "dummy-display", no_argument, &dummy_display_int, 1 },
         { "dummy-display-size", required_argument, NULL, 's' },
+        { "dummy-display-capture", required_argument, NULL, 'C' },
+        { "dummy-display-timings", required_argument, NULL, 'I' },
         { "drm-fd", required_argument, NULL, 'f' },
         { "debug-kms", no_argument, NULL, 'K' },
+        { "frame-stats", required_argument, NULL, 'F' },
+        { "trace", required_argument, NULL, 'T' },
+        { "plugin-loading", required_argument, NULL, 'P' },
+        { "input-thread", no_argument, NULL, 'n' },
+        { "input-thread-priority", required_argument, NULL, 'N' },
+        { "touch-resampling", required_argument, NULL, 'R' },
+        { "input-record", required_argument, NULL, 'e' },
+        { "input-replay", required_argument, NULL, 'y' },
+        { "input-replay-speed", required_argument, NULL, 'Y' },
         { "version", no_argument, NULL, 'V' },
         { 0, 0, 0, 0 },
     };
@@ -1923,6 +2403,18 @@ bool flutter_drm_embedder_parse_cmdline_args(int argc, char **argv, struct flutt
     result_out->engine_argv = NULL;
     result_out->drm_fd = -1;
     result_out->debug_kms = false;
+    result_out->has_frame_stats_interval = false;
+    result_out->frame_stats_interval_s = 0;
+    result_out->trace_path = NULL;
+    result_out->dummy_display_capture = NULL;
+    result_out->dummy_display_timings_path = NULL;
+    memset(&result_out->gtk_plugin_loader_options, 0, sizeof result_out->gtk_plugin_loader_options);
+    result_out->use_input_thread = false;
+    result_out->input_thread_priority = 0;
+    result_out->touch_resampling_mode = kOff_TouchResamplingMode;
+    result_out->input_record_path = NULL;
+    result_out->input_replay_path = NULL;
+    result_out->input_replay_speed = 1.0;
 
     finished_parsing_options = false;
     while (!finished_parsing_options) {
@@ -2031,6 +2523,23 @@ valid_format:
 
                 break;
 
+            case 'C':  // --dummy-display-capture
+                if (!frame_capture_is_valid_target(optarg)) {
+                    LOG_ERROR(
+                        "ERROR: Invalid argument for --dummy-display-capture passed.\n"
+                        "Valid values are null, png:<directory>, raw:<path> and shm:<name>.\n"
+                    );
+                    return false;
+                }
+
+                result_out->dummy_display_capture = strdup(optarg);
+                dummy_display_int = 1;
+                break;
+
+            case 'I':  // --dummy-display-timings
+                result_out->dummy_display_timings_path = strdup(optarg);
+                break;
+
             case 'f':;  // --drm-fd
                 char *drm_fd = strdup(optarg);
                 int fd = atoi(drm_fd);
@@ -2047,6 +2556,70 @@ valid_format:
                 result_out->debug_kms = true;
                 break;
 
+            case 'F':  // --frame-stats
+                ok = sscanf(optarg, "%d", &result_out->frame_stats_interval_s);
+                if (ok != 1 || result_out->frame_stats_interval_s <= 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --frame-stats passed. Expected a positive number of seconds.\n");
+                    return false;
+                }
+                result_out->has_frame_stats_interval = true;
+                break;
+
+            case 'T':  // --trace
+                result_out->trace_path = strdup(optarg);
+                break;
+
+            case 'P':  // --plugin-loading
+                ok = parse_plugin_loading_modes(optarg, &result_out->gtk_plugin_loader_options);
+                if (!ok) {
+                    return false;
+                }
+                break;
+
+            case 'n':  // --input-thread
+                result_out->use_input_thread = true;
+                break;
+
+            case 'N':  // --input-thread-priority
+                ok = sscanf(optarg, "%d", &result_out->input_thread_priority);
+                if (ok != 1 || result_out->input_thread_priority < 1 || result_out->input_thread_priority > 99) {
+                    LOG_ERROR("ERROR: Invalid argument for --input-thread-priority passed. Expected a priority between 1 and 99.\n");
+                    return false;
+                }
+                result_out->use_input_thread = true;
+                break;
+
+            case 'R':  // --touch-resampling
+                if (streq(optarg, "off")) {
+                    result_out->touch_resampling_mode = kOff_TouchResamplingMode;
+                } else if (streq(optarg, "coalesce")) {
+                    result_out->touch_resampling_mode = kCoalesce_TouchResamplingMode;
+                } else if (streq(optarg, "resample")) {
+                    result_out->touch_resampling_mode = kResample_TouchResamplingMode;
+                    result_out->use_input_thread = true;
+                } else {
+                    LOG_ERROR("ERROR: Invalid argument for --touch-resampling passed. Expected one of: off, coalesce, resample.\n");
+                    return false;
+                }
+                break;
+
+            case 'e':  // --input-record
+                result_out->input_record_path = strdup(optarg);
+                break;
+
+            case 'y':  // --input-replay
+                result_out->input_replay_path = strdup(optarg);
+                result_out->use_input_thread = true;
+                break;
+
+            case 'Y':  // --input-replay-speed
+                ok = sscanf(optarg, "%lf", &result_out->input_replay_speed);
+                if (ok != 1 || !(result_out->input_replay_speed > 0)) {
+                    LOG_ERROR("ERROR: Invalid argument for --input-replay-speed passed. Expected a positive number.\n");
+                    return false;
+                }
+                break;
+
             case 'h': printf("%s", usage); return false;
 
             case 'V': printf("flutter-drm-embedder %s\n", FLUTTER_DRM_EMBEDDER_VERSION); return false;
@@ -2066,6 +2639,24 @@ valid_format:
         return false;
     }
 
+    if (result_out->input_record_path != NULL && result_out->input_replay_path != NULL) {
+        LOG_ERROR("ERROR: Only one of --input-record and --input-replay can be specified.\n");
+        printf("%s", usage);
+        return false;
+    }
+
+    if (result_out->dummy_display_timings_path != NULL && result_out->dummy_display_capture == NULL) {
+        LOG_ERROR("ERROR: --dummy-display-timings needs --dummy-display-capture.\n");
+        printf("%s", usage);
+        return false;
+    }
+
+    if (vulkan_int && software_int) {
+        LOG_ERROR("ERROR: Only one of --vulkan and --software can be specified.\n");
+        printf("%s", usage);
+        return false;
+    }
+
     result_out->bundle_path = strdup(argv[optind]);
     result_out->runtime_mode = runtime_mode_int;
     result_out->has_runtime_mode = runtime_mode_int != 0;
@@ -2075,6 +2666,7 @@ valid_format:
     result_out->engine_argv = argv + optind;
 
     result_out->use_vulkan = vulkan_int;
+    result_out->use_software = software_int;
 
     result_out->dummy_display = !!dummy_display_int;
 
@@ -2085,6 +2677,11 @@ valid_format:
     return true;
 }
 
+const struct gtk_plugin_loader_options *flutter_drm_embedder_get_gtk_plugin_loader_options(struct flutter_drm_embedder *flutter_drm_embedder) {
+    ASSERT_NOT_NULL(flutter_drm_embedder);
+    return &flutter_drm_embedder->gtk_plugin_loader_options;
+}
+
 void flutter_drm_embedder_set_gtk_plugin_loader(struct flutter_drm_embedder *flutter_drm_embedder, struct gtk_plugin_loader *loader) {
     ASSERT_NOT_NULL(flutter_drm_embedder);
     flutter_drm_embedder->gtk_plugin_loader = loader;
@@ -2369,17 +2966,17 @@ static void on_session_disable(struct libseat *seat, void *userdata) {
     /// TODO: Implement
     LOG_DEBUG("on_session_disable\n");
 
-    if (fpi->user_input != NULL) {
-        user_input_suspend(fpi->user_input);
-    }
-
     // if (fpi->drmdev != NULL) {
     //     drmdev_suspend(fpi->drmdev);
     // }
 
-    libseat_disable_seat(seat);
-
-    fpi->session_active = false;
+    // libseat revokes the device fds once we acknowledge the disable, so wait until user input
+    // closed them. With the input thread, that happens asynchronously, in on_user_input_suspended.
+    if (fpi->user_input != NULL) {
+        user_input_suspend(fpi->user_input);
+    } else {
+        finish_session_disable(fpi);
+    }
 }
 
 static int on_libseat_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
@@ -2393,10 +2990,12 @@ static int on_libseat_fd_ready(sd_event_source *s, int fd, uint32_t revents, voi
     (void) fd;
     (void) revents;
 
+    lock_libseat(fpi);
     ok = libseat_dispatch(fpi->libseat, 0);
     if (ok < 0) {
         LOG_ERROR("Couldn't dispatch libseat events. libseat_dispatch: %s\n", strerror(errno));
     }
+    unlock_libseat(fpi);
 
     return 0;
 }
@@ -2419,6 +3018,8 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
     struct compositor *compositor;
     struct flutter_drm_embedder *fpi;
     struct sd_event *event_loop;
+    struct task_queue *platform_tasks;
+    struct timer_queue *platform_timers;
     struct flutter_drm_embedder_cmdline_args cmd_args;
     struct libseat *libseat;
     struct locales *locales;
@@ -2455,16 +3056,30 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
     engine_argc = cmd_args.engine_argc;
     engine_argv = cmd_args.engine_argv;
 
+#ifndef HAVE_SOFTWARE
+    if (cmd_args.use_software == true) {
+        LOG_ERROR("ERROR: --software was specified, but flutter-drm-embedder was built without software rendering support.\n");
+        printf("%s", usage);
+        return NULL;
+    }
+#endif
+
+    if (cmd_args.use_software) {
+        renderer_type = kSoftware_RendererType;
+    } else {
 #if defined(HAVE_EGL_GLES2) && defined(HAVE_VULKAN)
-    renderer_type = cmd_args.use_vulkan ? kVulkan_RendererType : kOpenGL_RendererType;
+        renderer_type = cmd_args.use_vulkan ? kVulkan_RendererType : kOpenGL_RendererType;
 #elif defined(HAVE_EGL_GLES2) && !defined(HAVE_VULKAN)
-    ASSUME(!cmd_args.use_vulkan);
-    renderer_type = kOpenGL_RendererType;
+        ASSUME(!cmd_args.use_vulkan);
+        renderer_type = kOpenGL_RendererType;
 #elif !defined(HAVE_EGL_GLES2) && defined(HAVE_VULKAN)
-    renderer_type = kVulkan_RendererType;
+        renderer_type = kVulkan_RendererType;
+#elif defined(HAVE_SOFTWARE)
+        renderer_type = kSoftware_RendererType;
 #else
-    #error "At least one of the Vulkan and OpenGL renderer backends must be built."
+    #error "At least one of the Vulkan, OpenGL and software renderer backends must be built."
 #endif
+    }
 
     desired_videomode = cmd_args.desired_videomode;
 
@@ -2496,6 +3111,31 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
         goto fail_unref_event_loop;
     }
 
+    {
+        sigset_t sigmask;
+
+        // sd-event only receives signals that are blocked in every thread. The flutter engine
+        // didn't spawn any threads yet, so blocking it here is enough.
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+        ok = sd_event_add_signal(event_loop, NULL, SIGUSR2, on_trace_signal, fpi);
+        if (ok < 0) {
+            LOG_ERROR("Couldn't listen for SIGUSR2. Tracing can't be toggled at runtime. sd_event_add_signal: %s\n", strerror(-ok));
+        }
+    }
+
+    platform_tasks = task_queue_new(event_loop);
+    if (platform_tasks == NULL) {
+        goto fail_unref_event_loop;
+    }
+
+    platform_timers = timer_queue_new(event_loop);
+    if (platform_timers == NULL) {
+        goto fail_destroy_platform_tasks;
+    }
+
 #ifdef HAVE_LIBSEAT
     static const struct libseat_seat_listener libseat_interface = { .enable_seat = on_session_enable, .disable_seat = on_session_disable };
 
@@ -2543,7 +3183,11 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
 
     locales_print(locales);
 
-    if (cmd_args.dummy_display) {
+    if (cmd_args.dummy_display && renderer_type == kSoftware_RendererType) {
+        // headless software rendering doesn't need any GPU at all.
+        drmdev = NULL;
+        gbm_device = NULL;
+    } else if (cmd_args.dummy_display) {
         drmdev = NULL;
 
         // for off-screen rendering, we just open the unprivileged /dev/dri/renderD128 (or whatever)
@@ -2580,7 +3224,11 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
         goto fail_destroy_drmdev;
     }
 
-    scheduler = frame_scheduler_new(false, kDoubleBufferedVsync_PresentMode, NULL, NULL);
+    if (cmd_args.trace_path != NULL) {
+        tracer_start_recording(tracer);
+    }
+
+    scheduler = frame_scheduler_new(true, kDoubleBufferedVsync_PresentMode, on_begin_frame, NULL);
     if (scheduler == NULL) {
         LOG_ERROR("Couldn't create frame scheduler.\n");
         goto fail_unref_tracer;
@@ -2624,6 +3272,10 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
 #else
         UNREACHABLE();
 #endif
+    } else if (renderer_type == kSoftware_RendererType) {
+        // flutter renders into memory provided by the render surfaces, there's no renderer object.
+        gl_renderer = NULL;
+        vk_renderer = NULL;
     } else {
         UNREACHABLE();
         goto fail_unref_scheduler;
@@ -2642,6 +3294,18 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
             cmd_args.physical_dimensions.y,
             60.0
         );
+        if (window == NULL) {
+            LOG_ERROR("Couldn't create dummy window.\n");
+            goto fail_unref_renderer;
+        }
+
+        if (cmd_args.dummy_display_capture != NULL) {
+            ok = dummy_window_enable_capture(window, cmd_args.dummy_display_capture, cmd_args.dummy_display_timings_path);
+            if (ok != 0) {
+                LOG_ERROR("Couldn't set up capturing the frames of the dummy display.\n");
+                goto fail_unref_window;
+            }
+        }
     } else {
         window = kms_window_new(
             // clang-format off
@@ -2697,22 +3361,61 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
         .close = on_user_input_close,
         .on_switch_vt = on_switch_vt,
         .on_key_event = NULL,
+        .get_next_vblank = on_get_next_vblank,
+        .on_replay_finished = on_input_replay_finished,
+        .on_suspended = on_user_input_suspended,
     };
 
     fpi->libseat = libseat;
     list_inithead(&fpi->fd_for_device_id);
+    fpi->use_input_thread = cmd_args.use_input_thread;
+    fpi->input_thread_priority = cmd_args.input_thread_priority;
+    pthread_mutex_init(&fpi->libseat_mutex, NULL);
+    atomic_init(&fpi->flutter.next_frame_request_is_secondary, false);
+
+    ok = spsc_ring_init(&fpi->deferred_input_events, sizeof(struct deferred_input_event), N_DEFERRED_INPUT_EVENTS);
+    if (ok != 0) {
+        goto fail_unref_compositor;
+    }
+    atomic_init(&fpi->deferred_input_events_posted, false);
+    atomic_init(&fpi->n_overflowed_input_events, 0);
+
+    if (cmd_args.input_replay_path != NULL) {
+        input = user_input_new_replay(
+            &user_input_interface,
+            fpi,
+            &geometry.display_to_view_transform,
+            &geometry.view_to_display_transform,
+            geometry.display_size.x,
+            geometry.display_size.y,
+            cmd_args.input_replay_path,
+            cmd_args.input_replay_speed
+        );
+    } else {
+        input = user_input_new(
+            &user_input_interface,
+            fpi,
+            &geometry.display_to_view_transform,
+            &geometry.view_to_display_transform,
+            geometry.display_size.x,
+            geometry.display_size.y
+        );
+    }
+    if (input != NULL) {
+        user_input_set_touch_resampling_mode(input, cmd_args.touch_resampling_mode);
+
+        if (cmd_args.input_record_path != NULL) {
+            ok = user_input_start_recording(input, cmd_args.input_record_path);
+            if (ok != 0) {
+                LOG_ERROR("Couldn't start recording input events. flutter-drm-embedder will run without recording.\n");
+            }
+        }
+    }
 
-    input = user_input_new(
-        &user_input_interface,
-        fpi,
-        &geometry.display_to_view_transform,
-        &geometry.view_to_display_transform,
-        geometry.display_size.x,
-        geometry.display_size.y
-    );
     if (input == NULL) {
         LOG_ERROR("Couldn't initialize user input. flutter-drm-embedder will run without user input.\n");
-    } else {
+    } else if (!fpi->use_input_thread) {
+        // With --input-thread, the input thread is started once the engine is running.
         sd_event_source *user_input_event_source;
 
         ok = sd_event_add_io(
@@ -2806,17 +3509,20 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
         }
     }
 
-    // We don't need these anymore.
-    frame_scheduler_unref(scheduler);
+    // We don't need this anymore.
     window_unref(window);
 
     pthread_mutex_init(&fpi->event_loop_mutex, get_default_mutex_attrs());
     fpi->event_loop_thread = pthread_self();
     fpi->wakeup_event_loop_fd = wakeup_fd;
     fpi->event_loop = event_loop;
+    fpi->platform_tasks = platform_tasks;
+    fpi->platform_timers = platform_timers;
     fpi->locales = locales;
     fpi->tracer = tracer;
     fpi->compositor = compositor;
+    fpi->scheduler = scheduler;
+    fpi->renderer_type = renderer_type;
     fpi->gl_renderer = gl_renderer;
     fpi->vk_renderer = vk_renderer;
     fpi->user_input = input;
@@ -2832,6 +3538,14 @@ struct flutter_drm_embedder *flutter_drm_embedder_new_from_args(int argc, char *
     fpi->gtk_plugin_loader = NULL;
     fpi->texture_registry = texture_registry;
     fpi->libseat = libseat;
+    fpi->frame_stats_interval_ns = cmd_args.has_frame_stats_interval ? cmd_args.frame_stats_interval_s * 1000000000ull : 0;
+    fpi->trace_path = cmd_args.trace_path;
+    fpi->gtk_plugin_loader_options = cmd_args.gtk_plugin_loader_options;
+
+    free(cmd_args.dummy_display_capture);
+    free(cmd_args.dummy_display_timings_path);
+    free(cmd_args.input_record_path);
+    free(cmd_args.input_replay_path);
     return fpi;
 
 fail_destroy_texture_registry:
@@ -2845,6 +3559,7 @@ fail_unload_engine:
 
 fail_destroy_user_input:
     user_input_destroy(input);
+    spsc_ring_deinit(&fpi->deferred_input_events);
 
 fail_unref_compositor:
     compositor_unref(compositor);
@@ -2889,6 +3604,11 @@ fail_destroy_libseat:
 #endif
     }
 
+    timer_queue_destroy(platform_timers);
+
+fail_destroy_platform_tasks:
+    task_queue_destroy(platform_tasks);
+
 fail_unref_event_loop:
     sd_event_unrefp(&event_loop);
 
@@ -2900,6 +3620,11 @@ fail_free_paths:
 
 fail_free_cmd_args:
     free(cmd_args.bundle_path);
+    free(cmd_args.trace_path);
+    free(cmd_args.dummy_display_capture);
+    free(cmd_args.dummy_display_timings_path);
+    free(cmd_args.input_record_path);
+    free(cmd_args.input_replay_path);
 
 fail_free_fpi:
     free(fpi);
@@ -2912,6 +3637,7 @@ void flutter_drm_embedder_destroy(struct flutter_drm_embedder *flutter_drm_embed
     LOG_DEBUG("deinit\n");
 
     pthread_mutex_destroy(&flutter_drm_embedder->event_loop_mutex);
+    pthread_mutex_destroy(&flutter_drm_embedder->libseat_mutex);
     texture_registry_destroy(flutter_drm_embedder->texture_registry);
     plugin_registry_destroy(flutter_drm_embedder->plugin_registry);
     if (flutter_drm_embedder->fl_texture_registrar) {
@@ -2923,7 +3649,9 @@ void flutter_drm_embedder_destroy(struct flutter_drm_embedder *flutter_drm_embed
     gtk_plugin_loader_destroy(flutter_drm_embedder->gtk_plugin_loader);
     unload_flutter_engine_lib(flutter_drm_embedder->flutter.engine_handle);
     user_input_destroy(flutter_drm_embedder->user_input);
+    spsc_ring_deinit(&flutter_drm_embedder->deferred_input_events);
     compositor_unref(flutter_drm_embedder->compositor);
+    frame_scheduler_unref(flutter_drm_embedder->scheduler);
     if (flutter_drm_embedder->gl_renderer) {
 #ifdef HAVE_EGL_GLES2
         gl_renderer_unref(flutter_drm_embedder->gl_renderer);
@@ -2938,6 +3666,10 @@ void flutter_drm_embedder_destroy(struct flutter_drm_embedder *flutter_drm_embed
         UNREACHABLE();
 #endif
     }
+    if (flutter_drm_embedder->trace_path != NULL && tracer_is_recording(flutter_drm_embedder->tracer)) {
+        write_trace(flutter_drm_embedder);
+    }
+    free(flutter_drm_embedder->trace_path);
     tracer_unref(flutter_drm_embedder->tracer);
     drmdev_unref(flutter_drm_embedder->drmdev);
     locales_destroy(flutter_drm_embedder->locales);
@@ -2948,6 +3680,25 @@ void flutter_drm_embedder_destroy(struct flutter_drm_embedder *flutter_drm_embed
         UNREACHABLE();
 #endif
     }
+    {
+        struct timer_queue_stats stats;
+
+        timer_queue_get_stats(flutter_drm_embedder->platform_timers, &stats);
+        LOG_DEBUG(
+            "Timed platform tasks: %" PRIu64 " posted, %" PRIu64 " executed, %" PRIu64 " cancelled, %" PRIu64
+            " timer updates, slack avg %" PRIu64 " us max %" PRIu64 " us, max pending %zu\n",
+            stats.n_posted,
+            stats.n_executed,
+            stats.n_cancelled,
+            stats.n_timer_updates,
+            stats.n_executed ? stats.total_slack_ns / stats.n_executed / 1000 : 0,
+            stats.max_slack_ns / 1000,
+            stats.max_pending
+        );
+    }
+
+    timer_queue_destroy(flutter_drm_embedder->platform_timers);
+    task_queue_destroy(flutter_drm_embedder->platform_tasks);
     sd_event_unrefp(&flutter_drm_embedder->event_loop);
     close(flutter_drm_embedder->wakeup_event_loop_fd);
     flutter_paths_free(flutter_drm_embedder->flutter.paths);
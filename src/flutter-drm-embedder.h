@@ -30,6 +30,8 @@
 
 #include "cursor.h"
 #include "pixel_format.h"
+#include "plugin_loader.h"
+#include "user_input.h"
 #include "util/collection.h"
 
 enum device_orientation { kPortraitUp, kLandscapeLeft, kPortraitDown, kLandscapeRight };
@@ -93,6 +95,7 @@ struct locales;
 struct vk_renderer;
 struct flutter_drm_embedder;
 struct gtk_plugin_loader;
+struct frame_timings;
 
 /// TODO: Remove this
 extern struct flutter_drm_embedder *flutter_drm_embedder;
@@ -137,16 +140,45 @@ struct flutter_drm_embedder_cmdline_args {
     char **engine_argv;
 
     bool use_vulkan;
+    bool use_software;
 
     char *desired_videomode;
 
     bool dummy_display;
     struct vec2i dummy_display_size;
 
+    /// Where the frames of the dummy display are written to, or NULL if they aren't composited at all.
+    char *dummy_display_capture;
+    char *dummy_display_timings_path;
+
     bool has_drm_fd;
     int drm_fd;
 
     bool debug_kms;
+
+    bool has_frame_stats_interval;
+    int frame_stats_interval_s;
+
+    char *trace_path;
+
+    struct gtk_plugin_loader_options gtk_plugin_loader_options;
+
+    /// Process user input on a dedicated thread instead of the platform thread.
+    bool use_input_thread;
+
+    /// SCHED_FIFO priority of the input thread, or 0 for the default scheduling policy.
+    int input_thread_priority;
+
+    enum touch_resampling_mode touch_resampling_mode;
+
+    /// Record all input events to this file, or NULL.
+    char *input_record_path;
+
+    /// Replay the input events recorded in this file instead of using the real input devices, or NULL.
+    char *input_replay_path;
+
+    /// How much faster than recorded the input events are replayed.
+    double input_replay_speed;
 };
 
 int flutter_drm_embedder_fill_view_properties(bool has_orientation, enum device_orientation orientation, bool has_rotation, int rotation);
@@ -175,6 +207,7 @@ bool flutter_drm_embedder_parse_cmdline_args(int argc, char **argv, struct flutt
 
 void flutter_drm_embedder_set_gtk_plugin_loader(struct flutter_drm_embedder *flutter_drm_embedder, struct gtk_plugin_loader *loader);
 struct gtk_plugin_loader *flutter_drm_embedder_get_gtk_plugin_loader(struct flutter_drm_embedder *flutter_drm_embedder);
+const struct gtk_plugin_loader_options *flutter_drm_embedder_get_gtk_plugin_loader_options(struct flutter_drm_embedder *flutter_drm_embedder);
 
 void flutter_drm_embedder_set_fl_texture_registrar(struct flutter_drm_embedder *flutter_drm_embedder, void *registrar);
 void *flutter_drm_embedder_get_fl_texture_registrar(struct flutter_drm_embedder *flutter_drm_embedder);
@@ -183,6 +216,8 @@ struct texture_registry *flutter_drm_embedder_get_texture_registry(struct flutte
 
 struct plugin_registry *flutter_drm_embedder_get_plugin_registry(struct flutter_drm_embedder *flutter_drm_embedder);
 
+struct frame_timings *flutter_drm_embedder_get_frame_timings(struct flutter_drm_embedder *flutter_drm_embedder);
+
 FlutterPlatformMessageResponseHandle *
 flutter_drm_embedder_create_platform_message_response_handle(struct flutter_drm_embedder *flutter_drm_embedder, FlutterDataCallback data_callback, void *userdata);
 
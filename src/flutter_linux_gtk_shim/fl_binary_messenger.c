@@ -2,6 +2,7 @@
 #include "flutter_linux/fl_binary_messenger.h"
 
 #include <gio/gio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "fl_binary_messenger_internal.h"
@@ -147,6 +148,38 @@ void fl_binary_messenger_set_message_handler_on_channel(FlBinaryMessenger *messe
     }
 }
 
+char **fl_binary_messenger_dup_channels(FlBinaryMessenger *messenger, size_t *n_channels_out) {
+    GHashTableIter iter;
+    gpointer channel;
+    char **channels;
+    size_t n_channels;
+
+    g_return_val_if_fail(messenger != NULL, NULL);
+    g_return_val_if_fail(n_channels_out != NULL, NULL);
+
+    channels = malloc((g_hash_table_size(messenger->handlers) + 1) * sizeof *channels);
+    if (channels == NULL) {
+        return NULL;
+    }
+
+    n_channels = 0;
+    g_hash_table_iter_init(&iter, messenger->handlers);
+    while (g_hash_table_iter_next(&iter, &channel, NULL)) {
+        channels[n_channels] = strdup(channel);
+        if (channels[n_channels] == NULL) {
+            for (size_t i = 0; i < n_channels; i++) {
+                free(channels[i]);
+            }
+            free(channels);
+            return NULL;
+        }
+        n_channels++;
+    }
+
+    *n_channels_out = n_channels;
+    return channels;
+}
+
 static void fl_binary_messenger_on_response(const uint8_t *data, size_t data_size, void *user_data) {
     FlBinaryMessengerPendingResponse *pending = user_data;
     GBytes *bytes = NULL;
@@ -10,4 +10,10 @@ FlBinaryMessenger *fl_binary_messenger_new_for_flutter_drm_embedder(struct flutt
 
 void fl_binary_messenger_send_on_channel_no_response(FlBinaryMessenger *messenger, const gchar *channel, GBytes *message);
 
+/**
+ * Returns a malloc'd array of malloc'd copies of the channels that currently have a message
+ * handler set through @a messenger, or NULL if allocating failed.
+ */
+char **fl_binary_messenger_dup_channels(FlBinaryMessenger *messenger, size_t *n_channels_out);
+
 #endif  // FL_BINARY_MESSENGER_INTERNAL_H
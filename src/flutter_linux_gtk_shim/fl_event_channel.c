@@ -100,7 +100,7 @@ static void fl_event_channel_message_handler(FlBinaryMessenger *messenger,
 
     g_free(method);
     if (args) {
-        g_object_unref(args);
+        fl_value_unref(args);
     }
 }
 
@@ -23,7 +23,7 @@ static void fl_method_call_finalize(GObject *object) {
         g_object_unref(self->codec);
     }
     if (self->args) {
-        g_object_unref(self->args);
+        fl_value_unref(self->args);
     }
     if (self->response_handle) {
         g_object_unref(self->response_handle);
@@ -51,7 +51,7 @@ FlMethodCall *fl_method_call_new(FlBinaryMessenger *messenger,
     call->messenger = messenger ? g_object_ref(messenger) : NULL;
     call->codec = codec ? g_object_ref(codec) : NULL;
     call->name = g_strdup(name ? name : "");
-    call->args = args ? g_object_ref(args) : NULL;
+    call->args = args ? fl_value_ref(args) : NULL;
     call->response_handle = response_handle ? g_object_ref(response_handle) : NULL;
     return call;
 }
@@ -79,7 +79,7 @@ static void fl_method_channel_message_handler(FlBinaryMessenger *messenger,
         g_free(method);
     }
     if (args) {
-        g_object_unref(args);
+        fl_value_unref(args);
     }
     g_object_unref(call);
 }
@@ -154,10 +154,10 @@ static void fl_method_channel_on_invoke_response(GObject *source_object, GAsyncR
     }
 
     if (result_value) {
-        g_object_unref(result_value);
+        fl_value_unref(result_value);
     }
     if (error_details) {
-        g_object_unref(error_details);
+        fl_value_unref(error_details);
     }
     g_free(error_code);
     g_free(error_message);
@@ -17,10 +17,10 @@ G_DEFINE_TYPE(FlMethodResponse, fl_method_response, G_TYPE_OBJECT)
 static void fl_method_response_finalize(GObject *object) {
     FlMethodResponse *self = FL_METHOD_RESPONSE(object);
     if (self->result) {
-        g_object_unref(self->result);
+        fl_value_unref(self->result);
     }
     if (self->error_details) {
-        g_object_unref(self->error_details);
+        fl_value_unref(self->error_details);
     }
     g_free(self->error_code);
     g_free(self->error_message);
@@ -45,7 +45,7 @@ FlMethodResponseType fl_method_response_get_type_id(FlMethodResponse *response)
 FlMethodResponse *fl_method_success_response_new(FlValue *result) {
     FlMethodResponse *response = g_object_new(FL_TYPE_METHOD_RESPONSE, NULL);
     response->type = FL_METHOD_RESPONSE_SUCCESS;
-    response->result = result ? g_object_ref(result) : NULL;
+    response->result = result ? fl_value_ref(result) : NULL;
     return response;
 }
 
@@ -54,7 +54,7 @@ FlMethodResponse *fl_method_error_response_new(const gchar *error_code, const gc
     response->type = FL_METHOD_RESPONSE_ERROR;
     response->error_code = g_strdup(error_code ? error_code : "");
     response->error_message = g_strdup(error_message ? error_message : "");
-    response->error_details = details ? g_object_ref(details) : NULL;
+    response->error_details = details ? fl_value_ref(details) : NULL;
     return response;
 }
 
@@ -18,9 +18,13 @@ __attribute__((weak)) void fl_register_plugins(FlPluginRegistry *registry);
 void flutter_drm_embedder_register_gtk_plugins(struct flutter_drm_embedder *flutter_drm_embedder) {
     fprintf(stderr, "[plugin_registrant] registering GTK plugins for embedder %p\n", (void *)flutter_drm_embedder);
 
-    struct gtk_plugin_loader *loader = gtk_plugin_loader_load(flutter_drm_embedder);
+    struct gtk_plugin_loader *loader = gtk_plugin_loader_load(
+        flutter_drm_embedder,
+        flutter_drm_embedder_get_gtk_plugin_loader_options(flutter_drm_embedder)
+    );
     if (loader != NULL) {
         fprintf(stderr, "[plugin_registrant] plugin_loader loaded plugins from bundle dir\n");
+        gtk_plugin_loader_print_timings(loader, stderr);
         flutter_drm_embedder_set_gtk_plugin_loader(flutter_drm_embedder, loader);
     } else {
         fprintf(stderr, "[plugin_registrant] plugin_loader found no plugins in bundle dir\n");
@@ -4,6 +4,8 @@
 #include <gio/gio.h>
 #include <string.h>
 
+#include "fl_standard_method_codec_internal.h"
+#include "fl_value_internal.h"
 #include "platformchannel.h"
 
 #if !GLIB_CHECK_VERSION(2, 68, 0)
@@ -31,12 +33,35 @@ G_DEFINE_TYPE(FlStandardMethodCodec, fl_standard_method_codec, FL_TYPE_METHOD_CO
 static int fl_value_to_std_value(FlValue *value, struct std_value *out);
 static FlValue *std_value_to_fl_value(const struct std_value *value);
 
-static void platch_free_std_value(struct std_value *value) {
-    struct platch_obj obj = {
-        .codec = kStandardMessageCodec,
-        .std_value = *value,
-    };
-    platch_free_obj(&obj);
+/**
+ * @brief Frees a std_value built by fl_value_to_std_value.
+ *
+ * platch_free_value_std assumes typed arrays point into a message buffer and doesn't
+ * free them (or the map values array), but fl_value_to_std_value copies those.
+ */
+static void free_converted_std_value(struct std_value *value) {
+    switch (value->type) {
+        case kStdString: g_free(value->string_value); break;
+        case kStdUInt8Array: g_free((void *) value->uint8array); break;
+        case kStdInt32Array: g_free((void *) value->int32array); break;
+        case kStdInt64Array: g_free((void *) value->int64array); break;
+        case kStdFloat64Array: g_free((void *) value->float64array); break;
+        case kStdList:
+            for (size_t i = 0; value->list != NULL && i < value->size; i++) {
+                free_converted_std_value(&value->list[i]);
+            }
+            free(value->list);
+            break;
+        case kStdMap:
+            for (size_t i = 0; value->keys != NULL && value->values != NULL && i < value->size; i++) {
+                free_converted_std_value(&value->keys[i]);
+                free_converted_std_value(&value->values[i]);
+            }
+            free(value->keys);
+            free(value->values);
+            break;
+        default: break;
+    }
 }
 
 static int fl_list_to_std_value(FlValue *value, struct std_value *out) {
@@ -201,95 +226,379 @@ static FlValue *std_value_to_fl_value(const struct std_value *value) {
     }
 }
 
-static GBytes *fl_standard_method_codec_encode_method_call(FlMethodCodec *codec, const gchar *method, FlValue *args, GError **error) {
-    (void) codec;
-    struct std_value std_arg = {0};
-    int ok = fl_value_to_std_value(args, &std_arg);
+GBytes *fl_standard_method_codec_encode_value_legacy(FlValue *value, GError **error) {
+    struct std_value std_value = {0};
+    int ok = fl_value_to_std_value(value, &std_value);
     if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode method call arguments");
+        free_converted_std_value(&std_value);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode value");
         return NULL;
     }
 
-    struct platch_obj obj = PLATCH_OBJ_STD_CALL(method, std_arg);
+    struct platch_obj obj = {
+        .codec = kStandardMessageCodec,
+        .std_value = std_value,
+    };
     uint8_t *buffer = NULL;
     size_t size = 0;
     ok = platch_encode(&obj, &buffer, &size);
-    platch_free_std_value(&std_arg);
+    free_converted_std_value(&std_value);
     if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode method call");
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode value");
         return NULL;
     }
 
-    GBytes *bytes = g_bytes_new_take(buffer, size);
-    return bytes;
+    return g_bytes_new_take(buffer, size);
 }
 
-static gboolean fl_standard_method_codec_decode_method_call(FlMethodCodec *codec, GBytes *message, gchar **method_out,
-                                                            FlValue **args_out, GError **error) {
-    (void) codec;
+FlValue *fl_standard_method_codec_decode_value_legacy(GBytes *message, GError **error) {
     gsize size = 0;
     const uint8_t *data = g_bytes_get_data(message, &size);
     struct platch_obj obj = {0};
-    int ok = platch_decode(data, size, kStandardMethodCall, &obj);
+    int ok = platch_decode(data, size, kStandardMessageCodec, &obj);
     if (ok != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to decode value");
+        return NULL;
+    }
+
+    FlValue *value = std_value_to_fl_value(&obj.std_value);
+    platch_free_obj(&obj);
+    return value;
+}
+
+/*
+ * Direct FlValue <-> standard message codec wire format conversion.
+ *
+ * Encoding writes the wire format straight from the FlValue tree (measuring the size in a first pass),
+ * decoding walks the message buffer using the raw_std_value API. Typed lists reference the message
+ * buffer instead of being copied, the GBytes is kept alive by the FlValues referencing it.
+ */
+
+struct std_writer {
+    uint8_t *buffer;  // NULL while measuring.
+    size_t offset;
+};
+
+typedef void (*std_write_fn)(struct std_writer *writer, gconstpointer userdata);
+
+static void std_writer_put(struct std_writer *writer, const void *src, size_t n) {
+    if (writer->buffer != NULL && n > 0) {
+        memcpy(writer->buffer + writer->offset, src, n);
+    }
+    writer->offset += n;
+}
+
+static void std_writer_put_u8(struct std_writer *writer, uint8_t value) {
+    std_writer_put(writer, &value, 1);
+}
+
+static void std_writer_align(struct std_writer *writer, size_t alignment) {
+    while (writer->offset % alignment != 0) {
+        std_writer_put_u8(writer, 0);
+    }
+}
+
+static void std_writer_put_size(struct std_writer *writer, size_t size) {
+    if (size < 254) {
+        std_writer_put_u8(writer, (uint8_t) size);
+    } else if (size <= 0xFFFF) {
+        uint16_t size16 = (uint16_t) size;
+        std_writer_put_u8(writer, 254);
+        std_writer_put(writer, &size16, sizeof size16);
+    } else {
+        uint32_t size32 = (uint32_t) size;
+        std_writer_put_u8(writer, 255);
+        std_writer_put(writer, &size32, sizeof size32);
+    }
+}
+
+static void std_writer_put_string(struct std_writer *writer, const gchar *string) {
+    size_t length = strlen(string);
+
+    std_writer_put_u8(writer, kStdString);
+    std_writer_put_size(writer, length);
+    std_writer_put(writer, string, length);
+}
+
+static void std_writer_put_typed_list(struct std_writer *writer, enum std_value_type type, const void *data, size_t length, size_t element_size) {
+    std_writer_put_u8(writer, type);
+    std_writer_put_size(writer, length);
+    std_writer_align(writer, element_size);
+    std_writer_put(writer, data, length * element_size);
+}
+
+static void std_writer_put_value(struct std_writer *writer, FlValue *value) {
+    size_t length = 0;
+
+    if (value == NULL) {
+        std_writer_put_u8(writer, kStdNull);
+        return;
+    }
+
+    switch (fl_value_get_type_id(value)) {
+        case FL_VALUE_TYPE_BOOL: std_writer_put_u8(writer, fl_value_get_bool(value) ? kStdTrue : kStdFalse); break;
+        case FL_VALUE_TYPE_INT: {
+            int64_t int_value = fl_value_get_int(value);
+            if (int_value >= INT32_MIN && int_value <= INT32_MAX) {
+                int32_t int32_value = (int32_t) int_value;
+                std_writer_put_u8(writer, kStdInt32);
+                std_writer_put(writer, &int32_value, sizeof int32_value);
+            } else {
+                std_writer_put_u8(writer, kStdInt64);
+                std_writer_put(writer, &int_value, sizeof int_value);
+            }
+            break;
+        }
+        case FL_VALUE_TYPE_FLOAT: {
+            double float_value = fl_value_get_float(value);
+            std_writer_put_u8(writer, kStdFloat64);
+            std_writer_align(writer, 8);
+            std_writer_put(writer, &float_value, sizeof float_value);
+            break;
+        }
+        case FL_VALUE_TYPE_STRING: std_writer_put_string(writer, fl_value_get_string(value)); break;
+        case FL_VALUE_TYPE_UINT8_LIST: {
+            const uint8_t *data = fl_value_get_uint8_list(value, &length);
+            std_writer_put_typed_list(writer, kStdUInt8Array, data, length, 1);
+            break;
+        }
+        case FL_VALUE_TYPE_INT32_LIST: {
+            const int32_t *data = fl_value_get_int32_list(value, &length);
+            std_writer_put_typed_list(writer, kStdInt32Array, data, length, sizeof(int32_t));
+            break;
+        }
+        case FL_VALUE_TYPE_INT64_LIST: {
+            const int64_t *data = fl_value_get_int64_list(value, &length);
+            std_writer_put_typed_list(writer, kStdInt64Array, data, length, sizeof(int64_t));
+            break;
+        }
+        case FL_VALUE_TYPE_FLOAT_LIST: {
+            const double *data = fl_value_get_float_list(value, &length);
+            std_writer_put_typed_list(writer, kStdFloat64Array, data, length, sizeof(double));
+            break;
+        }
+        case FL_VALUE_TYPE_LIST:
+            length = fl_value_get_length(value);
+            std_writer_put_u8(writer, kStdList);
+            std_writer_put_size(writer, length);
+            for (size_t i = 0; i < length; i++) {
+                std_writer_put_value(writer, fl_value_get_list_value(value, i));
+            }
+            break;
+        case FL_VALUE_TYPE_MAP:
+            length = fl_value_get_length(value);
+            std_writer_put_u8(writer, kStdMap);
+            std_writer_put_size(writer, length);
+            for (size_t i = 0; i < length; i++) {
+                std_writer_put_value(writer, fl_value_get_map_key(value, i));
+                std_writer_put_value(writer, fl_value_get_map_value(value, i));
+            }
+            break;
+        case FL_VALUE_TYPE_NULL:
+        default: std_writer_put_u8(writer, kStdNull); break;
+    }
+}
+
+static GBytes *std_encode(std_write_fn write, gconstpointer userdata) {
+    struct std_writer writer = { .buffer = NULL, .offset = 0 };
+    size_t size;
+
+    // first pass only measures the size of the encoded message.
+    write(&writer, userdata);
+    size = writer.offset;
+
+    writer.buffer = g_malloc(size);
+    writer.offset = 0;
+    write(&writer, userdata);
+    g_assert(writer.offset == size);
+
+    return g_bytes_new_take(writer.buffer, size);
+}
+
+static FlValue *std_read_value(GBytes *owner, const struct raw_std_value *value) {
+    size_t length;
+
+    switch (raw_std_value_get_type(value)) {
+        case kStdNull: return fl_value_new_null();
+        case kStdTrue: return fl_value_new_bool(TRUE);
+        case kStdFalse: return fl_value_new_bool(FALSE);
+        case kStdInt32: return fl_value_new_int(raw_std_value_as_int32(value));
+        case kStdInt64: return fl_value_new_int(raw_std_value_as_int64(value));
+        case kStdFloat64: return fl_value_new_float(raw_std_value_as_float64(value));
+        case kStdString:
+            return fl_value_new_string_sized(raw_std_string_get_nonzero_terminated(value), raw_std_string_get_length(value));
+        case kStdUInt8Array:
+            return fl_value_new_uint8_list_borrowed(owner, raw_std_value_as_uint8array(value), raw_std_value_get_size(value));
+        case kStdInt32Array:
+            return fl_value_new_int32_list_borrowed(owner, raw_std_value_as_int32array(value), raw_std_value_get_size(value));
+        case kStdInt64Array:
+            return fl_value_new_int64_list_borrowed(owner, raw_std_value_as_int64array(value), raw_std_value_get_size(value));
+        case kStdFloat64Array:
+            return fl_value_new_float_list_borrowed(owner, raw_std_value_as_float64array(value), raw_std_value_get_size(value));
+        case kStdFloat32Array: {
+            // There's no FlValue float32 list, so widen to a float64 list.
+            const float *data = raw_std_value_as_float32array(value);
+            length = raw_std_value_get_size(value);
+
+            double *widened = g_new(double, length);
+            for (size_t i = 0; i < length; i++) {
+                widened[i] = data[i];
+            }
+
+            FlValue *list = fl_value_new_float_list(widened, length);
+            g_free(widened);
+            return list;
+        }
+        case kStdList: {
+            FlValue *list = fl_value_new_list();
+
+            length = raw_std_list_get_size(value);
+            if (length == 0) {
+                return list;
+            }
+
+            value = raw_std_list_get_first_element(value);
+            for (size_t i = 0; i < length; i++, value = raw_std_value_after(value)) {
+                FlValue *child = std_read_value(owner, value);
+                fl_value_append(list, child);
+                fl_value_unref(child);
+            }
+            return list;
+        }
+        case kStdMap: {
+            FlValue *map = fl_value_new_map();
+
+            length = raw_std_map_get_size(value);
+            if (length == 0) {
+                return map;
+            }
+
+            value = raw_std_map_get_first_key(value);
+            for (size_t i = 0; i < length; i++) {
+                FlValue *key = std_read_value(owner, value);
+                value = raw_std_value_after(value);
+
+                FlValue *val = std_read_value(owner, value);
+                value = raw_std_value_after(value);
+
+                fl_value_set(map, key, val);
+                fl_value_unref(key);
+                fl_value_unref(val);
+            }
+            return map;
+        }
+        default: return fl_value_new_null();
+    }
+}
+
+static gchar *std_read_string_dup(const struct raw_std_value *value) {
+    if (!raw_std_value_is_string(value)) {
+        return g_strdup("");
+    }
+
+    return g_strndup(raw_std_string_get_nonzero_terminated(value), raw_std_string_get_length(value));
+}
+
+static void write_value(struct std_writer *writer, gconstpointer userdata) {
+    std_writer_put_value(writer, (FlValue *) userdata);
+}
+
+GBytes *fl_standard_method_codec_encode_value(FlValue *value, GError **error) {
+    (void) error;
+    return std_encode(write_value, value);
+}
+
+FlValue *fl_standard_method_codec_decode_value(GBytes *message, GError **error) {
+    gsize size = 0;
+    const struct raw_std_value *value = g_bytes_get_data(message, &size);
+    if (size == 0 || !raw_std_value_check(value, size)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to decode value");
+        return NULL;
+    }
+
+    return std_read_value(message, value);
+}
+
+struct method_call_args {
+    const gchar *method;
+    FlValue *args;
+};
+
+static void write_method_call(struct std_writer *writer, gconstpointer userdata) {
+    const struct method_call_args *call = userdata;
+
+    std_writer_put_string(writer, call->method);
+    std_writer_put_value(writer, call->args);
+}
+
+static GBytes *fl_standard_method_codec_encode_method_call(FlMethodCodec *codec, const gchar *method, FlValue *args, GError **error) {
+    (void) codec;
+    (void) error;
+    struct method_call_args call = {
+        .method = method,
+        .args = args,
+    };
+
+    return std_encode(write_method_call, &call);
+}
+
+static gboolean fl_standard_method_codec_decode_method_call(FlMethodCodec *codec, GBytes *message, gchar **method_out,
+                                                            FlValue **args_out, GError **error) {
+    (void) codec;
+    gsize size = 0;
+    const struct raw_std_value *value = g_bytes_get_data(message, &size);
+    if (size == 0 || !raw_std_method_call_check(value, size)) {
         g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to decode method call");
         return FALSE;
     }
 
     if (method_out) {
-        *method_out = g_strdup(obj.method ? obj.method : "");
+        *method_out = std_read_string_dup(raw_std_method_call_get_method(value));
     }
     if (args_out) {
-        *args_out = std_value_to_fl_value(&obj.std_arg);
+        *args_out = std_read_value(message, raw_std_method_call_get_arg(value));
     }
 
-    platch_free_obj(&obj);
     return TRUE;
 }
 
+static void write_success_envelope(struct std_writer *writer, gconstpointer userdata) {
+    std_writer_put_u8(writer, 0x00);
+    std_writer_put_value(writer, (FlValue *) userdata);
+}
+
 static GBytes *fl_standard_method_codec_encode_success_envelope(FlMethodCodec *codec, FlValue *result, GError **error) {
     (void) codec;
-    struct std_value std_result = {0};
-    int ok = fl_value_to_std_value(result, &std_result);
-    if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode success envelope");
-        return NULL;
-    }
+    (void) error;
+    return std_encode(write_success_envelope, result);
+}
 
-    struct platch_obj obj = PLATCH_OBJ_STD_CALL_SUCCESS_RESPONSE(std_result);
-    uint8_t *buffer = NULL;
-    size_t size = 0;
-    ok = platch_encode(&obj, &buffer, &size);
-    platch_free_std_value(&std_result);
-    if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode success envelope");
-        return NULL;
-    }
+struct error_envelope_args {
+    const gchar *code;
+    const gchar *message;
+    FlValue *details;
+};
 
-    return g_bytes_new_take(buffer, size);
+static void write_error_envelope(struct std_writer *writer, gconstpointer userdata) {
+    const struct error_envelope_args *envelope = userdata;
+
+    std_writer_put_u8(writer, 0x01);
+    std_writer_put_string(writer, envelope->code);
+    std_writer_put_string(writer, envelope->message);
+    std_writer_put_value(writer, envelope->details);
 }
 
 static GBytes *fl_standard_method_codec_encode_error_envelope(FlMethodCodec *codec, const gchar *code, const gchar *message,
                                                               FlValue *details, GError **error) {
     (void) codec;
-    struct std_value std_details = {0};
-    int ok = fl_value_to_std_value(details, &std_details);
-    if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode error envelope");
-        return NULL;
-    }
-
-    struct platch_obj obj = PLATCH_OBJ_STD_CALL_ERROR_RESPONSE(code ? code : "", message ? message : "", std_details);
-    uint8_t *buffer = NULL;
-    size_t size = 0;
-    ok = platch_encode(&obj, &buffer, &size);
-    platch_free_std_value(&std_details);
-    if (ok != 0) {
-        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to encode error envelope");
-        return NULL;
-    }
+    (void) error;
+    struct error_envelope_args envelope = {
+        .code = code ? code : "",
+        .message = message ? message : "",
+        .details = details,
+    };
 
-    return g_bytes_new_take(buffer, size);
+    return std_encode(write_error_envelope, &envelope);
 }
 
 static gboolean fl_standard_method_codec_decode_response_envelope(FlMethodCodec *codec, GBytes *message, FlValue **result_out,
@@ -310,30 +619,33 @@ static gboolean fl_standard_method_codec_decode_response_envelope(FlMethodCodec
     }
     gsize size = 0;
     const uint8_t *data = g_bytes_get_data(message, &size);
-    struct platch_obj obj = {0};
-    int ok = platch_decode(data, size, kStandardMethodCallResponse, &obj);
-    if (ok != 0) {
+    if (size == 0 || !raw_std_method_call_response_check((const struct raw_std_value *) data, size)) {
         g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to decode response envelope");
         return FALSE;
     }
 
-    if (obj.success) {
+    // first byte is the success flag, the actual values start after that.
+    const struct raw_std_value *value = (const struct raw_std_value *) (data + 1);
+
+    if (data[0] == 0x00) {
         if (result_out) {
-            *result_out = std_value_to_fl_value(&obj.std_result);
+            *result_out = std_read_value(message, value);
         }
     } else {
+        const struct raw_std_value *error_message = raw_std_value_after(value);
+        const struct raw_std_value *error_details = raw_std_value_after(error_message);
+
         if (error_code_out) {
-            *error_code_out = g_strdup(obj.error_code ? obj.error_code : "");
+            *error_code_out = std_read_string_dup(value);
         }
         if (error_message_out) {
-            *error_message_out = g_strdup(obj.error_msg ? obj.error_msg : "");
+            *error_message_out = std_read_string_dup(error_message);
         }
         if (error_details_out) {
-            *error_details_out = std_value_to_fl_value(&obj.std_error_details);
+            *error_details_out = std_read_value(message, error_details);
         }
     }
 
-    platch_free_obj(&obj);
     return TRUE;
 }
 
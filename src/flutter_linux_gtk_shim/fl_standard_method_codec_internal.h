@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: MIT
+#ifndef FL_STANDARD_METHOD_CODEC_INTERNAL_H
+#define FL_STANDARD_METHOD_CODEC_INTERNAL_H
+
+#include "flutter_linux/fl_standard_method_codec.h"
+
+// Encode/decode a single value using the standard message codec.
+// Typed lists in decoded values reference @a message instead of copying it.
+GBytes *fl_standard_method_codec_encode_value(FlValue *value, GError **error);
+FlValue *fl_standard_method_codec_decode_value(GBytes *message, GError **error);
+
+// Same as above, but converting via struct std_value (platch_encode/platch_decode).
+// Only kept for comparison in tests & benchmarks.
+GBytes *fl_standard_method_codec_encode_value_legacy(FlValue *value, GError **error);
+FlValue *fl_standard_method_codec_decode_value_legacy(GBytes *message, GError **error);
+
+#endif  // FL_STANDARD_METHOD_CODEC_INTERNAL_H
@@ -3,6 +3,8 @@
 
 #include <string.h>
 
+#include "fl_value_internal.h"
+
 #if !GLIB_CHECK_VERSION(2, 68, 0)
 static gpointer g_memdup2(gconstpointer mem, gsize byte_size) {
     if (mem == NULL || byte_size == 0) {
@@ -19,9 +21,23 @@ static gpointer g_memdup2(gconstpointer mem, gsize byte_size) {
 }
 #endif
 
+// Maps with at least this many entries get a hash index for fl_value_lookup_string.
+// Below that, a linear scan over the keys is faster than hashing the key.
+#define FL_VALUE_MAP_INDEX_THRESHOLD 16
+
+#define FL_VALUE_LIST_MIN_CAPACITY 4
+
+struct fl_value_map_entry {
+    FlValue *key;
+    FlValue *value;
+
+    // g_str_hash of the key, if the key is a string.
+    guint key_hash;
+};
+
 struct _FlValue {
-    GObject parent_instance;
     FlValueType type;
+    gint ref_count;
     union {
         gboolean bool_value;
         int64_t int_value;
@@ -30,91 +46,254 @@ struct _FlValue {
         struct {
             size_t length;
             uint8_t *data;
+            GBytes *owner;
         } uint8_list;
         struct {
             size_t length;
             int32_t *data;
+            GBytes *owner;
         } int32_list;
         struct {
             size_t length;
             int64_t *data;
+            GBytes *owner;
         } int64_list;
         struct {
             size_t length;
             double *data;
+            GBytes *owner;
         } float_list;
-        GPtrArray *list;
         struct {
-            GPtrArray *keys;
-            GPtrArray *values;
+            size_t length;
+            size_t capacity;
+            FlValue **items;
+        } list;
+        struct {
+            size_t length;
+            size_t capacity;
+            struct fl_value_map_entry *entries;
+
+            // Open-addressing table of string keys, NULL for small maps.
+            // Each slot is an index into entries plus one, 0 means empty.
+            uint32_t *index;
+            size_t index_mask;
         } map;
     } value;
 };
 
+// Typed lists either own their data (owner == NULL) or borrow it from a GBytes.
+#define FREE_TYPED_LIST(list)              \
+    do {                                   \
+        if ((list).owner != NULL) {        \
+            g_bytes_unref((list).owner);   \
+        } else {                           \
+            g_free((list).data);           \
+        }                                  \
+    } while (0)
+
+/*
+ * FlValues are allocated & freed in large numbers while encoding or decoding
+ * platform messages, so instead of going through malloc for each one, they're
+ * carved out of slabs and recycled through a per-thread free list.
+ *
+ * Values can be freed on a different thread than they were allocated on, so a
+ * freed value always goes to the free list of the freeing thread. If a thread
+ * accumulates too many free values, half of them are moved to a shared free list
+ * which other threads refill from. Slabs are never returned to the system.
+ *
+ * Sanitizer builds use plain g_new / g_free so use-after-free is still caught.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+    #define FL_VALUE_USE_SLABS 0
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define FL_VALUE_USE_SLABS 0
+    #endif
+#endif
+
+#ifndef FL_VALUE_USE_SLABS
+    #define FL_VALUE_USE_SLABS 1
+#endif
+
+#if FL_VALUE_USE_SLABS
+
+    #define FL_VALUE_SLAB_LENGTH 64
+    #define FL_VALUE_CACHE_MAX_FREE 256
+
+union fl_value_slot {
+    union fl_value_slot *next;
+    struct _FlValue value;
+};
+
+struct fl_value_cache {
+    union fl_value_slot *free;
+    size_t n_free;
+};
+
+G_LOCK_DEFINE_STATIC(shared_free);
+static union fl_value_slot *shared_free = NULL;
+static size_t n_shared_free = 0;
+
+static void fl_value_cache_destroy(gpointer userdata);
+
+static GPrivate value_cache = G_PRIVATE_INIT(fl_value_cache_destroy);
+
+/// Moves the first @a n slots of @a *list to the shared free list.
+static void give_to_shared_locked(union fl_value_slot **list, size_t n) {
+    union fl_value_slot *first = *list, *last = first;
+
+    g_assert(n > 0);
+
+    for (size_t i = 1; i < n; i++) {
+        last = last->next;
+    }
+
+    *list = last->next;
+    last->next = shared_free;
+    shared_free = first;
+    n_shared_free += n;
+}
+
+static void fl_value_cache_destroy(gpointer userdata) {
+    struct fl_value_cache *cache = userdata;
+
+    if (cache->n_free > 0) {
+        G_LOCK(shared_free);
+        give_to_shared_locked(&cache->free, cache->n_free);
+        G_UNLOCK(shared_free);
+    }
+
+    g_free(cache);
+}
+
+static struct fl_value_cache *get_cache(void) {
+    struct fl_value_cache *cache = g_private_get(&value_cache);
+
+    if (G_UNLIKELY(cache == NULL)) {
+        cache = g_new0(struct fl_value_cache, 1);
+        g_private_set(&value_cache, cache);
+    }
+
+    return cache;
+}
+
+static void refill_cache(struct fl_value_cache *cache) {
+    G_LOCK(shared_free);
+
+    if (n_shared_free > 0) {
+        size_t n = MIN(n_shared_free, FL_VALUE_SLAB_LENGTH);
+        union fl_value_slot *first = shared_free, *last = first;
+
+        for (size_t i = 1; i < n; i++) {
+            last = last->next;
+        }
+
+        shared_free = last->next;
+        n_shared_free -= n;
+
+        last->next = cache->free;
+        cache->free = first;
+        cache->n_free += n;
+
+        G_UNLOCK(shared_free);
+        return;
+    }
+
+    G_UNLOCK(shared_free);
+
+    union fl_value_slot *slab = g_new(union fl_value_slot, FL_VALUE_SLAB_LENGTH);
+    for (size_t i = 0; i < FL_VALUE_SLAB_LENGTH; i++) {
+        slab[i].next = i + 1 < FL_VALUE_SLAB_LENGTH ? slab + i + 1 : cache->free;
+    }
+
+    cache->free = slab;
+    cache->n_free += FL_VALUE_SLAB_LENGTH;
+}
+
+static FlValue *fl_value_alloc(void) {
+    struct fl_value_cache *cache = get_cache();
+    union fl_value_slot *slot;
+
+    if (G_UNLIKELY(cache->free == NULL)) {
+        refill_cache(cache);
+    }
+
+    slot = cache->free;
+    cache->free = slot->next;
+    cache->n_free--;
+
+    return &slot->value;
+}
+
+static void fl_value_free(FlValue *value) {
+    struct fl_value_cache *cache = get_cache();
+    union fl_value_slot *slot = (union fl_value_slot *) value;
+
+    slot->next = cache->free;
+    cache->free = slot;
+    cache->n_free++;
+
+    if (G_UNLIKELY(cache->n_free > FL_VALUE_CACHE_MAX_FREE)) {
+        G_LOCK(shared_free);
+        give_to_shared_locked(&cache->free, FL_VALUE_CACHE_MAX_FREE / 2);
+        G_UNLOCK(shared_free);
+
+        cache->n_free -= FL_VALUE_CACHE_MAX_FREE / 2;
+    }
+}
+
+#else
+
+static FlValue *fl_value_alloc(void) {
+    return g_new(FlValue, 1);
+}
+
+static void fl_value_free(FlValue *value) {
+    g_free(value);
+}
+
+#endif
+
 #define fl_value_get_type fl_value_get_gtype
-G_DEFINE_TYPE(FlValue, fl_value, G_TYPE_OBJECT)
+G_DEFINE_BOXED_TYPE(FlValue, fl_value, fl_value_ref, fl_value_unref)
 #undef fl_value_get_type
 
-static void fl_value_finalize(GObject *object) {
-    FlValue *self = FL_VALUE(object);
-
+static void fl_value_destroy(FlValue *self) {
     switch (self->type) {
         case FL_VALUE_TYPE_STRING:
             g_free(self->value.string_value);
             break;
         case FL_VALUE_TYPE_UINT8_LIST:
-            g_free(self->value.uint8_list.data);
+            FREE_TYPED_LIST(self->value.uint8_list);
             break;
         case FL_VALUE_TYPE_INT32_LIST:
-            g_free(self->value.int32_list.data);
+            FREE_TYPED_LIST(self->value.int32_list);
             break;
         case FL_VALUE_TYPE_INT64_LIST:
-            g_free(self->value.int64_list.data);
+            FREE_TYPED_LIST(self->value.int64_list);
             break;
         case FL_VALUE_TYPE_FLOAT_LIST:
-            g_free(self->value.float_list.data);
+            FREE_TYPED_LIST(self->value.float_list);
             break;
         case FL_VALUE_TYPE_LIST:
-            if (self->value.list) {
-                for (guint i = 0; i < self->value.list->len; i++) {
-                    FlValue *item = g_ptr_array_index(self->value.list, i);
-                    if (item) {
-                        g_object_unref(item);
-                    }
-                }
-                g_ptr_array_free(self->value.list, TRUE);
+            for (size_t i = 0; i < self->value.list.length; i++) {
+                fl_value_unref(self->value.list.items[i]);
             }
+            g_free(self->value.list.items);
             break;
         case FL_VALUE_TYPE_MAP:
-            if (self->value.map.keys) {
-                for (guint i = 0; i < self->value.map.keys->len; i++) {
-                    FlValue *key = g_ptr_array_index(self->value.map.keys, i);
-                    FlValue *val = g_ptr_array_index(self->value.map.values, i);
-                    if (key) {
-                        g_object_unref(key);
-                    }
-                    if (val) {
-                        g_object_unref(val);
-                    }
-                }
-                g_ptr_array_free(self->value.map.keys, TRUE);
-                g_ptr_array_free(self->value.map.values, TRUE);
+            for (size_t i = 0; i < self->value.map.length; i++) {
+                fl_value_unref(self->value.map.entries[i].key);
+                fl_value_unref(self->value.map.entries[i].value);
             }
+            g_free(self->value.map.entries);
+            g_free(self->value.map.index);
             break;
         default:
             break;
     }
 
-    G_OBJECT_CLASS(fl_value_parent_class)->finalize(object);
-}
-
-static void fl_value_class_init(FlValueClass *klass) {
-    GObjectClass *object_class = G_OBJECT_CLASS(klass);
-    object_class->finalize = fl_value_finalize;
-}
-
-static void fl_value_init(FlValue *self) {
-    self->type = FL_VALUE_TYPE_NULL;
+    fl_value_free(self);
 }
 
 FlValueType fl_value_get_type_id(FlValue *value) {
@@ -127,8 +306,10 @@ FlValueType fl_value_get_type(FlValue *value) {
 }
 
 static FlValue *fl_value_new_common(FlValueType type) {
-    FlValue *value = g_object_new(FL_TYPE_VALUE, NULL);
+    FlValue *value = fl_value_alloc();
+    memset(value, 0, sizeof *value);
     value->type = type;
+    value->ref_count = 1;
     return value;
 }
 
@@ -188,25 +369,45 @@ FlValue *fl_value_new_float_list(const double *value, size_t length) {
     return v;
 }
 
-FlValue *fl_value_new_list(void) {
-    FlValue *v = fl_value_new_common(FL_VALUE_TYPE_LIST);
-    v->value.list = g_ptr_array_new_with_free_func(NULL);
+FlValue *fl_value_new_string_sized(const gchar *value, size_t length) {
+    FlValue *v = fl_value_new_common(FL_VALUE_TYPE_STRING);
+    v->value.string_value = g_strndup(value, length);
     return v;
 }
 
+#define DEFINE_NEW_BORROWED_LIST(suffix, type_id, element_type)                                                   \
+    FlValue *fl_value_new_##suffix##_borrowed(GBytes *owner, const element_type *value, size_t length) {          \
+        FlValue *v = fl_value_new_common(type_id);                                                                 \
+        v->value.suffix.length = length;                                                                           \
+        v->value.suffix.data = (element_type *) value;                                                             \
+        v->value.suffix.owner = g_bytes_ref(owner);                                                                \
+        return v;                                                                                                  \
+    }
+
+DEFINE_NEW_BORROWED_LIST(uint8_list, FL_VALUE_TYPE_UINT8_LIST, uint8_t)
+DEFINE_NEW_BORROWED_LIST(int32_list, FL_VALUE_TYPE_INT32_LIST, int32_t)
+DEFINE_NEW_BORROWED_LIST(int64_list, FL_VALUE_TYPE_INT64_LIST, int64_t)
+DEFINE_NEW_BORROWED_LIST(float_list, FL_VALUE_TYPE_FLOAT_LIST, double)
+
+FlValue *fl_value_new_list(void) {
+    return fl_value_new_common(FL_VALUE_TYPE_LIST);
+}
+
 FlValue *fl_value_new_map(void) {
-    FlValue *v = fl_value_new_common(FL_VALUE_TYPE_MAP);
-    v->value.map.keys = g_ptr_array_new_with_free_func(NULL);
-    v->value.map.values = g_ptr_array_new_with_free_func(NULL);
-    return v;
+    return fl_value_new_common(FL_VALUE_TYPE_MAP);
 }
 
 FlValue *fl_value_ref(FlValue *value) {
-    return g_object_ref(value);
+    g_return_val_if_fail(value != NULL, NULL);
+    g_atomic_int_inc(&value->ref_count);
+    return value;
 }
 
 void fl_value_unref(FlValue *value) {
-    g_object_unref(value);
+    g_return_if_fail(value != NULL);
+    if (g_atomic_int_dec_and_test(&value->ref_count)) {
+        fl_value_destroy(value);
+    }
 }
 
 const gchar *fl_value_get_string(FlValue *value) {
@@ -237,8 +438,8 @@ size_t fl_value_get_length(FlValue *value) {
         case FL_VALUE_TYPE_INT32_LIST: return value->value.int32_list.length;
         case FL_VALUE_TYPE_INT64_LIST: return value->value.int64_list.length;
         case FL_VALUE_TYPE_FLOAT_LIST: return value->value.float_list.length;
-        case FL_VALUE_TYPE_LIST: return value->value.list ? value->value.list->len : 0;
-        case FL_VALUE_TYPE_MAP: return value->value.map.keys ? value->value.map.keys->len : 0;
+        case FL_VALUE_TYPE_LIST: return value->value.list.length;
+        case FL_VALUE_TYPE_MAP: return value->value.map.length;
         default: return 0;
     }
 }
@@ -301,43 +502,83 @@ const double *fl_value_get_float_list(FlValue *value, size_t *length) {
 
 FlValue *fl_value_get_list_value(FlValue *value, size_t index) {
     g_return_val_if_fail(value != NULL, NULL);
-    if (value->type != FL_VALUE_TYPE_LIST || value->value.list == NULL || index >= value->value.list->len) {
+    if (value->type != FL_VALUE_TYPE_LIST || index >= value->value.list.length) {
         return NULL;
     }
-    return g_ptr_array_index(value->value.list, index);
+    return value->value.list.items[index];
 }
 
 FlValue *fl_value_get_map_key(FlValue *value, size_t index) {
     g_return_val_if_fail(value != NULL, NULL);
-    if (value->type != FL_VALUE_TYPE_MAP || value->value.map.keys == NULL || index >= value->value.map.keys->len) {
+    if (value->type != FL_VALUE_TYPE_MAP || index >= value->value.map.length) {
         return NULL;
     }
-    return g_ptr_array_index(value->value.map.keys, index);
+    return value->value.map.entries[index].key;
 }
 
 FlValue *fl_value_get_map_value(FlValue *value, size_t index) {
     g_return_val_if_fail(value != NULL, NULL);
-    if (value->type != FL_VALUE_TYPE_MAP || value->value.map.values == NULL || index >= value->value.map.values->len) {
+    if (value->type != FL_VALUE_TYPE_MAP || index >= value->value.map.length) {
         return NULL;
     }
-    return g_ptr_array_index(value->value.map.values, index);
+    return value->value.map.entries[index].value;
+}
+
+static void map_index_insert(FlValue *map, size_t entry_index) {
+    const struct fl_value_map_entry *entry = map->value.map.entries + entry_index;
+    size_t slot;
+
+    if (entry->key->type != FL_VALUE_TYPE_STRING) {
+        return;
+    }
+
+    // Duplicate keys end up later in the probe sequence than the first one,
+    // so lookups still find the first matching entry, same as a linear scan.
+    slot = entry->key_hash & map->value.map.index_mask;
+    while (map->value.map.index[slot] != 0) {
+        slot = (slot + 1) & map->value.map.index_mask;
+    }
+
+    map->value.map.index[slot] = entry_index + 1;
+}
+
+static void map_index_rebuild(FlValue *map, size_t size) {
+    g_free(map->value.map.index);
+    map->value.map.index = g_new0(uint32_t, size);
+    map->value.map.index_mask = size - 1;
+
+    for (size_t i = 0; i < map->value.map.length; i++) {
+        map_index_insert(map, i);
+    }
 }
 
 FlValue *fl_value_lookup_string(FlValue *map, const gchar *key) {
     g_return_val_if_fail(map != NULL, NULL);
     g_return_val_if_fail(key != NULL, NULL);
-    if (map->type != FL_VALUE_TYPE_MAP || map->value.map.keys == NULL) {
+    if (map->type != FL_VALUE_TYPE_MAP) {
         return NULL;
     }
 
-    for (guint i = 0; i < map->value.map.keys->len; i++) {
-        FlValue *k = g_ptr_array_index(map->value.map.keys, i);
-        if (k && fl_value_get_type_id(k) == FL_VALUE_TYPE_STRING) {
-            const gchar *kstr = fl_value_get_string(k);
-            if (kstr && g_strcmp0(kstr, key) == 0) {
-                return fl_value_get_map_value(map, i);
+    if (map->value.map.index != NULL) {
+        guint hash = g_str_hash(key);
+        size_t slot = hash & map->value.map.index_mask;
+
+        for (uint32_t i; (i = map->value.map.index[slot]) != 0; slot = (slot + 1) & map->value.map.index_mask) {
+            const struct fl_value_map_entry *entry = map->value.map.entries + i - 1;
+
+            if (entry->key_hash == hash && strcmp(entry->key->value.string_value, key) == 0) {
+                return entry->value;
             }
         }
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < map->value.map.length; i++) {
+        FlValue *k = map->value.map.entries[i].key;
+        if (k->type == FL_VALUE_TYPE_STRING && strcmp(k->value.string_value, key) == 0) {
+            return map->value.map.entries[i].value;
+        }
     }
 
     return NULL;
@@ -349,7 +590,13 @@ void fl_value_append(FlValue *list, FlValue *value) {
     if (list->type != FL_VALUE_TYPE_LIST) {
         return;
     }
-    g_ptr_array_add(list->value.list, g_object_ref(value));
+
+    if (list->value.list.length == list->value.list.capacity) {
+        list->value.list.capacity = MAX(list->value.list.capacity * 2, FL_VALUE_LIST_MIN_CAPACITY);
+        list->value.list.items = g_renew(FlValue *, list->value.list.items, list->value.list.capacity);
+    }
+
+    list->value.list.items[list->value.list.length++] = fl_value_ref(value);
 }
 
 void fl_value_set(FlValue *map, FlValue *key, FlValue *value) {
@@ -359,6 +606,25 @@ void fl_value_set(FlValue *map, FlValue *key, FlValue *value) {
     if (map->type != FL_VALUE_TYPE_MAP) {
         return;
     }
-    g_ptr_array_add(map->value.map.keys, g_object_ref(key));
-    g_ptr_array_add(map->value.map.values, g_object_ref(value));
+
+    if (map->value.map.length == map->value.map.capacity) {
+        map->value.map.capacity = MAX(map->value.map.capacity * 2, FL_VALUE_LIST_MIN_CAPACITY);
+        map->value.map.entries = g_renew(struct fl_value_map_entry, map->value.map.entries, map->value.map.capacity);
+    }
+
+    size_t entry_index = map->value.map.length++;
+    map->value.map.entries[entry_index] = (struct fl_value_map_entry){
+        .key = fl_value_ref(key),
+        .value = fl_value_ref(value),
+        .key_hash = key->type == FL_VALUE_TYPE_STRING ? g_str_hash(key->value.string_value) : 0,
+    };
+
+    // Keep the index at most half full.
+    if (map->value.map.length < FL_VALUE_MAP_INDEX_THRESHOLD) {
+        return;
+    } else if (map->value.map.index == NULL || map->value.map.length * 2 > map->value.map.index_mask + 1) {
+        map_index_rebuild(map, map->value.map.index ? (map->value.map.index_mask + 1) * 2 : FL_VALUE_MAP_INDEX_THRESHOLD * 4);
+    } else {
+        map_index_insert(map, entry_index);
+    }
 }
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: MIT
+#ifndef FL_VALUE_INTERNAL_H
+#define FL_VALUE_INTERNAL_H
+
+#include "flutter_linux/fl_value.h"
+
+#include <gio/gio.h>
+
+FlValue *fl_value_new_string_sized(const gchar *value, size_t length);
+
+// Typed lists that reference @a value inside @a owner instead of copying it.
+// @a owner is kept alive for as long as the returned FlValue is alive.
+FlValue *fl_value_new_uint8_list_borrowed(GBytes *owner, const uint8_t *value, size_t length);
+FlValue *fl_value_new_int32_list_borrowed(GBytes *owner, const int32_t *value, size_t length);
+FlValue *fl_value_new_int64_list_borrowed(GBytes *owner, const int64_t *value, size_t length);
+FlValue *fl_value_new_float_list_borrowed(GBytes *owner, const double *value, size_t length);
+
+#endif  // FL_VALUE_INTERNAL_H
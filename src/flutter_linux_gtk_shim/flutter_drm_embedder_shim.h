@@ -10,6 +10,7 @@
 struct flutter_drm_embedder;
 struct texture;
 struct gtk_plugin_loader;
+struct gtk_plugin_loader_options;
 
 struct plugin_registry;
 struct texture_registry;
@@ -34,6 +35,7 @@ struct texture *flutter_drm_embedder_create_texture(struct flutter_drm_embedder
 
 void flutter_drm_embedder_set_gtk_plugin_loader(struct flutter_drm_embedder *flutter_drm_embedder, struct gtk_plugin_loader *loader);
 struct gtk_plugin_loader *flutter_drm_embedder_get_gtk_plugin_loader(struct flutter_drm_embedder *flutter_drm_embedder);
+const struct gtk_plugin_loader_options *flutter_drm_embedder_get_gtk_plugin_loader_options(struct flutter_drm_embedder *flutter_drm_embedder);
 
 void flutter_drm_embedder_set_fl_texture_registrar(struct flutter_drm_embedder *flutter_drm_embedder, void *registrar);
 void *flutter_drm_embedder_get_fl_texture_registrar(struct flutter_drm_embedder *flutter_drm_embedder);
@@ -0,0 +1,570 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Frame capture - writes the frames composited by a headless (dummy) window
+ * to PNG files, a raw video stream or a shared memory ring.
+ */
+
+#define _GNU_SOURCE
+#include "frame_capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <pthread.h>
+
+#include "util/asserts.h"
+#include "util/collection.h"
+#include "util/logging.h"
+#include "util/macros.h"
+
+/// The maximum amount of data in a single stored (uncompressed) deflate block.
+#define DEFLATE_MAX_STORED_BLOCK 65535
+
+enum frame_capture_target {
+    kNull_FrameCaptureTarget,
+    kPNG_FrameCaptureTarget,
+    kRaw_FrameCaptureTarget,
+    kShm_FrameCaptureTarget,
+};
+
+struct frame_capture {
+    enum frame_capture_target target;
+    struct vec2i size;
+
+    /// png: The directory the images are written to.
+    char *directory;
+
+    /// png: The encoded image.
+    uint8_t *png;
+    size_t png_size;
+
+    /// raw: The file all frames are appended to.
+    int fd;
+
+    /// shm: The name of the shared memory object, and its mapping.
+    char *shm_name;
+    void *shm;
+    size_t shm_size;
+
+    FILE *timings_file;
+
+    uint64_t n_frames;
+    uint64_t first_present_ns, last_present_ns;
+    uint64_t total_composite_ns, total_readback_ns, total_write_ns;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc32_of(const uint8_t *data, size_t length) {
+    uint32_t c = 0xFFFFFFFFu;
+
+    for (size_t i = 0; i < length; i++) {
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+    out[0] = (value >> 24) & 0xFF;
+    out[1] = (value >> 16) & 0xFF;
+    out[2] = (value >> 8) & 0xFF;
+    out[3] = value & 0xFF;
+}
+
+static size_t get_png_raw_size(struct vec2i size) {
+    // Every row starts with a filter type byte.
+    return (size_t) size.y * (1 + (size_t) size.x * 4);
+}
+
+static size_t get_n_deflate_blocks(size_t raw_size) {
+    return MAX2((raw_size + DEFLATE_MAX_STORED_BLOCK - 1) / DEFLATE_MAX_STORED_BLOCK, 1);
+}
+
+size_t frame_capture_get_png_size(struct vec2i size) {
+    size_t raw_size = get_png_raw_size(size);
+
+    // signature, IHDR chunk, IDAT chunk (zlib header, stored blocks, adler32), IEND chunk.
+    return 8 + (12 + 13) + (12 + 2 + 5 * get_n_deflate_blocks(raw_size) + raw_size + 4) + 12;
+}
+
+size_t frame_capture_encode_png(struct vec2i size, const uint8_t *pixels, uint8_t *out, size_t out_size) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    size_t raw_size, raw_offset, block_remaining, idat_length;
+    uint32_t adler_a, adler_b;
+    uint8_t *cursor, *idat;
+
+    ASSERT_NOT_NULL(pixels);
+    ASSERT_NOT_NULL(out);
+    assert(size.x > 0 && size.y > 0);
+
+    if (out_size < frame_capture_get_png_size(size)) {
+        return 0;
+    }
+
+    pthread_once(&crc_table_once, init_crc_table);
+
+    raw_size = get_png_raw_size(size);
+    cursor = out;
+
+    memcpy(cursor, signature, sizeof signature);
+    cursor += sizeof signature;
+
+    // IHDR: 8-bit RGBA, no interlacing.
+    put_be32(cursor, 13);
+    memcpy(cursor + 4, "IHDR", 4);
+    put_be32(cursor + 8, size.x);
+    put_be32(cursor + 12, size.y);
+    cursor[16] = 8;
+    cursor[17] = 6;
+    cursor[18] = 0;
+    cursor[19] = 0;
+    cursor[20] = 0;
+    put_be32(cursor + 21, crc32_of(cursor + 4, 4 + 13));
+    cursor += 12 + 13;
+
+    // IDAT: a zlib stream of stored deflate blocks. Compressing would take longer than
+    // rendering the frame, and the images are only meant to be compared.
+    idat = cursor;
+    idat_length = 2 + 5 * get_n_deflate_blocks(raw_size) + raw_size + 4;
+    put_be32(cursor, idat_length);
+    memcpy(cursor + 4, "IDAT", 4);
+    cursor += 8;
+
+    cursor[0] = 0x78;
+    cursor[1] = 0x01;
+    cursor += 2;
+
+    adler_a = 1;
+    adler_b = 0;
+    raw_offset = 0;
+    block_remaining = 0;
+    for (int y = 0; y < size.y; y++) {
+        const uint8_t *row = pixels + (size_t) y * size.x * 4;
+
+        for (int x = -1; x < size.x * 4; x++) {
+            uint8_t byte;
+
+            if (x < 0) {
+                // filter type: none
+                byte = 0;
+            } else if ((x & 3) == 3) {
+                byte = row[x];
+            } else {
+                // PNG alpha isn't premultiplied.
+                uint8_t alpha = row[x | 3];
+                byte = (alpha == 0 || alpha == 255) ? row[x] : (uint8_t) MIN2((row[x] * 255 + alpha / 2) / alpha, 255);
+            }
+
+            if (block_remaining == 0) {
+                size_t block_size = MIN2(raw_size - raw_offset, DEFLATE_MAX_STORED_BLOCK);
+
+                cursor[0] = raw_offset + block_size == raw_size ? 1 : 0;
+                cursor[1] = block_size & 0xFF;
+                cursor[2] = (block_size >> 8) & 0xFF;
+                cursor[3] = ~block_size & 0xFF;
+                cursor[4] = (~block_size >> 8) & 0xFF;
+                cursor += 5;
+                block_remaining = block_size;
+            }
+
+            *cursor++ = byte;
+            block_remaining--;
+            raw_offset++;
+
+            adler_a = (adler_a + byte) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+    }
+
+    put_be32(cursor, (adler_b << 16) | adler_a);
+    cursor += 4;
+
+    put_be32(cursor, crc32_of(idat + 4, 4 + idat_length));
+    cursor += 4;
+
+    put_be32(cursor, 0);
+    memcpy(cursor + 4, "IEND", 4);
+    put_be32(cursor + 8, crc32_of(cursor + 4, 4));
+    cursor += 12;
+
+    return cursor - out;
+}
+
+static int write_all(int fd, const void *data, size_t length) {
+    const uint8_t *cursor = data;
+    ssize_t n_written;
+
+    while (length > 0) {
+        n_written = write(fd, cursor, length);
+        if (n_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        cursor += n_written;
+        length -= n_written;
+    }
+
+    return 0;
+}
+
+static size_t get_shm_slot_size(struct vec2i size) {
+    return sizeof(struct frame_capture_shm_slot) + (size_t) size.x * size.y * 4;
+}
+
+static int open_shm(struct frame_capture *capture, const char *name) {
+    struct frame_capture_shm_header *header;
+    size_t shm_size;
+    void *shm;
+    int fd, ok;
+
+    shm_size = sizeof *header + FRAME_CAPTURE_SHM_N_SLOTS * get_shm_slot_size(capture->size);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't open shared memory object \"%s\" for frame capture. shm_open: %s\n", name, strerror(ok));
+        return ok;
+    }
+
+    if (ftruncate(fd, shm_size) < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't resize shared memory object for frame capture. ftruncate: %s\n", strerror(ok));
+        goto fail_close;
+    }
+
+    shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        ok = errno;
+        LOG_ERROR("Couldn't map shared memory object for frame capture. mmap: %s\n", strerror(ok));
+        goto fail_close;
+    }
+
+    close(fd);
+
+    memset(shm, 0, shm_size);
+
+    header = shm;
+    header->version = FRAME_CAPTURE_SHM_VERSION;
+    header->width = capture->size.x;
+    header->height = capture->size.y;
+    header->stride = capture->size.x * 4;
+    header->drm_format = DRM_FORMAT_ABGR8888;
+    header->n_slots = FRAME_CAPTURE_SHM_N_SLOTS;
+    header->slot_size = get_shm_slot_size(capture->size);
+    header->n_frames = 0;
+
+    // Readers can rely on the rest of the header once the magic is there.
+    atomic_thread_fence(memory_order_release);
+    header->magic = FRAME_CAPTURE_SHM_MAGIC;
+
+    capture->shm = shm;
+    capture->shm_size = shm_size;
+    return 0;
+
+fail_close:
+    close(fd);
+    shm_unlink(name);
+    return ok;
+}
+
+bool frame_capture_is_valid_target(const char *target) {
+    if (target == NULL) {
+        return false;
+    }
+
+    if (streq(target, "null")) {
+        return true;
+    }
+
+    if (strncmp(target, "png:", 4) == 0 || strncmp(target, "raw:", 4) == 0) {
+        return target[4] != '\0';
+    }
+
+    if (strncmp(target, "shm:", 4) == 0) {
+        // shm_open wants exactly one leading slash.
+        return target[4] != '\0' && strchr(target + 5, '/') == NULL;
+    }
+
+    return false;
+}
+
+struct frame_capture *frame_capture_new(const char *target, const char *timings_path, struct vec2i size) {
+    struct frame_capture *capture;
+    int ok;
+
+    ASSERT_NOT_NULL(target);
+
+    if (!frame_capture_is_valid_target(target)) {
+        LOG_ERROR("Invalid frame capture target: \"%s\". Valid targets are null, png:<directory>, raw:<path> and shm:<name>.\n", target);
+        return NULL;
+    }
+
+    if (size.x <= 0 || size.y <= 0) {
+        LOG_ERROR("Can't capture frames of size %dx%d.\n", size.x, size.y);
+        return NULL;
+    }
+
+    capture = malloc(sizeof *capture);
+    if (capture == NULL) {
+        return NULL;
+    }
+
+    memset(capture, 0, sizeof *capture);
+    capture->size = size;
+    capture->fd = -1;
+
+    if (streq(target, "null")) {
+        capture->target = kNull_FrameCaptureTarget;
+    } else if (strncmp(target, "png:", 4) == 0) {
+        capture->target = kPNG_FrameCaptureTarget;
+
+        capture->directory = strdup(target + 4);
+        if (capture->directory == NULL) {
+            goto fail_free_capture;
+        }
+
+        capture->png_size = frame_capture_get_png_size(size);
+        capture->png = malloc(capture->png_size);
+        if (capture->png == NULL) {
+            goto fail_free_capture;
+        }
+    } else if (strncmp(target, "raw:", 4) == 0) {
+        capture->target = kRaw_FrameCaptureTarget;
+
+        if (streq(target + 4, "-")) {
+            capture->fd = dup(STDOUT_FILENO);
+        } else {
+            capture->fd = open(target + 4, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (capture->fd < 0) {
+            LOG_ERROR("Couldn't open \"%s\" for writing captured frames. open: %s\n", target + 4, strerror(errno));
+            goto fail_free_capture;
+        }
+    } else {
+        ASSUME(strncmp(target, "shm:", 4) == 0);
+        capture->target = kShm_FrameCaptureTarget;
+
+        if (target[4] == '/') {
+            capture->shm_name = strdup(target + 4);
+        } else {
+            ok = asprintf(&capture->shm_name, "/%s", target + 4);
+            if (ok < 0) {
+                capture->shm_name = NULL;
+            }
+        }
+        if (capture->shm_name == NULL) {
+            goto fail_free_capture;
+        }
+
+        ok = open_shm(capture, capture->shm_name);
+        if (ok != 0) {
+            goto fail_free_capture;
+        }
+    }
+
+    if (timings_path != NULL) {
+        capture->timings_file = fopen(timings_path, "we");
+        if (capture->timings_file == NULL) {
+            LOG_ERROR("Couldn't open \"%s\" for writing frame timings. fopen: %s\n", timings_path, strerror(errno));
+            goto fail_close_target;
+        }
+
+        fprintf(capture->timings_file, "frame,present_ns,composite_ns,readback_ns,write_ns\n");
+    }
+
+    return capture;
+
+fail_close_target:
+    if (capture->shm != NULL) {
+        munmap(capture->shm, capture->shm_size);
+        shm_unlink(capture->shm_name);
+    }
+    if (capture->fd >= 0) {
+        close(capture->fd);
+    }
+
+fail_free_capture:
+    free(capture->shm_name);
+    free(capture->png);
+    free(capture->directory);
+    free(capture);
+    return NULL;
+}
+
+void frame_capture_destroy(struct frame_capture *capture) {
+    ASSERT_NOT_NULL(capture);
+
+    if (capture->n_frames > 0) {
+        uint64_t n = capture->n_frames;
+        uint64_t duration_ns = capture->last_present_ns - capture->first_present_ns;
+
+        LOG_ERROR_UNPREFIXED(
+            "frame capture: %" PRIu64 " frames, %.1f fps, mean composite %.3f ms, readback %.3f ms, write %.3f ms\n",
+            n,
+            n > 1 && duration_ns > 0 ? (double) (n - 1) * 1e9 / (double) duration_ns : 0.0,
+            (double) capture->total_composite_ns / n / 1e6,
+            (double) capture->total_readback_ns / n / 1e6,
+            (double) capture->total_write_ns / n / 1e6
+        );
+    }
+
+    if (capture->timings_file != NULL) {
+        fclose(capture->timings_file);
+    }
+
+    if (capture->shm != NULL) {
+        // Readers that have the object mapped keep it alive.
+        munmap(capture->shm, capture->shm_size);
+        shm_unlink(capture->shm_name);
+    }
+
+    if (capture->fd >= 0) {
+        close(capture->fd);
+    }
+
+    free(capture->shm_name);
+    free(capture->png);
+    free(capture->directory);
+    free(capture);
+}
+
+static int write_png(struct frame_capture *capture, const struct frame_capture_frame *frame) {
+    char path[PATH_MAX];
+    size_t length;
+    int fd, ok;
+
+    length = frame_capture_encode_png(frame->size, frame->pixels, capture->png, capture->png_size);
+    ASSUME(length > 0);
+
+    ok = snprintf(path, sizeof path, "%s/frame-%06" PRIu64 ".png", capture->directory, capture->n_frames);
+    if (ok < 0 || (size_t) ok >= sizeof path) {
+        return ENAMETOOLONG;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't open \"%s\" for writing captured frame. open: %s\n", path, strerror(ok));
+        return ok;
+    }
+
+    ok = write_all(fd, capture->png, length);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't write captured frame to \"%s\". write: %s\n", path, strerror(ok));
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void write_shm(struct frame_capture *capture, const struct frame_capture_frame *frame) {
+    struct frame_capture_shm_header *header;
+    struct frame_capture_shm_slot *slot;
+    _Atomic uint64_t *sequence;
+
+    header = capture->shm;
+    slot = (struct frame_capture_shm_slot *) ((uint8_t *) capture->shm + sizeof *header +
+                                              (capture->n_frames % FRAME_CAPTURE_SHM_N_SLOTS) * header->slot_size);
+    sequence = (_Atomic uint64_t *) &slot->sequence;
+
+    atomic_fetch_add_explicit(sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->frame = capture->n_frames;
+    slot->present_ns = frame->present_ns;
+    slot->composite_ns = frame->composite_ns;
+    slot->readback_ns = frame->readback_ns;
+    memcpy(slot + 1, frame->pixels, (size_t) frame->size.x * frame->size.y * 4);
+
+    atomic_store_explicit(sequence, atomic_load_explicit(sequence, memory_order_relaxed) + 1, memory_order_release);
+    atomic_store_explicit((_Atomic uint64_t *) &header->n_frames, capture->n_frames + 1, memory_order_release);
+}
+
+int frame_capture_write(struct frame_capture *capture, const struct frame_capture_frame *frame) {
+    uint64_t write_start_ns, write_ns;
+    int ok;
+
+    ASSERT_NOT_NULL(capture);
+    ASSERT_NOT_NULL(frame);
+
+    if (frame->size.x != capture->size.x || frame->size.y != capture->size.y) {
+        LOG_ERROR(
+            "Captured frame has size %dx%d, but the capture was set up for %dx%d.\n",
+            frame->size.x,
+            frame->size.y,
+            capture->size.x,
+            capture->size.y
+        );
+        return EINVAL;
+    }
+
+    write_start_ns = get_monotonic_time();
+
+    switch (capture->target) {
+        case kNull_FrameCaptureTarget: ok = 0; break;
+        case kPNG_FrameCaptureTarget: ok = write_png(capture, frame); break;
+        case kRaw_FrameCaptureTarget:
+            ok = write_all(capture->fd, frame->pixels, (size_t) frame->size.x * frame->size.y * 4);
+            if (ok != 0) {
+                LOG_ERROR("Couldn't write captured frame. write: %s\n", strerror(ok));
+            }
+            break;
+        case kShm_FrameCaptureTarget:
+            write_shm(capture, frame);
+            ok = 0;
+            break;
+        default: UNREACHABLE();
+    }
+
+    write_ns = get_monotonic_time() - write_start_ns;
+
+    if (ok != 0) {
+        return ok;
+    }
+
+    if (capture->timings_file != NULL) {
+        fprintf(
+            capture->timings_file,
+            "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            capture->n_frames,
+            frame->present_ns,
+            frame->composite_ns,
+            frame->readback_ns,
+            write_ns
+        );
+    }
+
+    if (capture->n_frames == 0) {
+        capture->first_present_ns = frame->present_ns;
+    }
+    capture->last_present_ns = frame->present_ns;
+    capture->total_composite_ns += frame->composite_ns;
+    capture->total_readback_ns += frame->readback_ns;
+    capture->total_write_ns += write_ns;
+    capture->n_frames++;
+    return 0;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Frame capture - writes the frames composited by a headless (dummy) window
+ * to PNG files, a raw video stream or a shared memory ring, along with
+ * per-frame timings.
+ *
+ * Capture targets are specified as strings:
+ *
+ *   null               composite & read back frames, but don't write them anywhere
+ *                      (for benchmarking the rendering throughput)
+ *   png:<directory>    one <directory>/frame-<number>.png file per frame
+ *   raw:<path>         all frames as raw RGBA pixels into a single file,
+ *                      or to stdout if <path> is "-"
+ *   shm:<name>         a POSIX shared memory object (see shm_open) containing
+ *                      a @ref frame_capture_shm_header, followed by
+ *                      FRAME_CAPTURE_SHM_N_SLOTS slots of the most recent frames.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_FRAME_CAPTURE_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_FRAME_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/geometry.h"
+
+struct frame_capture;
+
+/**
+ * @brief A composited frame, 8-bit RGBA (in that byte order) with premultiplied alpha,
+ * tightly packed, top row first.
+ */
+struct frame_capture_frame {
+    struct vec2i size;
+    const uint8_t *pixels;
+
+    /// When the frame was handed to the window, in CLOCK_MONOTONIC nanoseconds.
+    uint64_t present_ns;
+
+    /// How long compositing the layers & reading back the result took.
+    uint64_t composite_ns;
+    uint64_t readback_ns;
+};
+
+#define FRAME_CAPTURE_SHM_MAGIC 0x70616366u /* "fcap" */
+#define FRAME_CAPTURE_SHM_VERSION 1
+#define FRAME_CAPTURE_SHM_N_SLOTS 4
+
+/**
+ * @brief The header of each slot of the shared memory ring. The pixels follow directly after it.
+ *
+ * @ref sequence is odd while the slot is being written, and is incremented again
+ * once it's complete. Readers should check it's even and unchanged before and after
+ * copying the slot.
+ */
+struct frame_capture_shm_slot {
+    uint64_t sequence;
+    uint64_t frame;
+    uint64_t present_ns;
+    uint64_t composite_ns;
+    uint64_t readback_ns;
+    uint64_t reserved[3];
+};
+
+/**
+ * @brief The header of the shared memory ring. Frame number n is written to slot n % n_slots.
+ */
+struct frame_capture_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t stride;
+
+    /// DRM fourcc of the pixels. (DRM_FORMAT_ABGR8888, which is RGBA in byte order)
+    uint32_t drm_format;
+
+    uint32_t n_slots;
+
+    /// Size of a slot including its header, in bytes.
+    uint32_t slot_size;
+
+    /// The number of frames written so far. Updated after a frame is complete.
+    uint64_t n_frames;
+};
+
+/**
+ * @brief Creates a new frame capture writing to @a target, for frames of size @a size.
+ *
+ * If @a timings_path is not NULL, a CSV line with the timings of each frame is appended to that file.
+ *
+ * @returns The frame capture, or NULL if @a target is invalid or couldn't be opened.
+ */
+struct frame_capture *frame_capture_new(const char *target, const char *timings_path, struct vec2i size);
+
+/**
+ * @brief Logs a summary of the frame timings and closes all files.
+ */
+void frame_capture_destroy(struct frame_capture *capture);
+
+/**
+ * @brief Returns true if @a target is a valid capture target string.
+ */
+bool frame_capture_is_valid_target(const char *target);
+
+/**
+ * @brief Writes @a frame to the capture target.
+ *
+ * @returns 0 on success, EINVAL if the frame has the wrong size, or the error writing the frame.
+ */
+int frame_capture_write(struct frame_capture *capture, const struct frame_capture_frame *frame);
+
+/**
+ * @brief Encodes RGBA pixels as an (uncompressed) PNG image.
+ *
+ * @returns The number of bytes written to @a out, or 0 if @a out_size is smaller than
+ * @ref frame_capture_get_png_size.
+ */
+size_t frame_capture_encode_png(struct vec2i size, const uint8_t *pixels, uint8_t *out, size_t out_size);
+
+size_t frame_capture_get_png_size(struct vec2i size);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_FRAME_CAPTURE_H
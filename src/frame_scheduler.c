@@ -12,10 +12,27 @@
 #include <stdlib.h>
 
 #include "compositor_ng.h"
+#include "frame_timings.h"
+#include "modesetting.h"
 #include "util/collection.h"
 #include "util/lock_ops.h"
+#include "util/logging.h"
 #include "util/refcounting.h"
 
+/**
+ * @brief If the last known vblank is older than this, we ask the display controller for a new one,
+ * since the vblank grid drifts relative to the monotonic clock.
+ */
+#define VBLANK_RESYNC_INTERVAL_NS 500000000ull
+
+#define DEFAULT_REFRESH_RATE 60.0
+
+struct pending_frame {
+    void_callback_t present_cb;
+    void_callback_t cancel_cb;
+    void *userdata;
+};
+
 struct frame_scheduler {
     refcount_t n_refs;
 
@@ -24,7 +41,36 @@ struct frame_scheduler {
     fl_vsync_callback_t vsync_cb;
     void *userdata;
 
+    struct frame_timings *timings;
+
     pthread_mutex_t mutex;
+
+    struct drmdev *drmdev;
+    uint32_t crtc_id;
+    uint64_t refresh_period_ns;
+
+    /// Timestamp of the last vblank we know of, or 0 if we don't know any.
+    uint64_t last_vblank_ns;
+
+    /// Number of frames that were presented but not yet scanned out. Every one of those
+    /// occupies a buffer of the render surface.
+    unsigned n_queued_frames;
+
+    /// Maximum number of queued frames before we stop answering vsync requests.
+    unsigned max_queued_frames;
+
+    /// A vsync request that couldn't be answered yet because too many frames were queued.
+    bool has_pending_baton;
+    intptr_t pending_baton;
+
+    /// True if a frame was handed to the present callback and wasn't scanned out yet.
+    /// Only one frame is committed to the display at a time.
+    bool is_presenting;
+
+    /// The newest frame that was presented while another one was still waiting for its pageflip.
+    /// It replaces (cancels) any older frame waiting here, and is presented at the next scanout.
+    bool has_pending_frame;
+    struct pending_frame pending_frame;
 };
 
 DEFINE_REF_OPS(frame_scheduler, n_refs)
@@ -42,19 +88,185 @@ frame_scheduler_new(bool uses_frame_requests, enum present_mode present_mode, fl
         return NULL;
     }
 
+    scheduler->timings = frame_timings_new();
+    if (scheduler->timings == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+
     scheduler->n_refs = REFCOUNT_INIT_1;
     scheduler->uses_frame_requests = uses_frame_requests;
     scheduler->present_mode = present_mode;
     scheduler->vsync_cb = vsync_cb;
     scheduler->userdata = userdata;
+    pthread_mutex_init(&scheduler->mutex, get_default_mutex_attrs());
+    scheduler->drmdev = NULL;
+    scheduler->crtc_id = 0;
+    scheduler->refresh_period_ns = 1000000000.0 / DEFAULT_REFRESH_RATE;
+    scheduler->last_vblank_ns = 0;
+    scheduler->n_queued_frames = 0;
+    scheduler->max_queued_frames = present_mode == kTripleBufferedVsync_PresentMode ? 2 : 1;
+    scheduler->has_pending_baton = false;
+    scheduler->pending_baton = 0;
+    scheduler->is_presenting = false;
+    scheduler->has_pending_frame = false;
     return scheduler;
 }
 
 void frame_scheduler_destroy(struct frame_scheduler *scheduler) {
+    if (scheduler->has_pending_frame) {
+        scheduler->pending_frame.cancel_cb(scheduler->pending_frame.userdata);
+    }
+    if (scheduler->drmdev != NULL) {
+        drmdev_unref(scheduler->drmdev);
+    }
+    frame_timings_unref(scheduler->timings);
+    pthread_mutex_destroy(&scheduler->mutex);
     free(scheduler);
 }
 
+struct frame_timings *frame_scheduler_get_frame_timings(struct frame_scheduler *scheduler) {
+    ASSERT_NOT_NULL(scheduler);
+    return scheduler->timings;
+}
+
+void frame_scheduler_set_refresh_rate(struct frame_scheduler *scheduler, double refresh_rate) {
+    ASSERT_NOT_NULL(scheduler);
+    assert(refresh_rate > 0);
+
+    frame_scheduler_lock(scheduler);
+    scheduler->refresh_period_ns = 1000000000.0 / refresh_rate;
+    frame_scheduler_unlock(scheduler);
+}
+
+void frame_scheduler_set_vblank_source(struct frame_scheduler *scheduler, struct drmdev *drmdev, uint32_t crtc_id) {
+    struct drmdev *old;
+
+    ASSERT_NOT_NULL(scheduler);
+
+    frame_scheduler_lock(scheduler);
+    old = scheduler->drmdev;
+    scheduler->drmdev = drmdev != NULL ? drmdev_ref(drmdev) : NULL;
+    scheduler->crtc_id = crtc_id;
+    frame_scheduler_unlock(scheduler);
+
+    if (old != NULL) {
+        drmdev_unref(old);
+    }
+}
+
+static void set_last_vblank_locked(struct frame_scheduler *scheduler, uint64_t vblank_ns) {
+    ASSERT_MUTEX_LOCKED(scheduler->mutex);
+
+    if (vblank_ns > scheduler->last_vblank_ns) {
+        scheduler->last_vblank_ns = vblank_ns;
+    }
+}
+
+/**
+ * @brief Make sure we know a recent vblank timestamp, if we have a way to query it.
+ *
+ * Must be called without the scheduler locked, since the scanout callbacks are called
+ * with the drmdev locked.
+ */
+static void resync_vblank(struct frame_scheduler *scheduler, uint64_t now) {
+    struct drmdev *drmdev;
+    uint64_t last_vblank_ns;
+    uint32_t crtc_id;
+    int ok;
+
+    frame_scheduler_lock(scheduler);
+
+    if (scheduler->drmdev == NULL || (scheduler->last_vblank_ns != 0 && now - scheduler->last_vblank_ns < VBLANK_RESYNC_INTERVAL_NS)) {
+        frame_scheduler_unlock(scheduler);
+        return;
+    }
+
+    drmdev = drmdev_ref(scheduler->drmdev);
+    crtc_id = scheduler->crtc_id;
+
+    frame_scheduler_unlock(scheduler);
+
+    ok = drmdev_get_last_vblank(drmdev, crtc_id, &last_vblank_ns);
+    drmdev_unref(drmdev);
+
+    // the CRTC might not be enabled yet, in which case the timestamp is zero.
+    if (ok == 0 && last_vblank_ns != 0) {
+        frame_scheduler_lock(scheduler);
+        set_last_vblank_locked(scheduler, last_vblank_ns);
+        frame_scheduler_unlock(scheduler);
+    }
+}
+
+/**
+ * @brief Calculates the start of the vblank interval @a now is in, by extrapolating
+ * the last known vblank using the refresh period.
+ */
+static uint64_t get_current_vblank_locked(struct frame_scheduler *scheduler, uint64_t now) {
+    uint64_t last = scheduler->last_vblank_ns;
+
+    ASSERT_MUTEX_LOCKED(scheduler->mutex);
+
+    if (last == 0) {
+        // We don't know the vblank grid, best we can do is assume one is happening right now.
+        return now;
+    } else if (last >= now) {
+        return last;
+    }
+
+    return last + (now - last) / scheduler->refresh_period_ns * scheduler->refresh_period_ns;
+}
+
+uint64_t frame_scheduler_get_next_vblank(struct frame_scheduler *scheduler) {
+    uint64_t now, next_vblank_ns;
+
+    ASSERT_NOT_NULL(scheduler);
+
+    now = get_monotonic_time();
+    resync_vblank(scheduler, now);
+
+    frame_scheduler_lock(scheduler);
+    next_vblank_ns = get_current_vblank_locked(scheduler, now);
+    if (next_vblank_ns <= now) {
+        next_vblank_ns += scheduler->refresh_period_ns;
+    }
+    frame_scheduler_unlock(scheduler);
+
+    return next_vblank_ns;
+}
+
+static bool can_begin_frame_locked(struct frame_scheduler *scheduler) {
+    ASSERT_MUTEX_LOCKED(scheduler->mutex);
+    return scheduler->n_queued_frames < scheduler->max_queued_frames;
+}
+
+/**
+ * @brief If a vsync request is pending and we're allowed to begin a new frame now,
+ * take it out so it can be answered. Otherwise, returns zero.
+ */
+static intptr_t take_pending_baton_locked(struct frame_scheduler *scheduler) {
+    intptr_t baton;
+
+    ASSERT_MUTEX_LOCKED(scheduler->mutex);
+
+    if (!scheduler->has_pending_baton || !can_begin_frame_locked(scheduler)) {
+        return 0;
+    }
+
+    baton = scheduler->pending_baton;
+    scheduler->has_pending_baton = false;
+    scheduler->pending_baton = 0;
+    return baton;
+}
+
+static void reply_vsync(struct frame_scheduler *scheduler, intptr_t baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns) {
+    frame_timings_begin_frame(scheduler->timings, baton, frame_start_ns, next_frame_start_ns);
+    scheduler->vsync_cb(scheduler->userdata, baton, frame_start_ns, next_frame_start_ns);
+}
+
 void frame_scheduler_on_fl_vsync_request(struct frame_scheduler *scheduler, intptr_t vsync_baton) {
+    uint64_t now, frame_start_ns, period_ns;
+
     ASSERT_NOT_NULL(scheduler);
     assert(vsync_baton != 0);
     assert(scheduler->uses_frame_requests);
@@ -81,60 +293,148 @@ void frame_scheduler_on_fl_vsync_request(struct frame_scheduler *scheduler, intp
     //  - On the other hand, normally a mesa EGL surface only has 4 buffers available, so we could run out of framebuffers for surfaces
     //    as well if we draw too many frames at once. (Especially considering one framebuffer is probably busy with scanout right now)
     //
+    // So:
+    //  - If too many frames are queued already (1 in double buffered mode, 2 in triple buffered mode),
+    //    we defer the reply until one of them was scanned out, and use that vblank as the frame start.
+    //  - Otherwise, we reply right away. In double buffered mode, the frame starts at the next vblank (flutter
+    //    waits until frame_start_time if it's in the future), so the frame has a whole refresh period to complete.
+    //    In triple buffered mode, the frame starts right away, there's enough buffering to absorb the misalignment.
+    now = get_monotonic_time();
+    resync_vblank(scheduler, now);
+
+    frame_scheduler_lock(scheduler);
 
-    /// TODO: Implement
-    /// For now, just unconditionally reply
-    if (scheduler->present_mode == kTripleBufferedVsync_PresentMode) {
-        scheduler->vsync_cb(scheduler->userdata, vsync_baton, 0, 0);
-    } else if (scheduler->present_mode == kDoubleBufferedVsync_PresentMode) {
-        scheduler->vsync_cb(scheduler->userdata, vsync_baton, 0, 0);
+    if (!can_begin_frame_locked(scheduler)) {
+        // flutter only has one vsync request outstanding at a time.
+        assert(!scheduler->has_pending_baton);
+        scheduler->has_pending_baton = true;
+        scheduler->pending_baton = vsync_baton;
+        frame_scheduler_unlock(scheduler);
+        return;
     }
-}
 
-void frame_scheduler_on_rendering_complete(struct frame_scheduler *scheduler) {
-    ASSERT_NOT_NULL(scheduler);
-    (void) scheduler;
+    period_ns = scheduler->refresh_period_ns;
+    frame_start_ns = get_current_vblank_locked(scheduler, now);
+    if (scheduler->present_mode == kDoubleBufferedVsync_PresentMode && frame_start_ns < now) {
+        frame_start_ns += period_ns;
+    }
 
-    /// TODO: Implement
-    UNIMPLEMENTED();
+    frame_scheduler_unlock(scheduler);
+
+    reply_vsync(scheduler, vsync_baton, frame_start_ns, frame_start_ns + period_ns);
 }
 
-void frame_scheduler_on_fb_released(struct frame_scheduler *scheduler, bool has_timestamp, uint64_t timestamp_ns) {
+void frame_scheduler_on_rendering_complete(struct frame_scheduler *scheduler) {
     ASSERT_NOT_NULL(scheduler);
-    (void) scheduler;
-    (void) has_timestamp;
-    (void) timestamp_ns;
 
-    /// TODO: Implement
-    UNIMPLEMENTED();
+    // Frames are only queued for scanout once they're rendered (the KMS commit waits for
+    // the render fences), so there's nothing to throttle on here. The buffer occupied by
+    // the frame is only freed after the scanout.
+    (void) scheduler;
 }
 
-void frame_scheduler_request_fb(struct frame_scheduler *scheduler, uint64_t scanout_time_ns) {
+void frame_scheduler_on_fb_released(struct frame_scheduler *scheduler, bool has_timestamp, uint64_t timestamp_ns) {
     ASSERT_NOT_NULL(scheduler);
-    (void) scheduler;
-    (void) scanout_time_ns;
+    assert(!has_timestamp || timestamp_ns != 0);
 
-    /// TODO: Implement
-    UNIMPLEMENTED();
+    // The framebuffer is released at the pageflip to the next frame. That's already accounted
+    // for in frame_scheduler_on_scanout, but the timestamp is still useful.
+    if (has_timestamp) {
+        frame_scheduler_lock(scheduler);
+        set_last_vblank_locked(scheduler, timestamp_ns);
+        frame_scheduler_unlock(scheduler);
+    }
 }
 
 void frame_scheduler_present_frame(struct frame_scheduler *scheduler, void_callback_t present_cb, void *userdata, void_callback_t cancel_cb) {
+    struct pending_frame replaced;
+    bool present_now, has_replaced;
+
     ASSERT_NOT_NULL(scheduler);
     ASSERT_NOT_NULL(present_cb);
-    (void) scheduler;
-    (void) cancel_cb;
+    ASSERT_NOT_NULL(cancel_cb);
+
+    has_replaced = false;
+
+    frame_scheduler_lock(scheduler);
+
+    if (!scheduler->is_presenting) {
+        // Nothing's on the way to the display right now, so we can commit right away.
+        scheduler->is_presenting = true;
+        scheduler->n_queued_frames++;
+        present_now = true;
+    } else {
+        // Committing another frame before the last one was flipped would fail with EBUSY (or block),
+        // so this frame has to wait for the next scanout. If another frame is already waiting, that one
+        // is outdated now and is dropped. (mailbox semantics)
+        if (scheduler->has_pending_frame) {
+            replaced = scheduler->pending_frame;
+            has_replaced = true;
+        } else {
+            scheduler->n_queued_frames++;
+        }
+
+        scheduler->has_pending_frame = true;
+        scheduler->pending_frame.present_cb = present_cb;
+        scheduler->pending_frame.cancel_cb = cancel_cb;
+        scheduler->pending_frame.userdata = userdata;
+        present_now = false;
+    }
+
+    frame_scheduler_unlock(scheduler);
 
-    /// TODO: Implement
-    present_cb(userdata);
+    if (present_now) {
+        present_cb(userdata);
+    } else if (has_replaced) {
+        replaced.cancel_cb(replaced.userdata);
+    }
 }
 
 void frame_scheduler_on_scanout(struct frame_scheduler *scheduler, bool has_timestamp, uint64_t timestamp_ns) {
+    struct pending_frame next;
+    uint64_t vblank_ns, period_ns;
+    intptr_t baton;
+    bool has_next;
+
     ASSERT_NOT_NULL(scheduler);
     assert(!has_timestamp || timestamp_ns != 0);
-    (void) scheduler;
-    (void) has_timestamp;
-    (void) timestamp_ns;
 
-    /// TODO: Implement
-    UNIMPLEMENTED();
+    frame_scheduler_lock(scheduler);
+
+    // Without a timestamp, we only know the scanout happened some time before now. Don't put that
+    // into the vblank grid, it'd shift all the following predictions. Extrapolate from the last
+    // known vblank instead.
+    if (has_timestamp) {
+        set_last_vblank_locked(scheduler, timestamp_ns);
+        vblank_ns = timestamp_ns;
+    } else {
+        vblank_ns = get_current_vblank_locked(scheduler, get_monotonic_time());
+    }
+    if (scheduler->n_queued_frames > 0) {
+        scheduler->n_queued_frames--;
+    }
+
+    // The display is free again, commit the newest frame that was presented in the meantime.
+    has_next = scheduler->has_pending_frame;
+    if (has_next) {
+        next = scheduler->pending_frame;
+        scheduler->has_pending_frame = false;
+    } else {
+        scheduler->is_presenting = false;
+    }
+
+    // If a vsync request was deferred because too many frames were queued,
+    // the frame can begin right at this vblank.
+    baton = take_pending_baton_locked(scheduler);
+    period_ns = scheduler->refresh_period_ns;
+
+    frame_scheduler_unlock(scheduler);
+
+    if (has_next) {
+        next.present_cb(next.userdata);
+    }
+
+    if (baton != 0) {
+        reply_vsync(scheduler, baton, vblank_ns, vblank_ns + period_ns);
+    }
 }
@@ -14,6 +14,8 @@
 #include "util/refcounting.h"
 
 struct frame_scheduler;
+struct frame_timings;
+struct drmdev;
 
 // clang-format off
 typedef void (*fl_vsync_callback_t)(
@@ -53,6 +55,38 @@ void frame_scheduler_destroy(struct frame_scheduler *scheduler);
 
 DECLARE_REF_OPS(frame_scheduler)
 
+/**
+ * @brief Returns the recorder for the timings of the frames scheduled by this scheduler.
+ *
+ * The frame scheduler records when each frame begins. The other stages should be recorded
+ * by the code presenting the frame.
+ */
+struct frame_timings *frame_scheduler_get_frame_timings(struct frame_scheduler *scheduler);
+
+/**
+ * @brief Sets the refresh rate of the display the frames are presented on.
+ *
+ * Until this is called, 60Hz is assumed.
+ */
+void frame_scheduler_set_refresh_rate(struct frame_scheduler *scheduler, double refresh_rate);
+
+/**
+ * @brief Lets the scheduler query the timestamp of the last vblank of CRTC @a crtc_id
+ * using @ref drmdev_get_last_vblank.
+ *
+ * That's used to align frames to the vblank grid when there were no (recent) scanouts
+ * to derive it from, e.g. after the app was idle for a while.
+ */
+void frame_scheduler_set_vblank_source(struct frame_scheduler *scheduler, struct drmdev *drmdev, uint32_t crtc_id);
+
+/**
+ * @brief Predicts the CLOCK_MONOTONIC timestamp (in nanoseconds) of the next vblank,
+ * by extrapolating the last known one.
+ *
+ * Can be called from any thread.
+ */
+uint64_t frame_scheduler_get_next_vblank(struct frame_scheduler *scheduler);
+
 /**
  * @brief Called when flutter calls the embedder supplied vsync_callback.
  * Embedder should reply on the platform task thread with the timestamp
@@ -64,13 +98,33 @@ DECLARE_REF_OPS(frame_scheduler)
  */
 void frame_scheduler_on_fl_vsync_request(struct frame_scheduler *scheduler, intptr_t vsync_baton);
 
+/**
+ * @brief Should be called when the GPU finished rendering the last presented frame.
+ */
 void frame_scheduler_on_rendering_complete(struct frame_scheduler *scheduler);
 
+/**
+ * @brief Should be called when a framebuffer that was scanned out is no longer used by
+ * the display controller, optionally with the timestamp of the vblank at which that happened.
+ */
 void frame_scheduler_on_fb_released(struct frame_scheduler *scheduler, bool has_timestamp, uint64_t timestamp_ns);
 
+/**
+ * @brief Should be called when a frame presented using @ref frame_scheduler_present_frame
+ * is now being scanned out, optionally with the vblank timestamp of the pageflip.
+ *
+ * Should also be called (without a timestamp) when presenting the frame failed.
+ * If another frame is waiting to be presented, its present callback is called from in here.
+ */
+void frame_scheduler_on_scanout(struct frame_scheduler *scheduler, bool has_timestamp, uint64_t timestamp_ns);
+
 /**
  * @brief Will call present_cb when the next frame is ready to be presented.
  *
+ * Only one frame is presented at a time. If the last presented frame wasn't scanned out yet, this frame will wait
+ * for that, and will be presented from inside @ref frame_scheduler_on_scanout. At most one frame waits like that,
+ * a newer frame replaces it.
+ *
  * If the frame_scheduler is destroyed before the present_cb is called, or if the frame is displaced by another frame, cancel_cb will be called.
  *
  * @param scheduler  The frame scheduler instance.
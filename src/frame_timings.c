@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Frame timings
+ *
+ * Always-on recorder for per-frame stage timestamps and latency histograms.
+ *
+ * The stages of a frame are recorded from different threads (vsync replies and pageflips
+ * on the platform thread, presenting on the raster thread), so the recent frames are kept
+ * in a lock-free ring buffer indexed by frame id. The histograms are log-linear (like HDR
+ * histograms) with 8 sub-buckets per power of two, which is plenty for frame latencies.
+ *
+ * Copyright (c) 2022, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#include "frame_timings.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/asserts.h"
+#include "util/bitscan.h"
+#include "util/collection.h"
+#include "util/macros.h"
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_N_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/// Enough buckets for values up to 2^32 microseconds. Anything above goes into the last bucket.
+#define HISTOGRAM_N_BUCKETS ((32 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_N_SUB_BUCKETS)
+
+struct histogram {
+    atomic_uint_fast64_t counts[HISTOGRAM_N_BUCKETS];
+    atomic_uint_fast64_t n_samples;
+    atomic_uint_fast64_t sum_us;
+    atomic_uint_fast64_t max_us;
+};
+
+struct record_slot {
+    /// The frame that's currently recorded in this slot, or zero if the slot
+    /// is being (re-)initialized.
+    atomic_uint_fast64_t frame;
+
+    _Atomic intptr_t vsync_baton;
+    atomic_uint_fast64_t frame_start_ns;
+    atomic_uint_fast64_t next_frame_start_ns;
+    atomic_uint_fast64_t stages_ns[kCount_FrameStage];
+};
+
+struct frame_timings {
+    refcount_t n_refs;
+
+    /// The id the next frame will get. Starts at 1, zero is never a valid frame.
+    atomic_uint_fast64_t next_frame;
+
+    /// The last frame started with frame_timings_begin_frame that wasn't taken yet.
+    atomic_uint_fast64_t current_frame;
+
+    struct record_slot slots[FRAME_TIMINGS_N_RECENT_FRAMES];
+
+    atomic_uint_fast64_t n_frames;
+    atomic_uint_fast64_t n_dropped_frames;
+    atomic_uint_fast64_t n_committed_frames;
+    atomic_uint_fast64_t n_skipped_frames;
+    atomic_uint_fast64_t n_late_frames;
+    atomic_uint_fast64_t n_missed_vblanks;
+
+    struct histogram histograms[kCount_FrameInterval];
+};
+
+static const struct {
+    enum frame_stage from;
+    enum frame_stage to;
+    const char *name;
+} intervals[kCount_FrameInterval] = {
+    [kBuild_FrameInterval] = { kBeginFrame_FrameStage, kPresentLayers_FrameStage, "build" },
+    [kPresentSurfaces_FrameInterval] = { kPresentLayers_FrameStage, kSurfacesPresented_FrameStage, "present_surfaces" },
+    [kBuildRequest_FrameInterval] = { kSurfacesPresented_FrameStage, kRequestBuilt_FrameStage, "build_request" },
+    [kWaitCommit_FrameInterval] = { kRequestBuilt_FrameStage, kCommit_FrameStage, "wait_commit" },
+    [kPageflip_FrameInterval] = { kCommit_FrameStage, kScanout_FrameStage, "pageflip" },
+    [kTotal_FrameInterval] = { kBeginFrame_FrameStage, kScanout_FrameStage, "total" },
+};
+
+static const char *const stage_names[kCount_FrameStage] = {
+    [kBeginFrame_FrameStage] = "begin_frame",
+    [kPresentLayers_FrameStage] = "present_layers",
+    [kSurfacesPresented_FrameStage] = "surfaces_presented",
+    [kRequestBuilt_FrameStage] = "request_built",
+    [kCommit_FrameStage] = "commit",
+    [kScanout_FrameStage] = "scanout",
+};
+
+const char *frame_interval_get_name(enum frame_interval interval) {
+    assert(interval >= 0 && interval < kCount_FrameInterval);
+    return intervals[interval].name;
+}
+
+const char *frame_stage_get_name(enum frame_stage stage) {
+    assert(stage >= 0 && stage < kCount_FrameStage);
+    return stage_names[stage];
+}
+
+static unsigned histogram_get_bucket(uint64_t value_us) {
+    unsigned shift;
+
+    if (value_us < 2 * HISTOGRAM_N_SUB_BUCKETS) {
+        return value_us;
+    }
+
+    shift = util_last_bit64(value_us) - 1 - HISTOGRAM_SUB_BUCKET_BITS;
+    return MIN2((shift + 1) * HISTOGRAM_N_SUB_BUCKETS + (value_us >> shift) - HISTOGRAM_N_SUB_BUCKETS, HISTOGRAM_N_BUCKETS - 1);
+}
+
+/**
+ * @brief Returns the value in the middle of @a bucket.
+ */
+static uint64_t histogram_get_bucket_value(unsigned bucket) {
+    unsigned shift;
+
+    if (bucket < 2 * HISTOGRAM_N_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    shift = bucket / HISTOGRAM_N_SUB_BUCKETS - 1;
+    return ((uint64_t) (bucket % HISTOGRAM_N_SUB_BUCKETS + HISTOGRAM_N_SUB_BUCKETS) << shift) + ((1ull << shift) >> 1);
+}
+
+static void histogram_add(struct histogram *histogram, uint64_t value_ns) {
+    uint64_t value_us, max_us;
+
+    value_us = value_ns / 1000;
+
+    atomic_fetch_add_explicit(histogram->counts + histogram_get_bucket(value_us), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->n_samples, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_us, value_us, memory_order_relaxed);
+
+    max_us = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+    while (value_us > max_us &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max_us, &max_us, value_us, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void histogram_reset(struct histogram *histogram) {
+    for (unsigned i = 0; i < HISTOGRAM_N_BUCKETS; i++) {
+        atomic_store_explicit(histogram->counts + i, 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&histogram->n_samples, 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->sum_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->max_us, 0, memory_order_relaxed);
+}
+
+static void histogram_get_stats(struct histogram *histogram, struct frame_interval_stats *stats_out) {
+    static const unsigned percentiles[] = { 50, 90, 99 };
+    uint64_t *percentiles_out[] = { &stats_out->p50_ns, &stats_out->p90_ns, &stats_out->p99_ns };
+    uint64_t counts[HISTOGRAM_N_BUCKETS];
+    uint64_t n_samples, cumulative;
+    unsigned bucket;
+
+    n_samples = 0;
+    for (unsigned i = 0; i < HISTOGRAM_N_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(histogram->counts + i, memory_order_relaxed);
+        n_samples += counts[i];
+    }
+
+    memset(stats_out, 0, sizeof *stats_out);
+    if (n_samples == 0) {
+        return;
+    }
+
+    stats_out->n_samples = n_samples;
+    stats_out->mean_ns = atomic_load_explicit(&histogram->sum_us, memory_order_relaxed) * 1000 / n_samples;
+    stats_out->max_ns = atomic_load_explicit(&histogram->max_us, memory_order_relaxed) * 1000;
+
+    bucket = 0;
+    cumulative = counts[0];
+    for (unsigned i = 0; i < ARRAY_SIZE(percentiles); i++) {
+        // the smallest bucket that has at least percentile% of all samples in or below it.
+        uint64_t rank = MAX2((n_samples * percentiles[i] + 99) / 100, 1);
+
+        while (cumulative < rank && bucket < HISTOGRAM_N_BUCKETS - 1) {
+            bucket++;
+            cumulative += counts[bucket];
+        }
+
+        *percentiles_out[i] = MIN2(histogram_get_bucket_value(bucket) * 1000, stats_out->max_ns);
+    }
+}
+
+struct frame_timings *frame_timings_new(void) {
+    struct frame_timings *timings;
+
+    timings = malloc(sizeof *timings);
+    if (timings == NULL) {
+        return NULL;
+    }
+
+    timings->n_refs = REFCOUNT_INIT_1;
+    atomic_init(&timings->next_frame, 1);
+    atomic_init(&timings->current_frame, 0);
+
+    for (unsigned i = 0; i < FRAME_TIMINGS_N_RECENT_FRAMES; i++) {
+        atomic_init(&timings->slots[i].frame, 0);
+        atomic_init(&timings->slots[i].vsync_baton, 0);
+        atomic_init(&timings->slots[i].frame_start_ns, 0);
+        atomic_init(&timings->slots[i].next_frame_start_ns, 0);
+        for (unsigned j = 0; j < kCount_FrameStage; j++) {
+            atomic_init(timings->slots[i].stages_ns + j, 0);
+        }
+    }
+
+    atomic_init(&timings->n_frames, 0);
+    atomic_init(&timings->n_dropped_frames, 0);
+    atomic_init(&timings->n_committed_frames, 0);
+    atomic_init(&timings->n_skipped_frames, 0);
+    atomic_init(&timings->n_late_frames, 0);
+    atomic_init(&timings->n_missed_vblanks, 0);
+    for (unsigned i = 0; i < kCount_FrameInterval; i++) {
+        histogram_reset(timings->histograms + i);
+    }
+
+    return timings;
+}
+
+void frame_timings_destroy(struct frame_timings *timings) {
+    free(timings);
+}
+
+DEFINE_REF_OPS(frame_timings, n_refs)
+
+static struct record_slot *get_slot(struct frame_timings *timings, uint64_t frame) {
+    return timings->slots + (frame % FRAME_TIMINGS_N_RECENT_FRAMES);
+}
+
+static uint64_t start_frame(struct frame_timings *timings, intptr_t vsync_baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns) {
+    struct record_slot *slot;
+    uint64_t frame;
+
+    frame = atomic_fetch_add_explicit(&timings->next_frame, 1, memory_order_relaxed);
+    slot = get_slot(timings, frame);
+
+    // Invalidate the slot first, so concurrent readers don't mix the old and new frame.
+    atomic_store_explicit(&slot->frame, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&slot->vsync_baton, vsync_baton, memory_order_relaxed);
+    atomic_store_explicit(&slot->frame_start_ns, frame_start_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->next_frame_start_ns, next_frame_start_ns, memory_order_relaxed);
+    for (unsigned i = 0; i < kCount_FrameStage; i++) {
+        atomic_store_explicit(slot->stages_ns + i, 0, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&slot->frame, frame, memory_order_release);
+    return frame;
+}
+
+/**
+ * @brief Copies the frame in @a slot into @a record_out, if it's still @a frame.
+ */
+static bool read_slot(struct record_slot *slot, uint64_t frame, struct frame_record *record_out) {
+    if (frame == 0 || atomic_load_explicit(&slot->frame, memory_order_acquire) != frame) {
+        return false;
+    }
+
+    record_out->frame = frame;
+    record_out->vsync_baton = atomic_load_explicit(&slot->vsync_baton, memory_order_relaxed);
+    record_out->frame_start_ns = atomic_load_explicit(&slot->frame_start_ns, memory_order_relaxed);
+    record_out->next_frame_start_ns = atomic_load_explicit(&slot->next_frame_start_ns, memory_order_relaxed);
+    for (unsigned i = 0; i < kCount_FrameStage; i++) {
+        record_out->stages_ns[i] = atomic_load_explicit(slot->stages_ns + i, memory_order_relaxed);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->frame, memory_order_relaxed) == frame;
+}
+
+uint64_t frame_timings_begin_frame(struct frame_timings *timings, intptr_t vsync_baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns) {
+    uint64_t frame;
+
+    ASSERT_NOT_NULL(timings);
+
+    frame = start_frame(timings, vsync_baton, frame_start_ns, next_frame_start_ns);
+    atomic_store_explicit(get_slot(timings, frame)->stages_ns + kBeginFrame_FrameStage, get_monotonic_time(), memory_order_relaxed);
+    atomic_store_explicit(&timings->current_frame, frame, memory_order_release);
+    return frame;
+}
+
+uint64_t frame_timings_take_current_frame(struct frame_timings *timings) {
+    uint64_t frame;
+
+    ASSERT_NOT_NULL(timings);
+
+    frame = atomic_exchange_explicit(&timings->current_frame, 0, memory_order_acquire);
+    if (frame == 0) {
+        frame = start_frame(timings, 0, 0, 0);
+    }
+
+    return frame;
+}
+
+static void on_frame_scanned_out(struct frame_timings *timings, const struct frame_record *record) {
+    const uint64_t *stages = record->stages_ns;
+    uint64_t period_ns, target_ns, scanout_ns, n_missed;
+
+    atomic_fetch_add_explicit(&timings->n_frames, 1, memory_order_relaxed);
+
+    for (unsigned i = 0; i < kCount_FrameInterval; i++) {
+        uint64_t from = stages[intervals[i].from], to = stages[intervals[i].to];
+
+        if (from != 0 && to != 0 && to >= from) {
+            histogram_add(timings->histograms + i, to - from);
+        }
+    }
+
+    // The engine was told it should have the frame ready by next_frame_start, so that's the vblank
+    // we expect the frame to be scanned out at. Everything that's later by more than half a refresh
+    // period missed at least one vblank.
+    if (record->frame_start_ns != 0 && record->next_frame_start_ns > record->frame_start_ns) {
+        period_ns = record->next_frame_start_ns - record->frame_start_ns;
+        target_ns = record->next_frame_start_ns;
+        scanout_ns = stages[kScanout_FrameStage];
+
+        if (scanout_ns > target_ns + period_ns / 2) {
+            n_missed = (scanout_ns - target_ns + period_ns / 2) / period_ns;
+
+            atomic_fetch_add_explicit(&timings->n_late_frames, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&timings->n_missed_vblanks, n_missed, memory_order_relaxed);
+        }
+    }
+}
+
+void frame_timings_mark(struct frame_timings *timings, uint64_t frame, enum frame_stage stage, uint64_t timestamp_ns) {
+    struct frame_record record;
+    struct record_slot *slot;
+
+    ASSERT_NOT_NULL(timings);
+    assert(stage >= 0 && stage < kCount_FrameStage);
+
+    slot = get_slot(timings, frame);
+    if (frame == 0 || atomic_load_explicit(&slot->frame, memory_order_acquire) != frame) {
+        // The frame is so old it was already overwritten by a newer one.
+        return;
+    }
+
+    atomic_store_explicit(slot->stages_ns + stage, timestamp_ns, memory_order_relaxed);
+
+    if (stage == kCommit_FrameStage) {
+        atomic_fetch_add_explicit(&timings->n_committed_frames, 1, memory_order_relaxed);
+    }
+
+    if (stage == kScanout_FrameStage && read_slot(slot, frame, &record)) {
+        on_frame_scanned_out(timings, &record);
+    }
+}
+
+void frame_timings_drop_frame(struct frame_timings *timings, uint64_t frame) {
+    ASSERT_NOT_NULL(timings);
+    (void) frame;
+
+    atomic_fetch_add_explicit(&timings->n_dropped_frames, 1, memory_order_relaxed);
+}
+
+void frame_timings_skip_frame(struct frame_timings *timings, uint64_t frame) {
+    ASSERT_NOT_NULL(timings);
+
+    // Frames that aren't recorded (cursor updates) aren't counted either.
+    if (frame == 0) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&timings->n_skipped_frames, 1, memory_order_relaxed);
+}
+
+void frame_timings_get_stats(struct frame_timings *timings, struct frame_timings_stats *stats_out) {
+    ASSERT_NOT_NULL(timings);
+    ASSERT_NOT_NULL(stats_out);
+
+    stats_out->n_frames = atomic_load_explicit(&timings->n_frames, memory_order_relaxed);
+    stats_out->n_dropped_frames = atomic_load_explicit(&timings->n_dropped_frames, memory_order_relaxed);
+    stats_out->n_committed_frames = atomic_load_explicit(&timings->n_committed_frames, memory_order_relaxed);
+    stats_out->n_skipped_frames = atomic_load_explicit(&timings->n_skipped_frames, memory_order_relaxed);
+    stats_out->n_late_frames = atomic_load_explicit(&timings->n_late_frames, memory_order_relaxed);
+    stats_out->n_missed_vblanks = atomic_load_explicit(&timings->n_missed_vblanks, memory_order_relaxed);
+
+    for (unsigned i = 0; i < kCount_FrameInterval; i++) {
+        histogram_get_stats(timings->histograms + i, stats_out->intervals + i);
+    }
+}
+
+size_t frame_timings_get_recent_frames(struct frame_timings *timings, struct frame_record *records_out, size_t max_records) {
+    uint64_t last, first;
+    size_t n_records;
+
+    ASSERT_NOT_NULL(timings);
+    ASSERT_NOT_NULL(records_out);
+
+    last = atomic_load_explicit(&timings->next_frame, memory_order_acquire) - 1;
+    max_records = MIN2(max_records, FRAME_TIMINGS_N_RECENT_FRAMES);
+    first = last >= max_records ? last - max_records + 1 : 1;
+
+    n_records = 0;
+    for (uint64_t frame = first; frame <= last; frame++) {
+        // frames that are being recorded right now or were overwritten meanwhile are skipped.
+        if (read_slot(get_slot(timings, frame), frame, records_out + n_records)) {
+            n_records++;
+        }
+    }
+
+    return n_records;
+}
+
+void frame_timings_reset_stats(struct frame_timings *timings) {
+    ASSERT_NOT_NULL(timings);
+
+    atomic_store_explicit(&timings->n_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&timings->n_dropped_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&timings->n_committed_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&timings->n_skipped_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&timings->n_late_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&timings->n_missed_vblanks, 0, memory_order_relaxed);
+    for (unsigned i = 0; i < kCount_FrameInterval; i++) {
+        histogram_reset(timings->histograms + i);
+    }
+}
+
+void frame_timings_print_stats(struct frame_timings *timings, FILE *file) {
+    struct frame_timings_stats stats;
+
+    ASSERT_NOT_NULL(timings);
+    ASSERT_NOT_NULL(file);
+
+    frame_timings_get_stats(timings, &stats);
+
+    fprintf(
+        file,
+        "frame timings: %" PRIu64 " frames, %" PRIu64 " dropped, %" PRIu64 " committed, %" PRIu64 " skipped, %" PRIu64
+        " late (%" PRIu64 " missed vblanks)\n",
+        stats.n_frames,
+        stats.n_dropped_frames,
+        stats.n_committed_frames,
+        stats.n_skipped_frames,
+        stats.n_late_frames,
+        stats.n_missed_vblanks
+    );
+    fprintf(file, "  %-18s %8s %8s %8s %8s %8s %8s\n", "interval (ms)", "n", "mean", "p50", "p90", "p99", "max");
+
+    for (unsigned i = 0; i < kCount_FrameInterval; i++) {
+        const struct frame_interval_stats *s = stats.intervals + i;
+
+        fprintf(
+            file,
+            "  %-18s %8" PRIu64 " %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+            intervals[i].name,
+            s->n_samples,
+            s->mean_ns / 1e6,
+            s->p50_ns / 1e6,
+            s->p90_ns / 1e6,
+            s->p99_ns / 1e6,
+            s->max_ns / 1e6
+        );
+    }
+}
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Frame timings
+ *
+ * Always-on recorder for per-frame stage timestamps (vsync reply, present,
+ * KMS request building, commit, pageflip) and latency histograms derived from them.
+ *
+ * Copyright (c) 2022, Hannes Winkler <hanneswinkler2000@web.de>
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_FRAME_TIMINGS_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_FRAME_TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util/refcounting.h"
+
+struct frame_timings;
+
+/// How many of the most recent frames are kept.
+#define FRAME_TIMINGS_N_RECENT_FRAMES 128
+
+/**
+ * @brief The stages a frame goes through, in order.
+ */
+enum frame_stage {
+    /// The vsync request for the frame was answered, so the engine can begin building it.
+    kBeginFrame_FrameStage,
+
+    /// The engine handed the finished layers to the compositor.
+    kPresentLayers_FrameStage,
+
+    /// All layers were added to the KMS request. (surface_present_kms)
+    kSurfacesPresented_FrameStage,
+
+    /// The KMS request was built. (kms_req_builder_build)
+    kRequestBuilt_FrameStage,
+
+    /// The KMS request was committed. Might be a while after it was built,
+    /// if the previous frame was still waiting for its pageflip.
+    kCommit_FrameStage,
+
+    /// The frame is now on screen. The timestamp is that of the pageflip vblank.
+    kScanout_FrameStage,
+
+    kCount_FrameStage,
+};
+
+/**
+ * @brief The intervals between stages we keep latency histograms of.
+ */
+enum frame_interval {
+    /// Begin frame -> present layers. (build & raster in the engine)
+    kBuild_FrameInterval,
+
+    /// Present layers -> surfaces presented.
+    kPresentSurfaces_FrameInterval,
+
+    /// Surfaces presented -> request built.
+    kBuildRequest_FrameInterval,
+
+    /// Request built -> commit.
+    kWaitCommit_FrameInterval,
+
+    /// Commit -> scanout.
+    kPageflip_FrameInterval,
+
+    /// Begin frame -> scanout.
+    kTotal_FrameInterval,
+
+    kCount_FrameInterval,
+};
+
+struct frame_interval_stats {
+    uint64_t n_samples;
+
+    /// All in nanoseconds. Percentiles are accurate to ~12%.
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+};
+
+struct frame_timings_stats {
+    /// Frames that were scanned out.
+    uint64_t n_frames;
+
+    /// Frames that were replaced by a newer frame before they were committed.
+    uint64_t n_dropped_frames;
+
+    /// Frames that were committed to the display.
+    uint64_t n_committed_frames;
+
+    /// Frames that weren't committed at all, because they wouldn't have changed anything on screen.
+    uint64_t n_skipped_frames;
+
+    /// Frames that were scanned out at least one vblank later than targeted.
+    uint64_t n_late_frames;
+
+    /// The total number of vblanks frames were late by.
+    uint64_t n_missed_vblanks;
+
+    struct frame_interval_stats intervals[kCount_FrameInterval];
+};
+
+struct frame_record {
+    uint64_t frame;
+    intptr_t vsync_baton;
+
+    /// The frame start & next frame start timestamps that were sent to the engine.
+    uint64_t frame_start_ns;
+    uint64_t next_frame_start_ns;
+
+    /// Zero if the frame didn't reach the stage (yet).
+    uint64_t stages_ns[kCount_FrameStage];
+};
+
+struct frame_timings *frame_timings_new(void);
+
+void frame_timings_destroy(struct frame_timings *timings);
+
+DECLARE_REF_OPS(frame_timings)
+
+/**
+ * @brief Starts recording a frame, for the vsync request @a vsync_baton that was answered with
+ * @a frame_start_ns and @a next_frame_start_ns.
+ *
+ * The frame becomes the current frame, see @ref frame_timings_take_current_frame.
+ *
+ * @returns The id of the frame, which is never zero.
+ */
+uint64_t frame_timings_begin_frame(struct frame_timings *timings, intptr_t vsync_baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns);
+
+/**
+ * @brief Returns the last frame started using @ref frame_timings_begin_frame, so the layers the engine
+ * presents can be attributed to it.
+ *
+ * The frame is only returned once. If there's no current frame, because the engine presents
+ * without requesting vsync or presents multiple times per frame, a new frame without begin
+ * timestamp is started.
+ */
+uint64_t frame_timings_take_current_frame(struct frame_timings *timings);
+
+/**
+ * @brief Records the timestamp of @a stage for @a frame.
+ *
+ * When the frame reaches @ref kScanout_FrameStage, it's added to the latency histograms.
+ * Recording a frame that was already recycled in the ring buffer does nothing.
+ * Safe to call from any thread.
+ */
+void frame_timings_mark(struct frame_timings *timings, uint64_t frame, enum frame_stage stage, uint64_t timestamp_ns);
+
+/**
+ * @brief Records that @a frame was replaced by a newer frame and won't be scanned out.
+ */
+void frame_timings_drop_frame(struct frame_timings *timings, uint64_t frame);
+
+/**
+ * @brief Records that @a frame wasn't committed, because it's identical to the frame on screen.
+ */
+void frame_timings_skip_frame(struct frame_timings *timings, uint64_t frame);
+
+void frame_timings_get_stats(struct frame_timings *timings, struct frame_timings_stats *stats_out);
+
+/**
+ * @brief Copies out up to @a max_records of the most recent frames, oldest first.
+ *
+ * @returns The number of frames copied.
+ */
+size_t frame_timings_get_recent_frames(struct frame_timings *timings, struct frame_record *records_out, size_t max_records);
+
+/**
+ * @brief Clears all the histograms and counters. (But not the recent frames)
+ */
+void frame_timings_reset_stats(struct frame_timings *timings);
+
+/**
+ * @brief Prints the stats in a human-readable table.
+ */
+void frame_timings_print_stats(struct frame_timings *timings, FILE *file);
+
+const char *frame_interval_get_name(enum frame_interval interval);
+
+const char *frame_stage_get_name(enum frame_stage stage);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_FRAME_TIMINGS_H
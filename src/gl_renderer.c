@@ -9,9 +9,14 @@
 #include "gl_renderer.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <dlfcn.h>
+#include <gbm.h>
 #include <pthread.h>
 
 #include "egl.h"
@@ -735,3 +740,867 @@ EGLSurface gl_renderer_create_gbm_window_surface(
 
     return surface;
 }
+
+/*
+ * GLES flattening compositor
+ */
+#define GL_FLATTENER_N_BUFFERS 3
+#define GL_FLATTENER_MAX_SOURCES 16
+
+struct gl_flattener_source_import {
+    EGLImageKHR image;
+    GLuint texture;
+
+    gl_flattener_release_cb_t release_cb;
+    void *userdata;
+};
+
+struct gl_flattener_buffer {
+    struct gl_flattener *flattener;
+
+    struct gbm_bo *bo;
+    EGLImageKHR image;
+    GLuint texture, fbo;
+
+    bool in_use;
+
+    int n_sources;
+    struct gl_flattener_source_import sources[GL_FLATTENER_MAX_SOURCES];
+};
+
+struct egl_current_state {
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface draw, read;
+};
+
+struct gl_flattener {
+    refcount_t n_refs;
+
+    struct gl_renderer *renderer;
+    struct vec2i size;
+
+    /// The GBM usage flags of the buffers we composite into.
+    uint32_t bo_usage;
+
+    EGLDisplay display;
+    EGLContext context;
+
+    PFNEGLCREATEIMAGEKHRPROC egl_create_image;
+    PFNEGLDESTROYIMAGEKHRPROC egl_destroy_image;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC gl_egl_image_target_texture2d;
+    bool supports_modifiers;
+
+    /// Sources are imported as GL_TEXTURE_EXTERNAL_OES if that's supported,
+    /// since some formats can only be imported as external textures.
+    GLenum source_target;
+
+    GLuint program;
+    GLint pos_location, texcoord_location, opacity_location, texture_location;
+    GLint n_clips_location, clip_transforms_location, clip_rects_location;
+    GLint clip_radii_x_location, clip_radii_y_location;
+
+    pthread_mutex_t lock;
+    struct gl_flattener_buffer buffers[GL_FLATTENER_N_BUFFERS];
+
+    /// The buffer between @ref gl_flattener_begin and @ref gl_flattener_end / @ref gl_flattener_cancel.
+    struct gl_flattener_buffer *current;
+    struct egl_current_state saved_state;
+};
+
+static const char *flattener_vertex_shader =
+    "attribute vec2 pos;\n"
+    "attribute vec2 texcoord;\n"
+    "varying vec2 v_texcoord;\n"
+    "void main() {\n"
+    "    v_texcoord = texcoord;\n"
+    "    gl_Position = vec4(pos, 0.0, 1.0);\n"
+    "}\n";
+
+// Clips are applied per fragment. gl_FragCoord.xy is the position in buffer coordinates
+// (see gl_flattener_draw), clip_transforms map that into the coordinate space of the clip,
+// where it's an axis-aligned rect (x, y, w, h) with elliptic corners (tl, tr, br, bl).
+#define FLATTENER_FRAGMENT_SHADER_MAIN \
+    "#ifdef GL_FRAGMENT_PRECISION_HIGH\n" \
+    "precision highp float;\n" \
+    "#else\n" \
+    "precision mediump float;\n" \
+    "#endif\n" \
+    "uniform float opacity;\n" \
+    "uniform int n_clips;\n" \
+    "uniform mat3 clip_transforms[4];\n" \
+    "uniform vec4 clip_rects[4];\n" \
+    "uniform vec4 clip_radii_x[4];\n" \
+    "uniform vec4 clip_radii_y[4];\n" \
+    "varying vec2 v_texcoord;\n" \
+    "void main() {\n" \
+    "    float coverage = 1.0;\n" \
+    "    for (int i = 0; i < 4; i++) {\n" \
+    "        if (i >= n_clips) break;\n" \
+    "        vec3 q = clip_transforms[i] * vec3(gl_FragCoord.xy, 1.0);\n" \
+    "        vec2 p = q.xy / q.z;\n" \
+    "        vec2 lo = clip_rects[i].xy;\n" \
+    "        vec2 hi = clip_rects[i].xy + clip_rects[i].zw;\n" \
+    "        if (p.x < lo.x || p.y < lo.y || p.x > hi.x || p.y > hi.y) { coverage = 0.0; break; }\n" \
+    "        vec4 rx = clip_radii_x[i];\n" \
+    "        vec4 ry = clip_radii_y[i];\n" \
+    "        vec2 radius = vec2(0.0);\n" \
+    "        vec2 center = p;\n" \
+    "        if (p.x < lo.x + rx.x && p.y < lo.y + ry.x) {\n" \
+    "            radius = vec2(rx.x, ry.x); center = lo + radius;\n" \
+    "        } else if (p.x > hi.x - rx.y && p.y < lo.y + ry.y) {\n" \
+    "            radius = vec2(rx.y, ry.y); center = vec2(hi.x - rx.y, lo.y + ry.y);\n" \
+    "        } else if (p.x > hi.x - rx.z && p.y > hi.y - ry.z) {\n" \
+    "            radius = vec2(rx.z, ry.z); center = hi - radius;\n" \
+    "        } else if (p.x < lo.x + rx.w && p.y > hi.y - ry.w) {\n" \
+    "            radius = vec2(rx.w, ry.w); center = vec2(lo.x + rx.w, hi.y - ry.w);\n" \
+    "        }\n" \
+    "        if (radius.x > 0.0 && radius.y > 0.0) {\n" \
+    "            float d = length((p - center) / radius);\n" \
+    "            coverage *= clamp((1.0 - d) * min(radius.x, radius.y) + 0.5, 0.0, 1.0);\n" \
+    "        }\n" \
+    "    }\n" \
+    "    gl_FragColor = texture2D(tex, v_texcoord) * opacity * coverage;\n" \
+    "}\n"
+
+static const char *flattener_fragment_shader_2d =
+    "uniform sampler2D tex;\n"
+    FLATTENER_FRAGMENT_SHADER_MAIN;
+
+static const char *flattener_fragment_shader_external =
+    "#extension GL_OES_EGL_image_external : require\n"
+    "uniform samplerExternalOES tex;\n"
+    FLATTENER_FRAGMENT_SHADER_MAIN;
+
+static int make_flattener_context_current(struct gl_flattener *flattener, struct egl_current_state *saved_state_out) {
+    EGLBoolean egl_ok;
+
+    saved_state_out->display = eglGetCurrentDisplay();
+    saved_state_out->context = eglGetCurrentContext();
+    saved_state_out->draw = eglGetCurrentSurface(EGL_DRAW);
+    saved_state_out->read = eglGetCurrentSurface(EGL_READ);
+
+    egl_ok = eglMakeCurrent(flattener->display, EGL_NO_SURFACE, EGL_NO_SURFACE, flattener->context);
+    if (egl_ok != EGL_TRUE) {
+        LOG_EGL_ERROR(eglGetError(), "Couldn't make the flattener EGL context current. eglMakeCurrent");
+        return EIO;
+    }
+
+    return 0;
+}
+
+static void restore_egl_state(struct gl_flattener *flattener, const struct egl_current_state *saved_state) {
+    EGLBoolean egl_ok;
+
+    if (saved_state->display == EGL_NO_DISPLAY || saved_state->context == EGL_NO_CONTEXT) {
+        egl_ok = eglMakeCurrent(flattener->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    } else {
+        egl_ok = eglMakeCurrent(saved_state->display, saved_state->draw, saved_state->read, saved_state->context);
+    }
+
+    if (egl_ok != EGL_TRUE) {
+        LOG_EGL_ERROR(eglGetError(), "Couldn't restore the previous EGL context after flattening. eglMakeCurrent");
+    }
+}
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader;
+    GLint status;
+    char log[256];
+
+    shader = glCreateShader(type);
+    if (shader == 0) {
+        LOG_ERROR("Couldn't create flattener shader. glCreateShader: %" PRIu32 "\n", glGetError());
+        return 0;
+    }
+
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        LOG_ERROR("Couldn't compile flattener shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+static GLuint link_flattener_program(bool external) {
+    GLuint vertex_shader, fragment_shader, program;
+    GLint status;
+    char log[256];
+
+    vertex_shader = compile_shader(GL_VERTEX_SHADER, flattener_vertex_shader);
+    if (vertex_shader == 0) {
+        return 0;
+    }
+
+    fragment_shader = compile_shader(GL_FRAGMENT_SHADER, external ? flattener_fragment_shader_external : flattener_fragment_shader_2d);
+    if (fragment_shader == 0) {
+        glDeleteShader(vertex_shader);
+        return 0;
+    }
+
+    program = glCreateProgram();
+    if (program == 0) {
+        LOG_ERROR("Couldn't create flattener program. glCreateProgram: %" PRIu32 "\n", glGetError());
+        glDeleteShader(fragment_shader);
+        glDeleteShader(vertex_shader);
+        return 0;
+    }
+
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    // The program keeps the shaders alive as long as they're attached.
+    glDeleteShader(fragment_shader);
+    glDeleteShader(vertex_shader);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        LOG_ERROR("Couldn't link flattener program: %s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+static EGLImageKHR import_dmabuf(struct gl_flattener *flattener, const struct gl_flattener_source *source) {
+#define PUT_ATTR(_key, _value)                            \
+    do {                                                  \
+        assert(attr_index + 2 <= ARRAY_SIZE(attributes)); \
+        attributes[attr_index++] = (_key);                \
+        attributes[attr_index++] = (_value);              \
+    } while (false)
+    EGLImageKHR image;
+    EGLint attributes[2 * 8 + 1];
+    int attr_index;
+
+    attr_index = 0;
+    PUT_ATTR(EGL_WIDTH, source->width);
+    PUT_ATTR(EGL_HEIGHT, source->height);
+    PUT_ATTR(EGL_LINUX_DRM_FOURCC_EXT, uint32_to_int32(get_pixfmt_info(source->format)->drm_format));
+    PUT_ATTR(EGL_DMA_BUF_PLANE0_FD_EXT, source->fd);
+    PUT_ATTR(EGL_DMA_BUF_PLANE0_OFFSET_EXT, uint32_to_int32(source->offset));
+    PUT_ATTR(EGL_DMA_BUF_PLANE0_PITCH_EXT, uint32_to_int32(source->pitch));
+    if (source->has_modifier) {
+        if (!flattener->supports_modifiers) {
+            LOG_ERROR("Layer uses a modified format, but EGL doesn't support the EGL_EXT_image_dma_buf_import_modifiers extension.\n");
+            return EGL_NO_IMAGE_KHR;
+        }
+
+#ifdef EGL_EXT_image_dma_buf_import_modifiers
+        PUT_ATTR(EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, uint32_to_int32(source->modifier & 0xFFFFFFFFlu));
+        PUT_ATTR(EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, uint32_to_int32(source->modifier >> 32));
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    assert(attr_index < ARRAY_SIZE(attributes));
+    attributes[attr_index++] = EGL_NONE;
+
+    image = flattener->egl_create_image(flattener->display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attributes);
+    if (image == EGL_NO_IMAGE_KHR) {
+        LOG_EGL_ERROR(eglGetError(), "Couldn't import dmabuf as EGL image. eglCreateImageKHR");
+        return EGL_NO_IMAGE_KHR;
+    }
+
+    return image;
+#undef PUT_ATTR
+}
+
+static int init_flattener_buffer(struct gl_flattener *flattener, struct gl_flattener_buffer *buffer) {
+    struct gl_flattener_source source;
+    struct gbm_bo *bo;
+    EGLImageKHR image;
+    GLuint texture, fbo;
+    GLenum status;
+    int fd, ok;
+
+    bo = gbm_bo_create(
+        gl_renderer_get_gbm_device(flattener->renderer),
+        flattener->size.x,
+        flattener->size.y,
+        get_pixfmt_info(PIXFMT_ARGB8888)->gbm_format,
+        flattener->bo_usage
+    );
+    if (bo == NULL) {
+        LOG_ERROR("Couldn't create GBM buffer for flattening layers.\n");
+        return ENOMEM;
+    }
+
+    fd = gbm_bo_get_fd(bo);
+    if (fd < 0) {
+        LOG_ERROR("Couldn't get dmabuf fd of GBM buffer for flattening layers.\n");
+        ok = EIO;
+        goto fail_destroy_bo;
+    }
+
+    source.format = PIXFMT_ARGB8888;
+    source.width = flattener->size.x;
+    source.height = flattener->size.y;
+    source.fd = fd;
+    source.offset = gbm_bo_get_offset(bo, 0);
+    source.pitch = gbm_bo_get_stride(bo);
+    source.has_modifier = false;
+    source.modifier = 0;
+
+    image = import_dmabuf(flattener, &source);
+
+    // EGL dups the fd if it needs it.
+    close(fd);
+
+    if (image == EGL_NO_IMAGE_KHR) {
+        ok = EIO;
+        goto fail_destroy_bo;
+    }
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    flattener->gl_egl_image_target_texture2d(GL_TEXTURE_2D, image);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+
+    status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        LOG_ERROR("Flattening framebuffer is incomplete. glCheckFramebufferStatus: %" PRIu32 "\n", status);
+        ok = EIO;
+        goto fail_delete_fbo;
+    }
+
+    buffer->flattener = flattener;
+    buffer->bo = bo;
+    buffer->image = image;
+    buffer->texture = texture;
+    buffer->fbo = fbo;
+    buffer->in_use = false;
+    buffer->n_sources = 0;
+    return 0;
+
+fail_delete_fbo:
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    flattener->egl_destroy_image(flattener->display, image);
+
+fail_destroy_bo:
+    gbm_bo_destroy(bo);
+    return ok;
+}
+
+static void fini_flattener_buffer(struct gl_flattener *flattener, struct gl_flattener_buffer *buffer) {
+    glDeleteFramebuffers(1, &buffer->fbo);
+    glDeleteTextures(1, &buffer->texture);
+    flattener->egl_destroy_image(flattener->display, buffer->image);
+    gbm_bo_destroy(buffer->bo);
+}
+
+static struct gl_flattener *flattener_new(struct gl_renderer *renderer, struct vec2i size, uint32_t bo_usage) {
+    struct egl_current_state saved_state;
+    struct gl_flattener *flattener;
+    int ok, n_buffers;
+
+    ASSERT_NOT_NULL(renderer);
+    assert(size.x > 0 && size.y > 0);
+
+    if (!gl_renderer_supports_egl_extension(renderer, "EGL_EXT_image_dma_buf_import")) {
+        LOG_ERROR("EGL doesn't support the EGL_EXT_image_dma_buf_import extension. Layers can't be flattened.\n");
+        return NULL;
+    }
+
+    if (!gl_renderer_supports_gl_extension(renderer, "GL_OES_EGL_image")) {
+        LOG_ERROR("OpenGL ES doesn't support the GL_OES_EGL_image extension. Layers can't be flattened.\n");
+        return NULL;
+    }
+
+    flattener = malloc(sizeof *flattener);
+    if (flattener == NULL) {
+        return NULL;
+    }
+
+    flattener->egl_create_image = (PFNEGLCREATEIMAGEKHRPROC) gl_renderer_get_proc_address(renderer, "eglCreateImageKHR");
+    flattener->egl_destroy_image = (PFNEGLDESTROYIMAGEKHRPROC) gl_renderer_get_proc_address(renderer, "eglDestroyImageKHR");
+    flattener->gl_egl_image_target_texture2d = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC
+    ) gl_renderer_get_proc_address(renderer, "glEGLImageTargetTexture2DOES");
+    if (flattener->egl_create_image == NULL || flattener->egl_destroy_image == NULL || flattener->gl_egl_image_target_texture2d == NULL) {
+        LOG_ERROR("Could not resolve the EGL image procedures needed for flattening layers.\n");
+        goto fail_free_flattener;
+    }
+
+#ifdef EGL_EXT_image_dma_buf_import_modifiers
+    flattener->supports_modifiers = gl_renderer_supports_egl_extension(renderer, "EGL_EXT_image_dma_buf_import_modifiers");
+#else
+    flattener->supports_modifiers = false;
+#endif
+
+    if (gl_renderer_supports_gl_extension(renderer, "GL_OES_EGL_image_external")) {
+        flattener->source_target = GL_TEXTURE_EXTERNAL_OES;
+    } else {
+        flattener->source_target = GL_TEXTURE_2D;
+    }
+
+    flattener->display = gl_renderer_get_egl_display(renderer);
+    flattener->context = gl_renderer_create_context(renderer);
+    if (flattener->context == EGL_NO_CONTEXT) {
+        goto fail_free_flattener;
+    }
+
+    flattener->n_refs = REFCOUNT_INIT_1;
+    flattener->renderer = renderer;
+    flattener->size = size;
+    flattener->bo_usage = bo_usage;
+    flattener->current = NULL;
+    pthread_mutex_init(&flattener->lock, NULL);
+
+    ok = make_flattener_context_current(flattener, &saved_state);
+    if (ok != 0) {
+        goto fail_destroy_context;
+    }
+
+    flattener->program = link_flattener_program(flattener->source_target == GL_TEXTURE_EXTERNAL_OES);
+    if (flattener->program == 0) {
+        goto fail_restore_state;
+    }
+
+    flattener->pos_location = glGetAttribLocation(flattener->program, "pos");
+    flattener->texcoord_location = glGetAttribLocation(flattener->program, "texcoord");
+    flattener->opacity_location = glGetUniformLocation(flattener->program, "opacity");
+    flattener->texture_location = glGetUniformLocation(flattener->program, "tex");
+    flattener->n_clips_location = glGetUniformLocation(flattener->program, "n_clips");
+    flattener->clip_transforms_location = glGetUniformLocation(flattener->program, "clip_transforms");
+    flattener->clip_rects_location = glGetUniformLocation(flattener->program, "clip_rects");
+    flattener->clip_radii_x_location = glGetUniformLocation(flattener->program, "clip_radii_x");
+    flattener->clip_radii_y_location = glGetUniformLocation(flattener->program, "clip_radii_y");
+
+    for (n_buffers = 0; n_buffers < GL_FLATTENER_N_BUFFERS; n_buffers++) {
+        ok = init_flattener_buffer(flattener, flattener->buffers + n_buffers);
+        if (ok != 0) {
+            goto fail_fini_buffers;
+        }
+    }
+
+    restore_egl_state(flattener, &saved_state);
+
+    flattener->renderer = gl_renderer_ref(renderer);
+    return flattener;
+
+fail_fini_buffers:
+    for (int i = 0; i < n_buffers; i++) {
+        fini_flattener_buffer(flattener, flattener->buffers + i);
+    }
+    glDeleteProgram(flattener->program);
+
+fail_restore_state:
+    restore_egl_state(flattener, &saved_state);
+
+fail_destroy_context:
+    pthread_mutex_destroy(&flattener->lock);
+    eglDestroyContext(flattener->display, flattener->context);
+
+fail_free_flattener:
+    free(flattener);
+    return NULL;
+}
+
+struct gl_flattener *gl_flattener_new(struct gl_renderer *renderer, struct vec2i size) {
+    return flattener_new(renderer, size, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+}
+
+struct gl_flattener *gl_flattener_new_offscreen(struct gl_renderer *renderer, struct vec2i size) {
+    // Render nodes of GPU-less devices (e.g. vgem with llvmpipe) can't allocate scanout buffers.
+    return flattener_new(renderer, size, GBM_BO_USE_RENDERING);
+}
+
+void gl_flattener_destroy(struct gl_flattener *flattener) {
+    struct egl_current_state saved_state;
+    int ok;
+
+    ASSERT_NOT_NULL(flattener);
+    assert(flattener->current == NULL);
+
+    // Every buffer that's still in use holds a reference, so all of them are free now.
+    ok = make_flattener_context_current(flattener, &saved_state);
+    if (ok == 0) {
+        for (int i = 0; i < GL_FLATTENER_N_BUFFERS; i++) {
+            assert(!flattener->buffers[i].in_use);
+            fini_flattener_buffer(flattener, flattener->buffers + i);
+        }
+        glDeleteProgram(flattener->program);
+        restore_egl_state(flattener, &saved_state);
+    } else {
+        LOG_ERROR("Leaking flattener GL objects because its EGL context couldn't be made current.\n");
+    }
+
+    pthread_mutex_destroy(&flattener->lock);
+    eglDestroyContext(flattener->display, flattener->context);
+    gl_renderer_unref(flattener->renderer);
+    free(flattener);
+}
+
+DEFINE_REF_OPS(gl_flattener, n_refs)
+
+struct vec2i gl_flattener_get_size(struct gl_flattener *flattener) {
+    ASSERT_NOT_NULL(flattener);
+    return flattener->size;
+}
+
+int gl_flattener_begin(struct gl_flattener *flattener, bool opaque) {
+    struct gl_flattener_buffer *buffer;
+    int ok;
+
+    ASSERT_NOT_NULL(flattener);
+    assert(flattener->current == NULL);
+
+    TRACER_BEGIN(flattener->renderer->tracer, "gl_flattener_begin");
+
+    buffer = NULL;
+    pthread_mutex_lock(&flattener->lock);
+    for (int i = 0; i < GL_FLATTENER_N_BUFFERS; i++) {
+        if (!flattener->buffers[i].in_use) {
+            buffer = flattener->buffers + i;
+            buffer->in_use = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&flattener->lock);
+
+    if (buffer == NULL) {
+        ok = EBUSY;
+        goto fail_end_trace;
+    }
+
+    ok = make_flattener_context_current(flattener, &flattener->saved_state);
+    if (ok != 0) {
+        goto fail_free_buffer;
+    }
+
+    buffer->n_sources = 0;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+    glViewport(0, 0, flattener->size.x, flattener->size.y);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_DEPTH_TEST);
+
+    if (opaque) {
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    } else {
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Flutter layers use premultiplied alpha.
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    glUseProgram(flattener->program);
+    glUniform1i(flattener->texture_location, 0);
+    glActiveTexture(GL_TEXTURE0);
+
+    flattener->current = buffer;
+
+    TRACER_END(flattener->renderer->tracer, "gl_flattener_begin");
+    return 0;
+
+fail_free_buffer:
+    pthread_mutex_lock(&flattener->lock);
+    buffer->in_use = false;
+    pthread_mutex_unlock(&flattener->lock);
+
+fail_end_trace:
+    TRACER_END(flattener->renderer->tracer, "gl_flattener_begin");
+    return ok;
+}
+
+int gl_flattener_draw(
+    struct gl_flattener *flattener,
+    const struct gl_flattener_source *source,
+    const struct quad *quad,
+    double opacity,
+    const struct clip_rect *clips,
+    size_t n_clips,
+    gl_flattener_release_cb_t release_cb,
+    void *userdata
+) {
+    GLfloat clip_transforms[GL_FLATTENER_MAX_CLIPS * 9], clip_rects[GL_FLATTENER_MAX_CLIPS * 4];
+    GLfloat clip_radii_x[GL_FLATTENER_MAX_CLIPS * 4], clip_radii_y[GL_FLATTENER_MAX_CLIPS * 4];
+    struct gl_flattener_source_import *import;
+    struct aa_rect scissor;
+    bool has_scissor;
+    int n_shader_clips;
+    struct gl_flattener_buffer *buffer;
+    EGLImageKHR image;
+    GLuint texture;
+    GLfloat positions[8], w, h;
+
+    // Corners of the source, in the same order as the quad corners below.
+    static const GLfloat texcoords[8] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+
+    ASSERT_NOT_NULL(flattener);
+    ASSERT_NOT_NULL(source);
+    ASSERT_NOT_NULL(quad);
+    ASSERT_NOT_NULL(flattener->current);
+    assert(n_clips == 0 || clips != NULL);
+    buffer = flattener->current;
+
+    if (buffer->n_sources == GL_FLATTENER_MAX_SOURCES) {
+        LOG_ERROR("Can't flatten more than %d layers into one buffer.\n", GL_FLATTENER_MAX_SOURCES);
+        return ENOSPC;
+    }
+
+    TRACER_BEGIN(flattener->renderer->tracer, "gl_flattener_draw");
+
+    image = import_dmabuf(flattener, source);
+    if (image == EGL_NO_IMAGE_KHR) {
+        TRACER_END(flattener->renderer->tracer, "gl_flattener_draw");
+        return EIO;
+    }
+
+    glGenTextures(1, &texture);
+    glBindTexture(flattener->source_target, texture);
+    glTexParameteri(flattener->source_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(flattener->source_target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(flattener->source_target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(flattener->source_target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    flattener->gl_egl_image_target_texture2d(flattener->source_target, image);
+
+    // Map the quad from buffer coordinates to NDC.
+    // The flattening buffer is a texture that's later scanned out, so its first row
+    // is at the top of the screen and at y = -1 in NDC. No need to flip anything.
+    w = (GLfloat) flattener->size.x;
+    h = (GLfloat) flattener->size.y;
+    positions[0] = 2 * quad->top_left.x / w - 1;
+    positions[1] = 2 * quad->top_left.y / h - 1;
+    positions[2] = 2 * quad->top_right.x / w - 1;
+    positions[3] = 2 * quad->top_right.y / h - 1;
+    positions[4] = 2 * quad->bottom_left.x / w - 1;
+    positions[5] = 2 * quad->bottom_left.y / h - 1;
+    positions[6] = 2 * quad->bottom_right.x / w - 1;
+    positions[7] = 2 * quad->bottom_right.y / h - 1;
+
+    glUniform1f(flattener->opacity_location, (GLfloat) opacity);
+
+    // Axis-aligned clips that aren't rounded are applied using the scissor test, since
+    // that's a lot cheaper. Everything else is handled by the fragment shader.
+    n_shader_clips = 0;
+    has_scissor = false;
+    scissor = AA_RECT_FROM_COORDS(0, 0, flattener->size.x, flattener->size.y);
+    for (size_t i = 0; i < n_clips; i++) {
+        const struct clip_rect *clip = clips + i;
+
+        if ((clip->is_aa && !clip->is_rounded) || n_shader_clips == GL_FLATTENER_MAX_CLIPS) {
+            scissor = aa_rect_intersection(scissor, clip->aa_rect);
+            has_scissor = true;
+            continue;
+        }
+
+        // GLSL matrices are column-major.
+        clip_transforms[n_shader_clips * 9 + 0] = (GLfloat) clip->layer_to_local.scaleX;
+        clip_transforms[n_shader_clips * 9 + 1] = (GLfloat) clip->layer_to_local.skewY;
+        clip_transforms[n_shader_clips * 9 + 2] = (GLfloat) clip->layer_to_local.pers0;
+        clip_transforms[n_shader_clips * 9 + 3] = (GLfloat) clip->layer_to_local.skewX;
+        clip_transforms[n_shader_clips * 9 + 4] = (GLfloat) clip->layer_to_local.scaleY;
+        clip_transforms[n_shader_clips * 9 + 5] = (GLfloat) clip->layer_to_local.pers1;
+        clip_transforms[n_shader_clips * 9 + 6] = (GLfloat) clip->layer_to_local.transX;
+        clip_transforms[n_shader_clips * 9 + 7] = (GLfloat) clip->layer_to_local.transY;
+        clip_transforms[n_shader_clips * 9 + 8] = (GLfloat) clip->layer_to_local.pers2;
+
+        clip_rects[n_shader_clips * 4 + 0] = (GLfloat) clip->local_rect.offset.x;
+        clip_rects[n_shader_clips * 4 + 1] = (GLfloat) clip->local_rect.offset.y;
+        clip_rects[n_shader_clips * 4 + 2] = (GLfloat) clip->local_rect.size.x;
+        clip_rects[n_shader_clips * 4 + 3] = (GLfloat) clip->local_rect.size.y;
+
+        clip_radii_x[n_shader_clips * 4 + 0] = (GLfloat) clip->upper_left_corner_radius.x;
+        clip_radii_x[n_shader_clips * 4 + 1] = (GLfloat) clip->upper_right_corner_radius.x;
+        clip_radii_x[n_shader_clips * 4 + 2] = (GLfloat) clip->lower_right_corner_radius.x;
+        clip_radii_x[n_shader_clips * 4 + 3] = (GLfloat) clip->lower_left_corner_radius.x;
+        clip_radii_y[n_shader_clips * 4 + 0] = (GLfloat) clip->upper_left_corner_radius.y;
+        clip_radii_y[n_shader_clips * 4 + 1] = (GLfloat) clip->upper_right_corner_radius.y;
+        clip_radii_y[n_shader_clips * 4 + 2] = (GLfloat) clip->lower_right_corner_radius.y;
+        clip_radii_y[n_shader_clips * 4 + 3] = (GLfloat) clip->lower_left_corner_radius.y;
+
+        n_shader_clips++;
+    }
+
+    glUniform1i(flattener->n_clips_location, n_shader_clips);
+    if (n_shader_clips > 0) {
+        glUniformMatrix3fv(flattener->clip_transforms_location, n_shader_clips, GL_FALSE, clip_transforms);
+        glUniform4fv(flattener->clip_rects_location, n_shader_clips, clip_rects);
+        glUniform4fv(flattener->clip_radii_x_location, n_shader_clips, clip_radii_x);
+        glUniform4fv(flattener->clip_radii_y_location, n_shader_clips, clip_radii_y);
+    }
+
+    if (has_scissor) {
+        // Like the viewport, the scissor box has its origin at the first row of the buffer.
+        GLint x0 = (GLint) floor(scissor.offset.x), y0 = (GLint) floor(scissor.offset.y);
+        GLint x1 = (GLint) ceil(scissor.offset.x + scissor.size.x), y1 = (GLint) ceil(scissor.offset.y + scissor.size.y);
+
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x0, y0, MAX2(x1 - x0, 0), MAX2(y1 - y0, 0));
+    }
+
+    glVertexAttribPointer(flattener->pos_location, 2, GL_FLOAT, GL_FALSE, 0, positions);
+    glEnableVertexAttribArray(flattener->pos_location);
+    glVertexAttribPointer(flattener->texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+    glEnableVertexAttribArray(flattener->texcoord_location);
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    if (has_scissor) {
+        glDisable(GL_SCISSOR_TEST);
+    }
+
+    glDisableVertexAttribArray(flattener->texcoord_location);
+    glDisableVertexAttribArray(flattener->pos_location);
+    glBindTexture(flattener->source_target, 0);
+
+    // The image & texture are only destroyed after the draw calls were flushed.
+    import = buffer->sources + buffer->n_sources++;
+    import->image = image;
+    import->texture = texture;
+    import->release_cb = release_cb;
+    import->userdata = userdata;
+
+    TRACER_END(flattener->renderer->tracer, "gl_flattener_draw");
+    return 0;
+}
+
+static void delete_source_imports(struct gl_flattener *flattener, struct gl_flattener_buffer *buffer) {
+    for (int i = 0; i < buffer->n_sources; i++) {
+        glDeleteTextures(1, &buffer->sources[i].texture);
+        flattener->egl_destroy_image(flattener->display, buffer->sources[i].image);
+        buffer->sources[i].texture = 0;
+        buffer->sources[i].image = EGL_NO_IMAGE_KHR;
+    }
+}
+
+static void release_sources(struct gl_flattener_buffer *buffer) {
+    for (int i = 0; i < buffer->n_sources; i++) {
+        if (buffer->sources[i].release_cb != NULL) {
+            buffer->sources[i].release_cb(buffer->sources[i].userdata);
+        }
+    }
+    buffer->n_sources = 0;
+}
+
+struct gl_flattener_buffer *gl_flattener_end(struct gl_flattener *flattener) {
+    struct gl_flattener_buffer *buffer;
+
+    ASSERT_NOT_NULL(flattener);
+    ASSERT_NOT_NULL(flattener->current);
+    buffer = flattener->current;
+
+    TRACER_BEGIN(flattener->renderer->tracer, "gl_flattener_end");
+
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Same as eglSwapBuffers, we rely on implicit sync here. The KMS commit
+    // will wait for the rendering to finish before scanning out the buffer.
+    glFlush();
+
+    delete_source_imports(flattener, buffer);
+    restore_egl_state(flattener, &flattener->saved_state);
+
+    flattener->current = NULL;
+
+    TRACER_END(flattener->renderer->tracer, "gl_flattener_end");
+
+    // The buffer keeps the flattener alive until it's released.
+    gl_flattener_ref(flattener);
+    return buffer;
+}
+
+void gl_flattener_cancel(struct gl_flattener *flattener) {
+    struct gl_flattener_buffer *buffer;
+
+    ASSERT_NOT_NULL(flattener);
+    ASSERT_NOT_NULL(flattener->current);
+    buffer = flattener->current;
+
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // The sources might still be read by queued draw calls.
+    glFinish();
+
+    delete_source_imports(flattener, buffer);
+    restore_egl_state(flattener, &flattener->saved_state);
+
+    flattener->current = NULL;
+
+    release_sources(buffer);
+
+    pthread_mutex_lock(&flattener->lock);
+    buffer->in_use = false;
+    pthread_mutex_unlock(&flattener->lock);
+}
+
+struct gbm_bo *gl_flattener_buffer_get_bo(struct gl_flattener_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+    return buffer->bo;
+}
+
+int gl_flattener_buffer_read_pixels(struct gl_flattener_buffer *buffer, void *pixels) {
+    struct egl_current_state saved_state;
+    struct gl_flattener *flattener;
+    GLenum gl_error;
+    int ok;
+
+    ASSERT_NOT_NULL(buffer);
+    ASSERT_NOT_NULL(pixels);
+    flattener = buffer->flattener;
+    assert(buffer->in_use);
+
+    TRACER_BEGIN(flattener->renderer->tracer, "gl_flattener_buffer_read_pixels");
+
+    ok = make_flattener_context_current(flattener, &saved_state);
+    if (ok != 0) {
+        goto out_end_trace;
+    }
+
+    // The first row of the buffer is at y = 0 (see gl_flattener_draw), so the rows
+    // are read top to bottom.
+    glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, flattener->size.x, flattener->size.y, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    gl_error = glGetError();
+    if (gl_error != GL_NO_ERROR) {
+        LOG_ERROR("Couldn't read back flattened layers. glReadPixels: %" PRIu32 "\n", (uint32_t) gl_error);
+        ok = EIO;
+    }
+
+    restore_egl_state(flattener, &saved_state);
+
+out_end_trace:
+    TRACER_END(flattener->renderer->tracer, "gl_flattener_buffer_read_pixels");
+    return ok;
+}
+
+void gl_flattener_buffer_release(struct gl_flattener_buffer *buffer) {
+    struct gl_flattener *flattener;
+
+    ASSERT_NOT_NULL(buffer);
+    flattener = buffer->flattener;
+
+    release_sources(buffer);
+
+    pthread_mutex_lock(&flattener->lock);
+    assert(buffer->in_use);
+    buffer->in_use = false;
+    pthread_mutex_unlock(&flattener->lock);
+
+    gl_flattener_unref(flattener);
+}
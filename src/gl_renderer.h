@@ -16,6 +16,7 @@
 
 #include "pixel_format.h"
 #include "util/collection.h"
+#include "util/geometry.h"
 #include "util/refcounting.h"
 
 #include "config.h"
@@ -85,4 +86,116 @@ EGLSurface gl_renderer_create_gbm_window_surface(
     const EGLint *int_attrib_list
 );
 
+/*
+ * GLES flattening compositor
+ *
+ * Composites layers that couldn't be put on a hardware plane into a single
+ * scanout buffer, which is then presented on a single plane instead.
+ *
+ * The flattener uses its own EGL context. It's made current only between
+ * @ref gl_flattener_begin and @ref gl_flattener_end, and the context that was
+ * current before is restored afterwards, so this can be called on the flutter
+ * rasterizer thread.
+ */
+struct gl_flattener;
+struct gl_flattener_buffer;
+
+/**
+ * @brief A single-planar dmabuf that can be composited by a @ref gl_flattener.
+ *
+ * The flattener doesn't take ownership of the fd.
+ */
+struct gl_flattener_source {
+    enum pixfmt format;
+    int width, height;
+    int fd;
+    uint32_t offset, pitch;
+    bool has_modifier;
+    uint64_t modifier;
+};
+
+typedef void (*gl_flattener_release_cb_t)(void *userdata);
+
+/**
+ * @brief Creates a new flattener that composites into buffers of @a size (in pixels).
+ */
+struct gl_flattener *gl_flattener_new(struct gl_renderer *renderer, struct vec2i size);
+
+/**
+ * @brief Creates a new flattener whose buffers are only read back using @ref gl_flattener_buffer_read_pixels,
+ * never scanned out.
+ */
+struct gl_flattener *gl_flattener_new_offscreen(struct gl_renderer *renderer, struct vec2i size);
+
+void gl_flattener_destroy(struct gl_flattener *flattener);
+
+DECLARE_REF_OPS(gl_flattener)
+
+struct vec2i gl_flattener_get_size(struct gl_flattener *flattener);
+
+/**
+ * @brief Starts compositing a new buffer.
+ *
+ * If @a opaque is true, the buffer is cleared to opaque black, otherwise to transparent.
+ *
+ * @returns 0 on success, EBUSY if all buffers are still being scanned out, or another error code.
+ */
+int gl_flattener_begin(struct gl_flattener *flattener, bool opaque);
+
+/**
+ * @brief The maximum number of clip rects that can be applied to a single @ref gl_flattener_draw.
+ */
+#define GL_FLATTENER_MAX_CLIPS 4
+
+/**
+ * @brief Draws @a source into the quadrangle @a quad (in buffer coordinates) of the current buffer,
+ * on top of everything drawn before.
+ *
+ * The corners of the source are mapped onto the corners of @a quad, so rotation is honoured as well.
+ * Only the parts inside all of the @a n_clips (possibly rotated or rounded) @a clips are drawn.
+ * If there are more than @ref GL_FLATTENER_MAX_CLIPS clips, the remaining ones are only applied
+ * using their axis-aligned bounding rect.
+ * @a release_cb is called with @a userdata once the buffer isn't scanned out anymore, or when compositing
+ * is cancelled. If drawing fails, @a release_cb is not called.
+ */
+int gl_flattener_draw(
+    struct gl_flattener *flattener,
+    const struct gl_flattener_source *source,
+    const struct quad *quad,
+    double opacity,
+    const struct clip_rect *clips,
+    size_t n_clips,
+    gl_flattener_release_cb_t release_cb,
+    void *userdata
+);
+
+/**
+ * @brief Finishes compositing and returns the composited buffer.
+ *
+ * The buffer stays reserved until @ref gl_flattener_buffer_release is called.
+ */
+struct gl_flattener_buffer *gl_flattener_end(struct gl_flattener *flattener);
+
+/**
+ * @brief Stops compositing the current buffer and releases all its sources.
+ */
+void gl_flattener_cancel(struct gl_flattener *flattener);
+
+struct gbm_bo *gl_flattener_buffer_get_bo(struct gl_flattener_buffer *buffer);
+
+/**
+ * @brief Copies the contents of @a buffer into @a pixels, waiting for compositing to finish.
+ *
+ * @a pixels must be big enough for width * height pixels, tightly packed, top row first.
+ * The pixels are RGBA, 8 bits per channel in that byte order, with premultiplied alpha.
+ */
+int gl_flattener_buffer_read_pixels(struct gl_flattener_buffer *buffer, void *pixels);
+
+/**
+ * @brief Gives the buffer back to the flattener, once it isn't scanned out anymore.
+ *
+ * Can be called on any thread.
+ */
+void gl_flattener_buffer_release(struct gl_flattener_buffer *buffer);
+
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_GL_RENDERER_H
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Input Trace
+ *
+ * See input_trace.h for the trace format.
+ */
+
+#include "input_trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/asserts.h"
+#include "util/logging.h"
+
+struct input_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+};
+
+COMPILE_ASSERT(sizeof(struct input_trace_header) == 16);
+COMPILE_ASSERT(sizeof(struct input_trace_event) == 40);
+
+struct input_trace_writer {
+    FILE *file;
+};
+
+struct input_trace_reader {
+    FILE *file;
+};
+
+struct input_trace_writer *input_trace_writer_new(const char *path) {
+    struct input_trace_writer *writer;
+    struct input_trace_header header;
+    FILE *file;
+
+    ASSERT_NOT_NULL(path);
+
+    writer = malloc(sizeof *writer);
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    file = fopen(path, "wbe");
+    if (file == NULL) {
+        LOG_ERROR("Couldn't open \"%s\" for recording input events. fopen: %s\n", path, strerror(errno));
+        goto fail_free_writer;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, INPUT_TRACE_MAGIC, sizeof header.magic);
+    header.version = INPUT_TRACE_VERSION;
+    header.event_size = sizeof(struct input_trace_event);
+
+    if (fwrite(&header, sizeof header, 1, file) != 1) {
+        LOG_ERROR("Couldn't write input trace header to \"%s\".\n", path);
+        goto fail_close_file;
+    }
+
+    writer->file = file;
+    return writer;
+
+fail_close_file:
+    fclose(file);
+
+fail_free_writer:
+    free(writer);
+    return NULL;
+}
+
+void input_trace_writer_destroy(struct input_trace_writer *writer) {
+    ASSERT_NOT_NULL(writer);
+
+    if (fclose(writer->file) != 0) {
+        LOG_ERROR("Couldn't finish writing input trace. fclose: %s\n", strerror(errno));
+    }
+    free(writer);
+}
+
+int input_trace_writer_write(struct input_trace_writer *writer, const struct input_trace_event *event) {
+    ASSERT_NOT_NULL(writer);
+    ASSERT_NOT_NULL(event);
+
+    if (fwrite(event, sizeof *event, 1, writer->file) != 1) {
+        return ferror(writer->file) ? EIO : ENOSPC;
+    }
+
+    return 0;
+}
+
+struct input_trace_reader *input_trace_reader_new(const char *path) {
+    struct input_trace_reader *reader;
+    struct input_trace_header header;
+    FILE *file;
+
+    ASSERT_NOT_NULL(path);
+
+    reader = malloc(sizeof *reader);
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    file = fopen(path, "rbe");
+    if (file == NULL) {
+        LOG_ERROR("Couldn't open input trace \"%s\". fopen: %s\n", path, strerror(errno));
+        goto fail_free_reader;
+    }
+
+    if (fread(&header, sizeof header, 1, file) != 1 || memcmp(header.magic, INPUT_TRACE_MAGIC, sizeof header.magic) != 0) {
+        LOG_ERROR("\"%s\" is not an input trace.\n", path);
+        goto fail_close_file;
+    }
+
+    if (header.version != INPUT_TRACE_VERSION || header.event_size != sizeof(struct input_trace_event)) {
+        LOG_ERROR(
+            "Input trace \"%s\" has an unsupported version (%" PRIu32 ", event size %" PRIu32 ").\n",
+            path,
+            header.version,
+            header.event_size
+        );
+        goto fail_close_file;
+    }
+
+    reader->file = file;
+    return reader;
+
+fail_close_file:
+    fclose(file);
+
+fail_free_reader:
+    free(reader);
+    return NULL;
+}
+
+void input_trace_reader_destroy(struct input_trace_reader *reader) {
+    ASSERT_NOT_NULL(reader);
+
+    fclose(reader->file);
+    free(reader);
+}
+
+int input_trace_reader_next(struct input_trace_reader *reader, struct input_trace_event *event_out) {
+    size_t n_read;
+
+    ASSERT_NOT_NULL(reader);
+    ASSERT_NOT_NULL(event_out);
+
+    n_read = fread(event_out, 1, sizeof *event_out, reader->file);
+    if (n_read == 0 && feof(reader->file)) {
+        return ENODATA;
+    } else if (n_read != sizeof *event_out) {
+        return ferror(reader->file) ? EIO : EINVAL;
+    }
+
+    if (event_out->type > kMax_InputTraceEventType) {
+        return EINVAL;
+    }
+
+    return 0;
+}
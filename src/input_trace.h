@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Input Trace - A compact binary recording of the input events processed
+ * by user_input, so they can be replayed deterministically later on,
+ * without any input devices.
+ *
+ * A trace is a header followed by fixed-size event records, in the byte order
+ * of the machine that recorded it. Coordinates are stored independent of the
+ * display size, so traces can be replayed on a display with a different resolution.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_INPUT_TRACE_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_INPUT_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define INPUT_TRACE_MAGIC "FDEINPUT"
+#define INPUT_TRACE_VERSION 1
+
+enum input_trace_event_type {
+    kDeviceAdded_InputTraceEventType,
+    kDeviceRemoved_InputTraceEventType,
+    kKey_InputTraceEventType,
+    kPointerMotion_InputTraceEventType,
+    kPointerMotionAbsolute_InputTraceEventType,
+    kPointerButton_InputTraceEventType,
+    kPointerAxis_InputTraceEventType,
+    kTouchDown_InputTraceEventType,
+    kTouchUp_InputTraceEventType,
+    kTouchMotion_InputTraceEventType,
+    kMax_InputTraceEventType = kTouchMotion_InputTraceEventType,
+};
+
+#define INPUT_TRACE_DEVICE_CAP_KEYBOARD (1 << 0)
+#define INPUT_TRACE_DEVICE_CAP_POINTER (1 << 1)
+#define INPUT_TRACE_DEVICE_CAP_TOUCH (1 << 2)
+#define INPUT_TRACE_DEVICE_CAP_TABLET_TOOL (1 << 3)
+
+struct input_trace_event {
+    /// CLOCK_MONOTONIC microseconds.
+    uint64_t timestamp_us;
+
+    /// The device this event is from. Devices are numbered in the order they were added.
+    uint32_t device_id;
+
+    /// One of @ref input_trace_event_type.
+    uint16_t type;
+
+    /// The multitouch slot for touch events.
+    int16_t slot;
+
+    /// Device added: INPUT_TRACE_DEVICE_CAP_* flags.
+    /// Key & pointer button: The evdev key / button code.
+    uint32_t code;
+
+    /// Device added: The number of multitouch slots.
+    /// Key & pointer button: 1 if pressed, 0 if released.
+    uint32_t value;
+
+    /// Pointer motion: The motion delta in display pixels.
+    /// Absolute pointer motion & touch: The position, normalized to 0..1 in display coordinates.
+    /// Pointer axis: The scroll amount.
+    double x, y;
+};
+
+struct input_trace_writer;
+
+/**
+ * @brief Creates (or truncates) the file at @a path and writes the trace header.
+ */
+struct input_trace_writer *input_trace_writer_new(const char *path);
+
+/**
+ * @brief Flushes all buffered events to the file and closes it.
+ */
+void input_trace_writer_destroy(struct input_trace_writer *writer);
+
+/**
+ * @brief Appends @a event to the trace. Events are buffered, and only written
+ * to the file once the buffer is full or the writer is destroyed.
+ */
+int input_trace_writer_write(struct input_trace_writer *writer, const struct input_trace_event *event);
+
+struct input_trace_reader;
+
+/**
+ * @brief Opens the trace at @a path for reading, and checks the header.
+ */
+struct input_trace_reader *input_trace_reader_new(const char *path);
+
+void input_trace_reader_destroy(struct input_trace_reader *reader);
+
+/**
+ * @brief Reads the next event of the trace into @a event_out.
+ *
+ * @returns Zero on success, ENODATA at the end of the trace, EINVAL if the trace is truncated
+ * or contains an invalid event, or another errno code if reading failed.
+ */
+int input_trace_reader_next(struct input_trace_reader *reader, struct input_trace_event *event_out);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_INPUT_TRACE_H
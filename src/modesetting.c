@@ -21,6 +21,8 @@
 #include <xf86drmMode.h>
 
 #include "pixel_format.h"
+#include "plane_index.h"
+#include "plane_solver.h"
 #include "util/bitset.h"
 #include "util/list.h"
 #include "util/lock_ops.h"
@@ -62,6 +64,16 @@ struct kms_req_layer {
     bool set_rotation;
     drm_plane_transform_t rotation;
 
+    /// The number of zpos placeholders pushed right before this layer.
+    int n_zpos_placeholders;
+
+    /// Our copy of the damage clips. layer.damage_clips points in here.
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+
+    /// The FB_DAMAGE_CLIPS property blob, created on the first commit (or test commit)
+    /// that needs it, or 0.
+    uint32_t damage_clips_blob_id;
+
     kms_fb_release_cb_t release_callback;
     kms_deferred_fb_release_cb_t deferred_release_callback;
     void *release_callback_userdata;
@@ -81,6 +93,9 @@ struct kms_req_builder {
     drmModeAtomicReq *req;
     int64_t next_zpos;
 
+    /// zpos placeholders pushed since the last framebuffer layer.
+    int n_pending_zpos_placeholders;
+
     int n_layers;
     struct kms_req_layer layers[32];
 
@@ -90,6 +105,16 @@ struct kms_req_builder {
 };
 
 COMPILE_ASSERT(BITSET_SIZE(((struct kms_req_builder *) 0)->available_planes) == 128);
+COMPILE_ASSERT(BITSET_SIZE(((struct kms_req_builder *) 0)->available_planes) == DRM_PLANE_INDEX_MAX_PLANES);
+
+/// How many destroyed request builders are kept around for reuse.
+#define KMS_REQ_BUILDER_POOL_SIZE 4
+
+struct completed_scanout {
+    kms_scanout_cb_t callback;
+    void *userdata;
+    uint64_t vblank_ns;
+};
 
 struct drmdev {
     int fd;
@@ -111,6 +136,12 @@ struct drmdev {
     size_t n_planes;
     struct drm_plane *planes;
 
+    /// Capabilities of @ref planes, indexed for @ref allocate_plane.
+    struct drm_plane_index plane_index;
+
+    /// Finds (and caches) plane assignments the driver accepts, see @ref kms_req_commit_common.
+    struct plane_solver *plane_solver;
+
     drmModeRes *res;
     drmModePlaneRes *plane_res;
 
@@ -126,6 +157,11 @@ struct drmdev {
         struct kms_req *last_flipped;
     } per_crtc_state[32];
 
+    /// Scanout callbacks of pageflips that were handled while the drmdev was locked.
+    /// They're called once it's unlocked again, so they can commit the next frame.
+    struct completed_scanout completed_scanouts[32];
+    size_t n_completed_scanouts;
+
     int master_fd;
     void *master_fd_metadata;
 
@@ -133,6 +169,16 @@ struct drmdev {
     void *userdata;
 
     struct list_head fbs;
+
+    /**
+     * @brief Builders of requests that were destroyed, reused by @ref drmdev_create_request_builder
+     * along with their atomic requests, so building the request for a frame doesn't allocate anything.
+     *
+     * This has its own lock since requests are often destroyed while @ref mutex is locked.
+     */
+    pthread_mutex_t builder_pool_lock;
+    struct kms_req_builder *free_builders[KMS_REQ_BUILDER_POOL_SIZE];
+    size_t n_free_builders;
 };
 
 static bool is_drm_master(int fd) {
@@ -912,6 +958,7 @@ static int fetch_plane(int drm_fd, uint32_t plane_id, struct drm_plane *plane_ou
     memcpy(plane_out->supported_formats, supported_formats, sizeof supported_formats);
     plane_out->has_alpha = has_alpha;
     plane_out->has_blend_mode = has_blend_mode;
+    plane_out->has_fb_damage_clips = DRM_ID_IS_VALID(ids.fb_damage_clips);
     memcpy(plane_out->supported_blend_modes, supported_blend_modes, sizeof supported_blend_modes);
     plane_out->committed_state.crtc_id = plane->crtc_id;
     plane_out->committed_state.fb_id = plane->fb_id;
@@ -1236,10 +1283,24 @@ struct drmdev *drmdev_new_from_interface_fd(int fd, void *fd_metadata, const str
         }
     }
 
+    // Build the index after the possible_crtcs of the primary & cursor planes were fixed up above.
+    ok = drm_plane_index_init(&drmdev->plane_index, drmdev->planes, drmdev->n_planes);
+    if (ok != 0) {
+        LOG_ERROR("Could not index DRM planes. drm_plane_index_init: %s\n", strerror(ok));
+        goto fail_free_planes;
+    }
+    LOG_KMS_DEBUG("Indexed %zu modified formats\n", drmdev->plane_index.n_modified_formats);
+
+    drmdev->plane_solver = plane_solver_new(drmdev->planes, &drmdev->plane_index);
+    if (drmdev->plane_solver == NULL) {
+        LOG_ERROR("Could not create plane solver.\n");
+        goto fail_fini_plane_index;
+    }
+
     gbm_device = gbm_create_device(drmdev->fd);
     if (gbm_device == NULL) {
         LOG_ERROR("Could not create GBM device.\n");
-        goto fail_free_planes;
+        goto fail_destroy_plane_solver;
     }
     LOG_KMS_DEBUG("GBM device created successfully\n");
 
@@ -1263,11 +1324,14 @@ struct drmdev *drmdev_new_from_interface_fd(int fd, void *fd_metadata, const str
     drmdev->gbm_device = gbm_device;
     drmdev->event_fd = event_fd;
     memset(drmdev->per_crtc_state, 0, sizeof(drmdev->per_crtc_state));
+    drmdev->n_completed_scanouts = 0;
     drmdev->master_fd = master_fd;
     drmdev->master_fd_metadata = fd_metadata;
     drmdev->interface = *interface;
     drmdev->userdata = userdata;
     list_inithead(&drmdev->fbs);
+    pthread_mutex_init(&drmdev->builder_pool_lock, NULL);
+    drmdev->n_free_builders = 0;
 
     LOG_KMS_DEBUG("========== DRM device init complete ==========\n");
     LOG_KMS_DEBUG("  atomic modesetting: %s\n", supports_atomic_modesetting ? "yes" : "no");
@@ -1284,6 +1348,12 @@ fail_close_event_fd:
 fail_destroy_gbm_device:
     gbm_device_destroy(gbm_device);
 
+fail_destroy_plane_solver:
+    plane_solver_destroy(drmdev->plane_solver);
+
+fail_fini_plane_index:
+    drm_plane_index_fini(&drmdev->plane_index);
+
 fail_free_planes:
     free_planes(drmdev->planes, drmdev->n_planes);
 
@@ -1343,12 +1413,21 @@ static void drmdev_destroy(struct drmdev *drmdev) {
     drmdev->interface.close(drmdev->master_fd, drmdev->master_fd_metadata, drmdev->userdata);
     close(drmdev->event_fd);
     gbm_device_destroy(drmdev->gbm_device);
+    plane_solver_destroy(drmdev->plane_solver);
+    drm_plane_index_fini(&drmdev->plane_index);
     free_planes(drmdev->planes, drmdev->n_planes);
     free_crtcs(drmdev->crtcs, drmdev->n_crtcs);
     free_encoders(drmdev->encoders, drmdev->n_encoders);
     free_connectors(drmdev->connectors, drmdev->n_connectors);
     drmModeFreePlaneResources(drmdev->plane_res);
     drmModeFreeResources(drmdev->res);
+    for (size_t i = 0; i < drmdev->n_free_builders; i++) {
+        if (drmdev->free_builders[i]->req != NULL) {
+            drmModeAtomicFree(drmdev->free_builders[i]->req);
+        }
+        free(drmdev->free_builders[i]);
+    }
+    pthread_mutex_destroy(&drmdev->builder_pool_lock);
     free(drmdev);
 }
 
@@ -1486,8 +1565,14 @@ drmdev_on_page_flip_locked(int fd, unsigned int sequence, unsigned int tv_sec, u
     ASSERT_NOT_NULL_MSG(crtc, "Invalid CRTC id");
 
     if (drmdev->per_crtc_state[crtc->index].scanout_callback != NULL) {
-        uint64_t vblank_ns = tv_sec * 1000000000ull + tv_usec * 1000ull;
-        drmdev->per_crtc_state[crtc->index].scanout_callback(drmdev, vblank_ns, drmdev->per_crtc_state[crtc->index].userdata);
+        ASSERT_MSG(drmdev->n_completed_scanouts < ARRAY_SIZE(drmdev->completed_scanouts), "Too many unhandled scanout callbacks.");
+
+        // The callback is only called in drmdev_unlock_and_call_scanout_callbacks, when the drmdev is unlocked,
+        // so it can already commit the next frame to this CRTC.
+        drmdev->completed_scanouts[drmdev->n_completed_scanouts].callback = drmdev->per_crtc_state[crtc->index].scanout_callback;
+        drmdev->completed_scanouts[drmdev->n_completed_scanouts].userdata = drmdev->per_crtc_state[crtc->index].userdata;
+        drmdev->completed_scanouts[drmdev->n_completed_scanouts].vblank_ns = tv_sec * 1000000000ull + tv_usec * 1000ull;
+        drmdev->n_completed_scanouts++;
 
         // clear the scanout callback
         drmdev->per_crtc_state[crtc->index].scanout_callback = NULL;
@@ -1506,6 +1591,27 @@ drmdev_on_page_flip_locked(int fd, unsigned int sequence, unsigned int tv_sec, u
     kms_req_unref(req);
 }
 
+/**
+ * @brief Unlocks the drmdev, then calls the scanout callbacks of all the pageflips that
+ * were handled while it was locked.
+ */
+static void drmdev_unlock_and_call_scanout_callbacks(struct drmdev *drmdev) {
+    struct completed_scanout completed[ARRAY_SIZE(drmdev->completed_scanouts)];
+    size_t n_completed;
+
+    ASSERT_MUTEX_LOCKED(drmdev->mutex);
+
+    n_completed = drmdev->n_completed_scanouts;
+    memcpy(completed, drmdev->completed_scanouts, n_completed * sizeof *completed);
+    drmdev->n_completed_scanouts = 0;
+
+    drmdev_unlock(drmdev);
+
+    for (size_t i = 0; i < n_completed; i++) {
+        completed[i].callback(drmdev, completed[i].vblank_ns, completed[i].userdata);
+    }
+}
+
 static int drmdev_on_modesetting_fd_ready_locked(struct drmdev *drmdev) {
     int ok;
 
@@ -1557,12 +1663,12 @@ int drmdev_on_event_fd_ready(struct drmdev *drmdev) {
         }
     }
 
-    drmdev_unlock(drmdev);
+    drmdev_unlock_and_call_scanout_callbacks(drmdev);
 
     return 0;
 
 fail_unlock:
-    drmdev_unlock(drmdev);
+    drmdev_unlock_and_call_scanout_callbacks(drmdev);
     return ok;
 }
 
@@ -2068,6 +2174,72 @@ int drmdev_move_cursor(struct drmdev *drmdev, uint32_t crtc_id, struct vec2i pos
     return 0;
 }
 
+int drmdev_set_cursor(struct drmdev *drmdev, uint32_t crtc_id, uint32_t gem_handle, uint32_t fb_id, struct vec2i size, struct vec2i pos) {
+    struct drm_plane *plane, *cursor_plane;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    drmdev_lock(drmdev);
+
+    if (drmdev->master_fd < 0) {
+        ok = EBUSY;
+        goto fail_unlock;
+    }
+
+    cursor_plane = NULL;
+    for_each_plane_in_drmdev(drmdev, plane) {
+        if (plane->type == kCursor_DrmPlaneType && plane->committed_state.crtc_id == crtc_id) {
+            cursor_plane = plane;
+            break;
+        }
+    }
+
+    if (cursor_plane == NULL) {
+        ok = ENOENT;
+        goto fail_unlock;
+    }
+
+    if (gem_handle != 0) {
+        // Move first, so the new image doesn't show up at the old position for a frame.
+        ok = drmModeMoveCursor(drmdev->master_fd, crtc_id, pos.x, pos.y);
+        if (ok < 0) {
+            ok = errno;
+            LOG_ERROR("Couldn't move mouse cursor. drmModeMoveCursor: %s\n", strerror(ok));
+            goto fail_unlock;
+        }
+    }
+
+    ok = drmModeSetCursor(drmdev->master_fd, crtc_id, gem_handle, size.x, size.y);
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't set mouse cursor image. drmModeSetCursor: %s\n", strerror(ok));
+        goto fail_unlock;
+    }
+
+    if (gem_handle != 0) {
+        cursor_plane->committed_state.fb_id = fb_id;
+        cursor_plane->committed_state.src_x = 0;
+        cursor_plane->committed_state.src_y = 0;
+        cursor_plane->committed_state.src_w = size.x << 16;
+        cursor_plane->committed_state.src_h = size.y << 16;
+        cursor_plane->committed_state.crtc_x = pos.x;
+        cursor_plane->committed_state.crtc_y = pos.y;
+        cursor_plane->committed_state.crtc_w = size.x;
+        cursor_plane->committed_state.crtc_h = size.y;
+    } else {
+        cursor_plane->committed_state.crtc_id = 0;
+        cursor_plane->committed_state.fb_id = 0;
+    }
+
+    drmdev_unlock(drmdev);
+    return 0;
+
+fail_unlock:
+    drmdev_unlock(drmdev);
+    return ok;
+}
+
 static void drmdev_set_scanout_callback_locked(
     struct drmdev *drmdev,
     uint32_t crtc_id,
@@ -2181,10 +2353,18 @@ drmModeModeInfo *__next_mode(const struct drm_connector *connector, const drmMod
 
 #ifdef DEBUG_DRM_PLANE_ALLOCATIONS
     #define LOG_DRM_PLANE_ALLOCATION_DEBUG LOG_DEBUG
+    #define DRM_PLANE_ALLOCATION_DEBUG_ENABLED true
 #else
     #define LOG_DRM_PLANE_ALLOCATION_DEBUG LOG_KMS_DEBUG
+    #define DRM_PLANE_ALLOCATION_DEBUG_ENABLED kms_debug_enabled
 #endif
 
+/**
+ * @brief Checks a single plane against the constraints, logging why it doesn't qualify.
+ *
+ * Plane allocation itself uses the plane index. This is only used to explain why no plane
+ * could be allocated, when plane allocation debugging is enabled.
+ */
 static bool plane_qualifies(
     // clang-format off
     struct drm_plane *plane,
@@ -2327,41 +2507,56 @@ static struct drm_plane *allocate_plane(
     bool has_id_range, uint32_t id_lower_limit
     // clang-format on
 ) {
-    for (int i = 0; i < BITSET_SIZE(builder->available_planes); i++) {
-        struct drm_plane *plane = builder->drmdev->planes + i;
-
-        if (BITSET_TEST(builder->available_planes, i)) {
-            // find out if the plane matches our criteria
-            bool qualifies = plane_qualifies(
-                plane,
-                allow_primary,
-                allow_overlay,
-                allow_cursor,
-                format,
-                has_modifier,
-                modifier,
-                has_zpos,
-                zpos_lower_limit,
-                zpos_upper_limit,
-                has_rotation,
-                rotation,
-                has_id_range,
-                id_lower_limit
-            );
+    int index;
 
-            // if it doesn't, look for the next one
-            if (!qualifies) {
-                continue;
+    index = drm_plane_index_find(
+        &builder->drmdev->plane_index,
+        builder->available_planes,
+        allow_primary,
+        allow_overlay,
+        allow_cursor,
+        format,
+        has_modifier,
+        modifier,
+        has_zpos,
+        zpos_lower_limit,
+        zpos_upper_limit,
+        has_rotation,
+        rotation,
+        has_id_range,
+        id_lower_limit
+    );
+    if (index < 0) {
+        // we didn't find an available plane matching our criteria
+        if (DRM_PLANE_ALLOCATION_DEBUG_ENABLED) {
+            for (int i = 0; i < builder->drmdev->n_planes; i++) {
+                if (BITSET_TEST(builder->available_planes, i)) {
+                    plane_qualifies(
+                        builder->drmdev->planes + i,
+                        allow_primary,
+                        allow_overlay,
+                        allow_cursor,
+                        format,
+                        has_modifier,
+                        modifier,
+                        has_zpos,
+                        zpos_lower_limit,
+                        zpos_upper_limit,
+                        has_rotation,
+                        rotation,
+                        has_id_range,
+                        id_lower_limit
+                    );
+                }
             }
-
-            // we found one, mark it as used and return it
-            BITSET_CLEAR(builder->available_planes, i);
-            return plane;
         }
+
+        return NULL;
     }
 
-    // we didn't find an available plane matching our criteria
-    return NULL;
+    // we found one, mark it as used and return it
+    BITSET_CLEAR(builder->available_planes, index);
+    return builder->drmdev->planes + index;
 }
 
 static void release_plane(struct kms_req_builder *builder, uint32_t plane_id) {
@@ -2385,9 +2580,37 @@ static void release_plane(struct kms_req_builder *builder, uint32_t plane_id) {
     BITSET_SET(builder->available_planes, index);
 }
 
+static struct kms_req_builder *take_pooled_builder(struct drmdev *drmdev) {
+    struct kms_req_builder *builder;
+
+    pthread_mutex_lock(&drmdev->builder_pool_lock);
+    builder = drmdev->n_free_builders > 0 ? drmdev->free_builders[--drmdev->n_free_builders] : NULL;
+    pthread_mutex_unlock(&drmdev->builder_pool_lock);
+
+    return builder;
+}
+
+/**
+ * @brief Puts @a builder into the builder pool of @a drmdev, or frees it if the pool is full.
+ */
+static void recycle_builder(struct drmdev *drmdev, struct kms_req_builder *builder) {
+    pthread_mutex_lock(&drmdev->builder_pool_lock);
+    if (drmdev->n_free_builders < KMS_REQ_BUILDER_POOL_SIZE) {
+        drmdev->free_builders[drmdev->n_free_builders++] = builder;
+        builder = NULL;
+    }
+    pthread_mutex_unlock(&drmdev->builder_pool_lock);
+
+    if (builder != NULL) {
+        if (builder->req != NULL) {
+            drmModeAtomicFree(builder->req);
+        }
+        free(builder);
+    }
+}
+
 struct kms_req_builder *drmdev_create_request_builder(struct drmdev *drmdev, uint32_t crtc_id) {
     struct kms_req_builder *builder;
-    drmModeAtomicReq *req;
     struct drm_crtc *crtc;
     int64_t min_zpos;
     bool supports_atomic_modesetting;
@@ -2408,37 +2631,35 @@ struct kms_req_builder *drmdev_create_request_builder(struct drmdev *drmdev, uin
         goto fail_unlock;
     }
 
-    builder = malloc(sizeof *builder);
+    builder = take_pooled_builder(drmdev);
     if (builder == NULL) {
-        goto fail_unlock;
+        builder = malloc(sizeof *builder);
+        if (builder == NULL) {
+            goto fail_unlock;
+        }
+
+        builder->req = NULL;
     }
 
     supports_atomic_modesetting = drmdev->supports_atomic_modesetting;
 
     if (supports_atomic_modesetting) {
-        req = drmModeAtomicAlloc();
-        if (req == NULL) {
-            goto fail_free_builder;
+        if (builder->req != NULL) {
+            // Reuse the property storage of the pooled request.
+            drmModeAtomicSetCursor(builder->req, 0);
+        } else {
+            builder->req = drmModeAtomicAlloc();
+            if (builder->req == NULL) {
+                goto fail_free_builder;
+            }
         }
 
         // set the CRTC to active
-        drmModeAtomicAddProperty(req, crtc->id, crtc->ids.active, 1);
-    } else {
-        req = NULL;
+        drmModeAtomicAddProperty(builder->req, crtc->id, crtc->ids.active, 1);
     }
 
-    min_zpos = INT64_MAX;
-    BITSET_ZERO(builder->available_planes);
-    for (int i = 0; i < drmdev->n_planes; i++) {
-        struct drm_plane *plane = drmdev->planes + i;
-
-        if (plane->possible_crtcs & crtc->bitmask) {
-            BITSET_SET(builder->available_planes, i);
-            if (plane->has_zpos && plane->min_zpos < min_zpos) {
-                min_zpos = plane->min_zpos;
-            }
-        }
-    }
+    BITSET_COPY(builder->available_planes, drmdev->plane_index.crtc_planes[crtc->index]);
+    min_zpos = drmdev->plane_index.crtc_min_zpos[crtc->index];
 
     drmdev_unlock(drmdev);
 
@@ -2449,8 +2670,8 @@ struct kms_req_builder *drmdev_create_request_builder(struct drmdev *drmdev, uin
     builder->supports_atomic = supports_atomic_modesetting;
     builder->connector = NULL;
     builder->crtc = crtc;
-    builder->req = req;
     builder->next_zpos = min_zpos;
+    builder->n_pending_zpos_placeholders = 0;
     builder->n_layers = 0;
     builder->has_mode = false;
     builder->unset_mode = false;
@@ -2465,17 +2686,25 @@ fail_unlock:
 }
 
 static void kms_req_builder_destroy(struct kms_req_builder *builder) {
+    struct drmdev *drmdev;
+
     /// TODO: Is this complete?
     for (int i = 0; i < builder->n_layers; i++) {
         if (builder->layers[i].release_callback != NULL) {
             builder->layers[i].release_callback(builder->layers[i].release_callback_userdata);
         }
+
+        // The kernel keeps its own reference to the blob in the plane state, so
+        // it's fine to destroy it even if the request is still being scanned out.
+        if (builder->layers[i].damage_clips_blob_id != 0) {
+            drmModeDestroyPropertyBlob(builder->drmdev->fd, builder->layers[i].damage_clips_blob_id);
+        }
     }
-    if (builder->req != NULL) {
-        drmModeAtomicFree(builder->req);
-    }
-    drmdev_unref(builder->drmdev);
-    free(builder);
+    drmdev = builder->drmdev;
+
+    // The pool belongs to the drmdev, so this has to happen before the drmdev is unrefed.
+    recycle_builder(drmdev, builder);
+    drmdev_unref(drmdev);
 }
 
 DEFINE_REF_OPS(kms_req_builder, n_refs)
@@ -2529,6 +2758,34 @@ int kms_req_builder_set_connector(struct kms_req_builder *builder, uint32_t conn
     return 0;
 }
 
+/**
+ * @brief Copies @a n_clips damage clips from @a clips into @a clips_out, which has room for
+ * KMS_MAX_DAMAGE_CLIPS clips. If there are more than that, the bounding box of all of them is used instead.
+ *
+ * @returns The number of clips in @a clips_out.
+ */
+static size_t copy_damage_clips(struct drm_mode_rect *clips_out, const struct drm_mode_rect *clips, size_t n_clips) {
+    struct drm_mode_rect bounds;
+
+    if (n_clips <= KMS_MAX_DAMAGE_CLIPS) {
+        if (n_clips > 0) {
+            memcpy(clips_out, clips, n_clips * sizeof *clips);
+        }
+        return n_clips;
+    }
+
+    bounds = clips[0];
+    for (size_t i = 1; i < n_clips; i++) {
+        bounds.x1 = MIN2(bounds.x1, clips[i].x1);
+        bounds.y1 = MIN2(bounds.y1, clips[i].y1);
+        bounds.x2 = MAX2(bounds.x2, clips[i].x2);
+        bounds.y2 = MAX2(bounds.y2, clips[i].y2);
+    }
+
+    clips_out[0] = bounds;
+    return 1;
+}
+
 int kms_req_builder_push_fb_layer(
     struct kms_req_builder *builder,
     const struct kms_fb_layer *layer,
@@ -2695,42 +2952,6 @@ int kms_req_builder_push_fb_layer(
         zpos = 0;
     }
 
-    if (builder->use_legacy) {
-    } else {
-        uint32_t plane_id = plane->id;
-
-        /// TODO: Error checking
-        /// TODO: Maybe add these in the kms_req_builder_commit instead?
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_id, builder->crtc->id);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.fb_id, layer->drm_fb_id);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_x, layer->dst_x);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_y, layer->dst_y);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_w, layer->dst_w);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.crtc_h, layer->dst_h);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_x, layer->src_x);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_y, layer->src_y);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_w, layer->src_w);
-        drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.src_h, layer->src_h);
-
-        if (plane->has_zpos && !plane->has_hardcoded_zpos) {
-            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.zpos, zpos);
-        }
-
-        if (layer->has_rotation && plane->has_rotation && !plane->has_hardcoded_rotation) {
-            drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.rotation, layer->rotation.u64);
-        }
-
-        if (index == 0) {
-            if (plane->has_alpha) {
-                drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.alpha, plane->max_alpha);
-            }
-
-            if (plane->has_blend_mode && plane->supported_blend_modes[kNone_DrmBlendMode]) {
-                drmModeAtomicAddProperty(builder->req, plane_id, plane->ids.pixel_blend_mode, kNone_DrmBlendMode);
-            }
-        }
-    }
-
     // This should be done when we're sure we're not failing.
     // Because on failure it would be the callers job to close the fd.
     if (close_in_fence_fd_after) {
@@ -2742,6 +2963,8 @@ int kms_req_builder_push_fb_layer(
         }
     }
 
+    // The plane properties are only added to the atomic request on commit, when it's
+    // clear which planes the driver actually accepts for these layers.
     /// TODO: Right now we're adding zpos, rotation to the atomic request unconditionally
     /// when specified in the fb layer. Ideally we would check for updates
     /// on commit and only add to the atomic request when zpos / rotation changed.
@@ -2756,9 +2979,16 @@ int kms_req_builder_push_fb_layer(
     builder->layers[index].zpos = zpos;
     builder->layers[index].set_rotation = layer->has_rotation;
     builder->layers[index].rotation = layer->rotation;
+    builder->layers[index].n_zpos_placeholders = builder->n_pending_zpos_placeholders;
+    builder->layers[index].layer.n_damage_clips = layer->has_damage ? copy_damage_clips(
+        builder->layers[index].damage_clips, layer->damage_clips, layer->n_damage_clips
+    ) : 0;
+    builder->layers[index].layer.damage_clips = builder->layers[index].damage_clips;
+    builder->layers[index].damage_clips_blob_id = 0;
     builder->layers[index].release_callback = release_callback;
     builder->layers[index].deferred_release_callback = deferred_release_callback;
     builder->layers[index].release_callback_userdata = userdata;
+    builder->n_pending_zpos_placeholders = 0;
     return 0;
 
 fail_release_plane:
@@ -2770,6 +3000,7 @@ int kms_req_builder_push_zpos_placeholder_layer(struct kms_req_builder *builder,
     ASSERT_NOT_NULL(builder);
     ASSERT_NOT_NULL(zpos_out);
     *zpos_out = builder->next_zpos++;
+    builder->n_pending_zpos_placeholders++;
     return 0;
 }
 
@@ -2797,6 +3028,247 @@ static bool drm_plane_is_active(struct drm_plane *plane) {
     return plane->committed_state.fb_id != 0 && plane->committed_state.crtc_id != 0;
 }
 
+static void add_damage_clips_property(drmModeAtomicReq *req, struct kms_req_builder *builder, int index, struct drm_plane *plane) {
+    struct kms_req_layer *layer = builder->layers + index;
+    static const struct drm_mode_rect no_damage = { 0, 0, 0, 0 };
+    int ok;
+
+    if (layer->damage_clips_blob_id == 0) {
+        // A blob can't be empty, so "nothing changed" is sent as a single empty rect.
+        if (layer->layer.n_damage_clips == 0) {
+            ok = drmModeCreatePropertyBlob(builder->drmdev->fd, &no_damage, sizeof no_damage, &layer->damage_clips_blob_id);
+        } else {
+            ok = drmModeCreatePropertyBlob(
+                builder->drmdev->fd,
+                layer->damage_clips,
+                layer->layer.n_damage_clips * sizeof(struct drm_mode_rect),
+                &layer->damage_clips_blob_id
+            );
+        }
+        if (ok != 0) {
+            ok = errno;
+            LOG_ERROR("Couldn't upload damage clips. drmModeCreatePropertyBlob: %s\n", strerror(ok));
+            layer->damage_clips_blob_id = 0;
+            return;
+        }
+    }
+
+    drmModeAtomicAddProperty(req, plane->id, plane->ids.fb_damage_clips, layer->damage_clips_blob_id);
+}
+
+static void add_layer_properties(drmModeAtomicReq *req, struct kms_req_builder *builder, int index, struct drm_plane *plane, int64_t zpos) {
+    const struct kms_fb_layer *layer = &builder->layers[index].layer;
+    uint32_t plane_id = plane->id;
+    bool force;
+
+    // Properties that didn't change since the last commit are left out, the kernel keeps
+    // their committed values. That's only valid if the plane is still scanning out on our CRTC,
+    // otherwise everything is set again.
+    force = !drm_plane_is_active(plane) || plane->committed_state.crtc_id != builder->crtc->id;
+
+#define ADD_PROPERTY_IF_CHANGED(_prop_id, _committed, _value)              \
+    do {                                                                   \
+        if (force || (_committed) != (_value)) {                           \
+            drmModeAtomicAddProperty(req, plane_id, (_prop_id), (_value)); \
+        }                                                                  \
+    } while (false)
+
+    /// TODO: Error checking
+    // FB_ID is always set, so the CRTC is part of the commit and we get a pageflip event for it.
+    drmModeAtomicAddProperty(req, plane_id, plane->ids.fb_id, layer->drm_fb_id);
+
+    ADD_PROPERTY_IF_CHANGED(plane->ids.crtc_id, plane->committed_state.crtc_id, builder->crtc->id);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.crtc_x, plane->committed_state.crtc_x, (uint32_t) layer->dst_x);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.crtc_y, plane->committed_state.crtc_y, (uint32_t) layer->dst_y);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.crtc_w, plane->committed_state.crtc_w, layer->dst_w);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.crtc_h, plane->committed_state.crtc_h, layer->dst_h);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.src_x, plane->committed_state.src_x, layer->src_x);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.src_y, plane->committed_state.src_y, layer->src_y);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.src_w, plane->committed_state.src_w, layer->src_w);
+    ADD_PROPERTY_IF_CHANGED(plane->ids.src_h, plane->committed_state.src_h, layer->src_h);
+
+    if (plane->has_zpos && !plane->has_hardcoded_zpos) {
+        ADD_PROPERTY_IF_CHANGED(plane->ids.zpos, plane->committed_state.zpos, zpos);
+    }
+
+    if (layer->has_rotation && plane->has_rotation && !plane->has_hardcoded_rotation) {
+        ADD_PROPERTY_IF_CHANGED(plane->ids.rotation, plane->committed_state.rotation.u64, layer->rotation.u64);
+    }
+
+    if (index == 0) {
+        if (plane->has_alpha) {
+            ADD_PROPERTY_IF_CHANGED(plane->ids.alpha, plane->committed_state.alpha, plane->max_alpha);
+        }
+
+        if (plane->has_blend_mode && plane->supported_blend_modes[kNone_DrmBlendMode]) {
+            ADD_PROPERTY_IF_CHANGED(plane->ids.pixel_blend_mode, plane->committed_state.blend_mode, kNone_DrmBlendMode);
+        }
+    }
+
+    // Damage is relative to what the plane showed before, so it's only meaningful if the plane
+    // was already scanning out on our CRTC. The kernel doesn't keep damage clips across commits,
+    // so if we don't set them, the whole framebuffer is damaged.
+    if (layer->has_damage && plane->has_fb_damage_clips && !force) {
+        add_damage_clips_property(req, builder, index, plane);
+    }
+
+#undef ADD_PROPERTY_IF_CHANGED
+}
+
+static void add_plane_assignment_properties(drmModeAtomicReq *req, struct kms_req_builder *builder, const struct plane_assignment *assignment) {
+    struct drmdev *drmdev = builder->drmdev;
+    int unused_planes[DRM_PLANE_INDEX_MAX_PLANES];
+    int i, n_unused_planes;
+
+    n_unused_planes = drm_plane_index_get_unused_planes(
+        &drmdev->plane_index,
+        builder->crtc->index,
+        assignment->plane_indices,
+        assignment->n_layers,
+        unused_planes
+    );
+
+    // All planes that are not used by us and are connected to our CRTC
+    // should be disabled.
+    for (i = 0; i < n_unused_planes; i++) {
+        struct drm_plane *plane = drmdev->planes + unused_planes[i];
+
+        if (drm_plane_is_active(plane) && plane->committed_state.crtc_id == builder->crtc->id) {
+            LOG_KMS_DEBUG("  Disabling unused plane %u (was on crtc %u)\n", plane->id, builder->crtc->id);
+            drmModeAtomicAddProperty(req, plane->id, plane->ids.crtc_id, 0);
+            drmModeAtomicAddProperty(req, plane->id, plane->ids.fb_id, 0);
+        }
+    }
+
+    for (i = 0; i < assignment->n_layers; i++) {
+        add_layer_properties(req, builder, i, drmdev->planes + assignment->plane_indices[i], assignment->zpos[i]);
+    }
+}
+
+static void get_plane_solver_layers(struct kms_req_builder *builder, struct plane_solver_layer *layers_out) {
+    for (int i = 0; i < builder->n_layers; i++) {
+        const struct kms_fb_layer *layer = &builder->layers[i].layer;
+
+        layers_out[i] = (struct plane_solver_layer){
+            .format = layer->format,
+            .has_modifier = layer->has_modifier,
+            .modifier = layer->modifier,
+            .src_w = layer->src_w,
+            .src_h = layer->src_h,
+            .dst_w = layer->dst_w,
+            .dst_h = layer->dst_h,
+            .has_rotation = layer->has_rotation,
+            .rotation = layer->rotation,
+            .prefer_cursor = layer->prefer_cursor,
+            .n_zpos_placeholders = builder->layers[i].n_zpos_placeholders,
+        };
+    }
+}
+
+struct plane_test_context {
+    struct kms_req_builder *builder;
+    uint32_t flags;
+    int cursor;
+};
+
+static int test_plane_assignment(const struct plane_assignment *assignment, void *userdata) {
+    struct plane_test_context *context = userdata;
+    struct kms_req_builder *builder = context->builder;
+    int ok;
+
+    add_plane_assignment_properties(builder->req, builder, assignment);
+
+    ok = drmModeAtomicCommit(builder->drmdev->master_fd, builder->req, DRM_MODE_ATOMIC_TEST_ONLY | context->flags, NULL);
+    ok = ok != 0 ? errno : 0;
+
+    // Drop the plane properties again, so the next assignment can be tested on top of the same request.
+    drmModeAtomicSetCursor(builder->req, context->cursor);
+
+    LOG_KMS_DEBUG("  TEST_ONLY commit: %s\n", ok == 0 ? "accepted" : strerror(ok));
+    return ok;
+}
+
+/**
+ * @brief Finds a plane assignment for the layers of @a builder the driver accepts, moves the layers to
+ * those planes and adds their properties to the atomic request.
+ *
+ * The assignment is cached by the plane solver, so usually this doesn't do any TEST_ONLY commits.
+ * If no accepted assignment can be found, the planes chosen by @ref kms_req_builder_push_fb_layer are used.
+ */
+static void assign_planes_locked(struct kms_req_builder *builder, uint32_t test_flags) {
+    struct plane_solver_layer solver_layers[PLANE_SOLVER_MAX_LAYERS];
+    struct plane_test_context context;
+    struct plane_assignment initial, assignment;
+    struct drmdev *drmdev = builder->drmdev;
+    int ok;
+
+    initial.n_layers = builder->n_layers;
+    for (int i = 0; i < builder->n_layers; i++) {
+        initial.plane_indices[i] = builder->layers[i].plane - drmdev->planes;
+        initial.has_zpos[i] = builder->layers[i].set_zpos;
+        initial.zpos[i] = builder->layers[i].zpos;
+    }
+
+    if (builder->n_layers == 0) {
+        add_plane_assignment_properties(builder->req, builder, &initial);
+        return;
+    }
+
+    get_plane_solver_layers(builder, solver_layers);
+
+    context.builder = builder;
+    context.flags = test_flags;
+    context.cursor = drmModeAtomicGetCursor(builder->req);
+
+    ok = plane_solver_solve(
+        drmdev->plane_solver,
+        builder->crtc->index,
+        drmdev->plane_index.crtc_min_zpos[builder->crtc->index],
+        solver_layers,
+        builder->n_layers,
+        &initial,
+        test_plane_assignment,
+        &context,
+        &assignment
+    );
+    if (ok != 0) {
+        LOG_DEBUG("Could not find a plane assignment the driver accepts. plane_solver_solve: %s\n", strerror(ok));
+        assignment = initial;
+    }
+
+    BITSET_COPY(builder->available_planes, drmdev->plane_index.crtc_planes[builder->crtc->index]);
+    for (int i = 0; i < builder->n_layers; i++) {
+        struct drm_plane *plane = drmdev->planes + assignment.plane_indices[i];
+
+        if (plane != builder->layers[i].plane) {
+            LOG_KMS_DEBUG("  layer[%d]: moved from plane %u to plane %u\n", i, builder->layers[i].plane_id, plane->id);
+        }
+
+        builder->layers[i].plane = plane;
+        builder->layers[i].plane_id = plane->id;
+        builder->layers[i].set_zpos = assignment.has_zpos[i];
+        builder->layers[i].zpos = assignment.zpos[i];
+        BITSET_CLEAR(builder->available_planes, assignment.plane_indices[i]);
+    }
+
+    add_plane_assignment_properties(builder->req, builder, &assignment);
+
+    if (kms_debug_enabled) {
+        struct plane_solver_stats stats;
+
+        plane_solver_get_stats(drmdev->plane_solver, &stats);
+        LOG_KMS_DEBUG(
+            "  plane solver: %" PRIu64 " solves, %" PRIu64 " cache hits, %" PRIu64 " tests (%" PRIu64 " rejected), %" PRIu64
+            " unsolvable\n",
+            stats.n_solves,
+            stats.n_cache_hits,
+            stats.n_tests,
+            stats.n_rejected_tests,
+            stats.n_unsolvable
+        );
+    }
+}
+
 static int
 kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scanout_cb, void *userdata, void_callback_t destroy_cb) {
     struct kms_req_builder *builder;
@@ -3003,21 +3475,6 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             (flags & DRM_MODE_ATOMIC_NONBLOCK) ? " | NONBLOCK" : "",
             (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) ? " | ALLOW_MODESET" : "");
 
-        // All planes that are not used by us and are connected to our CRTC
-        // should be disabled.
-        {
-            int i;
-            BITSET_FOREACH_SET(i, builder->available_planes, 32) {
-                struct drm_plane *plane = builder->drmdev->planes + i;
-
-                if (drm_plane_is_active(plane) && plane->committed_state.crtc_id == builder->crtc->id) {
-                    LOG_KMS_DEBUG("  Disabling unused plane %u (was on crtc %u)\n", plane->id, builder->crtc->id);
-                    drmModeAtomicAddProperty(builder->req, plane->id, plane->ids.crtc_id, 0);
-                    drmModeAtomicAddProperty(builder->req, plane->id, plane->ids.fb_id, 0);
-                }
-            }
-        }
-
         if (builder->connector != NULL) {
             // add the CRTC_ID property if that was explicitly set
             drmModeAtomicAddProperty(builder->req, builder->connector->id, builder->connector->ids.crtc_id, builder->crtc->id);
@@ -3029,8 +3486,14 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             } else {
                 drmModeAtomicAddProperty(builder->req, builder->crtc->id, builder->crtc->ids.mode_id, 0);
             }
+
+            // Scaler and bandwidth limits depend on the mode, so the cached assignments might not be accepted anymore.
+            plane_solver_clear(builder->drmdev->plane_solver);
         }
 
+        // TEST_ONLY commits must not request a page flip event.
+        assign_planes_locked(builder, update_mode ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0);
+
         /// TODO: If we're on raspberry pi and only have one layer, we can do an async pageflip
         /// on the primary plane to replace the next queued frame. (To do _real_ triple buffering
         /// with fully decoupled framerate, potentially)
@@ -3040,6 +3503,15 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             ok = errno;
             LOG_ERROR("Could not commit display update. drmModeAtomicCommit: %s\n", strerror(ok));
             LOG_KMS_DEBUG("  FAILED: drmModeAtomicCommit: %s\n", strerror(ok));
+
+            if (builder->n_layers > 0 && (ok == EINVAL || ok == ERANGE || ok == ENOSPC)) {
+                struct plane_solver_layer solver_layers[PLANE_SOLVER_MAX_LAYERS];
+
+                // The driver rejected the assignment after all. Don't use it again next frame.
+                get_plane_solver_layers(builder, solver_layers);
+                plane_solver_forget(builder->drmdev->plane_solver, builder->crtc->index, solver_layers, builder->n_layers);
+            }
+
             goto fail_unref_builder;
         }
         LOG_KMS_DEBUG("  drmModeAtomicCommit: OK\n");
@@ -3061,7 +3533,7 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         plane->committed_state.crtc_w = layer->layer.dst_w;
         plane->committed_state.crtc_h = layer->layer.dst_h;
 
-        if (builder->layers[i].set_zpos) {
+        if (builder->layers[i].set_zpos || (!builder->use_legacy && plane->has_zpos && !plane->has_hardcoded_zpos)) {
             plane->committed_state.zpos = layer->zpos;
         }
         if (builder->layers[i].set_rotation) {
@@ -3071,8 +3543,42 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         plane->committed_state.has_format = true;
         plane->committed_state.format = layer->layer.format;
 
-        // builder->layers[i].plane->committed_state.alpha = layer->alpha;
-        // builder->layers[i].plane->committed_state.blend_mode = builder->layers[i].layer.blend_mode;
+        // see add_layer_properties
+        if (!builder->use_legacy && i == 0) {
+            if (plane->has_alpha) {
+                plane->committed_state.alpha = plane->max_alpha;
+            }
+            if (plane->has_blend_mode && plane->supported_blend_modes[kNone_DrmBlendMode]) {
+                plane->committed_state.blend_mode = kNone_DrmBlendMode;
+            }
+        }
+    }
+
+    // The planes of our CRTC that weren't used were disabled by add_plane_assignment_properties.
+    if (!builder->use_legacy) {
+        int used_planes[DRM_PLANE_INDEX_MAX_PLANES], unused_planes[DRM_PLANE_INDEX_MAX_PLANES];
+        int i, n_unused_planes;
+
+        for (i = 0; i < builder->n_layers; i++) {
+            used_planes[i] = builder->layers[i].plane - builder->drmdev->planes;
+        }
+
+        n_unused_planes = drm_plane_index_get_unused_planes(
+            &builder->drmdev->plane_index,
+            builder->crtc->index,
+            used_planes,
+            builder->n_layers,
+            unused_planes
+        );
+
+        for (i = 0; i < n_unused_planes; i++) {
+            struct drm_plane *plane = builder->drmdev->planes + unused_planes[i];
+
+            if (plane->committed_state.crtc_id == builder->crtc->id) {
+                plane->committed_state.crtc_id = 0;
+                plane->committed_state.fb_id = 0;
+            }
+        }
     }
 
     // update struct drm_crtc.committed_state
@@ -3116,7 +3622,7 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
             builder->drmdev->fd,
             (unsigned int) sequence,
             ns / 1000000000,
-            ns / 1000,
+            (ns % 1000000000) / 1000,
             builder->crtc->id,
             kms_req_ref(req)
         );
@@ -3129,7 +3635,8 @@ kms_req_commit_common(struct kms_req *req, bool blocking, kms_scanout_cb_t scano
         }
     }
 
-    drmdev_unlock(builder->drmdev);
+    // If this was a blocking commit, this will call the scanout callback.
+    drmdev_unlock_and_call_scanout_callbacks(builder->drmdev);
 
     return 0;
 
@@ -3147,7 +3654,7 @@ fail_maybe_destroy_mode_blob:
         drm_mode_blob_destroy(mode_blob);
 
 fail_unlock:
-    drmdev_unlock(builder->drmdev);
+    drmdev_unlock_and_call_scanout_callbacks(builder->drmdev);
 
     return ok;
 }
@@ -184,7 +184,7 @@ extern bool kms_debug_enabled;
     V("CRTC_Y", crtc_y)                                       \
     /* V("DEGAMMA_MODE", degamma_mode) */                     \
     /* V("EOTF", eotf) */                                     \
-    /* V("FB_DAMAGE_CLIPS", fb_damage_clips) */               \
+    V("FB_DAMAGE_CLIPS", fb_damage_clips)                     \
     V("FB_ID", fb_id)                                         \
     /* V("FEATURE", feature) */                               \
     /* V("GLOBAL_ALPHA", global_alpha) */                     \
@@ -523,6 +523,10 @@ struct drm_plane {
     /// Only valid if @ref has_blend_mode is true.
     bool supported_blend_modes[kCount_DrmBlendMode];
 
+    /// @brief Whether this plane has a FB_DAMAGE_CLIPS property, i.e. whether
+    /// we can tell the driver which parts of the framebuffer changed.
+    bool has_fb_damage_clips;
+
     struct {
         /// @brief The committed CRTC id.
         ///
@@ -727,12 +731,34 @@ int drmdev_resume(struct drmdev *drmdev);
 
 int drmdev_move_cursor(struct drmdev *drmdev, uint32_t crtc_id, struct vec2i pos);
 
+/**
+ * @brief Replaces the image of the cursor plane currently scanned out on @a crtc_id, and moves it to @a pos,
+ * without touching any of the other planes.
+ *
+ * This uses the legacy cursor ioctls, which the kernel applies as an atomic update of just the cursor plane
+ * that doesn't wait for vblank. A cursor-only atomic commit from userspace would fail with EBUSY while a
+ * page flip is pending, and could make the next frame commit fail the same way.
+ *
+ * @param gem_handle The GEM handle of the new cursor image, or 0 to disable the cursor plane.
+ * @param fb_id The framebuffer of the same buffer, only used to track the committed plane state.
+ * @param size The size of the cursor image.
+ * @param pos The position of the top-left corner of the cursor image on the CRTC.
+ *
+ * @returns Zero on success, ENOENT if there's no cursor plane scanned out on @a crtc_id right now,
+ * or another errno code if the update failed. In both cases, the cursor needs to be updated using a full commit.
+ */
+int drmdev_set_cursor(struct drmdev *drmdev, uint32_t crtc_id, uint32_t gem_handle, uint32_t fb_id, struct vec2i size, struct vec2i pos);
+
 static inline double mode_get_vrefresh(const drmModeModeInfo *mode) {
     return mode->clock * 1000.0 / (mode->htotal * mode->vtotal);
 }
 
 typedef void (*kms_scanout_cb_t)(struct drmdev *drmdev, uint64_t vblank_ns, void *userdata);
 
+/// The maximum number of damage clips per layer. If a layer has more,
+/// they're merged into their bounding box.
+#define KMS_MAX_DAMAGE_CLIPS 8
+
 struct kms_fb_layer {
     uint32_t drm_fb_id;
     enum pixfmt format;
@@ -749,6 +775,22 @@ struct kms_fb_layer {
     int in_fence_fd;
 
     bool prefer_cursor;
+
+    /**
+     * @brief The regions of the framebuffer that changed since the contents last
+     * presented on this plane, in framebuffer pixel coordinates.
+     *
+     * If @ref has_damage is false, the whole framebuffer is considered damaged.
+     * If it's true and @ref n_damage_clips is zero, nothing changed.
+     *
+     * Sent to the kernel as the FB_DAMAGE_CLIPS plane property, if supported.
+     * Drivers for displays that need to upload the framebuffer (SPI, USB, virtual GPUs)
+     * can use this to only upload the changed parts. The clips are copied by
+     * @ref kms_req_builder_push_fb_layer.
+     */
+    bool has_damage;
+    size_t n_damage_clips;
+    const struct drm_mode_rect *damage_clips;
 };
 
 typedef void (*kms_fb_release_cb_t)(void *userdata);
@@ -929,6 +971,13 @@ struct kms_req *kms_req_builder_build(struct kms_req_builder *builder);
 
 int kms_req_commit_blocking(struct kms_req *req, uint64_t *vblank_ns_out);
 
+/**
+ * @brief Commits the KMS request without waiting for the pageflip.
+ *
+ * @a scanout_cb is called with the vblank timestamp when the pageflip has happened.
+ * The drmdev is not locked at that point, so the callback can commit the next
+ * request for the same CRTC.
+ */
 int kms_req_commit_nonblocking(struct kms_req *req, kms_scanout_cb_t scanout_cb, void *userdata, void_callback_t destroy_cb);
 
 struct drm_connector *__next_connector(const struct drmdev *drmdev, const struct drm_connector *connector);
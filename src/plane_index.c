@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Plane index - precomputed plane capabilities for fast plane allocation.
+ */
+
+#include "plane_index.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+
+#define N_WORDS BITSET_WORDS(DRM_PLANE_INDEX_MAX_PLANES)
+
+struct modified_format_of_plane {
+    enum pixfmt format;
+    uint64_t modifier;
+    int plane_index;
+};
+
+struct collect_modified_formats_context {
+    struct modified_format_of_plane *pairs;
+    size_t n_pairs, size;
+    int plane_index;
+    bool failed;
+};
+
+static bool collect_modified_format(UNUSED struct drm_plane *plane, UNUSED int index, enum pixfmt format, uint64_t modifier, void *userdata) {
+    struct collect_modified_formats_context *context = userdata;
+
+    if (context->n_pairs == context->size) {
+        size_t new_size = context->size ? context->size * 2 : 64;
+        struct modified_format_of_plane *new_pairs = realloc(context->pairs, new_size * sizeof *new_pairs);
+        if (new_pairs == NULL) {
+            context->failed = true;
+            return false;
+        }
+
+        context->pairs = new_pairs;
+        context->size = new_size;
+    }
+
+    context->pairs[context->n_pairs].format = format;
+    context->pairs[context->n_pairs].modifier = modifier;
+    context->pairs[context->n_pairs].plane_index = context->plane_index;
+    context->n_pairs++;
+    return true;
+}
+
+static int compare_modified_formats(uint64_t modifier_a, enum pixfmt format_a, uint64_t modifier_b, enum pixfmt format_b) {
+    if (modifier_a != modifier_b) {
+        return modifier_a < modifier_b ? -1 : 1;
+    } else if (format_a != format_b) {
+        return format_a < format_b ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+static int compare_modified_formats_of_planes(const void *a, const void *b) {
+    const struct modified_format_of_plane *pair_a = a, *pair_b = b;
+
+    return compare_modified_formats(pair_a->modifier, pair_a->format, pair_b->modifier, pair_b->format);
+}
+
+static int index_modified_formats(struct drm_plane_index *index, struct drm_plane *planes, size_t n_planes) {
+    struct collect_modified_formats_context context = {
+        .pairs = NULL,
+        .n_pairs = 0,
+        .size = 0,
+        .plane_index = 0,
+        .failed = false,
+    };
+    struct drm_plane_index_modified_format *entries;
+    size_t n_entries;
+
+    for (size_t i = 0; i < n_planes; i++) {
+        if (planes[i].supported_modified_formats_blob == NULL) {
+            continue;
+        }
+
+        context.plane_index = (int) i;
+        drm_plane_for_each_modified_format(planes + i, collect_modified_format, &context);
+        if (context.failed) {
+            free(context.pairs);
+            return ENOMEM;
+        }
+    }
+
+    index->n_modified_formats = 0;
+    index->modified_formats = NULL;
+    if (context.n_pairs == 0) {
+        return 0;
+    }
+
+    qsort(context.pairs, context.n_pairs, sizeof *context.pairs, compare_modified_formats_of_planes);
+
+    // Upper bound. Every distinct pair gets one entry with the bitset of planes supporting it.
+    entries = calloc(context.n_pairs, sizeof *entries);
+    if (entries == NULL) {
+        free(context.pairs);
+        return ENOMEM;
+    }
+
+    n_entries = 0;
+    for (size_t i = 0; i < context.n_pairs; i++) {
+        struct modified_format_of_plane *pair = context.pairs + i;
+
+        if (n_entries == 0 ||
+            compare_modified_formats(entries[n_entries - 1].modifier, entries[n_entries - 1].format, pair->modifier, pair->format) != 0) {
+            entries[n_entries].format = pair->format;
+            entries[n_entries].modifier = pair->modifier;
+            n_entries++;
+        }
+
+        BITSET_SET(entries[n_entries - 1].planes, pair->plane_index);
+    }
+
+    free(context.pairs);
+
+    index->n_modified_formats = n_entries;
+    index->modified_formats = entries;
+    return 0;
+}
+
+static bool plane_supports_rotation(const struct drm_plane *plane, uint32_t rotation) {
+    if (!plane->has_rotation) {
+        // Planes without a rotation property are implicitly not rotated.
+        return rotation == PLANE_TRANSFORM_ROTATE_0.u32;
+    } else if (plane->has_hardcoded_rotation) {
+        return rotation == plane->hardcoded_rotation.u32;
+    } else {
+        return (rotation & ~plane->supported_rotations.u32) == 0;
+    }
+}
+
+int drm_plane_index_init(struct drm_plane_index *index, struct drm_plane *planes, size_t n_planes) {
+    int ok;
+
+    ASSERT_NOT_NULL(index);
+
+    if (n_planes > DRM_PLANE_INDEX_MAX_PLANES) {
+        return EINVAL;
+    }
+
+    memset(index, 0, sizeof *index);
+    index->n_planes = n_planes;
+
+    for (int crtc = 0; crtc < DRM_PLANE_INDEX_MAX_CRTCS; crtc++) {
+        index->crtc_min_zpos[crtc] = INT64_MAX;
+    }
+
+    for (size_t i = 0; i < n_planes; i++) {
+        struct drm_plane *plane = planes + i;
+
+        index->plane_ids[i] = plane->id;
+
+        for (int crtc = 0; crtc < DRM_PLANE_INDEX_MAX_CRTCS; crtc++) {
+            if (plane->possible_crtcs & (1u << crtc)) {
+                BITSET_SET(index->crtc_planes[crtc], i);
+                if (plane->has_zpos && plane->min_zpos < index->crtc_min_zpos[crtc]) {
+                    index->crtc_min_zpos[crtc] = plane->min_zpos;
+                }
+            }
+        }
+
+        if (plane->type == kPrimary_DrmPlaneType) {
+            BITSET_SET(index->primary_planes, i);
+        } else if (plane->type == kOverlay_DrmPlaneType) {
+            BITSET_SET(index->overlay_planes, i);
+        } else if (plane->type == kCursor_DrmPlaneType) {
+            BITSET_SET(index->cursor_planes, i);
+        }
+
+        if (plane->has_zpos) {
+            BITSET_SET(index->zpos_planes, i);
+            index->min_zpos[i] = plane->min_zpos;
+            index->max_zpos[i] = plane->max_zpos;
+        }
+
+        for (int format = 0; format < PIXFMT_COUNT; format++) {
+            if (plane->supported_formats[format]) {
+                BITSET_SET(index->unmodified_format_planes[format], i);
+            }
+        }
+
+        for (uint32_t rotation = 0; rotation < DRM_PLANE_INDEX_N_ROTATIONS; rotation++) {
+            if (plane_supports_rotation(plane, rotation)) {
+                BITSET_SET(index->rotation_planes[rotation], i);
+            }
+        }
+    }
+
+    ok = index_modified_formats(index, planes, n_planes);
+    if (ok != 0) {
+        return ok;
+    }
+
+    return 0;
+}
+
+void drm_plane_index_fini(struct drm_plane_index *index) {
+    free(index->modified_formats);
+    index->modified_formats = NULL;
+    index->n_modified_formats = 0;
+}
+
+static const struct drm_plane_index_modified_format *
+find_modified_format(const struct drm_plane_index *index, enum pixfmt format, uint64_t modifier) {
+    size_t lo, hi;
+
+    lo = 0;
+    hi = index->n_modified_formats;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct drm_plane_index_modified_format *entry = index->modified_formats + mid;
+
+        int cmp = compare_modified_formats(entry->modifier, entry->format, modifier, format);
+        if (cmp == 0) {
+            return entry;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+int drm_plane_index_find(
+    // clang-format off
+    const struct drm_plane_index *index,
+    const BITSET_WORD *available_planes,
+    bool allow_primary,
+    bool allow_overlay,
+    bool allow_cursor,
+    enum pixfmt format,
+    bool has_modifier, uint64_t modifier,
+    bool has_zpos, int64_t zpos_lower_limit, int64_t zpos_upper_limit,
+    bool has_rotation, drm_plane_transform_t rotation,
+    bool has_id_range, uint32_t id_lower_limit
+    // clang-format on
+) {
+    const BITSET_WORD *format_planes, *rotation_planes;
+    BITSET_WORD candidates;
+
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(available_planes);
+    ASSERT_PIXFMT_VALID(format);
+
+    if (has_modifier) {
+        const struct drm_plane_index_modified_format *entry = find_modified_format(index, format, modifier);
+        if (entry == NULL) {
+            return -1;
+        }
+
+        format_planes = entry->planes;
+    } else {
+        format_planes = index->unmodified_format_planes[format];
+    }
+
+    if (has_rotation) {
+        // No plane supports bits outside of the ROTATE_* and REFLECT_* ones.
+        if (rotation.u32 >= DRM_PLANE_INDEX_N_ROTATIONS) {
+            return -1;
+        }
+
+        rotation_planes = index->rotation_planes[rotation.u32];
+    } else {
+        rotation_planes = NULL;
+    }
+
+    for (int word = 0; word < N_WORDS; word++) {
+        candidates = 0;
+        if (allow_primary) {
+            candidates |= index->primary_planes[word];
+        }
+        if (allow_overlay) {
+            candidates |= index->overlay_planes[word];
+        }
+        if (allow_cursor) {
+            candidates |= index->cursor_planes[word];
+        }
+
+        candidates &= available_planes[word] & format_planes[word];
+
+        if (rotation_planes != NULL) {
+            candidates &= rotation_planes[word];
+        }
+
+        if (has_zpos) {
+            candidates &= index->zpos_planes[word];
+        }
+
+        // zpos ranges and plane ids are compared one plane at a time, but only
+        // for the planes that passed all the other checks.
+        while (candidates != 0) {
+            int bit = ffs(candidates) - 1;
+            int i = word * BITSET_WORDBITS + bit;
+
+            candidates &= candidates - 1;
+
+            if (has_zpos && (zpos_lower_limit > index->max_zpos[i] || zpos_upper_limit < index->min_zpos[i])) {
+                continue;
+            }
+
+            if (has_id_range && index->plane_ids[i] < id_lower_limit) {
+                continue;
+            }
+
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int drm_plane_index_get_unused_planes(
+    const struct drm_plane_index *index,
+    int crtc_index,
+    const int *used_planes,
+    int n_used_planes,
+    int *unused_planes_out
+) {
+    BITSET_DECLARE(unused_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    int i, n_unused;
+
+    ASSERT_NOT_NULL(index);
+    ASSERT_NOT_NULL(unused_planes_out);
+    assert(crtc_index >= 0 && crtc_index < DRM_PLANE_INDEX_MAX_CRTCS);
+    assert(n_used_planes == 0 || used_planes != NULL);
+
+    BITSET_COPY(unused_planes, index->crtc_planes[crtc_index]);
+    for (i = 0; i < n_used_planes; i++) {
+        BITSET_CLEAR(unused_planes, used_planes[i]);
+    }
+
+    n_unused = 0;
+    BITSET_FOREACH_SET(i, unused_planes, DRM_PLANE_INDEX_MAX_PLANES) {
+        unused_planes_out[n_unused++] = i;
+    }
+
+    return n_unused;
+}
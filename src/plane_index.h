@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Plane index - precomputed plane capabilities for fast plane allocation.
+ *
+ * Instead of checking every plane against the wanted pixel format, modifier,
+ * zpos and rotation on every frame (and walking the IN_FORMATS blob of each
+ * plane to do so), the capabilities of all planes are indexed once, when the
+ * planes are fetched. Finding a plane is then a few bitset ANDs.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_PLANE_INDEX_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_PLANE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "modesetting.h"
+#include "pixel_format.h"
+#include "util/bitset.h"
+
+#define DRM_PLANE_INDEX_MAX_PLANES 128
+#define DRM_PLANE_INDEX_MAX_CRTCS 32
+
+/// Number of distinct rotation values (combinations of the ROTATE_* and REFLECT_* bits).
+#define DRM_PLANE_INDEX_N_ROTATIONS 64
+
+struct drm_plane_index_modified_format {
+    enum pixfmt format;
+    uint64_t modifier;
+    BITSET_DECLARE(planes, DRM_PLANE_INDEX_MAX_PLANES);
+};
+
+/**
+ * @brief Bitsets of plane indices (indices into the plane array the index was built from)
+ * for every capability a plane can be queried for.
+ */
+struct drm_plane_index {
+    size_t n_planes;
+
+    /// The DRM ids and zpos ranges of the planes, for the constraints that aren't bitsets.
+    uint32_t plane_ids[DRM_PLANE_INDEX_MAX_PLANES];
+    int64_t min_zpos[DRM_PLANE_INDEX_MAX_PLANES];
+    int64_t max_zpos[DRM_PLANE_INDEX_MAX_PLANES];
+
+    /// The planes that can be scanned out on the CRTC with that index.
+    BITSET_DECLARE(crtc_planes[DRM_PLANE_INDEX_MAX_CRTCS], DRM_PLANE_INDEX_MAX_PLANES);
+
+    /// The minimum zpos of all planes of that CRTC, or INT64_MAX if none of them has a zpos.
+    int64_t crtc_min_zpos[DRM_PLANE_INDEX_MAX_CRTCS];
+
+    BITSET_DECLARE(primary_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    BITSET_DECLARE(overlay_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    BITSET_DECLARE(cursor_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    BITSET_DECLARE(zpos_planes, DRM_PLANE_INDEX_MAX_PLANES);
+
+    /// The planes supporting a pixel format without an explicit modifier.
+    BITSET_DECLARE(unmodified_format_planes[PIXFMT_COUNT], DRM_PLANE_INDEX_MAX_PLANES);
+
+    /// The planes that can be set to a rotation value (the u32 of a drm_plane_transform_t).
+    BITSET_DECLARE(rotation_planes[DRM_PLANE_INDEX_N_ROTATIONS], DRM_PLANE_INDEX_MAX_PLANES);
+
+    /// All pixel format & modifier pairs supported by any plane, sorted by modifier, then format.
+    size_t n_modified_formats;
+    struct drm_plane_index_modified_format *modified_formats;
+};
+
+/**
+ * @brief Builds the index for @a planes.
+ *
+ * The planes are only read while building the index, but @ref drm_plane_for_each_modified_format
+ * takes a non-const plane.
+ *
+ * @returns 0 on success, EINVAL if there are more than @ref DRM_PLANE_INDEX_MAX_PLANES planes,
+ *          ENOMEM if allocating failed.
+ */
+int drm_plane_index_init(struct drm_plane_index *index, struct drm_plane *planes, size_t n_planes);
+
+void drm_plane_index_fini(struct drm_plane_index *index);
+
+/**
+ * @brief Finds the first plane in @a available_planes that satisfies all the given constraints.
+ *
+ * The constraints have the same meaning as the ones accepted by the (linear) plane
+ * allocation in modesetting.c, and the plane that's found is the same one.
+ *
+ * @returns The index of the plane, or -1 if no plane satisfies the constraints.
+ */
+int drm_plane_index_find(
+    // clang-format off
+    const struct drm_plane_index *index,
+    const BITSET_WORD *available_planes,
+    bool allow_primary,
+    bool allow_overlay,
+    bool allow_cursor,
+    enum pixfmt format,
+    bool has_modifier, uint64_t modifier,
+    bool has_zpos, int64_t zpos_lower_limit, int64_t zpos_upper_limit,
+    bool has_rotation, drm_plane_transform_t rotation,
+    bool has_id_range, uint32_t id_lower_limit
+    // clang-format on
+);
+
+/**
+ * @brief Finds the planes of the CRTC with index @a crtc_index that are not one of the @a n_used_planes
+ * planes in @a used_planes, i.e. the planes that need to be disabled when only the used planes should
+ * be scanned out on that CRTC.
+ *
+ * @a unused_planes_out must have room for @ref DRM_PLANE_INDEX_MAX_PLANES plane indices.
+ *
+ * @returns The number of unused planes written to @a unused_planes_out, in ascending order.
+ */
+int drm_plane_index_get_unused_planes(
+    const struct drm_plane_index *index,
+    int crtc_index,
+    const int *used_planes,
+    int n_used_planes,
+    int *unused_planes_out
+);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_PLANE_INDEX_H
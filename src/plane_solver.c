@@ -0,0 +1,461 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Plane solver - finds a plane assignment for a set of layers that the driver
+ * actually accepts.
+ */
+
+#include "plane_solver.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/logging.h"
+#include "util/macros.h"
+
+/**
+ * @brief The part of a @ref plane_solver_layer assignments are cached by.
+ *
+ * Leaves out the sizes, so layers that are only resized don't miss the cache.
+ */
+struct layer_key {
+    enum pixfmt format;
+    bool has_modifier;
+    uint64_t modifier;
+    bool has_rotation;
+    uint64_t rotation;
+    bool scaled;
+    bool prefer_cursor;
+    int n_zpos_placeholders;
+};
+
+struct cache_entry {
+    bool valid;
+
+    /// False if no tested assignment was accepted for this topology.
+    bool solvable;
+
+    uint64_t hash;
+    uint64_t last_used;
+
+    int crtc_index;
+    int64_t min_zpos;
+    int n_layers;
+    struct layer_key keys[PLANE_SOLVER_MAX_LAYERS];
+
+    struct plane_assignment assignment;
+};
+
+struct plane_solver {
+    struct drm_plane *planes;
+    const struct drm_plane_index *index;
+
+    uint64_t tick;
+    struct cache_entry cache[PLANE_SOLVER_CACHE_SIZE];
+
+    struct plane_solver_stats stats;
+};
+
+struct search {
+    struct plane_solver *solver;
+    int crtc_index;
+    const struct plane_solver_layer *layers;
+    int n_layers;
+    const struct plane_assignment *initial;
+    plane_solver_test_cb_t test;
+    void *userdata;
+
+    int n_tests;
+    BITSET_DECLARE(used_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    struct plane_assignment current;
+};
+
+struct plane_solver *plane_solver_new(struct drm_plane *planes, const struct drm_plane_index *index) {
+    struct plane_solver *solver;
+
+    ASSERT_NOT_NULL(index);
+
+    solver = calloc(1, sizeof *solver);
+    if (solver == NULL) {
+        return NULL;
+    }
+
+    solver->planes = planes;
+    solver->index = index;
+    solver->tick = 0;
+    return solver;
+}
+
+void plane_solver_destroy(struct plane_solver *solver) {
+    free(solver);
+}
+
+static bool is_rejection(int error) {
+    // EINVAL is what most drivers return for configurations they can't scan out,
+    // some return ERANGE for unsupported scaling factors or ENOSPC for bandwidth limits.
+    return error == EINVAL || error == ERANGE || error == ENOSPC;
+}
+
+static bool is_scaled(const struct plane_solver_layer *layer) {
+    return layer->src_w != ((int64_t) layer->dst_w << 16) || layer->src_h != ((int64_t) layer->dst_h << 16);
+}
+
+static void get_layer_keys(const struct plane_solver_layer *layers, int n_layers, struct layer_key *keys_out) {
+    // Copy field by field into zeroed memory, so the keys can be memcmp'd and hashed including padding.
+    memset(keys_out, 0, n_layers * sizeof *keys_out);
+
+    for (int i = 0; i < n_layers; i++) {
+        keys_out[i].format = layers[i].format;
+        keys_out[i].has_modifier = layers[i].has_modifier;
+        keys_out[i].modifier = layers[i].has_modifier ? layers[i].modifier : 0;
+        keys_out[i].has_rotation = layers[i].has_rotation;
+        keys_out[i].rotation = layers[i].has_rotation ? layers[i].rotation.u64 : 0;
+        keys_out[i].scaled = is_scaled(layers + i);
+        keys_out[i].prefer_cursor = layers[i].prefer_cursor;
+        keys_out[i].n_zpos_placeholders = layers[i].n_zpos_placeholders;
+    }
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    // FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static uint64_t hash_keys(int crtc_index, int64_t min_zpos, const struct layer_key *keys, int n_layers) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    hash = hash_bytes(hash, &crtc_index, sizeof crtc_index);
+    hash = hash_bytes(hash, &min_zpos, sizeof min_zpos);
+    hash = hash_bytes(hash, &n_layers, sizeof n_layers);
+    hash = hash_bytes(hash, keys, n_layers * sizeof *keys);
+    return hash;
+}
+
+static struct cache_entry *lookup(
+    struct plane_solver *solver,
+    uint64_t hash,
+    int crtc_index,
+    int64_t min_zpos,
+    const struct layer_key *keys,
+    int n_layers
+) {
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE; i++) {
+        struct cache_entry *entry = solver->cache + i;
+
+        if (entry->valid && entry->hash == hash && entry->crtc_index == crtc_index && entry->min_zpos == min_zpos &&
+            entry->n_layers == n_layers && memcmp(entry->keys, keys, n_layers * sizeof *keys) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void store(
+    struct plane_solver *solver,
+    uint64_t hash,
+    int crtc_index,
+    int64_t min_zpos,
+    const struct layer_key *keys,
+    int n_layers,
+    bool solvable,
+    const struct plane_assignment *assignment
+) {
+    struct cache_entry *entry;
+
+    // Use an empty entry, or evict the least recently used one.
+    entry = solver->cache;
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE; i++) {
+        if (!solver->cache[i].valid) {
+            entry = solver->cache + i;
+            break;
+        } else if (solver->cache[i].last_used < entry->last_used) {
+            entry = solver->cache + i;
+        }
+    }
+
+    entry->valid = true;
+    entry->solvable = solvable;
+    entry->hash = hash;
+    entry->last_used = ++solver->tick;
+    entry->crtc_index = crtc_index;
+    entry->min_zpos = min_zpos;
+    entry->n_layers = n_layers;
+    memcpy(entry->keys, keys, n_layers * sizeof *keys);
+    entry->assignment = *assignment;
+}
+
+static bool assignments_equal(const struct plane_assignment *a, const struct plane_assignment *b) {
+    if (a->n_layers != b->n_layers) {
+        return false;
+    }
+
+    for (int i = 0; i < a->n_layers; i++) {
+        if (a->plane_indices[i] != b->plane_indices[i] || a->has_zpos[i] != b->has_zpos[i]) {
+            return false;
+        }
+        if (a->has_zpos[i] && a->zpos[i] != b->zpos[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int run_test(struct search *search, const struct plane_assignment *assignment) {
+    int ok;
+
+    search->n_tests++;
+    search->solver->stats.n_tests++;
+
+    ok = search->test(assignment, search->userdata);
+    if (is_rejection(ok)) {
+        search->solver->stats.n_rejected_tests++;
+    }
+
+    return ok;
+}
+
+static int search_layer(struct search *search, int layer_index, int64_t next_zpos, uint32_t prev_plane_id) {
+    const struct drm_plane_index *index = search->solver->index;
+    const struct plane_solver_layer *layer;
+    BITSET_DECLARE(tried_planes, DRM_PLANE_INDEX_MAX_PLANES);
+    struct {
+        bool allow_primary, allow_overlay, allow_cursor;
+        enum pixfmt format;
+    } passes[3];
+    int n_passes, ok;
+
+    if (search->n_tests >= PLANE_SOLVER_MAX_TESTS) {
+        return EINVAL;
+    }
+
+    if (layer_index == search->n_layers) {
+        // The initial assignment was tested already.
+        if (search->initial != NULL && assignments_equal(&search->current, search->initial)) {
+            return EINVAL;
+        }
+
+        return run_test(search, &search->current);
+    }
+
+    layer = search->layers + layer_index;
+    next_zpos += layer->n_zpos_placeholders;
+
+    // Same order of preference as kms_req_builder_push_fb_layer.
+    n_passes = 0;
+    if (layer->prefer_cursor) {
+        passes[n_passes++] = (typeof(passes[0])){ false, false, true, layer->format };
+    }
+    if (layer_index == 0) {
+        passes[n_passes++] = (typeof(passes[0])){ true, false, false, layer->format };
+        if (!get_pixfmt_info(layer->format)->is_opaque) {
+            passes[n_passes++] = (typeof(passes[0])){ true, false, false, pixfmt_opaque(layer->format) };
+        }
+    } else {
+        passes[n_passes++] = (typeof(passes[0])){ false, true, false, layer->format };
+    }
+
+    BITSET_ZERO(tried_planes);
+    for (int pass = 0; pass < n_passes; pass++) {
+        BITSET_DECLARE(candidates, DRM_PLANE_INDEX_MAX_PLANES);
+
+        for (int word = 0; word < ARRAY_SIZE(candidates); word++) {
+            candidates[word] = index->crtc_planes[search->crtc_index][word] & ~search->used_planes[word] & ~tried_planes[word];
+        }
+
+        while (true) {
+            struct drm_plane *plane;
+            int64_t zpos;
+            int plane_index;
+
+            plane_index = drm_plane_index_find(
+                // clang-format off
+                index,
+                candidates,
+                passes[pass].allow_primary,
+                passes[pass].allow_overlay,
+                passes[pass].allow_cursor,
+                passes[pass].format,
+                layer->has_modifier, layer->modifier,
+                false, 0, 0,
+                layer->has_rotation, layer->rotation,
+                false, 0
+                // clang-format on
+            );
+            if (plane_index < 0) {
+                break;
+            }
+
+            BITSET_CLEAR(candidates, plane_index);
+            BITSET_SET(tried_planes, plane_index);
+
+            plane = search->solver->planes + plane_index;
+
+            zpos = plane->has_zpos ? MAX2(next_zpos, plane->min_zpos) : 0;
+
+            // Overlay planes need to be above the previous layer, either by zpos or, if that's not possible,
+            // by plane id.
+            if (passes[pass].allow_overlay) {
+                bool above_by_zpos = plane->has_zpos && zpos <= plane->max_zpos;
+                bool above_by_id = plane->id > prev_plane_id;
+
+                if (!above_by_zpos && !above_by_id) {
+                    continue;
+                }
+            }
+
+            search->current.plane_indices[layer_index] = plane_index;
+            search->current.has_zpos[layer_index] = plane->has_zpos;
+            search->current.zpos[layer_index] = zpos;
+
+            BITSET_SET(search->used_planes, plane_index);
+            ok = search_layer(search, layer_index + 1, plane->has_zpos ? zpos + 1 : next_zpos, plane->id);
+            BITSET_CLEAR(search->used_planes, plane_index);
+
+            if (!is_rejection(ok)) {
+                // Either found an accepted assignment, or testing failed.
+                return ok;
+            }
+        }
+    }
+
+    return EINVAL;
+}
+
+int plane_solver_solve(
+    struct plane_solver *solver,
+    int crtc_index,
+    int64_t min_zpos,
+    const struct plane_solver_layer *layers,
+    int n_layers,
+    const struct plane_assignment *initial,
+    plane_solver_test_cb_t test,
+    void *userdata,
+    struct plane_assignment *assignment_out
+) {
+    struct layer_key keys[PLANE_SOLVER_MAX_LAYERS];
+    struct cache_entry *entry;
+    struct search search;
+    uint64_t hash;
+    int ok;
+
+    ASSERT_NOT_NULL(solver);
+    ASSERT_NOT_NULL(layers);
+    ASSERT_NOT_NULL(test);
+    ASSERT_NOT_NULL(assignment_out);
+    assert(crtc_index >= 0 && crtc_index < DRM_PLANE_INDEX_MAX_CRTCS);
+    assert(n_layers > 0 && n_layers <= PLANE_SOLVER_MAX_LAYERS);
+    assert(initial == NULL || initial->n_layers == n_layers);
+
+    solver->stats.n_solves++;
+
+    get_layer_keys(layers, n_layers, keys);
+    hash = hash_keys(crtc_index, min_zpos, keys, n_layers);
+
+    entry = lookup(solver, hash, crtc_index, min_zpos, keys, n_layers);
+    if (entry != NULL) {
+        solver->stats.n_cache_hits++;
+        entry->last_used = ++solver->tick;
+
+        if (!entry->solvable) {
+            *assignment_out = initial != NULL ? *initial : entry->assignment;
+            return EINVAL;
+        }
+
+        *assignment_out = entry->assignment;
+        return 0;
+    }
+
+    search.solver = solver;
+    search.crtc_index = crtc_index;
+    search.layers = layers;
+    search.n_layers = n_layers;
+    search.initial = initial;
+    search.test = test;
+    search.userdata = userdata;
+    search.n_tests = 0;
+    BITSET_ZERO(search.used_planes);
+    memset(&search.current, 0, sizeof search.current);
+    search.current.n_layers = n_layers;
+
+    if (initial != NULL) {
+        ok = run_test(&search, initial);
+        if (ok == 0) {
+            store(solver, hash, crtc_index, min_zpos, keys, n_layers, true, initial);
+            *assignment_out = *initial;
+            return 0;
+        } else if (!is_rejection(ok)) {
+            return ok;
+        }
+    }
+
+    ok = search_layer(&search, 0, min_zpos, 0);
+    if (ok == 0) {
+        LOG_DEBUG("Found a plane assignment the driver accepts after %d tests.\n", search.n_tests);
+        store(solver, hash, crtc_index, min_zpos, keys, n_layers, true, &search.current);
+        *assignment_out = search.current;
+        return 0;
+    } else if (!is_rejection(ok)) {
+        return ok;
+    }
+
+    LOG_DEBUG("Driver rejected all %d tested plane assignments.\n", search.n_tests);
+    solver->stats.n_unsolvable++;
+
+    if (initial != NULL) {
+        *assignment_out = *initial;
+    } else {
+        memset(assignment_out, 0, sizeof *assignment_out);
+    }
+
+    store(solver, hash, crtc_index, min_zpos, keys, n_layers, false, assignment_out);
+    return EINVAL;
+}
+
+void plane_solver_forget(struct plane_solver *solver, int crtc_index, const struct plane_solver_layer *layers, int n_layers) {
+    struct layer_key keys[PLANE_SOLVER_MAX_LAYERS];
+    struct cache_entry *entry;
+    uint64_t hash;
+
+    ASSERT_NOT_NULL(solver);
+    assert(n_layers > 0 && n_layers <= PLANE_SOLVER_MAX_LAYERS);
+
+    get_layer_keys(layers, n_layers, keys);
+
+    // min_zpos is part of the key too, but it's fixed per CRTC.
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE; i++) {
+        entry = solver->cache + i;
+
+        if (!entry->valid || entry->crtc_index != crtc_index) {
+            continue;
+        }
+
+        hash = hash_keys(crtc_index, entry->min_zpos, keys, n_layers);
+        if (lookup(solver, hash, crtc_index, entry->min_zpos, keys, n_layers) == entry) {
+            entry->valid = false;
+        }
+    }
+}
+
+void plane_solver_clear(struct plane_solver *solver) {
+    ASSERT_NOT_NULL(solver);
+
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE; i++) {
+        solver->cache[i].valid = false;
+    }
+}
+
+void plane_solver_get_stats(struct plane_solver *solver, struct plane_solver_stats *stats_out) {
+    ASSERT_NOT_NULL(solver);
+    ASSERT_NOT_NULL(stats_out);
+
+    *stats_out = solver->stats;
+}
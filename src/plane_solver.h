@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Plane solver - finds a plane assignment for a set of layers that the driver
+ * actually accepts.
+ *
+ * Plane allocation in modesetting.c is greedy and only knows about the static
+ * plane capabilities. Drivers can still reject the result (bandwidth or scaler
+ * limits, zpos restrictions, ...). The solver validates assignments using a
+ * test callback (a DRM_MODE_ATOMIC_TEST_ONLY commit), backtracks across
+ * alternative planes if the driver rejects one, and caches the result by the
+ * topology of the layers (formats, modifiers, rotation, scaled or not, zpos
+ * placeholders), so steady-state and animated frames don't need any extra ioctls.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_PLANE_SOLVER_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_PLANE_SOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "modesetting.h"
+#include "pixel_format.h"
+#include "plane_index.h"
+
+#define PLANE_SOLVER_MAX_LAYERS 32
+
+/// How many layer topologies (and their accepted assignments) are cached.
+#define PLANE_SOLVER_CACHE_SIZE 16
+
+/// How many assignments are tested at most for a single set of layers.
+#define PLANE_SOLVER_MAX_TESTS 32
+
+struct plane_solver;
+
+/**
+ * @brief Everything about a layer that affects which planes it can go on.
+ *
+ * Assignments are cached by the topology of the layers, i.e. everything in here except for the
+ * actual sizes. Of those, only whether the layer is scaled at all is part of the cache key, so
+ * animated layers (that change their size every frame) still reuse the cached assignment.
+ */
+struct plane_solver_layer {
+    enum pixfmt format;
+    bool has_modifier;
+    uint64_t modifier;
+
+    /// Source size in 16.16 fixed point, destination size in pixels. Same as in @ref kms_fb_layer.
+    int32_t src_w, src_h;
+    int32_t dst_w, dst_h;
+
+    bool has_rotation;
+    drm_plane_transform_t rotation;
+
+    bool prefer_cursor;
+
+    /// The number of zpos values reserved by placeholder layers right before this layer.
+    int n_zpos_placeholders;
+};
+
+struct plane_assignment {
+    int n_layers;
+
+    /// For every layer, the index of its plane in the plane array of the solver.
+    int plane_indices[PLANE_SOLVER_MAX_LAYERS];
+
+    bool has_zpos[PLANE_SOLVER_MAX_LAYERS];
+    int64_t zpos[PLANE_SOLVER_MAX_LAYERS];
+};
+
+/**
+ * @brief Tests whether the driver accepts @a assignment.
+ *
+ * @returns 0 if the driver accepts the assignment, EINVAL (or ERANGE, ENOSPC) if it doesn't,
+ *          any other error code if testing itself failed. In that case, solving is aborted.
+ */
+typedef int (*plane_solver_test_cb_t)(const struct plane_assignment *assignment, void *userdata);
+
+struct plane_solver_stats {
+    uint64_t n_solves;
+    uint64_t n_cache_hits;
+    uint64_t n_tests;
+    uint64_t n_rejected_tests;
+    uint64_t n_unsolvable;
+};
+
+/**
+ * @brief Creates a new solver for @a planes.
+ *
+ * Neither @a planes nor @a index are copied, they need to stay valid as long as the solver exists.
+ */
+struct plane_solver *plane_solver_new(struct drm_plane *planes, const struct drm_plane_index *index);
+
+void plane_solver_destroy(struct plane_solver *solver);
+
+/**
+ * @brief Finds an assignment of planes of the CRTC with index @a crtc_index to @a layers that's accepted
+ * by @a test.
+ *
+ * If the topology of @a layers was solved before, the cached assignment is returned without testing anything,
+ * even if the sizes of the layers changed since. If the driver rejects it for the new sizes after all,
+ * use @ref plane_solver_forget so it's solved again next frame.
+ * Otherwise @a initial (if non-NULL) is tested first, and if it's rejected, alternative planes are tried
+ * for every layer, in the same order of preference as the greedy plane allocation.
+ *
+ * @returns 0 if an accepted assignment was found, EINVAL if no tested assignment was accepted, or the error
+ *          returned by @a test. If no assignment was found, @a assignment_out is set to @a initial.
+ *          Unsolvable topologies are cached too, so they're not searched again every frame.
+ */
+int plane_solver_solve(
+    struct plane_solver *solver,
+    int crtc_index,
+    int64_t min_zpos,
+    const struct plane_solver_layer *layers,
+    int n_layers,
+    const struct plane_assignment *initial,
+    plane_solver_test_cb_t test,
+    void *userdata,
+    struct plane_assignment *assignment_out
+);
+
+/**
+ * @brief Removes the cached assignment for @a layers, for example because committing it failed.
+ */
+void plane_solver_forget(struct plane_solver *solver, int crtc_index, const struct plane_solver_layer *layers, int n_layers);
+
+/**
+ * @brief Removes all cached assignments, for example because the mode of a CRTC changed.
+ */
+void plane_solver_clear(struct plane_solver *solver);
+
+void plane_solver_get_stats(struct plane_solver *solver, struct plane_solver_stats *stats_out);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_PLANE_SOLVER_H
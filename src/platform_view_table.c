@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Platform view table - maps platform view ids to the surfaces displaying them.
+ */
+
+#include "platform_view_table.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "surface.h"
+#include "util/macros.h"
+
+#define NO_SLOT UINT32_MAX
+
+/// Generations are stored in the upper 32 bits of an id, but ids should stay positive.
+#define MAX_GENERATION INT32_MAX
+
+struct platform_view_slot {
+    /// NULL if the slot is free.
+    struct surface *surface;
+
+    uint32_t generation;
+
+    /// If the slot is free, the index of the next free slot.
+    uint32_t next_free;
+};
+
+struct platform_view_table {
+    pthread_mutex_t lock;
+
+    struct platform_view_slot *slots;
+    uint32_t n_slots, size;
+
+    uint32_t first_free;
+    size_t n_views;
+};
+
+static int64_t make_id(uint32_t index, uint32_t generation) {
+    return (int64_t) (((uint64_t) generation << 32) | ((uint64_t) index + 1));
+}
+
+/**
+ * @brief Returns the slot @a id refers to, or NULL if @a id is not valid (anymore).
+ */
+static struct platform_view_slot *get_slot_locked(struct platform_view_table *table, int64_t id) {
+    struct platform_view_slot *slot;
+    uint64_t index;
+
+    if (id <= 0 || (uint32_t) id == 0) {
+        return NULL;
+    }
+
+    index = (uint32_t) id - 1;
+    if (index >= table->n_slots) {
+        return NULL;
+    }
+
+    slot = table->slots + index;
+    if (slot->surface == NULL || slot->generation != (uint32_t) ((uint64_t) id >> 32)) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+struct platform_view_table *platform_view_table_new(void) {
+    struct platform_view_table *table;
+
+    table = malloc(sizeof *table);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&table->lock, NULL);
+    table->slots = NULL;
+    table->n_slots = 0;
+    table->size = 0;
+    table->first_free = NO_SLOT;
+    table->n_views = 0;
+    return table;
+}
+
+void platform_view_table_destroy(struct platform_view_table *table) {
+    ASSERT_NOT_NULL(table);
+
+    for (uint32_t i = 0; i < table->n_slots; i++) {
+        if (table->slots[i].surface != NULL) {
+            surface_unref(table->slots[i].surface);
+        }
+    }
+
+    free(table->slots);
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+int platform_view_table_add(struct platform_view_table *table, struct surface *surface, int64_t *id_out) {
+    struct platform_view_slot *slot;
+    uint32_t index;
+
+    ASSERT_NOT_NULL(table);
+    ASSERT_NOT_NULL(surface);
+    ASSERT_NOT_NULL(id_out);
+
+    pthread_mutex_lock(&table->lock);
+
+    if (table->first_free != NO_SLOT) {
+        index = table->first_free;
+        table->first_free = table->slots[index].next_free;
+    } else {
+        if (table->n_slots == table->size) {
+            struct platform_view_slot *new_slots;
+            uint32_t new_size;
+
+            if (table->size >= NO_SLOT / 2) {
+                pthread_mutex_unlock(&table->lock);
+                return ENOMEM;
+            }
+
+            new_size = table->size ? table->size * 2 : 16;
+            new_slots = realloc(table->slots, new_size * sizeof *new_slots);
+            if (new_slots == NULL) {
+                pthread_mutex_unlock(&table->lock);
+                return ENOMEM;
+            }
+
+            table->slots = new_slots;
+            table->size = new_size;
+        }
+
+        index = table->n_slots++;
+        table->slots[index].generation = 1;
+    }
+
+    slot = table->slots + index;
+    slot->surface = surface_ref(surface);
+    slot->next_free = NO_SLOT;
+    table->n_views++;
+
+    *id_out = make_id(index, slot->generation);
+
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
+
+int platform_view_table_set(struct platform_view_table *table, int64_t id, struct surface *surface) {
+    struct platform_view_slot *slot;
+    struct surface *old;
+
+    ASSERT_NOT_NULL(table);
+    ASSERT_NOT_NULL(surface);
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = get_slot_locked(table, id);
+    if (slot == NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return EINVAL;
+    }
+
+    old = slot->surface;
+    slot->surface = surface_ref(surface);
+
+    pthread_mutex_unlock(&table->lock);
+
+    // The last reference could be dropped here, don't destroy the surface with the lock held.
+    surface_unref(old);
+    return 0;
+}
+
+int platform_view_table_remove(struct platform_view_table *table, int64_t id) {
+    struct platform_view_slot *slot;
+    struct surface *old;
+
+    ASSERT_NOT_NULL(table);
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = get_slot_locked(table, id);
+    if (slot == NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return EINVAL;
+    }
+
+    old = slot->surface;
+    slot->surface = NULL;
+    slot->generation = slot->generation == MAX_GENERATION ? 1 : slot->generation + 1;
+    slot->next_free = table->first_free;
+    table->first_free = (uint32_t) (slot - table->slots);
+    table->n_views--;
+
+    pthread_mutex_unlock(&table->lock);
+
+    surface_unref(old);
+    return 0;
+}
+
+struct surface *platform_view_table_lookup(struct platform_view_table *table, int64_t id) {
+    struct platform_view_slot *slot;
+    struct surface *surface;
+
+    ASSERT_NOT_NULL(table);
+
+    pthread_mutex_lock(&table->lock);
+
+    slot = get_slot_locked(table, id);
+    surface = slot != NULL ? surface_ref(slot->surface) : NULL;
+
+    pthread_mutex_unlock(&table->lock);
+
+    return surface;
+}
+
+size_t platform_view_table_get_n_views(struct platform_view_table *table) {
+    size_t n_views;
+
+    ASSERT_NOT_NULL(table);
+
+    pthread_mutex_lock(&table->lock);
+    n_views = table->n_views;
+    pthread_mutex_unlock(&table->lock);
+
+    return n_views;
+}
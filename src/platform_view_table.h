@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Platform view table - maps platform view ids to the surfaces displaying them.
+ *
+ * Platform view ids are handles into a slot array. The lower 32 bits are the
+ * index of the slot plus one (so 0 is never a valid id) and the upper bits are
+ * the generation of the slot, which is bumped every time a view is removed.
+ * Looking up an id is O(1), and ids of removed views (or just garbage ids) are
+ * detected instead of being dereferenced.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_PLATFORM_VIEW_TABLE_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_PLATFORM_VIEW_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct surface;
+struct platform_view_table;
+
+struct platform_view_table *platform_view_table_new(void);
+
+/**
+ * @brief Destroys the table and drops the references to all surfaces that are still registered.
+ */
+void platform_view_table_destroy(struct platform_view_table *table);
+
+/**
+ * @brief Registers @a surface as a new platform view and returns its id in @a id_out.
+ *
+ * The table holds a reference on @a surface until the view is removed.
+ *
+ * @returns 0 on success, ENOMEM if the table couldn't be grown.
+ */
+int platform_view_table_add(struct platform_view_table *table, struct surface *surface, int64_t *id_out);
+
+/**
+ * @brief Makes the platform view with id @a id display @a surface instead.
+ *
+ * @returns 0 on success, EINVAL if @a id is not the id of a registered platform view.
+ */
+int platform_view_table_set(struct platform_view_table *table, int64_t id, struct surface *surface);
+
+/**
+ * @brief Removes the platform view with id @a id.
+ *
+ * @a id (and any other id that referred to the same slot) is invalid afterwards,
+ * even if the slot is reused for another view.
+ *
+ * @returns 0 on success, EINVAL if @a id is not the id of a registered platform view.
+ */
+int platform_view_table_remove(struct platform_view_table *table, int64_t id);
+
+/**
+ * @brief Returns a new reference to the surface of the platform view with id @a id,
+ * or NULL if there's no such platform view.
+ *
+ * Can be called from any thread.
+ */
+struct surface *platform_view_table_lookup(struct platform_view_table *table, int64_t id);
+
+size_t platform_view_table_get_n_views(struct platform_view_table *table);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_PLATFORM_VIEW_TABLE_H
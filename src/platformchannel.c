@@ -430,6 +430,62 @@ int platch_write_value_to_buffer_std(struct std_value *value, uint8_t **pbuffer)
 
     return 0;
 }
+static size_t calc_escaped_string_size_json(const char *str, size_t length) {
+    size_t size = 0;
+
+    // we need to count how many characters we need to escape.
+    for (size_t i = 0; i < length; i++) {
+        switch (str[i]) {
+            case '\b':
+            case '\f':
+            case '\n':
+            case '\r':
+            case '\t':
+            case '\"':
+            case '\\': size += 2; break;
+            default: size++; break;
+        }
+    }
+
+    return size;
+}
+
+static void write_escaped_string_json(const char *str, size_t length, uint8_t **pbuffer) {
+    for (size_t i = 0; i < length; i++) {
+        switch (str[i]) {
+            case '\b':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = 'b';
+                break;
+            case '\f':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = 'f';
+                break;
+            case '\n':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = 'n';
+                break;
+            case '\r':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = 'r';
+                break;
+            case '\t':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = 't';
+                break;
+            case '\"':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = '\"';
+                break;
+            case '\\':
+                *((*pbuffer)++) = '\\';
+                *((*pbuffer)++) = '\\';
+                break;
+            default: *((*pbuffer)++) = str[i]; break;
+        }
+    }
+}
+
 size_t platch_calc_value_size_json(struct json_value *value) {
     size_t size = 0;
 
@@ -438,24 +494,10 @@ size_t platch_calc_value_size_json(struct json_value *value) {
         case kJsonTrue: return 4;
         case kJsonFalse: return 5;
         case kJsonNumber:; char numBuffer[32]; return sprintf(numBuffer, "%g", value->number_value);
-        case kJsonString:
-            size = 2;
-
-            // we need to count how many characters we need to escape.
-            for (char *s = value->string_value; *s; s++) {
-                switch (*s) {
-                    case '\b':
-                    case '\f':
-                    case '\n':
-                    case '\r':
-                    case '\t':
-                    case '\"':
-                    case '\\': size += 2; break;
-                    default: size++; break;
-                }
-            }
-
-            return size;
+        case kJsonString: return 2 + calc_escaped_string_size_json(value->string_value, strlen(value->string_value));
+        case kJsonStringSegments:
+            return 2 + calc_escaped_string_size_json(value->string_segments[0].data, value->string_segments[0].length) +
+                   calc_escaped_string_size_json(value->string_segments[1].data, value->string_segments[1].length);
         case kJsonArray:
             size += 2;
             for (int i = 0; i < value->size; i++) {
@@ -485,43 +527,14 @@ int platch_write_value_to_buffer_json(struct json_value *value, uint8_t **pbuffe
         case kJsonNumber: *pbuffer += sprintf((char *) *pbuffer, "%g", value->number_value); break;
         case kJsonString:
             *((*pbuffer)++) = '\"';
-
-            for (char *s = value->string_value; *s; s++) {
-                switch (*s) {
-                    case '\b':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 'b';
-                        break;
-                    case '\f':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 'f';
-                        break;
-                    case '\n':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 'n';
-                        break;
-                    case '\r':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 'r';
-                        break;
-                    case '\t':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 't';
-                        break;
-                    case '\"':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = 't';
-                        break;
-                    case '\\':
-                        *((*pbuffer)++) = '\\';
-                        *((*pbuffer)++) = '\\';
-                        break;
-                    default: *((*pbuffer)++) = *s; break;
-                }
-            }
-
+            write_escaped_string_json(value->string_value, strlen(value->string_value), pbuffer);
+            *((*pbuffer)++) = '\"';
+            break;
+        case kJsonStringSegments:
+            *((*pbuffer)++) = '\"';
+            write_escaped_string_json(value->string_segments[0].data, value->string_segments[0].length, pbuffer);
+            write_escaped_string_json(value->string_segments[1].data, value->string_segments[1].length, pbuffer);
             *((*pbuffer)++) = '\"';
-
             break;
         case kJsonArray:
             *pbuffer += sprintf((char *) *pbuffer, "[");
@@ -1475,6 +1488,36 @@ int platch_send_error_event_json(char *channel, char *error_code, char *error_ms
     );
 }
 
+static bool json_string_segments_equal(const struct json_value *a, const struct json_value *b) {
+    size_t length, i_a, i_b;
+    int seg_a, seg_b;
+
+    length = a->string_segments[0].length + a->string_segments[1].length;
+    if (length != b->string_segments[0].length + b->string_segments[1].length) {
+        return false;
+    }
+
+    // The strings can be split at different places, so compare them byte by byte.
+    seg_a = seg_b = 0;
+    i_a = i_b = 0;
+    for (size_t i = 0; i < length; i++) {
+        while (i_a == a->string_segments[seg_a].length) {
+            seg_a++;
+            i_a = 0;
+        }
+        while (i_b == b->string_segments[seg_b].length) {
+            seg_b++;
+            i_b = 0;
+        }
+
+        if (a->string_segments[seg_a].data[i_a++] != b->string_segments[seg_b].data[i_b++]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool jsvalue_equals(struct json_value *a, struct json_value *b) {
     if (a == b)
         return true;
@@ -1489,6 +1532,7 @@ bool jsvalue_equals(struct json_value *a, struct json_value *b) {
         case kJsonFalse: return true;
         case kJsonNumber: return a->number_value == b->number_value;
         case kJsonString: return streq(a->string_value, b->string_value);
+        case kJsonStringSegments: return json_string_segments_equal(a, b);
         case kJsonArray:
             if (a->size != b->size)
                 return false;
@@ -1988,6 +2032,8 @@ memcmp_arrays:
         case kStdList:
             if (raw_std_value_get_size(a) != raw_std_value_get_size(b)) {
                 return false;
+            } else if (raw_std_value_get_size(a) == 0) {
+                return true;
             }
 
             const struct raw_std_value *cursor_a = raw_std_list_get_first_element(a);
@@ -2336,6 +2382,9 @@ check_arrays:
 
             // get the value size.
             size = raw_std_value_get_size(value);
+            if (size == 0) {
+                return true;
+            }
 
             for_each_element_in_raw_std_list(element, value) {
                 int diff = (intptr_t) element - (intptr_t) value;
@@ -2415,12 +2464,12 @@ ATTR_PURE bool raw_std_method_call_check(const struct raw_std_value *value, size
 
 ATTR_PURE bool raw_std_method_call_response_check(const struct raw_std_value *value, size_t buffer_size) {
     // method call responses have non-standard encoding for the first byte.
-    // first byte is zero for failure, non-zero for success.
+    // first byte is zero for success, non-zero for failure.
     if (buffer_size < 1) {
         return false;
     }
 
-    bool successful = (*(const uint8_t *) (value)) != 0;
+    bool successful = (*(const uint8_t *) (value)) == 0;
 
     value = (void *) ((intptr_t) value + (intptr_t) 1);
     buffer_size -= 1;
@@ -2448,7 +2497,7 @@ ATTR_PURE bool raw_std_method_call_response_check(const struct raw_std_value *va
             return false;
         }
 
-        const struct raw_std_value *third = raw_std_value_after(value);
+        const struct raw_std_value *third = raw_std_value_after(second);
         diff = (intptr_t) third - (intptr_t) value;
         assert(diff <= buffer_size);
 
@@ -38,12 +38,20 @@
  * need to be rewritten every time they do. The handlers not needing to be rewritten would probably be the only advantage
  * of using a unified message value type.
  */
-enum json_value_type { kJsonNull, kJsonTrue, kJsonFalse, kJsonNumber, kJsonString, kJsonArray, kJsonObject };
+enum json_value_type { kJsonNull, kJsonTrue, kJsonFalse, kJsonNumber, kJsonString, kJsonArray, kJsonObject, kJsonStringSegments };
 struct json_value {
     enum json_value_type type;
     union {
         double number_value;
         char *string_value;
+
+        /// A string made up of two parts that aren't null-terminated, for text that's stored that way
+        /// (like the text of a gap buffer). Only used for encoding, it's sent as a regular JSON string.
+        struct {
+            const char *data;
+            size_t length;
+        } string_segments[2];
+
         struct {
             size_t size;
             union {
@@ -722,6 +730,8 @@ struct std_value {
 #define JSONVALUE_IS_STRING(value) ((value).type == kJsonString)
 #define JSONVALUE_AS_STRING(value) ((value).string_value)
 #define JSONSTRING(str) ((struct json_value){ .type = kJsonString, .string_value = str })
+#define JSONSTRING_SEGMENTS(str1, length1, str2, length2) \
+    ((struct json_value){ .type = kJsonStringSegments, .string_segments = { { (str1), (length1) }, { (str2), (length2) } } })
 
 #define JSONVALUE_IS_ARRAY(value) ((value).type == kJsonArray)
 #define JSONVALUE_IS_SIZE(value, _size) ((value).size == (_size))
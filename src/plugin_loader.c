@@ -1,24 +1,96 @@
 // SPDX-License-Identifier: MIT
+/*
+ * GTK plugin loader
+ *
+ * Loads the GTK-style plugin libraries in the plugins directory of the app bundle
+ * and registers them with the shim.
+ *
+ * Loading ~25 plugin libraries serially (stat, dlopen with RTLD_NOW, dlsym, registration)
+ * adds up to hundreds of milliseconds of startup time on slow devices, so there's a few
+ * opt-in ways to make it cheaper, see @ref gtk_plugin_loader_options.
+ */
+
+#define _GNU_SOURCE
 #include "plugin_loader.h"
 
 #include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "flutter-drm-embedder.h"
+#include "platformchannel.h"
+#include "pluginregistry.h"
+#include "util/collection.h"
 #include "util/logging.h"
 
 #include <flutter_linux/flutter_linux.h>
 
+#include "flutter_linux_gtk_shim/fl_binary_messenger_internal.h"
 #include "flutter_linux_gtk_shim/fl_plugin_registrar_internal.h"
 
+#define MANIFEST_FILENAME "gtk_plugins.manifest"
+#define MANIFEST_HEADER "flutter-drm-embedder gtk plugin manifest 1"
+
+#define MAX_LOADER_THREADS 8
+
+typedef void (*register_func_t)(FlPluginRegistrar *registrar);
+
+struct gtk_plugin {
+    struct gtk_plugin_loader *loader;
+
+    char *filename;
+    char *path;
+    char *symbol;
+
+    /// Used to check whether a manifest entry is still up to date.
+    off_t size;
+    struct timespec mtime;
+
+    /// The channels the plugin registered the last time it was registered.
+    char **channels;
+    size_t n_channels;
+
+    void *handle;
+    register_func_t register_func;
+
+    /// Why the plugin couldn't be loaded. (dlerror() is only valid on the thread that called dlopen)
+    char *error;
+
+    bool deferred;
+    bool registered;
+
+    uint64_t open_ns;
+    uint64_t register_ns;
+};
+
 struct gtk_plugin_loader {
-    void **handles;
-    size_t handle_count;
-    size_t handle_capacity;
+    struct flutter_drm_embedder *flutter_drm_embedder;
+    struct gtk_plugin_loader_options options;
+
+    char *plugins_dir;
+    char *manifest_path;
+    struct timespec plugins_dir_mtime;
+
+    /// Sorted by file name. Never reallocated once loading starts,
+    /// since deferred plugins are referenced by the channel receivers.
+    struct gtk_plugin *plugins;
+    size_t n_plugins;
+
+    bool from_manifest;
+    bool manifest_dirty;
+
+    atomic_size_t next_plugin_to_open;
+
+    uint64_t scan_ns;
+    uint64_t open_ns;
+    uint64_t register_ns;
 };
 
 static bool has_so_suffix(const char *name) {
@@ -32,20 +104,6 @@ static bool has_so_suffix(const char *name) {
     return len > 3 && strcmp(name + len - 3, ".so") == 0;
 }
 
-static bool is_regular_file(const char *path) {
-    struct stat st;
-
-    if (path == NULL) {
-        return false;
-    }
-
-    if (stat(path, &st) != 0) {
-        return false;
-    }
-
-    return S_ISREG(st.st_mode);
-}
-
 static char *join_path(const char *dir, const char *name) {
     size_t dir_len;
     size_t name_len;
@@ -107,75 +165,120 @@ static char *build_symbol_name(const char *filename) {
     return symbol;
 }
 
-static char *get_plugins_dir(struct flutter_drm_embedder *flutter_drm_embedder) {
-    const char *bundle_path;
+static int dlopen_flags(struct gtk_plugin_loader *loader) {
+    return (loader->options.lazy_binding ? RTLD_LAZY : RTLD_NOW) | RTLD_GLOBAL;
+}
 
-    if (flutter_drm_embedder == NULL) {
+static double ns_to_ms(uint64_t ns) {
+    return ns / 1000000.0;
+}
+
+static struct gtk_plugin *add_plugin(struct gtk_plugin_loader *loader, const char *filename) {
+    struct gtk_plugin *plugins, *plugin;
+
+    plugins = realloc(loader->plugins, (loader->n_plugins + 1) * sizeof *plugins);
+    if (plugins == NULL) {
         return NULL;
     }
 
-    bundle_path = flutter_drm_embedder_get_bundle_path(flutter_drm_embedder);
-    if (bundle_path == NULL) {
+    loader->plugins = plugins;
+
+    plugin = plugins + loader->n_plugins;
+    memset(plugin, 0, sizeof *plugin);
+    plugin->loader = loader;
+    plugin->filename = strdup(filename);
+    plugin->path = join_path(loader->plugins_dir, filename);
+    if (plugin->filename == NULL || plugin->path == NULL) {
+        free(plugin->filename);
+        free(plugin->path);
         return NULL;
     }
 
-    return join_path(bundle_path, "plugins");
+    loader->n_plugins++;
+    return plugin;
 }
 
-static bool ensure_handle_capacity(struct gtk_plugin_loader *loader) {
-    size_t new_capacity;
-    void **new_handles;
+static void free_channels(char **channels, size_t n_channels) {
+    for (size_t i = 0; i < n_channels; i++) {
+        free(channels[i]);
+    }
+    free(channels);
+}
 
-    if (loader->handle_count < loader->handle_capacity) {
-        return true;
+static void plugin_fini(struct gtk_plugin *plugin) {
+    if (plugin->handle != NULL) {
+        dlclose(plugin->handle);
     }
+    free_channels(plugin->channels, plugin->n_channels);
+    free(plugin->error);
+    free(plugin->symbol);
+    free(plugin->path);
+    free(plugin->filename);
+}
 
-    new_capacity = loader->handle_capacity == 0 ? 4 : loader->handle_capacity * 2;
-    new_handles = realloc(loader->handles, new_capacity * sizeof(void *));
-    if (new_handles == NULL) {
-        return false;
+static void clear_plugins(struct gtk_plugin_loader *loader) {
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        plugin_fini(loader->plugins + i);
     }
 
-    loader->handles = new_handles;
-    loader->handle_capacity = new_capacity;
-    return true;
+    free(loader->plugins);
+    loader->plugins = NULL;
+    loader->n_plugins = 0;
 }
 
-struct gtk_plugin_loader *gtk_plugin_loader_load(struct flutter_drm_embedder *flutter_drm_embedder) {
-    struct gtk_plugin_loader *loader;
-    struct dirent *entry;
-    size_t found_count = 0;
-    DIR *dir;
-    char *plugins_dir;
+static int add_channel(struct gtk_plugin *plugin, const char *channel) {
+    char **channels;
 
-    if (flutter_drm_embedder == NULL) {
-        return NULL;
+    channels = realloc(plugin->channels, (plugin->n_channels + 1) * sizeof *channels);
+    if (channels == NULL) {
+        return ENOMEM;
     }
 
-    plugins_dir = get_plugins_dir(flutter_drm_embedder);
-    if (plugins_dir == NULL) {
-        return NULL;
+    plugin->channels = channels;
+
+    channels[plugin->n_channels] = strdup(channel);
+    if (channels[plugin->n_channels] == NULL) {
+        return ENOMEM;
     }
 
-    dir = opendir(plugins_dir);
-    if (dir == NULL) {
-        LOG_DEBUG("No plugins found in %s.\n", plugins_dir);
-        free(plugins_dir);
-        return NULL;
+    plugin->n_channels++;
+    return 0;
+}
+
+static int compare_plugins(const void *a, const void *b) {
+    return strcmp(((const struct gtk_plugin *) a)->filename, ((const struct gtk_plugin *) b)->filename);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static bool timespec_equal(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool plugin_file_unchanged(struct gtk_plugin *plugin) {
+    struct stat st;
+
+    if (stat(plugin->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
     }
 
-    loader = calloc(1, sizeof(*loader));
-    if (loader == NULL) {
-        closedir(dir);
-        free(plugins_dir);
-        return NULL;
+    return st.st_size == plugin->size && timespec_equal(st.st_mtim, plugin->mtime);
+}
+
+static int scan_plugins_dir(struct gtk_plugin_loader *loader) {
+    struct gtk_plugin *plugin;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir(loader->plugins_dir);
+    if (dir == NULL) {
+        return errno;
     }
 
     while ((entry = readdir(dir)) != NULL) {
-        char *path;
-        char *symbol;
-        void *handle;
-
         if (entry->d_name[0] == '.') {
             continue;
         }
@@ -184,101 +287,495 @@ struct gtk_plugin_loader *gtk_plugin_loader_load(struct flutter_drm_embedder *fl
             continue;
         }
 
-        path = join_path(plugins_dir, entry->d_name);
-        if (path == NULL) {
+        plugin = add_plugin(loader, entry->d_name);
+        if (plugin == NULL) {
             continue;
         }
 
-        if (!is_regular_file(path)) {
-            free(path);
+        plugin->symbol = build_symbol_name(entry->d_name);
+        if (plugin->symbol == NULL || stat(plugin->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            plugin_fini(plugin);
+            loader->n_plugins--;
             continue;
         }
 
-        found_count++;
+        plugin->size = st.st_size;
+        plugin->mtime = st.st_mtim;
+    }
 
-        symbol = build_symbol_name(entry->d_name);
-        if (symbol == NULL) {
-            free(path);
-            continue;
+    closedir(dir);
+
+    qsort(loader->plugins, loader->n_plugins, sizeof *loader->plugins, compare_plugins);
+    return 0;
+}
+
+/**
+ * @brief Fills the plugin list from the manifest, if it exists and is still up to date.
+ *
+ * The manifest is a text file:
+ *
+ *   flutter-drm-embedder gtk plugin manifest 1
+ *   dir <plugins dir mtime sec> <nsec>
+ *   plugin <size> <mtime sec> <nsec> <file name>
+ *   symbol <registration function name>
+ *   channel <channel name>
+ *   ...
+ */
+static int read_manifest(struct gtk_plugin_loader *loader) {
+    struct gtk_plugin *plugin;
+    long mtime_sec, mtime_nsec;
+    long long size;
+    size_t line_size;
+    ssize_t n_read;
+    FILE *file;
+    char *line;
+    bool valid;
+    int n_parsed;
+
+    file = fopen(loader->manifest_path, "r");
+    if (file == NULL) {
+        return errno;
+    }
+
+    line = NULL;
+    line_size = 0;
+    plugin = NULL;
+    valid = false;
+
+    n_read = getline(&line, &line_size, file);
+    if (n_read <= 0 || !streq(line, MANIFEST_HEADER "\n")) {
+        goto out;
+    }
+
+    n_read = getline(&line, &line_size, file);
+    if (n_read <= 0 || sscanf(line, "dir %ld %ld", &mtime_sec, &mtime_nsec) != 2 ||
+        mtime_sec != loader->plugins_dir_mtime.tv_sec || mtime_nsec != loader->plugins_dir_mtime.tv_nsec) {
+        // A plugin was added or removed.
+        goto out;
+    }
+
+    while ((n_read = getline(&line, &line_size, file)) > 0) {
+        if (line[n_read - 1] == '\n') {
+            line[n_read - 1] = '\0';
         }
 
-        LOG_DEBUG("[plugin_loader] trying to load plugin: %s (symbol: %s)\n", path, symbol);
+        if (sscanf(line, "plugin %lld %ld %ld %n", &size, &mtime_sec, &mtime_nsec, &n_parsed) == 3) {
+            plugin = add_plugin(loader, line + n_parsed);
+            if (plugin == NULL) {
+                goto out;
+            }
+
+            plugin->size = size;
+            plugin->mtime.tv_sec = mtime_sec;
+            plugin->mtime.tv_nsec = mtime_nsec;
+        } else if (plugin != NULL && strncmp(line, "symbol ", 7) == 0) {
+            free(plugin->symbol);
+            plugin->symbol = strdup(line + 7);
+        } else if (plugin != NULL && strncmp(line, "channel ", 8) == 0) {
+            if (add_channel(plugin, line + 8) != 0) {
+                goto out;
+            }
+        } else {
+            goto out;
+        }
+    }
 
-        handle = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
-        if (handle == NULL) {
-            LOG_ERROR("Failed to load plugin %s: %s\n", path, dlerror());
-            free(symbol);
-            free(path);
-            continue;
+    valid = true;
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        // A plugin library was replaced in-place.
+        if (loader->plugins[i].symbol == NULL || !plugin_file_unchanged(loader->plugins + i)) {
+            valid = false;
+            break;
         }
+    }
 
-        typedef void (*register_func_t)(FlPluginRegistrar *registrar);
-        register_func_t register_func = (register_func_t) dlsym(handle, symbol);
-        if (register_func == NULL) {
-            LOG_ERROR("Failed to find symbol %s in %s: %s\n", symbol, path, dlerror());
-            dlclose(handle);
-            free(symbol);
-            free(path);
-            continue;
+out:
+    free(line);
+    fclose(file);
+
+    if (!valid) {
+        clear_plugins(loader);
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+static void write_manifest(struct gtk_plugin_loader *loader) {
+    char *tmp_path;
+    FILE *file;
+    int ok;
+
+    ok = asprintf(&tmp_path, "%s.tmp", loader->manifest_path);
+    if (ok < 0) {
+        return;
+    }
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        LOG_DEBUG("Could not write plugin manifest \"%s\". fopen: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+
+    fprintf(file, MANIFEST_HEADER "\n");
+    fprintf(file, "dir %ld %ld\n", (long) loader->plugins_dir_mtime.tv_sec, (long) loader->plugins_dir_mtime.tv_nsec);
+
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        struct gtk_plugin *plugin = loader->plugins + i;
+
+        fprintf(
+            file,
+            "plugin %lld %ld %ld %s\nsymbol %s\n",
+            (long long) plugin->size,
+            (long) plugin->mtime.tv_sec,
+            (long) plugin->mtime.tv_nsec,
+            plugin->filename,
+            plugin->symbol
+        );
+
+        for (size_t j = 0; j < plugin->n_channels; j++) {
+            fprintf(file, "channel %s\n", plugin->channels[j]);
+        }
+    }
+
+    ok = ferror(file);
+    if (fclose(file) != 0 || ok != 0 || rename(tmp_path, loader->manifest_path) != 0) {
+        LOG_DEBUG("Could not write plugin manifest \"%s\".\n", loader->manifest_path);
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+}
+
+/**
+ * @brief dlopens the plugin library and looks up its registration function.
+ *
+ * Safe to call on any thread, as long as every plugin is only opened by one thread.
+ */
+static void open_plugin(struct gtk_plugin *plugin, int flags) {
+    const char *error;
+    uint64_t start;
+
+    start = get_monotonic_time();
+
+    plugin->handle = dlopen(plugin->path, flags);
+    if (plugin->handle == NULL) {
+        error = dlerror();
+        plugin->error = strdup(error != NULL ? error : "dlopen failed");
+        goto out;
+    }
+
+    plugin->register_func = (register_func_t) dlsym(plugin->handle, plugin->symbol);
+    if (plugin->register_func == NULL) {
+        error = dlerror();
+        plugin->error = strdup(error != NULL ? error : "registration function is NULL");
+        dlclose(plugin->handle);
+        plugin->handle = NULL;
+    }
+
+out:
+    plugin->open_ns = get_monotonic_time() - start;
+}
+
+static void *open_plugins_worker(void *userdata) {
+    struct gtk_plugin_loader *loader;
+    struct gtk_plugin *plugin;
+    size_t index;
+
+    loader = userdata;
+
+    while ((index = atomic_fetch_add(&loader->next_plugin_to_open, 1)) < loader->n_plugins) {
+        plugin = loader->plugins + index;
+        if (!plugin->deferred) {
+            open_plugin(plugin, dlopen_flags(loader));
         }
+    }
 
-        LOG_DEBUG("[plugin_loader] creating registrar for plugin %s\n", path);
-        FlPluginRegistrar *registrar = fl_plugin_registrar_new_for_flutter_drm_embedder(flutter_drm_embedder);
-        if (registrar == NULL) {
-            LOG_ERROR("Failed to create GTK registrar for %s.\n", path);
-            dlclose(handle);
-            free(symbol);
-            free(path);
-            continue;
+    return NULL;
+}
+
+static void open_plugins(struct gtk_plugin_loader *loader) {
+    pthread_t threads[MAX_LOADER_THREADS];
+    size_t n_threads, n_wanted;
+    long n_cpus;
+
+    atomic_store(&loader->next_plugin_to_open, 0);
+
+    n_threads = 0;
+    if (loader->options.parallel && loader->n_plugins > 1) {
+        // The calling thread opens plugins too.
+        n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_wanted = MIN2(MIN2(n_cpus > 1 ? (size_t) n_cpus - 1 : 1, MAX_LOADER_THREADS), loader->n_plugins - 1);
+
+        while (n_threads < n_wanted && pthread_create(threads + n_threads, NULL, open_plugins_worker, loader) == 0) {
+            n_threads++;
         }
+    }
 
-        LOG_DEBUG("[plugin_loader] calling %s(%p)\n", symbol, (void *)registrar);
-        register_func(registrar);
-        LOG_DEBUG("[plugin_loader] %s completed, unreffing registrar\n", symbol);
-        g_object_unref(registrar);
+    open_plugins_worker(loader);
 
-        if (!ensure_handle_capacity(loader)) {
-            LOG_ERROR("Failed to grow plugin handle list for %s.\n", path);
-            dlclose(handle);
-            free(symbol);
-            free(path);
-            continue;
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static bool channels_equal(char **a, size_t n_a, char **b, size_t n_b) {
+    if (n_a != n_b) {
+        return false;
+    }
+
+    for (size_t i = 0; i < n_a; i++) {
+        if (!streq(a[i], b[i])) {
+            return false;
         }
+    }
+
+    return true;
+}
+
+static void register_plugin(struct gtk_plugin *plugin) {
+    FlPluginRegistrar *registrar;
+    size_t n_channels;
+    uint64_t start;
+    char **channels;
 
-        loader->handles[loader->handle_count++] = handle;
-        free(symbol);
-        free(path);
+    LOG_DEBUG("[plugin_loader] creating registrar for plugin %s\n", plugin->path);
+    registrar = fl_plugin_registrar_new_for_flutter_drm_embedder(plugin->loader->flutter_drm_embedder);
+    if (registrar == NULL) {
+        plugin->error = strdup("could not create GTK registrar");
+        return;
     }
 
-    closedir(dir);
+    LOG_DEBUG("[plugin_loader] calling %s(%p)\n", plugin->symbol, (void *) registrar);
+
+    start = get_monotonic_time();
+    plugin->register_func(registrar);
+    plugin->register_ns = get_monotonic_time() - start;
+    plugin->registered = true;
+
+    // Remember which channels the plugin listens on, so it can be deferred next time.
+    channels = fl_binary_messenger_dup_channels(fl_plugin_registrar_get_messenger(registrar), &n_channels);
+    if (channels != NULL) {
+        qsort(channels, n_channels, sizeof *channels, compare_strings);
+
+        if (channels_equal(channels, n_channels, plugin->channels, plugin->n_channels)) {
+            free_channels(channels, n_channels);
+        } else {
+            free_channels(plugin->channels, plugin->n_channels);
+            plugin->channels = channels;
+            plugin->n_channels = n_channels;
+            plugin->loader->manifest_dirty = plugin->loader->manifest_path != NULL;
+        }
+    }
 
-    if (found_count == 0) {
-        LOG_DEBUG("No plugins found in %s.\n", plugins_dir);
-    } else {
-        LOG_DEBUG("Found %zu plugins in %s.\n", found_count, plugins_dir);
+    LOG_DEBUG("[plugin_loader] %s completed, unreffing registrar\n", plugin->symbol);
+    g_object_unref(registrar);
+}
+
+static void on_deferred_plugin_message(void *userdata, const FlutterPlatformMessage *message) {
+    struct gtk_plugin *plugin;
+
+    plugin = userdata;
+
+    // If the plugin was registered already but the message still ended up here, the plugin
+    // doesn't listen on this channel anymore.
+    if (plugin->registered || plugin->error != NULL) {
+        platch_respond_not_implemented((FlutterPlatformMessageResponseHandle *) message->response_handle);
+        return;
+    }
+
+    LOG_DEBUG("[plugin_loader] loading deferred plugin %s for message on %s\n", plugin->path, message->channel);
+
+    open_plugin(plugin, dlopen_flags(plugin->loader));
+    if (plugin->handle == NULL) {
+        LOG_ERROR("Failed to load plugin %s: %s\n", plugin->path, plugin->error);
+        platch_respond_not_implemented((FlutterPlatformMessageResponseHandle *) message->response_handle);
+        return;
+    }
+
+    register_plugin(plugin);
+
+    // The plugin might listen on other channels than the manifest says, e.g. after an update
+    // that didn't touch the library file. Fix the manifest, so the next start defers it correctly.
+    if (plugin->loader->manifest_dirty) {
+        write_manifest(plugin->loader);
+        plugin->loader->manifest_dirty = false;
+    }
+
+    // The plugin replaced our receivers with its own now, so dispatch the message again.
+    plugin_registry_on_platform_message(flutter_drm_embedder_get_plugin_registry(plugin->loader->flutter_drm_embedder), message);
+}
+
+static void defer_plugin(struct gtk_plugin *plugin) {
+    struct plugin_registry *registry;
+    int ok;
+
+    registry = flutter_drm_embedder_get_plugin_registry(plugin->loader->flutter_drm_embedder);
+
+    for (size_t i = 0; i < plugin->n_channels; i++) {
+        ok = plugin_registry_set_receiver_v2(registry, plugin->channels[i], on_deferred_plugin_message, plugin);
+        if (ok != 0) {
+            LOG_ERROR("Could not defer loading plugin %s. plugin_registry_set_receiver_v2: %s\n", plugin->path, strerror(ok));
+        }
+    }
+}
+
+struct gtk_plugin_loader *gtk_plugin_loader_load(struct flutter_drm_embedder *flutter_drm_embedder, const struct gtk_plugin_loader_options *options) {
+    struct gtk_plugin_loader *loader;
+    const char *bundle_path;
+    size_t n_loaded, n_deferred;
+    struct stat st;
+    uint64_t start;
+    int ok;
+
+    if (flutter_drm_embedder == NULL) {
+        return NULL;
     }
 
-    free(plugins_dir);
+    bundle_path = flutter_drm_embedder_get_bundle_path(flutter_drm_embedder);
+    if (bundle_path == NULL) {
+        return NULL;
+    }
 
-    if (loader->handle_count == 0) {
-        gtk_plugin_loader_destroy(loader);
+    loader = calloc(1, sizeof(*loader));
+    if (loader == NULL) {
         return NULL;
     }
 
+    loader->flutter_drm_embedder = flutter_drm_embedder;
+    if (options != NULL) {
+        loader->options = *options;
+    }
+    loader->options.defer_registration = loader->options.defer_registration && loader->options.use_manifest;
+
+    loader->plugins_dir = join_path(bundle_path, "plugins");
+    if (loader->plugins_dir == NULL) {
+        goto fail_destroy_loader;
+    }
+
+    if (stat(loader->plugins_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        LOG_DEBUG("No plugins found in %s.\n", loader->plugins_dir);
+        goto fail_destroy_loader;
+    }
+
+    loader->plugins_dir_mtime = st.st_mtim;
+
+    start = get_monotonic_time();
+
+    if (loader->options.use_manifest) {
+        // Not inside the plugins directory, so writing it doesn't change the directory mtime.
+        loader->manifest_path = join_path(bundle_path, MANIFEST_FILENAME);
+        loader->from_manifest = loader->manifest_path != NULL && read_manifest(loader) == 0;
+    }
+
+    if (!loader->from_manifest) {
+        ok = scan_plugins_dir(loader);
+        if (ok != 0) {
+            LOG_DEBUG("No plugins found in %s.\n", loader->plugins_dir);
+            goto fail_destroy_loader;
+        }
+
+        loader->manifest_dirty = loader->manifest_path != NULL;
+    }
+
+    loader->scan_ns = get_monotonic_time() - start;
+
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        loader->plugins[i].deferred = loader->options.defer_registration && loader->plugins[i].n_channels > 0;
+    }
+
+    start = get_monotonic_time();
+    open_plugins(loader);
+    loader->open_ns = get_monotonic_time() - start;
+
+    start = get_monotonic_time();
+
+    n_loaded = 0;
+    n_deferred = 0;
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        struct gtk_plugin *plugin = loader->plugins + i;
+
+        if (plugin->deferred) {
+            defer_plugin(plugin);
+            n_deferred++;
+        } else if (plugin->handle == NULL) {
+            LOG_ERROR("Failed to load plugin %s: %s\n", plugin->path, plugin->error);
+        } else {
+            register_plugin(plugin);
+            if (plugin->registered) {
+                n_loaded++;
+            }
+        }
+    }
+
+    loader->register_ns = get_monotonic_time() - start;
+
+    if (loader->manifest_dirty) {
+        write_manifest(loader);
+        loader->manifest_dirty = false;
+    }
+
+    if (loader->n_plugins == 0) {
+        LOG_DEBUG("No plugins found in %s.\n", loader->plugins_dir);
+    } else {
+        LOG_DEBUG("Found %zu plugins in %s.\n", loader->n_plugins, loader->plugins_dir);
+    }
+
+    if (n_loaded + n_deferred == 0) {
+        goto fail_destroy_loader;
+    }
+
     return loader;
+
+fail_destroy_loader:
+    gtk_plugin_loader_destroy(loader);
+    return NULL;
 }
 
-void gtk_plugin_loader_destroy(struct gtk_plugin_loader *loader) {
+void gtk_plugin_loader_print_timings(struct gtk_plugin_loader *loader, FILE *file) {
     if (loader == NULL) {
         return;
     }
 
-    for (size_t i = 0; i < loader->handle_count; i++) {
-        if (loader->handles[i] != NULL) {
-            dlclose(loader->handles[i]);
+    fprintf(
+        file,
+        "[plugin_loader] %zu plugins %s in %.1f ms (scan %.1f ms, open %.1f ms, register %.1f ms)\n",
+        loader->n_plugins,
+        loader->from_manifest ? "from manifest" : "scanned",
+        ns_to_ms(loader->scan_ns + loader->open_ns + loader->register_ns),
+        ns_to_ms(loader->scan_ns),
+        ns_to_ms(loader->open_ns),
+        ns_to_ms(loader->register_ns)
+    );
+
+    for (size_t i = 0; i < loader->n_plugins; i++) {
+        struct gtk_plugin *plugin = loader->plugins + i;
+
+        if (plugin->error != NULL) {
+            fprintf(file, "  %-40s failed: %s\n", plugin->filename, plugin->error);
+        } else if (plugin->deferred && !plugin->registered) {
+            fprintf(file, "  %-40s deferred until first message\n", plugin->filename);
+        } else {
+            fprintf(
+                file,
+                "  %-40s open %7.2f ms  register %7.2f ms%s\n",
+                plugin->filename,
+                ns_to_ms(plugin->open_ns),
+                ns_to_ms(plugin->register_ns),
+                plugin->deferred ? "  (deferred)" : ""
+            );
         }
     }
+}
+
+void gtk_plugin_loader_destroy(struct gtk_plugin_loader *loader) {
+    if (loader == NULL) {
+        return;
+    }
 
-    free(loader->handles);
+    clear_plugins(loader);
+    free(loader->manifest_path);
+    free(loader->plugins_dir);
     free(loader);
 }
@@ -2,6 +2,9 @@
 #ifndef _FLUTTER_DRM_EMBEDDER_SRC_PLUGIN_LOADER_H
 #define _FLUTTER_DRM_EMBEDDER_SRC_PLUGIN_LOADER_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,7 +12,35 @@ extern "C" {
 struct flutter_drm_embedder;
 struct gtk_plugin_loader;
 
-struct gtk_plugin_loader *gtk_plugin_loader_load(struct flutter_drm_embedder *flutter_drm_embedder);
+/**
+ * @brief How GTK plugins are loaded at startup. All false (the default) loads
+ * and registers every plugin serially, with all symbols bound immediately.
+ */
+struct gtk_plugin_loader_options {
+    /// dlopen the plugin libraries on a few worker threads. Registration still
+    /// happens on the calling thread, in the order of the plugin file names.
+    bool parallel;
+
+    /// Use RTLD_LAZY instead of RTLD_NOW, so symbols are only bound when they're first used.
+    /// A plugin with unresolvable symbols will then fail when it's used, not when it's loaded.
+    bool lazy_binding;
+
+    /// Cache the scanned plugin files, their registration symbols and the channels
+    /// they registered in a manifest file inside the app bundle.
+    bool use_manifest;
+
+    /// Don't load plugins whose channels are known from the manifest until the first
+    /// message is sent to one of their channels. Requires @ref use_manifest.
+    bool defer_registration;
+};
+
+struct gtk_plugin_loader *gtk_plugin_loader_load(struct flutter_drm_embedder *flutter_drm_embedder, const struct gtk_plugin_loader_options *options);
+
+/**
+ * @brief Prints how long scanning, loading and registering every plugin took.
+ */
+void gtk_plugin_loader_print_timings(struct gtk_plugin_loader *loader, FILE *file);
+
 void gtk_plugin_loader_destroy(struct gtk_plugin_loader *loader);
 
 #ifdef __cplusplus
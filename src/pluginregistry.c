@@ -17,6 +17,7 @@
 #include "flutter-drm-embedder.h"
 #include "platformchannel.h"
 #include "util/collection.h"
+#include "util/grace_period.h"
 #include "util/list.h"
 #include "util/lock_ops.h"
 #include "util/logging.h"
@@ -35,13 +36,20 @@ struct plugin_instance {
     struct list_head entry;
 
     const struct flutter_drm_embedder_plugin_v2 *plugin;
+    uint32_t name_hash;
     void *userdata;
     bool initialized;
 };
 
+/**
+ * @brief A registered platform message receiver.
+ *
+ * Receivers are immutable once they're published in a @ref channel_table.
+ * Replacing the receiver of a channel publishes a new receiver and retires
+ * the old one.
+ */
 struct platch_obj_cb_data {
-    struct list_head entry;
-
+    uint32_t hash;
     char *channel;
     enum platch_codec codec;
     platch_obj_recv_callback callback;
@@ -49,11 +57,30 @@ struct platch_obj_cb_data {
     void *userdata;
 };
 
+/**
+ * @brief Open-addressing (linear probing) hash index of all receivers, keyed by channel name.
+ *
+ * Tables are never modified after being published to @ref plugin_registry.channels.
+ * Writers build a modified copy, swap the pointer and free the old table (and
+ * any receivers it was the last owner of) after all readers have left it.
+ */
+struct channel_table {
+    size_t n_entries;
+    size_t mask;
+    struct platch_obj_cb_data *entries[];
+};
+
 struct plugin_registry {
     pthread_mutex_t lock;
     struct flutter_drm_embedder *flutter_drm_embedder;
     struct list_head plugins;
-    struct list_head callbacks;
+
+    /// The current receiver table. Readers only need to enter a read-side
+    /// critical section (@ref channels_read_lock), writers need to hold @ref lock.
+    struct channel_table *_Atomic channels;
+
+    /// Readers of @ref channels, see @ref channels_read_lock.
+    struct grace_period channel_readers;
 };
 
 DEFINE_STATIC_LOCK_OPS(plugin_registry, lock)
@@ -68,8 +95,10 @@ static pthread_mutex_t static_plugins_lock;
 static struct list_head static_plugins;
 
 static struct plugin_instance *get_plugin_by_name_locked(struct plugin_registry *registry, const char *plugin_name) {
+    uint32_t hash = hash_str(plugin_name);
+
     list_for_each_entry(struct plugin_instance, instance, &registry->plugins, entry) {
-        if (streq(instance->plugin->name, plugin_name)) {
+        if (instance->name_hash == hash && streq(instance->plugin->name, plugin_name)) {
             return instance;
         }
     }
@@ -89,14 +118,175 @@ static struct plugin_instance *get_plugin_by_name(struct plugin_registry *regist
     return instance;
 }
 
-static struct platch_obj_cb_data *get_cb_data_by_channel_locked(struct plugin_registry *registry, const char *channel) {
-    list_for_each_entry(struct platch_obj_cb_data, data, &registry->callbacks, entry) {
-        if (streq(data->channel, channel)) {
-            return data;
+#define CHANNEL_TABLE_MIN_SIZE 32
+
+static struct channel_table *channel_table_new(size_t size) {
+    struct channel_table *table;
+
+    assert(size >= CHANNEL_TABLE_MIN_SIZE && (size & (size - 1)) == 0);
+
+    table = calloc(1, sizeof(*table) + size * sizeof(*table->entries));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->n_entries = 0;
+    table->mask = size - 1;
+    return table;
+}
+
+static size_t channel_table_find_slot(const struct channel_table *table, uint32_t hash, const char *channel) {
+    size_t index;
+
+    for (index = hash & table->mask; table->entries[index] != NULL; index = (index + 1) & table->mask) {
+        if (table->entries[index]->hash == hash && streq(table->entries[index]->channel, channel)) {
+            break;
         }
     }
 
-    return NULL;
+    // The table is never more than half full, so this always terminates.
+    return index;
+}
+
+static struct platch_obj_cb_data *channel_table_lookup(const struct channel_table *table, uint32_t hash, const char *channel) {
+    return table->entries[channel_table_find_slot(table, hash, channel)];
+}
+
+/**
+ * @brief Create a copy of @ref table with the receiver for @ref channel replaced by @ref data.
+ *
+ * If @ref data is NULL, the receiver for @ref channel is removed.
+ * The returned table may be larger or smaller than the original table.
+ */
+static struct channel_table *
+channel_table_copy_with(const struct channel_table *table, uint32_t hash, const char *channel, struct platch_obj_cb_data *data) {
+    struct channel_table *copy;
+    size_t size, n_entries;
+
+    n_entries = table->n_entries;
+    if (channel_table_lookup(table, hash, channel) == NULL) {
+        n_entries += data != NULL ? 1 : 0;
+    } else {
+        n_entries -= data == NULL ? 1 : 0;
+    }
+
+    // keep the load factor below 1/2.
+    size = CHANNEL_TABLE_MIN_SIZE;
+    while (size < n_entries * 2 + 1) {
+        size *= 2;
+    }
+
+    copy = channel_table_new(size);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i <= table->mask; i++) {
+        struct platch_obj_cb_data *entry = table->entries[i];
+
+        if (entry == NULL || (entry->hash == hash && streq(entry->channel, channel))) {
+            continue;
+        }
+
+        copy->entries[channel_table_find_slot(copy, entry->hash, entry->channel)] = entry;
+        copy->n_entries++;
+    }
+
+    if (data != NULL) {
+        copy->entries[channel_table_find_slot(copy, hash, channel)] = data;
+        copy->n_entries++;
+    }
+
+    assert(copy->n_entries == n_entries);
+    return copy;
+}
+
+static void cb_data_destroy(struct platch_obj_cb_data *data) {
+    free(data->channel);
+    free(data);
+}
+
+/**
+ * @brief Enter a read-side critical section for the receiver table.
+ *
+ * Inside the critical section, the table returned by loading @ref plugin_registry.channels
+ * (and the receivers in it) are guaranteed to stay alive. Readers never block writers for longer
+ * than the critical section takes, and never block each other.
+ *
+ * @returns The token that must be passed to @ref channels_read_unlock.
+ */
+static unsigned channels_read_lock(struct plugin_registry *registry) {
+    return grace_period_read_lock(&registry->channel_readers);
+}
+
+static void channels_read_unlock(struct plugin_registry *registry, unsigned epoch) {
+    grace_period_read_unlock(&registry->channel_readers, epoch);
+}
+
+/**
+ * @brief Wait until all readers that could've observed a table that was unpublished
+ * before this call have left their critical section.
+ */
+static void synchronize_readers(struct plugin_registry *registry) {
+    ASSERT_MUTEX_LOCKED(registry->lock);
+    grace_period_synchronize(&registry->channel_readers);
+}
+
+/**
+ * @brief Replace the receiver for @ref channel with @ref data (or remove it, if @ref data is NULL).
+ *
+ * Frees the previous receiver for @ref channel after all readers have left it.
+ */
+static int publish_receiver_locked(struct plugin_registry *registry, const char *channel, uint32_t hash, struct platch_obj_cb_data *data) {
+    struct platch_obj_cb_data *old_data;
+    struct channel_table *table, *old_table;
+
+    ASSERT_MUTEX_LOCKED(registry->lock);
+
+    old_table = atomic_load_explicit(&registry->channels, memory_order_relaxed);
+    old_data = channel_table_lookup(old_table, hash, channel);
+
+    table = channel_table_copy_with(old_table, hash, channel, data);
+    if (table == NULL) {
+        return ENOMEM;
+    }
+
+    atomic_store(&registry->channels, table);
+
+    synchronize_readers(registry);
+
+    free(old_table);
+    if (old_data != NULL) {
+        cb_data_destroy(old_data);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Copy out the receiver for @ref channel, without taking the registry lock.
+ *
+ * @returns true if a receiver was found, false otherwise.
+ */
+static bool get_cb_data_by_channel(struct plugin_registry *registry, const char *channel, struct platch_obj_cb_data *data_out) {
+    struct platch_obj_cb_data *data;
+    unsigned epoch;
+
+    epoch = channels_read_lock(registry);
+
+    data = channel_table_lookup(atomic_load(&registry->channels), hash_str(channel), channel);
+    if (data != NULL) {
+        *data_out = *data;
+    }
+
+    channels_read_unlock(registry, epoch);
+
+    return data != NULL;
+}
+
+static struct platch_obj_cb_data *get_cb_data_by_channel_locked(struct plugin_registry *registry, const char *channel) {
+    ASSERT_MUTEX_LOCKED(registry->lock);
+    return channel_table_lookup(atomic_load_explicit(&registry->channels, memory_order_relaxed), hash_str(channel), channel);
 }
 
 struct plugin_registry *plugin_registry_new(struct flutter_drm_embedder *flutter_drm_embedder) {
@@ -108,16 +298,21 @@ struct plugin_registry *plugin_registry_new(struct flutter_drm_embedder *flutter
         return NULL;
     }
 
+    reg->channels = channel_table_new(CHANNEL_TABLE_MIN_SIZE);
+    if (reg->channels == NULL) {
+        free(reg);
+        return NULL;
+    }
+
     ok = pthread_mutex_init(&reg->lock, get_default_mutex_attrs());
     ASSERT_ZERO(ok);
 
     list_inithead(&reg->plugins);
-    list_inithead(&reg->callbacks);
+
+    grace_period_init(&reg->channel_readers);
 
     reg->flutter_drm_embedder = flutter_drm_embedder;
     return reg;
-
-    return NULL;
 }
 
 void plugin_registry_destroy(struct plugin_registry *registry) {
@@ -131,65 +326,45 @@ void plugin_registry_destroy(struct plugin_registry *registry) {
     }
 
     assert(list_is_empty(&registry->plugins));
-    assert(list_is_empty(&registry->callbacks));
+    assert(registry->channels->n_entries == 0);
+    free(registry->channels);
     free(registry);
 }
 
 int plugin_registry_on_platform_message(struct plugin_registry *registry, const FlutterPlatformMessage *message) {
-    struct platch_obj_cb_data *data;
-    platch_obj_recv_callback callback;
-    platform_message_callback_v2_t callback_v2;
+    struct platch_obj_cb_data data;
     struct platch_obj object;
-    enum platch_codec codec;
-    void *userdata;
     int ok;
 
-    plugin_registry_lock(registry);
-
-    data = get_cb_data_by_channel_locked(registry, message->channel);
-    if (data == NULL || (data->callback == NULL && data->callback_v2 == NULL)) {
-        ok = platch_respond_not_implemented((FlutterPlatformMessageResponseHandle *) message->response_handle);
-        goto fail_unlock;
+    // This is the hot path for all platform channels, so it doesn't take the registry lock.
+    // See @ref get_cb_data_by_channel.
+    if (!get_cb_data_by_channel(registry, message->channel, &data) || (data.callback == NULL && data.callback_v2 == NULL)) {
+        return platch_respond_not_implemented((FlutterPlatformMessageResponseHandle *) message->response_handle);
     }
 
-    codec = data->codec;
-    callback = data->callback;
-    callback_v2 = data->callback_v2;
-    userdata = data->userdata;
-
-    plugin_registry_unlock(registry);
-
-    if (callback_v2 != NULL) {
-        callback_v2(userdata, message);
+    if (data.callback_v2 != NULL) {
+        data.callback_v2(data.userdata, message);
     } else {
-        ok = platch_decode((uint8_t *) message->message, message->message_size, codec, &object);
+        ok = platch_decode((uint8_t *) message->message, message->message_size, data.codec, &object);
         if (ok != 0) {
             platch_respond_not_implemented((FlutterPlatformMessageResponseHandle *) message->response_handle);
-            goto fail_return_ok;
+            return ok;
         }
 
-        ok = callback(
+        ok = data.callback(
             (char *) message->channel,
             &object,
             (FlutterPlatformMessageResponseHandle *) message->response_handle
         );  //, userdata);
-        if (ok != 0) {
-            goto fail_free_object;
-        }
 
         platch_free_obj(&object);
+
+        if (ok != 0) {
+            return ok;
+        }
     }
 
     return 0;
-
-fail_free_object:
-    platch_free_obj(&object);
-
-fail_unlock:
-    plugin_registry_unlock(registry);
-
-fail_return_ok:
-    return ok;
 }
 
 void plugin_registry_add_plugin_locked(struct plugin_registry *registry, const struct flutter_drm_embedder_plugin_v2 *plugin) {
@@ -199,6 +374,7 @@ void plugin_registry_add_plugin_locked(struct plugin_registry *registry, const s
     ASSERT_NOT_NULL(instance);
 
     instance->plugin = plugin;
+    instance->name_hash = hash_str(plugin->name);
     instance->initialized = false;
     instance->userdata = NULL;
 
@@ -297,39 +473,36 @@ static int set_receiver_locked(
     platform_message_callback_v2_t callback_v2,
     void *userdata
 ) {
-    struct platch_obj_cb_data *data_ptr;
-    char *channel_dup;
+    struct platch_obj_cb_data *data;
+    uint32_t hash;
+    int ok;
 
     ASSERT_MSG((!!callback) != (!!callback_v2), "Exactly one of callback or callback_v2 must be non-NULL.");
     ASSERT_MUTEX_LOCKED(registry->lock);
 
-    data_ptr = get_cb_data_by_channel_locked(registry, channel);
-    if (data_ptr == NULL) {
-        channel_dup = strdup(channel);
-        if (channel_dup == NULL) {
-            return ENOMEM;
-        }
+    hash = hash_str(channel);
 
-        struct platch_obj_cb_data *data;
+    data = malloc(sizeof *data);
+    if (data == NULL) {
+        return ENOMEM;
+    }
 
-        data = malloc(sizeof *data);
-        if (data == NULL) {
-            free(channel_dup);
-            return ENOMEM;
-        }
+    data->channel = strdup(channel);
+    if (data->channel == NULL) {
+        free(data);
+        return ENOMEM;
+    }
 
-        data->channel = channel_dup;
-        data->codec = codec;
-        data->callback = callback;
-        data->callback_v2 = callback_v2;
-        data->userdata = userdata;
+    data->hash = hash;
+    data->codec = codec;
+    data->callback = callback;
+    data->callback_v2 = callback_v2;
+    data->userdata = userdata;
 
-        list_addtail(&data->entry, &registry->callbacks);
-    } else {
-        data_ptr->codec = codec;
-        data_ptr->callback = callback;
-        data_ptr->callback_v2 = callback_v2;
-        data_ptr->userdata = userdata;
+    ok = publish_receiver_locked(registry, channel, hash, data);
+    if (ok != 0) {
+        cb_data_destroy(data);
+        return ok;
     }
 
     return 0;
@@ -390,18 +563,11 @@ int plugin_registry_set_receiver(const char *channel, enum platch_codec codec, p
 }
 
 int plugin_registry_remove_receiver_v2_locked(struct plugin_registry *registry, const char *channel) {
-    struct platch_obj_cb_data *data;
-
-    data = get_cb_data_by_channel_locked(registry, channel);
-    if (data == NULL) {
+    if (get_cb_data_by_channel_locked(registry, channel) == NULL) {
         return EINVAL;
     }
 
-    list_del(&data->entry);
-    free(data->channel);
-    free(data);
-
-    return 0;
+    return publish_receiver_locked(registry, channel, hash_str(channel), NULL);
 }
 
 int plugin_registry_remove_receiver_v2(struct plugin_registry *registry, const char *channel) {
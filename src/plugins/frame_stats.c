@@ -0,0 +1,193 @@
+#include "plugins/frame_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "flutter-drm-embedder.h"
+#include "frame_timings.h"
+#include "pluginregistry.h"
+#include "util/asserts.h"
+#include "util/logging.h"
+#include "util/macros.h"
+
+/*
+ * Exposes the frame timings recorded by the frame scheduler & window on the
+ * "flutter-drm-embedder/frame_stats" method channel (standard method codec).
+ *
+ * Methods:
+ *   getStats() -> Map
+ *     Frame counts and latency stats (in microseconds) for each interval between frame stages.
+ *   getRecentFrames([int count]) -> List<Map>
+ *     The stage timestamps (in nanoseconds, CLOCK_MONOTONIC) of the most recent frames, oldest first.
+ *   reset()
+ *     Clears the counters and histograms.
+ */
+
+static int respond_stats(struct frame_timings *timings, const FlutterPlatformMessageResponseHandle *response_handle) {
+    struct std_value interval_names[kCount_FrameInterval];
+    struct std_value interval_stats[kCount_FrameInterval];
+    struct frame_timings_stats stats;
+
+    frame_timings_get_stats(timings, &stats);
+
+    for (int i = 0; i < kCount_FrameInterval; i++) {
+        struct frame_interval_stats *s = stats.intervals + i;
+
+        interval_names[i] = STDSTRING((char *) frame_interval_get_name(i));
+
+        // clang-format off
+        interval_stats[i] = STDMAP6(
+            STDSTRING("count"), STDINT64(s->n_samples),
+            STDSTRING("mean"),  STDINT64(s->mean_ns / 1000),
+            STDSTRING("p50"),   STDINT64(s->p50_ns / 1000),
+            STDSTRING("p90"),   STDINT64(s->p90_ns / 1000),
+            STDSTRING("p99"),   STDINT64(s->p99_ns / 1000),
+            STDSTRING("max"),   STDINT64(s->max_ns / 1000)
+        );
+        // clang-format on
+    }
+
+    // clang-format off
+    return platch_respond_success_std(
+        response_handle,
+        &STDMAP7(
+            STDSTRING("frames"),          STDINT64(stats.n_frames),
+            STDSTRING("droppedFrames"),   STDINT64(stats.n_dropped_frames),
+            STDSTRING("committedFrames"), STDINT64(stats.n_committed_frames),
+            STDSTRING("skippedFrames"),   STDINT64(stats.n_skipped_frames),
+            STDSTRING("lateFrames"),      STDINT64(stats.n_late_frames),
+            STDSTRING("missedVblanks"),   STDINT64(stats.n_missed_vblanks),
+            STDSTRING("intervals"),       ((struct std_value){
+                .type = kStdMap,
+                .size = kCount_FrameInterval,
+                .keys = interval_names,
+                .values = interval_stats,
+            })
+        )
+    );
+    // clang-format on
+}
+
+static int respond_recent_frames(struct frame_timings *timings, size_t max_frames, const FlutterPlatformMessageResponseHandle *response_handle) {
+    struct frame_record *records;
+    struct std_value *frames, *stage_names, *stage_values;
+    size_t n_records;
+    int ok;
+
+    records = malloc(max_frames * sizeof *records);
+    frames = malloc(max_frames * sizeof *frames);
+    stage_names = malloc(max_frames * kCount_FrameStage * sizeof *stage_names);
+    stage_values = malloc(max_frames * kCount_FrameStage * sizeof *stage_values);
+    if (records == NULL || frames == NULL || stage_names == NULL || stage_values == NULL) {
+        ok = platch_respond_native_error_std(response_handle, ENOMEM);
+        goto out_free;
+    }
+
+    n_records = frame_timings_get_recent_frames(timings, records, max_frames);
+
+    for (size_t i = 0; i < n_records; i++) {
+        struct std_value *names = stage_names + i * kCount_FrameStage;
+        struct std_value *values = stage_values + i * kCount_FrameStage;
+
+        for (int j = 0; j < kCount_FrameStage; j++) {
+            names[j] = STDSTRING((char *) frame_stage_get_name(j));
+            values[j] = records[i].stages_ns[j] != 0 ? STDINT64(records[i].stages_ns[j]) : STDNULL;
+        }
+
+        // clang-format off
+        frames[i] = STDMAP4(
+            STDSTRING("frame"),          STDINT64(records[i].frame),
+            STDSTRING("frameStart"),     STDINT64(records[i].frame_start_ns),
+            STDSTRING("nextFrameStart"), STDINT64(records[i].next_frame_start_ns),
+            STDSTRING("stages"),         ((struct std_value){
+                .type = kStdMap,
+                .size = kCount_FrameStage,
+                .keys = names,
+                .values = values,
+            })
+        );
+        // clang-format on
+    }
+
+    ok = platch_respond_success_std(response_handle, &(struct std_value){ .type = kStdList, .size = n_records, .list = frames });
+
+out_free:
+    free(stage_values);
+    free(stage_names);
+    free(frames);
+    free(records);
+    return ok;
+}
+
+static void on_receive(void *userdata, const FlutterPlatformMessage *message) {
+    const struct raw_std_value *method_call;
+    const struct raw_std_value *arg;
+    struct frame_timings *timings;
+    int64_t count;
+
+    ASSERT_NOT_NULL(userdata);
+    timings = userdata;
+
+    method_call = (const struct raw_std_value *) (message->message);
+
+    if (!raw_std_method_call_check(method_call, message->message_size)) {
+        platch_respond_illegal_arg_std(message->response_handle, "Malformed platform message.");
+        return;
+    }
+
+    arg = raw_std_method_call_get_arg(method_call);
+
+    if (raw_std_method_call_is_method(method_call, "getStats")) {
+        respond_stats(timings, message->response_handle);
+    } else if (raw_std_method_call_is_method(method_call, "getRecentFrames")) {
+        if (raw_std_value_is_null(arg)) {
+            count = FRAME_STATS_DEFAULT_N_RECENT_FRAMES;
+        } else if (raw_std_value_is_int(arg) && raw_std_value_as_int(arg) > 0) {
+            count = raw_std_value_as_int(arg);
+        } else {
+            platch_respond_illegal_arg_std(message->response_handle, "Expected `arg` to be null or a positive integer.");
+            return;
+        }
+
+        respond_recent_frames(timings, MIN2(count, FRAME_TIMINGS_N_RECENT_FRAMES), message->response_handle);
+    } else if (raw_std_method_call_is_method(method_call, "reset")) {
+        frame_timings_reset_stats(timings);
+        platch_respond_success_std(message->response_handle, &STDNULL);
+    } else {
+        platch_respond_not_implemented(message->response_handle);
+    }
+}
+
+enum plugin_init_result frame_stats_init(struct flutter_drm_embedder *flutter_drm_embedder, void **userdata_out) {
+    struct frame_timings *timings;
+    int ok;
+
+    timings = flutter_drm_embedder_get_frame_timings(flutter_drm_embedder);
+    if (timings == NULL) {
+        return PLUGIN_INIT_RESULT_NOT_APPLICABLE;
+    }
+
+    ok = plugin_registry_set_receiver_v2_locked(
+        flutter_drm_embedder_get_plugin_registry(flutter_drm_embedder),
+        FRAME_STATS_CHANNEL,
+        on_receive,
+        frame_timings_ref(timings)
+    );
+    if (ok != 0) {
+        LOG_ERROR("Could not set \"" FRAME_STATS_CHANNEL "\" receiver. plugin_registry_set_receiver_v2_locked: %s\n", strerror(ok));
+        frame_timings_unref(timings);
+        return PLUGIN_INIT_RESULT_ERROR;
+    }
+
+    *userdata_out = timings;
+    return PLUGIN_INIT_RESULT_INITIALIZED;
+}
+
+void frame_stats_deinit(struct flutter_drm_embedder *flutter_drm_embedder, void *userdata) {
+    ASSERT_NOT_NULL(userdata);
+
+    plugin_registry_remove_receiver_v2_locked(flutter_drm_embedder_get_plugin_registry(flutter_drm_embedder), FRAME_STATS_CHANNEL);
+    frame_timings_unref(userdata);
+}
+
+FLUTTER_DRM_EMBEDDER_PLUGIN("frame stats", frame_stats, frame_stats_init, frame_stats_deinit)
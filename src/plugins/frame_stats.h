@@ -0,0 +1,9 @@
+#ifndef _FRAME_STATS_PLUGIN_H
+#define _FRAME_STATS_PLUGIN_H
+
+#define FRAME_STATS_CHANNEL "flutter-drm-embedder/frame_stats"
+
+/// How many of the most recent frames getRecentFrames returns if no count is given.
+#define FRAME_STATS_DEFAULT_N_RECENT_FRAMES 60
+
+#endif
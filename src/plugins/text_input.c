@@ -10,6 +10,7 @@
 
 #include "flutter-drm-embedder.h"
 #include "pluginregistry.h"
+#include "text_buffer.h"
 #include "util/asserts.h"
 
 struct text_input {
@@ -21,7 +22,8 @@ struct text_input {
     bool has_allow_decimal;
     bool autocorrect;
     enum text_input_action input_action;
-    char text[TEXT_INPUT_MAX_CHARS];
+    bool enable_delta_model;
+    struct text_buffer text;
     int selection_base, selection_extent;
     bool selection_affinity_is_downstream;
     bool selection_is_directional;
@@ -50,40 +52,6 @@ static inline uint8_t utf8_symbol_length(uint8_t c) {
     return 1;
 }
 
-static inline uint8_t *symbol_at(unsigned int symbol_index) {
-    uint8_t *cursor = (uint8_t *) text_input.text;
-
-    for (; symbol_index && *cursor; symbol_index--)
-        cursor += utf8_symbol_length(*cursor);
-
-    return symbol_index ? NULL : cursor;
-}
-
-UNUSED static inline int to_byte_index(unsigned int symbol_index) {
-    char *cursor = text_input.text;
-
-    while ((*cursor) && (symbol_index--))
-        cursor += utf8_symbol_length(*cursor);
-
-    if (*cursor)
-        return cursor - text_input.text;
-
-    return -1;
-}
-
-static inline int to_symbol_index(unsigned int byte_index) {
-    char *cursor = text_input.text;
-    char *target_cursor = cursor + byte_index;
-    int symbol_index = 0;
-
-    while ((*cursor) && (cursor < target_cursor)) {
-        cursor += utf8_symbol_length(*cursor);
-        symbol_index++;
-    }
-
-    return cursor < target_cursor ? -1 : symbol_index;
-}
-
 /**
  * Platform message callbacks
  */
@@ -91,7 +59,7 @@ static int on_set_client(struct platch_obj *object, FlutterPlatformMessageRespon
     enum text_input_action input_action;
     enum text_input_type input_type;
     struct json_value *temp, *temp2, *config;
-    bool autocorrect, allow_signs, allow_decimal, has_allow_signs, has_allow_decimal;
+    bool autocorrect, enable_delta_model, allow_signs, allow_decimal, has_allow_signs, has_allow_decimal;
 
     (void) allow_signs;
     (void) allow_decimal;
@@ -130,6 +98,16 @@ static int on_set_client(struct platch_obj *object, FlutterPlatformMessageRespon
         autocorrect = temp->type == kJsonTrue;
     }
 
+    // DELTA MODEL
+    temp = jsobject_get(config, "enableDeltaModel");
+    if (temp == NULL || temp->type == kJsonNull) {
+        enable_delta_model = false;
+    } else if (temp->type == kJsonTrue || temp->type == kJsonFalse) {
+        enable_delta_model = temp->type == kJsonTrue;
+    } else {
+        return platch_respond_illegal_arg_json(responsehandle, "Expected `arg[1]['enableDeltaModel']` to be a boolean or null.");
+    }
+
     // INPUT ACTION
     temp = jsobject_get(config, "inputAction");
     if (temp == NULL || temp->type != kJsonString) {
@@ -241,6 +219,7 @@ static int on_set_client(struct platch_obj *object, FlutterPlatformMessageRespon
     // everything okay, apply the new text editing config
     text_input.connection_id = new_id;
     text_input.autocorrect = autocorrect;
+    text_input.enable_delta_model = enable_delta_model;
     text_input.input_action = input_action;
     text_input.input_type = input_type;
 
@@ -299,6 +278,7 @@ static int on_set_editing_state(struct platch_obj *object, FlutterPlatformMessag
     char *text;
     bool selection_affinity_is_downstream, selection_is_directional;
     int selection_base, selection_extent, composing_base, composing_extent;
+    int ok;
 
     /*
      *  TextInput.setEditingState(Map<String, dynamic> textEditingValue)
@@ -376,7 +356,11 @@ static int on_set_editing_state(struct platch_obj *object, FlutterPlatformMessag
         composing_extent = (int) temp->number_value;
     }
 
-    strncpy(text_input.text, text, TEXT_INPUT_MAX_CHARS - 1);
+    ok = text_buffer_set_text(&text_input.text, text, strlen(text));
+    if (ok != 0) {
+        return platch_respond_native_error_json(responsehandle, ok);
+    }
+
     text_input.selection_base = selection_base;
     text_input.selection_extent = selection_extent;
     text_input.selection_affinity_is_downstream = selection_affinity_is_downstream;
@@ -465,9 +449,20 @@ static int on_receive(char *channel, struct platch_obj *object, FlutterPlatformM
     return platch_respond_not_implemented(responsehandle);
 }
 
+/**
+ * @brief Gets @a text as a JSON string, without moving the gap of the text buffer.
+ */
+static struct json_value text_buffer_to_json(const struct text_buffer *text) {
+    const char *before, *after;
+    size_t before_length, after_length;
+
+    text_buffer_get_segments(text, &before, &before_length, &after, &after_length);
+    return JSONSTRING_SEGMENTS(before, before_length, after, after_length);
+}
+
 static int client_update_editing_state(
     double connection_id,
-    char *text,
+    const struct text_buffer *text,
     double selection_base,
     double selection_extent,
     bool selection_affinity_is_downstream,
@@ -482,7 +477,7 @@ static int client_update_editing_state(
             JSONNUM(connection_id),
             JSONOBJECT7(
                 "text",
-                JSONSTRING(text),
+                text_buffer_to_json(text),
                 "selectionBase",
                 JSONNUM(selection_base),
                 "selectionExtent",
@@ -502,6 +497,55 @@ static int client_update_editing_state(
     );
 }
 
+static int client_update_editing_state_with_delta(
+    double connection_id,
+    const struct text_buffer *old_text,
+    const char *delta_text,
+    double delta_start,
+    double delta_end,
+    double selection_base,
+    double selection_extent,
+    bool selection_affinity_is_downstream,
+    bool selection_is_directional,
+    double composing_base,
+    double composing_extent
+) {
+    return platch_call_json(
+        TEXT_INPUT_CHANNEL,
+        "TextInputClient.updateEditingStateWithDeltas",
+        &JSONARRAY2(
+            JSONNUM(connection_id),
+            JSONOBJECT1(
+                "deltas",
+                JSONARRAY1(JSONOBJECT10(
+                    "oldText",
+                    text_buffer_to_json(old_text),
+                    "deltaText",
+                    JSONSTRING((char *) delta_text),
+                    "deltaStart",
+                    JSONNUM(delta_start),
+                    "deltaEnd",
+                    JSONNUM(delta_end),
+                    "selectionBase",
+                    JSONNUM(selection_base),
+                    "selectionExtent",
+                    JSONNUM(selection_extent),
+                    "selectionAffinity",
+                    JSONSTRING(selection_affinity_is_downstream ? "TextAffinity.downstream" : "TextAffinity.upstream"),
+                    "selectionIsDirectional",
+                    JSONBOOL(selection_is_directional),
+                    "composingBase",
+                    JSONNUM(composing_base),
+                    "composingExtent",
+                    JSONNUM(composing_extent)
+                ))
+            )
+        ),
+        NULL,
+        NULL
+    );
+}
+
 int client_perform_action(double connection_id, enum text_input_action action) {
     char *action_str = (action == kTextInputActionNone)           ? "TextInputAction.none" :
                        (action == kTextInputActionUnspecified)    ? "TextInputAction.unspecified" :
@@ -574,143 +618,150 @@ int client_show_autocorrection_prompt_rect(double connection_id, double start, d
 
 /**
  * Text Input Model functions.
+ *
+ * All indices are in UTF-16 code units, like in flutter's TextEditingValue.
  */
-static inline int selection_start(void) {
-    return MIN2(text_input.selection_base, text_input.selection_extent);
-}
-
-static inline int selection_end(void) {
-    return MAX2(text_input.selection_base, text_input.selection_extent);
-}
 
 /**
- * Erases the characters between `start` and `end` (both inclusive) and returns
- * `start`.
+ * A change of the text input model, like flutter's TextEditingDelta.
  */
-static int model_erase(unsigned int start, unsigned int end) {
-    // 0 <= start <= end < len
+struct text_edit {
+    /// The replaced range. Both are -1 if only the selection changed.
+    int start, end;
 
-    uint8_t *start_str = symbol_at(start);
-    uint8_t *after_end_str = symbol_at(end + 1);
+    /// The text the range is replaced with. The model only ever inserts a single character.
+    char text[5];
 
-    if (start_str && after_end_str)
-        memmove(start_str, after_end_str, strlen((char *) after_end_str) + 1 /* null byte */);
+    /// The selection after the edit.
+    int selection_base, selection_extent;
+};
 
-    return start;
+static inline int selection_start(void) {
+    return CLAMP(MIN2(text_input.selection_base, text_input.selection_extent), 0, (int) text_buffer_get_length(&text_input.text));
 }
 
-static bool model_delete_selected(void) {
-    // erase selected text
-    text_input.selection_base = model_erase(selection_start(), selection_end() - 1);
-    text_input.selection_extent = text_input.selection_base;
-    return true;
+static inline int selection_end(void) {
+    return CLAMP(MAX2(text_input.selection_base, text_input.selection_extent), 0, (int) text_buffer_get_length(&text_input.text));
 }
 
-static bool model_add_utf8_char(uint8_t *c) {
-    size_t symbol_length;
-    uint8_t *to_move;
-
-    if (text_input.selection_base != text_input.selection_extent)
-        model_delete_selected();
-
-    // find out where in our string we need to insert the utf8 symbol
+static void model_replace(struct text_edit *edit, int start, int end, const uint8_t *c) {
+    size_t length;
 
-    symbol_length = utf8_symbol_length(*c);
-    to_move = symbol_at(text_input.selection_base);
+    length = c != NULL ? utf8_symbol_length(*c) : 0;
 
-    if (!to_move || !symbol_length)
-        return false;
+    edit->start = start;
+    edit->end = end;
+    if (length > 0) {
+        memcpy(edit->text, c, length);
+    }
+    edit->text[length] = '\0';
 
-    // move the string behind the insertion position to
-    // make place for the utf8 charactercursor
+    // only code points outside the BMP need two UTF-16 code units.
+    edit->selection_base = start + (length == 4 ? 2 : length > 0 ? 1 : 0);
+    edit->selection_extent = edit->selection_base;
+}
 
-    memmove(to_move + symbol_length, to_move, strlen((char *) to_move) + 1 /* null byte */);
+static void model_select(struct text_edit *edit, int base, int extent) {
+    edit->start = -1;
+    edit->end = -1;
+    edit->text[0] = '\0';
+    edit->selection_base = base;
+    edit->selection_extent = extent;
+}
 
-    // after the move, to_move points to the memory
-    // where c should be inserted
-    for (int i = 0; i < symbol_length; i++)
-        to_move[i] = c[i];
+static bool model_delete_selected(struct text_edit *edit) {
+    model_replace(edit, selection_start(), selection_end(), NULL);
+    return true;
+}
 
-    // move our selection to behind the inserted char
-    text_input.selection_extent++;
-    text_input.selection_base = text_input.selection_extent;
+static bool model_add_utf8_char(const uint8_t *c, struct text_edit *edit) {
+    if (utf8_symbol_length(*c) == 0) {
+        return false;
+    }
 
+    // replaces the selected text, if there's any.
+    model_replace(edit, selection_start(), selection_end(), c);
     return true;
 }
 
-static bool model_backspace(void) {
+static bool model_backspace(struct text_edit *edit) {
+    int start;
+
     if (text_input.selection_base != text_input.selection_extent)
-        return model_delete_selected();
+        return model_delete_selected(edit);
 
-    if (text_input.selection_base != 0) {
-        int base = text_input.selection_base - 1;
-        text_input.selection_base = model_erase(base, base);
-        text_input.selection_extent = text_input.selection_base;
+    start = selection_start();
+    if (start != 0) {
+        model_replace(edit, text_buffer_get_prev_boundary(&text_input.text, start), start, NULL);
         return true;
     }
 
     return false;
 }
 
-static bool model_delete(void) {
+static bool model_delete(struct text_edit *edit) {
+    int start;
+
     if (text_input.selection_base != text_input.selection_extent)
-        return model_delete_selected();
+        return model_delete_selected(edit);
 
-    if (selection_start() < strlen(text_input.text)) {
-        text_input.selection_base = model_erase(selection_start(), selection_end());
-        text_input.selection_extent = text_input.selection_base;
+    start = selection_start();
+    if (start < (int) text_buffer_get_length(&text_input.text)) {
+        model_replace(edit, start, text_buffer_get_next_boundary(&text_input.text, start), NULL);
         return true;
     }
 
     return false;
 }
 
-static bool model_move_cursor_to_beginning(void) {
+static bool model_move_cursor_to_beginning(struct text_edit *edit) {
     if ((text_input.selection_base != 0) || (text_input.selection_extent != 0)) {
-        text_input.selection_base = 0;
-        text_input.selection_extent = 0;
+        model_select(edit, 0, 0);
         return true;
     }
 
     return false;
 }
 
-static bool model_move_cursor_to_end(void) {
-    int end = to_symbol_index(strlen(text_input.text));
+static bool model_move_cursor_to_end(struct text_edit *edit) {
+    int end = text_buffer_get_length(&text_input.text);
 
-    if (text_input.selection_base != end) {
-        text_input.selection_base = end;
-        text_input.selection_extent = end;
+    if (text_input.selection_base != end || text_input.selection_extent != end) {
+        model_select(edit, end, end);
         return true;
     }
 
     return false;
 }
 
-UNUSED static bool model_move_cursor_forward(void) {
+UNUSED static bool model_move_cursor_forward(struct text_edit *edit) {
+    int next;
+
     if (text_input.selection_base != text_input.selection_extent) {
-        text_input.selection_base = text_input.selection_extent;
+        model_select(edit, text_input.selection_extent, text_input.selection_extent);
         return true;
     }
 
-    if (text_input.selection_extent < to_symbol_index(strlen(text_input.text))) {
-        text_input.selection_extent++;
-        text_input.selection_base++;
+    next = text_buffer_get_next_boundary(&text_input.text, selection_start());
+    if (next != selection_start()) {
+        model_select(edit, next, next);
         return true;
     }
 
     return false;
 }
 
-UNUSED static bool model_move_cursor_back(void) {
+UNUSED static bool model_move_cursor_back(struct text_edit *edit) {
+    int prev;
+
     if (text_input.selection_base != text_input.selection_extent) {
-        text_input.selection_extent = text_input.selection_base;
+        model_select(edit, text_input.selection_base, text_input.selection_base);
         return true;
     }
 
-    if (text_input.selection_base > 0) {
-        text_input.selection_base--;
-        text_input.selection_extent--;
+    prev = text_buffer_get_prev_boundary(&text_input.text, selection_start());
+    if (prev != selection_start()) {
+        model_select(edit, prev, prev);
         return true;
     }
 
@@ -720,7 +771,7 @@ UNUSED static bool model_move_cursor_back(void) {
 static int sync_editing_state(void) {
     return client_update_editing_state(
         text_input.connection_id,
-        text_input.text,
+        &text_input.text,
         text_input.selection_base,
         text_input.selection_extent,
         text_input.selection_affinity_is_downstream,
@@ -730,21 +781,71 @@ static int sync_editing_state(void) {
     );
 }
 
+/**
+ * Applies @a edit to the model and tells flutter about it, either as a delta if the client
+ * enabled the delta model, or by sending the whole new editing state.
+ */
+static int model_apply_edit(const struct text_edit *edit) {
+    int ok;
+
+    if (text_input.enable_delta_model) {
+        // The delta has to contain the text before the edit, so it's sent before the edit is applied.
+        // The composing region is gone after any edit, since we don't compose text.
+        ok = client_update_editing_state_with_delta(
+            text_input.connection_id,
+            &text_input.text,
+            edit->text,
+            edit->start,
+            edit->end,
+            edit->selection_base,
+            edit->selection_extent,
+            text_input.selection_affinity_is_downstream,
+            text_input.selection_is_directional,
+            -1,
+            -1
+        );
+        if (ok != 0) {
+            return ok;
+        }
+    }
+
+    if (edit->start >= 0) {
+        ok = text_buffer_replace(&text_input.text, edit->start, edit->end, edit->text, strlen(edit->text));
+        if (ok != 0) {
+            return ok;
+        }
+    }
+
+    text_input.selection_base = edit->selection_base;
+    text_input.selection_extent = edit->selection_extent;
+    text_input.composing_base = -1;
+    text_input.composing_extent = -1;
+
+    if (!text_input.enable_delta_model) {
+        return sync_editing_state();
+    }
+
+    return 0;
+}
+
 /**
  * `c` doesn't need to be NULL-terminated, the length of the char will be calculated
  * using the start byte.
  */
 int textin_on_utf8_char(uint8_t *c) {
+    struct text_edit edit;
+
     if (text_input.connection_id == -1)
         return 0;
 
-    if (model_add_utf8_char(c))
-        return sync_editing_state();
+    if (model_add_utf8_char(c, &edit))
+        return model_apply_edit(&edit);
 
     return 0;
 }
 
 int textin_on_xkb_keysym(xkb_keysym_t keysym) {
+    struct text_edit edit;
     bool needs_sync = false;
     bool perform_action = false;
     int ok;
@@ -753,36 +854,36 @@ int textin_on_xkb_keysym(xkb_keysym_t keysym) {
         return 0;
 
     switch (keysym) {
-        case XKB_KEY_BackSpace: needs_sync = model_backspace(); break;
+        case XKB_KEY_BackSpace: needs_sync = model_backspace(&edit); break;
         case XKB_KEY_Delete:
-        case XKB_KEY_KP_Delete: needs_sync = model_delete(); break;
+        case XKB_KEY_KP_Delete: needs_sync = model_delete(&edit); break;
         case XKB_KEY_End:
-        case XKB_KEY_KP_End: needs_sync = model_move_cursor_to_end(); break;
+        case XKB_KEY_KP_End: needs_sync = model_move_cursor_to_end(&edit); break;
         case XKB_KEY_Return:
         case XKB_KEY_KP_Enter:
         case XKB_KEY_ISO_Enter:
             if (text_input.input_type == kInputTypeMultiline)
-                needs_sync = model_add_utf8_char((uint8_t *) "\n");
+                needs_sync = model_add_utf8_char((const uint8_t *) "\n", &edit);
 
             perform_action = true;
             break;
         case XKB_KEY_Home:
-        case XKB_KEY_KP_Home: needs_sync = model_move_cursor_to_beginning(); break;
+        case XKB_KEY_KP_Home: needs_sync = model_move_cursor_to_beginning(&edit); break;
         case XKB_KEY_Left:
         case XKB_KEY_KP_Left:
             // handled inside of flutter
-            // needs_sync = model_move_cursor_back();
+            // needs_sync = model_move_cursor_back(&edit);
             break;
         case XKB_KEY_Right:
         case XKB_KEY_KP_Right:
             // handled inside of flutter
-            // needs_sync = model_move_cursor_forward();
+            // needs_sync = model_move_cursor_forward(&edit);
             break;
         default: break;
     }
 
     if (needs_sync) {
-        ok = sync_editing_state();
+        ok = model_apply_edit(&edit);
         if (ok != 0)
             return ok;
     }
@@ -821,7 +922,8 @@ enum plugin_init_result textin_init(struct flutter_drm_embedder *flutter_drm_emb
     textin->has_allow_decimal = false;
     textin->autocorrect = false;
     textin->input_action = kTextInputActionNone;
-    textin->text[0] = '\0';
+    textin->enable_delta_model = false;
+    text_buffer_init(&textin->text);
     textin->selection_base = 0;
     textin->selection_extent = 0;
     textin->selection_affinity_is_downstream = false;
@@ -835,6 +937,7 @@ enum plugin_init_result textin_init(struct flutter_drm_embedder *flutter_drm_emb
 
 void textin_deinit(struct flutter_drm_embedder *flutter_drm_embedder, void *userdata) {
     plugin_registry_remove_receiver_v2_locked(flutter_drm_embedder_get_plugin_registry(flutter_drm_embedder), TEXT_INPUT_CHANNEL);
+    text_buffer_deinit(&text_input.text);
     free(userdata);
 }
 
@@ -7,8 +7,6 @@
 
 #define TEXT_INPUT_CHANNEL "flutter/textinput"
 
-#define TEXT_INPUT_MAX_CHARS 8192
-
 enum text_input_type {
     kInputTypeText,
     kInputTypeMultiline,
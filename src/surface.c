@@ -13,6 +13,7 @@
 
 #include "surface.h"
 
+#include <errno.h>
 #include <stddef.h>
 #include <stdlib.h>
 
@@ -45,6 +46,7 @@ int surface_init(struct surface *s, struct tracer *tracer) {
     s->revision = 1;
     s->present_kms = NULL;
     s->present_fbdev = NULL;
+    s->present_gl = NULL;
     s->deinit = surface_deinit;
     return 0;
 }
@@ -116,3 +118,21 @@ int surface_present_fbdev(struct surface *s, const struct fl_layer_props *props,
 
     return ok;
 }
+
+int surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener) {
+    int ok;
+
+    ASSERT_NOT_NULL(s);
+    ASSERT_NOT_NULL(props);
+    ASSERT_NOT_NULL(flattener);
+
+    if (s->present_gl == NULL) {
+        return ENOTSUP;
+    }
+
+    TRACER_BEGIN(s->tracer, "surface_present_gl");
+    ok = s->present_gl(s, props, flattener);
+    TRACER_END(s->tracer, "surface_present_gl");
+
+    return ok;
+}
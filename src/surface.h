@@ -19,6 +19,7 @@ struct compositor;
 struct fl_layer_props;
 struct kms_req_builder;
 struct fbdev_commit_builder;
+struct gl_flattener;
 
 #define CAST_SURFACE_UNCHECKED(ptr) ((struct surface *) (ptr))
 #ifdef DEBUG
@@ -34,14 +35,19 @@ DECLARE_LOCK_OPS(surface)
 
 DECLARE_REF_OPS(surface)
 
-ATTR_PURE static inline struct surface *surface_from_id(int64_t id) {
-    return CAST_SURFACE(int64_to_ptr(id));
-}
-
 ATTR_PURE int64_t surface_get_revision(struct surface *s);
 
 int surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
 
 int surface_present_fbdev(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder);
 
+/**
+ * @brief Draws the surface into the buffer that @a flattener is currently compositing.
+ *
+ * Used for layers that couldn't get a hardware plane.
+ *
+ * @returns 0 on success, ENOTSUP if the surface can't be flattened, or another error code.
+ */
+int surface_present_gl(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener);
+
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_SURFACE_H
@@ -21,6 +21,7 @@
 struct fl_layer_props;
 struct kms_req_builder;
 struct fbdev_commit_builder;
+struct gl_flattener;
 struct tracer;
 
 struct surface {
@@ -34,6 +35,7 @@ struct surface {
 
     int (*present_kms)(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
     int (*present_fbdev)(struct surface *s, const struct fl_layer_props *props, struct fbdev_commit_builder *builder);
+    int (*present_gl)(struct surface *s, const struct fl_layer_props *props, struct gl_flattener *flattener);
     void (*deinit)(struct surface *s);
 };
 
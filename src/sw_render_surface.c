@@ -0,0 +1,660 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Software render surface
+ *
+ * - a render surface that can be used for filling flutter software backing stores
+ * - and for scanout using KMS, using DRM dumb buffers
+ */
+
+#include "sw_render_surface.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modesetting.h"
+#include "pixel_format.h"
+#include "render_surface.h"
+#include "render_surface_private.h"
+#include "surface.h"
+#include "surface_private.h"
+#include "tracer.h"
+#include "util/collection.h"
+#include "util/logging.h"
+#include "util/refcounting.h"
+
+struct sw_render_surface;
+
+struct fb {
+    /// True if the memory of this fb was allocated already.
+    bool is_allocated;
+
+    /// The memory flutter renders into. ARGB8888, cached.
+    uint8_t *pixels;
+    size_t pitch;
+
+    /// The DRM dumb buffer that's scanned out. NULL for headless surfaces.
+    void *map;
+    size_t map_size;
+    uint32_t map_pitch;
+    uint32_t gem_handle;
+
+    /// The KMS fb of the dumb buffer, added on the first present.
+    bool has_fb_id;
+    uint32_t fb_id;
+    enum pixfmt fb_format;
+};
+
+struct locked_fb {
+    /// Not a reference, see @ref release_locked_fb.
+    struct sw_render_surface *surface;
+    atomic_flag is_locked;
+    refcount_t n_refs;
+    struct fb *fb;
+};
+
+struct sw_render_surface {
+    union {
+        struct surface surface;
+        struct render_surface render_surface;
+    };
+
+#ifdef DEBUG
+    uuid_t uuid;
+#endif
+
+    /**
+     * @brief The KMS device the dumb buffers are allocated on, or NULL for headless surfaces.
+     */
+    struct drmdev *drmdev;
+
+    /**
+     * @brief The pixel format of the dumb buffers.
+     *
+     * Flutter always renders ARGB8888 (which is BGRA8888 in flutter terms, in byte order).
+     * For other formats, the pixels are converted when copying them into the dumb buffer.
+     */
+    enum pixfmt pixel_format;
+
+    struct fb fbs[SW_RENDER_SURFACE_MAX_BUFFERS];
+
+    /**
+     * @brief Locking wrapper around the fbs above. See vk_gbm_render_surface.
+     *
+     * Flutter, the front fb and every KMS layer scanning out an fb keep a reference on it.
+     * Once the reference count drops to zero, the fb can be filled again.
+     */
+    struct locked_fb locked_fbs[SW_RENDER_SURFACE_MAX_BUFFERS];
+
+    /**
+     * @brief The fb that was last queued to be presented. This is the one
+     * that's scanned out when @ref sw_render_surface_present_kms is called.
+     */
+    struct locked_fb *front_fb;
+};
+
+COMPILE_ASSERT(offsetof(struct sw_render_surface, surface) == 0);
+COMPILE_ASSERT(offsetof(struct sw_render_surface, render_surface.surface) == 0);
+
+#ifdef DEBUG
+static const uuid_t uuid = CONST_UUID(0x5b, 0x0e, 0x6a, 0x91, 0xd2, 0x47, 0x4c, 0x3f, 0x8b, 0x62, 0x1a, 0xe9, 0x0c, 0x73, 0x44, 0xb8);
+#endif
+
+#define CAST_THIS(ptr) CAST_SW_RENDER_SURFACE(ptr)
+#define CAST_THIS_UNCHECKED(ptr) CAST_SW_RENDER_SURFACE_UNCHECKED(ptr)
+
+#ifdef DEBUG
+ATTR_PURE struct sw_render_surface *__checked_cast_sw_render_surface(void *ptr) {
+    struct sw_render_surface *surface;
+
+    surface = CAST_SW_RENDER_SURFACE_UNCHECKED(ptr);
+    assert(uuid_equals(surface->uuid, uuid));
+    return surface;
+}
+#endif
+
+static void locked_fb_destroy(struct locked_fb *fb) {
+    atomic_flag_clear(&fb->is_locked);
+}
+
+DEFINE_STATIC_REF_OPS(locked_fb, n_refs)
+
+/*
+ * Unlike the GBM render surfaces, locked fbs don't reference the surface themselves.
+ * The front fb is owned by the surface, so that would be a reference cycle.
+ * Instead, everyone else locking an fb (flutter, KMS layers) also holds a reference
+ * on the surface, which is dropped here.
+ */
+static void release_locked_fb(void *userdata) {
+    struct sw_render_surface *surface;
+    struct locked_fb *fb;
+
+    ASSERT_NOT_NULL(userdata);
+
+    fb = userdata;
+    surface = fb->surface;
+
+    locked_fb_unref(fb);
+    surface_unref(CAST_SURFACE(surface));
+}
+
+/*
+ * Pixel format conversion.
+ *
+ * The row converters are written using GCC vector extensions, 8 pixels at a time,
+ * so they're lowered to NEON on ARM and SSE2 on x86 without any
+ * architecture specific code. The pack expressions work on both vectors and scalars,
+ * so the same expression is used for the remaining pixels of each row.
+ */
+#define N_VEC_PIXELS 8
+
+typedef uint32_t u32xN __attribute__((vector_size(N_VEC_PIXELS * sizeof(uint32_t))));
+typedef uint16_t u16xN __attribute__((vector_size(N_VEC_PIXELS * sizeof(uint16_t))));
+
+// clang-format off
+#define PACK_RGB565(p)   ((((p) >> 8) & 0xF800) | (((p) >> 5) & 0x07E0) | (((p) >> 3) & 0x001F))
+#define PACK_XRGB1555(p) ((((p) >> 9) & 0x7C00) | (((p) >> 6) & 0x03E0) | (((p) >> 3) & 0x001F))
+#define PACK_ARGB1555(p) ((((p) >> 16) & 0x8000) | PACK_XRGB1555(p))
+#define PACK_XRGB4444(p) ((((p) >> 12) & 0x0F00) | (((p) >> 8) & 0x00F0) | (((p) >> 4) & 0x000F))
+#define PACK_ARGB4444(p) ((((p) >> 16) & 0xF000) | PACK_XRGB4444(p))
+#define PACK_BGRA8888(p) (((p) << 24) | (((p) << 8) & 0x00FF0000) | (((p) >> 8) & 0x0000FF00) | ((p) >> 24))
+#define PACK_RGBA8888(p) (((p) << 8) | ((p) >> 24))
+// clang-format on
+
+#define DEFINE_ROW_CONVERTER(name, dst_type, dst_vec_type, pack)                          \
+    static void name(void *restrict dst_void, const uint32_t *restrict src, int width) { \
+        dst_type *restrict dst = dst_void;                                                 \
+        int x;                                                                             \
+                                                                                           \
+        for (x = 0; x + N_VEC_PIXELS <= width; x += N_VEC_PIXELS) {                        \
+            u32xN p;                                                                       \
+            dst_vec_type out;                                                              \
+                                                                                           \
+            memcpy(&p, src + x, sizeof p);                                                 \
+            out = __builtin_convertvector(pack(p), dst_vec_type);                          \
+            memcpy(dst + x, &out, sizeof out);                                             \
+        }                                                                                  \
+                                                                                           \
+        for (; x < width; x++) {                                                           \
+            dst[x] = (dst_type) pack(src[x]);                                              \
+        }                                                                                  \
+    }
+
+DEFINE_ROW_CONVERTER(convert_row_rgb565, uint16_t, u16xN, PACK_RGB565)
+DEFINE_ROW_CONVERTER(convert_row_argb1555, uint16_t, u16xN, PACK_ARGB1555)
+DEFINE_ROW_CONVERTER(convert_row_xrgb1555, uint16_t, u16xN, PACK_XRGB1555)
+DEFINE_ROW_CONVERTER(convert_row_argb4444, uint16_t, u16xN, PACK_ARGB4444)
+DEFINE_ROW_CONVERTER(convert_row_xrgb4444, uint16_t, u16xN, PACK_XRGB4444)
+DEFINE_ROW_CONVERTER(convert_row_bgra8888, uint32_t, u32xN, PACK_BGRA8888)
+DEFINE_ROW_CONVERTER(convert_row_rgba8888, uint32_t, u32xN, PACK_RGBA8888)
+
+static void copy_row_argb8888(void *restrict dst, const uint32_t *restrict src, int width) {
+    memcpy(dst, src, (size_t) width * sizeof(uint32_t));
+}
+
+typedef void (*row_converter_t)(void *restrict dst, const uint32_t *restrict src, int width);
+
+static row_converter_t get_row_converter(enum pixfmt format) {
+    switch (format) {
+        case PIXFMT_RGB565: return convert_row_rgb565;
+        case PIXFMT_ARGB4444: return convert_row_argb4444;
+        case PIXFMT_XRGB4444: return convert_row_xrgb4444;
+        case PIXFMT_ARGB1555: return convert_row_argb1555;
+        case PIXFMT_XRGB1555: return convert_row_xrgb1555;
+        case PIXFMT_ARGB8888:
+        case PIXFMT_XRGB8888: return copy_row_argb8888;
+        case PIXFMT_BGRA8888:
+        case PIXFMT_BGRX8888: return convert_row_bgra8888;
+        case PIXFMT_RGBA8888:
+        case PIXFMT_RGBX8888: return convert_row_rgba8888;
+        default: UNREACHABLE();
+    }
+}
+
+void sw_render_surface_convert_pixels(
+    enum pixfmt format,
+    void *dst,
+    size_t dst_pitch,
+    const void *src,
+    size_t src_pitch,
+    struct vec2i size
+) {
+    row_converter_t convert_row;
+
+    ASSERT_NOT_NULL(dst);
+    ASSERT_NOT_NULL(src);
+    ASSUME_PIXFMT_VALID(format);
+
+    convert_row = get_row_converter(format);
+
+    if (format == PIXFMT_ARGB8888 || format == PIXFMT_XRGB8888) {
+        // Only copy everything at once if there's no row padding that'd be overwritten.
+        if (dst_pitch == src_pitch && src_pitch == (size_t) size.x * sizeof(uint32_t)) {
+            memcpy(dst, src, src_pitch * size.y);
+            return;
+        }
+    }
+
+    for (int y = 0; y < size.y; y++) {
+        convert_row((uint8_t *) dst + y * dst_pitch, (const uint32_t *) ((const uint8_t *) src + y * src_pitch), size.x);
+    }
+}
+
+static void fb_deinit(struct fb *fb, struct drmdev *drmdev) {
+    if (!fb->is_allocated) {
+        return;
+    }
+
+    if (drmdev != NULL) {
+        if (fb->has_fb_id) {
+            drmdev_rm_fb(drmdev, fb->fb_id);
+        }
+        drmdev_unmap_dumb_buffer(drmdev, fb->map, fb->map_size);
+        drmdev_destroy_dumb_buffer(drmdev, fb->gem_handle);
+    }
+
+    free(fb->pixels);
+    fb->is_allocated = false;
+}
+
+static int fb_allocate(struct fb *fb, struct drmdev *drmdev, struct vec2i size, enum pixfmt pixel_format) {
+    int ok;
+
+    ASSERT_NOT_NULL(fb);
+    assert(!fb->is_allocated);
+
+    fb->pitch = (size_t) size.x * 4;
+    fb->pixels = malloc(fb->pitch * size.y);
+    if (fb->pixels == NULL) {
+        return ENOMEM;
+    }
+
+    if (drmdev != NULL) {
+        ok = drmdev_create_dumb_buffer(
+            drmdev,
+            size.x,
+            size.y,
+            get_pixfmt_info(pixel_format)->bits_per_pixel,
+            &fb->gem_handle,
+            &fb->map_pitch,
+            &fb->map_size
+        );
+        if (ok != 0) {
+            LOG_ERROR("Couldn't create DRM dumb buffer for software rendering.\n");
+            goto fail_free_pixels;
+        }
+
+        fb->map = drmdev_map_dumb_buffer(drmdev, fb->gem_handle, fb->map_size);
+        if (fb->map == NULL) {
+            LOG_ERROR("Couldn't map DRM dumb buffer for software rendering.\n");
+            ok = EIO;
+            goto fail_destroy_dumb_buffer;
+        }
+    } else {
+        fb->map = NULL;
+        fb->map_size = 0;
+        fb->map_pitch = 0;
+        fb->gem_handle = 0;
+    }
+
+    fb->has_fb_id = false;
+    fb->fb_id = 0;
+    fb->fb_format = pixel_format;
+    fb->is_allocated = true;
+    return 0;
+
+fail_destroy_dumb_buffer:
+    drmdev_destroy_dumb_buffer(drmdev, fb->gem_handle);
+
+fail_free_pixels:
+    free(fb->pixels);
+    return ok;
+}
+
+void sw_render_surface_deinit(struct surface *s);
+static int sw_render_surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder);
+static int sw_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store);
+static int sw_render_surface_queue_present(struct render_surface *s, const FlutterBackingStore *fl_store);
+
+static int
+sw_render_surface_init(struct sw_render_surface *surface, struct tracer *tracer, struct vec2i size, struct drmdev *drmdev, enum pixfmt pixel_format) {
+    int ok;
+
+    ASSUME_PIXFMT_VALID(pixel_format);
+
+    if (drmdev != NULL && !drmdev_supports_dumb_buffers(drmdev)) {
+        LOG_ERROR("KMS device doesn't support dumb buffers, which are required for software rendering.\n");
+        return ENOTSUP;
+    }
+
+    ok = render_surface_init(CAST_RENDER_SURFACE_UNCHECKED(surface), tracer, size);
+    if (ok != 0) {
+        return ok;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(surface->locked_fbs); i++) {
+        surface->fbs[i].is_allocated = false;
+        surface->locked_fbs[i].surface = NULL;
+        surface->locked_fbs[i].is_locked = (atomic_flag) ATOMIC_FLAG_INIT;
+        surface->locked_fbs[i].n_refs = REFCOUNT_INIT_0;
+        surface->locked_fbs[i].fb = surface->fbs + i;
+    }
+
+    COMPILE_ASSERT(ARRAY_SIZE(surface->fbs) == ARRAY_SIZE(surface->locked_fbs));
+
+    surface->surface.present_kms = drmdev != NULL ? sw_render_surface_present_kms : NULL;
+    surface->surface.deinit = sw_render_surface_deinit;
+    surface->render_surface.fill = sw_render_surface_fill;
+    surface->render_surface.queue_present = sw_render_surface_queue_present;
+
+#ifdef DEBUG
+    uuid_copy(&surface->uuid, uuid);
+#endif
+
+    surface->drmdev = drmdev != NULL ? drmdev_ref(drmdev) : NULL;
+    surface->pixel_format = pixel_format;
+    surface->front_fb = NULL;
+    return 0;
+}
+
+struct sw_render_surface *sw_render_surface_new(struct tracer *tracer, struct vec2i size, struct drmdev *drmdev, enum pixfmt pixel_format) {
+    struct sw_render_surface *surface;
+    int ok;
+
+    ASSERT_NOT_NULL(drmdev);
+
+    surface = malloc(sizeof *surface);
+    if (surface == NULL) {
+        goto fail_return_null;
+    }
+
+    ok = sw_render_surface_init(surface, tracer, size, drmdev, pixel_format);
+    if (ok != 0) {
+        goto fail_free_surface;
+    }
+
+    return surface;
+
+fail_free_surface:
+    free(surface);
+
+fail_return_null:
+    return NULL;
+}
+
+struct sw_render_surface *sw_render_surface_new_headless(struct tracer *tracer, struct vec2i size) {
+    struct sw_render_surface *surface;
+    int ok;
+
+    surface = malloc(sizeof *surface);
+    if (surface == NULL) {
+        goto fail_return_null;
+    }
+
+    ok = sw_render_surface_init(surface, tracer, size, NULL, PIXFMT_ARGB8888);
+    if (ok != 0) {
+        goto fail_free_surface;
+    }
+
+    return surface;
+
+fail_free_surface:
+    free(surface);
+
+fail_return_null:
+    return NULL;
+}
+
+void sw_render_surface_deinit(struct surface *s) {
+    struct sw_render_surface *sw_surface;
+
+    sw_surface = CAST_THIS(s);
+
+    if (sw_surface->front_fb != NULL) {
+        locked_fb_unrefp(&sw_surface->front_fb);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(sw_surface->fbs); i++) {
+        fb_deinit(sw_surface->fbs + i, sw_surface->drmdev);
+    }
+
+    if (sw_surface->drmdev != NULL) {
+        drmdev_unref(sw_surface->drmdev);
+    }
+
+    render_surface_deinit(s);
+}
+
+static int sw_render_surface_present_kms(struct surface *s, const struct fl_layer_props *props, struct kms_req_builder *builder) {
+    struct sw_render_surface *sw_surface;
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+    struct aa_rect src, dst;
+    struct drm_crtc *crtc;
+    size_t n_damage_clips;
+    struct fb *fb;
+    bool has_damage;
+    int ok;
+
+    sw_surface = CAST_THIS(s);
+
+    // see egl_gbm_render_surface_present_kms
+    if (!fl_layer_props_get_scanout_rects(props, VEC2F(sw_surface->render_surface.size.x, sw_surface->render_surface.size.y), &src, &dst)) {
+        return 0;
+    }
+
+    surface_lock(s);
+
+    ASSERT_NOT_NULL_MSG(
+        sw_surface->front_fb,
+        "There's no framebuffer available for scanout right now. Make sure you called render_surface_queue_present() before presenting."
+    );
+    ASSERT_EQUALS_MSG(
+        sw_surface->drmdev,
+        kms_req_builder_get_drmdev(builder),
+        "Software render surfaces can only be scanned out on the KMS device they were created for."
+    );
+
+    fb = sw_surface->front_fb->fb;
+    if (!fb->has_fb_id) {
+        crtc = kms_req_builder_get_crtc(builder);
+        ASSERT_NOT_NULL(crtc);
+
+        // Same as for GBM surfaces, if there's no plane supporting the format with alpha,
+        // just scan out the opaque equivalent.
+        fb->fb_format = sw_surface->pixel_format;
+        if (!drm_crtc_any_plane_supports_format(sw_surface->drmdev, crtc, fb->fb_format)) {
+            fb->fb_format = pixfmt_opaque(sw_surface->pixel_format);
+        }
+
+        TRACER_BEGIN(sw_surface->surface.tracer, "drmdev_add_fb");
+        fb->fb_id = drmdev_add_fb(
+            sw_surface->drmdev,
+            sw_surface->render_surface.size.x,
+            sw_surface->render_surface.size.y,
+            fb->fb_format,
+            fb->gem_handle,
+            fb->map_pitch,
+            0,
+            false,
+            0
+        );
+        TRACER_END(sw_surface->surface.tracer, "drmdev_add_fb");
+
+        if (fb->fb_id == 0) {
+            LOG_ERROR("Couldn't add dumb buffer as DRM framebuffer.\n");
+            ok = EIO;
+            goto fail_unlock;
+        }
+
+        fb->has_fb_id = true;
+    }
+
+    has_damage = fl_layer_props_get_damage_clips(props, damage_clips, &n_damage_clips);
+
+    TRACER_BEGIN(sw_surface->surface.tracer, "kms_req_builder_push_fb_layer");
+    ok = kms_req_builder_push_fb_layer(
+        builder,
+        &(const struct kms_fb_layer){
+            .drm_fb_id = fb->fb_id,
+            .format = fb->fb_format,
+            .has_modifier = false,
+            .modifier = 0,
+
+            .dst_x = (int32_t) dst.offset.x,
+            .dst_y = (int32_t) dst.offset.y,
+            .dst_w = (uint32_t) dst.size.x,
+            .dst_h = (uint32_t) dst.size.y,
+
+            .src_x = DOUBLE_TO_FP1616_ROUNDED(src.offset.x),
+            .src_y = DOUBLE_TO_FP1616_ROUNDED(src.offset.y),
+            .src_w = DOUBLE_TO_FP1616_ROUNDED(src.size.x),
+            .src_h = DOUBLE_TO_FP1616_ROUNDED(src.size.y),
+
+            // see egl_gbm_render_surface_present_kms
+            .has_rotation = true,
+            .rotation = PLANE_TRANSFORM_ROTATE_0,
+
+            .has_in_fence_fd = false,
+            .in_fence_fd = 0,
+
+            .has_damage = has_damage,
+            .n_damage_clips = n_damage_clips,
+            .damage_clips = damage_clips,
+        },
+        release_locked_fb,
+        NULL,
+        locked_fb_ref(sw_surface->front_fb),
+        NULL
+    );
+    TRACER_END(sw_surface->surface.tracer, "kms_req_builder_push_fb_layer");
+    if (ok != 0) {
+        goto fail_unref_locked_fb;
+    }
+
+    surface_ref(s);
+    surface_unlock(s);
+    return 0;
+
+fail_unref_locked_fb:
+    locked_fb_unref(sw_surface->front_fb);
+
+fail_unlock:
+    surface_unlock(s);
+    return ok;
+}
+
+static int sw_render_surface_fill(struct render_surface *s, FlutterBackingStore *fl_store) {
+    struct sw_render_surface *sw_surface;
+    struct locked_fb *locked_fb;
+    int i, ok;
+
+    sw_surface = CAST_THIS(s);
+
+    surface_lock(CAST_SURFACE_UNCHECKED(s));
+
+    // see vk_gbm_render_surface_fill.
+    // Prefer fbs that are allocated already, so we only allocate the ones we actually need.
+    locked_fb = NULL;
+    for (int pass = 0; pass < 2 && locked_fb == NULL; pass++) {
+        for (i = 0; i < ARRAY_SIZE(sw_surface->locked_fbs); i++) {
+            if (sw_surface->fbs[i].is_allocated != (pass == 0)) {
+                continue;
+            }
+
+            if (atomic_flag_test_and_set(&sw_surface->locked_fbs[i].is_locked) == false) {
+                locked_fb = sw_surface->locked_fbs + i;
+                break;
+            }
+        }
+    }
+
+    if (locked_fb == NULL) {
+        LOG_ERROR("Couldn't find a free framebuffer for software rendering.\n");
+        ok = EBUSY;
+        goto fail_unlock;
+    }
+
+    if (!locked_fb->fb->is_allocated) {
+        TRACER_BEGIN(s->surface.tracer, "fb_allocate");
+        ok = fb_allocate(locked_fb->fb, sw_surface->drmdev, s->size, sw_surface->pixel_format);
+        TRACER_END(s->surface.tracer, "fb_allocate");
+
+        if (ok != 0) {
+            atomic_flag_clear(&locked_fb->is_locked);
+            goto fail_unlock;
+        }
+    }
+
+    locked_fb->surface = CAST_THIS_UNCHECKED(surface_ref(CAST_SURFACE_UNCHECKED(s)));
+    locked_fb->n_refs = REFCOUNT_INIT_1;
+
+    // Flutter's reference on the locked fb (and the surface) is dropped when the backing store is collected.
+    fl_store->type = kFlutterBackingStoreTypeSoftware2;
+    fl_store->software2 = (FlutterSoftwareBackingStore2){
+        .struct_size = sizeof(FlutterSoftwareBackingStore2),
+        .allocation = locked_fb->fb->pixels,
+        .row_bytes = locked_fb->fb->pitch,
+        .height = (size_t) s->size.y,
+        .user_data = locked_fb,
+        .destruction_callback = release_locked_fb,
+        // B, G, R, A in byte order, which is DRM_FORMAT_ARGB8888.
+        .pixel_format = kFlutterSoftwarePixelFormatBGRA8888,
+    };
+
+    surface_unlock(CAST_SURFACE_UNCHECKED(s));
+    return 0;
+
+fail_unlock:
+    surface_unlock(CAST_SURFACE_UNCHECKED(s));
+    return ok;
+}
+
+static int sw_render_surface_queue_present(struct render_surface *s, const FlutterBackingStore *fl_store) {
+    struct sw_render_surface *sw_surface;
+    struct locked_fb *locked_fb;
+
+    sw_surface = CAST_THIS(s);
+
+    ASSERT_EQUALS(fl_store->type, kFlutterBackingStoreTypeSoftware2);
+
+    surface_lock(CAST_SURFACE_UNCHECKED(s));
+
+    // find out which fb flutter rendered into
+    locked_fb = NULL;
+    for (int i = 0; i < ARRAY_SIZE(sw_surface->locked_fbs); i++) {
+        if (sw_surface->fbs[i].is_allocated && sw_surface->fbs[i].pixels == fl_store->software2.allocation) {
+            locked_fb = sw_surface->locked_fbs + i;
+            break;
+        }
+    }
+
+    if (locked_fb == NULL) {
+        LOG_ERROR("The software framebuffer flutter wants to present is not known to this render surface.\n");
+        surface_unlock(CAST_SURFACE_UNCHECKED(s));
+        return EINVAL;
+    }
+
+    // If flutter didn't render anything, the dumb buffer is still up to date.
+    if (fl_store->did_update || locked_fb != sw_surface->front_fb) {
+        if (locked_fb->fb->map != NULL) {
+            TRACER_BEGIN(s->surface.tracer, "sw_render_surface_convert_pixels");
+            sw_render_surface_convert_pixels(
+                sw_surface->pixel_format,
+                locked_fb->fb->map,
+                locked_fb->fb->map_pitch,
+                locked_fb->fb->pixels,
+                locked_fb->fb->pitch,
+                s->size
+            );
+            TRACER_END(s->surface.tracer, "sw_render_surface_convert_pixels");
+        }
+
+        s->surface.revision++;
+    }
+
+    locked_fb_swap_ptrs(&sw_surface->front_fb, locked_fb);
+
+    surface_unlock(CAST_SURFACE_UNCHECKED(s));
+    return 0;
+}
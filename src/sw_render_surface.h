@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Software render surface
+ *
+ * - used as a render target for flutter software (CPU) rendering
+ * - backed by DRM dumb buffers for scanout using KMS,
+ *   or by plain memory for headless (dummy) windows
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_SW_RENDER_SURFACE_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_SW_RENDER_SURFACE_H
+
+#include <stddef.h>
+
+#include "compositor_ng.h"
+#include "pixel_format.h"
+#include "util/collection.h"
+#include "util/geometry.h"
+
+struct tracer;
+struct drmdev;
+struct sw_render_surface;
+
+#define CAST_SW_RENDER_SURFACE_UNCHECKED(ptr) ((struct sw_render_surface *) (ptr))
+#ifdef DEBUG
+    #define CAST_SW_RENDER_SURFACE(ptr) __checked_cast_sw_render_surface(ptr)
+ATTR_PURE struct sw_render_surface *__checked_cast_sw_render_surface(void *ptr);
+#else
+    #define CAST_SW_RENDER_SURFACE(ptr) CAST_SW_RENDER_SURFACE_UNCHECKED(ptr)
+#endif
+
+/**
+ * @brief The maximum number of buffers of a software render surface.
+ *
+ * Buffers are allocated on first use. With a single flutter layer, one buffer
+ * is on screen, one is queued for the next page flip and one is being rendered into,
+ * so the steady state is triple buffering.
+ */
+#define SW_RENDER_SURFACE_MAX_BUFFERS 4
+
+/**
+ * @brief Creates a new software render surface that can be scanned out on @a drmdev.
+ *
+ * Flutter renders into cached system memory, which is copied (and converted,
+ * if @a pixel_format isn't ARGB8888 / XRGB8888) into a DRM dumb buffer when
+ * the frame is queued for presenting. Dumb buffers are usually mapped write-combined,
+ * so letting skia blend directly into them would be very slow.
+ */
+struct sw_render_surface *sw_render_surface_new(struct tracer *tracer, struct vec2i size, struct drmdev *drmdev, enum pixfmt pixel_format);
+
+/**
+ * @brief Creates a new software render surface that's only backed by memory, for headless windows.
+ *
+ * The pixel format is always ARGB8888.
+ */
+struct sw_render_surface *sw_render_surface_new_headless(struct tracer *tracer, struct vec2i size);
+
+/**
+ * @brief Converts pixels in ARGB8888 (the format flutter renders into) to @a format.
+ *
+ * Both ARGB8888 and @a format are the DRM definitions, i.e. little-endian packed.
+ * @a src and @a dst must not overlap.
+ */
+void sw_render_surface_convert_pixels(
+    enum pixfmt format,
+    void *dst,
+    size_t dst_pitch,
+    const void *src,
+    size_t src_pitch,
+    struct vec2i size
+);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_SW_RENDER_SURFACE_H
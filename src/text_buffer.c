@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Text buffer
+ *
+ * See text_buffer.h for details.
+ */
+
+#include "text_buffer.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/asserts.h"
+#include "util/macros.h"
+
+#define TEXT_BUFFER_MIN_CAPACITY 64
+
+static inline size_t utf8_symbol_length(uint8_t c) {
+    // Continuation bytes and invalid lead bytes are treated as single-byte symbols,
+    // so we never get stuck on invalid UTF-8.
+    if ((c & 0b11111000) == 0b11110000) {
+        return 4;
+    } else if ((c & 0b11110000) == 0b11100000) {
+        return 3;
+    } else if ((c & 0b11100000) == 0b11000000) {
+        return 2;
+    }
+    return 1;
+}
+
+static inline size_t utf16_symbol_length(uint8_t c) {
+    // Only code points outside of the BMP (4 byte UTF-8 sequences) need a surrogate pair.
+    return utf8_symbol_length(c) == 4 ? 2 : 1;
+}
+
+static inline bool is_utf8_continuation(uint8_t c) {
+    return (c & 0b11000000) == 0b10000000;
+}
+
+static inline size_t gap_length(const struct text_buffer *buffer) {
+    return buffer->gap_end - buffer->gap_start;
+}
+
+static inline size_t byte_length(const struct text_buffer *buffer) {
+    return buffer->capacity - gap_length(buffer);
+}
+
+static inline uint8_t byte_at(const struct text_buffer *buffer, size_t offset) {
+    return (uint8_t) buffer->data[offset < buffer->gap_start ? offset : offset + gap_length(buffer)];
+}
+
+static size_t count_utf16(const char *text, size_t length) {
+    size_t n, i;
+
+    n = 0;
+    for (i = 0; i < length; i += utf8_symbol_length((uint8_t) text[i])) {
+        n += utf16_symbol_length((uint8_t) text[i]);
+    }
+
+    return n;
+}
+
+void text_buffer_init(struct text_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+    memset(buffer, 0, sizeof *buffer);
+}
+
+void text_buffer_deinit(struct text_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+    free(buffer->data);
+    memset(buffer, 0, sizeof *buffer);
+}
+
+/**
+ * @brief Finds the byte offset of the UTF-16 offset @a utf16, starting at the known
+ * position that's closest to it.
+ *
+ * @a utf16 is rounded down to the start of its code point, the rounded offset is
+ * returned in @a utf16_out.
+ */
+static size_t find_byte_offset(struct text_buffer *buffer, size_t utf16, size_t *utf16_out) {
+    size_t anchors[4][2] = {
+        { 0, 0 },
+        { buffer->gap_start, buffer->gap_utf16 },
+        { buffer->cached_byte, buffer->cached_utf16 },
+        { byte_length(buffer), buffer->utf16_length },
+    };
+    size_t byte, current, distance, best_distance;
+    uint8_t c;
+
+    utf16 = MIN2(utf16, buffer->utf16_length);
+
+    byte = 0;
+    current = 0;
+    best_distance = SIZE_MAX;
+    for (size_t i = 0; i < ARRAY_SIZE(anchors); i++) {
+        distance = anchors[i][1] > utf16 ? anchors[i][1] - utf16 : utf16 - anchors[i][1];
+        if (distance < best_distance) {
+            byte = anchors[i][0];
+            current = anchors[i][1];
+            best_distance = distance;
+        }
+    }
+
+    // With invalid UTF-8, the UTF-16 length might not match the bytes exactly, so never walk past the text.
+    while (current < utf16 && byte < byte_length(buffer)) {
+        c = byte_at(buffer, byte);
+        if (current + utf16_symbol_length(c) > utf16) {
+            // utf16 points into the middle of a surrogate pair.
+            break;
+        }
+
+        current += utf16_symbol_length(c);
+        byte = MIN2(byte + utf8_symbol_length(c), byte_length(buffer));
+    }
+
+    while (current > utf16 && byte > 0) {
+        // step back to the start of the previous code point.
+        byte--;
+        for (int i = 0; i < 3 && byte > 0 && is_utf8_continuation(byte_at(buffer, byte)); i++) {
+            byte--;
+        }
+
+        current -= MIN2(utf16_symbol_length(byte_at(buffer, byte)), current);
+    }
+
+    buffer->cached_byte = byte;
+    buffer->cached_utf16 = current;
+
+    if (utf16_out != NULL) {
+        *utf16_out = current;
+    }
+    return byte;
+}
+
+static void move_gap(struct text_buffer *buffer, size_t byte, size_t utf16) {
+    size_t length = gap_length(buffer);
+
+    if (byte < buffer->gap_start) {
+        memmove(buffer->data + byte + length, buffer->data + byte, buffer->gap_start - byte);
+    } else if (byte > buffer->gap_start) {
+        memmove(buffer->data + buffer->gap_start, buffer->data + buffer->gap_end, byte - buffer->gap_start);
+    }
+
+    buffer->gap_start = byte;
+    buffer->gap_end = byte + length;
+    buffer->gap_utf16 = utf16;
+}
+
+static int grow_gap(struct text_buffer *buffer, size_t min_gap_length) {
+    size_t capacity, tail_length;
+    char *data;
+
+    if (gap_length(buffer) >= min_gap_length) {
+        return 0;
+    }
+
+    capacity = MAX2(MAX2(buffer->capacity * 2, byte_length(buffer) + min_gap_length), TEXT_BUFFER_MIN_CAPACITY);
+
+    data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    tail_length = buffer->capacity - buffer->gap_end;
+    memmove(data + capacity - tail_length, data + buffer->gap_end, tail_length);
+
+    buffer->data = data;
+    buffer->gap_end = capacity - tail_length;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int text_buffer_replace(struct text_buffer *buffer, size_t start, size_t end, const char *text, size_t length) {
+    size_t start_byte, end_byte, n_inserted;
+    int ok;
+
+    ASSERT_NOT_NULL(buffer);
+    ASSERT(text != NULL || length == 0);
+
+    if (start > end) {
+        size_t tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    start_byte = find_byte_offset(buffer, start, &start);
+    end_byte = find_byte_offset(buffer, end, &end);
+
+    // The replaced text becomes part of the gap. Keep one byte for the null-terminator
+    // in text_buffer_get_text. Grow first, so the text is unchanged if that fails.
+    if (length + 1 > end_byte - start_byte) {
+        ok = grow_gap(buffer, length + 1 - (end_byte - start_byte));
+        if (ok != 0) {
+            return ok;
+        }
+    }
+
+    move_gap(buffer, start_byte, start);
+
+    buffer->gap_end += end_byte - start_byte;
+    buffer->utf16_length -= end - start;
+
+    n_inserted = count_utf16(text, length);
+
+    memcpy(buffer->data + buffer->gap_start, text, length);
+    buffer->gap_start += length;
+    buffer->gap_utf16 += n_inserted;
+    buffer->utf16_length += n_inserted;
+
+    buffer->cached_byte = buffer->gap_start;
+    buffer->cached_utf16 = buffer->gap_utf16;
+    return 0;
+}
+
+int text_buffer_set_text(struct text_buffer *buffer, const char *text, size_t length) {
+    ASSERT_NOT_NULL(buffer);
+
+    buffer->gap_start = 0;
+    buffer->gap_end = buffer->capacity;
+    buffer->utf16_length = 0;
+    buffer->gap_utf16 = 0;
+    buffer->cached_byte = 0;
+    buffer->cached_utf16 = 0;
+
+    return text_buffer_replace(buffer, 0, 0, text, length);
+}
+
+size_t text_buffer_get_prev_boundary(struct text_buffer *buffer, size_t offset) {
+    ASSERT_NOT_NULL(buffer);
+
+    offset = MIN2(offset, buffer->utf16_length);
+    if (offset == 0) {
+        return 0;
+    }
+
+    // If offset - 1 is in the middle of a surrogate pair, it's rounded down to its start.
+    find_byte_offset(buffer, offset - 1, &offset);
+    return offset;
+}
+
+size_t text_buffer_get_next_boundary(struct text_buffer *buffer, size_t offset) {
+    size_t byte;
+
+    ASSERT_NOT_NULL(buffer);
+
+    byte = find_byte_offset(buffer, offset, &offset);
+    if (offset >= buffer->utf16_length) {
+        return buffer->utf16_length;
+    }
+
+    return offset + utf16_symbol_length(byte_at(buffer, byte));
+}
+
+const char *text_buffer_get_text(struct text_buffer *buffer) {
+    ASSERT_NOT_NULL(buffer);
+
+    if (buffer->data == NULL) {
+        return "";
+    }
+
+    move_gap(buffer, byte_length(buffer), buffer->utf16_length);
+
+    // There's always at least one byte of gap, see text_buffer_replace.
+    buffer->data[buffer->gap_start] = '\0';
+    return buffer->data;
+}
+
+void text_buffer_get_segments(
+    const struct text_buffer *buffer,
+    const char **before_out,
+    size_t *before_length_out,
+    const char **after_out,
+    size_t *after_length_out
+) {
+    ASSERT_NOT_NULL(buffer);
+    ASSERT_NOT_NULL(before_out);
+    ASSERT_NOT_NULL(before_length_out);
+    ASSERT_NOT_NULL(after_out);
+    ASSERT_NOT_NULL(after_length_out);
+
+    if (buffer->data == NULL) {
+        *before_out = *after_out = "";
+        *before_length_out = *after_length_out = 0;
+        return;
+    }
+
+    *before_out = buffer->data;
+    *before_length_out = buffer->gap_start;
+    *after_out = buffer->data + buffer->gap_end;
+    *after_length_out = buffer->capacity - buffer->gap_end;
+}
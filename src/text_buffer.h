@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Text buffer - A gap buffer of UTF-8 text, addressed in UTF-16 code units
+ * like flutter's TextEditingValue.
+ *
+ * Edits happen at the gap, so typing or deleting at the same place only moves
+ * the text between the previous and the new edit position, instead of
+ * everything behind it. UTF-16 offsets are converted to byte offsets by
+ * walking from the nearest known position (the start, the end, the gap or
+ * the last converted offset), so that's cheap near the last edit too.
+ *
+ * A zero-initialized text buffer is a valid, empty text buffer.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_TEXT_BUFFER_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_TEXT_BUFFER_H
+
+#include <stddef.h>
+
+struct text_buffer {
+    /// The text before the gap is in [0, gap_start), the text after the gap in [gap_end, capacity).
+    char *data;
+    size_t capacity;
+    size_t gap_start, gap_end;
+
+    /// The UTF-16 length of the whole text.
+    size_t utf16_length;
+
+    /// The UTF-16 offset of the gap.
+    size_t gap_utf16;
+
+    /// The last converted offset, as byte offset (ignoring the gap) and UTF-16 offset.
+    size_t cached_byte, cached_utf16;
+};
+
+void text_buffer_init(struct text_buffer *buffer);
+
+void text_buffer_deinit(struct text_buffer *buffer);
+
+/**
+ * @brief Replaces the whole text with the first @a length bytes of the UTF-8 string @a text.
+ */
+int text_buffer_set_text(struct text_buffer *buffer, const char *text, size_t length);
+
+/**
+ * @brief Replaces the text between the UTF-16 offsets @a start and @a end with the first
+ * @a length bytes of the UTF-8 string @a text.
+ *
+ * Offsets are clamped to the text, and rounded down if they point into the middle of a surrogate pair.
+ */
+int text_buffer_replace(struct text_buffer *buffer, size_t start, size_t end, const char *text, size_t length);
+
+/**
+ * @brief Returns the length of the text in UTF-16 code units.
+ */
+static inline size_t text_buffer_get_length(const struct text_buffer *buffer) {
+    return buffer->utf16_length;
+}
+
+/**
+ * @brief Returns the UTF-16 offset of the character before @a offset, or 0 if there's none.
+ */
+size_t text_buffer_get_prev_boundary(struct text_buffer *buffer, size_t offset);
+
+/**
+ * @brief Returns the UTF-16 offset of the character after @a offset, or the text length if there's none.
+ */
+size_t text_buffer_get_next_boundary(struct text_buffer *buffer, size_t offset);
+
+/**
+ * @brief Returns the whole text as a null-terminated UTF-8 string.
+ *
+ * This closes the gap by moving it to the end of the text, which copies everything behind the gap.
+ * Use @ref text_buffer_get_segments where the text doesn't need to be contiguous.
+ * The string is only valid until the text buffer is modified the next time.
+ */
+const char *text_buffer_get_text(struct text_buffer *buffer);
+
+/**
+ * @brief Gets the text as the two parts before and after the gap, without moving the gap.
+ *
+ * Neither part is null-terminated. Both are only valid until the text buffer is modified the next time.
+ */
+void text_buffer_get_segments(
+    const struct text_buffer *buffer,
+    const char **before_out,
+    size_t *before_length_out,
+    const char **after_out,
+    size_t *after_length_out
+);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_TEXT_BUFFER_H
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Touch resampler
+ *
+ * See touch_resampler.h for how resampling works.
+ */
+
+#include "touch_resampler.h"
+
+#include "util/asserts.h"
+#include "util/collection.h"
+
+void touch_resampler_reset(struct touch_resampler *resampler, struct touch_sample sample) {
+    ASSERT_NOT_NULL(resampler);
+
+    resampler->samples[1] = sample;
+    resampler->n_samples = 1;
+    resampler->has_pending = false;
+    resampler->is_interpolated = false;
+    resampler->last_taken_us = sample.timestamp_us;
+}
+
+void touch_resampler_add_sample(struct touch_resampler *resampler, struct touch_sample sample) {
+    ASSERT_NOT_NULL(resampler);
+
+    resampler->samples[0] = resampler->samples[1];
+    resampler->samples[1] = sample;
+    resampler->n_samples = MIN2(resampler->n_samples + 1, 2);
+    resampler->has_pending = true;
+    resampler->is_interpolated = false;
+}
+
+static bool resample(const struct touch_resampler *resampler, uint64_t target_us, struct touch_sample *sample_out) {
+    const struct touch_sample *a, *b;
+    uint64_t delta_us, max_prediction_us;
+    float alpha;
+
+    if (resampler->n_samples < 2) {
+        return false;
+    }
+
+    a = resampler->samples + 0;
+    b = resampler->samples + 1;
+
+    if (b->timestamp_us <= a->timestamp_us) {
+        return false;
+    }
+
+    delta_us = b->timestamp_us - a->timestamp_us;
+
+    if (target_us > b->timestamp_us) {
+        // extrapolate, but not too far.
+        if (delta_us < TOUCH_RESAMPLER_MIN_DELTA_US || delta_us > TOUCH_RESAMPLER_MAX_DELTA_US) {
+            return false;
+        }
+
+        max_prediction_us = MIN2(delta_us / 2, TOUCH_RESAMPLER_MAX_PREDICTION_US);
+        target_us = MIN2(target_us, b->timestamp_us + max_prediction_us);
+    } else if (target_us < a->timestamp_us) {
+        // we don't know where the touch point was back then.
+        return false;
+    }
+
+    alpha = (float) (int64_t) (target_us - a->timestamp_us) / (float) delta_us;
+
+    sample_out->timestamp_us = target_us;
+    sample_out->pos = VEC2F(a->pos.x + (b->pos.x - a->pos.x) * alpha, a->pos.y + (b->pos.y - a->pos.y) * alpha);
+    return true;
+}
+
+struct touch_sample touch_resampler_take(struct touch_resampler *resampler, bool should_resample, uint64_t target_us) {
+    struct touch_sample sample;
+
+    ASSERT_NOT_NULL(resampler);
+    assert(resampler->has_pending);
+
+    if (should_resample && !resampler->is_interpolated && resample(resampler, target_us, &sample)) {
+        // If we interpolated between the last two samples, the latest one is still
+        // pending. It'll be taken out as-is next time, unless a new sample arrives first.
+        resampler->is_interpolated = sample.timestamp_us < resampler->samples[1].timestamp_us;
+        resampler->has_pending = resampler->is_interpolated;
+    } else {
+        sample = resampler->samples[1];
+        resampler->is_interpolated = false;
+        resampler->has_pending = false;
+    }
+
+    // Interpolating can go back in time relative to the last sample we took out.
+    if (sample.timestamp_us < resampler->last_taken_us) {
+        sample.timestamp_us = resampler->last_taken_us;
+    }
+
+    resampler->last_taken_us = sample.timestamp_us;
+    return sample;
+}
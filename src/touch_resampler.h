@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Touch resampler - coalesces the motion samples of a single touch point
+ * and resamples its position to a target time (usually shortly before the
+ * next vblank), so flutter gets one evenly spaced move event per frame
+ * instead of bursts of raw digitizer samples.
+ *
+ * Resampling interpolates between (or extrapolates from) the last two
+ * samples, like the android input resampler:
+ *
+ *   - if the target time is between the last two samples, the position is
+ *     linearly interpolated between them.
+ *   - if it's after the last sample, the position is extrapolated, but at most
+ *     half the interval between the last two samples and at most
+ *     TOUCH_RESAMPLER_MAX_PREDICTION_US into the future.
+ *   - if the samples are too close together or too far apart, the latest
+ *     sample is used as-is.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_TOUCH_RESAMPLER_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_TOUCH_RESAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/geometry.h"
+
+/**
+ * @brief How long before the next vblank touch events should be resampled to and sent to flutter.
+ */
+#define TOUCH_RESAMPLER_LATENCY_US 5000
+
+/**
+ * @brief Samples closer together than this are too noisy to extrapolate from.
+ */
+#define TOUCH_RESAMPLER_MIN_DELTA_US 2000
+
+/**
+ * @brief Samples further apart than this are too old to extrapolate from.
+ */
+#define TOUCH_RESAMPLER_MAX_DELTA_US 20000
+
+/**
+ * @brief The maximum time the position is extrapolated past the latest sample.
+ */
+#define TOUCH_RESAMPLER_MAX_PREDICTION_US 8000
+
+struct touch_sample {
+    /// CLOCK_MONOTONIC microseconds, like libinput & flutter pointer event timestamps.
+    uint64_t timestamp_us;
+    struct vec2f pos;
+};
+
+struct touch_resampler {
+    /// The last two samples, the latest one in samples[1].
+    struct touch_sample samples[2];
+    int n_samples;
+
+    /// True if samples[1] wasn't sent to flutter yet.
+    bool has_pending;
+
+    /// True if a position interpolated between samples[0] and samples[1]
+    /// was taken out, so samples[1] should be taken out as-is next.
+    bool is_interpolated;
+
+    /// The timestamp of the last sample taken out of the resampler,
+    /// so timestamps never go backwards.
+    uint64_t last_taken_us;
+};
+
+/**
+ * @brief Starts tracking a new touch point that went down at @a sample.
+ * The down event itself isn't pending, it's sent to flutter right away.
+ */
+void touch_resampler_reset(struct touch_resampler *resampler, struct touch_sample sample);
+
+/**
+ * @brief Adds a new motion sample. It replaces (coalesces) any other pending sample.
+ */
+void touch_resampler_add_sample(struct touch_resampler *resampler, struct touch_sample sample);
+
+static inline bool touch_resampler_has_pending(const struct touch_resampler *resampler) {
+    return resampler->has_pending;
+}
+
+/**
+ * @brief Takes out the pending motion sample.
+ *
+ * If the resampled position was interpolated between the last two samples, the latest
+ * sample is still pending afterwards, and will be taken out unchanged the next time.
+ *
+ * @param resample If true, the position is resampled to @a target_us. Otherwise, the latest
+ * sample is returned as-is.
+ * @param target_us The time to resample to.
+ */
+struct touch_sample touch_resampler_take(struct touch_resampler *resampler, bool resample, uint64_t target_us);
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_TOUCH_RESAMPLER_H
@@ -2,20 +2,72 @@
 /*
  * Tracer - simple event tracing based on flutter event tracing interface
  *
+ * Events can also be recorded into per-thread ring buffers. Every thread only ever writes
+ * into its own buffer, so recording an event is just a timestamp and a few stores, without
+ * any locking. The buffers are only locked for registering a new thread and for exporting.
+ * The buffer of a thread that has exited is freed (or handed to a new thread) as soon as
+ * all of its events have been exported.
+ *
  * Copyright (c) 2022, Hannes Winkler <hanneswinkler2000@web.de>
  */
 
+#define _GNU_SOURCE
 #include "tracer.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <flutter_embedder.h>
 
 #include "util/asserts.h"
 #include "util/collection.h"
+#include "util/list.h"
+#include "util/lock_ops.h"
 #include "util/logging.h"
 #include "util/refcounting.h"
 
+struct trace_event {
+    uint64_t timestamp_ns;
+    const char *name;
+    enum trace_event_type type;
+};
+
+/// Shared between a thread and every buffer it recorded into, so the tracers can tell
+/// when the thread has exited without the thread having to touch the tracers.
+struct thread_state {
+    refcount_t n_refs;
+    atomic_bool exited;
+};
+
+static void thread_state_destroy(struct thread_state *state) {
+    free(state);
+}
+
+DEFINE_STATIC_REF_OPS(thread_state, n_refs)
+
+struct thread_buffer {
+    struct list_head entry;
+
+    struct thread_state *thread;
+    pid_t tid;
+    char thread_name[16];
+
+    /// The value of @ref n_written at the last export.
+    /// Only accessed with the tracer lock held.
+    uint64_t n_exported;
+
+    /// The total number of events ever written into this buffer.
+    /// Only written by the thread owning the buffer.
+    atomic_uint_fast64_t n_written;
+
+    struct trace_event events[TRACER_N_EVENTS_PER_THREAD];
+};
+
 struct tracer {
     refcount_t n_refs;
     atomic_bool has_cbs;
@@ -24,9 +76,88 @@ struct tracer {
     FlutterEngineTraceEventInstantFnPtr trace_instant;
 
     atomic_bool logged_discarded_events;
+
+    /// Unique for every tracer ever created, so the thread-local buffer cache
+    /// can't confuse a new tracer with a destroyed one at the same address.
+    uint64_t id;
+    atomic_bool is_recording;
+
+    pthread_mutex_t lock;
+    struct list_head buffers;
+
+    /// Names copied by @ref tracer_intern_name. Separate from @ref lock so
+    /// interning a name doesn't have to wait for an export to finish.
+    pthread_mutex_t names_lock;
+    struct list_head names;
 };
 
-struct tracer *tracer_new_with_cbs(
+struct interned_name {
+    struct list_head entry;
+    char name[];
+};
+
+DEFINE_STATIC_LOCK_OPS(tracer, lock)
+
+static atomic_uint_fast64_t next_tracer_id = 1;
+
+/// The buffer the calling thread last recorded into, and the tracer it belongs to.
+static _Thread_local struct {
+    uint64_t tracer_id;
+    struct thread_buffer *buffer;
+} thread_buffer_cache;
+
+static _Thread_local struct thread_state *current_thread_state = NULL;
+
+static pthread_once_t thread_state_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_state_key;
+
+static void on_thread_exit(void *userdata) {
+    struct thread_state *state = userdata;
+
+    atomic_store(&state->exited, true);
+    thread_state_unref(state);
+
+    // Other thread-local destructors might still record events after this one.
+    // Make sure those go into a fresh buffer instead of one that's about to be freed.
+    current_thread_state = NULL;
+    thread_buffer_cache.tracer_id = 0;
+    thread_buffer_cache.buffer = NULL;
+}
+
+static void create_thread_state_key(void) {
+    ASSERTED int ok;
+
+    ok = pthread_key_create(&thread_state_key, on_thread_exit);
+    ASSERT_ZERO(ok);
+}
+
+static struct thread_state *get_current_thread_state(void) {
+    struct thread_state *state;
+
+    if (current_thread_state != NULL) {
+        return current_thread_state;
+    }
+
+    state = malloc(sizeof *state);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    state->n_refs = REFCOUNT_INIT_1;
+    state->exited = false;
+
+    pthread_once(&thread_state_key_once, create_thread_state_key);
+    if (pthread_setspecific(thread_state_key, state) != 0) {
+        free(state);
+        return NULL;
+    }
+
+    current_thread_state = state;
+    return state;
+}
+
+static struct tracer *tracer_new(
+    bool has_cbs,
     FlutterEngineTraceEventDurationBeginFnPtr trace_begin,
     FlutterEngineTraceEventDurationEndFnPtr trace_end,
     FlutterEngineTraceEventInstantFnPtr trace_instant
@@ -39,35 +170,33 @@ struct tracer *tracer_new_with_cbs(
     }
 
     tracer->n_refs = REFCOUNT_INIT_1;
-    tracer->has_cbs = true;
+    tracer->has_cbs = has_cbs;
     tracer->trace_begin = trace_begin;
     tracer->trace_end = trace_end;
     tracer->trace_instant = trace_instant;
     tracer->logged_discarded_events = false;
+    tracer->id = atomic_fetch_add(&next_tracer_id, 1);
+    tracer->is_recording = false;
+    pthread_mutex_init(&tracer->lock, NULL);
+    list_inithead(&tracer->buffers);
+    pthread_mutex_init(&tracer->names_lock, NULL);
+    list_inithead(&tracer->names);
     return tracer;
 
 fail_return_null:
     return NULL;
 }
 
-struct tracer *tracer_new_with_stubs() {
-    struct tracer *tracer;
-
-    tracer = malloc(sizeof *tracer);
-    if (tracer == NULL) {
-        goto fail_return_null;
-    }
-
-    tracer->n_refs = REFCOUNT_INIT_1;
-    tracer->has_cbs = false;
-    tracer->trace_begin = NULL;
-    tracer->trace_end = NULL;
-    tracer->trace_instant = NULL;
-    tracer->logged_discarded_events = false;
-    return tracer;
+struct tracer *tracer_new_with_cbs(
+    FlutterEngineTraceEventDurationBeginFnPtr trace_begin,
+    FlutterEngineTraceEventDurationEndFnPtr trace_end,
+    FlutterEngineTraceEventInstantFnPtr trace_instant
+) {
+    return tracer_new(true, trace_begin, trace_end, trace_instant);
+}
 
-fail_return_null:
-    return NULL;
+struct tracer *tracer_new_with_stubs() {
+    return tracer_new(false, NULL, NULL, NULL);
 }
 
 void tracer_set_cbs(
@@ -86,6 +215,17 @@ void tracer_set_cbs(
 }
 
 void tracer_destroy(struct tracer *tracer) {
+    list_for_each_entry_safe(struct thread_buffer, buffer, &tracer->buffers, entry) {
+        list_del(&buffer->entry);
+        thread_state_unref(buffer->thread);
+        free(buffer);
+    }
+    list_for_each_entry_safe(struct interned_name, name, &tracer->names, entry) {
+        list_del(&name->entry);
+        free(name);
+    }
+    pthread_mutex_destroy(&tracer->names_lock);
+    pthread_mutex_destroy(&tracer->lock);
     free(tracer);
 }
 
@@ -101,6 +241,7 @@ static void log_discarded_event(struct tracer *tracer, const char *name) {
 void __tracer_begin(struct tracer *tracer, const char *name) {
     ASSERT_NOT_NULL(tracer);
     ASSERT_NOT_NULL(name);
+    __tracer_record(tracer, kBegin_TraceEventType, name);
     if (atomic_load(&tracer->has_cbs)) {
         tracer->trace_begin(name);
     } else {
@@ -111,6 +252,7 @@ void __tracer_begin(struct tracer *tracer, const char *name) {
 void __tracer_end(struct tracer *tracer, const char *name) {
     ASSERT_NOT_NULL(tracer);
     ASSERT_NOT_NULL(name);
+    __tracer_record(tracer, kEnd_TraceEventType, name);
     if (atomic_load(&tracer->has_cbs)) {
         tracer->trace_end(name);
     } else {
@@ -121,9 +263,490 @@ void __tracer_end(struct tracer *tracer, const char *name) {
 void __tracer_instant(struct tracer *tracer, const char *name) {
     ASSERT_NOT_NULL(tracer);
     ASSERT_NOT_NULL(name);
+    __tracer_record(tracer, kInstant_TraceEventType, name);
     if (atomic_load(&tracer->has_cbs)) {
         tracer->trace_instant(name);
     } else {
         log_discarded_event(tracer, name);
     }
 }
+
+const char *tracer_intern_name(struct tracer *tracer, const char *name) {
+    struct interned_name *interned;
+    const char *result;
+    size_t length;
+
+    ASSERT_NOT_NULL(tracer);
+    ASSERT_NOT_NULL(name);
+
+    pthread_mutex_lock(&tracer->names_lock);
+
+    result = NULL;
+    list_for_each_entry(struct interned_name, iter, &tracer->names, entry) {
+        if (streq(iter->name, name)) {
+            result = iter->name;
+            break;
+        }
+    }
+
+    if (result == NULL) {
+        length = strlen(name);
+
+        interned = malloc(sizeof *interned + length + 1);
+        if (interned != NULL) {
+            memcpy(interned->name, name, length + 1);
+            list_add(&interned->entry, &tracer->names);
+            result = interned->name;
+        }
+    }
+
+    pthread_mutex_unlock(&tracer->names_lock);
+
+    return result;
+}
+
+/// Whether @a buffer belongs to a thread that has exited and all of its events were exported,
+/// so it can be freed or reused without losing anything.
+static bool is_buffer_flushed_locked(struct thread_buffer *buffer) {
+    return atomic_load(&buffer->thread->exited) && buffer->n_exported == atomic_load(&buffer->n_written);
+}
+
+static struct thread_buffer *get_thread_buffer_slow(struct tracer *tracer) {
+    struct thread_buffer *buffer;
+    struct thread_state *state;
+
+    state = get_current_thread_state();
+    if (state == NULL) {
+        return NULL;
+    }
+
+    tracer_lock(tracer);
+
+    buffer = NULL;
+    list_for_each_entry(struct thread_buffer, iter, &tracer->buffers, entry) {
+        if (iter->thread == state) {
+            buffer = iter;
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        // Reuse the buffer of an exited thread if there's one, so threads that come and go
+        // don't each leave a buffer behind.
+        list_for_each_entry(struct thread_buffer, iter, &tracer->buffers, entry) {
+            if (is_buffer_flushed_locked(iter)) {
+                buffer = iter;
+                list_del(&buffer->entry);
+                thread_state_unref(buffer->thread);
+                break;
+            }
+        }
+
+        if (buffer == NULL) {
+            buffer = malloc(sizeof *buffer);
+            if (buffer == NULL) {
+                tracer_unlock(tracer);
+                return NULL;
+            }
+        }
+
+        buffer->thread = thread_state_ref(state);
+        buffer->tid = syscall(SYS_gettid);
+        buffer->n_exported = 0;
+        atomic_init(&buffer->n_written, 0);
+        list_addtail(&buffer->entry, &tracer->buffers);
+    }
+
+    // The thread might have been renamed since it last got here.
+    if (pthread_getname_np(pthread_self(), buffer->thread_name, sizeof buffer->thread_name) != 0) {
+        buffer->thread_name[0] = '\0';
+    }
+
+    tracer_unlock(tracer);
+
+    thread_buffer_cache.tracer_id = tracer->id;
+    thread_buffer_cache.buffer = buffer;
+    return buffer;
+}
+
+void __tracer_record(struct tracer *tracer, enum trace_event_type type, const char *name) {
+    struct thread_buffer *buffer;
+    struct trace_event *event;
+    uint64_t n_written;
+
+    if (!atomic_load_explicit(&tracer->is_recording, memory_order_relaxed)) {
+        return;
+    }
+
+    if (thread_buffer_cache.tracer_id == tracer->id) {
+        buffer = thread_buffer_cache.buffer;
+    } else {
+        buffer = get_thread_buffer_slow(tracer);
+        if (buffer == NULL) {
+            return;
+        }
+    }
+
+    n_written = atomic_load_explicit(&buffer->n_written, memory_order_relaxed);
+
+    event = buffer->events + (n_written % TRACER_N_EVENTS_PER_THREAD);
+    event->timestamp_ns = get_monotonic_time();
+    event->name = name;
+    event->type = type;
+
+    atomic_store_explicit(&buffer->n_written, n_written + 1, memory_order_release);
+}
+
+void tracer_start_recording(struct tracer *tracer) {
+    ASSERT_NOT_NULL(tracer);
+    atomic_store(&tracer->is_recording, true);
+}
+
+void tracer_stop_recording(struct tracer *tracer) {
+    ASSERT_NOT_NULL(tracer);
+    atomic_store(&tracer->is_recording, false);
+}
+
+bool tracer_is_recording(struct tracer *tracer) {
+    ASSERT_NOT_NULL(tracer);
+    return atomic_load(&tracer->is_recording);
+}
+
+/**
+ * @brief Copies the events still in @a buffer into @a events_out, oldest first.
+ *
+ * The owning thread might be recording concurrently. Events it could've overwritten
+ * while we were copying are discarded.
+ */
+static size_t copy_thread_buffer(struct thread_buffer *buffer, struct trace_event *events_out, uint64_t *end_out) {
+    uint64_t start, end, end_after;
+
+    end = atomic_load_explicit(&buffer->n_written, memory_order_acquire);
+    *end_out = end;
+    start = end > TRACER_N_EVENTS_PER_THREAD ? end - TRACER_N_EVENTS_PER_THREAD : 0;
+
+    for (uint64_t i = start; i < end; i++) {
+        events_out[i - start] = buffer->events[i % TRACER_N_EVENTS_PER_THREAD];
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    end_after = atomic_load_explicit(&buffer->n_written, memory_order_relaxed);
+
+    // The writer might be in the middle of writing event number end_after.
+    if (end_after + 1 > start + TRACER_N_EVENTS_PER_THREAD) {
+        uint64_t n_discarded = MIN2(end_after + 1 - TRACER_N_EVENTS_PER_THREAD - start, end - start);
+
+        memmove(events_out, events_out + n_discarded, (end - start - n_discarded) * sizeof *events_out);
+        return end - start - n_discarded;
+    }
+
+    return end - start;
+}
+
+static void write_json_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+            fputc(*str, file);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(file, "\\u%04x", (unsigned char) *str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void write_chrome_json_thread(FILE *file, pid_t pid, struct thread_buffer *buffer, const struct trace_event *events, size_t n_events) {
+    static const char *const phases[] = {
+        [kBegin_TraceEventType] = "B",
+        [kEnd_TraceEventType] = "E",
+        [kInstant_TraceEventType] = "i",
+    };
+
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, buffer->tid);
+    write_json_string(file, buffer->thread_name);
+    fprintf(file, "}}");
+
+    for (size_t i = 0; i < n_events; i++) {
+        fprintf(file, ",\n{\"name\":");
+        write_json_string(file, events[i].name);
+        fprintf(
+            file,
+            ",\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d%s}",
+            phases[events[i].type],
+            events[i].timestamp_ns / 1000,
+            (unsigned) (events[i].timestamp_ns % 1000),
+            pid,
+            buffer->tid,
+            events[i].type == kInstant_TraceEventType ? ",\"s\":\"t\"" : ""
+        );
+    }
+}
+
+/*
+ * Just enough of the protobuf wire format to write perfetto traces.
+ * See https://perfetto.dev/docs/reference/trace-packet-proto for the message definitions.
+ */
+struct pb_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+};
+
+#define PB_WIRE_TYPE_VARINT 0
+#define PB_WIRE_TYPE_LENGTH_DELIMITED 2
+
+#define PERFETTO_TRACE_PACKET 1
+
+#define PERFETTO_TRACE_PACKET_TIMESTAMP 8
+#define PERFETTO_TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID 10
+#define PERFETTO_TRACE_PACKET_TRACK_EVENT 11
+#define PERFETTO_TRACE_PACKET_TIMESTAMP_CLOCK_ID 58
+#define PERFETTO_TRACE_PACKET_TRACK_DESCRIPTOR 60
+
+#define PERFETTO_TRACK_DESCRIPTOR_UUID 1
+#define PERFETTO_TRACK_DESCRIPTOR_THREAD 4
+
+#define PERFETTO_THREAD_DESCRIPTOR_PID 1
+#define PERFETTO_THREAD_DESCRIPTOR_TID 2
+#define PERFETTO_THREAD_DESCRIPTOR_THREAD_NAME 5
+
+#define PERFETTO_TRACK_EVENT_TYPE 9
+#define PERFETTO_TRACK_EVENT_TRACK_UUID 11
+#define PERFETTO_TRACK_EVENT_NAME 23
+
+#define PERFETTO_TRACK_EVENT_TYPE_SLICE_BEGIN 1
+#define PERFETTO_TRACK_EVENT_TYPE_SLICE_END 2
+#define PERFETTO_TRACK_EVENT_TYPE_INSTANT 3
+
+#define PERFETTO_BUILTIN_CLOCK_MONOTONIC 3
+
+static void pb_put_raw(struct pb_buffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = MAX2(buffer->capacity * 2, buffer->size + size);
+        uint8_t *new_data;
+
+        new_data = realloc(buffer->data, capacity);
+        if (new_data == NULL) {
+            buffer->failed = true;
+            return;
+        }
+
+        buffer->data = new_data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void pb_put_varint(struct pb_buffer *buffer, uint64_t value) {
+    uint8_t bytes[10];
+    size_t n_bytes = 0;
+
+    do {
+        bytes[n_bytes] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+        n_bytes++;
+    } while (value != 0);
+
+    pb_put_raw(buffer, bytes, n_bytes);
+}
+
+static void pb_put_uint64(struct pb_buffer *buffer, unsigned field, uint64_t value) {
+    pb_put_varint(buffer, field << 3 | PB_WIRE_TYPE_VARINT);
+    pb_put_varint(buffer, value);
+}
+
+static void pb_put_bytes(struct pb_buffer *buffer, unsigned field, const void *data, size_t size) {
+    pb_put_varint(buffer, field << 3 | PB_WIRE_TYPE_LENGTH_DELIMITED);
+    pb_put_varint(buffer, size);
+    pb_put_raw(buffer, data, size);
+}
+
+static void pb_put_string(struct pb_buffer *buffer, unsigned field, const char *str) {
+    pb_put_bytes(buffer, field, str, strlen(str));
+}
+
+static void pb_put_message(struct pb_buffer *buffer, unsigned field, const struct pb_buffer *message) {
+    pb_put_bytes(buffer, field, message->data, message->size);
+}
+
+/**
+ * @brief Writes @a packet as a TracePacket of the top-level Trace message.
+ */
+static void write_perfetto_packet(FILE *file, struct pb_buffer *scratch, const struct pb_buffer *packet) {
+    scratch->size = 0;
+    pb_put_message(scratch, PERFETTO_TRACE_PACKET, packet);
+    fwrite(scratch->data, 1, scratch->size, file);
+}
+
+static void write_perfetto_thread(
+    FILE *file,
+    pid_t pid,
+    uint32_t sequence_id,
+    struct thread_buffer *buffer,
+    const struct trace_event *events,
+    size_t n_events,
+    struct pb_buffer *scratch
+) {
+    static const uint64_t types[] = {
+        [kBegin_TraceEventType] = PERFETTO_TRACK_EVENT_TYPE_SLICE_BEGIN,
+        [kEnd_TraceEventType] = PERFETTO_TRACK_EVENT_TYPE_SLICE_END,
+        [kInstant_TraceEventType] = PERFETTO_TRACK_EVENT_TYPE_INSTANT,
+    };
+    struct pb_buffer *packet = scratch + 1, *message = scratch + 2, *submessage = scratch + 3;
+    uint64_t track_uuid;
+
+    track_uuid = (uint64_t) pid << 32 | (uint32_t) buffer->tid;
+
+    // First, a TrackDescriptor describing the thread.
+    submessage->size = 0;
+    pb_put_uint64(submessage, PERFETTO_THREAD_DESCRIPTOR_PID, pid);
+    pb_put_uint64(submessage, PERFETTO_THREAD_DESCRIPTOR_TID, buffer->tid);
+    if (buffer->thread_name[0] != '\0') {
+        pb_put_string(submessage, PERFETTO_THREAD_DESCRIPTOR_THREAD_NAME, buffer->thread_name);
+    }
+
+    message->size = 0;
+    pb_put_uint64(message, PERFETTO_TRACK_DESCRIPTOR_UUID, track_uuid);
+    pb_put_message(message, PERFETTO_TRACK_DESCRIPTOR_THREAD, submessage);
+
+    packet->size = 0;
+    pb_put_uint64(packet, PERFETTO_TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID, sequence_id);
+    pb_put_message(packet, PERFETTO_TRACE_PACKET_TRACK_DESCRIPTOR, message);
+    write_perfetto_packet(file, scratch, packet);
+
+    // Then one TrackEvent packet per event.
+    for (size_t i = 0; i < n_events; i++) {
+        message->size = 0;
+        pb_put_uint64(message, PERFETTO_TRACK_EVENT_TYPE, types[events[i].type]);
+        pb_put_uint64(message, PERFETTO_TRACK_EVENT_TRACK_UUID, track_uuid);
+        if (events[i].type != kEnd_TraceEventType) {
+            pb_put_string(message, PERFETTO_TRACK_EVENT_NAME, events[i].name);
+        }
+
+        packet->size = 0;
+        pb_put_uint64(packet, PERFETTO_TRACE_PACKET_TIMESTAMP, events[i].timestamp_ns);
+        pb_put_uint64(packet, PERFETTO_TRACE_PACKET_TIMESTAMP_CLOCK_ID, PERFETTO_BUILTIN_CLOCK_MONOTONIC);
+        pb_put_uint64(packet, PERFETTO_TRACE_PACKET_TRUSTED_PACKET_SEQUENCE_ID, sequence_id);
+        pb_put_message(packet, PERFETTO_TRACE_PACKET_TRACK_EVENT, message);
+        write_perfetto_packet(file, scratch, packet);
+    }
+}
+
+int tracer_export(struct tracer *tracer, enum tracer_export_format format, FILE *file) {
+    struct trace_event *events;
+    struct pb_buffer scratch[4];
+    uint32_t sequence_id;
+    size_t n_events;
+    bool failed;
+    pid_t pid;
+
+    ASSERT_NOT_NULL(tracer);
+    ASSERT_NOT_NULL(file);
+
+    events = malloc(TRACER_N_EVENTS_PER_THREAD * sizeof *events);
+    if (events == NULL) {
+        return ENOMEM;
+    }
+
+    memset(scratch, 0, sizeof scratch);
+    pid = getpid();
+    sequence_id = 1;
+
+    if (format == kChromeJson_TracerExportFormat) {
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    }
+
+    tracer_lock(tracer);
+
+    list_for_each_entry(struct thread_buffer, buffer, &tracer->buffers, entry) {
+        n_events = copy_thread_buffer(buffer, events, &buffer->n_exported);
+
+        if (format == kChromeJson_TracerExportFormat) {
+            if (sequence_id > 1) {
+                fprintf(file, ",\n");
+            }
+            write_chrome_json_thread(file, pid, buffer, events, n_events);
+        } else {
+            write_perfetto_thread(file, pid, sequence_id, buffer, events, n_events, scratch);
+        }
+
+        sequence_id++;
+    }
+
+    // The buffers of exited threads won't get any new events, so they can go now.
+    list_for_each_entry_safe(struct thread_buffer, buffer, &tracer->buffers, entry) {
+        if (is_buffer_flushed_locked(buffer)) {
+            list_del(&buffer->entry);
+            thread_state_unref(buffer->thread);
+            free(buffer);
+        }
+    }
+
+    tracer_unlock(tracer);
+
+    if (format == kChromeJson_TracerExportFormat) {
+        fprintf(file, "\n]}\n");
+    }
+
+    failed = false;
+    for (unsigned i = 0; i < ARRAY_SIZE(scratch); i++) {
+        failed = failed || scratch[i].failed;
+        free(scratch[i].data);
+    }
+    free(events);
+
+    if (failed) {
+        return ENOMEM;
+    }
+
+    if (fflush(file) != 0 || ferror(file)) {
+        return EIO;
+    }
+
+    return 0;
+}
+
+static bool has_suffix(const char *str, const char *suffix) {
+    size_t str_len = strlen(str), suffix_len = strlen(suffix);
+
+    return str_len >= suffix_len && streq(str + str_len - suffix_len, suffix);
+}
+
+int tracer_export_to_path(struct tracer *tracer, const char *path) {
+    enum tracer_export_format format;
+    FILE *file;
+    int ok;
+
+    ASSERT_NOT_NULL(tracer);
+    ASSERT_NOT_NULL(path);
+
+    if (has_suffix(path, ".pftrace") || has_suffix(path, ".perfetto-trace")) {
+        format = kPerfetto_TracerExportFormat;
+    } else {
+        format = kChromeJson_TracerExportFormat;
+    }
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        ok = errno;
+        LOG_ERROR("Could not open trace file \"%s\". fopen: %s\n", path, strerror(ok));
+        return ok;
+    }
+
+    ok = tracer_export(tracer, format, file);
+    if (ok != 0) {
+        LOG_ERROR("Could not write trace file \"%s\". tracer_export: %s\n", path, strerror(ok));
+    }
+
+    if (fclose(file) != 0 && ok == 0) {
+        ok = errno;
+    }
+
+    return ok;
+}
@@ -2,18 +2,41 @@
 /*
  * Tracer - simple object for tracing using flutter event tracing interface.
  *
+ * Additionally, tracers can record events into per-thread ring buffers, even
+ * in release mode, and export them as a Chrome JSON trace or a perfetto trace.
+ *
  * Copyright (c) 2022, Hannes Winkler <hanneswinkler2000@web.de>
  */
 
 #ifndef _FLUTTER_DRM_EMBEDDER_SRC_TRACER_H
 #define _FLUTTER_DRM_EMBEDDER_SRC_TRACER_H
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include <flutter_embedder.h>
 
 #include "util/refcounting.h"
 
 struct tracer;
 
+/// How many events are kept per thread while recording. Older events are overwritten.
+#define TRACER_N_EVENTS_PER_THREAD 8192
+
+enum trace_event_type {
+    kBegin_TraceEventType,
+    kEnd_TraceEventType,
+    kInstant_TraceEventType,
+};
+
+enum tracer_export_format {
+    /// JSON trace event format, as understood by chrome://tracing and ui.perfetto.dev.
+    kChromeJson_TracerExportFormat,
+
+    /// perfetto protobuf trace, using TrackEvents.
+    kPerfetto_TracerExportFormat,
+};
+
 struct tracer *tracer_new_with_cbs(
     FlutterEngineTraceEventDurationBeginFnPtr trace_begin,
     FlutterEngineTraceEventDurationEndFnPtr trace_end,
@@ -30,6 +53,22 @@ void __tracer_end(struct tracer *tracer, const char *name);
 
 void __tracer_instant(struct tracer *tracer, const char *name);
 
+/**
+ * @brief Records an event into the ring buffer of the calling thread, if the tracer is recording.
+ *
+ * @a name is not copied, so it needs to stay valid until the trace is exported.
+ * (In practice, it should be a string literal, or a name returned by @ref tracer_intern_name.)
+ */
+void __tracer_record(struct tracer *tracer, enum trace_event_type type, const char *name);
+
+/**
+ * @brief Returns a copy of @a name that stays valid until the tracer is destroyed,
+ * for recording event names that aren't string literals.
+ *
+ * Interning the same name twice returns the same copy. Returns NULL if out of memory.
+ */
+const char *tracer_intern_name(struct tracer *tracer, const char *name);
+
 void tracer_set_cbs(
     struct tracer *tracer,
     FlutterEngineTraceEventDurationBeginFnPtr trace_begin,
@@ -37,28 +76,45 @@ void tracer_set_cbs(
     FlutterEngineTraceEventInstantFnPtr trace_instant
 );
 
+/**
+ * @brief Starts recording events into per-thread ring buffers.
+ *
+ * Previously recorded events are kept. Recording is cheap enough (a few tens of nanoseconds per event)
+ * to be left enabled in production.
+ */
+void tracer_start_recording(struct tracer *tracer);
+
+/**
+ * @brief Stops recording events. The recorded events are kept, so they can still be exported.
+ */
+void tracer_stop_recording(struct tracer *tracer);
+
+bool tracer_is_recording(struct tracer *tracer);
+
+/**
+ * @brief Writes all recorded events in @a format to @a file.
+ *
+ * Can be called while other threads are still recording.
+ */
+int tracer_export(struct tracer *tracer, enum tracer_export_format format, FILE *file);
+
+/**
+ * @brief Writes all recorded events to the file at @a path.
+ *
+ * Paths ending in `.pftrace` or `.perfetto-trace` are written as perfetto traces,
+ * everything else as a Chrome JSON trace.
+ */
+int tracer_export_to_path(struct tracer *tracer, const char *path);
+
 #ifdef DEBUG
     #define TRACER_BEGIN(tracer, name) __tracer_begin(tracer, name)
     #define TRACER_END(tracer, name) __tracer_end(tracer, name)
     #define TRACER_INSTANT(tracer, name) __tracer_instant(tracer, name)
 #else
-    // Cast tracer & name to void so we don't get unused variable warnings
-    // in release mode.
-    #define TRACER_BEGIN(tracer, name) \
-        do {                           \
-            (void) tracer;             \
-            (void) name;               \
-        } while (0)
-    #define TRACER_END(tracer, name) \
-        do {                         \
-            (void) tracer;           \
-            (void) name;             \
-        } while (0)
-    #define TRACER_INSTANT(tracer, name) \
-        do {                             \
-            (void) tracer;               \
-            (void) name;                 \
-        } while (0)
+    // In release mode, events are not forwarded to the engine, but they can still be recorded.
+    #define TRACER_BEGIN(tracer, name) __tracer_record(tracer, kBegin_TraceEventType, name)
+    #define TRACER_END(tracer, name) __tracer_record(tracer, kEnd_TraceEventType, name)
+    #define TRACER_INSTANT(tracer, name) __tracer_record(tracer, kInstant_TraceEventType, name)
 #endif
 
 #define DECLARE_STATIC_TRACING_CALLS(obj_type_name, obj_var_name)                  \
@@ -68,13 +124,13 @@ void tracer_set_cbs(
 
 #define DEFINE_STATIC_TRACING_CALLS(obj_type_name, obj_var_name, tracer_member_name)  \
     static void trace_begin(struct obj_type_name *obj_var_name, const char *name) {   \
-        return tracer_begin(obj_var_name->tracer_member_name, name);                  \
+        TRACER_BEGIN(obj_var_name->tracer_member_name, name);                         \
     }                                                                                 \
     static void trace_end(struct obj_type_name *obj_var_name, const char *name) {     \
-        return tracer_end(obj_var_name->tracer_member_name, name);                    \
+        TRACER_END(obj_var_name->tracer_member_name, name);                           \
     }                                                                                 \
     static void trace_instant(struct obj_type_name *obj_var_name, const char *name) { \
-        return tracer_instant(obj_var_name->tracer_member_name, name);                \
+        TRACER_INSTANT(obj_var_name->tracer_member_name, name);                       \
     }
 
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_TRACER_H
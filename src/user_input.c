@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include "user_input.h"
 
 #include <errno.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,14 +23,33 @@
 
 #include "compositor_ng.h"
 #include "flutter-drm-embedder.h"
+#include "input_trace.h"
 #include "keyboard.h"
+#include "touch_resampler.h"
 #include "util/collection.h"
+#include "util/list.h"
+#include "util/lock_ops.h"
 #include "util/logging.h"
 
 #define LIBINPUT_VER(major, minor, patch) ((((major) & 0xFF) << 16) | (((minor) & 0xFF) << 8) | ((patch) & 0xFF))
 #define THIS_LIBINPUT_VER LIBINPUT_VER(LIBINPUT_VERSION_MAJOR, LIBINPUT_VERSION_MINOR, LIBINPUT_VERSION_PATCH)
 
+/**
+ * @brief Replayed traces with more devices than this are considered corrupted.
+ */
+#define USER_INPUT_MAX_REPLAY_DEVICES 1024
+
 struct input_device_data {
+    /**
+     * @brief The INPUT_TRACE_DEVICE_CAP_* capabilities of this device.
+     */
+    uint32_t caps;
+
+    /**
+     * @brief The id of this device in input traces.
+     */
+    uint32_t trace_device_id;
+
     struct keyboard_state *keyboard_state;
     int64_t buttons;
     uint64_t timestamp;
@@ -49,6 +74,17 @@ struct input_device_data {
      */
     struct vec2f *positions;
 
+    /**
+     * @brief The touch move samples of each multitouch slot that weren't sent to flutter yet.
+     */
+    struct touch_resampler *touch_resamplers;
+    int n_touch_slots;
+
+    /**
+     * @brief Entry in @ref user_input.touch_devices, if this is a touch device.
+     */
+    struct list_head touch_devices_entry;
+
     int64_t touch_device_id_offset;
     int64_t stylus_device_id;
 };
@@ -87,15 +123,86 @@ struct user_input {
     double cursor_x, cursor_y;
 
     /**
-     * @brief Buffer of collected flutter pointer events, since we can send multiple events at once to flutter.
+     * @brief Flutter pointer events that weren't sent to flutter yet, since we can send multiple events at once to flutter.
+     *
+     * Events are collected while processing a batch of libinput events and are then sent to flutter
+     * in one go, by the same thread. FlutterEngineSendPointerEvent can be called from any thread,
+     * so with the input thread, they don't need to go through the platform thread.
+     */
+    FlutterPointerEvent pointer_events[USER_INPUT_MAX_QUEUED_POINTER_EVENTS];
+    size_t n_pointer_events;
+
+    enum touch_resampling_mode touch_resampling_mode;
+
+    /**
+     * @brief All touch devices, so their pending touch moves can be found.
+     */
+    struct list_head touch_devices;
+
+    /**
+     * @brief True if any touch slot has a touch move that wasn't sent to flutter yet.
+     */
+    bool has_pending_touch_moves;
+
+    /**
+     * @brief When the pending touch moves should be resampled to & sent to flutter (CLOCK_MONOTONIC, nanoseconds),
+     * or 0 if they should be sent when all pending libinput events are processed.
+     */
+    uint64_t touch_flush_time_ns;
+
+    atomic_uint_least64_t n_touch_moves_in;
+    atomic_uint_least64_t n_touch_moves_out;
+    atomic_uint_least64_t n_replayed_events;
+
+    /**
+     * @brief Protects the libinput context and all the state above against concurrent
+     * access by the input thread and the threads calling the user_input functions.
+     */
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief The dedicated input thread, if @ref has_thread is true.
+     */
+    bool has_thread;
+    pthread_t thread;
+    int thread_rt_priority;
+
+    /**
+     * @brief eventfd used to wake up the input thread when it should stop or
+     * suspend / resume libinput.
+     */
+    int thread_wakeup_fd;
+    atomic_bool thread_should_stop;
+
+    /**
+     * @brief Set when @ref user_input_suspend or @ref user_input_resume were called
+     * while the input thread is running. The input thread then applies @ref session_active.
+     */
+    atomic_bool session_changed;
+    atomic_bool session_active;
+
+    /**
+     * @brief If non-NULL, all processed input events are recorded into this trace.
+     */
+    struct input_trace_writer *recorder;
+    uint32_t next_trace_device_id;
+
+    /**
+     * @brief If non-NULL, input events are replayed from this trace by the input thread,
+     * instead of coming from libinput. @ref libinput is NULL in that case.
      */
-    FlutterPointerEvent collected_flutter_pointer_events[MAX_COLLECTED_FLUTTER_POINTER_EVENTS];
+    struct input_trace_reader *replay;
+    double replay_speed;
+
     /**
-     * @brief Number of pointer events currently contained in @ref collected_flutter_pointer_events.
+     * @brief The data of the replayed devices, indexed by their trace device id.
      */
-    size_t n_collected_flutter_pointer_events;
+    struct input_device_data **replay_devices;
+    size_t n_replay_devices;
 };
 
+DEFINE_STATIC_LOCK_OPS(user_input, mutex)
+
 static inline FlutterPointerEvent make_touch_event(FlutterPointerPhase phase, size_t timestamp, struct vec2f pos, int32_t device_id) {
     FlutterPointerEvent event;
     memset(&event, 0, sizeof(event));
@@ -275,7 +382,7 @@ static void on_close(int fd, void *userdata) {
 
 static const struct libinput_interface libinput_interface = { .open_restricted = on_open, .close_restricted = on_close };
 
-struct user_input *user_input_new(
+static struct user_input *user_input_alloc(
     const struct user_input_interface *interface,
     void *userdata,
     const struct mat3f *display_to_view_transform,
@@ -283,13 +390,89 @@ struct user_input *user_input_new(
     unsigned int display_width,
     unsigned int display_height
 ) {
+    struct user_input *input;
+
+    input = malloc(sizeof *input);
+    if (input == NULL) {
+        return NULL;
+    }
+
+    input->n_pointer_events = 0;
+    input->interface = *interface;
+    input->userdata = userdata;
+
+    pthread_mutex_init(&input->mutex, NULL);
+
+    input->libinput = NULL;
+    input->kbdcfg = NULL;
+    input->next_unused_flutter_device_id = 0;
+
+    user_input_set_transform(input, display_to_view_transform, view_to_display_transform, display_width, display_height);
+
+    input->n_cursor_devices = 0;
+    input->cursor_flutter_device_id = -1;
+    input->cursor_x = 0.0;
+    input->cursor_y = 0.0;
+
+    input->touch_resampling_mode = kOff_TouchResamplingMode;
+    list_inithead(&input->touch_devices);
+    input->has_pending_touch_moves = false;
+    input->touch_flush_time_ns = 0;
+    atomic_init(&input->n_touch_moves_in, 0);
+    atomic_init(&input->n_touch_moves_out, 0);
+    atomic_init(&input->n_replayed_events, 0);
+
+    input->has_thread = false;
+    input->thread_rt_priority = 0;
+    input->thread_wakeup_fd = -1;
+    atomic_init(&input->thread_should_stop, false);
+    atomic_init(&input->session_changed, false);
+    atomic_init(&input->session_active, true);
+
+    input->recorder = NULL;
+    input->next_trace_device_id = 0;
+    input->replay = NULL;
+    input->replay_speed = 1.0;
+    input->replay_devices = NULL;
+    input->n_replay_devices = 0;
+
+    return input;
+}
+
+static void user_input_free(struct user_input *input) {
+    pthread_mutex_destroy(&input->mutex);
+    free(input);
+}
+
+static struct keyboard_config *load_keyboard_config(void) {
+#ifdef BUILD_TEXT_INPUT_PLUGIN
     struct keyboard_config *kbdcfg;
+
+    kbdcfg = keyboard_config_new();
+    if (kbdcfg == NULL) {
+        LOG_ERROR("Could not initialize keyboard configuration. Flutter-drm-embedder will run without text/raw keyboard input.\n");
+    }
+
+    return kbdcfg;
+#else
+    return NULL;
+#endif
+}
+
+struct user_input *user_input_new(
+    const struct user_input_interface *interface,
+    void *userdata,
+    const struct mat3f *display_to_view_transform,
+    const struct mat3f *view_to_display_transform,
+    unsigned int display_width,
+    unsigned int display_height
+) {
     struct user_input *input;
     struct libinput *libinput;
     struct udev *udev;
     int ok;
 
-    input = malloc(sizeof *input);
+    input = user_input_alloc(interface, userdata, display_to_view_transform, view_to_display_transform, display_width, display_height);
     if (input == NULL) {
         goto fail_return_null;
     }
@@ -300,9 +483,6 @@ struct user_input *user_input_new(
         goto fail_free_input;
     }
 
-    input->interface = *interface;
-    input->userdata = userdata;
-
     libinput = libinput_udev_create_context(&libinput_interface, input, udev);
     if (libinput == NULL) {
         perror("[flutter-drm-embedder] Could not create libinput instance. libinput_udev_create_context");
@@ -317,27 +497,8 @@ struct user_input *user_input_new(
         goto fail_unref_libinput;
     }
 
-#ifdef BUILD_TEXT_INPUT_PLUGIN
-    kbdcfg = keyboard_config_new();
-    if (kbdcfg == NULL) {
-        LOG_ERROR("Could not initialize keyboard configuration. Flutter-drm-embedder will run without text/raw keyboard input.\n");
-    }
-#else
-    kbdcfg = NULL;
-#endif
-
     input->libinput = libinput;
-    input->kbdcfg = kbdcfg;
-    input->next_unused_flutter_device_id = 0;
-
-    user_input_set_transform(input, display_to_view_transform, view_to_display_transform, display_width, display_height);
-
-    input->n_cursor_devices = 0;
-    input->cursor_flutter_device_id = -1;
-    input->cursor_x = 0.0;
-    input->cursor_y = 0.0;
-
-    input->n_collected_flutter_pointer_events = 0;
+    input->kbdcfg = load_keyboard_config();
 
     return input;
 
@@ -349,49 +510,123 @@ fail_unref_udev:
     udev_unref(udev);
 
 fail_free_input:
-    free(input);
+    user_input_free(input);
 
 fail_return_null:
     return NULL;
 }
 
-static int on_device_removed(struct user_input *input, struct libinput_event *event, uint64_t timestamp, bool emit_flutter_events);
+struct user_input *user_input_new_replay(
+    const struct user_input_interface *interface,
+    void *userdata,
+    const struct mat3f *display_to_view_transform,
+    const struct mat3f *view_to_display_transform,
+    unsigned int display_width,
+    unsigned int display_height,
+    const char *trace_path,
+    double speed
+) {
+    struct user_input *input;
+
+    ASSERT_NOT_NULL(trace_path);
+    assert(speed > 0);
+
+    input = user_input_alloc(interface, userdata, display_to_view_transform, view_to_display_transform, display_width, display_height);
+    if (input == NULL) {
+        return NULL;
+    }
+
+    input->replay = input_trace_reader_new(trace_path);
+    if (input->replay == NULL) {
+        user_input_free(input);
+        return NULL;
+    }
+
+    input->replay_speed = speed;
+    input->kbdcfg = load_keyboard_config();
+
+    return input;
+}
+
+static void on_device_removed(struct user_input *input, struct input_device_data *data, uint64_t timestamp, bool emit_flutter_events);
 
 void user_input_destroy(struct user_input *input) {
     enum libinput_event_type event_type;
     struct libinput_event *event;
-    ASSERTED int ok;
+    struct libinput_device *device;
+    struct input_device_data *data;
 
     assert(input != NULL);
 
-    /// TODO: Destroy all the input device data, maybe add an additional
-    /// parameter to indicate whether any flutter device removal events should be
-    /// emitted.
+    user_input_stop_thread(input);
 
-    libinput_suspend(input->libinput);
-    libinput_dispatch(input->libinput);
+    if (input->libinput != NULL) {
+        libinput_suspend(input->libinput);
+        libinput_dispatch(input->libinput);
 
-    // handle all device removal events
-    while (libinput_next_event_type(input->libinput) != LIBINPUT_EVENT_NONE) {
-        event = libinput_get_event(input->libinput);
-        event_type = libinput_event_get_type(event);
+        // handle all device removal events
+        while (libinput_next_event_type(input->libinput) != LIBINPUT_EVENT_NONE) {
+            event = libinput_get_event(input->libinput);
+            event_type = libinput_event_get_type(event);
 
-        switch (event_type) {
-            case LIBINPUT_EVENT_DEVICE_REMOVED:
-                ok = on_device_removed(input, event, 0, false);
-                ASSERT_ZERO(ok);
-                break;
-            default: break;
+            if (event_type == LIBINPUT_EVENT_DEVICE_REMOVED) {
+                device = libinput_event_get_device(event);
+
+                // on_device_added might never have been called for this device,
+                // in which case there's no data.
+                data = libinput_device_get_user_data(device);
+                if (data != NULL) {
+                    on_device_removed(input, data, 0, false);
+                    libinput_device_set_user_data(device, NULL);
+                }
+            }
+
+            libinput_event_destroy(event);
         }
 
-        libinput_event_destroy(event);
+        libinput_unref(input->libinput);
+    }
+
+    if (input->replay != NULL) {
+        for (size_t i = 0; i < input->n_replay_devices; i++) {
+            if (input->replay_devices[i] != NULL) {
+                on_device_removed(input, input->replay_devices[i], 0, false);
+            }
+        }
+
+        free(input->replay_devices);
+        input_trace_reader_destroy(input->replay);
+    }
+
+    if (input->recorder != NULL) {
+        input_trace_writer_destroy(input->recorder);
     }
 
     if (input->kbdcfg != NULL) {
         keyboard_config_destroy(input->kbdcfg);
     }
-    libinput_unref(input->libinput);
-    free(input);
+
+    user_input_free(input);
+}
+
+int user_input_start_recording(struct user_input *input, const char *path) {
+    struct input_trace_writer *recorder;
+
+    ASSERT_NOT_NULL(input);
+    ASSERT_NOT_NULL(path);
+    assert(!input->has_thread);
+
+    recorder = input_trace_writer_new(path);
+    if (recorder == NULL) {
+        return EIO;
+    }
+
+    user_input_lock(input);
+    assert(input->recorder == NULL);
+    input->recorder = recorder;
+    user_input_unlock(input);
+
+    return 0;
 }
 
 void user_input_set_transform(
@@ -405,28 +640,57 @@ void user_input_set_transform(
     assert(display_to_view_transform != NULL);
     assert(view_to_display_transform != NULL);
 
+    user_input_lock(input);
+
     input->display_to_view_transform = *display_to_view_transform;
     input->view_to_display_transform_nontranslating = *view_to_display_transform;
     input->view_to_display_transform_nontranslating.transX = 0.0;
     input->view_to_display_transform_nontranslating.transY = 0.0;
     input->display_width = display_width;
     input->display_height = display_height;
+
+    user_input_unlock(input);
+}
+
+void user_input_set_touch_resampling_mode(struct user_input *input, enum touch_resampling_mode mode) {
+    ASSERT_NOT_NULL(input);
+    assert(!input->has_thread);
+
+    user_input_lock(input);
+    input->touch_resampling_mode = mode;
+    user_input_unlock(input);
+}
+
+void user_input_get_stats(struct user_input *input, struct user_input_stats *stats_out) {
+    ASSERT_NOT_NULL(input);
+    ASSERT_NOT_NULL(stats_out);
+
+    stats_out->n_touch_moves_in = atomic_load_explicit(&input->n_touch_moves_in, memory_order_relaxed);
+    stats_out->n_touch_moves_out = atomic_load_explicit(&input->n_touch_moves_out, memory_order_relaxed);
+    stats_out->n_replayed_events = atomic_load_explicit(&input->n_replayed_events, memory_order_relaxed);
 }
 
 int user_input_get_fd(struct user_input *input) {
     assert(input != NULL);
-    return libinput_get_fd(input->libinput);
+    return input->libinput != NULL ? libinput_get_fd(input->libinput) : -1;
 }
 
-void user_input_suspend(struct user_input *input) {
-    ASSERT_NOT_NULL(input);
-    libinput_suspend(input->libinput);
+static int wake_thread(struct user_input *input) {
+    int ok;
+
+    ok = write(input->thread_wakeup_fd, &(uint64_t){ 1 }, sizeof(uint64_t));
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't wake up input thread. write: %s\n", strerror(ok));
+        return ok;
+    }
+
+    return 0;
 }
 
-int user_input_resume(struct user_input *input) {
+static int resume_locked(struct user_input *input) {
     int ok;
 
-    ASSERT_NOT_NULL(input);
     ok = libinput_resume(input->libinput);
     if (ok < 0) {
         LOG_ERROR("Couldn't resume libinput event processing. libinput_resume: %s\n", strerror(errno));
@@ -436,64 +700,151 @@ int user_input_resume(struct user_input *input) {
     return 0;
 }
 
-static void flush_pointer_events(struct user_input *input) {
-    assert(input != NULL);
+static void notify_suspended(struct user_input *input) {
+    if (input->interface.on_suspended != NULL) {
+        input->interface.on_suspended(input->userdata);
+    }
+}
 
-    if (input->n_collected_flutter_pointer_events > 0) {
-        input->interface.on_flutter_pointer_event(
-            input->userdata,
-            input->collected_flutter_pointer_events,
-            input->n_collected_flutter_pointer_events
-        );
+void user_input_suspend(struct user_input *input) {
+    ASSERT_NOT_NULL(input);
 
-        input->n_collected_flutter_pointer_events = 0;
+    // replayed input doesn't depend on the session.
+    if (input->replay != NULL) {
+        notify_suspended(input);
+        return;
     }
+
+    if (input->has_thread) {
+        // Don't wait for the input thread here. The input thread might need the
+        // caller (e.g. libseat) to finish opening a device first. The input thread
+        // calls on_suspended when it's done.
+        atomic_store(&input->session_active, false);
+        atomic_store(&input->session_changed, true);
+        wake_thread(input);
+        return;
+    }
+
+    user_input_lock(input);
+    libinput_suspend(input->libinput);
+    user_input_unlock(input);
+
+    notify_suspended(input);
 }
 
-UNUSED static void emit_pointer_events(struct user_input *input, const FlutterPointerEvent *events, size_t n_events) {
-    assert(input != NULL);
-    assert(events != NULL);
+int user_input_resume(struct user_input *input) {
+    int ok;
 
-    size_t to_copy;
+    ASSERT_NOT_NULL(input);
 
-    while (n_events > 0) {
-        // if the internal buffer is full, flush it
-        if (input->n_collected_flutter_pointer_events == MAX_COLLECTED_FLUTTER_POINTER_EVENTS) {
-            flush_pointer_events(input);
-        }
+    if (input->replay != NULL) {
+        return 0;
+    }
 
-        // how many pointer events we can copy into the internal pointer event buffer?
-        to_copy = MIN2(n_events, MAX_COLLECTED_FLUTTER_POINTER_EVENTS - input->n_collected_flutter_pointer_events);
+    if (input->has_thread) {
+        atomic_store(&input->session_active, true);
+        atomic_store(&input->session_changed, true);
+        return wake_thread(input);
+    }
 
-        // copy into the internal pointer event buffer
-        memcpy(
-            input->collected_flutter_pointer_events + input->n_collected_flutter_pointer_events,
-            events,
-            to_copy * sizeof(FlutterPointerEvent)
-        );
+    user_input_lock(input);
+    ok = resume_locked(input);
+    user_input_unlock(input);
 
-        // advance n_events so it's now the number of remaining unemitted events
-        n_events -= to_copy;
+    return ok;
+}
 
-        // advance events so it points to the first remaining unemitted event
-        events += to_copy;
+static void flush_pointer_events(struct user_input *input) {
+    assert(input != NULL);
 
-        // advance the number of stored pointer events
-        input->n_collected_flutter_pointer_events += to_copy;
+    if (input->n_pointer_events > 0) {
+        input->interface.on_flutter_pointer_event(input->userdata, input->pointer_events, input->n_pointer_events);
+        input->n_pointer_events = 0;
     }
 }
 
 static void emit_pointer_event(struct user_input *input, const FlutterPointerEvent event) {
     assert(input != NULL);
 
-    // if the internal buffer is full, flush it
-    if (input->n_collected_flutter_pointer_events == MAX_COLLECTED_FLUTTER_POINTER_EVENTS) {
+    // if the queue is full, flush it
+    if (input->n_pointer_events == ARRAY_SIZE(input->pointer_events)) {
         flush_pointer_events(input);
     }
 
-    memcpy(input->collected_flutter_pointer_events + input->n_collected_flutter_pointer_events, &event, sizeof(event));
+    input->pointer_events[input->n_pointer_events++] = event;
+}
+
+static void emit_touch_move(struct user_input *input, struct input_device_data *data, int slot, struct touch_sample sample) {
+    emit_pointer_event(input, make_touch_move_event(sample.timestamp_us, sample.pos, data->touch_device_id_offset + slot));
+    atomic_fetch_add_explicit(&input->n_touch_moves_out, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Called when a touch slot got its first pending touch move, to decide when the
+ * pending touch moves are sent to flutter.
+ */
+static void schedule_touch_flush_locked(struct user_input *input) {
+    uint64_t now, next_vblank_ns;
+    int ok;
+
+    if (input->has_pending_touch_moves) {
+        return;
+    }
+
+    input->has_pending_touch_moves = true;
+    input->touch_flush_time_ns = 0;
+
+    // Without the input thread, there's nothing to wake us up at a specific time,
+    // so pending touch moves are sent at the end of each dispatch.
+    if (!input->has_thread || input->interface.get_next_vblank == NULL) {
+        return;
+    }
+
+    // Send them shortly before the next vblank, so they're picked up by the frame starting at that vblank.
+    // If that's too soon, take the vblank after that.
+    now = get_monotonic_time();
+    ok = input->interface.get_next_vblank(input->userdata, now + TOUCH_RESAMPLER_LATENCY_US * 1000ull, &next_vblank_ns);
+    if (ok != 0) {
+        return;
+    }
+
+    input->touch_flush_time_ns = next_vblank_ns - TOUCH_RESAMPLER_LATENCY_US * 1000ull;
+}
+
+/**
+ * @brief Sends the pending touch moves of all touch slots to flutter, resampled to @ref touch_flush_time_ns
+ * if touch resampling is enabled.
+ */
+static void flush_touch_moves_locked(struct user_input *input) {
+    struct touch_resampler *resampler;
+    uint64_t target_us;
+    bool resample, has_remaining;
+
+    if (!input->has_pending_touch_moves) {
+        return;
+    }
+
+    resample = input->touch_resampling_mode == kResample_TouchResamplingMode && input->touch_flush_time_ns != 0;
+    target_us = input->touch_flush_time_ns / 1000;
+    has_remaining = false;
+
+    list_for_each_entry(struct input_device_data, data, &input->touch_devices, touch_devices_entry) {
+        for (int slot = 0; slot < data->n_touch_slots; slot++) {
+            resampler = data->touch_resamplers + slot;
+
+            if (touch_resampler_has_pending(resampler)) {
+                emit_touch_move(input, data, slot, touch_resampler_take(resampler, resample, target_us));
 
-    input->n_collected_flutter_pointer_events += 1;
+                // If the position was interpolated, the latest sample is sent next frame.
+                has_remaining |= touch_resampler_has_pending(resampler);
+            }
+        }
+    }
+
+    input->has_pending_touch_moves = false;
+    if (has_remaining) {
+        schedule_touch_flush_locked(input);
+    }
 }
 
 /**
@@ -529,34 +880,34 @@ static void maybe_disable_mouse_cursor(struct user_input *input, uint64_t timest
     }
 }
 
-static int on_device_added(struct user_input *input, struct libinput_event *event, uint64_t timestamp) {
+static int on_device_added(struct user_input *input, const struct input_trace_event *event, struct input_device_data **data_out) {
     struct input_device_data *data;
-    struct libinput_device *device;
     struct vec2f *positions;
     int64_t device_id;
+    int n_slots;
 
     assert(input != NULL);
     assert(event != NULL);
 
-    device = libinput_event_get_device(event);
-
     data = malloc(sizeof *data);
     if (data == NULL) {
         return ENOMEM;
     }
 
+    data->caps = event->code;
+    data->trace_device_id = event->device_id;
     data->touch_device_id_offset = -1;
     data->stylus_device_id = -1;
     data->keyboard_state = NULL;
     data->buttons = 0;
-    data->timestamp = timestamp;
+    data->timestamp = event->timestamp_us;
     data->has_emitted_pointer_events = false;
     data->tip = false;
     data->positions = NULL;
+    data->touch_resamplers = NULL;
+    data->n_touch_slots = 0;
 
-    libinput_device_set_user_data(device, data);
-
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_POINTER)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_POINTER) {
         // no special things to do here
         // mouse pointer will be added as soon as the device actually sends a
         // mouse event, as some devices will erroneously have a LIBINPUT_DEVICE_CAP_POINTER
@@ -566,13 +917,10 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
         // input->next_unused_flutter_device_id++;
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TOUCH)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_TOUCH) {
         // add all touch slots as individual touch devices to flutter
-        int n_slots = libinput_device_touch_get_touch_count(device);
-        if (n_slots == -1) {
-            LOG_ERROR("Could not query input device multitouch slot count.\n");
-            goto fail_free_data;
-        } else if (n_slots == 0) {
+        n_slots = (int) event->value;
+        if (n_slots == 0) {
             LOG_ERROR("Input devive has unknown number of multitouch slots.\n");
             goto fail_free_data;
         }
@@ -582,7 +930,7 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
         for (int i = 0; i < n_slots; i++) {
             device_id = input->next_unused_flutter_device_id++;
 
-            emit_pointer_event(input, make_touch_add_event(timestamp, VEC2F(0, 0), device_id));
+            emit_pointer_event(input, make_touch_add_event(event->timestamp_us, VEC2F(0, 0), device_id));
         }
 
         positions = malloc(n_slots * sizeof(struct vec2f));
@@ -590,10 +938,18 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
             goto fail_free_data;
         }
 
+        data->touch_resamplers = calloc(n_slots, sizeof(struct touch_resampler));
+        if (data->touch_resamplers == NULL) {
+            free(positions);
+            goto fail_free_data;
+        }
+
         data->positions = positions;
+        data->n_touch_slots = n_slots;
+        list_addtail(&data->touch_devices_entry, &input->touch_devices);
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_KEYBOARD) {
         // create a new keyboard state for this keyboard
         if (input->kbdcfg) {
             data->keyboard_state = keyboard_state_new(input->kbdcfg, NULL, NULL);
@@ -603,14 +959,15 @@ static int on_device_added(struct user_input *input, struct libinput_event *even
         }
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TABLET_TOOL)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_TABLET_TOOL) {
         device_id = input->next_unused_flutter_device_id++;
 
         data->stylus_device_id = device_id;
 
-        emit_pointer_event(input, make_stylus_add_event(timestamp, VEC2F(0, 0), device_id));
+        emit_pointer_event(input, make_stylus_add_event(event->timestamp_us, VEC2F(0, 0), device_id));
     }
 
+    *data_out = data;
     return 0;
 
 fail_free_data:
@@ -618,32 +975,11 @@ fail_free_data:
     return EINVAL;
 }
 
-static int on_device_removed(struct user_input *input, struct libinput_event *event, uint64_t timestamp, bool emit_flutter_events) {
-    struct input_device_data *data;
-    struct libinput_device *device;
-
+static void on_device_removed(struct user_input *input, struct input_device_data *data, uint64_t timestamp, bool emit_flutter_events) {
     assert(input != NULL);
-    assert(event != NULL);
-
-    device = libinput_event_get_device(event);
-
-    data = libinput_device_get_user_data(device);
-
-    // on_device_removed is special here because it's also invoked
-    // outside the normal user_input_on_fd_ready function as well,
-    // in user_input_destroy.
-    //
-    // user_input_destroy calls libinput_suspend and then handles all events,
-    // but only the DEVICE_REMOVED events, so it could be we skip some
-    // DEVICE_ADDED events as well
-    //
-    // so it might be the data is null here because on_device_added
-    // was never called for this device.
-    if (data == NULL) {
-        return 0;
-    }
+    assert(data != NULL);
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_POINTER)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_POINTER) {
         if (data->has_emitted_pointer_events) {
             input->n_cursor_devices--;
             if (emit_flutter_events) {
@@ -652,42 +988,35 @@ static int on_device_removed(struct user_input *input, struct libinput_event *ev
         }
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TOUCH)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_TOUCH) {
         // add all touch slots as individual touch devices to flutter
         if (emit_flutter_events) {
-            for (int i = 0; i < libinput_device_touch_get_touch_count(device); i++) {
+            for (int i = 0; i < data->n_touch_slots; i++) {
                 emit_pointer_event(input, make_touch_remove_event(timestamp, VEC2F(0, 0), data->touch_device_id_offset + i));
             }
         }
+
+        // Any pending touch moves of this device are dropped.
+        list_del(&data->touch_devices_entry);
+        free(data->touch_resamplers);
+        free(data->positions);
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_KEYBOARD) {
         // create a new keyboard state for this keyboard
         if (data->keyboard_state != NULL) {
             keyboard_state_destroy(data->keyboard_state);
         }
     }
 
-    if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TABLET_TOOL)) {
+    if (data->caps & INPUT_TRACE_DEVICE_CAP_TABLET_TOOL) {
         emit_pointer_event(input, make_stylus_remove_event(timestamp, VEC2F(0, 0), data->stylus_device_id));
     }
 
-    if (data != NULL) {
-        if (data->positions != NULL) {
-            free(data->positions);
-        }
-        free(data);
-    }
-
-    libinput_device_set_user_data(device, NULL);
-
-    return 0;
+    free(data);
 }
 
-static int on_key_event(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_keyboard *key_event;
-    struct input_device_data *data;
-    struct libinput_device *device;
+static int on_key_event(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     enum libinput_key_state key_state;
     xkb_keysym_t keysym;
     uint32_t codepoint, plain_codepoint;
@@ -697,12 +1026,8 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
     assert(input != NULL);
     assert(event != NULL);
 
-    key_event = libinput_event_get_keyboard_event(event);
-    device = libinput_event_get_device(event);
-    data = libinput_device_get_user_data(device);
-
-    evdev_keycode = (uint16_t) libinput_event_keyboard_get_key(key_event);
-    key_state = libinput_event_keyboard_get_key_state(key_event);
+    evdev_keycode = (uint16_t) event->code;
+    key_state = event->value ? LIBINPUT_KEY_STATE_PRESSED : LIBINPUT_KEY_STATE_RELEASED;
 
     LOG_DEBUG("on_key_event\n");
 
@@ -770,7 +1095,7 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
     if (input->interface.on_key_event) {
         input->interface.on_key_event(
             input->userdata,
-            libinput_event_keyboard_get_time_usec(key_event),
+            event->timestamp_us,
             evdev_keycode + 8u,
             keysym,
             plain_codepoint,
@@ -812,27 +1137,18 @@ static int on_key_event(struct user_input *input, struct libinput_event *event)
     return 0;
 }
 
-static int on_mouse_motion_event(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_pointer *pointer_event;
-    struct input_device_data *data;
-    struct libinput_device *device;
+static int on_mouse_motion_event(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     struct vec2f delta, pos_display, pos_view;
     uint64_t timestamp;
 
     assert(input != NULL);
     assert(event != NULL);
 
-    pointer_event = libinput_event_get_pointer_event(event);
-    device = libinput_event_get_device(event);
-    data = libinput_device_get_user_data(device);
-    timestamp = libinput_event_pointer_get_time_usec(pointer_event);
+    timestamp = event->timestamp_us;
 
     data->timestamp = timestamp;
 
-    delta = transform_point(
-        input->view_to_display_transform_nontranslating,
-        VEC2F(libinput_event_pointer_get_dx(pointer_event), libinput_event_pointer_get_dy(pointer_event))
-    );
+    delta = transform_point(input->view_to_display_transform_nontranslating, VEC2F(event->x, event->y));
 
     pos_display = VEC2F(input->cursor_x + delta.x, input->cursor_y + delta.y);
 
@@ -878,26 +1194,17 @@ static int on_mouse_motion_event(struct user_input *input, struct libinput_event
     return 0;
 }
 
-static int on_mouse_motion_absolute_event(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_pointer *pointer_event;
-    struct input_device_data *data;
-    struct libinput_device *device;
+static int on_mouse_motion_absolute_event(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     struct vec2f pos_display, pos_view;
     uint64_t timestamp;
 
     assert(input != NULL);
     assert(event != NULL);
 
-    pointer_event = libinput_event_get_pointer_event(event);
-    device = libinput_event_get_device(event);
-    data = libinput_device_get_user_data(device);
-    timestamp = libinput_event_pointer_get_time_usec(pointer_event);
+    timestamp = event->timestamp_us;
 
     // get the new mouse position in display coordinates
-    pos_display = VEC2F(
-        libinput_event_pointer_get_absolute_x_transformed(pointer_event, input->display_width),
-        libinput_event_pointer_get_absolute_y_transformed(pointer_event, input->display_height)
-    );
+    pos_display = VEC2F(event->x * input->display_width, event->y * input->display_height);
 
     data->timestamp = timestamp;
 
@@ -924,11 +1231,8 @@ static int on_mouse_motion_absolute_event(struct user_input *input, struct libin
     return 0;
 }
 
-static int on_mouse_button_event(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_pointer *pointer_event;
+static int on_mouse_button_event(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     enum libinput_button_state button_state;
-    struct input_device_data *data;
-    struct libinput_device *device;
     FlutterPointerPhase pointer_phase;
     struct vec2f pos_view;
     uint64_t timestamp;
@@ -939,12 +1243,9 @@ static int on_mouse_button_event(struct user_input *input, struct libinput_event
     assert(input != NULL);
     assert(event != NULL);
 
-    pointer_event = libinput_event_get_pointer_event(event);
-    device = libinput_event_get_device(event);
-    data = libinput_device_get_user_data(device);
-    timestamp = libinput_event_pointer_get_time_usec(pointer_event);
-    evdev_code = (uint16_t) libinput_event_pointer_get_button(pointer_event);
-    button_state = libinput_event_pointer_get_button_state(pointer_event);
+    timestamp = event->timestamp_us;
+    evdev_code = (uint16_t) event->code;
+    button_state = event->value ? LIBINPUT_BUTTON_STATE_PRESSED : LIBINPUT_BUTTON_STATE_RELEASED;
 
     if (data->has_emitted_pointer_events == false) {
         data->has_emitted_pointer_events = true;
@@ -1018,32 +1319,21 @@ static int on_mouse_button_event(struct user_input *input, struct libinput_event
     return 0;
 }
 
-static int on_mouse_axis_event(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_pointer *pointer_event;
-    struct input_device_data *data;
-    struct libinput_device *device;
+static int on_mouse_axis_event(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     struct vec2f pos_view;
     uint64_t timestamp;
 
     assert(input != NULL);
     assert(event != NULL);
 
-    pointer_event = libinput_event_get_pointer_event(event);
-    device = libinput_event_get_device(event);
-    data = libinput_device_get_user_data(device);
-    timestamp = libinput_event_pointer_get_time_usec(pointer_event);
+    timestamp = event->timestamp_us;
 
     // since the stored coords are in display, not view coordinates,
     // we need to transform them again
     pos_view = transform_point(input->display_to_view_transform, VEC2F(input->cursor_x, input->cursor_y));
 
-    double scroll_x = libinput_event_pointer_has_axis(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL) ?
-                          libinput_event_pointer_get_axis_value(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL) :
-                          0.0;
-
-    double scroll_y = libinput_event_pointer_has_axis(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL) ?
-                          libinput_event_pointer_get_axis_value(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL) :
-                          0.0;
+    double scroll_x = event->x;
+    double scroll_y = event->y;
 
     emit_pointer_event(
         input,
@@ -1061,9 +1351,7 @@ static int on_mouse_axis_event(struct user_input *input, struct libinput_event *
     return 0;
 }
 
-static int on_touch_down(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_touch *touch_event;
-    struct input_device_data *data;
+static int on_touch_down(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     struct vec2f pos_view;
     uint64_t timestamp;
     int64_t device_id;
@@ -1072,41 +1360,29 @@ static int on_touch_down(struct user_input *input, struct libinput_event *event)
     assert(input != NULL);
     assert(event != NULL);
 
-    data = libinput_device_get_user_data(libinput_event_get_device(event));
-    touch_event = libinput_event_get_touch_event(event);
-    timestamp = libinput_event_touch_get_time_usec(touch_event);
-
-    // get the multitouch slot for this event
-    // can return -1 when the device is a single touch device
-    slot = libinput_event_touch_get_slot(touch_event);
-    if (slot == -1) {
-        slot = 0;
-    }
+    timestamp = event->timestamp_us;
+    slot = event->slot;
 
     device_id = data->touch_device_id_offset + slot;
 
     // transform the display coordinates to view (flutter) coordinates
     pos_view = transform_point(
         input->display_to_view_transform,
-        VEC2F(
-            libinput_event_touch_get_x_transformed(touch_event, input->display_width),
-            libinput_event_touch_get_y_transformed(touch_event, input->display_height)
-        )
+        VEC2F(event->x * input->display_width, event->y * input->display_height)
     );
 
     // emit the flutter pointer event
     emit_pointer_event(input, make_touch_down_event(timestamp, pos_view, device_id));
 
     // alter our device state
+    touch_resampler_reset(data->touch_resamplers + slot, (struct touch_sample){ .timestamp_us = timestamp, .pos = pos_view });
     data->positions[slot] = pos_view;
     data->timestamp = timestamp;
 
     return 0;
 }
 
-static int on_touch_up(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_touch *touch_event;
-    struct input_device_data *data;
+static int on_touch_up(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
     uint64_t timestamp;
     int64_t device_id;
     int slot;
@@ -1114,59 +1390,49 @@ static int on_touch_up(struct user_input *input, struct libinput_event *event) {
     assert(input != NULL);
     assert(event != NULL);
 
-    data = libinput_device_get_user_data(libinput_event_get_device(event));
-    touch_event = libinput_event_get_touch_event(event);
-    timestamp = libinput_event_touch_get_time_usec(touch_event);
-
-    // get the multitouch slot for this event
-    // can return -1 when the device is a single touch device
-    slot = libinput_event_touch_get_slot(touch_event);
-    if (slot == -1) {
-        slot = 0;
-    }
+    timestamp = event->timestamp_us;
+    slot = event->slot;
 
     device_id = data->touch_device_id_offset + slot;
 
+    // send the last position before the touch point goes up.
+    if (touch_resampler_has_pending(data->touch_resamplers + slot)) {
+        emit_touch_move(input, data, slot, touch_resampler_take(data->touch_resamplers + slot, false, 0));
+    }
+
     emit_pointer_event(input, make_touch_up_event(timestamp, data->positions[slot], device_id));
 
     return 0;
 }
 
-static int on_touch_motion(struct user_input *input, struct libinput_event *event) {
-    struct libinput_event_touch *touch_event;
-    struct input_device_data *data;
+static int on_touch_motion(struct user_input *input, struct input_device_data *data, const struct input_trace_event *event) {
+    struct touch_sample sample;
     struct vec2f pos_view;
     uint64_t timestamp;
-    int64_t device_id;
     int slot;
 
     assert(input != NULL);
     assert(event != NULL);
 
-    data = libinput_device_get_user_data(libinput_event_get_device(event));
-    touch_event = libinput_event_get_touch_event(event);
-    timestamp = libinput_event_touch_get_time_usec(touch_event);
-
-    // get the multitouch slot for this event
-    // can return -1 when the device is a single touch device
-    slot = libinput_event_touch_get_slot(touch_event);
-    if (slot == -1) {
-        slot = 0;
-    }
-
-    device_id = data->touch_device_id_offset + slot;
+    timestamp = event->timestamp_us;
+    slot = event->slot;
 
     // transform the display coordinates to view (flutter) coordinates
     pos_view = transform_point(
         FLUTTER_TRANSFORM_AS_MAT3F(input->display_to_view_transform),
-        VEC2F(
-            libinput_event_touch_get_x_transformed(touch_event, input->display_width),
-            libinput_event_touch_get_y_transformed(touch_event, input->display_height)
-        )
+        VEC2F(event->x * input->display_width, event->y * input->display_height)
     );
 
-    // emit the flutter pointer event
-    emit_pointer_event(input, make_touch_move_event(timestamp, pos_view, device_id));
+    atomic_fetch_add_explicit(&input->n_touch_moves_in, 1, memory_order_relaxed);
+
+    sample = (struct touch_sample){ .timestamp_us = timestamp, .pos = pos_view };
+    if (input->touch_resampling_mode == kOff_TouchResamplingMode) {
+        emit_touch_move(input, data, slot, sample);
+    } else {
+        // replaces any touch move of this slot that wasn't sent yet.
+        touch_resampler_add_sample(data->touch_resamplers + slot, sample);
+        schedule_touch_flush_locked(input);
+    }
 
     // alter our device state
     data->positions[slot] = pos_view;
@@ -1345,6 +1611,208 @@ static int on_tablet_pad_key(struct user_input *input, struct libinput_event *ev
 }
 #endif
 
+/**
+ * @brief Converts a libinput event into an input trace event, which is what the event handlers
+ * above work with, so recorded events can be replayed through the same code.
+ *
+ * @returns false if the event is not one of the recordable events, e.g. a tablet event.
+ */
+static bool decode_libinput_event(struct user_input *input, struct libinput_event *event, uint64_t timestamp, struct input_trace_event *out) {
+    struct libinput_event_pointer *pointer_event;
+    struct libinput_event_keyboard *key_event;
+    struct libinput_event_touch *touch_event;
+    struct libinput_device *device;
+    int n_slots;
+
+    memset(out, 0, sizeof *out);
+
+    switch (libinput_event_get_type(event)) {
+        case LIBINPUT_EVENT_DEVICE_ADDED:
+            device = libinput_event_get_device(event);
+
+            out->type = kDeviceAdded_InputTraceEventType;
+            out->timestamp_us = timestamp;
+            out->device_id = input->next_trace_device_id++;
+
+            if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_KEYBOARD)) {
+                out->code |= INPUT_TRACE_DEVICE_CAP_KEYBOARD;
+            }
+            if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_POINTER)) {
+                out->code |= INPUT_TRACE_DEVICE_CAP_POINTER;
+            }
+            if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TOUCH)) {
+                out->code |= INPUT_TRACE_DEVICE_CAP_TOUCH;
+
+                n_slots = libinput_device_touch_get_touch_count(device);
+                if (n_slots == -1) {
+                    LOG_ERROR("Could not query input device multitouch slot count.\n");
+                    n_slots = 0;
+                }
+                out->value = n_slots;
+            }
+            if (libinput_device_has_capability(device, LIBINPUT_DEVICE_CAP_TABLET_TOOL)) {
+                out->code |= INPUT_TRACE_DEVICE_CAP_TABLET_TOOL;
+            }
+            return true;
+        case LIBINPUT_EVENT_DEVICE_REMOVED:
+            out->type = kDeviceRemoved_InputTraceEventType;
+            out->timestamp_us = timestamp;
+            return true;
+        case LIBINPUT_EVENT_KEYBOARD_KEY:
+            key_event = libinput_event_get_keyboard_event(event);
+
+            out->type = kKey_InputTraceEventType;
+            out->timestamp_us = libinput_event_keyboard_get_time_usec(key_event);
+            out->code = libinput_event_keyboard_get_key(key_event);
+            out->value = libinput_event_keyboard_get_key_state(key_event) == LIBINPUT_KEY_STATE_PRESSED;
+            return true;
+        case LIBINPUT_EVENT_POINTER_MOTION:
+            pointer_event = libinput_event_get_pointer_event(event);
+
+            out->type = kPointerMotion_InputTraceEventType;
+            out->timestamp_us = libinput_event_pointer_get_time_usec(pointer_event);
+            out->x = libinput_event_pointer_get_dx(pointer_event);
+            out->y = libinput_event_pointer_get_dy(pointer_event);
+            return true;
+        case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
+            pointer_event = libinput_event_get_pointer_event(event);
+
+            out->type = kPointerMotionAbsolute_InputTraceEventType;
+            out->timestamp_us = libinput_event_pointer_get_time_usec(pointer_event);
+            out->x = libinput_event_pointer_get_absolute_x_transformed(pointer_event, input->display_width) / input->display_width;
+            out->y = libinput_event_pointer_get_absolute_y_transformed(pointer_event, input->display_height) / input->display_height;
+            return true;
+        case LIBINPUT_EVENT_POINTER_BUTTON:
+            pointer_event = libinput_event_get_pointer_event(event);
+
+            out->type = kPointerButton_InputTraceEventType;
+            out->timestamp_us = libinput_event_pointer_get_time_usec(pointer_event);
+            out->code = libinput_event_pointer_get_button(pointer_event);
+            out->value = libinput_event_pointer_get_button_state(pointer_event) == LIBINPUT_BUTTON_STATE_PRESSED;
+            return true;
+        case LIBINPUT_EVENT_POINTER_AXIS:
+            pointer_event = libinput_event_get_pointer_event(event);
+
+            out->type = kPointerAxis_InputTraceEventType;
+            out->timestamp_us = libinput_event_pointer_get_time_usec(pointer_event);
+            if (libinput_event_pointer_has_axis(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL)) {
+                out->x = libinput_event_pointer_get_axis_value(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL);
+            }
+            if (libinput_event_pointer_has_axis(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL)) {
+                out->y = libinput_event_pointer_get_axis_value(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
+            }
+            return true;
+        case LIBINPUT_EVENT_TOUCH_DOWN:
+        case LIBINPUT_EVENT_TOUCH_UP:
+        case LIBINPUT_EVENT_TOUCH_MOTION:
+            touch_event = libinput_event_get_touch_event(event);
+
+            out->type = libinput_event_get_type(event) == LIBINPUT_EVENT_TOUCH_DOWN ? kTouchDown_InputTraceEventType :
+                        libinput_event_get_type(event) == LIBINPUT_EVENT_TOUCH_UP   ? kTouchUp_InputTraceEventType :
+                                                                                      kTouchMotion_InputTraceEventType;
+            out->timestamp_us = libinput_event_touch_get_time_usec(touch_event);
+
+            // get the multitouch slot for this event
+            // can return -1 when the device is a single touch device
+            out->slot = libinput_event_touch_get_slot(touch_event);
+            if (out->slot == -1) {
+                out->slot = 0;
+            }
+
+            // touch up events don't have a position.
+            if (out->type != kTouchUp_InputTraceEventType) {
+                out->x = libinput_event_touch_get_x_transformed(touch_event, input->display_width) / input->display_width;
+                out->y = libinput_event_touch_get_y_transformed(touch_event, input->display_height) / input->display_height;
+            }
+            return true;
+        default: return false;
+    }
+}
+
+/**
+ * @brief Handles a (live or replayed) input event of the device with data @a *data.
+ *
+ * For device added events, the data of the new device is stored in @a *data.
+ * For device removed events, the device data is freed and @a *data is set to NULL.
+ */
+static int handle_event(struct user_input *input, struct input_device_data **data, const struct input_trace_event *event) {
+    if (event->type == kDeviceAdded_InputTraceEventType) {
+        return on_device_added(input, event, data);
+    }
+
+    // Replayed traces might be corrupted, so check everything that's used as an index.
+    if (event->type == kTouchDown_InputTraceEventType || event->type == kTouchUp_InputTraceEventType ||
+        event->type == kTouchMotion_InputTraceEventType) {
+        if (event->slot < 0 || event->slot >= (*data)->n_touch_slots) {
+            return EINVAL;
+        }
+    }
+
+    switch ((enum input_trace_event_type) event->type) {
+        case kDeviceRemoved_InputTraceEventType:
+            on_device_removed(input, *data, event->timestamp_us, true);
+            *data = NULL;
+            return 0;
+        case kKey_InputTraceEventType: return on_key_event(input, *data, event);
+        case kPointerMotion_InputTraceEventType: return on_mouse_motion_event(input, *data, event);
+        case kPointerMotionAbsolute_InputTraceEventType: return on_mouse_motion_absolute_event(input, *data, event);
+        case kPointerButton_InputTraceEventType: return on_mouse_button_event(input, *data, event);
+        case kPointerAxis_InputTraceEventType: return on_mouse_axis_event(input, *data, event);
+        case kTouchDown_InputTraceEventType: return on_touch_down(input, *data, event);
+        case kTouchUp_InputTraceEventType: return on_touch_up(input, *data, event);
+        case kTouchMotion_InputTraceEventType: return on_touch_motion(input, *data, event);
+        default: return EINVAL;
+    }
+}
+
+static void record_event(struct user_input *input, const struct input_trace_event *event) {
+    int ok;
+
+    if (input->recorder == NULL) {
+        return;
+    }
+
+    ok = input_trace_writer_write(input->recorder, event);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't record input event, input recording stopped. input_trace_writer_write: %s\n", strerror(ok));
+        input_trace_writer_destroy(input->recorder);
+        input->recorder = NULL;
+    }
+}
+
+static int handle_libinput_event(struct user_input *input, struct libinput_event *event, uint64_t timestamp) {
+    struct input_trace_event trace_event;
+    struct libinput_device *device;
+    struct input_device_data *data;
+    int ok;
+
+    device = libinput_event_get_device(event);
+    data = libinput_device_get_user_data(device);
+
+    if (!decode_libinput_event(input, event, timestamp, &trace_event)) {
+        return 0;
+    }
+
+    if (trace_event.type != kDeviceAdded_InputTraceEventType) {
+        // We don't have any data if adding the device failed.
+        if (data == NULL) {
+            return 0;
+        }
+
+        trace_event.device_id = data->trace_device_id;
+    }
+
+    ok = handle_event(input, &data, &trace_event);
+    if (ok != 0) {
+        return ok;
+    }
+
+    libinput_device_set_user_data(device, data);
+
+    record_event(input, &trace_event);
+    return 0;
+}
+
 static int process_libinput_events(struct user_input *input, uint64_t timestamp) {
     enum libinput_event_type event_type;
     struct libinput_event *event;
@@ -1357,66 +1825,6 @@ static int process_libinput_events(struct user_input *input, uint64_t timestamp)
         event_type = libinput_event_get_type(event);
 
         switch (event_type) {
-            case LIBINPUT_EVENT_DEVICE_ADDED:
-                ok = on_device_added(input, event, timestamp);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_DEVICE_REMOVED:
-                ok = on_device_removed(input, event, timestamp, true);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_KEYBOARD_KEY:
-                ok = on_key_event(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_POINTER_MOTION:
-                ok = on_mouse_motion_event(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
-                ok = on_mouse_motion_absolute_event(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_POINTER_BUTTON:
-                ok = on_mouse_button_event(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_POINTER_AXIS:
-                ok = on_mouse_axis_event(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_TOUCH_DOWN:
-                ok = on_touch_down(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_TOUCH_UP:
-                ok = on_touch_up(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
-            case LIBINPUT_EVENT_TOUCH_MOTION:
-                ok = on_touch_motion(input, event);
-                if (ok != 0) {
-                    goto fail_destroy_event;
-                }
-                break;
             case LIBINPUT_EVENT_TOUCH_CANCEL:
                 ok = on_touch_cancel(input, event);
                 if (ok != 0) {
@@ -1479,7 +1887,13 @@ static int process_libinput_events(struct user_input *input, uint64_t timestamp)
                 }
                 break;
 #endif
-            default: break;
+            default:
+                // device, keyboard, pointer & touch events.
+                ok = handle_libinput_event(input, event, timestamp);
+                if (ok != 0) {
+                    goto fail_destroy_event;
+                }
+                break;
         }
 
         libinput_event_destroy(event);
@@ -1492,16 +1906,59 @@ fail_destroy_event:
     return ok;
 }
 
-int user_input_on_fd_ready(struct user_input *input) {
-    int cursor_x, cursor_y, cursor_x_before, cursor_y_before;
+struct cursor_state {
+    bool enabled;
+    int x, y;
+};
+
+static struct cursor_state get_cursor_state_locked(struct user_input *input) {
+    return (struct cursor_state){
+        .enabled = input->n_cursor_devices > 0,
+        .x = round(input->cursor_x),
+        .y = round(input->cursor_y),
+    };
+}
+
+/**
+ * @brief Sends all the flutter pointer events queued while handling a batch of input events,
+ * and updates the mouse cursor if it changed since @a before.
+ */
+static void finish_dispatch_locked(struct user_input *input, struct cursor_state before) {
+    struct cursor_state after;
+
+    // record cursor state after handling events
+    after = get_cursor_state_locked(input);
+
+    // Unless the input thread sends them at a specific time, coalesced touch moves are sent now.
+    if (input->touch_flush_time_ns == 0) {
+        flush_touch_moves_locked(input);
+    }
+
+    // make sure we've dispatched all the flutter pointer events
+    flush_pointer_events(input);
+
+    // call the interface callback if the cursor has been enabled or disabled
+    if (after.enabled && !before.enabled) {
+        input->interface.on_set_cursor_enabled(input->userdata, true);
+    } else if (!after.enabled && before.enabled) {
+        input->interface.on_set_cursor_enabled(input->userdata, false);
+    }
+
+    // only move the pointer if the cursor is enabled now
+    if (after.enabled && ((after.x != before.x) || (after.y != before.y))) {
+        input->interface.on_move_cursor(input->userdata, VEC2F(after.x - before.x, after.y - before.y));
+    }
+}
+
+static int dispatch_locked(struct user_input *input) {
+    struct cursor_state before;
     uint64_t timestamp;
-    bool cursor_enabled, cursor_enabled_before;
     int ok;
 
     assert(input != NULL);
 
-    // get a timestamp because some libinput events don't provide one
-    // needs to be in milliseconds, since that's what the other libinput events
+    // get a timestamp because some libinput events (device added / removed) don't provide one.
+    // needs to be in microseconds, since that's what the other libinput events
     // use and what flutter pointer events require
     timestamp = get_monotonic_time() / 1000;
 
@@ -1513,9 +1970,7 @@ int user_input_on_fd_ready(struct user_input *input) {
     }
 
     // record cursor state before handling events
-    cursor_enabled_before = input->n_cursor_devices > 0;
-    cursor_x_before = round(input->cursor_x);
-    cursor_y_before = round(input->cursor_y);
+    before = get_cursor_state_locked(input);
 
     // handle all available libinput events
     ok = process_libinput_events(input, timestamp);
@@ -1524,25 +1979,365 @@ int user_input_on_fd_ready(struct user_input *input) {
         return ok;
     }
 
-    // record cursor state after handling events
-    cursor_enabled = input->n_cursor_devices > 0;
-    cursor_x = round(input->cursor_x);
-    cursor_y = round(input->cursor_y);
+    finish_dispatch_locked(input, before);
+    return 0;
+}
 
-    // make sure we've dispatched all the flutter pointer events
-    flush_pointer_events(input);
+int user_input_on_fd_ready(struct user_input *input) {
+    int ok;
 
-    // call the interface callback if the cursor has been enabled or disabled
-    if (cursor_enabled && !cursor_enabled_before) {
-        input->interface.on_set_cursor_enabled(input->userdata, true);
-    } else if (!cursor_enabled && cursor_enabled_before) {
-        input->interface.on_set_cursor_enabled(input->userdata, false);
+    ASSERT_NOT_NULL(input);
+    assert(!input->has_thread);
+
+    user_input_lock(input);
+    ok = dispatch_locked(input);
+    user_input_unlock(input);
+
+    return ok;
+}
+
+/**
+ * @returns true if libinput is suspended now.
+ */
+static bool apply_session_change_locked(struct user_input *input) {
+    // Always suspend first, even when resuming. If the session was disabled and enabled
+    // again before we got to it, the device fds were revoked in the meantime and need to be
+    // opened again.
+    libinput_suspend(input->libinput);
+
+    if (atomic_load(&input->session_active)) {
+        resume_locked(input);
+        return false;
     }
 
-    // only move the pointer if the cursor is enabled now
-    if (cursor_enabled && ((cursor_x != cursor_x_before) || (cursor_y != cursor_y_before))) {
-        input->interface.on_move_cursor(input->userdata, VEC2F(cursor_x - cursor_x_before, cursor_y - cursor_y_before));
+    return true;
+}
+
+static void set_thread_rt_priority(int priority) {
+    struct sched_param param;
+    int ok;
+
+    memset(&param, 0, sizeof param);
+    param.sched_priority = priority;
+
+    ok = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ok != 0) {
+        LOG_ERROR(
+            "Couldn't make the input thread real-time (SCHED_FIFO, priority %d). It will run with normal priority. "
+            "Real-time scheduling needs CAP_SYS_NICE or a sufficient RLIMIT_RTPRIO. pthread_setschedparam: %s\n",
+            priority,
+            strerror(ok)
+        );
+    }
+}
+
+/**
+ * @brief Sends the pending touch moves to flutter if it's time to, otherwise returns
+ * how long (in nanoseconds) to wait until it's time. Returns -1 if there's nothing to wait for.
+ */
+static int64_t maybe_flush_touch_moves(struct user_input *input) {
+    uint64_t now;
+    int64_t timeout_ns;
+
+    timeout_ns = -1;
+
+    user_input_lock(input);
+
+    if (input->has_pending_touch_moves) {
+        now = get_monotonic_time();
+        if (now >= input->touch_flush_time_ns) {
+            flush_touch_moves_locked(input);
+            flush_pointer_events(input);
+        }
+
+        // maybe some touch moves are still pending after being resampled.
+        if (input->has_pending_touch_moves) {
+            timeout_ns = input->touch_flush_time_ns > now ? input->touch_flush_time_ns - now : 0;
+        }
+    }
+
+    user_input_unlock(input);
+
+    return timeout_ns;
+}
+
+static void *input_thread_entry(void *userdata) {
+    struct user_input *input;
+    struct timespec timeout;
+    struct pollfd fds[2];
+    int64_t timeout_ns;
+    uint64_t value;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    input = userdata;
+
+    pthread_setname_np(pthread_self(), "input");
+
+    if (input->thread_rt_priority > 0) {
+        set_thread_rt_priority(input->thread_rt_priority);
+    }
+
+    fds[0] = (struct pollfd){ .fd = libinput_get_fd(input->libinput), .events = POLLIN | POLLPRI };
+    fds[1] = (struct pollfd){ .fd = input->thread_wakeup_fd, .events = POLLIN };
+
+    while (true) {
+        timeout_ns = maybe_flush_touch_moves(input);
+        if (timeout_ns >= 0) {
+            timeout.tv_sec = timeout_ns / 1000000000;
+            timeout.tv_nsec = timeout_ns % 1000000000;
+        }
+
+        ok = ppoll(fds, ARRAY_SIZE(fds), timeout_ns >= 0 ? &timeout : NULL, NULL);
+        if (ok < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERROR("Couldn't wait for input events. poll: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            ok = read(input->thread_wakeup_fd, &value, sizeof value);
+            (void) ok;
+
+            if (atomic_load(&input->thread_should_stop)) {
+                break;
+            }
+
+            if (atomic_exchange(&input->session_changed, false)) {
+                bool suspended;
+
+                user_input_lock(input);
+                suspended = apply_session_change_locked(input);
+
+                // Suspending & resuming queues device removed / added events without
+                // making the libinput fd ready, so handle those right away.
+                dispatch_locked(input);
+                user_input_unlock(input);
+
+                if (suspended) {
+                    notify_suspended(input);
+                }
+                continue;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLPRI)) {
+            user_input_lock(input);
+            dispatch_locked(input);
+            user_input_unlock(input);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Waits until @a time_ns (or forever, if it's UINT64_MAX), while sending pending
+ * touch moves to flutter on time.
+ *
+ * @returns false if the input thread should stop.
+ */
+static bool replay_wait_until(struct user_input *input, uint64_t time_ns) {
+    struct timespec timeout;
+    struct pollfd fd;
+    int64_t timeout_ns;
+    uint64_t now, value;
+    int ok;
+
+    fd = (struct pollfd){ .fd = input->thread_wakeup_fd, .events = POLLIN };
+
+    while (!atomic_load(&input->thread_should_stop)) {
+        timeout_ns = maybe_flush_touch_moves(input);
+
+        now = get_monotonic_time();
+        if (time_ns != UINT64_MAX) {
+            if (now >= time_ns) {
+                return true;
+            }
+
+            if (timeout_ns < 0 || (uint64_t) timeout_ns > time_ns - now) {
+                timeout_ns = time_ns - now;
+            }
+        }
+
+        if (timeout_ns >= 0) {
+            timeout.tv_sec = timeout_ns / 1000000000;
+            timeout.tv_nsec = timeout_ns % 1000000000;
+        }
+
+        ok = ppoll(&fd, 1, timeout_ns >= 0 ? &timeout : NULL, NULL);
+        if (ok > 0 && (fd.revents & POLLIN)) {
+            ok = read(input->thread_wakeup_fd, &value, sizeof value);
+            (void) ok;
+        }
+    }
+
+    return false;
+}
+
+static int replay_event_locked(struct user_input *input, const struct input_trace_event *event) {
+    struct input_device_data **devices;
+    size_t n_devices;
+
+    if (event->device_id >= input->n_replay_devices) {
+        if (event->device_id >= USER_INPUT_MAX_REPLAY_DEVICES) {
+            return EINVAL;
+        }
+
+        n_devices = event->device_id + 1;
+
+        devices = realloc(input->replay_devices, n_devices * sizeof *devices);
+        if (devices == NULL) {
+            return ENOMEM;
+        }
+
+        memset(devices + input->n_replay_devices, 0, (n_devices - input->n_replay_devices) * sizeof *devices);
+        input->replay_devices = devices;
+        input->n_replay_devices = n_devices;
+    }
+
+    // Devices can only be added once, and must be added before they send any events.
+    if ((event->type == kDeviceAdded_InputTraceEventType) != (input->replay_devices[event->device_id] == NULL)) {
+        return EINVAL;
+    }
+
+    return handle_event(input, input->replay_devices + event->device_id, event);
+}
+
+static void *replay_thread_entry(void *userdata) {
+    struct input_trace_event event;
+    struct cursor_state before;
+    struct user_input *input;
+    uint64_t start_ns, first_us, due_ns;
+    int ok;
+
+    ASSERT_NOT_NULL(userdata);
+    input = userdata;
+
+    pthread_setname_np(pthread_self(), "input-replay");
+
+    if (input->thread_rt_priority > 0) {
+        set_thread_rt_priority(input->thread_rt_priority);
+    }
+
+    memset(&event, 0, sizeof event);
+    ok = input_trace_reader_next(input->replay, &event);
+
+    start_ns = get_monotonic_time();
+    first_us = event.timestamp_us;
+    due_ns = start_ns;
+
+    while (ok == 0) {
+        // Replay the events relative to when the replay started, at the replay speed.
+        // Timestamps are never allowed to go backwards.
+        if (event.timestamp_us > first_us) {
+            due_ns = MAX2(due_ns, start_ns + (uint64_t) ((event.timestamp_us - first_us) * 1000.0 / input->replay_speed));
+        }
+
+        if (!replay_wait_until(input, due_ns)) {
+            return NULL;
+        }
+
+        user_input_lock(input);
+
+        before = get_cursor_state_locked(input);
+
+        // Replay the event, and all the others that are due by now, as one batch.
+        while (true) {
+            event.timestamp_us = due_ns / 1000;
+
+            ok = replay_event_locked(input, &event);
+            if (ok != 0) {
+                break;
+            }
+
+            atomic_fetch_add_explicit(&input->n_replayed_events, 1, memory_order_relaxed);
+
+            ok = input_trace_reader_next(input->replay, &event);
+            if (ok != 0) {
+                break;
+            }
+
+            if (event.timestamp_us > first_us) {
+                due_ns = MAX2(due_ns, start_ns + (uint64_t) ((event.timestamp_us - first_us) * 1000.0 / input->replay_speed));
+            }
+
+            if (due_ns > get_monotonic_time()) {
+                break;
+            }
+        }
+
+        finish_dispatch_locked(input, before);
+
+        user_input_unlock(input);
+    }
+
+    if (ok != ENODATA) {
+        LOG_ERROR("Couldn't replay input trace: %s\n", strerror(ok));
+    }
+
+    if (input->interface.on_replay_finished != NULL) {
+        input->interface.on_replay_finished(input->userdata);
+    }
+
+    // keep sending the remaining touch moves, until we're told to stop.
+    replay_wait_until(input, UINT64_MAX);
+    return NULL;
+}
+
+int user_input_start_thread(struct user_input *input, int rt_priority) {
+    int ok;
+
+    ASSERT_NOT_NULL(input);
+    assert(!input->has_thread);
+    assert(rt_priority >= 0 && rt_priority <= 99);
+
+    ok = eventfd(0, EFD_CLOEXEC);
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Couldn't create input thread wakeup fd. eventfd: %s\n", strerror(ok));
+        return ok;
+    }
+
+    input->thread_wakeup_fd = ok;
+    input->thread_rt_priority = rt_priority;
+    atomic_store(&input->thread_should_stop, false);
+
+    // Set this before the thread is started, so user_input_suspend / user_input_resume
+    // don't touch libinput directly anymore.
+    input->has_thread = true;
+
+    ok = pthread_create(&input->thread, NULL, input->replay != NULL ? replay_thread_entry : input_thread_entry, input);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't create input thread. pthread_create: %s\n", strerror(ok));
+        goto fail_close_wakeup_fd;
     }
 
     return 0;
+
+fail_close_wakeup_fd:
+    input->has_thread = false;
+    close(input->thread_wakeup_fd);
+    input->thread_wakeup_fd = -1;
+    return ok;
+}
+
+void user_input_stop_thread(struct user_input *input) {
+    ASSERT_NOT_NULL(input);
+
+    if (!input->has_thread) {
+        return;
+    }
+
+    atomic_store(&input->thread_should_stop, true);
+    wake_thread(input);
+
+    pthread_join(input->thread, NULL);
+
+    close(input->thread_wakeup_fd);
+    input->thread_wakeup_fd = -1;
+    input->has_thread = false;
 }
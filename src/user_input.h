@@ -19,7 +19,28 @@
 #include "util/collection.h"
 #include "util/geometry.h"
 
-#define MAX_COLLECTED_FLUTTER_POINTER_EVENTS 64
+/**
+ * @brief The maximum number of flutter pointer events that are queued before they're sent to flutter.
+ */
+#define USER_INPUT_MAX_QUEUED_POINTER_EVENTS 1024
+
+/**
+ * @brief How touch move events are sent to flutter.
+ */
+enum touch_resampling_mode {
+    /// Every touch move reported by libinput is sent to flutter as-is.
+    kOff_TouchResamplingMode,
+
+    /// Touch moves of each touch point are coalesced, only the latest one is sent.
+    /// With the input thread, they're held back until shortly before the next vblank,
+    /// so flutter gets (at most) one move per touch point and frame.
+    kCoalesce_TouchResamplingMode,
+
+    /// Like coalesce, but the position is resampled to the time the touch moves
+    /// are sent at, which makes touch motion smoother when the touchscreen
+    /// samples at a different rate than the display refreshes. Needs the input thread.
+    kResample_TouchResamplingMode,
+};
 
 typedef void (*flutter_pointer_event_callback_t)(void *userdata, const FlutterPointerEvent *events, size_t n_events);
 
@@ -67,6 +88,39 @@ struct user_input_interface {
     void (*close)(int fd, void *userdata);
     void (*on_switch_vt)(void *userdata, int vt);
     keyevent_callback_t on_key_event;
+
+    /**
+     * @brief Optional. Returns the timestamp (CLOCK_MONOTONIC, nanoseconds) of the first vblank after @a after_ns.
+     *
+     * Used to align coalesced / resampled touch moves to the display refresh.
+     * Called on the input thread.
+     */
+    int (*get_next_vblank)(void *userdata, uint64_t after_ns, uint64_t *next_vblank_ns_out);
+
+    /**
+     * @brief Optional. Called on the input thread when all events of a replayed input trace were replayed.
+     */
+    void (*on_replay_finished)(void *userdata);
+
+    /**
+     * @brief Optional. Called when a @ref user_input_suspend is complete, i.e. libinput is suspended
+     * and all input devices are closed.
+     *
+     * Without the input thread, this is called before @ref user_input_suspend returns. Otherwise,
+     * it's called on the input thread.
+     */
+    void (*on_suspended)(void *userdata);
+};
+
+struct user_input_stats {
+    /// The number of touch moves reported by libinput.
+    uint64_t n_touch_moves_in;
+
+    /// The number of touch move events sent to flutter.
+    uint64_t n_touch_moves_out;
+
+    /// The number of events replayed from an input trace.
+    uint64_t n_replayed_events;
 };
 
 struct user_input;
@@ -84,6 +138,26 @@ struct user_input *user_input_new(
     unsigned int display_height
 );
 
+/**
+ * @brief Create a new user input instance that replays the input events recorded
+ * in the input trace at @a trace_path, instead of using libinput.
+ *
+ * The events are replayed by the input thread, so @ref user_input_start_thread must be called
+ * to start replaying. The events are replayed with the timing they were recorded with,
+ * sped up by @a speed, and the timestamps of the replayed events are relative to when replaying
+ * started. Tablet, touch cancel & touch frame events are not recorded, so they aren't replayed either.
+ */
+struct user_input *user_input_new_replay(
+    const struct user_input_interface *interface,
+    void *userdata,
+    const struct mat3f *display_to_view_transform,
+    const struct mat3f *view_to_display_transform,
+    unsigned int display_width,
+    unsigned int display_height,
+    const char *trace_path,
+    double speed
+);
+
 /**
  * @brief Destroy this user input instance and free all allocated memory. This will not remove any input devices
  * added to flutter and won't invoke any callbacks in the user input interface at all.
@@ -106,7 +180,32 @@ void user_input_set_transform(
 );
 
 /**
- * @brief Returns a filedescriptor used for input event notification. The returned
+ * @brief Records all input events processed from now on into a new input trace at @a path,
+ * which can be replayed using @ref user_input_new_replay.
+ *
+ * Must be called before the first input events are processed, i.e. before @ref user_input_on_fd_ready
+ * was called or the input thread was started, so the devices that are connected on startup are recorded too.
+ */
+int user_input_start_recording(struct user_input *input, const char *path);
+
+/**
+ * @brief Sets how touch move events are coalesced / resampled before they're sent to flutter.
+ *
+ * Must be called before the input thread is started. Without the input thread, touch moves
+ * are only coalesced within each @ref user_input_on_fd_ready call, and
+ * @ref kResample_TouchResamplingMode behaves like @ref kCoalesce_TouchResamplingMode.
+ */
+void user_input_set_touch_resampling_mode(struct user_input *input, enum touch_resampling_mode mode);
+
+/**
+ * @brief Returns the number of touch moves reported by libinput and sent to flutter so far.
+ *
+ * Can be called from any thread.
+ */
+void user_input_get_stats(struct user_input *input, struct user_input_stats *stats_out);
+
+/**
+ * @brief Returns a filedescriptor used for input event notification, or -1 when replaying an input trace. The returned
  * filedescriptor should be listened to with EPOLLIN | EPOLLRDHUP | EPOLLPRI or equivalent.
  * When the fd becomes ready, @ref user_input_on_fd_ready should be called not long after it
  * became ready. (libinput somehow relies on that)
@@ -116,11 +215,46 @@ int user_input_get_fd(struct user_input *input);
 /**
  * @brief Should be called when the fd returned by @ref user_input_get_fd becomes ready.
  * The user_input_interface callbacks will be called inside this function.
+ *
+ * Must not be called when the input thread was started using @ref user_input_start_thread.
  */
 int user_input_on_fd_ready(struct user_input *input);
 
+/**
+ * @brief Starts a dedicated thread that waits for and processes all libinput events from now on,
+ * instead of whoever calls @ref user_input_on_fd_ready.
+ *
+ * All user_input_interface callbacks (except open & close, which may be called on any thread)
+ * are called on that thread afterwards. That way, input events are picked up without delay,
+ * even if the thread that was handling them so far is busy.
+ *
+ * @param rt_priority The SCHED_FIFO priority for the input thread (1 - 99), or 0 to use the default
+ * scheduling policy. If the priority can't be set (usually because of missing privileges), the
+ * thread runs with the default policy.
+ */
+int user_input_start_thread(struct user_input *input, int rt_priority);
+
+/**
+ * @brief Stops the input thread, if it was started. When this returns, no more
+ * user_input_interface callbacks will be called.
+ */
+void user_input_stop_thread(struct user_input *input);
+
+/**
+ * @brief Suspends libinput, i.e. closes all input devices.
+ *
+ * If the input thread is running, this only asks the input thread to suspend
+ * and returns immediately. @ref user_input_interface.on_suspended is called
+ * when the input devices are closed.
+ */
 void user_input_suspend(struct user_input *input);
 
+/**
+ * @brief Resumes libinput after @ref user_input_suspend.
+ *
+ * If the input thread is running, this only asks the input thread to resume
+ * and returns immediately.
+ */
 int user_input_resume(struct user_input *input);
 
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_USER_INPUT_H
@@ -117,6 +117,22 @@ ATTR_PURE static inline bool streq(const char *a, const char *b) {
     return strcmp(a, b) == 0;
 }
 
+/**
+ * @brief 32-bit FNV-1a hash of a null-terminated string.
+ *
+ * Not cryptographically secure, only meant for hash tables.
+ */
+ATTR_PURE static inline uint32_t hash_str(const char *str) {
+    uint32_t hash = 2166136261u;
+
+    for (const unsigned char *c = (const unsigned char *) str; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 const pthread_mutexattr_t *get_default_mutex_attrs();
 
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_UTIL_COLLECTION_H
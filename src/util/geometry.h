@@ -57,6 +57,10 @@ ATTR_CONST static inline struct vec2i vec2i_sub(struct vec2i a, struct vec2i b)
     return VEC2I(a.x - b.x, a.y - b.y);
 }
 
+ATTR_CONST static inline bool vec2i_equals(struct vec2i a, struct vec2i b) {
+    return a.x == b.x && a.y == b.y;
+}
+
 ATTR_CONST static inline struct vec2i vec2i_swap_xy(const struct vec2i point) {
     return VEC2I(point.y, point.x);
 }
@@ -103,6 +107,17 @@ ATTR_CONST static inline struct aa_rect quad_get_aa_bounding_rect(const struct q
     return AA_RECT_FROM_COORDS(l, t, r - l, b - t);
 }
 
+/**
+ * @brief The smallest axis-aligned rectangle containing both @a a and @a b.
+ */
+ATTR_CONST static inline struct aa_rect aa_rect_union(const struct aa_rect a, const struct aa_rect b) {
+    double l = MIN2(a.offset.x, b.offset.x);
+    double r = MAX2(a.offset.x + a.size.x, b.offset.x + b.size.x);
+    double t = MIN2(a.offset.y, b.offset.y);
+    double btm = MAX2(a.offset.y + a.size.y, b.offset.y + b.size.y);
+    return AA_RECT_FROM_COORDS(l, t, r - l, btm - t);
+}
+
 ATTR_CONST static inline struct vec2f aa_rect_top_left(const struct aa_rect rect) {
     return rect.offset;
 }
@@ -323,4 +338,97 @@ ATTR_CONST static inline struct vec2f vec2f_swap_xy(const struct vec2f point) {
     return VEC2F(point.y, point.x);
 }
 
+#define MAT3F_IDENTITY                                  \
+    ((struct mat3f){                                    \
+        .scaleX = 1,                                    \
+        .skewX = 0,                                     \
+        .transX = 0,                                    \
+        .skewY = 0,                                     \
+        .scaleY = 1,                                    \
+        .transY = 0,                                    \
+        .pers0 = 0,                                     \
+        .pers1 = 0,                                     \
+        .pers2 = 1,                                     \
+    })
+
+ATTR_CONST static inline double mat3f_determinant(const struct mat3f a) {
+    return a.scaleX * (a.scaleY * a.pers2 - a.transY * a.pers1) - a.skewX * (a.skewY * a.pers2 - a.transY * a.pers0) +
+           a.transX * (a.skewY * a.pers1 - a.scaleY * a.pers0);
+}
+
+/**
+ * @brief Inverts @a a.
+ *
+ * @param a The input matrix.
+ * @param out Where the inverse of @a a is stored.
+ * @return false if @a a is not invertible (for example because it scales something to zero size).
+ */
+static inline bool invert_mat3f(const struct mat3f a, struct mat3f *out) {
+    double det = mat3f_determinant(a);
+
+    if (fabs(det) < 1e-12) {
+        return false;
+    }
+
+    *out = (struct mat3f){
+        .scaleX = (a.scaleY * a.pers2 - a.transY * a.pers1) / det,
+        .skewX = (a.transX * a.pers1 - a.skewX * a.pers2) / det,
+        .transX = (a.skewX * a.transY - a.transX * a.scaleY) / det,
+        .skewY = (a.transY * a.pers0 - a.skewY * a.pers2) / det,
+        .scaleY = (a.scaleX * a.pers2 - a.transX * a.pers0) / det,
+        .transY = (a.transX * a.skewY - a.scaleX * a.transY) / det,
+        .pers0 = (a.skewY * a.pers1 - a.scaleY * a.pers0) / det,
+        .pers1 = (a.skewX * a.pers0 - a.scaleX * a.pers1) / det,
+        .pers2 = (a.scaleX * a.scaleY - a.skewX * a.skewY) / det,
+    };
+    return true;
+}
+
+/**
+ * @brief The intersection of @a a and @a b. If they don't intersect, the result has zero size.
+ */
+ATTR_CONST static inline struct aa_rect aa_rect_intersection(const struct aa_rect a, const struct aa_rect b) {
+    double l = MAX2(a.offset.x, b.offset.x);
+    double r = MIN2(a.offset.x + a.size.x, b.offset.x + b.size.x);
+    double t = MAX2(a.offset.y, b.offset.y);
+    double btm = MIN2(a.offset.y + a.size.y, b.offset.y + b.size.y);
+    return AA_RECT_FROM_COORDS(l, t, MAX2(r - l, 0), MAX2(btm - t, 0));
+}
+
+ATTR_CONST static inline bool aa_rect_is_empty(const struct aa_rect a) {
+    return a.size.x <= 0 || a.size.y <= 0;
+}
+
+/**
+ * @brief A (possibly rounded) rectangle that a layer is clipped to.
+ */
+struct clip_rect {
+    /**
+     * @brief The clip rectangle in layer coordinates, i.e. after all transforms were applied.
+     */
+    struct quad rect;
+
+    /**
+     * @brief True if @ref rect is an axis-aligned rectangle, in which case it's also
+     * available as @ref aa_rect.
+     */
+    bool is_aa;
+    struct aa_rect aa_rect;
+
+    /**
+     * @brief The clip rectangle in its own coordinate space, before it was transformed.
+     *
+     * @ref layer_to_local maps layer coordinates into that space, so it's
+     * possible to check whether a point is inside a rotated or rounded clip.
+     */
+    struct aa_rect local_rect;
+    struct mat3f layer_to_local;
+
+    bool is_rounded;
+    struct vec2f upper_left_corner_radius;
+    struct vec2f upper_right_corner_radius;
+    struct vec2f lower_right_corner_radius;
+    struct vec2f lower_left_corner_radius;
+};
+
 #endif  // _FLUTTER_DRM_EMBEDDER_SRC_UTIL_GEOMETRY_H
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Grace Period - Lets lock-free readers access shared data, and lets
+ * writers wait until no reader can still be accessing data they unpublished.
+ *
+ * Readers increment one of two counters for the duration of their read-side
+ * critical section, selected by the parity of the current epoch. A writer
+ * first unpublishes the data (e.g. by swapping a pointer), then calls
+ * @ref grace_period_synchronize, and may free the data afterwards.
+ *
+ * Readers never block, and writers only wait for readers that entered their
+ * critical section before the writer started waiting. Writers need to be
+ * serialized by the caller.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_UTIL_GRACE_PERIOD_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_UTIL_GRACE_PERIOD_H
+
+#include <sched.h>
+#include <stdatomic.h>
+
+/**
+ * @brief Called by readers between loading the epoch and incrementing the reader counter.
+ *
+ * Only used by tests to stall readers at the worst possible point.
+ */
+#ifndef GRACE_PERIOD_READER_STALL_HOOK
+    #define GRACE_PERIOD_READER_STALL_HOOK() \
+        do {                                 \
+        } while (0)
+#endif
+
+struct grace_period {
+    atomic_uint epoch;
+    atomic_uint readers[2];
+};
+
+static inline void grace_period_init(struct grace_period *gp) {
+    atomic_init(&gp->epoch, 0);
+    atomic_init(&gp->readers[0], 0);
+    atomic_init(&gp->readers[1], 0);
+}
+
+/**
+ * @brief Enter a read-side critical section.
+ *
+ * @returns The token that must be passed to @ref grace_period_read_unlock.
+ */
+static inline unsigned grace_period_read_lock(struct grace_period *gp) {
+    unsigned epoch;
+
+    epoch = atomic_load(&gp->epoch) & 1;
+    GRACE_PERIOD_READER_STALL_HOOK();
+    atomic_fetch_add(&gp->readers[epoch], 1);
+
+    return epoch;
+}
+
+static inline void grace_period_read_unlock(struct grace_period *gp, unsigned epoch) {
+    atomic_fetch_sub(&gp->readers[epoch], 1);
+}
+
+static inline void grace_period_wait_for_readers(struct grace_period *gp) {
+    unsigned epoch;
+
+    epoch = atomic_fetch_add(&gp->epoch, 1) & 1;
+    while (atomic_load(&gp->readers[epoch]) != 0) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Wait until all readers that could've observed data that was unpublished
+ * before this call have left their critical section.
+ *
+ * A reader can load the epoch, stall, and only increment its counter after a writer
+ * already flipped the epoch and found that counter empty. That reader might still pick
+ * up the data this writer unpublishes, while counting itself on the counter of the previous
+ * epoch. So both counters need to drain, one after the other. New readers are always directed
+ * to the other counter, so a continuous stream of readers can't starve the writer.
+ */
+static inline void grace_period_synchronize(struct grace_period *gp) {
+    grace_period_wait_for_readers(gp);
+    grace_period_wait_for_readers(gp);
+}
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_UTIL_GRACE_PERIOD_H
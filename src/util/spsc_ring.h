@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: MIT
+/*
+ * SPSC Ring - A lock-free, bounded single-producer single-consumer
+ * queue of fixed-size elements.
+ *
+ * One thread may push elements while (at most) one other thread pops them,
+ * without any locking. The consumer can access the queued elements in place,
+ * so they can be passed to an API that takes an array (like
+ * FlutterEngineSendPointerEvent) without copying them out first.
+ */
+
+#ifndef _FLUTTER_DRM_EMBEDDER_SRC_UTIL_SPSC_RING_H
+#define _FLUTTER_DRM_EMBEDDER_SRC_UTIL_SPSC_RING_H
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asserts.h"
+#include "macros.h"
+
+#define SPSC_RING_CACHELINE_SIZE 64
+
+struct spsc_ring {
+    void *elements;
+    size_t element_size;
+
+    /**
+     * @brief The number of element slots. Always a power of two.
+     */
+    size_t capacity;
+
+    /**
+     * @brief Free-running index of the next element to be written. Only modified by the producer.
+     *
+     * Head and tail are on separate cache lines, so the producer and the consumer
+     * don't keep invalidating each others cache line.
+     */
+    alignas(SPSC_RING_CACHELINE_SIZE) atomic_size_t head;
+
+    /**
+     * @brief Free-running index of the next element to be read. Only modified by the consumer.
+     */
+    alignas(SPSC_RING_CACHELINE_SIZE) atomic_size_t tail;
+};
+
+/**
+ * @brief Initializes @a ring with room for @a capacity elements of @a element_size bytes each.
+ *
+ * @a capacity must be a power of two.
+ */
+static inline int spsc_ring_init(struct spsc_ring *ring, size_t element_size, size_t capacity) {
+    ASSERT_NOT_NULL(ring);
+    assert(element_size > 0);
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    ring->elements = calloc(capacity, element_size);
+    if (ring->elements == NULL) {
+        return ENOMEM;
+    }
+
+    ring->element_size = element_size;
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+static inline void spsc_ring_deinit(struct spsc_ring *ring) {
+    ASSERT_NOT_NULL(ring);
+    free(ring->elements);
+    ring->elements = NULL;
+}
+
+static inline void *spsc_ring_get_slot(struct spsc_ring *ring, size_t index) {
+    return (char *) ring->elements + (index & (ring->capacity - 1)) * ring->element_size;
+}
+
+/**
+ * @brief Appends a copy of @a element to the ring. Must only be called by the producer.
+ *
+ * @returns false if the ring is full.
+ */
+static inline bool spsc_ring_push(struct spsc_ring *ring, const void *element) {
+    size_t head, tail;
+
+    ASSERT_NOT_NULL(ring);
+    ASSERT_NOT_NULL(element);
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == ring->capacity) {
+        return false;
+    }
+
+    memcpy(spsc_ring_get_slot(ring, head), element, ring->element_size);
+
+    // Publish the element to the consumer.
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Returns the number of queued elements that are contiguous in memory,
+ * starting with the oldest one, and stores a pointer to the oldest one in @a elements_out.
+ *
+ * The elements stay valid until they're released using @ref spsc_ring_consume.
+ * Must only be called by the consumer. When this returns less than @ref spsc_ring_get_size,
+ * the queued elements wrap around the end of the ring, and the rest can be accessed
+ * after consuming the returned ones.
+ */
+static inline size_t spsc_ring_peek_contiguous(struct spsc_ring *ring, void **elements_out) {
+    size_t head, tail, offset;
+
+    ASSERT_NOT_NULL(ring);
+    ASSERT_NOT_NULL(elements_out);
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    offset = tail & (ring->capacity - 1);
+
+    *elements_out = (char *) ring->elements + offset * ring->element_size;
+    return MIN2(head - tail, ring->capacity - offset);
+}
+
+/**
+ * @brief Releases the @a n oldest elements, so their slots can be reused by the producer.
+ * Must only be called by the consumer.
+ */
+static inline void spsc_ring_consume(struct spsc_ring *ring, size_t n) {
+    size_t tail;
+
+    ASSERT_NOT_NULL(ring);
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    assert(n <= atomic_load_explicit(&ring->head, memory_order_acquire) - tail);
+
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+/**
+ * @brief Copies the oldest element into @a element_out and releases it. Must only be called by the consumer.
+ *
+ * @returns false if the ring is empty.
+ */
+static inline bool spsc_ring_pop(struct spsc_ring *ring, void *element_out) {
+    void *element;
+
+    ASSERT_NOT_NULL(element_out);
+
+    if (spsc_ring_peek_contiguous(ring, &element) == 0) {
+        return false;
+    }
+
+    memcpy(element_out, element, ring->element_size);
+    spsc_ring_consume(ring, 1);
+    return true;
+}
+
+/**
+ * @brief The number of queued elements. Only exact when called by the producer or the consumer.
+ */
+static inline size_t spsc_ring_get_size(struct spsc_ring *ring) {
+    ASSERT_NOT_NULL(ring);
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif  // _FLUTTER_DRM_EMBEDDER_SRC_UTIL_SPSC_RING_H
@@ -583,6 +583,10 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
     struct drmdev *drmdev;
     struct gbm_bo *bo;
     enum pixfmt pixel_format;
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+    struct aa_rect src, dst;
+    size_t n_damage_clips;
+    bool has_damage;
     uint32_t fb_id;
     int ok;
 
@@ -590,8 +594,10 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
     (void) props;
     (void) builder;
 
-    /// TODO: Implement non axis-aligned fl_layer_props
-    ASSERT_MSG(props->is_aa_rect, "only axis aligned view geometry is supported right now");
+    // see egl_gbm_render_surface_present_kms
+    if (!fl_layer_props_get_scanout_rects(props, VEC2F(vk_surface->render_surface.size.x, vk_surface->render_surface.size.y), &src, &dst)) {
+        return 0;
+    }
 
     surface_lock(s);
 
@@ -668,6 +674,8 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
 
     vkDeviceWaitIdle(vk_renderer_get_device(vk_surface->renderer));
 
+    has_damage = fl_layer_props_get_damage_clips(props, damage_clips, &n_damage_clips);
+
     TRACER_BEGIN(vk_surface->surface.tracer, "kms_req_builder_push_fb_layer");
     ok = kms_req_builder_push_fb_layer(
         builder,
@@ -677,15 +685,15 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
             .has_modifier = true,
             .modifier = gbm_bo_get_modifier(bo),
 
-            .dst_x = (int32_t) props->aa_rect.offset.x,
-            .dst_y = (int32_t) props->aa_rect.offset.y,
-            .dst_w = (uint32_t) props->aa_rect.size.x,
-            .dst_h = (uint32_t) props->aa_rect.size.y,
+            .dst_x = (int32_t) dst.offset.x,
+            .dst_y = (int32_t) dst.offset.y,
+            .dst_w = (uint32_t) dst.size.x,
+            .dst_h = (uint32_t) dst.size.y,
 
-            .src_x = 0,
-            .src_y = 0,
-            .src_w = DOUBLE_TO_FP1616_ROUNDED(vk_surface->render_surface.size.x),
-            .src_h = DOUBLE_TO_FP1616_ROUNDED(vk_surface->render_surface.size.y),
+            .src_x = DOUBLE_TO_FP1616_ROUNDED(src.offset.x),
+            .src_y = DOUBLE_TO_FP1616_ROUNDED(src.offset.y),
+            .src_w = DOUBLE_TO_FP1616_ROUNDED(src.size.x),
+            .src_h = DOUBLE_TO_FP1616_ROUNDED(src.size.y),
 
             // see egl_gbm_render_surface_present_kms
             .has_rotation = true,
@@ -693,6 +701,10 @@ static int vk_gbm_render_surface_present_kms(struct surface *s, const struct fl_
 
             .has_in_fence_fd = false,
             .in_fence_fd = 0,
+
+            .has_damage = has_damage,
+            .n_damage_clips = n_damage_clips,
+            .damage_clips = damage_clips,
         },
         on_release_layer,
         NULL,
@@ -794,7 +806,6 @@ static int vk_gbm_render_surface_queue_present(struct render_surface *s, const F
     vk_surface = CAST_THIS(s);
 
     ASSERT_EQUALS(fl_store->type, kFlutterBackingStoreTypeVulkan);
-    /// TODO: Implement handling if fl_store->did_update == false
 
     surface_lock(CAST_SURFACE_UNCHECKED(s));
 
@@ -815,6 +826,12 @@ static int vk_gbm_render_surface_queue_present(struct render_surface *s, const F
 
     // Replace the front fb with the new one
     // (will unref the old one if not NULL internally)
+    // Flutter may hand us the same image again if it didn't render into it.
+    // Only a new image (or new contents) is a new revision.
+    if (fl_store->did_update || fb != vk_surface->front_fb) {
+        s->surface.revision++;
+    }
+
     locked_fb_swap_ptrs(&vk_surface->front_fb, fb);
 
     // Since flutter no longer uses this fb for rendering, we need to unref it
@@ -12,15 +12,19 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <flutter_embedder.h>
 
 #include "compositor_ng.h"
 #include "cursor.h"
 #include "flutter-drm-embedder.h"
+#include "frame_capture.h"
 #include "frame_scheduler.h"
+#include "frame_timings.h"
 #include "modesetting.h"
 #include "render_surface.h"
 #include "surface.h"
@@ -41,6 +45,16 @@
     #include "vk_renderer.h"
 #endif
 
+#ifdef HAVE_SOFTWARE
+    #include "sw_render_surface.h"
+#endif
+
+/// How many frames that were already scanned out a KMS window keeps around for reuse.
+#define KMS_WINDOW_FRAME_POOL_SIZE 4
+#define KMS_WINDOW_CURSOR_CACHE_SIZE 8
+
+struct frame;
+
 struct window {
     pthread_mutex_t lock;
     refcount_t n_refs;
@@ -172,10 +186,129 @@ struct window {
         const struct pointer_icon *pointer_icon;
         struct cursor_buffer *cursor;
 
+        /**
+         * @brief Cursor buffers that were uploaded already, so switching between pointer kinds
+         * doesn't decode, rotate and upload the icon every time.
+         *
+         * The icon identifies the pointer kind and pixel ratio. If the cache is full,
+         * the least recently used buffer is evicted.
+         */
+        struct {
+            struct cursor_buffer *buffer;
+            uint64_t last_used;
+        } cursor_cache[KMS_WINDOW_CURSOR_CACHE_SIZE];
+        uint64_t cursor_cache_clock;
+
         bool logged_cursor_plane_allocation_failed;
+
+        /**
+         * @brief Whether the cursor of the last pushed composition got a hardware cursor plane.
+         *
+         * If it did, the cursor can be moved and its image replaced without committing
+         * the composition again.
+         */
         bool has_cursor_plane;
+
+        /**
+         * @brief Whether the cursor is drawn on top of the flattened layers using OpenGL ES,
+         * because it didn't get a hardware plane.
+         *
+         * Stays set once the cursor didn't get a plane, so we don't try (and fail) again every frame.
+         */
+        bool software_cursor;
+
+        /**
+         * @brief Whether the last composition we presented was (or is about to be) committed successfully.
+         *
+         * If it was, and the next composition is the same (same surfaces, same surface revisions,
+         * same layer properties, same cursor), we don't need to commit anything.
+         *
+         * Cleared by the frame callback if committing fails.
+         */
+        atomic_bool composition_on_screen;
+
+        /**
+         * @brief The number of frames that were handed to the frame scheduler, but weren't
+         * committed (or replaced by a newer frame) yet.
+         *
+         * While there are any, we don't know what will be on screen when the next frame
+         * is committed, so we can't tell the kernel which parts of the framebuffers changed.
+         */
+        atomic_int n_pending_frames;
+
+        /**
+         * @brief Whether the cursor changed while frames were pending, and that change wasn't pushed yet.
+         *
+         * The pending frames were built with the old cursor, and pushing another composition just for the
+         * cursor would compete with flutter's frames. So the change is applied once the pending frames were
+         * committed (see @ref on_present_frame), or with the next flutter frame, whichever comes first.
+         * All cursor changes in between are coalesced into one update.
+         */
+        atomic_bool cursor_update_pending;
+
+        /**
+         * @brief The number of layers of the last presented composition that got their own plane.
+         */
+        size_t n_presented_direct_layers;
+
+        /**
+         * @brief The cursor buffer and position that were presented along with the last composition.
+         */
+        struct cursor_buffer *pushed_cursor;
+        struct vec2i pushed_cursor_pos;
+
+        /**
+         * @brief Composites the layers that don't fit on the hardware planes into a single buffer.
+         *
+         * Created lazily, the first time we run out of planes.
+         */
+        struct gl_flattener *flattener;
+
+        /**
+         * @brief The KMS framebuffers of the flattener buffers.
+         *
+         * These are removed in @ref kms_window_deinit, and not when the buffers are destroyed,
+         * because the last flattener buffer might be released while the drmdev is locked.
+         */
+        struct {
+            struct gbm_bo *bo;
+            uint32_t fb_id, opaque_fb_id;
+        } flattened_fbs[4];
+        size_t n_flattened_fbs;
+
+        /**
+         * @brief Frames that were scanned out or dropped already, reused for the next compositions.
+         *
+         * Frames are destroyed from frame scheduler and drmdev callbacks, sometimes while the
+         * window is locked, so this has its own lock.
+         */
+        pthread_mutex_t frame_pool_lock;
+        struct frame *free_frames[KMS_WINDOW_FRAME_POOL_SIZE];
+        size_t n_free_frames;
     } kms;
 
+    /**
+     * @brief Dummy-window-specific fields if this is a dummy window.
+     *
+     */
+    struct {
+        /**
+         * @brief Where the composited frames are written to, if the window should composite
+         * its layers at all. See @ref dummy_window_enable_capture.
+         */
+        struct frame_capture *capture;
+
+        /**
+         * @brief Composites the layers offscreen, created along with the capture.
+         */
+        struct gl_flattener *flattener;
+
+        /**
+         * @brief The pixels read back from the flattener.
+         */
+        uint8_t *pixels;
+    } dummy;
+
     /**
      * @brief The type of rendering that should be used. (gl, vk)
      *
@@ -392,6 +525,7 @@ static int window_init(
     window->tracer = tracer_ref(tracer);
     window->frame_scheduler = frame_scheduler_ref(scheduler);
     window->refresh_rate = refresh_rate;
+    frame_scheduler_set_refresh_rate(scheduler, refresh_rate);
     window->pixel_ratio = pixel_ratio;
     window->has_dimensions = has_dimensions;
     window->width_mm = width_mm;
@@ -472,12 +606,8 @@ double window_get_refresh_rate(struct window *window) {
 int window_get_next_vblank(struct window *window, uint64_t *next_vblank_ns_out) {
     ASSERT_NOT_NULL(window);
     ASSERT_NOT_NULL(next_vblank_ns_out);
-    (void) window;
-    (void) next_vblank_ns_out;
-
-    /// TODO: Implement
-    UNIMPLEMENTED();
 
+    *next_vblank_ns_out = frame_scheduler_get_next_vblank(window->frame_scheduler);
     return 0;
 }
 
@@ -922,12 +1052,19 @@ MUST_CHECK struct window *kms_window_new(
     ASSUME(renderer_type != kOpenGL_RendererType);
 #endif
 
+#if !defined(HAVE_SOFTWARE)
+    ASSUME(renderer_type != kSoftware_RendererType);
+#endif
+
     // if opengl --> gl_renderer != NULL && vk_renderer == NULL
     assert(renderer_type != kOpenGL_RendererType || (gl_renderer != NULL && vk_renderer == NULL));
 
     // if vulkan --> vk_renderer != NULL && gl_renderer == NULL
     assert(renderer_type != kVulkan_RendererType || (vk_renderer != NULL && gl_renderer == NULL));
 
+    // if software --> gl_renderer == NULL && vk_renderer == NULL
+    assert(renderer_type != kSoftware_RendererType || (gl_renderer == NULL && vk_renderer == NULL));
+
     window = malloc(sizeof *window);
     if (window == NULL) {
         return NULL;
@@ -998,8 +1135,24 @@ MUST_CHECK struct window *kms_window_new(
     window->kms.crtc = selected_crtc;
     window->kms.mode = selected_mode;
     window->kms.should_apply_mode = true;
+    frame_scheduler_set_vblank_source(scheduler, drmdev, selected_crtc->id);
     window->kms.cursor = NULL;
     window->kms.pointer_icon = NULL;
+    memset(window->kms.cursor_cache, 0, sizeof window->kms.cursor_cache);
+    window->kms.cursor_cache_clock = 0;
+    window->kms.logged_cursor_plane_allocation_failed = false;
+    window->kms.has_cursor_plane = false;
+    window->kms.software_cursor = false;
+    atomic_init(&window->kms.composition_on_screen, false);
+    atomic_init(&window->kms.n_pending_frames, 0);
+    atomic_init(&window->kms.cursor_update_pending, false);
+    window->kms.n_presented_direct_layers = 0;
+    window->kms.pushed_cursor = NULL;
+    window->kms.pushed_cursor_pos = VEC2I(0, 0);
+    window->kms.flattener = NULL;
+    window->kms.n_flattened_fbs = 0;
+    pthread_mutex_init(&window->kms.frame_pool_lock, NULL);
+    window->kms.n_free_frames = 0;
     window->renderer_type = renderer_type;
     if (gl_renderer != NULL) {
 #ifdef HAVE_EGL_GLES2
@@ -1060,6 +1213,29 @@ void kms_window_deinit(struct window *window) {
     if (window->kms.cursor != NULL) {
         cursor_buffer_unref(window->kms.cursor);
     }
+    if (window->kms.pushed_cursor != NULL) {
+        cursor_buffer_unref(window->kms.pushed_cursor);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(window->kms.cursor_cache); i++) {
+        if (window->kms.cursor_cache[i].buffer != NULL) {
+            cursor_buffer_unref(window->kms.cursor_cache[i].buffer);
+        }
+    }
+    for (size_t i = 0; i < window->kms.n_flattened_fbs; i++) {
+        drmdev_rm_fb(window->kms.drmdev, window->kms.flattened_fbs[i].fb_id);
+        drmdev_rm_fb(window->kms.drmdev, window->kms.flattened_fbs[i].opaque_fb_id);
+    }
+    for (size_t i = 0; i < window->kms.n_free_frames; i++) {
+        free(window->kms.free_frames[i]);
+    }
+    pthread_mutex_destroy(&window->kms.frame_pool_lock);
+    if (window->kms.flattener != NULL) {
+#ifdef HAVE_EGL_GLES2
+        gl_flattener_unref(window->kms.flattener);
+#else
+        UNREACHABLE();
+#endif
+    }
     if (window->render_surface != NULL) {
         surface_unref(CAST_SURFACE(window->render_surface));
     }
@@ -1082,21 +1258,94 @@ void kms_window_deinit(struct window *window) {
 }
 
 struct frame {
+    struct window *window;
     struct tracer *tracer;
+    struct frame_scheduler *scheduler;
     struct kms_req *req;
     bool unset_should_apply_mode_on_commit;
+
+    /// The id of this frame in the frame timings, or zero if it isn't recorded.
+    uint64_t timings_id;
 };
 
-UNUSED static void on_scanout(struct drmdev *drmdev, uint64_t vblank_ns, void *userdata) {
+static struct frame *kms_window_take_frame(struct window *window) {
+    struct frame *frame;
+
+    pthread_mutex_lock(&window->kms.frame_pool_lock);
+    frame = window->kms.n_free_frames > 0 ? window->kms.free_frames[--window->kms.n_free_frames] : NULL;
+    pthread_mutex_unlock(&window->kms.frame_pool_lock);
+
+    if (frame == NULL) {
+        frame = malloc(sizeof *frame);
+    }
+
+    return frame;
+}
+
+static void frame_destroy(struct frame *frame) {
+    struct window *window;
+
+    window = frame->window;
+    frame_scheduler_unref(frame->scheduler);
+    tracer_unref(frame->tracer);
+    kms_req_unref(frame->req);
+
+    // The pool belongs to the window, so this has to happen before the window is unrefed.
+    pthread_mutex_lock(&window->kms.frame_pool_lock);
+    if (window->kms.n_free_frames < KMS_WINDOW_FRAME_POOL_SIZE) {
+        window->kms.free_frames[window->kms.n_free_frames++] = frame;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&window->kms.frame_pool_lock);
+
+    free(frame);
+    window_unref(window);
+}
+
+static void on_scanout(struct drmdev *drmdev, uint64_t vblank_ns, void *userdata) {
+    struct frame_scheduler *scheduler;
+    struct frame *frame;
+
     ASSERT_NOT_NULL(drmdev);
+    ASSERT_NOT_NULL(userdata);
     (void) drmdev;
-    (void) vblank_ns;
-    (void) userdata;
 
-    /// TODO: What should we do here?
+    frame = userdata;
+    scheduler = frame_scheduler_ref(frame->scheduler);
+
+    frame_timings_mark(
+        frame_scheduler_get_frame_timings(scheduler),
+        frame->timings_id,
+        kScanout_FrameStage,
+        vblank_ns != 0 ? vblank_ns : get_monotonic_time()
+    );
+    frame_destroy(frame);
+
+    // This might commit the next frame right away.
+    frame_scheduler_on_scanout(scheduler, vblank_ns != 0, vblank_ns);
+    frame_scheduler_unref(scheduler);
+}
+
+static void kms_window_update_cursor_locked(struct window *window);
+
+static int on_apply_pending_cursor_update(void *userdata) {
+    struct window *window;
+
+    ASSERT_NOT_NULL(userdata);
+    window = userdata;
+
+    window_lock(window);
+    kms_window_update_cursor_locked(window);
+    window_unlock(window);
+
+    window_unref(window);
+    return 0;
 }
 
 static void on_present_frame(void *userdata) {
+    struct frame_scheduler *scheduler;
+    struct tracer *tracer;
+    struct window *window;
     struct frame *frame;
     int ok;
 
@@ -1104,22 +1353,48 @@ static void on_present_frame(void *userdata) {
 
     frame = userdata;
 
-    LOG_KMS_DEBUG("on_present_frame: committing KMS request (blocking)...\n");
+    LOG_KMS_DEBUG("on_present_frame: committing KMS request (nonblocking)...\n");
+
+    // on_scanout might destroy the frame before kms_req_commit_nonblocking even returns.
+    tracer = tracer_ref(frame->tracer);
+    window = window_ref(frame->window);
 
-    TRACER_BEGIN(frame->tracer, "kms_req_commit_nonblocking");
-    ok = kms_req_commit_blocking(frame->req, NULL);
-    TRACER_END(frame->tracer, "kms_req_commit_nonblocking");
+    TRACER_BEGIN(tracer, "kms_req_commit_nonblocking");
+    frame_timings_mark(frame_scheduler_get_frame_timings(frame->scheduler), frame->timings_id, kCommit_FrameStage, get_monotonic_time());
+    ok = kms_req_commit_nonblocking(frame->req, on_scanout, frame, NULL);
+    TRACER_END(tracer, "kms_req_commit_nonblocking");
+
+    tracer_unref(tracer);
 
     if (ok != 0) {
         LOG_ERROR("Could not commit frame request.\n");
-        LOG_KMS_DEBUG("on_present_frame: FAILED kms_req_commit_blocking: errno=%d (%s)\n", ok, strerror(ok));
+        LOG_KMS_DEBUG("on_present_frame: FAILED kms_req_commit_nonblocking: errno=%d (%s)\n", ok, strerror(ok));
+
+        // Make sure the next composition is committed, even if it's the same as this one.
+        atomic_store(&window->kms.composition_on_screen, false);
+
+        scheduler = frame_scheduler_ref(frame->scheduler);
+        frame_destroy(frame);
+
+        // The frame won't be scanned out, but it's not queued anymore either.
+        frame_scheduler_on_scanout(scheduler, false, 0);
+        frame_scheduler_unref(scheduler);
     } else {
+        // the frame is destroyed in on_scanout, which might've been called already.
         LOG_KMS_DEBUG("on_present_frame: commit OK\n");
     }
 
-    tracer_unref(frame->tracer);
-    kms_req_unref(frame->req);
-    free(frame);
+    // If the cursor changed while frames were pending, apply that now. We might be called with the window
+    // locked (if the frame is committed right away), so do that on the platform thread.
+    if (atomic_fetch_sub(&window->kms.n_pending_frames, 1) == 1 && atomic_exchange(&window->kms.cursor_update_pending, false)) {
+        ok = flutter_drm_embedder_post_platform_task(on_apply_pending_cursor_update, window_ref(window));
+        if (ok != 0) {
+            LOG_ERROR("Couldn't post pending cursor update to the platform thread.\n");
+            window_unref(window);
+        }
+    }
+
+    window_unref(window);
 }
 
 static void on_cancel_frame(void *userdata) {
@@ -1128,20 +1403,355 @@ static void on_cancel_frame(void *userdata) {
 
     frame = userdata;
 
-    tracer_unref(frame->tracer);
-    kms_req_unref(frame->req);
-    free(frame);
+    LOG_KMS_DEBUG("on_cancel_frame: frame was replaced by a newer one before it could be presented.\n");
+    frame_timings_drop_frame(frame_scheduler_get_frame_timings(frame->scheduler), frame->timings_id);
+    atomic_fetch_sub(&frame->window->kms.n_pending_frames, 1);
+    frame_destroy(frame);
 }
 
-static int kms_window_push_composition_locked(struct window *window, struct fl_layer_composition *composition) {
+#ifdef HAVE_EGL_GLES2
+static void on_release_flattened_buffer(void *userdata) {
+    ASSERT_NOT_NULL(userdata);
+    gl_flattener_buffer_release(userdata);
+}
+
+static int kms_window_get_flattened_fb_locked(struct window *window, struct gbm_bo *bo, bool opaque, uint32_t *fb_id_out) {
+    uint32_t fb_id, opaque_fb_id;
+    size_t i;
+
+    for (i = 0; i < window->kms.n_flattened_fbs; i++) {
+        if (window->kms.flattened_fbs[i].bo == bo) {
+            break;
+        }
+    }
+
+    if (i == window->kms.n_flattened_fbs) {
+        if (i == ARRAY_SIZE(window->kms.flattened_fbs)) {
+            return ENOSPC;
+        }
+
+        fb_id = drmdev_add_fb_from_gbm_bo(window->kms.drmdev, bo, /* cast_opaque */ false);
+        if (fb_id == 0) {
+            LOG_ERROR("Couldn't add flattened layers buffer as DRM framebuffer.\n");
+            return EIO;
+        }
+
+        opaque_fb_id = drmdev_add_fb_from_gbm_bo(window->kms.drmdev, bo, /* cast_opaque */ true);
+        if (opaque_fb_id == 0) {
+            LOG_ERROR("Couldn't add flattened layers buffer as opaque DRM framebuffer.\n");
+            drmdev_rm_fb(window->kms.drmdev, fb_id);
+            return EIO;
+        }
+
+        window->kms.flattened_fbs[i].bo = bo;
+        window->kms.flattened_fbs[i].fb_id = fb_id;
+        window->kms.flattened_fbs[i].opaque_fb_id = opaque_fb_id;
+        window->kms.n_flattened_fbs++;
+    }
+
+    *fb_id_out = opaque ? window->kms.flattened_fbs[i].opaque_fb_id : window->kms.flattened_fbs[i].fb_id;
+    return 0;
+}
+
+/**
+ * @brief Whether layer @a index of @a composition shows exactly the same surface contents
+ * as in @a previous.
+ */
+static bool layer_contents_unchanged(struct fl_layer_composition *previous, struct fl_layer_composition *composition, size_t index) {
+    struct fl_layer *layer, *previous_layer;
+
+    if (index >= fl_layer_composition_get_n_layers(previous)) {
+        return false;
+    }
+
+    layer = fl_layer_composition_peek_layer(composition, index);
+    previous_layer = fl_layer_composition_peek_layer(previous, index);
+    return layer->surface == previous_layer->surface && layer->surface_revision == previous_layer->surface_revision;
+}
+
+/**
+ * @brief Gets the damage of the flattened buffer, i.e. the regions covered by flattened layers
+ * that changed since @a previous, before or after the change.
+ *
+ * @returns false if the whole buffer is damaged.
+ */
+static bool kms_window_get_flattened_damage(
+    struct window *window,
+    struct fl_layer_composition *previous,
+    struct fl_layer_composition *composition,
+    size_t first_layer,
+    struct drm_mode_rect *clips_out,
+    size_t *n_clips_out
+) {
+    struct aa_rect damage_rects[KMS_MAX_DAMAGE_CLIPS];
+    size_t n_damage_rects;
+
+    if (previous == NULL || fl_layer_composition_get_n_layers(previous) != fl_layer_composition_get_n_layers(composition) ||
+        window->kms.n_presented_direct_layers != first_layer) {
+        *n_clips_out = 0;
+        return false;
+    }
+
+    n_damage_rects = 0;
+    for (size_t i = first_layer; i < fl_layer_composition_get_n_layers(composition); i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+        struct fl_layer *previous_layer = fl_layer_composition_peek_layer(previous, i);
+        struct aa_rect rect;
+
+        if (layer_contents_unchanged(previous, composition, i) && fl_layer_props_equals(&layer->props, &previous_layer->props)) {
+            continue;
+        }
+
+        rect = aa_rect_union(quad_get_aa_bounding_rect(layer->props.quad), quad_get_aa_bounding_rect(previous_layer->props.quad));
+
+        // If we run out of rects, grow the last one.
+        if (n_damage_rects == ARRAY_SIZE(damage_rects)) {
+            damage_rects[n_damage_rects - 1] = aa_rect_union(damage_rects[n_damage_rects - 1], rect);
+        } else {
+            damage_rects[n_damage_rects++] = rect;
+        }
+    }
+
+    return fl_layer_props_get_damage_clips(
+        &(const struct fl_layer_props){
+            .has_damage = true,
+            .n_damage_rects = n_damage_rects,
+            .damage_rects = damage_rects,
+        },
+        clips_out,
+        n_clips_out
+    );
+}
+
+/**
+ * @brief Draws the current cursor on top of everything flattened so far.
+ */
+static int kms_window_flatten_cursor_locked(struct window *window) {
+    struct cursor_buffer *cursor;
+    struct quad quad;
+    struct vec2i pos;
+    int fd, ok;
+
+    cursor = window->kms.cursor;
+    ASSERT_NOT_NULL(cursor);
+
+    fd = gbm_bo_get_fd(cursor->bo);
+    if (fd < 0) {
+        LOG_ERROR("Couldn't get dmabuf fd of cursor buffer for flattening.\n");
+        return EIO;
+    }
+
+    pos = vec2i_sub(window->cursor_pos, cursor->hotspot);
+    quad = get_quad(AA_RECT_FROM_COORDS(pos.x, pos.y, cursor->width, cursor->height));
+
+    ok = gl_flattener_draw(
+        window->kms.flattener,
+        &(const struct gl_flattener_source){
+            .format = cursor->format,
+            .width = cursor->width,
+            .height = cursor->height,
+            .fd = fd,
+            .offset = 0,
+            .pitch = gbm_bo_get_stride(cursor->bo),
+            .has_modifier = false,
+            .modifier = DRM_FORMAT_MOD_LINEAR,
+        },
+        &quad,
+        1.0,
+        NULL,
+        0,
+        cursor_buffer_unref_with_locked_drmdev,
+        cursor_buffer_ref(cursor)
+    );
+
+    // EGL dups the fd if it needs it.
+    close(fd);
+
+    if (ok != 0) {
+        cursor_buffer_unref(cursor);
+        return ok;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Composites the layers of @a composition starting at @a first_layer into a single buffer
+ * using OpenGL ES, and pushes that buffer as a single fullscreen layer.
+ *
+ * Used for the layers that didn't get a hardware plane, so we don't fail presenting the whole frame.
+ * If @a draw_cursor is true, the cursor is drawn on top, since it didn't get a plane either.
+ */
+static int kms_window_push_flattened_layers_locked(
+    struct window *window,
+    struct fl_layer_composition *previous,
+    struct fl_layer_composition *composition,
+    size_t first_layer,
+    bool draw_cursor,
+    struct kms_req_builder *builder
+) {
+    struct drm_mode_rect damage_clips[KMS_MAX_DAMAGE_CLIPS];
+    struct gl_flattener_buffer *buffer;
+    struct vec2i size;
+    size_t n_damage_clips;
+    uint32_t fb_id;
+    bool opaque, has_damage;
+    int ok;
+
+    size = VEC2I(window->kms.mode->hdisplay, window->kms.mode->vdisplay);
+
+    if (window->kms.flattener == NULL) {
+        window->kms.flattener = gl_flattener_new(window->gl_renderer, size);
+        if (window->kms.flattener == NULL) {
+            LOG_ERROR("Couldn't create GL flattener for compositing layers without a hardware plane.\n");
+            return EIO;
+        }
+    }
+
+    // If the flattened layers are the bottom-most layer, the buffer is scanned out
+    // as an opaque framebuffer, so clear it to opaque black.
+    opaque = kms_req_builder_prefer_next_layer_opaque(builder);
+
+    TRACER_BEGIN(window->tracer, "kms_window_push_flattened_layers_locked");
+
+    ok = gl_flattener_begin(window->kms.flattener, opaque);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't begin flattening layers. gl_flattener_begin: %s\n", strerror(ok));
+        goto fail_end_trace;
+    }
+
+    for (size_t i = first_layer; i < fl_layer_composition_get_n_layers(composition); i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+
+        ok = surface_present_gl(layer->surface, &layer->props, window->kms.flattener);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't flatten flutter layer. surface_present_gl: %s\n", strerror(ok));
+            gl_flattener_cancel(window->kms.flattener);
+            goto fail_end_trace;
+        }
+    }
+
+    if (draw_cursor) {
+        ok = kms_window_flatten_cursor_locked(window);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't flatten cursor. kms_window_flatten_cursor_locked: %s\n", strerror(ok));
+            gl_flattener_cancel(window->kms.flattener);
+            goto fail_end_trace;
+        }
+    }
+
+    buffer = gl_flattener_end(window->kms.flattener);
+
+    // The cursor moves independently of the layers, so the whole buffer is damaged if it's drawn in there.
+    if (draw_cursor) {
+        has_damage = false;
+        n_damage_clips = 0;
+    } else {
+        has_damage = kms_window_get_flattened_damage(window, previous, composition, first_layer, damage_clips, &n_damage_clips);
+    }
+
+    ok = kms_window_get_flattened_fb_locked(window, gl_flattener_buffer_get_bo(buffer), opaque, &fb_id);
+    if (ok != 0) {
+        goto fail_release_buffer;
+    }
+
+    ok = kms_req_builder_push_fb_layer(
+        builder,
+        &(const struct kms_fb_layer){
+            .drm_fb_id = fb_id,
+            .format = opaque ? PIXFMT_XRGB8888 : PIXFMT_ARGB8888,
+            .has_modifier = false,
+            .modifier = 0,
+            .src_x = 0,
+            .src_y = 0,
+            .src_w = ((uint32_t) size.x) << 16,
+            .src_h = ((uint32_t) size.y) << 16,
+            .dst_x = 0,
+            .dst_y = 0,
+            .dst_w = size.x,
+            .dst_h = size.y,
+            .has_rotation = true,
+            .rotation = PLANE_TRANSFORM_ROTATE_0,
+            .has_in_fence_fd = false,
+            .in_fence_fd = 0,
+            .has_damage = has_damage,
+            .n_damage_clips = n_damage_clips,
+            .damage_clips = damage_clips,
+        },
+        on_release_flattened_buffer,
+        NULL,
+        buffer,
+        NULL
+    );
+    if (ok != 0) {
+        LOG_ERROR("Couldn't present flattened layers. kms_req_builder_push_fb_layer: %s\n", strerror(ok));
+        goto fail_release_buffer;
+    }
+
+    TRACER_END(window->tracer, "kms_window_push_flattened_layers_locked");
+    return 0;
+
+fail_release_buffer:
+    gl_flattener_buffer_release(buffer);
+
+fail_end_trace:
+    TRACER_END(window->tracer, "kms_window_push_flattened_layers_locked");
+    return ok;
+}
+#endif
+
+/**
+ * @brief Updates the damage of the directly scanned out layers of @a composition.
+ *
+ * The damage the compositor specified is relative to the previous composition. If that's not what's on screen
+ * (@a previous is NULL) or the layers are assigned to planes differently, the whole layer is damaged.
+ * Layers that still show the same surface revision as before aren't damaged at all.
+ */
+static void kms_window_update_layer_damage(
+    struct window *window,
+    struct fl_layer_composition *previous,
+    struct fl_layer_composition *composition,
+    size_t n_direct
+) {
+    bool same_planes;
+
+    same_planes = previous != NULL && fl_layer_composition_get_n_layers(previous) == fl_layer_composition_get_n_layers(composition) &&
+                  window->kms.n_presented_direct_layers == n_direct;
+
+    for (size_t i = 0; i < n_direct; i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+
+        if (!same_planes || fl_layer_composition_peek_layer(previous, i)->surface != layer->surface) {
+            layer->props.has_damage = false;
+        } else if (layer->surface_revision == fl_layer_composition_peek_layer(previous, i)->surface_revision) {
+            layer->props.has_damage = true;
+            layer->props.n_damage_rects = 0;
+            layer->props.damage_rects = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Presents @a composition on screen.
+ *
+ * @param timings_id The id of the frame in the frame timings, or zero if this frame
+ *                   shouldn't be recorded. (e.g. because it's just a cursor update)
+ */
+static int kms_window_push_composition_locked(struct window *window, struct fl_layer_composition *composition, uint64_t timings_id) {
+    struct fl_layer_composition *previous;
+    struct frame_timings *timings;
     struct kms_req_builder *builder;
     struct kms_req *req;
     struct frame *frame;
+    size_t n_layers, n_direct;
+    bool can_flatten, retried, draw_cursor;
     int ok;
 
     ASSERT_NOT_NULL(window);
     ASSERT_NOT_NULL(composition);
 
+    timings = frame_scheduler_get_frame_timings(window->frame_scheduler);
+
     // If flutter won't request frames (because the vsync callback is broken),
     // we'll wait here for the previous frame to be presented / rendered.
     // Otherwise the surface_swap_buffers at the bottom might allocate an
@@ -1157,14 +1767,65 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
     //     }
     // }
 
-    /// TODO: If we don't have new revisions, we don't need to scanout anything.
+    // If nothing changed since the last composition we committed, there's nothing to scan out.
+    // Committing anyway would just cost us a vblank and keep the display pipeline busy.
+    if (atomic_load(&window->kms.composition_on_screen) && window->composition != NULL &&
+        fl_layer_composition_equals(window->composition, composition) && window->kms.pushed_cursor == window->kms.cursor &&
+        vec2i_equals(window->kms.pushed_cursor_pos, window->cursor_pos)) {
+        LOG_KMS_DEBUG("kms_window_push_composition: composition didn't change, skipping commit.\n");
+        fl_layer_composition_swap_ptrs(&window->composition, composition);
+        frame_timings_skip_frame(timings, timings_id);
+        return 0;
+    }
+
+    // Damage is relative to what's on screen when this frame is committed. That's the previous
+    // composition, if it was committed successfully and there's no other frame that might still be
+    // committed before this one.
+    previous = NULL;
+    if (atomic_load(&window->kms.composition_on_screen) && atomic_load(&window->kms.n_pending_frames) == 0 &&
+        window->composition != NULL) {
+        previous = fl_layer_composition_ref(window->composition);
+    }
+
+    atomic_store(&window->kms.composition_on_screen, false);
     fl_layer_composition_swap_ptrs(&window->composition, composition);
 
+    n_layers = fl_layer_composition_get_n_layers(composition);
+
+    // Layers that can't be scanned out directly (no free plane, not an axis-aligned rect,
+    // translucent or with rounded / non axis-aligned clips) are composited into a single buffer using OpenGL ES instead.
+    // n_direct is the number of bottom-most layers that get their own plane.
+#ifdef HAVE_EGL_GLES2
+    can_flatten = window->renderer_type == kOpenGL_RendererType && window->gl_renderer != NULL;
+#else
+    can_flatten = false;
+#endif
+
+    n_direct = n_layers;
+    if (can_flatten) {
+        for (size_t i = 0; i < n_layers; i++) {
+            if (fl_layer_props_needs_gpu_composition(&fl_layer_composition_peek_layer(composition, i)->props)) {
+                n_direct = i;
+                break;
+            }
+        }
+    }
+
+    // Without a hardware plane for the cursor, it's drawn on top of the flattened layers.
+    // The topmost layer is flattened as well, so the flattened buffer can take its plane.
+    draw_cursor = can_flatten && window->kms.software_cursor && window->kms.cursor != NULL;
+    if (draw_cursor && n_layers > 0) {
+        n_direct = MIN2(n_direct, n_layers - 1);
+    }
+
+    retried = false;
+
+retry:
     builder = drmdev_create_request_builder(window->kms.drmdev, window->kms.crtc->id);
     if (builder == NULL) {
         LOG_KMS_DEBUG("kms_window_push_composition: FAILED to create request builder for crtc_id=%u\n", window->kms.crtc->id);
         ok = ENOMEM;
-        goto fail_unref_builder;
+        goto fail_unref_previous;
     }
     LOG_KMS_DEBUG("kms_window_push_composition: created request builder (crtc_id=%u, n_layers=%zu)\n",
         window->kms.crtc->id, fl_layer_composition_get_n_layers(composition));
@@ -1191,11 +1852,13 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
         }
     }
 
-    for (size_t i = 0; i < fl_layer_composition_get_n_layers(composition); i++) {
+    kms_window_update_layer_damage(window, previous, composition, n_direct);
+
+    for (size_t i = 0; i < n_direct; i++) {
         struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
 
         LOG_KMS_DEBUG("  Presenting layer %zu/%zu: surface=%p, is_aa_rect=%s",
-            i + 1, fl_layer_composition_get_n_layers(composition),
+            i + 1, n_layers,
             (void*)layer->surface, layer->props.is_aa_rect ? "yes" : "no");
         if (layer->props.is_aa_rect) {
             LOG_KMS_DEBUG_UNPREFIXED(", rect=(%.1f,%.1f %.1fx%.1f)",
@@ -1206,7 +1869,17 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
             layer->props.opacity, layer->props.rotation);
 
         ok = surface_present_kms(layer->surface, &layer->props, builder);
-        if (ok != 0) {
+        if (ok != 0 && can_flatten && !retried) {
+            // Most likely we ran out of planes. The flattened layers need a plane too,
+            // so the layer below this one is flattened as well.
+            LOG_KMS_DEBUG("  surface_present_kms for layer %zu failed (%s), flattening layers %zu..%zu.\n",
+                i, strerror(ok), i > 0 ? i - 1 : 0, n_layers - 1);
+
+            kms_req_builder_unref(builder);
+            n_direct = i > 0 ? i - 1 : 0;
+            retried = true;
+            goto retry;
+        } else if (ok != 0) {
             LOG_ERROR("Couldn't present flutter layer on screen. surface_present_kms: %s\n", strerror(ok));
             LOG_KMS_DEBUG("  FAILED: surface_present_kms for layer %zu: errno=%d (%s)\n", i, ok, strerror(ok));
             goto fail_unref_builder;
@@ -1214,8 +1887,25 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
         LOG_KMS_DEBUG("  Layer %zu presented OK\n", i + 1);
     }
 
+    if (n_direct < n_layers || draw_cursor) {
+#ifdef HAVE_EGL_GLES2
+        ok = kms_window_push_flattened_layers_locked(window, previous, composition, n_direct, draw_cursor, builder);
+        if (ok != 0) {
+            goto fail_unref_builder;
+        }
+#else
+        UNREACHABLE();
+#endif
+    }
+
+    if (previous != NULL) {
+        fl_layer_composition_unrefp(&previous);
+    }
+
+    frame_timings_mark(timings, timings_id, kSurfacesPresented_FrameStage, get_monotonic_time());
+
     // add cursor infos
-    if (window->kms.cursor != NULL) {
+    if (window->kms.cursor != NULL && !draw_cursor) {
         ok = kms_req_builder_push_fb_layer(
             builder,
             &(const struct kms_fb_layer){
@@ -1242,7 +1932,18 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
             window->kms.cursor,
             &window->kms.has_cursor_plane
         );
-        if (ok != 0) {
+        if (ok != 0 && can_flatten) {
+            // No plane left for the cursor. Draw it using OpenGL ES from now on.
+            LOG_DEBUG("Couldn't present cursor on a hardware plane, drawing it using OpenGL ES instead.\n");
+            window->kms.software_cursor = true;
+
+            kms_req_builder_unref(builder);
+            draw_cursor = true;
+            if (n_layers > 0) {
+                n_direct = MIN2(n_direct, n_layers - 1);
+            }
+            goto retry;
+        } else if (ok != 0) {
             window->kms.has_cursor_plane = false;
             if (!window->kms.logged_cursor_plane_allocation_failed) {
                 window->kms.logged_cursor_plane_allocation_failed = true;
@@ -1251,6 +1952,8 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
         } else {
             cursor_buffer_ref(window->kms.cursor);
         }
+    } else {
+        window->kms.has_cursor_plane = false;
     }
 
     req = kms_req_builder_build(builder);
@@ -1261,14 +1964,35 @@ static int kms_window_push_composition_locked(struct window *window, struct fl_l
     kms_req_builder_unref(builder);
     builder = NULL;
 
-    frame = malloc(sizeof *frame);
+    frame_timings_mark(timings, timings_id, kRequestBuilt_FrameStage, get_monotonic_time());
+
+    frame = kms_window_take_frame(window);
     if (frame == NULL) {
+        ok = ENOMEM;
         goto fail_unref_req;
     }
 
+    frame->window = window_ref(window);
     frame->req = req;
     frame->tracer = tracer_ref(window->tracer);
+    frame->scheduler = frame_scheduler_ref(window->frame_scheduler);
     frame->unset_should_apply_mode_on_commit = window->kms.should_apply_mode;
+    frame->timings_id = timings_id;
+
+    // Set before presenting, since on_present_frame might run (and fail) right away.
+    atomic_store(&window->kms.composition_on_screen, true);
+    atomic_fetch_add(&window->kms.n_pending_frames, 1);
+    window->kms.n_presented_direct_layers = n_direct;
+    if (window->kms.pushed_cursor != window->kms.cursor) {
+        if (window->kms.pushed_cursor != NULL) {
+            cursor_buffer_unref(window->kms.pushed_cursor);
+        }
+        window->kms.pushed_cursor = window->kms.cursor != NULL ? cursor_buffer_ref(window->kms.cursor) : NULL;
+    }
+    window->kms.pushed_cursor_pos = window->cursor_pos;
+
+    // This frame has the newest cursor already.
+    atomic_store(&window->kms.cursor_update_pending, false);
 
     frame_scheduler_present_frame(window->frame_scheduler, on_present_frame, frame, on_cancel_frame);
 
@@ -1332,15 +2056,27 @@ fail_unref_req:
 
 fail_unref_builder:
     kms_req_builder_unref(builder);
+
+fail_unref_previous:
+    if (previous != NULL) {
+        fl_layer_composition_unref(previous);
+    }
     return ok;
 }
 
 static int kms_window_push_composition(struct window *window, struct fl_layer_composition *composition) {
+    struct frame_timings *timings;
+    uint64_t timings_id;
     int ok;
 
+    // The engine just handed us the layers of the frame it began last.
+    timings = frame_scheduler_get_frame_timings(window->frame_scheduler);
+    timings_id = frame_timings_take_current_frame(timings);
+    frame_timings_mark(timings, timings_id, kPresentLayers_FrameStage, get_monotonic_time());
+
     window_lock(window);
 
-    ok = kms_window_push_composition_locked(window, composition);
+    ok = kms_window_push_composition_locked(window, composition, timings_id);
 
     window_unlock(window);
 
@@ -1501,9 +2237,7 @@ static struct render_surface *kms_window_get_render_surface_internal(struct wind
 #else
         UNREACHABLE();
 #endif
-    } else {
-        ASSUME(window->renderer_type == kVulkan_RendererType);
-
+    } else if (window->renderer_type == kVulkan_RendererType) {
         // vulkan
 #ifdef HAVE_VULKAN
         struct vk_gbm_render_surface *vk_surface =
@@ -1516,6 +2250,21 @@ static struct render_surface *kms_window_get_render_surface_internal(struct wind
         }
 #else
         UNREACHABLE();
+#endif
+    } else {
+        ASSUME(window->renderer_type == kSoftware_RendererType);
+
+        // software. Dumb buffers are always linear, so the modifiers don't matter.
+#ifdef HAVE_SOFTWARE
+        struct sw_render_surface *sw_surface = sw_render_surface_new(window->tracer, size, window->kms.drmdev, pixel_format);
+        if (sw_surface == NULL) {
+            LOG_ERROR("Couldn't create software rendering surface.\n");
+            render_surface = NULL;
+        } else {
+            render_surface = CAST_RENDER_SURFACE(sw_surface);
+        }
+#else
+        UNREACHABLE();
 #endif
     }
 
@@ -1551,6 +2300,101 @@ static EGLSurface kms_window_get_egl_surface(struct window *window) {
 }
 #endif
 
+/**
+ * @brief Returns a new reference to the (possibly cached) cursor buffer for @a icon.
+ */
+static struct cursor_buffer *kms_window_get_cursor_buffer_locked(struct window *window, const struct pointer_icon *icon) {
+    struct cursor_buffer *buffer;
+    size_t lru;
+
+    lru = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(window->kms.cursor_cache); i++) {
+        buffer = window->kms.cursor_cache[i].buffer;
+        if (buffer != NULL && buffer->icon == icon && buffer->rotation.u64 == window->rotation.u64) {
+            window->kms.cursor_cache[i].last_used = ++window->kms.cursor_cache_clock;
+            return cursor_buffer_ref(buffer);
+        }
+
+        if (buffer == NULL || (window->kms.cursor_cache[lru].buffer != NULL &&
+                               window->kms.cursor_cache[i].last_used < window->kms.cursor_cache[lru].last_used)) {
+            lru = i;
+        }
+    }
+
+    buffer = cursor_buffer_new(window->kms.drmdev, icon, window->rotation);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    // The cache keeps the initial reference.
+    if (window->kms.cursor_cache[lru].buffer != NULL) {
+        cursor_buffer_unref(window->kms.cursor_cache[lru].buffer);
+    }
+    window->kms.cursor_cache[lru].buffer = buffer;
+    window->kms.cursor_cache[lru].last_used = ++window->kms.cursor_cache_clock;
+
+    return cursor_buffer_ref(buffer);
+}
+
+/**
+ * @brief Applies the current cursor buffer & position by updating just the hardware cursor plane,
+ * or if that's not possible, by pushing the current composition again.
+ *
+ * If there are frames waiting to be committed, the update is deferred until they are,
+ * see @ref cursor_update_pending.
+ */
+static void kms_window_update_cursor_locked(struct window *window) {
+    struct cursor_buffer *cursor;
+    int ok;
+
+    cursor = window->kms.cursor;
+
+    // Set the flag before checking for pending frames, so either on_present_frame sees it after
+    // the last pending frame was committed, or we see that there are no more pending frames.
+    atomic_store(&window->kms.cursor_update_pending, true);
+    if (atomic_load(&window->kms.n_pending_frames) > 0) {
+        return;
+    }
+
+    // on_present_frame took care of it in the meantime.
+    if (!atomic_exchange(&window->kms.cursor_update_pending, false)) {
+        return;
+    }
+
+    // The cursor can only be updated on its own if it's on a hardware cursor plane already.
+    if (window->kms.has_cursor_plane) {
+        if (cursor != NULL) {
+            ok = drmdev_set_cursor(
+                window->kms.drmdev,
+                window->kms.crtc->id,
+                gbm_bo_get_handle(cursor->bo).u32,
+                cursor->drm_fb_id,
+                VEC2I(cursor->width, cursor->height),
+                vec2i_sub(window->cursor_pos, cursor->hotspot)
+            );
+        } else {
+            ok = drmdev_set_cursor(window->kms.drmdev, window->kms.crtc->id, 0, 0, VEC2I(0, 0), VEC2I(0, 0));
+        }
+
+        if (ok == 0) {
+            if (window->kms.pushed_cursor != NULL) {
+                cursor_buffer_unref(window->kms.pushed_cursor);
+            }
+            window->kms.pushed_cursor = cursor != NULL ? cursor_buffer_ref(cursor) : NULL;
+            window->kms.pushed_cursor_pos = window->cursor_pos;
+            window->kms.has_cursor_plane = cursor != NULL;
+            return;
+        }
+    }
+
+    // Software cursor: scan out the cursor on whatever plane kms_window_push_composition_locked
+    // finds for it, or draw it into the flattened layers if there's none. Cursor changes until
+    // this frame is committed are coalesced, so it's at most one extra commit per frame.
+    if (window->composition != NULL) {
+        kms_window_push_composition_locked(window, window->composition, 0);
+    }
+}
+
 static int kms_window_set_cursor_locked(
     // clang-format off
     struct window *window,
@@ -1586,45 +2430,37 @@ static int kms_window_set_cursor_locked(
 
     if (enabled) {
         if (cursor == NULL || icon != cursor->icon) {
-            cursor = cursor_buffer_new(window->kms.drmdev, window->kms.pointer_icon, window->rotation);
+            cursor = kms_window_get_cursor_buffer_locked(window, window->kms.pointer_icon);
             if (cursor == NULL) {
                 return EIO;
             }
 
             cursor_buffer_swap_ptrs(&window->kms.cursor, cursor);
 
-            // cursor is created with refcount 1. cursor_buffer_swap_ptrs
-            // increases refcount by one. deref here so we don't leak a
-            // reference.
+            // cursor_buffer_swap_ptrs took its own reference.
             cursor_buffer_unrefp(&cursor);
 
-            // apply the new cursor icon & position by scanning out a new frame.
             window->cursor_pos = pos;
-            if (window->composition != NULL) {
-                kms_window_push_composition_locked(window, window->composition);
-            }
+            kms_window_update_cursor_locked(window);
         } else if (has_pos) {
-            // apply the new cursor position using drmModeMoveCursor
             window->cursor_pos = pos;
 
-            // if we have a hardware cursor plane, just move the cursor.
+            // if we have a hardware cursor plane and no frame is waiting to be committed, just move the cursor.
             // this is very fast and we can do that a lot of times per frame.
             //
-            // if we don't have a hardware cursor plane, we need to do a full commit.
-            // However, we can only do one commit per vsync, so if flutter also later
-            // wants to present a frame, we wouldn't be able to present it. Even later
-            // cursor movements in the same vsync interval we couldn't show on screen anymore.
-            //
-            // Mutter (GNOME's compositor) has an extra KMS cursor thread with high priority for that purpose.
-            if (window->kms.has_cursor_plane) {
-                drmdev_move_cursor(window->kms.drmdev, window->kms.crtc->id, vec2i_sub(pos, window->kms.cursor->hotspot));
+            // if we don't, the cursor is scanned out on an overlay plane (or drawn into the flattened layers),
+            // and it's applied with the next commit.
+            if (window->kms.has_cursor_plane && atomic_load(&window->kms.n_pending_frames) == 0 &&
+                drmdev_move_cursor(window->kms.drmdev, window->kms.crtc->id, vec2i_sub(pos, window->kms.cursor->hotspot)) == 0) {
+                window->kms.pushed_cursor_pos = pos;
             } else {
-                // for now just don't do anything.
+                kms_window_update_cursor_locked(window);
             }
         }
     } else {
         if (window->kms.cursor != NULL) {
             cursor_buffer_unrefp(&window->kms.cursor);
+            kms_window_update_cursor_locked(window);
         }
     }
 
@@ -1709,18 +2545,141 @@ MUST_CHECK struct window *dummy_window_new(
 #endif
     window->deinit = dummy_window_deinit;
     window->set_cursor_locked = dummy_window_set_cursor_locked;
+    window->dummy.capture = NULL;
+    window->dummy.flattener = NULL;
+    window->dummy.pixels = NULL;
     return window;
 }
 
+int dummy_window_enable_capture(struct window *window, const char *target, const char *timings_path) {
+    struct frame_capture *capture;
+    struct vec2i size;
+
+    ASSERT_NOT_NULL(window);
+    ASSERT_NOT_NULL(target);
+    assert(window->push_composition == dummy_window_push_composition);
+    assert(window->dummy.capture == NULL);
+
+#ifdef HAVE_EGL_GLES2
+    if (window->gl_renderer == NULL) {
+        LOG_ERROR("Capturing frames is only supported when rendering using OpenGL.\n");
+        return ENOTSUP;
+    }
+
+    size = vec2f_round_to_integer(window->display_size);
+
+    capture = frame_capture_new(target, timings_path, size);
+    if (capture == NULL) {
+        return EINVAL;
+    }
+
+    window->dummy.pixels = malloc((size_t) size.x * size.y * 4);
+    if (window->dummy.pixels == NULL) {
+        goto fail_destroy_capture;
+    }
+
+    window->dummy.flattener = gl_flattener_new_offscreen(window->gl_renderer, size);
+    if (window->dummy.flattener == NULL) {
+        LOG_ERROR("Couldn't create GL flattener for capturing frames.\n");
+        goto fail_free_pixels;
+    }
+
+    window->dummy.capture = capture;
+    return 0;
+
+fail_free_pixels:
+    free(window->dummy.pixels);
+    window->dummy.pixels = NULL;
+
+fail_destroy_capture:
+    frame_capture_destroy(capture);
+    return EIO;
+#else
+    (void) capture;
+    (void) size;
+    (void) timings_path;
+    LOG_ERROR("Capturing frames is only supported when rendering using OpenGL.\n");
+    return ENOTSUP;
+#endif
+}
+
+#ifdef HAVE_EGL_GLES2
+static int dummy_window_capture_locked(struct window *window, struct fl_layer_composition *composition, uint64_t present_ns) {
+    struct gl_flattener_buffer *buffer;
+    uint64_t composited_ns, read_back_ns;
+    int ok;
+
+    TRACER_BEGIN(window->tracer, "dummy_window_capture_locked");
+
+    ok = gl_flattener_begin(window->dummy.flattener, true);
+    if (ok != 0) {
+        LOG_ERROR("Couldn't begin compositing captured frame. gl_flattener_begin: %s\n", strerror(ok));
+        goto out_end_trace;
+    }
+
+    for (size_t i = 0; i < fl_layer_composition_get_n_layers(composition); i++) {
+        struct fl_layer *layer = fl_layer_composition_peek_layer(composition, i);
+
+        ok = surface_present_gl(layer->surface, &layer->props, window->dummy.flattener);
+        if (ok != 0) {
+            LOG_ERROR("Couldn't composite flutter layer for capturing. surface_present_gl: %s\n", strerror(ok));
+            gl_flattener_cancel(window->dummy.flattener);
+            goto out_end_trace;
+        }
+    }
+
+    buffer = gl_flattener_end(window->dummy.flattener);
+    composited_ns = get_monotonic_time();
+
+    // This waits for compositing to finish, so the readback time includes the GPU time.
+    ok = gl_flattener_buffer_read_pixels(buffer, window->dummy.pixels);
+    gl_flattener_buffer_release(buffer);
+    if (ok != 0) {
+        goto out_end_trace;
+    }
+
+    read_back_ns = get_monotonic_time();
+
+    ok = frame_capture_write(
+        window->dummy.capture,
+        &(const struct frame_capture_frame){
+            .size = gl_flattener_get_size(window->dummy.flattener),
+            .pixels = window->dummy.pixels,
+            .present_ns = present_ns,
+            .composite_ns = composited_ns - present_ns,
+            .readback_ns = read_back_ns - composited_ns,
+        }
+    );
+
+out_end_trace:
+    TRACER_END(window->tracer, "dummy_window_capture_locked");
+    return ok;
+}
+#endif
+
 static int dummy_window_push_composition(struct window *window, struct fl_layer_composition *composition) {
+    uint64_t present_ns;
+    int ok;
+
+    present_ns = get_monotonic_time();
+
     window_lock(window);
 
-    /// TODO: Maybe allow to export the layer composition as an image, for testing purposes.
-    (void) composition;
+    // Keep the composition around like a KMS window would, so it's only recycled once it's replaced.
+    fl_layer_composition_swap_ptrs(&window->composition, composition);
+
+    ok = 0;
+    if (window->dummy.capture != NULL) {
+#ifdef HAVE_EGL_GLES2
+        ok = dummy_window_capture_locked(window, composition, present_ns);
+#else
+        UNREACHABLE();
+#endif
+    }
 
     window_unlock(window);
 
-    return 0;
+    return ok;
 }
 
 static struct render_surface *dummy_window_get_render_surface_internal(struct window *window, bool has_size, UNUSED struct vec2i size) {
@@ -1764,14 +2723,27 @@ static struct render_surface *dummy_window_get_render_surface_internal(struct wi
 #else
         UNREACHABLE();
 #endif
-    } else {
-        ASSUME(window->renderer_type == kVulkan_RendererType);
-
+    } else if (window->renderer_type == kVulkan_RendererType) {
         // vulkan
 #ifdef HAVE_VULKAN
         UNIMPLEMENTED();
 #else
         UNREACHABLE();
+#endif
+    } else {
+        ASSUME(window->renderer_type == kSoftware_RendererType);
+
+        // software
+#ifdef HAVE_SOFTWARE
+        struct sw_render_surface *sw_surface = sw_render_surface_new_headless(window->tracer, size);
+        if (sw_surface == NULL) {
+            LOG_ERROR("Couldn't create software rendering surface.\n");
+            render_surface = NULL;
+        } else {
+            render_surface = CAST_RENDER_SURFACE(sw_surface);
+        }
+#else
+        UNREACHABLE();
 #endif
     }
 
@@ -1810,6 +2782,16 @@ static EGLSurface dummy_window_get_egl_surface(struct window *window) {
 static void dummy_window_deinit(struct window *window) {
     ASSERT_NOT_NULL(window);
 
+    if (window->dummy.capture != NULL) {
+        frame_capture_destroy(window->dummy.capture);
+        free(window->dummy.pixels);
+#ifdef HAVE_EGL_GLES2
+        gl_flattener_unref(window->dummy.flattener);
+#else
+        UNREACHABLE();
+#endif
+    }
+
     if (window->render_surface != NULL) {
         surface_unref(CAST_SURFACE(window->render_surface));
     }
@@ -30,7 +30,7 @@ struct view_geometry {
     double device_pixel_ratio;
 };
 
-enum renderer_type { kOpenGL_RendererType, kVulkan_RendererType };
+enum renderer_type { kOpenGL_RendererType, kVulkan_RendererType, kSoftware_RendererType };
 
 DECLARE_REF_OPS(window)
 
@@ -97,6 +97,17 @@ MUST_CHECK struct window *dummy_window_new(
     double refresh_rate
 );
 
+/**
+ * @brief Makes the dummy window @a window composite every composition it's given offscreen,
+ * and write the result to @a target. See @ref frame_capture.h for the valid targets.
+ *
+ * If @a timings_path is not NULL, the timings of every frame are written to that file as CSV.
+ * Only supported when rendering using OpenGL. Must be called before the first composition is pushed.
+ *
+ * @returns 0 on success, ENOTSUP if the window doesn't render using OpenGL, or another error code.
+ */
+int dummy_window_enable_capture(struct window *window, const char *target, const char *timings_path);
+
 /**
  * @brief Push a new flutter composition to the window, outputting a new frame.
  *
@@ -0,0 +1,707 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_PRODUCERS 4
+#define N_TASKS_PER_PRODUCER 50000
+#define N_BENCHMARK_TASKS 200000
+#define N_TIMERS 2000
+#define N_BENCHMARK_TIMERS 20000
+#define MS_TO_NS(ms) ((ms) * 1000000ull)
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+struct ordering_state {
+    sd_event *loop;
+    int64_t last_seen[N_PRODUCERS];
+    int n_executed;
+    int n_expected;
+    bool in_order;
+};
+
+struct ordering_task {
+    struct ordering_state *state;
+    int producer;
+    int sequence;
+};
+
+struct producer_args {
+    struct task_queue *queue;
+    struct ordering_state *state;
+    int producer;
+};
+
+static int on_ordering_task(void *userdata) {
+    struct ordering_task *task = userdata;
+    struct ordering_state *state = task->state;
+
+    if (task->sequence != state->last_seen[task->producer] + 1) {
+        state->in_order = false;
+    }
+    state->last_seen[task->producer] = task->sequence;
+
+    state->n_executed++;
+    if (state->n_executed == state->n_expected) {
+        sd_event_exit(state->loop, 0);
+    }
+
+    return 0;
+}
+
+static void *producer_entry(void *userdata) {
+    struct producer_args *args = userdata;
+    int ok;
+
+    for (int i = 0; i < N_TASKS_PER_PRODUCER; i++) {
+        struct ordering_task task = { .state = args->state, .producer = args->producer, .sequence = i };
+
+        ok = task_queue_post_with_data(args->queue, on_ordering_task, &task, sizeof task);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+    }
+
+    return NULL;
+}
+
+void test_tasks_from_each_producer_run_in_order() {
+    struct producer_args args[N_PRODUCERS];
+    struct ordering_state state;
+    struct task_queue *queue;
+    pthread_t threads[N_PRODUCERS];
+    sd_event *loop;
+    int ok;
+
+    ok = sd_event_new(&loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    queue = task_queue_new(loop);
+    TEST_ASSERT_NOT_NULL(queue);
+
+    state.loop = loop;
+    state.n_executed = 0;
+    state.n_expected = N_PRODUCERS * N_TASKS_PER_PRODUCER;
+    state.in_order = true;
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        state.last_seen[i] = -1;
+    }
+
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        args[i] = (struct producer_args){ .queue = queue, .state = &state, .producer = i };
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(threads + i, NULL, producer_entry, args + i));
+    }
+
+    ok = sd_event_loop(loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    for (int i = 0; i < N_PRODUCERS; i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], NULL));
+    }
+
+    TEST_ASSERT_TRUE(state.in_order);
+    TEST_ASSERT_EQUAL_INT(state.n_expected, state.n_executed);
+
+    task_queue_destroy(queue);
+    sd_event_unref(loop);
+}
+
+struct reposting_state {
+    sd_event *loop;
+    struct task_queue *queue;
+    int n_remaining;
+    int n_wakeups;
+};
+
+static int on_count_wakeup(sd_event_source *s, void *userdata) {
+    (void) s;
+    ((struct reposting_state *) userdata)->n_wakeups++;
+    return 0;
+}
+
+static int on_reposting_task(void *userdata) {
+    struct reposting_state *state = userdata;
+
+    state->n_remaining--;
+    if (state->n_remaining == 0) {
+        sd_event_exit(state->loop, 0);
+        return 0;
+    }
+
+    return task_queue_post(state->queue, on_reposting_task, state);
+}
+
+void test_task_posted_from_task_runs_in_next_iteration() {
+    struct reposting_state state;
+    sd_event_source *post_src;
+    int ok;
+
+    ok = sd_event_new(&state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    state.queue = task_queue_new(state.loop);
+    TEST_ASSERT_NOT_NULL(state.queue);
+
+    state.n_remaining = 10;
+    state.n_wakeups = 0;
+
+    // post sources are dispatched once after every event loop iteration that dispatched
+    // something else, so they count how often the queue was drained.
+    ok = sd_event_add_post(state.loop, &post_src, on_count_wakeup, &state);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    sd_event_source_set_enabled(post_src, SD_EVENT_ON);
+
+    ok = task_queue_post(state.queue, on_reposting_task, &state);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    ok = sd_event_loop(state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    TEST_ASSERT_EQUAL_INT(0, state.n_remaining);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(9, state.n_wakeups);
+
+    sd_event_source_unref(post_src);
+    task_queue_destroy(state.queue);
+    sd_event_unref(state.loop);
+}
+
+static int on_never_executed(void *userdata) {
+    (void) userdata;
+    TEST_FAIL_MESSAGE("task executed after its queue was destroyed");
+    return 0;
+}
+
+void test_destroy_with_pending_tasks() {
+    struct task_queue *queue;
+    sd_event *loop;
+    int ok;
+
+    ok = sd_event_new(&loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    queue = task_queue_new(loop);
+    TEST_ASSERT_NOT_NULL(queue);
+
+    for (int i = 0; i < 100; i++) {
+        ok = task_queue_post(queue, on_never_executed, NULL);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+    }
+
+    task_queue_destroy(queue);
+
+    ok = sd_event_run(loop, 0);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0, ok);
+
+    sd_event_unref(loop);
+}
+
+/**
+ * The way platform tasks were posted before the task queue existed: one
+ * sd_event defer source per task, ordered using a priority counter, and an eventfd write
+ * per post to wake up the loop.
+ */
+struct legacy_queue {
+    sd_event *loop;
+    pthread_mutex_t mutex;
+    int64_t counter;
+    int wakeup_fd;
+    sd_event_source *wakeup_src;
+};
+
+struct legacy_task {
+    task_queue_callback_t callback;
+    void *userdata;
+};
+
+static int on_legacy_wakeup(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    uint64_t value;
+
+    (void) s;
+    (void) revents;
+    (void) userdata;
+
+    return read(fd, &value, sizeof value) < 0 ? -errno : 0;
+}
+
+static int on_legacy_task(sd_event_source *s, void *userdata) {
+    struct legacy_task *task = userdata;
+    int ok;
+
+    ok = task->callback(task->userdata);
+
+    sd_event_source_set_enabled(s, SD_EVENT_OFF);
+    sd_event_source_unref(s);
+    free(task);
+
+    return ok;
+}
+
+static int legacy_queue_post(struct legacy_queue *queue, task_queue_callback_t callback, void *userdata) {
+    struct legacy_task *task;
+    sd_event_source *src;
+    int ok;
+
+    task = malloc(sizeof *task);
+    if (task == NULL) {
+        return ENOMEM;
+    }
+
+    task->callback = callback;
+    task->userdata = userdata;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    ok = sd_event_add_defer(queue->loop, &src, on_legacy_task, task);
+    if (ok < 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        free(task);
+        return -ok;
+    }
+
+    sd_event_source_set_priority(src, queue->counter++);
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (write(queue->wakeup_fd, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs the loop like the main event loop in flutter-drm-embedder.c does: holding the mutex,
+ * except while waiting for events. The defer sources are added from other threads,
+ * so that's required for the legacy queue.
+ */
+static int run_loop_with_mutex(sd_event *loop, pthread_mutex_t *mutex) {
+    struct pollfd fd = { .fd = sd_event_get_fd(loop), .events = POLLIN };
+    int state, ok;
+
+    pthread_mutex_lock(mutex);
+
+    do {
+        state = sd_event_get_state(loop);
+        switch (state) {
+            case SD_EVENT_INITIAL: ok = sd_event_prepare(loop); break;
+            case SD_EVENT_ARMED:
+                pthread_mutex_unlock(mutex);
+                do {
+                    ok = poll(&fd, 1, -1);
+                } while (ok < 0 && errno == EINTR);
+                pthread_mutex_lock(mutex);
+
+                ok = sd_event_wait(loop, 0);
+                break;
+            case SD_EVENT_PENDING: ok = sd_event_dispatch(loop); break;
+            case SD_EVENT_FINISHED: ok = 0; break;
+            default: ok = -EINVAL; break;
+        }
+    } while (ok >= 0 && state != SD_EVENT_FINISHED);
+
+    pthread_mutex_unlock(mutex);
+
+    return ok < 0 ? -ok : 0;
+}
+
+struct benchmark_state {
+    sd_event *loop;
+    pthread_mutex_t *mutex;
+    struct task_queue *queue;
+    struct legacy_queue *legacy;
+    atomic_int n_executed;
+};
+
+static int on_benchmark_task(void *userdata) {
+    struct benchmark_state *state = userdata;
+
+    if (atomic_fetch_add(&state->n_executed, 1) + 1 == N_BENCHMARK_TASKS) {
+        sd_event_exit(state->loop, 0);
+    }
+
+    return 0;
+}
+
+static void *benchmark_producer_entry(void *userdata) {
+    struct benchmark_state *state = userdata;
+
+    for (int i = 0; i < N_BENCHMARK_TASKS; i++) {
+        if (state->queue != NULL) {
+            task_queue_post(state->queue, on_benchmark_task, state);
+        } else {
+            legacy_queue_post(state->legacy, on_benchmark_task, state);
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t run_benchmark(struct benchmark_state *state) {
+    pthread_t producer;
+    uint64_t start;
+
+    atomic_store(&state->n_executed, 0);
+
+    start = get_monotonic_time();
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&producer, NULL, benchmark_producer_entry, state));
+    TEST_ASSERT_EQUAL_INT(0, run_loop_with_mutex(state->loop, state->mutex));
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(producer, NULL));
+
+    TEST_ASSERT_EQUAL_INT(N_BENCHMARK_TASKS, atomic_load(&state->n_executed));
+
+    return get_monotonic_time() - start;
+}
+
+/**
+ * Measures posting tasks from another thread and executing them on the event loop,
+ * both for the task queue and the per-task defer sources it replaces. Only checks
+ * that every task was executed, the timings are just printed.
+ */
+void test_benchmark_post_from_other_thread() {
+    struct benchmark_state state;
+    struct legacy_queue legacy;
+    pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t queue_time, legacy_time;
+    int ok;
+
+    ok = sd_event_new(&state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    state.mutex = &loop_mutex;
+    state.queue = task_queue_new(state.loop);
+    TEST_ASSERT_NOT_NULL(state.queue);
+    state.legacy = NULL;
+
+    queue_time = run_benchmark(&state);
+
+    task_queue_destroy(state.queue);
+    sd_event_unref(state.loop);
+
+    ok = sd_event_new(&state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    legacy.loop = state.loop;
+    legacy.counter = 0;
+    pthread_mutex_init(&legacy.mutex, NULL);
+    legacy.wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0, legacy.wakeup_fd);
+    ok = sd_event_add_io(state.loop, &legacy.wakeup_src, legacy.wakeup_fd, EPOLLIN, on_legacy_wakeup, NULL);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    state.mutex = &legacy.mutex;
+    state.queue = NULL;
+    state.legacy = &legacy;
+
+    legacy_time = run_benchmark(&state);
+
+    sd_event_source_unref(legacy.wakeup_src);
+    close(legacy.wakeup_fd);
+    pthread_mutex_destroy(&legacy.mutex);
+    sd_event_unref(state.loop);
+
+    printf(
+        "task queue:    %8.1f ns/task, %6.2f Mtasks/s\n",
+        (double) queue_time / N_BENCHMARK_TASKS,
+        N_BENCHMARK_TASKS * 1e3 / (double) queue_time
+    );
+    printf(
+        "defer sources: %8.1f ns/task, %6.2f Mtasks/s\n",
+        (double) legacy_time / N_BENCHMARK_TASKS,
+        N_BENCHMARK_TASKS * 1e3 / (double) legacy_time
+    );
+}
+
+struct timer_state {
+    sd_event *loop;
+    struct timer_queue *queue;
+    uint64_t target_times[N_TIMERS];
+    int order[N_TIMERS];
+    int n_executed;
+    int n_expected;
+    bool too_early;
+};
+
+struct timer_task {
+    struct timer_state *state;
+    int index;
+};
+
+static int on_timer_task(void *userdata) {
+    struct timer_task *task = userdata;
+    struct timer_state *state = task->state;
+
+    if (get_monotonic_time() < state->target_times[task->index]) {
+        state->too_early = true;
+    }
+
+    state->order[state->n_executed++] = task->index;
+    if (state->n_executed == state->n_expected) {
+        sd_event_exit(state->loop, 0);
+    }
+
+    return 0;
+}
+
+static void init_timer_state(struct timer_state *state) {
+    int ok;
+
+    ok = sd_event_new(&state->loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    state->queue = timer_queue_new(state->loop);
+    TEST_ASSERT_NOT_NULL(state->queue);
+
+    state->n_executed = 0;
+    state->n_expected = 0;
+    state->too_early = false;
+}
+
+static void post_timer_task(struct timer_state *state, int index, uint64_t target_time, timer_queue_handle_t *handle_out) {
+    struct timer_task task = { .state = state, .index = index };
+    int ok;
+
+    state->target_times[index] = target_time;
+
+    ok = timer_queue_post_with_data(state->queue, on_timer_task, &task, sizeof task, target_time, handle_out);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+}
+
+static void deinit_timer_state(struct timer_state *state) {
+    timer_queue_destroy(state->queue);
+    sd_event_unref(state->loop);
+}
+
+void test_timers_execute_in_deadline_order() {
+    struct timer_state state;
+    uint64_t now;
+    int ok;
+
+    init_timer_state(&state);
+
+    // a mix of past, equal and future deadlines.
+    now = get_monotonic_time();
+    srand(1234);
+    for (int i = 0; i < N_TIMERS; i++) {
+        post_timer_task(&state, i, now - MS_TO_NS(1) + MS_TO_NS(rand() % 20), NULL);
+    }
+    state.n_expected = N_TIMERS;
+
+    ok = sd_event_loop(state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    TEST_ASSERT_FALSE(state.too_early);
+    TEST_ASSERT_EQUAL_INT(N_TIMERS, state.n_executed);
+    for (int i = 1; i < N_TIMERS; i++) {
+        uint64_t previous = state.target_times[state.order[i - 1]];
+        uint64_t current = state.target_times[state.order[i]];
+
+        // tasks with the same deadline are executed in the order they were posted.
+        TEST_ASSERT_TRUE(previous < current || (previous == current && state.order[i - 1] < state.order[i]));
+    }
+
+    deinit_timer_state(&state);
+}
+
+void test_cancel_timers() {
+    struct timer_queue_stats stats;
+    struct timer_state state;
+    timer_queue_handle_t handles[100];
+    uint64_t now;
+    int ok;
+
+    init_timer_state(&state);
+
+    now = get_monotonic_time();
+    for (int i = 0; i < 100; i++) {
+        post_timer_task(&state, i, now + MS_TO_NS(i % 10), handles + i);
+        TEST_ASSERT_NOT_EQUAL(0, handles[i]);
+    }
+
+    for (int i = 0; i < 100; i += 2) {
+        TEST_ASSERT_EQUAL_INT(0, timer_queue_cancel(state.queue, handles[i]));
+        TEST_ASSERT_EQUAL_INT(ENOENT, timer_queue_cancel(state.queue, handles[i]));
+    }
+
+    // the cancelled slots are reused, but the old handles must stay invalid.
+    for (int i = 100; i < 150; i++) {
+        post_timer_task(&state, i, now + MS_TO_NS(5), NULL);
+    }
+    for (int i = 0; i < 100; i += 2) {
+        TEST_ASSERT_EQUAL_INT(ENOENT, timer_queue_cancel(state.queue, handles[i]));
+    }
+
+    state.n_expected = 100;
+    ok = sd_event_loop(state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    for (int i = 0; i < state.n_executed; i++) {
+        TEST_ASSERT_TRUE(state.order[i] >= 100 || state.order[i] % 2 == 1);
+    }
+
+    // already executed.
+    TEST_ASSERT_EQUAL_INT(ENOENT, timer_queue_cancel(state.queue, handles[1]));
+
+    timer_queue_get_stats(state.queue, &stats);
+    TEST_ASSERT_EQUAL_UINT64(150, stats.n_posted);
+    TEST_ASSERT_EQUAL_UINT64(100, stats.n_executed);
+    TEST_ASSERT_EQUAL_UINT64(50, stats.n_cancelled);
+    TEST_ASSERT_EQUAL_size_t(100, stats.max_pending);
+
+    deinit_timer_state(&state);
+}
+
+static void *post_earlier_timer_entry(void *userdata) {
+    struct timer_state *state = userdata;
+
+    usleep(5000);
+    post_timer_task(state, 1, get_monotonic_time() + MS_TO_NS(1), NULL);
+
+    return NULL;
+}
+
+void test_earlier_timer_from_other_thread_rearms() {
+    struct timer_state state;
+    pthread_t thread;
+    uint64_t start;
+    int ok;
+
+    init_timer_state(&state);
+
+    // the first timer is too far in the future to ever execute in this test.
+    start = get_monotonic_time();
+    post_timer_task(&state, 0, start + MS_TO_NS(10000), NULL);
+    state.n_expected = 1;
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&thread, NULL, post_earlier_timer_entry, &state));
+
+    ok = sd_event_loop(state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(thread, NULL));
+
+    TEST_ASSERT_EQUAL_INT(1, state.order[0]);
+    TEST_ASSERT_LESS_THAN(MS_TO_NS(1000), get_monotonic_time() - start);
+
+    deinit_timer_state(&state);
+}
+
+struct timer_benchmark_state {
+    sd_event *loop;
+    int n_executed;
+};
+
+static int on_timer_benchmark_task(void *userdata) {
+    struct timer_benchmark_state *state = userdata;
+
+    if (++state->n_executed == N_BENCHMARK_TIMERS) {
+        sd_event_exit(state->loop, 0);
+    }
+
+    return 0;
+}
+
+static int on_time_source_benchmark_task(sd_event_source *s, uint64_t usec, void *userdata) {
+    (void) usec;
+
+    on_timer_benchmark_task(userdata);
+    sd_event_source_disable_unref(s);
+
+    return 0;
+}
+
+/**
+ * Measures posting and executing delayed tasks spread over 50ms, similar to what
+ * the engine does with animation and timer tasks, using both the timer queue and
+ * one sd-event time source per task. Only checks that every task was executed,
+ * the timings are just printed.
+ */
+void test_benchmark_delayed_tasks() {
+    struct timer_benchmark_state state;
+    struct timer_queue_stats stats;
+    struct timer_queue *queue;
+    sd_event_source *src;
+    uint64_t start, queue_post, queue_total, source_post, source_total;
+    int ok;
+
+    ok = sd_event_new(&state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    queue = timer_queue_new(state.loop);
+    TEST_ASSERT_NOT_NULL(queue);
+    state.n_executed = 0;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < N_BENCHMARK_TIMERS; i++) {
+        ok = timer_queue_post(queue, on_timer_benchmark_task, &state, start + MS_TO_NS(i % 50), NULL);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+    }
+    queue_post = get_monotonic_time() - start;
+
+    TEST_ASSERT_EQUAL_INT(0, sd_event_loop(state.loop));
+    queue_total = get_monotonic_time() - start;
+    TEST_ASSERT_EQUAL_INT(N_BENCHMARK_TIMERS, state.n_executed);
+
+    timer_queue_get_stats(queue, &stats);
+    timer_queue_destroy(queue);
+    sd_event_unref(state.loop);
+
+    ok = sd_event_new(&state.loop);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    state.n_executed = 0;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < N_BENCHMARK_TIMERS; i++) {
+        ok = sd_event_add_time(state.loop, &src, CLOCK_MONOTONIC, (start + MS_TO_NS(i % 50)) / 1000, 1, on_time_source_benchmark_task, &state);
+        TEST_ASSERT_GREATER_OR_EQUAL_INT(0, ok);
+    }
+    source_post = get_monotonic_time() - start;
+
+    TEST_ASSERT_EQUAL_INT(0, sd_event_loop(state.loop));
+    source_total = get_monotonic_time() - start;
+    TEST_ASSERT_EQUAL_INT(N_BENCHMARK_TIMERS, state.n_executed);
+
+    sd_event_unref(state.loop);
+
+    printf(
+        "timer queue:  post %6.1f ns/task, post + execute %6.2f ms\n",
+        (double) queue_post / N_BENCHMARK_TIMERS,
+        (double) queue_total / 1e6
+    );
+    printf(
+        "time sources: post %6.1f ns/task, post + execute %6.2f ms\n",
+        (double) source_post / N_BENCHMARK_TIMERS,
+        (double) source_total / 1e6
+    );
+    printf(
+        "timer queue slack: avg %6.1f us, max %6.1f us, %llu timerfd updates\n",
+        (double) stats.total_slack_ns / stats.n_executed / 1e3,
+        (double) stats.max_slack_ns / 1e3,
+        (unsigned long long) stats.n_timer_updates
+    );
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_tasks_from_each_producer_run_in_order);
+    RUN_TEST(test_task_posted_from_task_runs_in_next_iteration);
+    RUN_TEST(test_destroy_with_pending_tasks);
+    RUN_TEST(test_benchmark_post_from_other_thread);
+    RUN_TEST(test_timers_execute_in_deadline_order);
+    RUN_TEST(test_cancel_timers);
+    RUN_TEST(test_earlier_timer_from_other_thread_rearms);
+    RUN_TEST(test_benchmark_delayed_tasks);
+
+    return UNITY_END();
+}
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+
+#include "flutter_linux/fl_standard_method_codec.h"
+#include "flutter_linux_gtk_shim/fl_standard_method_codec_internal.h"
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define KiB 1024
+#define MiB (1024 * 1024)
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static bool fl_value_equals(FlValue *a, FlValue *b) {
+    size_t length_a, length_b;
+
+    if (fl_value_get_type_id(a) != fl_value_get_type_id(b)) {
+        return false;
+    }
+
+    switch (fl_value_get_type_id(a)) {
+        case FL_VALUE_TYPE_NULL: return true;
+        case FL_VALUE_TYPE_BOOL: return fl_value_get_bool(a) == fl_value_get_bool(b);
+        case FL_VALUE_TYPE_INT: return fl_value_get_int(a) == fl_value_get_int(b);
+        case FL_VALUE_TYPE_FLOAT: return fl_value_get_float(a) == fl_value_get_float(b);
+        case FL_VALUE_TYPE_STRING: return streq(fl_value_get_string(a), fl_value_get_string(b));
+        case FL_VALUE_TYPE_UINT8_LIST: {
+            const uint8_t *data_a = fl_value_get_uint8_list(a, &length_a);
+            const uint8_t *data_b = fl_value_get_uint8_list(b, &length_b);
+            return length_a == length_b && memcmp(data_a, data_b, length_a) == 0;
+        }
+        case FL_VALUE_TYPE_INT32_LIST: {
+            const int32_t *data_a = fl_value_get_int32_list(a, &length_a);
+            const int32_t *data_b = fl_value_get_int32_list(b, &length_b);
+            return length_a == length_b && memcmp(data_a, data_b, length_a * sizeof(int32_t)) == 0;
+        }
+        case FL_VALUE_TYPE_INT64_LIST: {
+            const int64_t *data_a = fl_value_get_int64_list(a, &length_a);
+            const int64_t *data_b = fl_value_get_int64_list(b, &length_b);
+            return length_a == length_b && memcmp(data_a, data_b, length_a * sizeof(int64_t)) == 0;
+        }
+        case FL_VALUE_TYPE_FLOAT_LIST: {
+            const double *data_a = fl_value_get_float_list(a, &length_a);
+            const double *data_b = fl_value_get_float_list(b, &length_b);
+            return length_a == length_b && memcmp(data_a, data_b, length_a * sizeof(double)) == 0;
+        }
+        case FL_VALUE_TYPE_LIST:
+            if (fl_value_get_length(a) != fl_value_get_length(b)) {
+                return false;
+            }
+            for (size_t i = 0; i < fl_value_get_length(a); i++) {
+                if (!fl_value_equals(fl_value_get_list_value(a, i), fl_value_get_list_value(b, i))) {
+                    return false;
+                }
+            }
+            return true;
+        case FL_VALUE_TYPE_MAP:
+            if (fl_value_get_length(a) != fl_value_get_length(b)) {
+                return false;
+            }
+            for (size_t i = 0; i < fl_value_get_length(a); i++) {
+                if (!fl_value_equals(fl_value_get_map_key(a, i), fl_value_get_map_key(b, i)) ||
+                    !fl_value_equals(fl_value_get_map_value(a, i), fl_value_get_map_value(b, i))) {
+                    return false;
+                }
+            }
+            return true;
+        default: return false;
+    }
+}
+
+static void map_set_take(FlValue *map, const char *key, FlValue *value) {
+    FlValue *key_value = fl_value_new_string(key);
+    fl_value_set(map, key_value, value);
+    fl_value_unref(key_value);
+    fl_value_unref(value);
+}
+
+static void list_append_take(FlValue *list, FlValue *value) {
+    fl_value_append(list, value);
+    fl_value_unref(value);
+}
+
+static FlValue *new_test_value(void) {
+    static const uint8_t bytes[] = { 1, 2, 3, 4, 5 };
+    static const int32_t int32s[] = { -1, 0, 1, INT32_MAX };
+    static const int64_t int64s[] = { INT64_MIN, 0, INT64_MAX };
+    static const double doubles[] = { -1.5, 0.0, 3.25 };
+
+    FlValue *list = fl_value_new_list();
+    list_append_take(list, fl_value_new_null());
+    list_append_take(list, fl_value_new_bool(TRUE));
+    list_append_take(list, fl_value_new_int(INT64_C(0x100000000)));
+
+    FlValue *map = fl_value_new_map();
+    map_set_take(map, "null", fl_value_new_null());
+    map_set_take(map, "true", fl_value_new_bool(TRUE));
+    map_set_take(map, "false", fl_value_new_bool(FALSE));
+    map_set_take(map, "int32", fl_value_new_int(-42));
+    map_set_take(map, "int64", fl_value_new_int(INT64_MIN));
+    map_set_take(map, "float", fl_value_new_float(1.0 / 3.0));
+    map_set_take(map, "string", fl_value_new_string("hello ünïcödé"));
+    map_set_take(map, "long string", fl_value_new_string("................................................................................"
+                                                         "................................................................................"
+                                                         "................................................................................"
+                                                         "................................................................................"));
+    map_set_take(map, "uint8 list", fl_value_new_uint8_list(bytes, ARRAY_SIZE(bytes)));
+    map_set_take(map, "int32 list", fl_value_new_int32_list(int32s, ARRAY_SIZE(int32s)));
+    map_set_take(map, "int64 list", fl_value_new_int64_list(int64s, ARRAY_SIZE(int64s)));
+    map_set_take(map, "float list", fl_value_new_float_list(doubles, ARRAY_SIZE(doubles)));
+    map_set_take(map, "empty list", fl_value_new_list());
+    map_set_take(map, "list", list);
+
+    return map;
+}
+
+void test_encode_matches_legacy_encoder() {
+    FlValue *value = new_test_value();
+
+    GBytes *direct = fl_standard_method_codec_encode_value(value, NULL);
+    GBytes *legacy = fl_standard_method_codec_encode_value_legacy(value, NULL);
+    TEST_ASSERT_NOT_NULL(direct);
+    TEST_ASSERT_NOT_NULL(legacy);
+
+    // The legacy encoder always encodes ints as int64, so only compare decoded values.
+    FlValue *decoded_direct = fl_standard_method_codec_decode_value_legacy(direct, NULL);
+    FlValue *decoded_legacy = fl_standard_method_codec_decode_value(legacy, NULL);
+    TEST_ASSERT_NOT_NULL(decoded_direct);
+    TEST_ASSERT_NOT_NULL(decoded_legacy);
+    TEST_ASSERT_TRUE(fl_value_equals(value, decoded_direct));
+    TEST_ASSERT_TRUE(fl_value_equals(value, decoded_legacy));
+
+    fl_value_unref(decoded_direct);
+    fl_value_unref(decoded_legacy);
+    g_bytes_unref(direct);
+    g_bytes_unref(legacy);
+    fl_value_unref(value);
+}
+
+void test_decoded_typed_list_borrows_message() {
+    static const double doubles[] = { 1.0, 2.0, 3.0, 4.0 };
+    const double *data;
+    size_t length;
+
+    FlValue *value = fl_value_new_float_list(doubles, ARRAY_SIZE(doubles));
+    GBytes *message = fl_standard_method_codec_encode_value(value, NULL);
+    fl_value_unref(value);
+
+    gsize message_size;
+    const uint8_t *message_data = g_bytes_get_data(message, &message_size);
+
+    FlValue *decoded = fl_standard_method_codec_decode_value(message, NULL);
+    TEST_ASSERT_NOT_NULL(decoded);
+
+    // The message should be kept alive by the decoded value.
+    g_bytes_unref(message);
+
+    data = fl_value_get_float_list(decoded, &length);
+    TEST_ASSERT_EQUAL_INT(ARRAY_SIZE(doubles), length);
+    TEST_ASSERT_TRUE((const uint8_t *) data > message_data && (const uint8_t *) data < message_data + message_size);
+    TEST_ASSERT_EQUAL_MEMORY(doubles, data, sizeof(doubles));
+
+    fl_value_unref(decoded);
+}
+
+void test_method_call_and_envelopes() {
+    FlStandardMethodCodec *codec = fl_standard_method_codec_new();
+    FlValue *args = new_test_value();
+    FlValue *decoded_args = NULL, *result = NULL, *details = NULL;
+    gchar *method = NULL, *error_code = NULL, *error_message = NULL;
+    gboolean ok;
+
+    GBytes *call = fl_method_codec_encode_method_call(FL_METHOD_CODEC(codec), "doStuff", args, NULL);
+    ok = fl_method_codec_decode_method_call(FL_METHOD_CODEC(codec), call, &method, &decoded_args, NULL);
+    TEST_ASSERT_TRUE(ok);
+    TEST_ASSERT_EQUAL_STRING("doStuff", method);
+    TEST_ASSERT_TRUE(fl_value_equals(args, decoded_args));
+    g_free(method);
+    fl_value_unref(decoded_args);
+    g_bytes_unref(call);
+
+    GBytes *success = fl_method_codec_encode_success_envelope(FL_METHOD_CODEC(codec), args, NULL);
+    ok = fl_method_codec_decode_response_envelope(FL_METHOD_CODEC(codec), success, &result, &error_code, &error_message, &details, NULL);
+    TEST_ASSERT_TRUE(ok);
+    TEST_ASSERT_NOT_NULL(result);
+    TEST_ASSERT_NULL(error_code);
+    TEST_ASSERT_TRUE(fl_value_equals(args, result));
+    fl_value_unref(result);
+    g_bytes_unref(success);
+
+    GBytes *error = fl_method_codec_encode_error_envelope(FL_METHOD_CODEC(codec), "code", "message", args, NULL);
+    ok = fl_method_codec_decode_response_envelope(FL_METHOD_CODEC(codec), error, &result, &error_code, &error_message, &details, NULL);
+    TEST_ASSERT_TRUE(ok);
+    TEST_ASSERT_NULL(result);
+    TEST_ASSERT_EQUAL_STRING("code", error_code);
+    TEST_ASSERT_EQUAL_STRING("message", error_message);
+    TEST_ASSERT_TRUE(fl_value_equals(args, details));
+    g_free(error_code);
+    g_free(error_message);
+    fl_value_unref(details);
+    g_bytes_unref(error);
+
+    fl_value_unref(args);
+    g_object_unref(codec);
+}
+
+static void benchmark(const char *name, FlValue *value, int iterations) {
+    uint64_t start, direct_encode, direct_decode, legacy_encode, legacy_decode;
+    GBytes *bytes;
+    FlValue *decoded;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < iterations; i++) {
+        g_bytes_unref(fl_standard_method_codec_encode_value(value, NULL));
+    }
+    direct_encode = get_monotonic_time() - start;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < iterations; i++) {
+        g_bytes_unref(fl_standard_method_codec_encode_value_legacy(value, NULL));
+    }
+    legacy_encode = get_monotonic_time() - start;
+
+    bytes = fl_standard_method_codec_encode_value(value, NULL);
+
+    start = get_monotonic_time();
+    for (int i = 0; i < iterations; i++) {
+        decoded = fl_standard_method_codec_decode_value(bytes, NULL);
+        fl_value_unref(decoded);
+    }
+    direct_decode = get_monotonic_time() - start;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < iterations; i++) {
+        decoded = fl_standard_method_codec_decode_value_legacy(bytes, NULL);
+        fl_value_unref(decoded);
+    }
+    legacy_decode = get_monotonic_time() - start;
+
+    g_bytes_unref(bytes);
+
+    printf(
+        "%-16s encode: %10.1f ns direct, %10.1f ns legacy | decode: %10.1f ns direct, %10.1f ns legacy\n",
+        name,
+        (double) direct_encode / iterations,
+        (double) legacy_encode / iterations,
+        (double) direct_decode / iterations,
+        (double) legacy_decode / iterations
+    );
+}
+
+void test_benchmark_typed_lists() {
+    uint8_t *bytes = g_malloc(MiB);
+    double *doubles = g_new(double, MiB / sizeof(double));
+
+    memset(bytes, 0xAB, MiB);
+    for (size_t i = 0; i < MiB / sizeof(double); i++) {
+        doubles[i] = (double) i;
+    }
+
+    FlValue *value = fl_value_new_uint8_list(bytes, KiB);
+    benchmark("Uint8List 1KB", value, 10000);
+    fl_value_unref(value);
+
+    value = fl_value_new_uint8_list(bytes, MiB);
+    benchmark("Uint8List 1MB", value, 100);
+    fl_value_unref(value);
+
+    value = fl_value_new_float_list(doubles, KiB / sizeof(double));
+    benchmark("Float64List 1KB", value, 10000);
+    fl_value_unref(value);
+
+    value = fl_value_new_float_list(doubles, MiB / sizeof(double));
+    benchmark("Float64List 1MB", value, 100);
+    fl_value_unref(value);
+
+    value = new_test_value();
+    benchmark("nested map", value, 10000);
+    fl_value_unref(value);
+
+    g_free(bytes);
+    g_free(doubles);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_encode_matches_legacy_encoder);
+    RUN_TEST(test_decoded_typed_list_borrows_message);
+    RUN_TEST(test_method_call_and_envelopes);
+    RUN_TEST(test_benchmark_typed_lists);
+
+    return UNITY_END();
+}
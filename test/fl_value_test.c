@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+
+#include "flutter_linux/fl_value.h"
+#include "flutter_linux_gtk_shim/fl_standard_method_codec_internal.h"
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_BENCHMARK_ROUNDS 300
+#define N_THREAD_VALUES 10000
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void map_set_take(FlValue *map, FlValue *key, FlValue *value) {
+    fl_value_set(map, key, value);
+    fl_value_unref(key);
+    fl_value_unref(value);
+}
+
+static FlValue *new_map_with_n_entries(size_t n) {
+    FlValue *map = fl_value_new_map();
+    char key[32];
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof key, "key_%zu", i);
+        map_set_take(map, fl_value_new_string(key), fl_value_new_int(i));
+    }
+
+    return map;
+}
+
+/**
+ * Roughly what a plugin method call looks like: a 30-entry map of mixed values,
+ * one of them a list of smaller maps.
+ */
+static FlValue *new_nested_value(void) {
+    FlValue *map = new_map_with_n_entries(25);
+    FlValue *list = fl_value_new_list();
+    static const uint8_t bytes[64] = { 0 };
+
+    for (int i = 0; i < 10; i++) {
+        FlValue *child = new_map_with_n_entries(5);
+        fl_value_append(list, child);
+        fl_value_unref(child);
+    }
+
+    map_set_take(map, fl_value_new_string("list"), list);
+    map_set_take(map, fl_value_new_string("name"), fl_value_new_string("io.flutter.benchmark"));
+    map_set_take(map, fl_value_new_string("enabled"), fl_value_new_bool(TRUE));
+    map_set_take(map, fl_value_new_string("ratio"), fl_value_new_float(1.5));
+    map_set_take(map, fl_value_new_string("bytes"), fl_value_new_uint8_list(bytes, sizeof bytes));
+
+    return map;
+}
+
+void test_lookup_string() {
+    static const size_t sizes[] = { 4, 15, 16, 17, 100, 1000 };
+    char key[32];
+
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); i++) {
+        FlValue *map = new_map_with_n_entries(sizes[i]);
+
+        // non-string keys are never matched by fl_value_lookup_string.
+        map_set_take(map, fl_value_new_int(1), fl_value_new_null());
+
+        for (size_t j = 0; j < sizes[i]; j++) {
+            snprintf(key, sizeof key, "key_%zu", j);
+
+            FlValue *value = fl_value_lookup_string(map, key);
+            TEST_ASSERT_NOT_NULL(value);
+            TEST_ASSERT_EQUAL_INT64(j, fl_value_get_int(value));
+        }
+
+        TEST_ASSERT_NULL(fl_value_lookup_string(map, "1"));
+        TEST_ASSERT_NULL(fl_value_lookup_string(map, "missing"));
+
+        fl_value_unref(map);
+    }
+}
+
+void test_lookup_string_duplicate_keys() {
+    FlValue *map = new_map_with_n_entries(3);
+
+    // fl_value_set appends, so a duplicate key should always resolve to the first entry,
+    // whether the map is small enough for a linear scan or not.
+    map_set_take(map, fl_value_new_string("key_1"), fl_value_new_int(-1));
+    TEST_ASSERT_EQUAL_INT64(1, fl_value_get_int(fl_value_lookup_string(map, "key_1")));
+
+    for (int i = 0; i < 100; i++) {
+        map_set_take(map, fl_value_new_string("padding"), fl_value_new_int(i));
+    }
+    map_set_take(map, fl_value_new_string("key_2"), fl_value_new_int(-2));
+
+    TEST_ASSERT_EQUAL_INT64(1, fl_value_get_int(fl_value_lookup_string(map, "key_1")));
+    TEST_ASSERT_EQUAL_INT64(2, fl_value_get_int(fl_value_lookup_string(map, "key_2")));
+    TEST_ASSERT_EQUAL_INT64(0, fl_value_get_int(fl_value_lookup_string(map, "padding")));
+    TEST_ASSERT_EQUAL_size_t(105, fl_value_get_length(map));
+
+    fl_value_unref(map);
+}
+
+void test_list_and_refcount() {
+    FlValue *list = fl_value_new_list();
+    FlValue *item = fl_value_new_string("item");
+
+    for (int i = 0; i < 100; i++) {
+        fl_value_append(list, item);
+    }
+    TEST_ASSERT_EQUAL_size_t(100, fl_value_get_length(list));
+    TEST_ASSERT_EQUAL_PTR(item, fl_value_get_list_value(list, 99));
+    TEST_ASSERT_NULL(fl_value_get_list_value(list, 100));
+
+    fl_value_unref(list);
+
+    // the list only dropped its own references.
+    TEST_ASSERT_EQUAL_STRING("item", fl_value_get_string(item));
+    fl_value_unref(item);
+}
+
+static void *unref_values(void *userdata) {
+    FlValue **values = userdata;
+
+    for (size_t i = 0; i < N_THREAD_VALUES; i++) {
+        fl_value_unref(values[i]);
+    }
+
+    return NULL;
+}
+
+static void *alloc_and_unref_values(void *userdata) {
+    (void) userdata;
+
+    for (size_t i = 0; i < N_THREAD_VALUES; i++) {
+        fl_value_unref(new_nested_value());
+    }
+
+    return NULL;
+}
+
+void test_values_freed_on_other_threads() {
+    FlValue **values = calloc(N_THREAD_VALUES, sizeof *values);
+    pthread_t threads[4];
+
+    for (size_t i = 0; i < N_THREAD_VALUES; i++) {
+        values[i] = fl_value_new_int(i);
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(threads + 0, NULL, unref_values, values));
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[0], NULL));
+
+    // values freed on (now dead) threads must still be reusable here and elsewhere.
+    for (size_t i = 0; i < ARRAY_SIZE(threads); i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(threads + i, NULL, alloc_and_unref_values, NULL));
+    }
+    alloc_and_unref_values(NULL);
+
+    for (size_t i = 0; i < ARRAY_SIZE(threads); i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_join(threads[i], NULL));
+    }
+
+    free(values);
+}
+
+/**
+ * Measures constructing, encoding, decoding and destroying a typical nested
+ * method call value, and string lookups in a large map. The timings are just printed.
+ */
+void test_benchmark_nested_values() {
+    FlValue *values[64];
+    uint64_t construct = 0, encode = 0, decode = 0, destroy = 0, lookup = 0, start;
+    size_t n_values = N_BENCHMARK_ROUNDS * ARRAY_SIZE(values);
+    char keys[25][16];
+
+    for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
+        snprintf(keys[i], sizeof keys[i], "key_%zu", i);
+    }
+
+    for (int i = 0; i < N_BENCHMARK_ROUNDS; i++) {
+        start = get_monotonic_time();
+        for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+            values[j] = new_nested_value();
+        }
+        construct += get_monotonic_time() - start;
+
+        for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+            start = get_monotonic_time();
+            GBytes *message = fl_standard_method_codec_encode_value(values[j], NULL);
+            encode += get_monotonic_time() - start;
+            TEST_ASSERT_NOT_NULL(message);
+
+            start = get_monotonic_time();
+            FlValue *decoded = fl_standard_method_codec_decode_value(message, NULL);
+            decode += get_monotonic_time() - start;
+            TEST_ASSERT_NOT_NULL(decoded);
+
+            fl_value_unref(values[j]);
+            values[j] = decoded;
+            g_bytes_unref(message);
+        }
+
+        start = get_monotonic_time();
+        for (int j = 0; j < 30; j++) {
+            TEST_ASSERT_NOT_NULL(fl_value_lookup_string(values[0], keys[j % ARRAY_SIZE(keys)]));
+        }
+        lookup += get_monotonic_time() - start;
+
+        start = get_monotonic_time();
+        for (size_t j = 0; j < ARRAY_SIZE(values); j++) {
+            fl_value_unref(values[j]);
+        }
+        destroy += get_monotonic_time() - start;
+    }
+
+    printf(
+        "nested value: construct %8.1f ns, encode %8.1f ns, decode %8.1f ns, destroy %8.1f ns\n",
+        (double) construct / n_values,
+        (double) encode / n_values,
+        (double) decode / n_values,
+        (double) destroy / n_values
+    );
+    printf("30-entry map: lookup_string %8.1f ns\n", (double) lookup / (N_BENCHMARK_ROUNDS * 30));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_lookup_string);
+    RUN_TEST(test_lookup_string_duplicate_keys);
+    RUN_TEST(test_list_and_refcount);
+    RUN_TEST(test_values_freed_on_other_threads);
+    RUN_TEST(test_benchmark_nested_values);
+
+    return UNITY_END();
+}
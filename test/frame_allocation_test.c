@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <flutter_embedder.h>
+
+#include "compositor_ng.h"
+#include "frame_scheduler.h"
+#include "surface.h"
+#include "surface_private.h"
+#include "tracer.h"
+#include "window.h"
+
+#include <unity.h>
+
+#define N_WARMUP_FRAMES 8
+#define N_FRAMES 256
+
+/*
+ * Count the allocations made by the present path, by interposing the allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_bool count_allocations = false;
+static atomic_int n_allocations = 0;
+
+void *malloc(size_t size) {
+    if (atomic_load(&count_allocations)) {
+        atomic_fetch_add(&n_allocations, 1);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (atomic_load(&count_allocations)) {
+        atomic_fetch_add(&n_allocations, 1);
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (atomic_load(&count_allocations)) {
+        atomic_fetch_add(&n_allocations, 1);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+static struct tracer *tracer;
+static struct frame_scheduler *scheduler;
+static struct window *window;
+static struct compositor *compositor;
+
+static void on_vsync(void *userdata, intptr_t baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns) {
+    (void) userdata;
+    (void) baton;
+    (void) frame_start_ns;
+    (void) next_frame_start_ns;
+}
+
+// required by Unity.
+void setUp() {
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    scheduler = frame_scheduler_new(false, kDoubleBufferedVsync_PresentMode, on_vsync, NULL);
+    TEST_ASSERT_NOT_NULL(scheduler);
+
+    window = dummy_window_new(tracer, scheduler, kOpenGL_RendererType, NULL, NULL, VEC2I(800, 480), false, 0, 0, 60.0);
+    TEST_ASSERT_NOT_NULL(window);
+
+    compositor = compositor_new(tracer, window);
+    TEST_ASSERT_NOT_NULL(compositor);
+}
+
+void tearDown() {
+    compositor_unref(compositor);
+    window_unref(window);
+    frame_scheduler_unref(scheduler);
+    tracer_unref(tracer);
+}
+
+static int64_t add_platform_view(void) {
+    struct surface *s;
+    int64_t id;
+
+    s = malloc(sizeof *s);
+    TEST_ASSERT_NOT_NULL(s);
+    TEST_ASSERT_EQUAL_INT(0, surface_init(s, tracer));
+
+    TEST_ASSERT_EQUAL_INT(0, compositor_add_platform_view(compositor, s, &id));
+    surface_unref(s);
+
+    return id;
+}
+
+static void present_layers(const FlutterLayer **layers, size_t n_layers) {
+    const FlutterCompositor *fl_compositor = compositor_get_flutter_compositor(compositor);
+
+    TEST_ASSERT_TRUE(fl_compositor->present_layers_callback(layers, n_layers, fl_compositor->user_data));
+}
+
+void test_steady_state_present_does_not_allocate() {
+    FlutterPlatformViewMutation translate, clip, opacity;
+    const FlutterPlatformViewMutation *mutations[3];
+    FlutterPlatformView views[2];
+    FlutterLayer layers[2];
+    const FlutterLayer *layer_ptrs[2];
+
+    translate = (FlutterPlatformViewMutation){
+        .type = kFlutterPlatformViewMutationTypeTransformation,
+        .transformation = { .scaleX = 1, .transX = 100, .scaleY = 1, .transY = 50, .pers2 = 1 },
+    };
+    clip = (FlutterPlatformViewMutation){
+        .type = kFlutterPlatformViewMutationTypeClipRect,
+        .clip_rect = { .left = 0, .top = 0, .right = 200, .bottom = 100 },
+    };
+    opacity = (FlutterPlatformViewMutation){
+        .type = kFlutterPlatformViewMutationTypeOpacity,
+        .opacity = 0.5,
+    };
+    mutations[0] = &translate;
+    mutations[1] = &clip;
+    mutations[2] = &opacity;
+
+    for (int i = 0; i < 2; i++) {
+        views[i] = (FlutterPlatformView){
+            .struct_size = sizeof(FlutterPlatformView),
+            .identifier = add_platform_view(),
+            .mutations_count = i == 0 ? 0 : 3,
+            .mutations = mutations,
+        };
+
+        layers[i] = (FlutterLayer){
+            .struct_size = sizeof(FlutterLayer),
+            .type = kFlutterLayerContentTypePlatformView,
+            .platform_view = views + i,
+            .offset = { .x = 0, .y = 0 },
+            .size = { .width = 400, .height = 300 },
+        };
+
+        layer_ptrs[i] = layers + i;
+    }
+
+    // The first frames fill the pools.
+    for (int i = 0; i < N_WARMUP_FRAMES; i++) {
+        present_layers(layer_ptrs, 2);
+    }
+
+    atomic_store(&n_allocations, 0);
+    atomic_store(&count_allocations, true);
+
+    for (int i = 0; i < N_FRAMES; i++) {
+        // Alternate the number of layers, so compositions of different sizes get recycled too.
+        present_layers(layer_ptrs, i % 2 == 0 ? 2 : 1);
+    }
+
+    atomic_store(&count_allocations, false);
+
+    TEST_ASSERT_EQUAL_INT(0, atomic_load(&n_allocations));
+}
+
+void test_compositions_are_recycled() {
+    struct fl_layer_composition_pool *pool;
+    struct fl_layer_composition *a, *b;
+
+    pool = fl_layer_composition_pool_new();
+    TEST_ASSERT_NOT_NULL(pool);
+
+    a = fl_layer_composition_pool_get(pool, 0);
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(fl_layer_composition_reserve_clip_rects(a, 4));
+    fl_layer_composition_unref(a);
+
+    // A composition that was destroyed is reused, along with its clip rect storage.
+    atomic_store(&n_allocations, 0);
+    atomic_store(&count_allocations, true);
+
+    b = fl_layer_composition_pool_get(pool, 0);
+    TEST_ASSERT_NOT_NULL(fl_layer_composition_reserve_clip_rects(b, 3));
+
+    atomic_store(&count_allocations, false);
+
+    TEST_ASSERT_EQUAL_PTR(a, b);
+    TEST_ASSERT_EQUAL_INT(0, atomic_load(&n_allocations));
+
+    // compositions keep the pool alive.
+    fl_layer_composition_pool_unref(pool);
+    fl_layer_composition_unref(b);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_steady_state_present_does_not_allocate);
+    RUN_TEST(test_compositions_are_recycled);
+
+    return UNITY_END();
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "frame_capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <unity.h>
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/**
+ * Unpacks the stored deflate blocks of the single IDAT chunk of @a png into @a raw.
+ */
+static size_t unpack_png(const uint8_t *png, size_t png_size, uint8_t *raw, size_t raw_size) {
+    const uint8_t *cursor, *end;
+    size_t n_raw = 0;
+    bool final;
+
+    TEST_ASSERT_EQUAL_MEMORY("\x89PNG\r\n\x1a\n", png, 8);
+    TEST_ASSERT_EQUAL_MEMORY("IHDR", png + 12, 4);
+    TEST_ASSERT_EQUAL_MEMORY("IDAT", png + 37, 4);
+
+    cursor = png + 41 + 2;
+    end = png + 41 + get_be32(png + 33);
+
+    do {
+        uint16_t length = cursor[1] | (cursor[2] << 8);
+        uint16_t nlength = cursor[3] | (cursor[4] << 8);
+
+        final = cursor[0] & 1;
+        TEST_ASSERT_EQUAL_UINT16((uint16_t) ~length, nlength);
+        TEST_ASSERT_TRUE(n_raw + length <= raw_size);
+
+        memcpy(raw + n_raw, cursor + 5, length);
+        n_raw += length;
+        cursor += 5 + length;
+    } while (!final);
+
+    // adler32, then the IDAT crc, then IEND.
+    TEST_ASSERT_TRUE(cursor + 4 == end);
+    TEST_ASSERT_EQUAL_MEMORY("IEND", end + 4 + 4, 4);
+    TEST_ASSERT_EQUAL_size_t(png_size, end + 4 + 12 - png);
+
+    return n_raw;
+}
+
+void test_png_header_and_pixels() {
+    // one opaque red pixel, one half-transparent (premultiplied) white one.
+    static const uint8_t pixels[] = { 255, 0, 0, 255, 128, 128, 128, 128 };
+    uint8_t png[256], raw[16];
+    size_t size;
+
+    TEST_ASSERT_EQUAL_size_t(0, frame_capture_encode_png(VEC2I(2, 1), pixels, png, 16));
+
+    size = frame_capture_encode_png(VEC2I(2, 1), pixels, png, sizeof png);
+    TEST_ASSERT_EQUAL_size_t(frame_capture_get_png_size(VEC2I(2, 1)), size);
+
+    // width, height, 8 bits, RGBA
+    TEST_ASSERT_EQUAL_UINT32(2, get_be32(png + 16));
+    TEST_ASSERT_EQUAL_UINT32(1, get_be32(png + 20));
+    TEST_ASSERT_EQUAL_UINT8(8, png[24]);
+    TEST_ASSERT_EQUAL_UINT8(6, png[25]);
+
+    TEST_ASSERT_EQUAL_size_t(9, unpack_png(png, size, raw, sizeof raw));
+    TEST_ASSERT_EQUAL_UINT8(0, raw[0]);
+    TEST_ASSERT_EQUAL_MEMORY(pixels, raw + 1, 4);
+
+    // PNG alpha isn't premultiplied.
+    TEST_ASSERT_EQUAL_UINT8(255, raw[5]);
+    TEST_ASSERT_EQUAL_UINT8(255, raw[6]);
+    TEST_ASSERT_EQUAL_UINT8(255, raw[7]);
+    TEST_ASSERT_EQUAL_UINT8(128, raw[8]);
+}
+
+void test_png_is_split_into_deflate_blocks() {
+    struct vec2i size = VEC2I(200, 150);
+    uint8_t *pixels, *png, *raw;
+    size_t png_size, raw_size;
+
+    pixels = malloc(size.x * size.y * 4);
+    for (int i = 0; i < size.x * size.y * 4; i++) {
+        pixels[i] = (i & 3) == 3 ? 255 : i & 0xFF;
+    }
+
+    png_size = frame_capture_get_png_size(size);
+    png = malloc(png_size);
+    raw_size = size.y * (1 + size.x * 4);
+    raw = malloc(raw_size);
+
+    TEST_ASSERT_EQUAL_size_t(png_size, frame_capture_encode_png(size, pixels, png, png_size));
+    TEST_ASSERT_EQUAL_size_t(raw_size, unpack_png(png, png_size, raw, raw_size));
+
+    for (int y = 0; y < size.y; y++) {
+        TEST_ASSERT_EQUAL_UINT8(0, raw[y * (1 + size.x * 4)]);
+        TEST_ASSERT_EQUAL_MEMORY(pixels + y * size.x * 4, raw + y * (1 + size.x * 4) + 1, size.x * 4);
+    }
+
+    free(raw);
+    free(png);
+    free(pixels);
+}
+
+void test_invalid_targets() {
+    TEST_ASSERT_TRUE(frame_capture_is_valid_target("null"));
+    TEST_ASSERT_TRUE(frame_capture_is_valid_target("png:/tmp"));
+    TEST_ASSERT_TRUE(frame_capture_is_valid_target("raw:-"));
+    TEST_ASSERT_TRUE(frame_capture_is_valid_target("shm:frames"));
+    TEST_ASSERT_TRUE(frame_capture_is_valid_target("shm:/frames"));
+
+    TEST_ASSERT_FALSE(frame_capture_is_valid_target(""));
+    TEST_ASSERT_FALSE(frame_capture_is_valid_target("png:"));
+    TEST_ASSERT_FALSE(frame_capture_is_valid_target("jpeg:/tmp"));
+    TEST_ASSERT_FALSE(frame_capture_is_valid_target("shm:/a/b"));
+
+    TEST_ASSERT_NULL(frame_capture_new("bogus", NULL, VEC2I(4, 4)));
+    TEST_ASSERT_NULL(frame_capture_new("null", NULL, VEC2I(0, 4)));
+}
+
+void test_raw_frames_and_timings() {
+    char raw_path[] = "/tmp/frame_capture_test_XXXXXX";
+    char timings_path[64], target[64], line[128];
+    struct frame_capture *capture;
+    uint8_t pixels[2 * 2 * 4], read_back[sizeof pixels];
+    FILE *file;
+    int fd;
+
+    fd = mkstemp(raw_path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    snprintf(target, sizeof target, "raw:%s", raw_path);
+    snprintf(timings_path, sizeof timings_path, "%s.csv", raw_path);
+
+    capture = frame_capture_new(target, timings_path, VEC2I(2, 2));
+    TEST_ASSERT_NOT_NULL(capture);
+
+    for (int frame = 0; frame < 3; frame++) {
+        memset(pixels, frame, sizeof pixels);
+        TEST_ASSERT_EQUAL_INT(
+            0,
+            frame_capture_write(
+                capture,
+                &(const struct frame_capture_frame){
+                    .size = VEC2I(2, 2),
+                    .pixels = pixels,
+                    .present_ns = 1000 * (frame + 1),
+                    .composite_ns = 10,
+                    .readback_ns = 20,
+                }
+            )
+        );
+    }
+
+    // frames of the wrong size are rejected.
+    TEST_ASSERT_NOT_EQUAL_INT(
+        0,
+        frame_capture_write(capture, &(const struct frame_capture_frame){ .size = VEC2I(1, 2), .pixels = pixels })
+    );
+
+    frame_capture_destroy(capture);
+
+    file = fopen(raw_path, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    for (int frame = 0; frame < 3; frame++) {
+        TEST_ASSERT_EQUAL_size_t(1, fread(read_back, sizeof read_back, 1, file));
+        TEST_ASSERT_EACH_EQUAL_UINT8(frame, read_back, sizeof read_back);
+    }
+    TEST_ASSERT_EQUAL_size_t(0, fread(read_back, 1, 1, file));
+    fclose(file);
+
+    file = fopen(timings_path, "r");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof line, file));
+    TEST_ASSERT_EQUAL_STRING("frame,present_ns,composite_ns,readback_ns,write_ns\n", line);
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof line, file));
+    TEST_ASSERT_EQUAL_INT(0, strncmp(line, "0,1000,10,20,", strlen("0,1000,10,20,")));
+    fclose(file);
+
+    unlink(timings_path);
+    unlink(raw_path);
+}
+
+void test_shm_ring() {
+    const struct frame_capture_shm_header *header;
+    const struct frame_capture_shm_slot *slot;
+    struct frame_capture *capture;
+    uint8_t pixels[4 * 2 * 4];
+    char name[64], target[64];
+    size_t shm_size;
+    void *shm;
+    int fd;
+
+    snprintf(name, sizeof name, "/frame_capture_test-%d", (int) getpid());
+    snprintf(target, sizeof target, "shm:%s", name);
+
+    capture = frame_capture_new(target, NULL, VEC2I(4, 2));
+    TEST_ASSERT_NOT_NULL(capture);
+
+    for (int frame = 0; frame < FRAME_CAPTURE_SHM_N_SLOTS + 1; frame++) {
+        memset(pixels, frame, sizeof pixels);
+        TEST_ASSERT_EQUAL_INT(
+            0,
+            frame_capture_write(
+                capture,
+                &(const struct frame_capture_frame){ .size = VEC2I(4, 2), .pixels = pixels, .present_ns = frame }
+            )
+        );
+    }
+
+    fd = shm_open(name, O_RDONLY, 0);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    shm_size = sizeof *header + FRAME_CAPTURE_SHM_N_SLOTS * (sizeof *slot + sizeof pixels);
+    shm = mmap(NULL, shm_size, PROT_READ, MAP_SHARED, fd, 0);
+    TEST_ASSERT_TRUE(shm != MAP_FAILED);
+    close(fd);
+
+    header = shm;
+    TEST_ASSERT_EQUAL_UINT32(FRAME_CAPTURE_SHM_MAGIC, header->magic);
+    TEST_ASSERT_EQUAL_UINT32(4, header->width);
+    TEST_ASSERT_EQUAL_UINT32(2, header->height);
+    TEST_ASSERT_EQUAL_UINT32(16, header->stride);
+    TEST_ASSERT_EQUAL_UINT32(sizeof *slot + sizeof pixels, header->slot_size);
+    TEST_ASSERT_EQUAL_UINT64(FRAME_CAPTURE_SHM_N_SLOTS + 1, header->n_frames);
+
+    // The last frame replaced the first one.
+    slot = (const void *) ((const uint8_t *) shm + sizeof *header);
+    TEST_ASSERT_EQUAL_UINT64(FRAME_CAPTURE_SHM_N_SLOTS, slot->frame);
+    TEST_ASSERT_EQUAL_UINT64(4, slot->sequence);
+    TEST_ASSERT_EACH_EQUAL_UINT8(FRAME_CAPTURE_SHM_N_SLOTS, (const uint8_t *) (slot + 1), sizeof pixels);
+
+    slot = (const void *) ((const uint8_t *) shm + sizeof *header + header->slot_size);
+    TEST_ASSERT_EQUAL_UINT64(1, slot->frame);
+    TEST_ASSERT_EQUAL_UINT64(2, slot->sequence);
+
+    munmap(shm, shm_size);
+
+    // Destroying the capture removes the shared memory object.
+    frame_capture_destroy(capture);
+    TEST_ASSERT_TRUE(shm_open(name, O_RDONLY, 0) < 0);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_png_header_and_pixels);
+    RUN_TEST(test_png_is_split_into_deflate_blocks);
+    RUN_TEST(test_invalid_targets);
+    RUN_TEST(test_raw_frames_and_timings);
+    RUN_TEST(test_shm_ring);
+
+    return UNITY_END();
+}
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "frame_scheduler.h"
+
+#include <stdio.h>
+
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define REFRESH_RATE 50.0
+#define REFRESH_PERIOD_NS 20000000ull
+
+struct vsync_reply {
+    int n_replies;
+    intptr_t baton;
+    uint64_t frame_start_ns;
+    uint64_t next_frame_start_ns;
+};
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void on_vsync(void *userdata, intptr_t baton, uint64_t frame_start_ns, uint64_t next_frame_start_ns) {
+    struct vsync_reply *reply = userdata;
+
+    reply->n_replies++;
+    reply->baton = baton;
+    reply->frame_start_ns = frame_start_ns;
+    reply->next_frame_start_ns = next_frame_start_ns;
+}
+
+static void on_present(void *userdata) {
+    (*(int *) userdata)++;
+}
+
+static void on_cancel(void *userdata) {
+    (void) userdata;
+    TEST_FAIL_MESSAGE("frame was cancelled");
+}
+
+static void on_count_cancel(void *userdata) {
+    (*(int *) userdata) += 100;
+}
+
+static struct frame_scheduler *new_scheduler(enum present_mode mode, struct vsync_reply *reply) {
+    struct frame_scheduler *scheduler;
+
+    scheduler = frame_scheduler_new(true, mode, on_vsync, reply);
+    TEST_ASSERT_NOT_NULL(scheduler);
+
+    frame_scheduler_set_refresh_rate(scheduler, REFRESH_RATE);
+    return scheduler;
+}
+
+void test_double_buffered_frame_starts_at_next_vblank() {
+    struct frame_scheduler *scheduler;
+    struct vsync_reply reply = { 0 };
+    uint64_t vblank_ns, now;
+
+    scheduler = new_scheduler(kDoubleBufferedVsync_PresentMode, &reply);
+
+    // a scanout some time in the past establishes the vblank grid.
+    now = get_monotonic_time();
+    vblank_ns = now - 5 * REFRESH_PERIOD_NS - 1000;
+    frame_scheduler_on_scanout(scheduler, true, vblank_ns);
+
+    frame_scheduler_on_fl_vsync_request(scheduler, 1);
+    TEST_ASSERT_EQUAL_INT(1, reply.n_replies);
+    TEST_ASSERT_EQUAL_INT(1, reply.baton);
+
+    // the frame should start at the first vblank after now, on the grid.
+    TEST_ASSERT_EQUAL_UINT64(0, (reply.frame_start_ns - vblank_ns) % REFRESH_PERIOD_NS);
+    TEST_ASSERT_TRUE(reply.frame_start_ns >= now);
+    TEST_ASSERT_TRUE(reply.frame_start_ns <= now + REFRESH_PERIOD_NS);
+    TEST_ASSERT_EQUAL_UINT64(reply.frame_start_ns + REFRESH_PERIOD_NS, reply.next_frame_start_ns);
+
+    frame_scheduler_unref(scheduler);
+}
+
+void test_double_buffered_throttles_until_scanout() {
+    struct frame_scheduler *scheduler;
+    struct vsync_reply reply = { 0 };
+    uint64_t vblank_ns;
+    int n_presented = 0;
+
+    scheduler = new_scheduler(kDoubleBufferedVsync_PresentMode, &reply);
+
+    frame_scheduler_present_frame(scheduler, on_present, &n_presented, on_cancel);
+    TEST_ASSERT_EQUAL_INT(1, n_presented);
+
+    // the presented frame wasn't scanned out yet, so the next one has to wait.
+    frame_scheduler_on_fl_vsync_request(scheduler, 2);
+    TEST_ASSERT_EQUAL_INT(0, reply.n_replies);
+
+    vblank_ns = get_monotonic_time();
+    frame_scheduler_on_scanout(scheduler, true, vblank_ns);
+
+    TEST_ASSERT_EQUAL_INT(1, reply.n_replies);
+    TEST_ASSERT_EQUAL_INT(2, reply.baton);
+    TEST_ASSERT_EQUAL_UINT64(vblank_ns, reply.frame_start_ns);
+    TEST_ASSERT_EQUAL_UINT64(vblank_ns + REFRESH_PERIOD_NS, reply.next_frame_start_ns);
+
+    // nothing is queued now, so this is answered right away.
+    frame_scheduler_on_fl_vsync_request(scheduler, 3);
+    TEST_ASSERT_EQUAL_INT(2, reply.n_replies);
+    TEST_ASSERT_EQUAL_INT(3, reply.baton);
+
+    frame_scheduler_unref(scheduler);
+}
+
+void test_triple_buffered_allows_two_queued_frames() {
+    struct frame_scheduler *scheduler;
+    struct vsync_reply reply = { 0 };
+    uint64_t vblank_ns, now;
+    int n_presented = 0;
+
+    scheduler = new_scheduler(kTripleBufferedVsync_PresentMode, &reply);
+
+    now = get_monotonic_time();
+    vblank_ns = now - REFRESH_PERIOD_NS / 2;
+    frame_scheduler_on_fb_released(scheduler, true, vblank_ns);
+
+    frame_scheduler_present_frame(scheduler, on_present, &n_presented, on_cancel);
+
+    // one frame queued is fine, and the next frame starts right away, at the last vblank.
+    frame_scheduler_on_fl_vsync_request(scheduler, 4);
+    TEST_ASSERT_EQUAL_INT(1, reply.n_replies);
+    TEST_ASSERT_EQUAL_UINT64(vblank_ns, reply.frame_start_ns);
+
+    // the first frame wasn't scanned out yet, so this one is only presented at the next scanout.
+    frame_scheduler_present_frame(scheduler, on_present, &n_presented, on_cancel);
+    TEST_ASSERT_EQUAL_INT(1, n_presented);
+
+    frame_scheduler_on_fl_vsync_request(scheduler, 5);
+    TEST_ASSERT_EQUAL_INT(1, reply.n_replies);
+
+    frame_scheduler_on_scanout(scheduler, true, vblank_ns + REFRESH_PERIOD_NS);
+    TEST_ASSERT_EQUAL_INT(2, n_presented);
+    TEST_ASSERT_EQUAL_INT(2, reply.n_replies);
+    TEST_ASSERT_EQUAL_INT(5, reply.baton);
+    TEST_ASSERT_EQUAL_UINT64(vblank_ns + REFRESH_PERIOD_NS, reply.frame_start_ns);
+
+    frame_scheduler_unref(scheduler);
+}
+
+void test_scanout_without_timestamp_keeps_vblank_grid() {
+    struct frame_scheduler *scheduler;
+    struct vsync_reply reply = { 0 };
+    uint64_t vblank_ns;
+    int n_presented = 0;
+
+    scheduler = new_scheduler(kDoubleBufferedVsync_PresentMode, &reply);
+
+    vblank_ns = get_monotonic_time() - 3 * REFRESH_PERIOD_NS - REFRESH_PERIOD_NS / 3;
+    frame_scheduler_on_scanout(scheduler, true, vblank_ns);
+
+    frame_scheduler_present_frame(scheduler, on_present, &n_presented, on_cancel);
+    frame_scheduler_on_fl_vsync_request(scheduler, 6);
+    TEST_ASSERT_EQUAL_INT(0, reply.n_replies);
+
+    // the frame starts at the extrapolated vblank, not at the time the scanout was handled.
+    frame_scheduler_on_scanout(scheduler, false, 0);
+    TEST_ASSERT_EQUAL_INT(1, reply.n_replies);
+    TEST_ASSERT_EQUAL_UINT64(0, (reply.frame_start_ns - vblank_ns) % REFRESH_PERIOD_NS);
+
+    // and so do the vblanks predicted later on.
+    TEST_ASSERT_EQUAL_UINT64(0, (frame_scheduler_get_next_vblank(scheduler) - vblank_ns) % REFRESH_PERIOD_NS);
+
+    frame_scheduler_unref(scheduler);
+}
+
+void test_newest_frame_replaces_pending_frame() {
+    struct frame_scheduler *scheduler;
+    struct vsync_reply reply = { 0 };
+    int first = 0, second = 0, third = 0, fourth = 0;
+
+    scheduler = new_scheduler(kTripleBufferedVsync_PresentMode, &reply);
+
+    frame_scheduler_present_frame(scheduler, on_present, &first, on_count_cancel);
+    TEST_ASSERT_EQUAL_INT(1, first);
+
+    // the first frame is still waiting for its pageflip.
+    frame_scheduler_present_frame(scheduler, on_present, &second, on_count_cancel);
+    frame_scheduler_present_frame(scheduler, on_present, &third, on_count_cancel);
+    TEST_ASSERT_EQUAL_INT(100, second);
+    TEST_ASSERT_EQUAL_INT(0, third);
+
+    // only the newest frame is presented at the next scanout.
+    frame_scheduler_on_scanout(scheduler, true, get_monotonic_time());
+    TEST_ASSERT_EQUAL_INT(100, second);
+    TEST_ASSERT_EQUAL_INT(1, third);
+
+    // presenting failed (or it was scanned out), so the next frame is presented right away.
+    frame_scheduler_on_scanout(scheduler, false, 0);
+    frame_scheduler_present_frame(scheduler, on_present, &fourth, on_count_cancel);
+    TEST_ASSERT_EQUAL_INT(1, fourth);
+
+    // a frame that's still pending when the scheduler is destroyed is cancelled.
+    frame_scheduler_present_frame(scheduler, on_present, &first, on_count_cancel);
+    frame_scheduler_unref(scheduler);
+    TEST_ASSERT_EQUAL_INT(101, first);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_double_buffered_frame_starts_at_next_vblank);
+    RUN_TEST(test_double_buffered_throttles_until_scanout);
+    RUN_TEST(test_triple_buffered_allows_two_queued_frames);
+    RUN_TEST(test_scanout_without_timestamp_keeps_vblank_grid);
+    RUN_TEST(test_newest_frame_replaces_pending_frame);
+
+    return UNITY_END();
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include "frame_timings.h"
+
+#include <stdlib.h>
+
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define REFRESH_PERIOD_NS 20000000ull
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void scan_out_frame(struct frame_timings *timings, uint64_t frame_start_ns, uint64_t build_ns, uint64_t scanout_ns) {
+    uint64_t frame;
+
+    frame_timings_begin_frame(timings, 1, frame_start_ns, frame_start_ns + REFRESH_PERIOD_NS);
+    frame = frame_timings_take_current_frame(timings);
+
+    // overwrite the begin timestamp taken by frame_timings_begin_frame so the intervals are predictable.
+    frame_timings_mark(timings, frame, kBeginFrame_FrameStage, frame_start_ns);
+    frame_timings_mark(timings, frame, kPresentLayers_FrameStage, frame_start_ns + build_ns);
+    frame_timings_mark(timings, frame, kSurfacesPresented_FrameStage, frame_start_ns + build_ns);
+    frame_timings_mark(timings, frame, kRequestBuilt_FrameStage, frame_start_ns + build_ns);
+    frame_timings_mark(timings, frame, kCommit_FrameStage, frame_start_ns + build_ns);
+    frame_timings_mark(timings, frame, kScanout_FrameStage, scanout_ns);
+}
+
+void test_percentiles() {
+    struct frame_timings_stats stats;
+    struct frame_timings *timings;
+    uint64_t start_ns;
+
+    timings = frame_timings_new();
+    TEST_ASSERT_NOT_NULL(timings);
+
+    // 90 frames take 4ms to build, 9 take 10ms and one takes 30ms.
+    start_ns = 1000000000ull;
+    for (int i = 0; i < 100; i++, start_ns += REFRESH_PERIOD_NS) {
+        uint64_t build_ns = i < 90 ? 4000000 : i < 99 ? 10000000 : 30000000;
+
+        scan_out_frame(timings, start_ns, build_ns, start_ns + REFRESH_PERIOD_NS);
+    }
+
+    frame_timings_get_stats(timings, &stats);
+    TEST_ASSERT_EQUAL_UINT64(100, stats.n_frames);
+    TEST_ASSERT_EQUAL_UINT64(100, stats.intervals[kBuild_FrameInterval].n_samples);
+
+    // percentiles are only accurate to the histogram bucket size.
+    TEST_ASSERT_UINT64_WITHIN(500000, 4000000, stats.intervals[kBuild_FrameInterval].p50_ns);
+    TEST_ASSERT_UINT64_WITHIN(500000, 4000000, stats.intervals[kBuild_FrameInterval].p90_ns);
+    TEST_ASSERT_UINT64_WITHIN(1250000, 10000000, stats.intervals[kBuild_FrameInterval].p99_ns);
+    TEST_ASSERT_EQUAL_UINT64(30000000, stats.intervals[kBuild_FrameInterval].max_ns);
+    TEST_ASSERT_EQUAL_UINT64((90 * 4000000ull + 9 * 10000000ull + 30000000ull) / 100, stats.intervals[kBuild_FrameInterval].mean_ns);
+
+    TEST_ASSERT_EQUAL_UINT64(REFRESH_PERIOD_NS, stats.intervals[kTotal_FrameInterval].max_ns);
+
+    frame_timings_reset_stats(timings);
+    frame_timings_get_stats(timings, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.n_frames);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.intervals[kBuild_FrameInterval].n_samples);
+
+    frame_timings_unref(timings);
+}
+
+void test_late_frames_count_missed_vblanks() {
+    struct frame_timings_stats stats;
+    struct frame_timings *timings;
+    uint64_t start_ns;
+
+    timings = frame_timings_new();
+    TEST_ASSERT_NOT_NULL(timings);
+
+    start_ns = 1000000000ull;
+
+    // on time, with a bit of jitter.
+    scan_out_frame(timings, start_ns, 1000000, start_ns + REFRESH_PERIOD_NS + 100000);
+
+    // one vblank late.
+    scan_out_frame(timings, start_ns, 1000000, start_ns + 2 * REFRESH_PERIOD_NS);
+
+    // three vblanks late.
+    scan_out_frame(timings, start_ns, 1000000, start_ns + 4 * REFRESH_PERIOD_NS + 100000);
+
+    frame_timings_get_stats(timings, &stats);
+    TEST_ASSERT_EQUAL_UINT64(3, stats.n_frames);
+    TEST_ASSERT_EQUAL_UINT64(2, stats.n_late_frames);
+    TEST_ASSERT_EQUAL_UINT64(4, stats.n_missed_vblanks);
+
+    frame_timings_unref(timings);
+}
+
+void test_current_frame_is_taken_once() {
+    struct frame_timings *timings;
+    uint64_t frame, other;
+
+    timings = frame_timings_new();
+    TEST_ASSERT_NOT_NULL(timings);
+
+    frame = frame_timings_begin_frame(timings, 42, 1000, 2000);
+    TEST_ASSERT_NOT_EQUAL(0, frame);
+    TEST_ASSERT_EQUAL_UINT64(frame, frame_timings_take_current_frame(timings));
+
+    // presenting again without a new vsync reply starts a new frame.
+    other = frame_timings_take_current_frame(timings);
+    TEST_ASSERT_NOT_EQUAL(0, other);
+    TEST_ASSERT_NOT_EQUAL(frame, other);
+
+    frame_timings_unref(timings);
+}
+
+void test_recent_frames_wrap_around() {
+    struct frame_record *records;
+    struct frame_timings *timings;
+    size_t n_records;
+
+    timings = frame_timings_new();
+    TEST_ASSERT_NOT_NULL(timings);
+
+    records = malloc(FRAME_TIMINGS_N_RECENT_FRAMES * sizeof *records);
+    TEST_ASSERT_NOT_NULL(records);
+
+    for (unsigned i = 0; i < FRAME_TIMINGS_N_RECENT_FRAMES + 10; i++) {
+        frame_timings_begin_frame(timings, i, 1000 * i, 1000 * (i + 1));
+    }
+
+    n_records = frame_timings_get_recent_frames(timings, records, 5);
+    TEST_ASSERT_EQUAL_size_t(5, n_records);
+    TEST_ASSERT_EQUAL_INT(FRAME_TIMINGS_N_RECENT_FRAMES + 5, records[0].vsync_baton);
+    TEST_ASSERT_EQUAL_INT(FRAME_TIMINGS_N_RECENT_FRAMES + 9, records[4].vsync_baton);
+    TEST_ASSERT_EQUAL_UINT64(1000 * (FRAME_TIMINGS_N_RECENT_FRAMES + 9), records[4].frame_start_ns);
+    TEST_ASSERT_NOT_EQUAL(0, records[4].stages_ns[kBeginFrame_FrameStage]);
+    TEST_ASSERT_EQUAL_UINT64(0, records[4].stages_ns[kScanout_FrameStage]);
+
+    // the oldest frames were overwritten.
+    n_records = frame_timings_get_recent_frames(timings, records, 1000);
+    TEST_ASSERT_EQUAL_size_t(FRAME_TIMINGS_N_RECENT_FRAMES, n_records);
+    TEST_ASSERT_EQUAL_INT(10, records[0].vsync_baton);
+
+    // marking an overwritten frame does nothing.
+    frame_timings_mark(timings, records[0].frame - 1, kScanout_FrameStage, 1);
+    frame_timings_get_recent_frames(timings, records, 1000);
+    for (unsigned i = 0; i < FRAME_TIMINGS_N_RECENT_FRAMES; i++) {
+        TEST_ASSERT_EQUAL_UINT64(0, records[i].stages_ns[kScanout_FrameStage]);
+    }
+
+    free(records);
+    frame_timings_unref(timings);
+}
+
+void test_skipped_frames_are_not_committed() {
+    struct frame_timings_stats stats;
+    struct frame_timings *timings;
+    uint64_t frame;
+
+    timings = frame_timings_new();
+    TEST_ASSERT_NOT_NULL(timings);
+
+    scan_out_frame(timings, 1000000000ull, 4000000, 1000000000ull + REFRESH_PERIOD_NS);
+
+    frame_timings_begin_frame(timings, 2, 1000000000ull + REFRESH_PERIOD_NS, 1000000000ull + 2 * REFRESH_PERIOD_NS);
+    frame = frame_timings_take_current_frame(timings);
+    frame_timings_skip_frame(timings, frame);
+
+    // untracked frames (cursor updates) aren't counted.
+    frame_timings_skip_frame(timings, 0);
+
+    frame_timings_get_stats(timings, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_committed_frames);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_skipped_frames);
+
+    frame_timings_reset_stats(timings);
+    frame_timings_get_stats(timings, &stats);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.n_committed_frames);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.n_skipped_frames);
+
+    frame_timings_unref(timings);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_percentiles);
+    RUN_TEST(test_late_frames_count_missed_vblanks);
+    RUN_TEST(test_current_frame_is_taken_once);
+    RUN_TEST(test_recent_frames_wrap_around);
+    RUN_TEST(test_skipped_frames_are_not_committed);
+
+    return UNITY_END();
+}
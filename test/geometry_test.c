@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "util/geometry.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "compositor_ng.h"
+
+#include <unity.h>
+
+#define EPSILON 1e-9
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+#define MAT3F_SCALE(scale_x, scale_y) \
+    ((struct mat3f){                  \
+        .scaleX = scale_x,            \
+        .skewX = 0,                   \
+        .transX = 0,                  \
+        .skewY = 0,                   \
+        .scaleY = scale_y,            \
+        .transY = 0,                  \
+        .pers0 = 0,                   \
+        .pers1 = 0,                   \
+        .pers2 = 1,                   \
+    })
+
+static void assert_vec2f_equals(struct vec2f expected, struct vec2f actual) {
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, expected.x, actual.x);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, expected.y, actual.y);
+}
+
+static void assert_aa_rect_equals(struct aa_rect expected, struct aa_rect actual) {
+    assert_vec2f_equals(expected.offset, actual.offset);
+    assert_vec2f_equals(expected.size, actual.size);
+}
+
+void test_multiply_mat3f() {
+    struct mat3f m;
+
+    // multiply_mat3f(a, b) applies b first, then a.
+    m = multiply_mat3f(MAT3F_TRANSLATION(10, 20), MAT3F_SCALE(2, 3));
+    assert_vec2f_equals(VEC2F(12, 23), transform_point(m, VEC2F(1, 1)));
+
+    m = multiply_mat3f(MAT3F_SCALE(2, 3), MAT3F_TRANSLATION(10, 20));
+    assert_vec2f_equals(VEC2F(22, 63), transform_point(m, VEC2F(1, 1)));
+
+    m = multiply_mat3f(MAT3F_IDENTITY, MAT3F_ROTZ(90));
+    assert_vec2f_equals(transform_point(MAT3F_ROTZ(90), VEC2F(3, 4)), transform_point(m, VEC2F(3, 4)));
+}
+
+void test_invert_mat3f() {
+    struct mat3f m, inverse, product;
+
+    m = multiply_mat3f(MAT3F_TRANSLATION(-5, 7), multiply_mat3f(MAT3F_ROTZ(30), MAT3F_SCALE(2, 0.5)));
+    TEST_ASSERT_TRUE(invert_mat3f(m, &inverse));
+
+    product = multiply_mat3f(inverse, m);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 1, product.scaleX);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.skewX);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.transX);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.skewY);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 1, product.scaleY);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.transY);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.pers0);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 0, product.pers1);
+    TEST_ASSERT_DOUBLE_WITHIN(EPSILON, 1, product.pers2);
+
+    assert_vec2f_equals(VEC2F(3, -2), transform_point(inverse, transform_point(m, VEC2F(3, -2))));
+}
+
+void test_invert_singular_mat3f() {
+    struct mat3f inverse;
+
+    TEST_ASSERT_FALSE(invert_mat3f(MAT3F_SCALE(0, 1), &inverse));
+    TEST_ASSERT_FALSE(invert_mat3f(multiply_mat3f(MAT3F_TRANSLATION(10, 10), MAT3F_SCALE(3, 0)), &inverse));
+}
+
+void test_transform_aa_rect() {
+    struct quad quad;
+
+    quad = transform_aa_rect(MAT3F_TRANSLATION(10, 20), AA_RECT_FROM_COORDS(0, 0, 100, 50));
+    TEST_ASSERT_TRUE(quad_is_axis_aligned(quad));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(10, 20, 100, 50), quad_get_aa_bounding_rect(quad));
+
+    // scaling keeps the rect axis aligned.
+    quad = transform_aa_rect(MAT3F_SCALE(2, 0.5), AA_RECT_FROM_COORDS(10, 10, 100, 50));
+    TEST_ASSERT_TRUE(quad_is_axis_aligned(quad));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(20, 5, 200, 25), quad_get_aa_bounding_rect(quad));
+
+    // mirroring doesn't, since the corners end up in the wrong places.
+    quad = transform_aa_rect(MAT3F_SCALE(-1, 1), AA_RECT_FROM_COORDS(0, 0, 100, 50));
+    TEST_ASSERT_FALSE(quad_is_axis_aligned(quad));
+
+    // 45 degrees doesn't.
+    quad = transform_aa_rect(MAT3F_ROTZ(45), AA_RECT_FROM_COORDS(0, 0, 100, 100));
+    TEST_ASSERT_FALSE(quad_is_axis_aligned(quad));
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 100 * sqrt(2), quad_get_aa_bounding_rect(quad).size.x);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-6, 100 * sqrt(2), quad_get_aa_bounding_rect(quad).size.y);
+}
+
+void test_aa_rect_intersection_and_union() {
+    struct aa_rect a, b;
+
+    a = AA_RECT_FROM_COORDS(0, 0, 100, 100);
+    b = AA_RECT_FROM_COORDS(50, 25, 100, 50);
+
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(50, 25, 50, 50), aa_rect_intersection(a, b));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(0, 0, 150, 100), aa_rect_union(a, b));
+    TEST_ASSERT_FALSE(aa_rect_is_empty(aa_rect_intersection(a, b)));
+
+    // disjoint rects have an empty intersection.
+    b = AA_RECT_FROM_COORDS(200, 200, 10, 10);
+    TEST_ASSERT_TRUE(aa_rect_is_empty(aa_rect_intersection(a, b)));
+    TEST_ASSERT_TRUE(aa_rect_is_empty(AA_RECT_FROM_COORDS(5, 5, 0, 10)));
+}
+
+void test_mutation_stack_clip() {
+    struct mat3f transform, layer_to_local;
+    struct aa_rect clip;
+    struct quad quad;
+
+    // A clip that was pushed after a translate and a scale mutation, root-first.
+    transform = MAT3F_IDENTITY;
+    transform = multiply_mat3f(transform, MAT3F_TRANSLATION(100, 50));
+    transform = multiply_mat3f(transform, MAT3F_SCALE(2, 2));
+
+    clip = AA_RECT_FROM_COORDS(10, 10, 20, 30);
+    quad = transform_aa_rect(transform, clip);
+    TEST_ASSERT_TRUE(quad_is_axis_aligned(quad));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(120, 70, 40, 60), quad_get_aa_bounding_rect(quad));
+
+    // The inverse maps layer coordinates back into the clip space.
+    TEST_ASSERT_TRUE(invert_mat3f(transform, &layer_to_local));
+    assert_vec2f_equals(VEC2F(10, 10), transform_point(layer_to_local, quad.top_left));
+    assert_vec2f_equals(VEC2F(30, 40), transform_point(layer_to_local, quad.bottom_right));
+}
+
+void test_scanout_rects_are_cropped_by_clips() {
+    struct fl_layer_props props = { 0 };
+    struct clip_rect clip = { 0 };
+    struct aa_rect src, dst;
+
+    props.is_aa_rect = true;
+    props.aa_rect = AA_RECT_FROM_COORDS(100, 100, 200, 100);
+    props.quad = get_quad(props.aa_rect);
+    props.opacity = 1.0;
+
+    TEST_ASSERT_TRUE(fl_layer_props_get_scanout_rects(&props, VEC2F(400, 200), &src, &dst));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(0, 0, 400, 200), src);
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(100, 100, 200, 100), dst);
+
+    // Clip away the left half of the view.
+    clip.is_aa = true;
+    clip.aa_rect = AA_RECT_FROM_COORDS(200, 0, 1000, 1000);
+    clip.rect = get_quad(clip.aa_rect);
+    props.n_clip_rects = 1;
+    props.clip_rects = &clip;
+
+    TEST_ASSERT_FALSE(fl_layer_props_needs_gpu_composition(&props));
+    TEST_ASSERT_TRUE(fl_layer_props_get_scanout_rects(&props, VEC2F(400, 200), &src, &dst));
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(200, 0, 200, 200), src);
+    assert_aa_rect_equals(AA_RECT_FROM_COORDS(200, 100, 100, 100), dst);
+
+    // Rounded clips can't be scanned out.
+    clip.is_rounded = true;
+    TEST_ASSERT_TRUE(fl_layer_props_needs_gpu_composition(&props));
+    clip.is_rounded = false;
+
+    // A clip outside of the view hides it completely.
+    clip.aa_rect = AA_RECT_FROM_COORDS(0, 0, 50, 50);
+    clip.rect = get_quad(clip.aa_rect);
+    TEST_ASSERT_FALSE(fl_layer_props_get_scanout_rects(&props, VEC2F(400, 200), &src, &dst));
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_multiply_mat3f);
+    RUN_TEST(test_invert_mat3f);
+    RUN_TEST(test_invert_singular_mat3f);
+    RUN_TEST(test_transform_aa_rect);
+    RUN_TEST(test_aa_rect_intersection_and_union);
+    RUN_TEST(test_mutation_stack_clip);
+    RUN_TEST(test_scanout_rects_are_cropped_by_clips);
+
+    return UNITY_END();
+}
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void reader_stall(void);
+
+#define GRACE_PERIOD_READER_STALL_HOOK() reader_stall()
+#include "util/grace_period.h"
+
+#include <unity.h>
+
+#define N_STRESS_PUBLISHES 20000
+#define N_STRESS_READERS 2
+
+struct item {
+    atomic_bool alive;
+};
+
+/**
+ * Shared state of a test. Items are never actually freed while the test runs,
+ * writers only mark them as dead, so a reader that can still see a retired item
+ * can be detected reliably.
+ */
+struct test_state {
+    struct grace_period gp;
+    struct item *_Atomic current;
+    pthread_mutex_t writer_lock;
+
+    struct item *items;
+    atomic_size_t n_items;
+    size_t max_items;
+
+    atomic_bool stop;
+};
+
+enum stall_mode {
+    kNoStall,
+    kStallOnce,
+    kStallRandomly,
+};
+
+static _Thread_local enum stall_mode stall_mode = kNoStall;
+static _Thread_local unsigned stall_seed;
+
+// for kStallOnce
+static sem_t reader_loaded_epoch;
+static sem_t reader_resume;
+
+static void reader_stall(void) {
+    if (stall_mode == kStallOnce) {
+        stall_mode = kNoStall;
+        sem_post(&reader_loaded_epoch);
+        sem_wait(&reader_resume);
+    } else if (stall_mode == kStallRandomly) {
+        switch (rand_r(&stall_seed) % 8) {
+            case 0: sched_yield(); break;
+            case 1: usleep(10); break;
+            default: break;
+        }
+    }
+}
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void test_state_init(struct test_state *state, size_t max_items) {
+    grace_period_init(&state->gp);
+    pthread_mutex_init(&state->writer_lock, NULL);
+
+    state->items = calloc(max_items, sizeof *state->items);
+    TEST_ASSERT_NOT_NULL(state->items);
+
+    state->max_items = max_items;
+    atomic_init(&state->n_items, 1);
+    atomic_init(&state->items[0].alive, true);
+    atomic_init(&state->current, &state->items[0]);
+    atomic_init(&state->stop, false);
+}
+
+static void test_state_deinit(struct test_state *state) {
+    free(state->items);
+    pthread_mutex_destroy(&state->writer_lock);
+}
+
+/// Publishes a new item, waits for a grace period and retires the previous one.
+/// Returns false if there's no more room for items.
+static bool publish(struct test_state *state) {
+    struct item *item, *old;
+    size_t index;
+
+    index = atomic_fetch_add(&state->n_items, 1);
+    if (index >= state->max_items) {
+        return false;
+    }
+
+    item = state->items + index;
+    atomic_store(&item->alive, true);
+
+    pthread_mutex_lock(&state->writer_lock);
+
+    old = atomic_exchange(&state->current, item);
+    grace_period_synchronize(&state->gp);
+    atomic_store(&old->alive, false);
+
+    pthread_mutex_unlock(&state->writer_lock);
+    return true;
+}
+
+static void *publish_once(void *userdata) {
+    publish(userdata);
+    return NULL;
+}
+
+struct stalled_reader_result {
+    struct test_state *state;
+    struct item *item;
+    bool saw_retired_item;
+};
+
+static sem_t reader_has_item;
+
+static void *stalled_reader(void *userdata) {
+    struct stalled_reader_result *result = userdata;
+    unsigned epoch;
+
+    stall_mode = kStallOnce;
+
+    epoch = grace_period_read_lock(&result->state->gp);
+
+    result->item = atomic_load(&result->state->current);
+    sem_post(&reader_has_item);
+
+    // give the second writer plenty of time to (wrongly) retire the item.
+    usleep(100000);
+    result->saw_retired_item = !atomic_load(&result->item->alive);
+
+    grace_period_read_unlock(&result->state->gp, epoch);
+    return NULL;
+}
+
+/**
+ * A reader loads the epoch and stalls before incrementing its counter. Writer A
+ * publishes an item in the meantime and doesn't need to wait for the reader, so the reader
+ * then picks up A's item while being counted for the previous epoch. Writer B must not
+ * retire A's item while the reader is still using it.
+ */
+void test_stalled_reader_with_two_writers() {
+    struct stalled_reader_result result = { 0 };
+    struct test_state state;
+    pthread_t reader, writer_a, writer_b;
+
+    test_state_init(&state, 3);
+    sem_init(&reader_loaded_epoch, 0, 0);
+    sem_init(&reader_resume, 0, 0);
+    sem_init(&reader_has_item, 0, 0);
+
+    result.state = &state;
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&reader, NULL, stalled_reader, &result));
+
+    sem_wait(&reader_loaded_epoch);
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&writer_a, NULL, publish_once, &state));
+    pthread_join(writer_a, NULL);
+
+    sem_post(&reader_resume);
+    sem_wait(&reader_has_item);
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&writer_b, NULL, publish_once, &state));
+
+    pthread_join(reader, NULL);
+    pthread_join(writer_b, NULL);
+
+    TEST_ASSERT_EQUAL_PTR(state.items + 1, result.item);
+    TEST_ASSERT_FALSE(result.saw_retired_item);
+    TEST_ASSERT_FALSE(atomic_load(&state.items[1].alive));
+    TEST_ASSERT_TRUE(atomic_load(&state.items[2].alive));
+
+    sem_destroy(&reader_has_item);
+    sem_destroy(&reader_resume);
+    sem_destroy(&reader_loaded_epoch);
+    test_state_deinit(&state);
+}
+
+struct stress_reader_result {
+    struct test_state *state;
+    unsigned seed;
+    unsigned long n_reads;
+    unsigned long n_retired_items_seen;
+};
+
+static void *stress_reader(void *userdata) {
+    struct stress_reader_result *result = userdata;
+    struct item *item;
+    unsigned epoch;
+
+    stall_mode = kStallRandomly;
+    stall_seed = result->seed;
+
+    while (!atomic_load(&result->state->stop)) {
+        epoch = grace_period_read_lock(&result->state->gp);
+
+        item = atomic_load(&result->state->current);
+        if (rand_r(&stall_seed) % 4 == 0) {
+            sched_yield();
+        }
+        if (!atomic_load(&item->alive)) {
+            result->n_retired_items_seen++;
+        }
+
+        grace_period_read_unlock(&result->state->gp, epoch);
+        result->n_reads++;
+    }
+
+    return NULL;
+}
+
+static void *stress_writer(void *userdata) {
+    while (publish(userdata)) {
+    }
+    return NULL;
+}
+
+void test_stress_two_writers() {
+    struct stress_reader_result results[N_STRESS_READERS];
+    struct test_state state;
+    pthread_t readers[N_STRESS_READERS], writers[2];
+
+    test_state_init(&state, 2 * N_STRESS_PUBLISHES + 1);
+
+    for (int i = 0; i < N_STRESS_READERS; i++) {
+        results[i] = (struct stress_reader_result){ .state = &state, .seed = i + 1 };
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(readers + i, NULL, stress_reader, results + i));
+    }
+
+    for (int i = 0; i < 2; i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(writers + i, NULL, stress_writer, &state));
+    }
+
+    for (int i = 0; i < 2; i++) {
+        pthread_join(writers[i], NULL);
+    }
+
+    atomic_store(&state.stop, true);
+    for (int i = 0; i < N_STRESS_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (int i = 0; i < N_STRESS_READERS; i++) {
+        TEST_ASSERT_TRUE(results[i].n_reads > 0);
+        TEST_ASSERT_EQUAL_UINT64(0, results[i].n_retired_items_seen);
+    }
+
+    test_state_deinit(&state);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_stalled_reader_with_two_writers);
+    RUN_TEST(test_stress_two_writers);
+
+    return UNITY_END();
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "input_trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <flutter_embedder.h>
+
+#include "user_input.h"
+#include "util/collection.h"
+#include "util/geometry.h"
+
+#include <unity.h>
+
+static char trace_path[] = "/tmp/input_trace_test_XXXXXX";
+
+// required by Unity.
+void setUp() {
+    int fd;
+
+    strcpy(trace_path, "/tmp/input_trace_test_XXXXXX");
+    fd = mkstemp(trace_path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+}
+
+void tearDown() {
+    unlink(trace_path);
+}
+
+static void write_trace(const struct input_trace_event *events, size_t n_events) {
+    struct input_trace_writer *writer;
+
+    writer = input_trace_writer_new(trace_path);
+    TEST_ASSERT_NOT_NULL(writer);
+
+    for (size_t i = 0; i < n_events; i++) {
+        TEST_ASSERT_EQUAL_INT(0, input_trace_writer_write(writer, events + i));
+    }
+
+    input_trace_writer_destroy(writer);
+}
+
+void test_write_and_read() {
+    struct input_trace_reader *reader;
+    struct input_trace_event event;
+
+    const struct input_trace_event events[] = {
+        { .timestamp_us = 1000, .device_id = 0, .type = kDeviceAdded_InputTraceEventType, .code = INPUT_TRACE_DEVICE_CAP_TOUCH, .value = 10 },
+        { .timestamp_us = 2000, .device_id = 0, .type = kTouchDown_InputTraceEventType, .slot = 3, .x = 0.25, .y = 0.75 },
+        { .timestamp_us = 3000, .device_id = 0, .type = kKey_InputTraceEventType, .code = 30, .value = 1 },
+    };
+
+    write_trace(events, ARRAY_SIZE(events));
+
+    reader = input_trace_reader_new(trace_path);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    for (size_t i = 0; i < ARRAY_SIZE(events); i++) {
+        TEST_ASSERT_EQUAL_INT(0, input_trace_reader_next(reader, &event));
+        TEST_ASSERT_EQUAL_MEMORY(events + i, &event, sizeof event);
+    }
+
+    TEST_ASSERT_EQUAL_INT(ENODATA, input_trace_reader_next(reader, &event));
+
+    input_trace_reader_destroy(reader);
+}
+
+void test_rejects_invalid_traces() {
+    struct input_trace_reader *reader;
+    struct input_trace_event event;
+    FILE *file;
+
+    // not a trace at all
+    file = fopen(trace_path, "wb");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs("hello world, this is not a trace", file);
+    fclose(file);
+
+    TEST_ASSERT_NULL(input_trace_reader_new(trace_path));
+
+    // truncated event
+    write_trace(&(struct input_trace_event){ .type = kKey_InputTraceEventType }, 1);
+    TEST_ASSERT_EQUAL_INT(0, truncate(trace_path, 16 + sizeof event / 2));
+
+    reader = input_trace_reader_new(trace_path);
+    TEST_ASSERT_NOT_NULL(reader);
+    TEST_ASSERT_EQUAL_INT(EINVAL, input_trace_reader_next(reader, &event));
+    input_trace_reader_destroy(reader);
+
+    // unknown event type
+    write_trace(&(struct input_trace_event){ .type = kMax_InputTraceEventType + 1 }, 1);
+
+    reader = input_trace_reader_new(trace_path);
+    TEST_ASSERT_NOT_NULL(reader);
+    TEST_ASSERT_EQUAL_INT(EINVAL, input_trace_reader_next(reader, &event));
+    input_trace_reader_destroy(reader);
+}
+
+struct replay_result {
+    pthread_mutex_t mutex;
+    pthread_cond_t finished_cond;
+    bool finished;
+
+    FlutterPointerEvent events[16];
+    size_t n_events;
+};
+
+static void on_flutter_pointer_event(void *userdata, const FlutterPointerEvent *events, size_t n_events) {
+    struct replay_result *result = userdata;
+
+    pthread_mutex_lock(&result->mutex);
+    for (size_t i = 0; i < n_events && result->n_events < ARRAY_SIZE(result->events); i++) {
+        result->events[result->n_events++] = events[i];
+    }
+    pthread_mutex_unlock(&result->mutex);
+}
+
+static void on_replay_finished(void *userdata) {
+    struct replay_result *result = userdata;
+
+    pthread_mutex_lock(&result->mutex);
+    result->finished = true;
+    pthread_cond_signal(&result->finished_cond);
+    pthread_mutex_unlock(&result->mutex);
+}
+
+static void on_set_cursor_enabled(void *userdata, bool enabled) {
+    (void) userdata;
+    (void) enabled;
+}
+
+static void on_move_cursor(void *userdata, struct vec2f delta) {
+    (void) userdata;
+    (void) delta;
+}
+
+void test_replay_touch_events() {
+    struct replay_result result;
+    struct user_input_stats stats;
+    struct user_input *input;
+    struct mat3f identity;
+
+    static const struct user_input_interface interface = {
+        .on_flutter_pointer_event = on_flutter_pointer_event,
+        .on_set_cursor_enabled = on_set_cursor_enabled,
+        .on_move_cursor = on_move_cursor,
+        .on_replay_finished = on_replay_finished,
+    };
+
+    // recorded 10s after boot, with 1ms between the events.
+    const struct input_trace_event events[] = {
+        { .timestamp_us = 10000000, .device_id = 0, .type = kDeviceAdded_InputTraceEventType, .code = INPUT_TRACE_DEVICE_CAP_TOUCH, .value = 2 },
+        { .timestamp_us = 10001000, .device_id = 0, .type = kTouchDown_InputTraceEventType, .slot = 1, .x = 0.5, .y = 0.25 },
+        { .timestamp_us = 10002000, .device_id = 0, .type = kTouchMotion_InputTraceEventType, .slot = 1, .x = 0.75, .y = 0.5 },
+        { .timestamp_us = 10003000, .device_id = 0, .type = kTouchUp_InputTraceEventType, .slot = 1 },
+    };
+
+    write_trace(events, ARRAY_SIZE(events));
+
+    memset(&result, 0, sizeof result);
+    pthread_mutex_init(&result.mutex, NULL);
+    pthread_cond_init(&result.finished_cond, NULL);
+
+    identity = MAT3F_TRANSLATION(0, 0);
+
+    input = user_input_new_replay(&interface, &result, &identity, &identity, 800, 480, trace_path, 1.0);
+    TEST_ASSERT_NOT_NULL(input);
+
+    TEST_ASSERT_EQUAL_INT(0, user_input_start_thread(input, 0));
+
+    pthread_mutex_lock(&result.mutex);
+    while (!result.finished) {
+        pthread_cond_wait(&result.finished_cond, &result.mutex);
+    }
+    pthread_mutex_unlock(&result.mutex);
+
+    user_input_stop_thread(input);
+
+    // add events for both slots, then down, move & up for slot 1.
+    TEST_ASSERT_EQUAL_size_t(5, result.n_events);
+    TEST_ASSERT_EQUAL_INT(kAdd, result.events[0].phase);
+    TEST_ASSERT_EQUAL_INT(kAdd, result.events[1].phase);
+
+    TEST_ASSERT_EQUAL_INT(kDown, result.events[2].phase);
+    TEST_ASSERT_EQUAL_INT(result.events[1].device, result.events[2].device);
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 400, result.events[2].x);
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 120, result.events[2].y);
+
+    TEST_ASSERT_EQUAL_INT(kMove, result.events[3].phase);
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 600, result.events[3].x);
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 240, result.events[3].y);
+
+    TEST_ASSERT_EQUAL_INT(kUp, result.events[4].phase);
+
+    // The timestamps are relative to the start of the replay, but keep their spacing.
+    TEST_ASSERT_UINT64_WITHIN(500, 1000, result.events[3].timestamp - result.events[2].timestamp);
+    TEST_ASSERT_UINT64_WITHIN(500, 1000, result.events[4].timestamp - result.events[3].timestamp);
+
+    user_input_get_stats(input, &stats);
+    TEST_ASSERT_EQUAL_UINT64(4, stats.n_replayed_events);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_touch_moves_in);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_touch_moves_out);
+
+    user_input_destroy(input);
+
+    pthread_cond_destroy(&result.finished_cond);
+    pthread_mutex_destroy(&result.mutex);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_write_and_read);
+    RUN_TEST(test_rejects_invalid_traces);
+    RUN_TEST(test_replay_touch_events);
+
+    return UNITY_END();
+}
@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+#include "plane_index.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <drm_fourcc.h>
+#include <xf86drmMode.h>
+
+#include "modesetting.h"
+#include "pixel_format.h"
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_RANDOM_QUERIES 100000
+#define N_BENCHMARK_FRAMES 20000
+
+#define ALL_FORMATS UINT64_MAX
+#define UNKNOWN_MODIFIER 0x00ffffffffff1234ull
+
+#define VC4_ROTATIONS (DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_180 | DRM_MODE_REFLECT_X | DRM_MODE_REFLECT_Y)
+#define I915_ROTATIONS (DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_180 | DRM_MODE_ROTATE_270 | DRM_MODE_REFLECT_X)
+#define I915_CURSOR_ROTATIONS (DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_180)
+#define ROCKCHIP_ROTATIONS (DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y)
+
+struct recorded_modifier {
+    uint64_t modifier;
+
+    /// Bitmask of the indices (into the format list of the plane) of the formats supported with this modifier.
+    uint64_t formats;
+};
+
+struct recorded_plane {
+    uint32_t id;
+    enum drm_plane_type type;
+    uint32_t possible_crtcs;
+
+    bool has_zpos, has_hardcoded_zpos;
+    int64_t min_zpos, max_zpos;
+
+    /// Zero if the plane has no rotation property.
+    uint32_t supported_rotations;
+
+    const uint32_t *formats;
+    size_t n_formats;
+
+    const struct recorded_modifier *modifiers;
+    size_t n_modifiers;
+};
+
+struct recorded_device {
+    const char *name;
+    size_t n_crtcs;
+    const struct recorded_plane *planes;
+    size_t n_planes;
+
+    /// The pixel format & modifier of the buffers the app is rendered into on this device.
+    uint64_t scanout_modifier;
+};
+
+/*
+ * The plane tables below are modelled on drm_info output of the respective devices. Only what matters
+ * for plane allocation is kept, and formats without an enum pixfmt are kept too, since they're still in
+ * the IN_FORMATS blob that has to be walked.
+ */
+
+// Raspberry Pi 4, vc4 (HVS5): a primary & cursor plane per CRTC, 16 overlay planes shared by all CRTCs.
+static const uint32_t vc4_formats[] = {
+    DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_ABGR8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_RGB565, DRM_FORMAT_BGR565,
+    DRM_FORMAT_ARGB1555, DRM_FORMAT_XRGB1555, DRM_FORMAT_RGB888,  DRM_FORMAT_BGR888,   DRM_FORMAT_YUV422, DRM_FORMAT_YUV420,
+    DRM_FORMAT_YVU420,   DRM_FORMAT_NV12,     DRM_FORMAT_NV21,     DRM_FORMAT_NV16,
+};
+
+static const struct recorded_modifier vc4_modifiers[] = {
+    { DRM_FORMAT_MOD_LINEAR, ALL_FORMATS },
+    { DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED, 0x3F },
+    { DRM_FORMAT_MOD_BROADCOM_SAND64, (1 << 11) | (1 << 13) },
+    { DRM_FORMAT_MOD_BROADCOM_SAND128, (1 << 11) | (1 << 13) },
+    { DRM_FORMAT_MOD_BROADCOM_SAND256, (1 << 11) | (1 << 13) },
+};
+
+#define VC4_PLANE(_id, _type, _possible_crtcs)                                                                                           \
+    {                                                                                                                                    \
+        .id = (_id), .type = (_type), .possible_crtcs = (_possible_crtcs), .has_zpos = true, .has_hardcoded_zpos = false, .min_zpos = 0, \
+        .max_zpos = 31, .supported_rotations = VC4_ROTATIONS, .formats = vc4_formats, .n_formats = ARRAY_SIZE(vc4_formats),              \
+        .modifiers = vc4_modifiers, .n_modifiers = ARRAY_SIZE(vc4_modifiers),                                                           \
+    }
+
+static const struct recorded_plane vc4_planes[] = {
+    VC4_PLANE(32, kPrimary_DrmPlaneType, 1 << 0),  VC4_PLANE(34, kCursor_DrmPlaneType, 1 << 0),
+    VC4_PLANE(42, kPrimary_DrmPlaneType, 1 << 1),  VC4_PLANE(44, kCursor_DrmPlaneType, 1 << 1),
+    VC4_PLANE(52, kPrimary_DrmPlaneType, 1 << 2),  VC4_PLANE(54, kCursor_DrmPlaneType, 1 << 2),
+    VC4_PLANE(62, kPrimary_DrmPlaneType, 1 << 3),  VC4_PLANE(64, kCursor_DrmPlaneType, 1 << 3),
+    VC4_PLANE(72, kPrimary_DrmPlaneType, 1 << 4),  VC4_PLANE(74, kCursor_DrmPlaneType, 1 << 4),
+    VC4_PLANE(80, kOverlay_DrmPlaneType, 0x1F),    VC4_PLANE(86, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(92, kOverlay_DrmPlaneType, 0x1F),    VC4_PLANE(98, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(104, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(110, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(116, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(122, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(128, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(134, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(140, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(146, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(152, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(158, kOverlay_DrmPlaneType, 0x1F),
+    VC4_PLANE(164, kOverlay_DrmPlaneType, 0x1F),   VC4_PLANE(170, kOverlay_DrmPlaneType, 0x1F),
+};
+
+// Intel Skylake GT2, i915: a primary, two sprite and a cursor plane per pipe, with immutable zpos.
+static const uint32_t i915_formats[] = {
+    DRM_FORMAT_C8,          DRM_FORMAT_RGB565,      DRM_FORMAT_XRGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_ABGR8888,
+    DRM_FORMAT_XRGB2101010, DRM_FORMAT_XBGR2101010, DRM_FORMAT_YUYV,     DRM_FORMAT_UYVY,     DRM_FORMAT_NV12,
+};
+
+static const struct recorded_modifier i915_modifiers[] = {
+    { DRM_FORMAT_MOD_LINEAR, ALL_FORMATS },        { I915_FORMAT_MOD_X_TILED, 0x3FF },      { I915_FORMAT_MOD_Y_TILED, 0x7FF },
+    { I915_FORMAT_MOD_Yf_TILED, 0x3FF },           { I915_FORMAT_MOD_Y_TILED_CCS, 0x3C },   { I915_FORMAT_MOD_Yf_TILED_CCS, 0x3C },
+};
+
+static const uint32_t i915_cursor_formats[] = { DRM_FORMAT_ARGB8888 };
+
+static const struct recorded_modifier i915_cursor_modifiers[] = {
+    { DRM_FORMAT_MOD_LINEAR, ALL_FORMATS },
+};
+
+#define I915_PLANE(_id, _type, _pipe, _zpos)                                                                                         \
+    {                                                                                                                                \
+        .id = (_id), .type = (_type), .possible_crtcs = 1 << (_pipe), .has_zpos = true, .has_hardcoded_zpos = true, .min_zpos = (_zpos), \
+        .max_zpos = (_zpos), .supported_rotations = I915_ROTATIONS, .formats = i915_formats, .n_formats = ARRAY_SIZE(i915_formats),   \
+        .modifiers = i915_modifiers, .n_modifiers = ARRAY_SIZE(i915_modifiers),                                                     \
+    }
+
+#define I915_CURSOR_PLANE(_id, _pipe)                                                                                                  \
+    {                                                                                                                                  \
+        .id = (_id), .type = kCursor_DrmPlaneType, .possible_crtcs = 1 << (_pipe), .has_zpos = true, .has_hardcoded_zpos = true,       \
+        .min_zpos = 3, .max_zpos = 3, .supported_rotations = I915_CURSOR_ROTATIONS, .formats = i915_cursor_formats,                    \
+        .n_formats = ARRAY_SIZE(i915_cursor_formats), .modifiers = i915_cursor_modifiers, .n_modifiers = ARRAY_SIZE(i915_cursor_modifiers), \
+    }
+
+static const struct recorded_plane i915_planes[] = {
+    I915_PLANE(31, kPrimary_DrmPlaneType, 0, 0),  I915_PLANE(39, kOverlay_DrmPlaneType, 0, 1),
+    I915_PLANE(47, kOverlay_DrmPlaneType, 0, 2),  I915_CURSOR_PLANE(55, 0),
+    I915_PLANE(62, kPrimary_DrmPlaneType, 1, 0),  I915_PLANE(70, kOverlay_DrmPlaneType, 1, 1),
+    I915_PLANE(78, kOverlay_DrmPlaneType, 1, 2),  I915_CURSOR_PLANE(86, 1),
+    I915_PLANE(93, kPrimary_DrmPlaneType, 2, 0),  I915_PLANE(101, kOverlay_DrmPlaneType, 2, 1),
+    I915_PLANE(109, kOverlay_DrmPlaneType, 2, 2), I915_CURSOR_PLANE(117, 2),
+};
+
+// Rockchip RK3399, rockchip-drm: VOP big (4 windows) and VOP little (2 windows), AFBC only on the primary windows.
+static const uint32_t rockchip_yuv_formats[] = {
+    DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888, DRM_FORMAT_RGB888, DRM_FORMAT_BGR888,
+    DRM_FORMAT_RGB565,   DRM_FORMAT_BGR565,   DRM_FORMAT_NV12,     DRM_FORMAT_NV16,     DRM_FORMAT_NV24,
+};
+
+static const uint32_t rockchip_rgb_formats[] = {
+    DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888,
+    DRM_FORMAT_RGB888,   DRM_FORMAT_BGR888,   DRM_FORMAT_RGB565,   DRM_FORMAT_BGR565,
+};
+
+static const struct recorded_modifier rockchip_afbc_modifiers[] = {
+    { DRM_FORMAT_MOD_LINEAR, ALL_FORMATS },
+    { DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE | AFBC_FORMAT_MOD_YTR), 0x4F },
+};
+
+static const struct recorded_modifier rockchip_linear_modifiers[] = {
+    { DRM_FORMAT_MOD_LINEAR, ALL_FORMATS },
+};
+
+#define ROCKCHIP_PLANE(_id, _type, _crtc, _zpos, _rotations, _formats, _modifiers)                                                     \
+    {                                                                                                                                  \
+        .id = (_id), .type = (_type), .possible_crtcs = 1 << (_crtc), .has_zpos = true, .has_hardcoded_zpos = true, .min_zpos = (_zpos), \
+        .max_zpos = (_zpos), .supported_rotations = (_rotations), .formats = (_formats), .n_formats = ARRAY_SIZE(_formats),              \
+        .modifiers = (_modifiers), .n_modifiers = ARRAY_SIZE(_modifiers),                                                               \
+    }
+
+static const struct recorded_plane rockchip_planes[] = {
+    ROCKCHIP_PLANE(31, kPrimary_DrmPlaneType, 0, 0, ROCKCHIP_ROTATIONS, rockchip_yuv_formats, rockchip_afbc_modifiers),
+    ROCKCHIP_PLANE(37, kOverlay_DrmPlaneType, 0, 1, ROCKCHIP_ROTATIONS, rockchip_yuv_formats, rockchip_linear_modifiers),
+    ROCKCHIP_PLANE(43, kOverlay_DrmPlaneType, 0, 2, 0, rockchip_rgb_formats, rockchip_linear_modifiers),
+    ROCKCHIP_PLANE(49, kCursor_DrmPlaneType, 0, 3, 0, rockchip_rgb_formats, rockchip_linear_modifiers),
+    ROCKCHIP_PLANE(58, kPrimary_DrmPlaneType, 1, 0, ROCKCHIP_ROTATIONS, rockchip_yuv_formats, rockchip_afbc_modifiers),
+    ROCKCHIP_PLANE(64, kCursor_DrmPlaneType, 1, 1, 0, rockchip_rgb_formats, rockchip_linear_modifiers),
+};
+
+static const struct recorded_device devices[] = {
+    { "vc4", 5, vc4_planes, ARRAY_SIZE(vc4_planes), DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED },
+    { "i915", 3, i915_planes, ARRAY_SIZE(i915_planes), I915_FORMAT_MOD_Y_TILED_CCS },
+    { "rockchip", 2, rockchip_planes, ARRAY_SIZE(rockchip_planes), DRM_FORMAT_MOD_LINEAR },
+};
+
+struct plane_query {
+    bool allow_primary, allow_overlay, allow_cursor;
+    enum pixfmt format;
+    bool has_modifier;
+    uint64_t modifier;
+    bool has_zpos;
+    int64_t zpos_lower_limit, zpos_upper_limit;
+    bool has_rotation;
+    drm_plane_transform_t rotation;
+    bool has_id_range;
+    uint32_t id_lower_limit;
+};
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static struct drm_format_modifier_blob *build_in_formats_blob(const struct recorded_plane *recorded) {
+    struct drm_format_modifier_blob *blob;
+    struct drm_format_modifier *modifiers;
+    uint32_t *formats;
+    size_t formats_offset, modifiers_offset;
+
+    formats_offset = sizeof *blob;
+    modifiers_offset = formats_offset + ((recorded->n_formats * sizeof *formats + 7) & ~7ull);
+
+    blob = calloc(1, modifiers_offset + recorded->n_modifiers * sizeof *modifiers);
+    TEST_ASSERT_NOT_NULL(blob);
+
+    blob->version = FORMAT_BLOB_CURRENT;
+    blob->count_formats = recorded->n_formats;
+    blob->formats_offset = formats_offset;
+    blob->count_modifiers = recorded->n_modifiers;
+    blob->modifiers_offset = modifiers_offset;
+
+    formats = (uint32_t *) ((char *) blob + formats_offset);
+    memcpy(formats, recorded->formats, recorded->n_formats * sizeof *formats);
+
+    modifiers = (struct drm_format_modifier *) ((char *) blob + modifiers_offset);
+    for (size_t i = 0; i < recorded->n_modifiers; i++) {
+        modifiers[i].modifier = recorded->modifiers[i].modifier;
+        modifiers[i].offset = 0;
+        modifiers[i].formats = recorded->modifiers[i].formats &
+                               (recorded->n_formats >= 64 ? UINT64_MAX : (1ull << recorded->n_formats) - 1);
+    }
+
+    return blob;
+}
+
+static struct drm_plane *build_planes(const struct recorded_device *device) {
+    struct drm_plane *planes;
+
+    planes = calloc(device->n_planes, sizeof *planes);
+    TEST_ASSERT_NOT_NULL(planes);
+
+    for (size_t i = 0; i < device->n_planes; i++) {
+        const struct recorded_plane *recorded = device->planes + i;
+        struct drm_plane *plane = planes + i;
+
+        plane->id = recorded->id;
+        plane->type = recorded->type;
+        plane->possible_crtcs = recorded->possible_crtcs;
+        plane->has_zpos = recorded->has_zpos;
+        plane->min_zpos = recorded->min_zpos;
+        plane->max_zpos = recorded->max_zpos;
+        plane->has_hardcoded_zpos = recorded->has_hardcoded_zpos;
+        plane->hardcoded_zpos = recorded->min_zpos;
+        plane->has_rotation = recorded->supported_rotations != 0;
+        plane->supported_rotations.u64 = recorded->supported_rotations;
+        plane->has_hardcoded_rotation = false;
+
+        for (size_t j = 0; j < recorded->n_formats; j++) {
+            if (has_pixfmt_for_drm_format(recorded->formats[j])) {
+                plane->supported_formats[get_pixfmt_for_drm_format(recorded->formats[j])] = true;
+            }
+        }
+
+        if (recorded->n_modifiers > 0) {
+            plane->supports_modifiers = true;
+            plane->supported_modified_formats_blob = build_in_formats_blob(recorded);
+        }
+    }
+
+    return planes;
+}
+
+static void free_planes(struct drm_plane *planes, size_t n_planes) {
+    for (size_t i = 0; i < n_planes; i++) {
+        free(planes[i].supported_modified_formats_blob);
+    }
+    free(planes);
+}
+
+/// The plane allocation modesetting.c did before the plane index, for comparison.
+static bool linear_plane_qualifies(struct drm_plane *plane, const struct plane_query *query) {
+    if (plane->type == kPrimary_DrmPlaneType && !query->allow_primary) {
+        return false;
+    } else if (plane->type == kOverlay_DrmPlaneType && !query->allow_overlay) {
+        return false;
+    } else if (plane->type == kCursor_DrmPlaneType && !query->allow_cursor) {
+        return false;
+    }
+
+    if (query->has_modifier) {
+        if (!drm_plane_supports_modified_format(plane, query->format, query->modifier)) {
+            return false;
+        }
+    } else if (!drm_plane_supports_unmodified_format(plane, query->format)) {
+        return false;
+    }
+
+    if (query->has_zpos) {
+        if (!plane->has_zpos) {
+            return false;
+        } else if (query->zpos_lower_limit > plane->max_zpos || query->zpos_upper_limit < plane->min_zpos) {
+            return false;
+        }
+    }
+
+    if (query->has_id_range && plane->id < query->id_lower_limit) {
+        return false;
+    }
+
+    if (query->has_rotation) {
+        if (!plane->has_rotation) {
+            if (query->rotation.u32 != PLANE_TRANSFORM_ROTATE_0.u32) {
+                return false;
+            }
+        } else if (plane->has_hardcoded_rotation && plane->hardcoded_rotation.u32 != query->rotation.u32) {
+            return false;
+        } else if (query->rotation.u32 & ~plane->supported_rotations.u32) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int find_plane_linear(struct drm_plane *planes, size_t n_planes, const BITSET_WORD *available, const struct plane_query *query) {
+    for (size_t i = 0; i < n_planes; i++) {
+        if (BITSET_TEST(available, i) && linear_plane_qualifies(planes + i, query)) {
+            return (int) i;
+        }
+    }
+
+    return -1;
+}
+
+static int find_plane_indexed(const struct drm_plane_index *index, const BITSET_WORD *available, const struct plane_query *query) {
+    return drm_plane_index_find(
+        index,
+        available,
+        query->allow_primary,
+        query->allow_overlay,
+        query->allow_cursor,
+        query->format,
+        query->has_modifier,
+        query->modifier,
+        query->has_zpos,
+        query->zpos_lower_limit,
+        query->zpos_upper_limit,
+        query->has_rotation,
+        query->rotation,
+        query->has_id_range,
+        query->id_lower_limit
+    );
+}
+
+static uint32_t next_random(uint32_t *state) {
+    // xorshift32, so the queries are the same on every run.
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void random_query(const struct recorded_device *device, uint32_t *rng, struct plane_query *query) {
+    static const uint32_t rotations[] = {
+        DRM_MODE_ROTATE_0,
+        DRM_MODE_ROTATE_90,
+        DRM_MODE_ROTATE_180,
+        DRM_MODE_ROTATE_270,
+        DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X,
+        DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y,
+        DRM_MODE_ROTATE_90 | DRM_MODE_REFLECT_X,
+        1 << 6,
+    };
+    const struct recorded_plane *plane;
+    uint32_t allowed_types;
+
+    do {
+        allowed_types = next_random(rng) & 7;
+    } while (allowed_types == 0);
+
+    query->allow_primary = allowed_types & 1;
+    query->allow_overlay = allowed_types & 2;
+    query->allow_cursor = allowed_types & 4;
+    query->format = next_random(rng) % PIXFMT_COUNT;
+
+    // Mostly ask for modifiers that some plane of the device actually has.
+    plane = device->planes + next_random(rng) % device->n_planes;
+    query->has_modifier = next_random(rng) % 4 != 0;
+    if (next_random(rng) % 8 == 0 || plane->n_modifiers == 0) {
+        query->modifier = UNKNOWN_MODIFIER;
+    } else {
+        query->modifier = plane->modifiers[next_random(rng) % plane->n_modifiers].modifier;
+    }
+
+    query->has_zpos = next_random(rng) % 2;
+    query->zpos_lower_limit = (int64_t) (next_random(rng) % 5);
+    query->zpos_upper_limit = next_random(rng) % 4 == 0 ? query->zpos_lower_limit : INT64_MAX;
+
+    query->has_rotation = next_random(rng) % 2;
+    query->rotation = PLANE_TRANSFORM_NONE;
+    query->rotation.u32 = rotations[next_random(rng) % ARRAY_SIZE(rotations)];
+
+    query->has_id_range = next_random(rng) % 3 == 0;
+    query->id_lower_limit = plane->id + 1;
+}
+
+void test_index_finds_the_same_planes_as_linear_search() {
+    for (size_t d = 0; d < ARRAY_SIZE(devices); d++) {
+        const struct recorded_device *device = devices + d;
+        struct drm_plane_index index;
+        struct drm_plane *planes;
+        BITSET_DECLARE(available, DRM_PLANE_INDEX_MAX_PLANES);
+        uint32_t rng = 0x12345678;
+        int ok;
+
+        planes = build_planes(device);
+
+        ok = drm_plane_index_init(&index, planes, device->n_planes);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+
+        for (int i = 0; i < N_RANDOM_QUERIES; i++) {
+            struct plane_query query;
+
+            // Either all planes of a CRTC, or some of them, as if others were allocated already.
+            BITSET_COPY(available, index.crtc_planes[next_random(&rng) % device->n_crtcs]);
+            if (next_random(&rng) % 2) {
+                for (size_t word = 0; word < ARRAY_SIZE(available); word++) {
+                    available[word] &= next_random(&rng);
+                }
+            }
+
+            random_query(device, &rng, &query);
+
+            int expected = find_plane_linear(planes, device->n_planes, available, &query);
+            int actual = find_plane_indexed(&index, available, &query);
+            if (expected != actual) {
+                char message[128];
+                snprintf(message, sizeof message, "%s, query %d", device->name, i);
+                TEST_ASSERT_EQUAL_INT_MESSAGE(expected, actual, message);
+            }
+        }
+
+        drm_plane_index_fini(&index);
+        free_planes(planes, device->n_planes);
+    }
+}
+
+void test_crtc_planes_and_min_zpos() {
+    const struct recorded_device *device = devices + 1;
+    struct drm_plane_index index;
+    struct drm_plane *planes;
+    int ok;
+
+    planes = build_planes(device);
+
+    ok = drm_plane_index_init(&index, planes, device->n_planes);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    // Every i915 pipe has its own 4 planes.
+    for (size_t crtc = 0; crtc < device->n_crtcs; crtc++) {
+        for (size_t i = 0; i < device->n_planes; i++) {
+            TEST_ASSERT_EQUAL(i / 4 == crtc, BITSET_TEST(index.crtc_planes[crtc], i));
+        }
+        TEST_ASSERT_EQUAL_INT64(0, index.crtc_min_zpos[crtc]);
+    }
+
+    TEST_ASSERT_EQUAL_INT64(INT64_MAX, index.crtc_min_zpos[device->n_crtcs]);
+
+    drm_plane_index_fini(&index);
+    free_planes(planes, device->n_planes);
+}
+
+void test_too_many_planes_is_rejected() {
+    struct drm_plane_index index;
+    struct drm_plane *planes;
+
+    planes = calloc(DRM_PLANE_INDEX_MAX_PLANES + 1, sizeof *planes);
+    TEST_ASSERT_NOT_NULL(planes);
+
+    TEST_ASSERT_EQUAL_INT(EINVAL, drm_plane_index_init(&index, planes, DRM_PLANE_INDEX_MAX_PLANES + 1));
+
+    free(planes);
+}
+
+void test_unused_planes_beyond_32() {
+    struct recorded_plane recorded[40];
+    struct recorded_device device = { "many planes", 2, recorded, ARRAY_SIZE(recorded), DRM_FORMAT_MOD_LINEAR };
+    struct drm_plane_index index;
+    struct drm_plane *planes;
+    int unused[DRM_PLANE_INDEX_MAX_PLANES];
+    int n_unused, ok;
+
+    // 40 planes on CRTC 0, except for plane 35 which is on CRTC 1 only.
+    for (size_t i = 0; i < ARRAY_SIZE(recorded); i++) {
+        recorded[i] = (struct recorded_plane){
+            .id = 100 + i,
+            .type = i == 0 ? kPrimary_DrmPlaneType : kOverlay_DrmPlaneType,
+            .possible_crtcs = i == 35 ? 1 << 1 : 1 << 0,
+            .formats = vc4_formats,
+            .n_formats = ARRAY_SIZE(vc4_formats),
+            .modifiers = rockchip_linear_modifiers,
+            .n_modifiers = ARRAY_SIZE(rockchip_linear_modifiers),
+        };
+    }
+
+    planes = build_planes(&device);
+
+    ok = drm_plane_index_init(&index, planes, device.n_planes);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    n_unused = drm_plane_index_get_unused_planes(&index, 0, (const int[]){ 0, 5, 33, 39 }, 4, unused);
+
+    // all planes of CRTC 0 except the used ones, including the ones with index 32 or higher.
+    TEST_ASSERT_EQUAL_INT(35, n_unused);
+    for (int i = 0, plane = 0; plane < (int) ARRAY_SIZE(recorded); plane++) {
+        if (plane == 0 || plane == 5 || plane == 33 || plane == 35 || plane == 39) {
+            continue;
+        }
+        TEST_ASSERT_EQUAL_INT(plane, unused[i++]);
+    }
+
+    n_unused = drm_plane_index_get_unused_planes(&index, 1, NULL, 0, unused);
+    TEST_ASSERT_EQUAL_INT(1, n_unused);
+    TEST_ASSERT_EQUAL_INT(35, unused[0]);
+
+    drm_plane_index_fini(&index);
+    free_planes(planes, device.n_planes);
+}
+
+/// Allocates the planes for one frame on one CRTC, the way kms_req_builder_push_fb_layer does:
+/// the app on the primary plane, two platform views on overlay planes above it, and the cursor.
+static int allocate_frame(
+    const struct recorded_device *device,
+    struct drm_plane *planes,
+    const struct drm_plane_index *index,
+    int crtc,
+    bool use_index
+) {
+    BITSET_DECLARE(available, DRM_PLANE_INDEX_MAX_PLANES);
+    struct plane_query query;
+    uint32_t last_plane_id;
+    int n_allocated, plane;
+
+    BITSET_COPY(available, index->crtc_planes[crtc]);
+
+    query = (struct plane_query){
+        .allow_primary = true,
+        .format = PIXFMT_XRGB8888,
+        .has_modifier = true,
+        .modifier = device->scanout_modifier,
+        .has_rotation = true,
+        .rotation = PLANE_TRANSFORM_ROTATE_0,
+    };
+
+    n_allocated = 0;
+    last_plane_id = 0;
+    for (int layer = 0; layer < 4; layer++) {
+        if (layer == 1) {
+            query.allow_primary = false;
+            query.allow_overlay = true;
+            query.format = PIXFMT_ARGB8888;
+            query.modifier = DRM_FORMAT_MOD_LINEAR;
+        } else if (layer == 3) {
+            query.allow_overlay = false;
+            query.allow_cursor = true;
+        }
+
+        query.has_zpos = layer == 1 || layer == 2;
+        query.zpos_lower_limit = layer;
+        query.zpos_upper_limit = INT64_MAX;
+        query.has_id_range = false;
+
+        plane = use_index ? find_plane_indexed(index, available, &query) : find_plane_linear(planes, device->n_planes, available, &query);
+        if (plane < 0 && (layer == 1 || layer == 2)) {
+            // No overlay plane with a high enough zpos, try one with a higher id.
+            query.has_zpos = false;
+            query.has_id_range = true;
+            query.id_lower_limit = last_plane_id + 1;
+
+            plane = use_index ? find_plane_indexed(index, available, &query) :
+                                find_plane_linear(planes, device->n_planes, available, &query);
+        }
+
+        if (plane >= 0) {
+            BITSET_CLEAR(available, plane);
+            last_plane_id = planes[plane].id;
+            n_allocated++;
+        }
+    }
+
+    return n_allocated;
+}
+
+void test_plane_allocation_benchmark() {
+    for (size_t d = 0; d < ARRAY_SIZE(devices); d++) {
+        const struct recorded_device *device = devices + d;
+        struct drm_plane_index index;
+        struct drm_plane *planes;
+        uint64_t start, linear_ns, indexed_ns;
+        int n_linear, n_indexed, ok;
+
+        planes = build_planes(device);
+
+        start = get_monotonic_time();
+        ok = drm_plane_index_init(&index, planes, device->n_planes);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+        printf("%s: building the index for %zu planes took %.1f us\n", device->name, device->n_planes, (get_monotonic_time() - start) / 1000.0);
+
+        n_linear = 0;
+        start = get_monotonic_time();
+        for (int i = 0; i < N_BENCHMARK_FRAMES; i++) {
+            n_linear += allocate_frame(device, planes, &index, i % device->n_crtcs, false);
+        }
+        linear_ns = get_monotonic_time() - start;
+
+        n_indexed = 0;
+        start = get_monotonic_time();
+        for (int i = 0; i < N_BENCHMARK_FRAMES; i++) {
+            n_indexed += allocate_frame(device, planes, &index, i % device->n_crtcs, true);
+        }
+        indexed_ns = get_monotonic_time() - start;
+
+        // Both need to allocate the same planes, otherwise comparing the times doesn't make sense.
+        TEST_ASSERT_EQUAL_INT(n_linear, n_indexed);
+
+        printf(
+            "%s: allocating the planes for a frame takes %.1f ns with linear search, %.1f ns with the index (%.1fx)\n",
+            device->name,
+            (double) linear_ns / N_BENCHMARK_FRAMES,
+            (double) indexed_ns / N_BENCHMARK_FRAMES,
+            (double) linear_ns / (indexed_ns ? indexed_ns : 1)
+        );
+
+        drm_plane_index_fini(&index);
+        free_planes(planes, device->n_planes);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_index_finds_the_same_planes_as_linear_search);
+    RUN_TEST(test_crtc_planes_and_min_zpos);
+    RUN_TEST(test_too_many_planes_is_rejected);
+    RUN_TEST(test_unused_planes_beyond_32);
+    RUN_TEST(test_plane_allocation_benchmark);
+
+    return UNITY_END();
+}
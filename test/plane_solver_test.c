@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "plane_solver.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modesetting.h"
+#include "pixel_format.h"
+#include "plane_index.h"
+#include "util/collection.h"
+
+#include <unity.h>
+
+/*
+ * A CRTC modelled on vc4: a primary & cursor plane and 4 overlay planes with mutable zpos.
+ */
+struct mock_plane {
+    uint32_t id;
+    enum drm_plane_type type;
+};
+
+static const struct mock_plane mock_planes[] = {
+    { 32, kPrimary_DrmPlaneType }, { 34, kCursor_DrmPlaneType },  { 80, kOverlay_DrmPlaneType },
+    { 86, kOverlay_DrmPlaneType }, { 92, kOverlay_DrmPlaneType }, { 98, kOverlay_DrmPlaneType },
+};
+
+#define PLANE_PRIMARY 0
+#define PLANE_CURSOR 1
+#define PLANE_OVERLAY_80 2
+#define PLANE_OVERLAY_86 3
+#define PLANE_OVERLAY_92 4
+#define PLANE_OVERLAY_98 5
+
+/**
+ * @brief The accept/reject rules of the mock driver, replayed for every TEST_ONLY commit.
+ */
+struct mock_driver {
+    const struct plane_solver_layer *layers;
+
+    /// Planes that can't scale their layer.
+    uint64_t planes_without_scaler;
+
+    /// Planes that share a single scaler, i.e. at most one of them can scale its layer.
+    uint64_t planes_sharing_scaler;
+
+    /// Reject everything.
+    bool reject_all;
+
+    /// Error returned by every test, instead of accepting or rejecting.
+    int fail_with;
+
+    int n_tests;
+};
+
+static struct drm_plane planes[ARRAY_SIZE(mock_planes)];
+static struct drm_plane_index plane_index;
+static struct plane_solver *solver;
+
+// required by Unity.
+void setUp() {
+    memset(planes, 0, sizeof planes);
+
+    for (size_t i = 0; i < ARRAY_SIZE(mock_planes); i++) {
+        planes[i].id = mock_planes[i].id;
+        planes[i].type = mock_planes[i].type;
+        planes[i].possible_crtcs = 1 << 0;
+        planes[i].has_zpos = true;
+        planes[i].min_zpos = 0;
+        planes[i].max_zpos = 31;
+        planes[i].supported_formats[PIXFMT_XRGB8888] = true;
+        planes[i].supported_formats[PIXFMT_ARGB8888] = true;
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, drm_plane_index_init(&plane_index, planes, ARRAY_SIZE(planes)));
+
+    solver = plane_solver_new(planes, &plane_index);
+    TEST_ASSERT_NOT_NULL(solver);
+}
+
+void tearDown() {
+    plane_solver_destroy(solver);
+    drm_plane_index_fini(&plane_index);
+}
+
+static bool is_scaled(const struct plane_solver_layer *layer) {
+    return layer->src_w != layer->dst_w << 16 || layer->src_h != layer->dst_h << 16;
+}
+
+static int mock_test(const struct plane_assignment *assignment, void *userdata) {
+    struct mock_driver *driver = userdata;
+    int n_shared_scaler_users = 0;
+
+    driver->n_tests++;
+
+    if (driver->fail_with != 0) {
+        return driver->fail_with;
+    } else if (driver->reject_all) {
+        return EINVAL;
+    }
+
+    for (int i = 0; i < assignment->n_layers; i++) {
+        int plane = assignment->plane_indices[i];
+
+        if (!is_scaled(driver->layers + i)) {
+            continue;
+        }
+
+        if (driver->planes_without_scaler & (1ull << plane)) {
+            return ERANGE;
+        }
+
+        if (driver->planes_sharing_scaler & (1ull << plane)) {
+            n_shared_scaler_users++;
+        }
+    }
+
+    if (n_shared_scaler_users > 1) {
+        return ENOSPC;
+    }
+
+    return 0;
+}
+
+static struct plane_solver_layer make_layer(int32_t src_w, int32_t dst_w) {
+    return (struct plane_solver_layer){
+        .format = PIXFMT_ARGB8888,
+        .has_modifier = false,
+        .src_w = src_w << 16,
+        .src_h = 1080 << 16,
+        .dst_w = dst_w,
+        .dst_h = 1080,
+        .has_rotation = false,
+        .prefer_cursor = false,
+        .n_zpos_placeholders = 0,
+    };
+}
+
+/// The assignment the greedy plane allocation in modesetting.c comes up with for up to 4 layers.
+static struct plane_assignment greedy_assignment(int n_layers) {
+    static const int greedy_planes[] = { PLANE_PRIMARY, PLANE_OVERLAY_80, PLANE_OVERLAY_86, PLANE_OVERLAY_92 };
+    struct plane_assignment assignment;
+
+    memset(&assignment, 0, sizeof assignment);
+    assignment.n_layers = n_layers;
+    for (int i = 0; i < n_layers; i++) {
+        assignment.plane_indices[i] = greedy_planes[i];
+        assignment.has_zpos[i] = true;
+        assignment.zpos[i] = i;
+    }
+
+    return assignment;
+}
+
+static int solve(struct mock_driver *driver, const struct plane_solver_layer *layers, int n_layers, struct plane_assignment *assignment_out) {
+    struct plane_assignment initial = greedy_assignment(n_layers);
+
+    driver->layers = layers;
+    return plane_solver_solve(solver, 0, 0, layers, n_layers, &initial, mock_test, driver, assignment_out);
+}
+
+void test_accepted_assignment_is_cached() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 640) };
+    struct plane_assignment assignment;
+    struct plane_solver_stats stats;
+    struct mock_driver driver = { 0 };
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(1, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(PLANE_PRIMARY, assignment.plane_indices[0]);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_80, assignment.plane_indices[1]);
+
+    // Steady state: the same layer shape doesn't need any TEST_ONLY commits.
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    }
+    TEST_ASSERT_EQUAL_INT(1, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_80, assignment.plane_indices[1]);
+
+    plane_solver_get_stats(solver, &stats);
+    TEST_ASSERT_EQUAL_UINT64(101, stats.n_solves);
+    TEST_ASSERT_EQUAL_UINT64(100, stats.n_cache_hits);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_tests);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.n_rejected_tests);
+}
+
+void test_backtracks_to_plane_with_scaler() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280) };
+    struct plane_assignment assignment;
+    struct mock_driver driver = { .planes_without_scaler = 1ull << PLANE_OVERLAY_80 };
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(PLANE_PRIMARY, assignment.plane_indices[0]);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_86, assignment.plane_indices[1]);
+    TEST_ASSERT_TRUE(assignment.zpos[1] > assignment.zpos[0]);
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_86, assignment.plane_indices[1]);
+}
+
+void test_backtracks_across_layers() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280), make_layer(320, 640) };
+    struct plane_assignment assignment;
+    struct mock_driver driver = {
+        .planes_without_scaler = 1ull << PLANE_OVERLAY_80,
+        .planes_sharing_scaler = (1ull << PLANE_OVERLAY_86) | (1ull << PLANE_OVERLAY_92),
+    };
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_TRUE(driver.n_tests <= PLANE_SOLVER_MAX_TESTS + 1);
+    TEST_ASSERT_EQUAL_INT(0, mock_test(&assignment, &driver));
+
+    TEST_ASSERT_EQUAL_INT(3, assignment.n_layers);
+    TEST_ASSERT_EQUAL_INT(PLANE_PRIMARY, assignment.plane_indices[0]);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_86, assignment.plane_indices[1]);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_98, assignment.plane_indices[2]);
+    TEST_ASSERT_TRUE(assignment.zpos[1] > assignment.zpos[0]);
+    TEST_ASSERT_TRUE(assignment.zpos[2] > assignment.zpos[1]);
+}
+
+void test_zpos_placeholders_are_skipped() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280) };
+    struct plane_assignment assignment;
+    struct mock_driver driver = { .planes_without_scaler = 1ull << PLANE_OVERLAY_80 };
+
+    layers[1].n_zpos_placeholders = 2;
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_86, assignment.plane_indices[1]);
+    TEST_ASSERT_EQUAL_INT64(0, assignment.zpos[0]);
+    TEST_ASSERT_EQUAL_INT64(3, assignment.zpos[1]);
+}
+
+void test_unsolvable_shape_is_cached() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280) };
+    struct plane_assignment assignment, initial = greedy_assignment(2);
+    struct plane_solver_stats stats;
+    struct mock_driver driver = { .reject_all = true };
+    int n_tests;
+
+    TEST_ASSERT_EQUAL_INT(EINVAL, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_MEMORY(&initial, &assignment, sizeof assignment);
+    TEST_ASSERT_TRUE(driver.n_tests > 1);
+    TEST_ASSERT_TRUE(driver.n_tests <= PLANE_SOLVER_MAX_TESTS + 1);
+
+    n_tests = driver.n_tests;
+    TEST_ASSERT_EQUAL_INT(EINVAL, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(n_tests, driver.n_tests);
+    TEST_ASSERT_EQUAL_MEMORY(&initial, &assignment, sizeof assignment);
+
+    plane_solver_get_stats(solver, &stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.n_unsolvable);
+    TEST_ASSERT_EQUAL_UINT64(stats.n_tests, stats.n_rejected_tests);
+}
+
+void test_test_errors_abort_and_are_not_cached() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920) };
+    struct plane_assignment assignment;
+    struct mock_driver driver = { .fail_with = EACCES };
+
+    TEST_ASSERT_EQUAL_INT(EACCES, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(1, driver.n_tests);
+
+    driver.fail_with = 0;
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+}
+
+void test_forget_and_clear() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 640) };
+    struct plane_solver_layer other_layers[] = { make_layer(1920, 1920) };
+    struct plane_assignment assignment;
+    struct mock_driver driver = { 0 };
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, other_layers, ARRAY_SIZE(other_layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+
+    // Forgetting one shape keeps the others.
+    plane_solver_forget(solver, 0, layers, ARRAY_SIZE(layers));
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, other_layers, ARRAY_SIZE(other_layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(3, driver.n_tests);
+
+    plane_solver_clear(solver);
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, other_layers, ARRAY_SIZE(other_layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(5, driver.n_tests);
+}
+
+void test_resized_layers_hit_the_cache() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280) };
+    struct plane_assignment assignment;
+    struct plane_solver_stats stats;
+    struct mock_driver driver = { .planes_without_scaler = 1ull << PLANE_OVERLAY_80 };
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+
+    // An animated layer changes its size every frame, but stays on the same planes.
+    for (int i = 0; i < 100; i++) {
+        layers[1].src_w = (320 + i) << 16;
+        layers[1].dst_w = 1280 - i;
+        TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+        TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_86, assignment.plane_indices[1]);
+    }
+    TEST_ASSERT_EQUAL_INT(2, driver.n_tests);
+
+    // Whether the layer is scaled at all is part of the topology though.
+    layers[1] = make_layer(640, 640);
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    TEST_ASSERT_EQUAL_INT(3, driver.n_tests);
+    TEST_ASSERT_EQUAL_INT(PLANE_OVERLAY_80, assignment.plane_indices[1]);
+
+    plane_solver_get_stats(solver, &stats);
+    TEST_ASSERT_EQUAL_UINT64(102, stats.n_solves);
+    TEST_ASSERT_EQUAL_UINT64(100, stats.n_cache_hits);
+}
+
+void test_unsolvable_topology_is_cached_across_sizes() {
+    struct plane_solver_layer layers[] = { make_layer(1920, 1920), make_layer(640, 1280) };
+    struct plane_assignment assignment, initial = greedy_assignment(2);
+    struct mock_driver driver = { .reject_all = true };
+    int n_tests;
+
+    TEST_ASSERT_EQUAL_INT(EINVAL, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+    n_tests = driver.n_tests;
+
+    for (int i = 0; i < 100; i++) {
+        layers[1].dst_w = 1280 + i;
+        TEST_ASSERT_EQUAL_INT(EINVAL, solve(&driver, layers, ARRAY_SIZE(layers), &assignment));
+        TEST_ASSERT_EQUAL_MEMORY(&initial, &assignment, sizeof assignment);
+    }
+    TEST_ASSERT_EQUAL_INT(n_tests, driver.n_tests);
+}
+
+void test_least_recently_used_shape_is_evicted() {
+    struct plane_solver_layer layers[PLANE_SOLVER_CACHE_SIZE + 1][2];
+    struct plane_assignment assignment;
+    struct mock_driver driver = { 0 };
+
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE + 1; i++) {
+        layers[i][0] = make_layer(1920, 1920);
+        layers[i][1] = make_layer(640, 640);
+        layers[i][1].n_zpos_placeholders = i;
+    }
+
+    for (int i = 0; i < PLANE_SOLVER_CACHE_SIZE; i++) {
+        TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers[i], 2, &assignment));
+    }
+    TEST_ASSERT_EQUAL_INT(PLANE_SOLVER_CACHE_SIZE, driver.n_tests);
+
+    // Use shape 0 again, so shape 1 is the least recently used one.
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers[0], 2, &assignment));
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers[PLANE_SOLVER_CACHE_SIZE], 2, &assignment));
+    TEST_ASSERT_EQUAL_INT(PLANE_SOLVER_CACHE_SIZE + 1, driver.n_tests);
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers[0], 2, &assignment));
+    TEST_ASSERT_EQUAL_INT(PLANE_SOLVER_CACHE_SIZE + 1, driver.n_tests);
+
+    TEST_ASSERT_EQUAL_INT(0, solve(&driver, layers[1], 2, &assignment));
+    TEST_ASSERT_EQUAL_INT(PLANE_SOLVER_CACHE_SIZE + 2, driver.n_tests);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_accepted_assignment_is_cached);
+    RUN_TEST(test_backtracks_to_plane_with_scaler);
+    RUN_TEST(test_backtracks_across_layers);
+    RUN_TEST(test_zpos_placeholders_are_skipped);
+    RUN_TEST(test_unsolvable_shape_is_cached);
+    RUN_TEST(test_test_errors_abort_and_are_not_cached);
+    RUN_TEST(test_forget_and_clear);
+    RUN_TEST(test_resized_layers_hit_the_cache);
+    RUN_TEST(test_unsolvable_topology_is_cached_across_sizes);
+    RUN_TEST(test_least_recently_used_shape_is_evicted);
+
+    return UNITY_END();
+}
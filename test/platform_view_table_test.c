@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include "platform_view_table.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "surface.h"
+#include "surface_private.h"
+#include "tracer.h"
+
+#include <unity.h>
+
+#define N_WRITERS 4
+#define N_VIEWS_PER_WRITER 4000
+
+static struct tracer *tracer;
+
+// required by Unity.
+void setUp() {
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+}
+
+void tearDown() {
+    tracer_unref(tracer);
+}
+
+static struct surface *new_surface(void) {
+    struct surface *s;
+
+    s = malloc(sizeof *s);
+    TEST_ASSERT_NOT_NULL(s);
+    TEST_ASSERT_EQUAL_INT(0, surface_init(s, tracer));
+    return s;
+}
+
+void test_add_lookup_remove() {
+    struct platform_view_table *table;
+    struct surface *a, *b, *s;
+    int64_t id_a, id_b;
+
+    table = platform_view_table_new();
+    TEST_ASSERT_NOT_NULL(table);
+
+    a = new_surface();
+    b = new_surface();
+
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_add(table, a, &id_a));
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_add(table, b, &id_b));
+    TEST_ASSERT_TRUE(id_a != 0);
+    TEST_ASSERT_TRUE(id_a != id_b);
+    TEST_ASSERT_EQUAL_INT(2, platform_view_table_get_n_views(table));
+
+    s = platform_view_table_lookup(table, id_a);
+    TEST_ASSERT_EQUAL_PTR(a, s);
+    surface_unref(s);
+
+    // replace the surface of view a.
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_set(table, id_a, b));
+    s = platform_view_table_lookup(table, id_a);
+    TEST_ASSERT_EQUAL_PTR(b, s);
+    surface_unref(s);
+
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_remove(table, id_a));
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, id_a));
+    TEST_ASSERT_EQUAL_INT(EINVAL, platform_view_table_remove(table, id_a));
+    TEST_ASSERT_EQUAL_INT(EINVAL, platform_view_table_set(table, id_a, a));
+    TEST_ASSERT_EQUAL_INT(1, platform_view_table_get_n_views(table));
+
+    surface_unref(a);
+    surface_unref(b);
+
+    // destroying the table drops the reference on the remaining view.
+    platform_view_table_destroy(table);
+}
+
+void test_stale_and_garbage_ids_are_rejected() {
+    struct platform_view_table *table;
+    struct surface *a, *b, *s;
+    int64_t id_a, id_b;
+
+    table = platform_view_table_new();
+    TEST_ASSERT_NOT_NULL(table);
+
+    a = new_surface();
+    b = new_surface();
+
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_add(table, a, &id_a));
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_remove(table, id_a));
+
+    // b reuses the slot of a, but with a different generation.
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_add(table, b, &id_b));
+    TEST_ASSERT_TRUE(id_a != id_b);
+    TEST_ASSERT_EQUAL_INT((uint32_t) id_a, (uint32_t) id_b);
+
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, id_a));
+    s = platform_view_table_lookup(table, id_b);
+    TEST_ASSERT_EQUAL_PTR(b, s);
+    surface_unref(s);
+
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, 0));
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, -1));
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, 12345));
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, (int64_t) (intptr_t) b));
+    TEST_ASSERT_NULL(platform_view_table_lookup(table, INT64_MAX));
+
+    surface_unref(a);
+    surface_unref(b);
+    platform_view_table_destroy(table);
+}
+
+/*
+ * Unity's assertions longjmp out of the test, so they must only be used on the main thread.
+ * The worker threads record what went wrong in their own results instead, and the main thread
+ * checks those after joining them.
+ */
+struct stress_state {
+    struct platform_view_table *table;
+    atomic_int_least64_t published_ids[N_WRITERS];
+    atomic_bool done;
+};
+
+struct writer_args {
+    struct stress_state *state;
+    int writer;
+
+    // results
+    int add_error, set_error, remove_error;
+    int n_stale_hits;
+};
+
+struct composition_args {
+    struct stress_state *state;
+
+    // results
+    int n_lookups;
+    int n_bad_revisions;
+};
+
+static void *writer_entry(void *userdata) {
+    struct writer_args *args = userdata;
+    struct stress_state *state = args->state;
+    struct surface *s, *replacement;
+    int64_t id;
+
+    for (int i = 0; i < N_VIEWS_PER_WRITER; i++) {
+        s = new_surface();
+
+        args->add_error = platform_view_table_add(state->table, s, &id);
+        surface_unref(s);
+        if (args->add_error != 0) {
+            break;
+        }
+
+        atomic_store(state->published_ids + args->writer, id);
+
+        if (i % 3 == 0) {
+            replacement = new_surface();
+            args->set_error = platform_view_table_set(state->table, id, replacement);
+            surface_unref(replacement);
+            if (args->set_error != 0) {
+                break;
+            }
+        }
+
+        args->remove_error = platform_view_table_remove(state->table, id);
+        if (args->remove_error != 0) {
+            break;
+        }
+
+        // The id must never resolve to another view, even though its slot is reused right away.
+        s = platform_view_table_lookup(state->table, id);
+        if (s != NULL) {
+            args->n_stale_hits++;
+            surface_unref(s);
+        }
+    }
+
+    return NULL;
+}
+
+static void *composition_entry(void *userdata) {
+    struct composition_args *args = userdata;
+    struct stress_state *state = args->state;
+    struct surface *s;
+
+    // Look up the views like the compositor does for every platform view layer of a frame.
+    while (!atomic_load(&state->done)) {
+        for (int i = 0; i < N_WRITERS; i++) {
+            s = platform_view_table_lookup(state->table, atomic_load(state->published_ids + i));
+            if (s != NULL) {
+                // The surface is kept alive by our reference, even if it's removed in the meantime.
+                if (surface_get_revision(s) != 1) {
+                    args->n_bad_revisions++;
+                }
+                surface_unref(s);
+            }
+
+            args->n_lookups++;
+        }
+    }
+
+    return NULL;
+}
+
+void test_concurrent_add_remove_with_composition() {
+    struct composition_args composition_args;
+    struct writer_args args[N_WRITERS];
+    struct stress_state state;
+    pthread_t writers[N_WRITERS], compositor_thread;
+
+    state.table = platform_view_table_new();
+    TEST_ASSERT_NOT_NULL(state.table);
+    atomic_init(&state.done, false);
+    for (int i = 0; i < N_WRITERS; i++) {
+        atomic_init(state.published_ids + i, 0);
+    }
+
+    composition_args = (struct composition_args){ .state = &state };
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&compositor_thread, NULL, composition_entry, &composition_args));
+
+    for (int i = 0; i < N_WRITERS; i++) {
+        args[i] = (struct writer_args){ .state = &state, .writer = i };
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(writers + i, NULL, writer_entry, args + i));
+    }
+
+    for (int i = 0; i < N_WRITERS; i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_join(writers[i], NULL));
+    }
+
+    atomic_store(&state.done, true);
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(compositor_thread, NULL));
+
+    for (int i = 0; i < N_WRITERS; i++) {
+        TEST_ASSERT_EQUAL_INT(0, args[i].add_error);
+        TEST_ASSERT_EQUAL_INT(0, args[i].set_error);
+        TEST_ASSERT_EQUAL_INT(0, args[i].remove_error);
+        TEST_ASSERT_EQUAL_INT(0, args[i].n_stale_hits);
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, composition_args.n_bad_revisions);
+    TEST_ASSERT_TRUE(composition_args.n_lookups > 0);
+    TEST_ASSERT_EQUAL_INT(0, platform_view_table_get_n_views(state.table));
+
+    platform_view_table_destroy(state.table);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_add_lookup_remove);
+    RUN_TEST(test_stale_and_garbage_ids_are_rejected);
+    RUN_TEST(test_concurrent_add_remove_with_composition);
+
+    return UNITY_END();
+}
@@ -1367,6 +1367,24 @@ void test_raw_std_method_call_get_method_dup() {
 void test_raw_std_method_call_get_arg() {
 }
 
+void test_json_string_segments_encoding() {
+    struct platch_obj object;
+    uint8_t *buffer;
+    size_t size;
+
+    object = (struct platch_obj){
+        .codec = kJSONMessageCodec,
+        .json_value = JSONARRAY2(JSONSTRING_SEGMENTS("say \"hi", 7, "\"\nbye", 5), JSONSTRING("\"")),
+    };
+
+    TEST_ASSERT_EQUAL_INT(0, platch_encode(&object, &buffer, &size));
+    TEST_ASSERT_EQUAL_STRING_LEN("[\"say \\\"hi\\\"\\nbye\",\"\\\"\"]", buffer, size);
+    free(buffer);
+
+    TEST_ASSERT_TRUE(jsvalue_equals(&JSONSTRING_SEGMENTS("hel", 3, "lo", 2), &JSONSTRING_SEGMENTS("h", 1, "ello", 4)));
+    TEST_ASSERT_FALSE(jsvalue_equals(&JSONSTRING_SEGMENTS("hel", 3, "lo", 2), &JSONSTRING_SEGMENTS("h", 1, "elp", 3)));
+}
+
 int main(void) {
     UNITY_BEGIN();
 
@@ -1415,6 +1433,7 @@ int main(void) {
     RUN_TEST(test_raw_std_method_call_get_method);
     RUN_TEST(test_raw_std_method_call_get_method_dup);
     RUN_TEST(test_raw_std_method_call_get_arg);
+    RUN_TEST(test_json_string_segments_encoding);
 
     return UNITY_END();
 }
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "pluginregistry.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_BENCHMARK_MESSAGES 200000
+
+static const size_t benchmark_channel_counts[] = { 1, 8, 64, 256, 1024 };
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void on_message(void *userdata, const FlutterPlatformMessage *message) {
+    (void) message;
+    (*(int *) userdata)++;
+}
+
+static FlutterPlatformMessage make_message(const char *channel) {
+    return (FlutterPlatformMessage){
+        .struct_size = sizeof(FlutterPlatformMessage),
+        .channel = channel,
+        .message = NULL,
+        .message_size = 0,
+        .response_handle = NULL,
+    };
+}
+
+static void get_channel_name(char *buf, size_t size, size_t index) {
+    snprintf(buf, size, "plugins.flutter.io/benchmark_channel_%zu", index);
+}
+
+void test_set_and_dispatch_receivers() {
+    struct plugin_registry *registry;
+    char channel[64];
+    int counts[100] = { 0 };
+    int ok;
+
+    registry = plugin_registry_new(NULL);
+    TEST_ASSERT_NOT_NULL(registry);
+
+    for (size_t i = 0; i < ARRAY_SIZE(counts); i++) {
+        get_channel_name(channel, sizeof channel, i);
+
+        ok = plugin_registry_set_receiver_v2(registry, channel, on_message, counts + i);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(counts); i++) {
+        get_channel_name(channel, sizeof channel, i);
+
+        FlutterPlatformMessage message = make_message(channel);
+        for (size_t j = 0; j <= i; j++) {
+            ok = plugin_registry_on_platform_message(registry, &message);
+            TEST_ASSERT_EQUAL_INT(0, ok);
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(counts); i++) {
+        TEST_ASSERT_EQUAL_INT(i + 1, counts[i]);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(counts); i++) {
+        get_channel_name(channel, sizeof channel, i);
+
+        ok = plugin_registry_remove_receiver_v2(registry, channel);
+        TEST_ASSERT_EQUAL_INT(0, ok);
+    }
+
+    plugin_registry_destroy(registry);
+}
+
+void test_replace_and_remove_receiver() {
+    struct plugin_registry *registry;
+    int count_a = 0, count_b = 0;
+    int ok;
+
+    registry = plugin_registry_new(NULL);
+    TEST_ASSERT_NOT_NULL(registry);
+
+    FlutterPlatformMessage message = make_message("test/channel");
+
+    ok = plugin_registry_set_receiver_v2(registry, "test/channel", on_message, &count_a);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    plugin_registry_on_platform_message(registry, &message);
+    TEST_ASSERT_EQUAL_INT(1, count_a);
+
+    ok = plugin_registry_set_receiver_v2(registry, "test/channel", on_message, &count_b);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    plugin_registry_on_platform_message(registry, &message);
+    TEST_ASSERT_EQUAL_INT(1, count_a);
+    TEST_ASSERT_EQUAL_INT(1, count_b);
+
+    ok = plugin_registry_remove_receiver_v2(registry, "test/channel");
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    ok = plugin_registry_remove_receiver_v2(registry, "test/channel");
+    TEST_ASSERT_EQUAL_INT(EINVAL, ok);
+
+    plugin_registry_destroy(registry);
+}
+
+/**
+ * Measures the cost of dispatching a platform message to a receiver, depending
+ * on the number of registered receivers. Only checks that every message was delivered,
+ * the timings are just printed.
+ */
+void test_benchmark_dispatch() {
+    struct plugin_registry *registry;
+    char channel[64];
+    uint64_t start, end;
+    int count;
+    int ok;
+
+    for (size_t i = 0; i < ARRAY_SIZE(benchmark_channel_counts); i++) {
+        size_t n_channels = benchmark_channel_counts[i];
+
+        registry = plugin_registry_new(NULL);
+        TEST_ASSERT_NOT_NULL(registry);
+
+        count = 0;
+        for (size_t j = 0; j < n_channels; j++) {
+            get_channel_name(channel, sizeof channel, j);
+
+            ok = plugin_registry_set_receiver_v2(registry, channel, on_message, &count);
+            TEST_ASSERT_EQUAL_INT(0, ok);
+        }
+
+        // dispatch to the last registered channel, that's the worst case for a list.
+        get_channel_name(channel, sizeof channel, n_channels - 1);
+        FlutterPlatformMessage message = make_message(channel);
+
+        start = get_monotonic_time();
+        for (size_t j = 0; j < N_BENCHMARK_MESSAGES; j++) {
+            plugin_registry_on_platform_message(registry, &message);
+        }
+        end = get_monotonic_time();
+
+        TEST_ASSERT_EQUAL_INT(N_BENCHMARK_MESSAGES, count);
+
+        printf(
+            "dispatch with %4zu registered channels: %6.1f ns/message\n",
+            n_channels,
+            (double) (end - start) / N_BENCHMARK_MESSAGES
+        );
+
+        for (size_t j = 0; j < n_channels; j++) {
+            get_channel_name(channel, sizeof channel, j);
+            plugin_registry_remove_receiver_v2(registry, channel);
+        }
+
+        plugin_registry_destroy(registry);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_set_and_dispatch_receivers);
+    RUN_TEST(test_replace_and_remove_receiver);
+    RUN_TEST(test_benchmark_dispatch);
+
+    return UNITY_END();
+}
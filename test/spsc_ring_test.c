@@ -0,0 +1,123 @@
+#include "util/spsc_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <unity.h>
+
+#define N_STRESS_ELEMENTS 1000000
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_push_pop() {
+    struct spsc_ring ring;
+    uint32_t value;
+
+    TEST_ASSERT_EQUAL_INT(0, spsc_ring_init(&ring, sizeof(uint32_t), 4));
+
+    TEST_ASSERT_FALSE(spsc_ring_pop(&ring, &value));
+
+    for (uint32_t i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(spsc_ring_push(&ring, &i));
+    }
+
+    // full
+    value = 4;
+    TEST_ASSERT_FALSE(spsc_ring_push(&ring, &value));
+    TEST_ASSERT_EQUAL_size_t(4, spsc_ring_get_size(&ring));
+
+    for (uint32_t i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(spsc_ring_pop(&ring, &value));
+        TEST_ASSERT_EQUAL_UINT32(i, value);
+    }
+
+    TEST_ASSERT_FALSE(spsc_ring_pop(&ring, &value));
+    TEST_ASSERT_EQUAL_size_t(0, spsc_ring_get_size(&ring));
+
+    spsc_ring_deinit(&ring);
+}
+
+void test_peek_contiguous_wraps_around() {
+    struct spsc_ring ring;
+    uint32_t *elements, value;
+
+    TEST_ASSERT_EQUAL_INT(0, spsc_ring_init(&ring, sizeof(uint32_t), 4));
+
+    // move the read & write positions to the last slot.
+    for (uint32_t i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(spsc_ring_push(&ring, &i));
+        TEST_ASSERT_TRUE(spsc_ring_pop(&ring, &value));
+    }
+
+    for (uint32_t i = 10; i < 13; i++) {
+        TEST_ASSERT_TRUE(spsc_ring_push(&ring, &i));
+    }
+
+    // 10 is in the last slot, 11 & 12 wrapped around to the start.
+    TEST_ASSERT_EQUAL_size_t(1, spsc_ring_peek_contiguous(&ring, (void **) &elements));
+    TEST_ASSERT_EQUAL_UINT32(10, elements[0]);
+    spsc_ring_consume(&ring, 1);
+
+    TEST_ASSERT_EQUAL_size_t(2, spsc_ring_peek_contiguous(&ring, (void **) &elements));
+    TEST_ASSERT_EQUAL_UINT32(11, elements[0]);
+    TEST_ASSERT_EQUAL_UINT32(12, elements[1]);
+    spsc_ring_consume(&ring, 2);
+
+    TEST_ASSERT_EQUAL_size_t(0, spsc_ring_peek_contiguous(&ring, (void **) &elements));
+
+    spsc_ring_deinit(&ring);
+}
+
+static void *producer_entry(void *userdata) {
+    struct spsc_ring *ring = userdata;
+
+    for (uint64_t i = 0; i < N_STRESS_ELEMENTS; i++) {
+        while (!spsc_ring_push(ring, &i)) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+void test_producer_and_consumer_threads() {
+    struct spsc_ring ring;
+    uint64_t *elements, expected;
+    pthread_t producer;
+    size_t n;
+
+    TEST_ASSERT_EQUAL_INT(0, spsc_ring_init(&ring, sizeof(uint64_t), 64));
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&producer, NULL, producer_entry, &ring));
+
+    // every element must arrive exactly once, in order.
+    expected = 0;
+    while (expected < N_STRESS_ELEMENTS) {
+        n = spsc_ring_peek_contiguous(&ring, (void **) &elements);
+        for (size_t i = 0; i < n; i++) {
+            TEST_ASSERT_EQUAL_UINT64(expected, elements[i]);
+            expected++;
+        }
+        spsc_ring_consume(&ring, n);
+    }
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_join(producer, NULL));
+    TEST_ASSERT_EQUAL_size_t(0, spsc_ring_get_size(&ring));
+
+    spsc_ring_deinit(&ring);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_push_pop);
+    RUN_TEST(test_peek_contiguous_wraps_around);
+    RUN_TEST(test_producer_and_consumer_threads);
+
+    return UNITY_END();
+}
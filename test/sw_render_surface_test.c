@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "sw_render_surface.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <flutter_embedder.h>
+
+#include "render_surface.h"
+#include "surface.h"
+#include "tracer.h"
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_BENCHMARK_FRAMES 120
+
+static struct tracer *tracer;
+
+// required by Unity.
+void setUp() {
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+}
+
+void tearDown() {
+    tracer_unref(tracer);
+}
+
+static void fill(struct sw_render_surface *s, FlutterBackingStore *store) {
+    memset(store, 0, sizeof *store);
+    store->struct_size = sizeof *store;
+    TEST_ASSERT_EQUAL_INT(0, render_surface_fill(CAST_RENDER_SURFACE(s), store));
+}
+
+static void collect(FlutterBackingStore *store) {
+    store->software2.destruction_callback(store->software2.user_data);
+}
+
+void test_convert_pixels() {
+    // A = 0x80, R = 0xFF, G = 0x80, B = 0x40
+    static const uint32_t pixel = 0x80FF8040;
+    static const struct {
+        enum pixfmt format;
+        uint32_t expected;
+    } cases[] = {
+        { PIXFMT_RGB565, 0xFC08 },       { PIXFMT_ARGB1555, 0xFE08 },     { PIXFMT_XRGB1555, 0x7E08 },
+        { PIXFMT_ARGB4444, 0x8F84 },     { PIXFMT_XRGB4444, 0x0F84 },     { PIXFMT_ARGB8888, 0x80FF8040 },
+        { PIXFMT_XRGB8888, 0x80FF8040 }, { PIXFMT_BGRA8888, 0x4080FF80 }, { PIXFMT_BGRX8888, 0x4080FF80 },
+        { PIXFMT_RGBA8888, 0xFF804080 }, { PIXFMT_RGBX8888, 0xFF804080 },
+    };
+
+    // 13 pixels wide, so both the vectorized part and the remainder of each row are used.
+    // The destination has some padding at the end of each row that must be left alone.
+    uint32_t src[2][16];
+    uint8_t dst[2][64];
+
+    for (int i = 0; i < 16; i++) {
+        src[0][i] = pixel;
+        src[1][i] = pixel;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+        int bytes_per_pixel = get_pixfmt_info(cases[i].format)->bits_per_pixel / 8;
+
+        memset(dst, 0xAB, sizeof dst);
+        sw_render_surface_convert_pixels(cases[i].format, dst, sizeof dst[0], src, sizeof src[0], VEC2I(13, 2));
+
+        for (int y = 0; y < 2; y++) {
+            for (int x = 0; x < 13; x++) {
+                uint32_t actual;
+
+                if (bytes_per_pixel == 2) {
+                    uint16_t value;
+                    memcpy(&value, dst[y] + x * 2, 2);
+                    actual = value;
+                } else {
+                    memcpy(&actual, dst[y] + x * 4, 4);
+                }
+
+                TEST_ASSERT_EQUAL_HEX32_MESSAGE(cases[i].expected, actual, get_pixfmt_info(cases[i].format)->name);
+            }
+
+            TEST_ASSERT_EACH_EQUAL_UINT8(0xAB, dst[y] + 13 * bytes_per_pixel, sizeof dst[y] - 13 * bytes_per_pixel);
+        }
+    }
+}
+
+void test_fill_and_present_headless() {
+    FlutterBackingStore stores[SW_RENDER_SURFACE_MAX_BUFFERS + 1];
+    struct sw_render_surface *s;
+    int64_t revision;
+
+    s = sw_render_surface_new_headless(tracer, VEC2I(64, 32));
+    TEST_ASSERT_NOT_NULL(s);
+
+    fill(s, stores + 0);
+    TEST_ASSERT_EQUAL_INT(kFlutterBackingStoreTypeSoftware2, stores[0].type);
+    TEST_ASSERT_EQUAL_INT(kFlutterSoftwarePixelFormatBGRA8888, stores[0].software2.pixel_format);
+    TEST_ASSERT_EQUAL_size_t(64 * 4, stores[0].software2.row_bytes);
+    TEST_ASSERT_EQUAL_size_t(32, stores[0].software2.height);
+    TEST_ASSERT_NOT_NULL(stores[0].software2.allocation);
+
+    // Every backing store gets its own buffer.
+    fill(s, stores + 1);
+    TEST_ASSERT_TRUE(stores[0].software2.allocation != stores[1].software2.allocation);
+
+    revision = surface_get_revision(CAST_SURFACE(s));
+    stores[0].did_update = true;
+    TEST_ASSERT_EQUAL_INT(0, render_surface_queue_present(CAST_RENDER_SURFACE(s), stores + 0));
+    TEST_ASSERT_TRUE(surface_get_revision(CAST_SURFACE(s)) > revision);
+
+    // Presenting the front buffer again without an update is not a new revision.
+    revision = surface_get_revision(CAST_SURFACE(s));
+    stores[0].did_update = false;
+    TEST_ASSERT_EQUAL_INT(0, render_surface_queue_present(CAST_RENDER_SURFACE(s), stores + 0));
+    TEST_ASSERT_EQUAL_INT64(revision, surface_get_revision(CAST_SURFACE(s)));
+
+    collect(stores + 0);
+    collect(stores + 1);
+
+    // The front buffer stays locked, all others can be filled again.
+    for (int i = 0; i < SW_RENDER_SURFACE_MAX_BUFFERS - 1; i++) {
+        fill(s, stores + i);
+    }
+
+    memset(stores + SW_RENDER_SURFACE_MAX_BUFFERS, 0, sizeof(FlutterBackingStore));
+    TEST_ASSERT_EQUAL_INT(EBUSY, render_surface_fill(CAST_RENDER_SURFACE(s), stores + SW_RENDER_SURFACE_MAX_BUFFERS));
+
+    for (int i = 0; i < SW_RENDER_SURFACE_MAX_BUFFERS - 1; i++) {
+        collect(stores + i);
+    }
+
+    surface_unref(CAST_SURFACE(s));
+}
+
+void test_present_unknown_allocation() {
+    struct sw_render_surface *s;
+    FlutterBackingStore store;
+    uint8_t pixels[16];
+
+    s = sw_render_surface_new_headless(tracer, VEC2I(2, 2));
+    TEST_ASSERT_NOT_NULL(s);
+
+    memset(&store, 0, sizeof store);
+    store.type = kFlutterBackingStoreTypeSoftware2;
+    store.software2.allocation = pixels;
+    store.did_update = true;
+    TEST_ASSERT_EQUAL_INT(EINVAL, render_surface_queue_present(CAST_RENDER_SURFACE(s), &store));
+
+    surface_unref(CAST_SURFACE(s));
+}
+
+static double get_fps(uint64_t start_ns, int n_frames) {
+    return n_frames / ((double) (get_monotonic_time() - start_ns) / 1e9);
+}
+
+void test_benchmark_frames_per_second() {
+    static const struct {
+        const char *name;
+        struct vec2i size;
+    } resolutions[] = {
+        { "720p", { 1280, 720 } },
+        { "1080p", { 1920, 1080 } },
+    };
+    static const enum pixfmt formats[] = { PIXFMT_XRGB8888, PIXFMT_RGB565, PIXFMT_BGRX8888, PIXFMT_ARGB1555 };
+
+    for (int i = 0; i < ARRAY_SIZE(resolutions); i++) {
+        struct vec2i size = resolutions[i].size;
+        struct sw_render_surface *s;
+        FlutterBackingStore store;
+        uint64_t start;
+        uint32_t *src;
+        uint8_t *dst;
+
+        s = sw_render_surface_new_headless(tracer, size);
+        TEST_ASSERT_NOT_NULL(s);
+
+        // fill, clear the whole buffer (like flutter would) and present.
+        start = get_monotonic_time();
+        for (int frame = 0; frame < N_BENCHMARK_FRAMES; frame++) {
+            fill(s, &store);
+            memset((void *) store.software2.allocation, frame, store.software2.row_bytes * store.software2.height);
+            store.did_update = true;
+            TEST_ASSERT_EQUAL_INT(0, render_surface_queue_present(CAST_RENDER_SURFACE(s), &store));
+            collect(&store);
+        }
+        printf("%s headless: %.1f frames/s\n", resolutions[i].name, get_fps(start, N_BENCHMARK_FRAMES));
+
+        surface_unref(CAST_SURFACE(s));
+
+        // The copy into the scanout buffer for each plane format.
+        src = malloc((size_t) size.x * size.y * 4);
+        TEST_ASSERT_NOT_NULL(src);
+        for (int j = 0; j < size.x * size.y; j++) {
+            src[j] = 0xFF000000 | (j * 2654435761u >> 8);
+        }
+
+        dst = malloc((size_t) size.x * size.y * 4);
+        TEST_ASSERT_NOT_NULL(dst);
+
+        for (int j = 0; j < ARRAY_SIZE(formats); j++) {
+            size_t pitch = (size_t) size.x * get_pixfmt_info(formats[j])->bits_per_pixel / 8;
+
+            start = get_monotonic_time();
+            for (int frame = 0; frame < N_BENCHMARK_FRAMES; frame++) {
+                sw_render_surface_convert_pixels(formats[j], dst, pitch, src, (size_t) size.x * 4, size);
+            }
+            printf(
+                "%s ARGB8888 -> %s: %.1f frames/s\n",
+                resolutions[i].name,
+                get_pixfmt_info(formats[j])->arg_name,
+                get_fps(start, N_BENCHMARK_FRAMES)
+            );
+        }
+
+        free(dst);
+        free(src);
+    }
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_convert_pixels);
+    RUN_TEST(test_fill_and_present_headless);
+    RUN_TEST(test_present_unknown_allocation);
+    RUN_TEST(test_benchmark_frames_per_second);
+
+    return UNITY_END();
+}
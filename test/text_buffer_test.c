@@ -0,0 +1,149 @@
+#include "text_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unity.h>
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static int replace(struct text_buffer *buffer, size_t start, size_t end, const char *text) {
+    return text_buffer_replace(buffer, start, end, text, strlen(text));
+}
+
+void test_empty_buffer() {
+    struct text_buffer buffer = { 0 };
+
+    TEST_ASSERT_EQUAL_STRING("", text_buffer_get_text(&buffer));
+    TEST_ASSERT_EQUAL_size_t(0, text_buffer_get_length(&buffer));
+    TEST_ASSERT_EQUAL_size_t(0, text_buffer_get_prev_boundary(&buffer, 0));
+    TEST_ASSERT_EQUAL_size_t(0, text_buffer_get_next_boundary(&buffer, 0));
+
+    text_buffer_deinit(&buffer);
+}
+
+void test_edit_at_different_positions() {
+    struct text_buffer buffer;
+
+    text_buffer_init(&buffer);
+
+    TEST_ASSERT_EQUAL_INT(0, text_buffer_set_text(&buffer, "hello world", 11));
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 5, 5, ","));
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 0, 1, "H"));
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 12, 12, "!"));
+    TEST_ASSERT_EQUAL_STRING("Hello, world!", text_buffer_get_text(&buffer));
+    TEST_ASSERT_EQUAL_size_t(13, text_buffer_get_length(&buffer));
+
+    // reversed and out-of-bounds ranges
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 7, 5, ""));
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 100, 200, "?"));
+    TEST_ASSERT_EQUAL_STRING("Helloworld!?", text_buffer_get_text(&buffer));
+
+    text_buffer_deinit(&buffer);
+}
+
+void test_offsets_are_utf16() {
+    struct text_buffer buffer;
+
+    text_buffer_init(&buffer);
+
+    // "a", "ä" (2 bytes, 1 unit), "😀" (4 bytes, 2 units), "b"
+    TEST_ASSERT_EQUAL_INT(0, text_buffer_set_text(&buffer, "a\xC3\xA4\xF0\x9F\x98\x80" "b", 8));
+    TEST_ASSERT_EQUAL_size_t(5, text_buffer_get_length(&buffer));
+
+    TEST_ASSERT_EQUAL_size_t(4, text_buffer_get_prev_boundary(&buffer, 5));
+    TEST_ASSERT_EQUAL_size_t(2, text_buffer_get_prev_boundary(&buffer, 4));
+    TEST_ASSERT_EQUAL_size_t(1, text_buffer_get_prev_boundary(&buffer, 2));
+    TEST_ASSERT_EQUAL_size_t(4, text_buffer_get_next_boundary(&buffer, 2));
+    TEST_ASSERT_EQUAL_size_t(5, text_buffer_get_next_boundary(&buffer, 4));
+
+    // inserting in the middle of the surrogate pair inserts before it.
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 3, 3, "x"));
+    TEST_ASSERT_EQUAL_STRING("a\xC3\xA4x\xF0\x9F\x98\x80" "b", text_buffer_get_text(&buffer));
+
+    // deleting the emoji.
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 3, 5, ""));
+    TEST_ASSERT_EQUAL_STRING("a\xC3\xA4xb", text_buffer_get_text(&buffer));
+    TEST_ASSERT_EQUAL_size_t(4, text_buffer_get_length(&buffer));
+
+    text_buffer_deinit(&buffer);
+}
+
+void test_large_text() {
+    struct text_buffer buffer;
+    const char *text;
+    char *expected;
+
+    text_buffer_init(&buffer);
+
+    // more than the old 8192 character limit, typed from the end to the start.
+    for (int i = 0; i < 20000; i++) {
+        TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 0, 0, i % 2 ? "b" : "\xC3\xA4"));
+    }
+    TEST_ASSERT_EQUAL_size_t(20000, text_buffer_get_length(&buffer));
+
+    expected = malloc(30001);
+    TEST_ASSERT_NOT_NULL(expected);
+    for (int i = 0, j = 0; i < 20000; i++) {
+        if ((19999 - i) % 2) {
+            expected[j++] = 'b';
+        } else {
+            expected[j++] = '\xC3';
+            expected[j++] = '\xA4';
+        }
+        expected[j] = '\0';
+    }
+
+    text = text_buffer_get_text(&buffer);
+    TEST_ASSERT_EQUAL_STRING(expected, text);
+
+    // delete every second character from the middle, which are all "b"s.
+    for (int i = 0; i < 1000; i++) {
+        TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 10000 + i, 10000 + i + 1, ""));
+    }
+    TEST_ASSERT_EQUAL_size_t(19000, text_buffer_get_length(&buffer));
+    TEST_ASSERT_EQUAL_size_t(29000, strlen(text_buffer_get_text(&buffer)));
+
+    free(expected);
+    text_buffer_deinit(&buffer);
+}
+
+void test_segments_dont_move_the_gap() {
+    struct text_buffer buffer = { 0 };
+    const char *before, *after;
+    size_t before_length, after_length, gap_start;
+
+    text_buffer_get_segments(&buffer, &before, &before_length, &after, &after_length);
+    TEST_ASSERT_EQUAL_size_t(0, before_length);
+    TEST_ASSERT_EQUAL_size_t(0, after_length);
+
+    TEST_ASSERT_EQUAL_INT(0, text_buffer_set_text(&buffer, "hello world", 11));
+    TEST_ASSERT_EQUAL_INT(0, replace(&buffer, 5, 5, ","));
+    gap_start = buffer.gap_start;
+
+    text_buffer_get_segments(&buffer, &before, &before_length, &after, &after_length);
+    TEST_ASSERT_EQUAL_size_t(gap_start, buffer.gap_start);
+    TEST_ASSERT_EQUAL_size_t(6, before_length);
+    TEST_ASSERT_EQUAL_MEMORY("hello,", before, 6);
+    TEST_ASSERT_EQUAL_size_t(6, after_length);
+    TEST_ASSERT_EQUAL_MEMORY(" world", after, 6);
+
+    text_buffer_deinit(&buffer);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_empty_buffer);
+    RUN_TEST(test_edit_at_different_positions);
+    RUN_TEST(test_offsets_are_utf16);
+    RUN_TEST(test_large_text);
+    RUN_TEST(test_segments_dont_move_the_gap);
+
+    return UNITY_END();
+}
@@ -0,0 +1,120 @@
+#include "touch_resampler.h"
+
+#include <unity.h>
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static struct touch_sample sample(uint64_t timestamp_us, float x, float y) {
+    return (struct touch_sample){ .timestamp_us = timestamp_us, .pos = VEC2F(x, y) };
+}
+
+void test_coalesces_pending_samples() {
+    struct touch_resampler r;
+    struct touch_sample taken;
+
+    touch_resampler_reset(&r, sample(1000, 0, 0));
+    TEST_ASSERT_FALSE(touch_resampler_has_pending(&r));
+
+    touch_resampler_add_sample(&r, sample(2000, 1, 0));
+    touch_resampler_add_sample(&r, sample(3000, 2, 0));
+    touch_resampler_add_sample(&r, sample(4000, 3, 0));
+    TEST_ASSERT_TRUE(touch_resampler_has_pending(&r));
+
+    // without resampling, only the latest sample comes out.
+    taken = touch_resampler_take(&r, false, 0);
+    TEST_ASSERT_EQUAL_UINT64(4000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(3, taken.pos.x);
+    TEST_ASSERT_FALSE(touch_resampler_has_pending(&r));
+}
+
+void test_interpolates_then_takes_latest() {
+    struct touch_resampler r;
+    struct touch_sample taken;
+
+    touch_resampler_reset(&r, sample(0, 0, 0));
+    touch_resampler_add_sample(&r, sample(8000, 8, 0));
+    touch_resampler_add_sample(&r, sample(16000, 16, 4));
+
+    taken = touch_resampler_take(&r, true, 12000);
+    TEST_ASSERT_EQUAL_UINT64(12000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(12, taken.pos.x);
+    TEST_ASSERT_EQUAL_FLOAT(2, taken.pos.y);
+
+    // the latest sample wasn't reached yet, so it's still pending,
+    // and comes out as-is instead of being extrapolated.
+    TEST_ASSERT_TRUE(touch_resampler_has_pending(&r));
+    taken = touch_resampler_take(&r, true, 30000);
+    TEST_ASSERT_EQUAL_UINT64(16000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(16, taken.pos.x);
+    TEST_ASSERT_FALSE(touch_resampler_has_pending(&r));
+}
+
+void test_extrapolation_is_limited() {
+    struct touch_resampler r;
+    struct touch_sample taken;
+
+    touch_resampler_reset(&r, sample(0, 0, 0));
+    touch_resampler_add_sample(&r, sample(4000, 0, 0));
+    touch_resampler_add_sample(&r, sample(8000, 4, 0));
+
+    // at most half the sample interval into the future.
+    taken = touch_resampler_take(&r, true, 20000);
+    TEST_ASSERT_EQUAL_UINT64(10000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(6, taken.pos.x);
+    TEST_ASSERT_FALSE(touch_resampler_has_pending(&r));
+
+    // samples too far apart aren't extrapolated from.
+    touch_resampler_add_sample(&r, sample(40000, 10, 0));
+    taken = touch_resampler_take(&r, true, 45000);
+    TEST_ASSERT_EQUAL_UINT64(40000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(10, taken.pos.x);
+}
+
+void test_timestamps_never_go_backwards() {
+    struct touch_resampler r;
+    struct touch_sample taken;
+
+    touch_resampler_reset(&r, sample(0, 0, 0));
+    touch_resampler_add_sample(&r, sample(4000, 4, 0));
+    touch_resampler_add_sample(&r, sample(8000, 8, 0));
+
+    // extrapolated to 10000.
+    taken = touch_resampler_take(&r, true, 12000);
+    TEST_ASSERT_EQUAL_UINT64(10000, taken.timestamp_us);
+
+    // the next sample arrives earlier than the extrapolated one.
+    touch_resampler_add_sample(&r, sample(9000, 9, 0));
+    taken = touch_resampler_take(&r, false, 0);
+    TEST_ASSERT_EQUAL_UINT64(10000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(9, taken.pos.x);
+}
+
+void test_single_sample_is_not_resampled() {
+    struct touch_resampler r;
+    struct touch_sample taken;
+
+    // only the down position is known, nothing to interpolate with.
+    touch_resampler_reset(&r, sample(1000, 5, 5));
+    touch_resampler_add_sample(&r, sample(1000, 6, 6));
+
+    taken = touch_resampler_take(&r, true, 5000);
+    TEST_ASSERT_EQUAL_UINT64(1000, taken.timestamp_us);
+    TEST_ASSERT_EQUAL_FLOAT(6, taken.pos.x);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_coalesces_pending_samples);
+    RUN_TEST(test_interpolates_then_takes_latest);
+    RUN_TEST(test_extrapolation_is_limited);
+    RUN_TEST(test_timestamps_never_go_backwards);
+    RUN_TEST(test_single_sample_is_not_resampled);
+
+    return UNITY_END();
+}
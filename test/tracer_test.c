@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include "tracer.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/collection.h"
+
+#include <unity.h>
+
+#define N_BENCHMARK_EVENTS 1000000
+
+// required by Unity.
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static char *export_to_string(struct tracer *tracer, enum tracer_export_format format, size_t *size_out) {
+    char *data;
+    size_t size;
+    FILE *file;
+    int ok;
+
+    file = open_memstream(&data, &size);
+    TEST_ASSERT_NOT_NULL(file);
+
+    ok = tracer_export(tracer, format, file);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+
+    fclose(file);
+
+    if (size_out != NULL) {
+        *size_out = size;
+    }
+    return data;
+}
+
+static size_t count_occurrences(const char *haystack, const char *needle) {
+    size_t n = 0;
+
+    for (const char *pos = strstr(haystack, needle); pos != NULL; pos = strstr(pos + 1, needle)) {
+        n++;
+    }
+
+    return n;
+}
+
+void test_events_are_only_recorded_while_recording() {
+    struct tracer *tracer;
+    char *json;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    __tracer_record(tracer, kInstant_TraceEventType, "not_recorded");
+
+    tracer_start_recording(tracer);
+    TEST_ASSERT_TRUE(tracer_is_recording(tracer));
+
+    __tracer_record(tracer, kBegin_TraceEventType, "slice");
+    __tracer_record(tracer, kInstant_TraceEventType, "instant \"quoted\"");
+    __tracer_record(tracer, kEnd_TraceEventType, "slice");
+
+    tracer_stop_recording(tracer);
+    __tracer_record(tracer, kInstant_TraceEventType, "not_recorded");
+
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+
+    TEST_ASSERT_EQUAL_INT(0, count_occurrences(json, "not_recorded"));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"ph\":\"B\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"ph\":\"E\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"ph\":\"i\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"instant \\\"quoted\\\"\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"thread_name\""));
+
+    free(json);
+    tracer_unref(tracer);
+}
+
+static void *record_on_thread(void *userdata) {
+    struct tracer *tracer = userdata;
+
+    pthread_setname_np(pthread_self(), "tracer-test");
+    __tracer_record(tracer, kInstant_TraceEventType, "from_thread");
+    return NULL;
+}
+
+void test_every_thread_gets_its_own_buffer() {
+    struct tracer *tracer;
+    pthread_t thread;
+    char *json;
+    int ok;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+
+    __tracer_record(tracer, kInstant_TraceEventType, "from_main");
+
+    ok = pthread_create(&thread, NULL, record_on_thread, tracer);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    pthread_join(thread, NULL);
+
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+
+    TEST_ASSERT_EQUAL_INT(2, count_occurrences(json, "\"thread_name\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"tracer-test\""));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "from_main"));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "from_thread"));
+
+    free(json);
+    tracer_unref(tracer);
+}
+
+void test_exited_thread_buffer_is_released_after_export() {
+    struct tracer *tracer;
+    pthread_t thread;
+    char *json;
+    int ok;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+
+    __tracer_record(tracer, kInstant_TraceEventType, "from_main");
+
+    ok = pthread_create(&thread, NULL, record_on_thread, tracer);
+    TEST_ASSERT_EQUAL_INT(0, ok);
+    pthread_join(thread, NULL);
+
+    // The events of the exited thread are kept until they've been exported once.
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "from_thread"));
+    free(json);
+
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "\"thread_name\""));
+    TEST_ASSERT_EQUAL_INT(0, count_occurrences(json, "from_thread"));
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "from_main"));
+    free(json);
+
+    tracer_unref(tracer);
+}
+
+void test_interned_names_outlive_the_caller() {
+    struct tracer *tracer;
+    const char *interned;
+    char *name, *json;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+
+    name = strdup("dynamic_name");
+    TEST_ASSERT_NOT_NULL(name);
+
+    interned = tracer_intern_name(tracer, name);
+    TEST_ASSERT_NOT_NULL(interned);
+    TEST_ASSERT_TRUE(interned != name);
+    TEST_ASSERT_TRUE(interned == tracer_intern_name(tracer, "dynamic_name"));
+
+    __tracer_record(tracer, kInstant_TraceEventType, interned);
+
+    memset(name, 'x', strlen(name));
+    free(name);
+
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+    TEST_ASSERT_EQUAL_INT(1, count_occurrences(json, "dynamic_name"));
+
+    free(json);
+    tracer_unref(tracer);
+}
+
+void test_ring_buffer_keeps_newest_events() {
+    struct tracer *tracer;
+    char *json;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+
+    __tracer_record(tracer, kInstant_TraceEventType, "oldest");
+    for (int i = 0; i < TRACER_N_EVENTS_PER_THREAD; i++) {
+        __tracer_record(tracer, kInstant_TraceEventType, "newer");
+    }
+
+    json = export_to_string(tracer, kChromeJson_TracerExportFormat, NULL);
+
+    // The oldest event still in the buffer is the next one to be overwritten,
+    // so the exporter discards it too.
+    TEST_ASSERT_EQUAL_INT(0, count_occurrences(json, "oldest"));
+    TEST_ASSERT_EQUAL_INT(TRACER_N_EVENTS_PER_THREAD - 1, count_occurrences(json, "\"newer\""));
+
+    free(json);
+    tracer_unref(tracer);
+}
+
+void test_perfetto_export() {
+    struct tracer *tracer;
+    size_t size;
+    char *data;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+    __tracer_record(tracer, kBegin_TraceEventType, "perfetto_slice");
+    __tracer_record(tracer, kEnd_TraceEventType, "perfetto_slice");
+
+    data = export_to_string(tracer, kPerfetto_TracerExportFormat, &size);
+
+    // 1 track descriptor packet + 2 track event packets, each a length-delimited field 1 of the Trace message.
+    TEST_ASSERT_TRUE(size > 0);
+    TEST_ASSERT_EQUAL_HEX8(0x0A, data[0]);
+    TEST_ASSERT_NOT_NULL(memmem(data, size, "perfetto_slice", strlen("perfetto_slice")));
+
+    free(data);
+    tracer_unref(tracer);
+}
+
+void test_recording_cost() {
+    struct tracer *tracer;
+    uint64_t start, duration;
+
+    tracer = tracer_new_with_stubs();
+    TEST_ASSERT_NOT_NULL(tracer);
+
+    tracer_start_recording(tracer);
+
+    start = get_monotonic_time();
+    for (int i = 0; i < N_BENCHMARK_EVENTS; i++) {
+        __tracer_record(tracer, kInstant_TraceEventType, "benchmark");
+    }
+    duration = get_monotonic_time() - start;
+
+    printf("recording an event takes %.1f ns\n", (double) duration / N_BENCHMARK_EVENTS);
+
+    // Very generous bound, so this doesn't flake on loaded CI machines or with sanitizers.
+    TEST_ASSERT_LESS_THAN_UINT64(1000ull * N_BENCHMARK_EVENTS, duration);
+
+    tracer_unref(tracer);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_events_are_only_recorded_while_recording);
+    RUN_TEST(test_every_thread_gets_its_own_buffer);
+    RUN_TEST(test_exited_thread_buffer_is_released_after_export);
+    RUN_TEST(test_interned_names_outlive_the_caller);
+    RUN_TEST(test_ring_buffer_keeps_newest_events);
+    RUN_TEST(test_perfetto_export);
+    RUN_TEST(test_recording_cost);
+
+    return UNITY_END();
+}
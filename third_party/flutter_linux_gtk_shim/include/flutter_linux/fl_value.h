@@ -8,12 +8,13 @@
 
 G_BEGIN_DECLS
 
-#define fl_value_get_type fl_value_get_gtype
-G_DECLARE_FINAL_TYPE(FlValue, fl_value, FL, VALUE, GObject)
-#undef fl_value_get_type
+// Like upstream flutter_linux, FlValue is a plain refcounted struct, not a GObject.
+// Use fl_value_ref / fl_value_unref, never g_object_ref / g_object_unref.
+typedef struct _FlValue FlValue;
 
-#undef FL_TYPE_VALUE
+// Boxed GType for FlValue, so it can still be used in GValues / signals.
 #define FL_TYPE_VALUE (fl_value_get_gtype())
+#define FL_VALUE(obj) ((FlValue *) (obj))
 
 GType fl_value_get_gtype(void);
 
@@ -49,6 +50,8 @@ FlValue *fl_value_new_map(void);
 FlValue *fl_value_ref(FlValue *value);
 void fl_value_unref(FlValue *value);
 
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(FlValue, fl_value_unref)
+
 // Accessors
 const gchar *fl_value_get_string(FlValue *value);
 int64_t fl_value_get_int(FlValue *value);